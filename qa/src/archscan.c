@@ -0,0 +1,446 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * Archive read throughput benchmark ... optionally generate an archive
+ * of (at least) a given size with libpcp_import, then read every record
+ * with pmFetchArchive(), forwards and optionally backwards as well,
+ * and optionally time random positioning with pmSetMode() (checking
+ * each one lands on the right record) or fetching just a few metrics
+ * with pmFetch() (to compare with and without a columnar sidecar).
+ * Optionally truncate the data volume part way through a forward scan,
+ * which must end the scan cleanly, not with SIGBUS from a mapping.
+ *
+ * Deterministic results (record and value counts) go to stdout, timing
+ * to stderr.
+ */
+
+#include <pcp/pmapi.h>
+#include <pcp/import.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#define NMETRIC	20
+#define NINST	10
+
+static void
+generate(const char *archive, long mbytes)
+{
+    char	name[MAXPATHLEN];
+    char	inst[16];
+    int		hdl[NMETRIC][NINST];
+    int		m, i, sts;
+    long	nrec = 0;
+    struct stat	sbuf;
+    pmInDom	indom = pmInDom_build(245, 1);
+
+    if ((sts = pmiStart(archive, 0)) < 0) {
+	fprintf(stderr, "pmiStart(%s): %s\n", archive, pmiErrStr(sts));
+	exit(1);
+    }
+    pmiSetHostname("archscan.example.com");
+    pmiSetTimezone("UTC");
+    for (i = 0; i < NINST; i++) {
+	pmsprintf(inst, sizeof(inst), "inst%02d", i);
+	pmiAddInstance(indom, inst, i);
+    }
+    for (m = 0; m < NMETRIC; m++) {
+	pmsprintf(name, sizeof(name), "archscan.m%02d", m);
+	sts = pmiAddMetric(name, pmID_build(245, 0, m), PM_TYPE_U64, indom,
+			PM_SEM_COUNTER, pmiUnits(0, 0, 1, 0, 0, PM_COUNT_ONE));
+	if (sts < 0) {
+	    fprintf(stderr, "pmiAddMetric(%s): %s\n", name, pmiErrStr(sts));
+	    exit(1);
+	}
+	for (i = 0; i < NINST; i++) {
+	    pmsprintf(inst, sizeof(inst), "inst%02d", i);
+	    if ((hdl[m][i] = pmiGetHandle(name, inst)) < 0) {
+		fprintf(stderr, "pmiGetHandle(%s, %s): %s\n",
+			name, inst, pmiErrStr(hdl[m][i]));
+		exit(1);
+	    }
+	}
+    }
+
+    pmsprintf(name, sizeof(name), "%s.0", archive);
+    for ( ; ; ) {
+	for (m = 0; m < NMETRIC; m++) {
+	    for (i = 0; i < NINST; i++) {
+		pmsprintf(inst, sizeof(inst), "%ld", nrec * (m + 1) + i);
+		pmiPutValueHandle(hdl[m][i], inst);
+	    }
+	}
+	if ((sts = pmiWrite(1500000000 + nrec, 0)) < 0) {
+	    fprintf(stderr, "pmiWrite: %s\n", pmiErrStr(sts));
+	    exit(1);
+	}
+	nrec++;
+	/* check the size now and then, the data volume is buffered */
+	if (nrec % 1000 == 0 && stat(name, &sbuf) == 0 &&
+	    sbuf.st_size >= mbytes * 1024 * 1024)
+	    break;
+	if (mbytes == 0 && nrec == 100)
+	    break;
+    }
+    pmiEnd();
+    printf("generated %ld records\n", nrec);
+}
+
+static struct timeval	*stamps;	/* record timestamps, forward scan */
+static long		nstamps;
+static char		**metrics;	/* -m, pmFetch() these instead */
+static int		nmetrics;
+static char		*instance;	/* -i, instance profile for -m */
+static pmID		*pmids;
+
+/* -m and -i setup for the current context */
+static void
+lookup(void)
+{
+    pmDesc	desc;
+    int		inst;
+    int		sts;
+
+    if (pmids == NULL &&
+	(pmids = (pmID *)calloc(nmetrics, sizeof(pmID))) == NULL) {
+	fprintf(stderr, "lookup: calloc failed\n");
+	exit(1);
+    }
+    if ((sts = pmLookupName(nmetrics, metrics, pmids)) < 0) {
+	fprintf(stderr, "pmLookupName: %s\n", pmErrStr(sts));
+	exit(1);
+    }
+    if (instance != NULL) {
+	/* same instance name in the first metric's indom */
+	if ((sts = pmLookupDesc(pmids[0], &desc)) < 0 ||
+	    (inst = pmLookupInDomArchive(desc.indom, instance)) < 0) {
+	    fprintf(stderr, "instance %s: %s\n", instance, pmErrStr(sts < 0 ? sts : inst));
+	    exit(1);
+	}
+	pmDelProfile(desc.indom, 0, NULL);
+	pmAddProfile(desc.indom, 1, &inst);
+    }
+}
+
+static void
+scan(const char *archive, int mode)
+{
+    struct timeval	origin;
+    struct timeval	start, end;
+    pmLogLabel		label;
+    pmResult		*rp;
+    long		nrec = 0;
+    long		nval = 0;
+    double		elapsed;
+    struct stat		sbuf;
+    char		name[MAXPATHLEN];
+    unsigned int	sum = 0;
+    int			ctx, sts, i, j, k;
+
+    if ((ctx = pmNewContext(PM_CONTEXT_ARCHIVE, archive)) < 0) {
+	fprintf(stderr, "pmNewContext(%s): %s\n", archive, pmErrStr(ctx));
+	exit(1);
+    }
+    if (nmetrics > 0)
+	lookup();
+    if (mode == PM_MODE_BACK) {
+	if ((sts = pmGetArchiveEnd(&origin)) < 0) {
+	    fprintf(stderr, "pmGetArchiveEnd: %s\n", pmErrStr(sts));
+	    exit(1);
+	}
+    }
+    else {
+	if ((sts = pmGetArchiveLabel(&label)) < 0) {
+	    fprintf(stderr, "pmGetArchiveLabel: %s\n", pmErrStr(sts));
+	    exit(1);
+	}
+	origin = label.ll_start;
+    }
+    if ((sts = pmSetMode(mode, &origin, 0)) < 0) {
+	fprintf(stderr, "pmSetMode: %s\n", pmErrStr(sts));
+	exit(1);
+    }
+
+    gettimeofday(&start, NULL);
+    while ((sts = nmetrics > 0 ? pmFetch(nmetrics, pmids, &rp) :
+				 pmFetchArchive(&rp)) >= 0) {
+	if (mode == PM_MODE_FORW) {
+	    if ((nrec & (nrec - 1)) == 0 &&
+		(stamps = (struct timeval *)realloc(stamps,
+				(nrec ? 2 * nrec : 1) * sizeof(*stamps))) == NULL) {
+		fprintf(stderr, "scan: realloc failed\n");
+		exit(1);
+	    }
+	    stamps[nrec] = rp->timestamp;
+	    nstamps = nrec + 1;
+	}
+	nrec++;
+	for (i = 0; i < rp->numpmid; i++) {
+	    pmValueSet	*vsp = rp->vset[i];
+
+	    if (vsp->numval > 0)
+		nval += vsp->numval;
+	    if (nmetrics == 0)
+		continue;
+	    /* checksum of everything pmFetch() returned */
+	    sum = sum * 31 + rp->timestamp.tv_sec * 7 + rp->timestamp.tv_usec;
+	    sum = sum * 31 + vsp->pmid + vsp->numval;
+	    for (j = 0; j < vsp->numval; j++) {
+		sum = sum * 31 + vsp->vlist[j].inst;
+		if (vsp->valfmt == PM_VAL_INSITU)
+		    sum = sum * 31 + vsp->vlist[j].value.lval;
+		else {
+		    pmValueBlock	*vbp = vsp->vlist[j].value.pval;
+
+		    sum = sum * 31 + vbp->vtype + vbp->vlen;
+		    for (k = 0; k < vbp->vlen - PM_VAL_HDR_SIZE; k++)
+			sum = sum * 31 + (unsigned char)vbp->vbuf[k];
+		}
+	    }
+	}
+	pmFreeResult(rp);
+    }
+    gettimeofday(&end, NULL);
+    if (sts != PM_ERR_EOL) {
+	fprintf(stderr, "pmFetchArchive: %s\n", pmErrStr(sts));
+	exit(1);
+    }
+    pmDestroyContext(ctx);
+
+    printf("%s: %ld records %ld values",
+	    mode == PM_MODE_BACK ? "backward" : "forward", nrec, nval);
+    if (nmetrics > 0)
+	printf(" checksum %08x", sum);
+    putchar('\n');
+    elapsed = pmtimevalSub(&end, &start);
+    pmsprintf(name, sizeof(name), "%s.0", archive);
+    if (stat(name, &sbuf) < 0)
+	sbuf.st_size = 0;
+    fprintf(stderr, "%s: %.3f sec, %.0f records/sec, %.1f MB/sec\n",
+	    mode == PM_MODE_BACK ? "backward" : "forward", elapsed,
+	    nrec / elapsed, sbuf.st_size / elapsed / (1024 * 1024));
+}
+
+/*
+ * read a few records, then truncate the data volume beneath the open
+ * context and carry on reading ... with the data volume mapped, the
+ * next record would be in pages beyond the end of the file
+ */
+static void
+truncated(const char *archive)
+{
+    pmLogLabel		label;
+    pmResult		*rp;
+    char		name[MAXPATHLEN];
+    long		before = 0;
+    long		after = 0;
+    int			ctx, sts;
+
+    if ((ctx = pmNewContext(PM_CONTEXT_ARCHIVE, archive)) < 0) {
+	fprintf(stderr, "pmNewContext(%s): %s\n", archive, pmErrStr(ctx));
+	exit(1);
+    }
+    if ((sts = pmGetArchiveLabel(&label)) < 0 ||
+	(sts = pmSetMode(PM_MODE_FORW, &label.ll_start, 0)) < 0) {
+	fprintf(stderr, "truncated: %s\n", pmErrStr(sts));
+	exit(1);
+    }
+    while (before < 10 && (sts = pmFetchArchive(&rp)) >= 0) {
+	pmFreeResult(rp);
+	before++;
+    }
+    pmsprintf(name, sizeof(name), "%s.0", archive);
+    if (truncate(name, 0) < 0) {
+	fprintf(stderr, "truncate(%s): %s\n", name, osstrerror());
+	exit(1);
+    }
+    while ((sts = pmFetchArchive(&rp)) >= 0) {
+	pmFreeResult(rp);
+	after++;
+    }
+    pmDestroyContext(ctx);
+
+    printf("truncated: %ld records before, %ld after, then %s\n",
+	    before, after, pmErrStr(sts));
+}
+
+/*
+ * expected record for a pmSetMode() to t ... index into stamps[] of the
+ * first record at or after t (forward) or last at or before t (backward),
+ * -1 if none
+ */
+static long
+expect(struct timeval *t, int mode)
+{
+    long	lo = 0, hi = nstamps, mid;
+
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (pmtimevalSub(&stamps[mid], t) < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if (mode == PM_MODE_FORW)
+	return lo < nstamps ? lo : -1;
+    if (lo < nstamps && pmtimevalSub(&stamps[lo], t) == 0)
+	return lo;
+    return lo - 1;
+}
+
+static void
+position(const char *archive, int iter)
+{
+    struct timeval	t;
+    struct timeval	start, end;
+    pmResult		*rp;
+    long		k;
+    long		want;
+    int			bad = 0;
+    int			ctx, sts, i, mode;
+
+    if (nstamps == 0)
+	return;
+    if ((ctx = pmNewContext(PM_CONTEXT_ARCHIVE, archive)) < 0) {
+	fprintf(stderr, "pmNewContext(%s): %s\n", archive, pmErrStr(ctx));
+	exit(1);
+    }
+    if (nmetrics > 0)
+	lookup();
+    srand48(1);
+    gettimeofday(&start, NULL);
+    for (i = 0; i < iter; i++) {
+	/* a record time, or half way to the next one */
+	k = lrand48() % nstamps;
+	t = stamps[k];
+	if (lrand48() % 2 && k + 1 < nstamps)
+	    pmtimevalFromReal((pmtimevalToReal(&stamps[k]) +
+			       pmtimevalToReal(&stamps[k+1])) / 2, &t);
+	mode = lrand48() % 2 ? PM_MODE_BACK : PM_MODE_FORW;
+	want = expect(&t, mode);
+	if ((sts = pmSetMode(mode, &t, 0)) < 0) {
+	    fprintf(stderr, "pmSetMode: %s\n", pmErrStr(sts));
+	    exit(1);
+	}
+	sts = nmetrics > 0 ? pmFetch(nmetrics, pmids, &rp) : pmFetchArchive(&rp);
+	if (sts < 0) {
+	    if (want >= 0) {
+		fprintf(stderr, "%s to %ld.%06ld: pmFetchArchive: %s\n",
+			mode == PM_MODE_BACK ? "backward" : "forward",
+			(long)t.tv_sec, (long)t.tv_usec, pmErrStr(sts));
+		bad++;
+	    }
+	    continue;
+	}
+	if (want < 0 || pmtimevalSub(&rp->timestamp, &stamps[want]) != 0) {
+	    fprintf(stderr, "%s to %ld.%06ld: got %ld.%06ld expected record %ld\n",
+		    mode == PM_MODE_BACK ? "backward" : "forward",
+		    (long)t.tv_sec, (long)t.tv_usec,
+		    (long)rp->timestamp.tv_sec, (long)rp->timestamp.tv_usec, want);
+	    bad++;
+	}
+	pmFreeResult(rp);
+    }
+    gettimeofday(&end, NULL);
+    pmDestroyContext(ctx);
+
+    printf("position: %d random, %d wrong\n", iter, bad);
+    fprintf(stderr, "position: %.3f sec, %.1f usec each\n",
+	    pmtimevalSub(&end, &start),
+	    pmtimevalSub(&end, &start) * 1000000 / iter);
+}
+
+int
+main(int argc, char **argv)
+{
+    int		c;
+    int		sts;
+    int		bflag = 0;
+    int		tflag = 0;
+    long	mbytes = -1;
+    int		iter = 0;
+    int		errflag = 0;
+    char	*endnum;
+
+    pmSetProgname(argv[0]);
+
+    while ((c = getopt(argc, argv, "bD:g:i:m:r:t")) != EOF) {
+	switch (c) {
+
+	case 'b':	/* backwards scan as well */
+	    bflag = 1;
+	    break;
+
+	case 'D':	/* debug options */
+	    sts = pmSetDebug(optarg);
+	    if (sts < 0) {
+		fprintf(stderr, "%s: unrecognized debug options specification (%s)\n",
+		    pmGetProgname(), optarg);
+		errflag++;
+	    }
+	    break;
+
+	case 'g':	/* generate archive first */
+	    mbytes = strtol(optarg, &endnum, 10);
+	    if (*endnum != '\0' || mbytes < 0) {
+		fprintf(stderr, "%s: -g requires numeric argument\n", pmGetProgname());
+		errflag++;
+	    }
+	    break;
+
+	case 'i':	/* instance, with -m */
+	    instance = optarg;
+	    break;
+
+	case 'm':	/* metric to pmFetch */
+	    if ((metrics = (char **)realloc(metrics, (nmetrics + 1) * sizeof(char *))) == NULL) {
+		fprintf(stderr, "%s: realloc failed\n", pmGetProgname());
+		exit(1);
+	    }
+	    metrics[nmetrics++] = optarg;
+	    break;
+
+	case 'r':	/* random positioning */
+	    iter = (int)strtol(optarg, &endnum, 10);
+	    if (*endnum != '\0' || iter < 1) {
+		fprintf(stderr, "%s: -r requires numeric argument\n", pmGetProgname());
+		errflag++;
+	    }
+	    break;
+
+	case 't':	/* truncate part way through, last of all */
+	    tflag = 1;
+	    break;
+
+	case '?':
+	default:
+	    errflag++;
+	    break;
+	}
+    }
+
+    if (errflag || optind != argc - 1) {
+	fprintf(stderr, "Usage: %s [options] archive\n", pmGetProgname());
+	fprintf(stderr, "options:\n");
+	fprintf(stderr, "  -b		scan backwards as well as forwards\n");
+	fprintf(stderr, "  -D debug\n");
+	fprintf(stderr, "  -g MB		generate archive of at least MB Mbytes\n");
+	fprintf(stderr, "		(0 for a small 100 record archive) first\n");
+	fprintf(stderr, "  -i inst	instance profile of just inst for -m\n");
+	fprintf(stderr, "  -m metric	pmFetch metric (repeatable) not pmFetchArchive\n");
+	fprintf(stderr, "  -r iter	random pmSetMode positioning, iter times\n");
+	fprintf(stderr, "  -t		truncate the data volume during a final scan\n");
+	exit(1);
+    }
+
+    if (mbytes >= 0)
+	generate(argv[optind], mbytes);
+    scan(argv[optind], PM_MODE_FORW);
+    if (bflag)
+	scan(argv[optind], PM_MODE_BACK);
+    if (iter)
+	position(argv[optind], iter);
+    if (tflag)
+	truncated(argv[optind]);
+
+    return 0;
+}
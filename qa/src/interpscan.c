@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * Interpolation (PM_MODE_INTERP) benchmark ... optionally generate an
+ * archive with libpcp_import that looks like the proc PMDA's, with a
+ * large instance domain of short-lived instances and an optionally
+ * sparse (logged less often) second metric, then replay it with
+ * pmFetch() in PM_MODE_INTERP forwards and/or backwards.
+ *
+ * Deterministic results (steps, values and a checksum of the values, or
+ * every value with -v) go to stdout, timing and the per-step cost to
+ * stderr.
+ */
+
+#include <pcp/pmapi.h>
+#include <pcp/import.h>
+#include <sys/time.h>
+
+static int	ninst = 1000;		/* -n, instances over the archive */
+static int	life = 100;		/* -l, records each instance lives */
+static int	nrec = 1000;		/* -N, records in the archive */
+static int	sparse = 1;		/* -s, log the second metric every N */
+static int	vflag;			/* -v, report every value */
+
+static char	*names[] = { "interpscan.cpu", "interpscan.mem" };
+
+static void
+generate(const char *archive)
+{
+    char	name[32];
+    int		(*hdl)[2];
+    int		first, i, r, sts;
+    pmInDom	indom = pmInDom_build(246, 1);
+
+    if ((hdl = calloc(ninst, sizeof(*hdl))) == NULL) {
+	fprintf(stderr, "generate: calloc failed\n");
+	exit(1);
+    }
+    if ((sts = pmiStart(archive, 0)) < 0) {
+	fprintf(stderr, "pmiStart(%s): %s\n", archive, pmiErrStr(sts));
+	exit(1);
+    }
+    pmiSetHostname("interpscan.example.com");
+    pmiSetTimezone("UTC");
+    pmiAddMetric(names[0], pmID_build(246, 0, 0), PM_TYPE_U64, indom,
+		PM_SEM_COUNTER, pmiUnits(0, 1, 0, 0, PM_TIME_MSEC, 0));
+    pmiAddMetric(names[1], pmID_build(246, 0, 1), PM_TYPE_U32, indom,
+		PM_SEM_INSTANT, pmiUnits(1, 0, 0, PM_SPACE_KBYTE, 0, 0));
+    for (i = 0; i < ninst; i++) {
+	pmsprintf(name, sizeof(name), "%06d", 1000 + i);
+	if ((sts = pmiAddInstance(indom, name, 1000 + i)) < 0) {
+	    fprintf(stderr, "pmiAddInstance(%s): %s\n", name, pmiErrStr(sts));
+	    exit(1);
+	}
+	if ((hdl[i][0] = pmiGetHandle(names[0], name)) < 0 ||
+	    (hdl[i][1] = pmiGetHandle(names[1], name)) < 0) {
+	    fprintf(stderr, "pmiGetHandle(%s): failed\n", name);
+	    exit(1);
+	}
+    }
+
+    /*
+     * instance i is alive for life records, from record
+     * i * (nrec - life) / (ninst - 1), so arrivals and departures are
+     * spread over the whole archive
+     */
+    for (r = 0; r < nrec; r++) {
+	for (i = 0; i < ninst; i++) {
+	    first = ninst > 1 && nrec > life ?
+			(int)((long)i * (nrec - life) / (ninst - 1)) : 0;
+	    if (r < first || r >= first + life)
+		continue;
+	    pmsprintf(name, sizeof(name), "%ld", (long)(r - first) * (i % 7 + 1) * 10);
+	    pmiPutValueHandle(hdl[i][0], name);
+	    if (r % sparse == 0) {
+		pmsprintf(name, sizeof(name), "%d", 1000 + i + r);
+		pmiPutValueHandle(hdl[i][1], name);
+	    }
+	}
+	if ((sts = pmiWrite(1500000000 + r, 0)) < 0) {
+	    fprintf(stderr, "pmiWrite: %s\n", pmiErrStr(sts));
+	    exit(1);
+	}
+    }
+    pmiEnd();
+    free(hdl);
+    printf("generated %d records, %d instances\n", nrec, ninst);
+}
+
+static void
+replay(const char *archive, int direction, double delta)
+{
+    struct timeval	origin, start, end;
+    pmLogLabel		label;
+    pmResult		*rp;
+    pmAtomValue		av;
+    pmDesc		desc[2];
+    pmID		pmids[2];
+    double		sum = 0;
+    double		elapsed;
+    long		steps = 0;
+    long		nval = 0;
+    int			ctx, i, j, sts;
+
+    if ((ctx = pmNewContext(PM_CONTEXT_ARCHIVE, archive)) < 0) {
+	fprintf(stderr, "pmNewContext(%s): %s\n", archive, pmErrStr(ctx));
+	exit(1);
+    }
+    if ((sts = pmLookupName(2, names, pmids)) < 0 ||
+	(sts = pmLookupDesc(pmids[0], &desc[0])) < 0 ||
+	(sts = pmLookupDesc(pmids[1], &desc[1])) < 0) {
+	fprintf(stderr, "metrics: %s\n", pmErrStr(sts));
+	exit(1);
+    }
+    if (direction > 0) {
+	if ((sts = pmGetArchiveLabel(&label)) < 0) {
+	    fprintf(stderr, "pmGetArchiveLabel: %s\n", pmErrStr(sts));
+	    exit(1);
+	}
+	origin = label.ll_start;
+    }
+    else if ((sts = pmGetArchiveEnd(&origin)) < 0) {
+	fprintf(stderr, "pmGetArchiveEnd: %s\n", pmErrStr(sts));
+	exit(1);
+    }
+    if ((sts = pmSetMode(PM_MODE_INTERP, &origin,
+			(int)(direction * delta * 1000))) < 0) {
+	fprintf(stderr, "pmSetMode: %s\n", pmErrStr(sts));
+	exit(1);
+    }
+
+    gettimeofday(&start, NULL);
+    while ((sts = pmFetch(2, pmids, &rp)) >= 0) {
+	for (i = 0; i < rp->numpmid; i++) {
+	    for (j = 0; j < rp->vset[i]->numval; j++) {
+		pmExtractValue(rp->vset[i]->valfmt, &rp->vset[i]->vlist[j],
+				desc[i].type, &av, PM_TYPE_DOUBLE);
+		if (vflag)
+		    printf("%ld.%06ld %s[%d] %.0f\n",
+			    (long)rp->timestamp.tv_sec,
+			    (long)rp->timestamp.tv_usec, names[i],
+			    rp->vset[i]->vlist[j].inst, av.d);
+		sum += av.d;
+		nval++;
+	    }
+	}
+	pmFreeResult(rp);
+	steps++;
+    }
+    gettimeofday(&end, NULL);
+    if (sts != PM_ERR_EOL) {
+	fprintf(stderr, "pmFetch: %s\n", pmErrStr(sts));
+	exit(1);
+    }
+    pmDestroyContext(ctx);
+
+    printf("%s: %ld steps %ld values checksum %.0f\n",
+	    direction > 0 ? "forward" : "backward", steps, nval, sum);
+    elapsed = pmtimevalSub(&end, &start);
+    fprintf(stderr, "%s: %.3f sec, %.1f usec per step\n",
+	    direction > 0 ? "forward" : "backward", elapsed,
+	    steps ? 1000000 * elapsed / steps : 0);
+}
+
+int
+main(int argc, char **argv)
+{
+    int		c;
+    int		gflag = 0;
+    int		bflag = 0;
+    int		fflag = 0;
+    int		errflag = 0;
+    double	delta = 0.5;
+    char	*endnum;
+
+    pmSetProgname(argv[0]);
+
+    while ((c = getopt(argc, argv, "bD:fgl:n:N:s:t:v")) != EOF) {
+	switch (c) {
+
+	case 'b':	/* replay backwards */
+	    bflag++;
+	    break;
+
+	case 'D':	/* debug options */
+	    if (pmSetDebug(optarg) < 0) {
+		fprintf(stderr, "%s: unrecognized debug options (%s)\n",
+			pmGetProgname(), optarg);
+		errflag++;
+	    }
+	    break;
+
+	case 'f':	/* replay forwards */
+	    fflag++;
+	    break;
+
+	case 'g':	/* generate the archive first */
+	    gflag++;
+	    break;
+
+	case 'l':
+	    life = (int)strtol(optarg, &endnum, 10);
+	    if (*endnum != '\0' || life < 1)
+		errflag++;
+	    break;
+
+	case 'n':
+	    ninst = (int)strtol(optarg, &endnum, 10);
+	    if (*endnum != '\0' || ninst < 1)
+		errflag++;
+	    break;
+
+	case 'N':
+	    nrec = (int)strtol(optarg, &endnum, 10);
+	    if (*endnum != '\0' || nrec < 1)
+		errflag++;
+	    break;
+
+	case 's':
+	    sparse = (int)strtol(optarg, &endnum, 10);
+	    if (*endnum != '\0' || sparse < 1)
+		errflag++;
+	    break;
+
+	case 't':	/* interpolation interval in seconds */
+	    delta = strtod(optarg, &endnum);
+	    if (*endnum != '\0' || delta <= 0)
+		errflag++;
+	    break;
+
+	case 'v':	/* every value */
+	    vflag++;
+	    break;
+
+	case '?':
+	default:
+	    errflag++;
+	    break;
+	}
+    }
+
+    if (errflag || optind != argc - 1) {
+	fprintf(stderr, "Usage: %s [options] archive\n", pmGetProgname());
+	fprintf(stderr, "options:\n");
+	fprintf(stderr, "  -b		replay backwards\n");
+	fprintf(stderr, "  -D debug\n");
+	fprintf(stderr, "  -f		replay forwards (default unless -b)\n");
+	fprintf(stderr, "  -g		generate archive first, with\n");
+	fprintf(stderr, "  -l life	records each instance lives [100]\n");
+	fprintf(stderr, "  -n ninst	instances over the archive [1000]\n");
+	fprintf(stderr, "  -N nrec	records, one per second [1000]\n");
+	fprintf(stderr, "  -s sparse	log second metric every sparse records [1]\n");
+	fprintf(stderr, "  -t delta	interpolation interval in seconds [0.5]\n");
+	fprintf(stderr, "  -v		report every value\n");
+	exit(1);
+    }
+
+    if (gflag)
+	generate(argv[optind]);
+    if (fflag || !bflag)
+	replay(argv[optind], 1, delta);
+    if (bflag)
+	replay(argv[optind], -1, delta);
+
+    return 0;
+}
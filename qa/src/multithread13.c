@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * libpcp lock contention benchmark ... N threads, each with its own
+ * context, doing pmLookupName() and pmFetch() (and optionally
+ * pmTraversePMNS()) in a tight loop.  With per-context and per-subsystem
+ * locking the aggregate rate should scale (close to) linearly with the
+ * number of threads, up to the number of CPUs available.
+ *
+ * Every lookup and traversal is checked against the answer obtained
+ * before any threads are started, so concurrent namespace operations
+ * on host contexts (PMNS_REMOTE) are verified, not just timed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pcp/pmapi.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#ifndef HAVE_PTHREAD_BARRIER_T
+#include "pthread_barrier.h"
+#endif
+
+static pthread_barrier_t barrier;
+
+static int	ctxtype = PM_CONTEXT_ARCHIVE;
+static char	*source;
+static char	**namelist;
+static int	numnames;
+static int	iter = 100;
+static char	*traverse;		/* -p subtree for pmTraversePMNS() */
+static pmID	*ref_pmids;		/* expected pmLookupName() answer */
+static int	ref_numtraverse;	/* expected pmTraversePMNS() count */
+
+typedef struct {
+    int		id;
+    int		ctx;
+    pmID	*pmids;
+    long	ops;		/* pmLookupName + pmFetch calls completed */
+    struct timeval	start;
+    struct timeval	end;
+    char	*botch;
+} worker_t;
+
+static void
+count_name(const char *name, void *arg)
+{
+    (*(int *)arg)++;
+}
+
+static void *
+worker(void *arg)
+{
+    worker_t	*wp = (worker_t *)arg;
+    struct timeval	origin = { 0, 0 };
+    pmResult	*rp;
+    int		sts;
+    int		i;
+    int		j;
+    int		count;
+    char	strbuf[PM_MAXERRMSGLEN];
+
+    if ((sts = pmUseContext(wp->ctx)) < 0) {
+	fprintf(stderr, "Error: worker %d: pmUseContext(%d) -> %s\n",
+		wp->id, wp->ctx, pmErrStr_r(sts, strbuf, sizeof(strbuf)));
+	wp->botch = "pmUseContext";
+	return NULL;
+    }
+
+    pthread_barrier_wait(&barrier);
+    gettimeofday(&wp->start, NULL);
+
+    for (i = 0; i < iter; i++) {
+	sts = pmLookupName(numnames, namelist, wp->pmids);
+	if (sts < 0) {
+	    fprintf(stderr, "Error: worker %d: pmLookupName -> %s\n",
+		    wp->id, pmErrStr_r(sts, strbuf, sizeof(strbuf)));
+	    wp->botch = "pmLookupName";
+	    break;
+	}
+	for (j = 0; j < numnames; j++) {
+	    if (wp->pmids[j] != ref_pmids[j]) {
+		fprintf(stderr, "Error: worker %d: pmLookupName(%s) -> %s not %s\n",
+			wp->id, namelist[j], pmIDStr(wp->pmids[j]),
+			pmIDStr(ref_pmids[j]));
+		wp->botch = "pmLookupName";
+		break;
+	    }
+	}
+	if (wp->botch != NULL)
+	    break;
+	wp->ops++;
+	if (traverse != NULL) {
+	    count = 0;
+	    if ((sts = pmTraversePMNS_r(traverse, count_name, &count)) < 0) {
+		fprintf(stderr, "Error: worker %d: pmTraversePMNS(%s) -> %s\n",
+			wp->id, traverse, pmErrStr_r(sts, strbuf, sizeof(strbuf)));
+		wp->botch = "pmTraversePMNS";
+		break;
+	    }
+	    if (count != ref_numtraverse) {
+		fprintf(stderr, "Error: worker %d: pmTraversePMNS(%s) -> %d names not %d\n",
+			wp->id, traverse, count, ref_numtraverse);
+		wp->botch = "pmTraversePMNS";
+		break;
+	    }
+	    wp->ops++;
+	}
+	if (ctxtype == PM_CONTEXT_ARCHIVE &&
+	    (sts = pmSetMode(PM_MODE_FORW, &origin, 0)) < 0) {
+	    fprintf(stderr, "Error: worker %d: pmSetMode -> %s\n",
+		    wp->id, pmErrStr_r(sts, strbuf, sizeof(strbuf)));
+	    wp->botch = "pmSetMode";
+	    break;
+	}
+	while ((sts = pmFetch(numnames, wp->pmids, &rp)) >= 0) {
+	    wp->ops++;
+	    pmFreeResult(rp);
+	    if (ctxtype != PM_CONTEXT_ARCHIVE)
+		break;
+	}
+	if (sts < 0 && sts != PM_ERR_EOL) {
+	    fprintf(stderr, "Error: worker %d: pmFetch -> %s\n",
+		    wp->id, pmErrStr_r(sts, strbuf, sizeof(strbuf)));
+	    wp->botch = "pmFetch";
+	    break;
+	}
+    }
+
+    gettimeofday(&wp->end, NULL);
+    return NULL;
+}
+
+/*
+ * run one trial with nthreads workers, return aggregate ops/sec or
+ * -1 on error
+ */
+static double
+trial(int nthreads)
+{
+    pthread_t		*tids;
+    worker_t		*workers;
+    struct timeval	start;
+    struct timeval	end;
+    long		ops = 0;
+    int			botch = 0;
+    int			sts;
+    int			i;
+
+    tids = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+    workers = (worker_t *)calloc(nthreads, sizeof(worker_t));
+    if (tids == NULL || workers == NULL) {
+	fprintf(stderr, "trial: calloc failed\n");
+	exit(1);
+    }
+
+    for (i = 0; i < nthreads; i++) {
+	workers[i].id = i;
+	if ((workers[i].ctx = pmNewContext(ctxtype, source)) < 0) {
+	    fprintf(stderr, "pmNewContext(%s): %s\n", source, pmErrStr(workers[i].ctx));
+	    exit(1);
+	}
+	workers[i].pmids = (pmID *)calloc(numnames, sizeof(pmID));
+	if (workers[i].pmids == NULL) {
+	    fprintf(stderr, "trial: pmids calloc failed\n");
+	    exit(1);
+	}
+    }
+
+    pthread_barrier_init(&barrier, NULL, nthreads+1);
+    for (i = 0; i < nthreads; i++) {
+	if ((sts = pthread_create(&tids[i], NULL, worker, &workers[i])) != 0) {
+	    fprintf(stderr, "pthread_create: worker %d: %s\n", i, pmErrStr(-sts));
+	    exit(1);
+	}
+    }
+    pthread_barrier_wait(&barrier);
+    for (i = 0; i < nthreads; i++)
+	pthread_join(tids[i], NULL);
+    pthread_barrier_destroy(&barrier);
+
+    /*
+     * elapsed time is from the earliest worker start to the latest
+     * worker end, as seen by the workers themselves
+     */
+    start = workers[0].start;
+    end = workers[0].end;
+    for (i = 0; i < nthreads; i++) {
+	if (workers[i].botch != NULL)
+	    botch++;
+	if (pmtimevalSub(&workers[i].start, &start) < 0)
+	    start = workers[i].start;
+	if (pmtimevalSub(&workers[i].end, &end) > 0)
+	    end = workers[i].end;
+	ops += workers[i].ops;
+	pmDestroyContext(workers[i].ctx);
+	free(workers[i].pmids);
+    }
+    free(workers);
+    free(tids);
+
+    if (botch)
+	return -1;
+    return (double)ops / pmtimevalSub(&end, &start);
+}
+
+int
+main(int argc, char **argv)
+{
+    int		maxthreads = 16;
+    int		nthreads;
+    double	base = 0;
+    double	rate;
+    char	*endnum;
+    int		errflag = 0;
+    int		ctx;
+    int		sts;
+    int		c;
+
+    pmSetProgname(argv[0]);
+
+    while ((c = getopt(argc, argv, "D:hi:p:t:")) != EOF) {
+	switch (c) {
+
+	case 'D':	/* debug options */
+	    sts = pmSetDebug(optarg);
+	    if (sts < 0) {
+		fprintf(stderr, "%s: unrecognized debug options specification (%s)\n",
+		    pmGetProgname(), optarg);
+		errflag++;
+	    }
+	    break;
+
+	case 'h':	/* host context, rather than archive */
+	    ctxtype = PM_CONTEXT_HOST;
+	    break;
+
+	case 'i':
+	    iter = (int)strtol(optarg, &endnum, 10);
+	    if (*endnum != '\0' || iter < 1) {
+		fprintf(stderr, "%s: -i requires numeric argument\n", pmGetProgname());
+		errflag++;
+	    }
+	    break;
+
+	case 'p':	/* also traverse this PMNS subtree */
+	    traverse = optarg;
+	    break;
+
+	case 't':
+	    maxthreads = (int)strtol(optarg, &endnum, 10);
+	    if (*endnum != '\0' || maxthreads < 1) {
+		fprintf(stderr, "%s: -t requires numeric argument\n", pmGetProgname());
+		errflag++;
+	    }
+	    break;
+
+	case '?':
+	default:
+	    errflag++;
+	    break;
+	}
+    }
+
+    if (errflag || argc - optind < 2) {
+	fprintf(stderr, "Usage: %s [options] archive|host metric [metric ...]\n", pmGetProgname());
+	fprintf(stderr, "options:\n");
+	fprintf(stderr, "  -D debug\n");
+	fprintf(stderr, "  -h		source is a pmcd host, not an archive\n");
+	fprintf(stderr, "  -i iter	iterations per thread [default 100]\n");
+	fprintf(stderr, "  -p name	also pmTraversePMNS from name each iteration\n");
+	fprintf(stderr, "  -t maxthreads	maximum number of threads [default 16]\n");
+	exit(1);
+    }
+
+    source = argv[optind++];
+    namelist = &argv[optind];
+    numnames = argc - optind;
+
+    /* reference answers, from a single-threaded context */
+    if ((ctx = pmNewContext(ctxtype, source)) < 0) {
+	fprintf(stderr, "pmNewContext(%s): %s\n", source, pmErrStr(ctx));
+	exit(1);
+    }
+    if ((ref_pmids = (pmID *)calloc(numnames, sizeof(pmID))) == NULL) {
+	fprintf(stderr, "main: pmids calloc failed\n");
+	exit(1);
+    }
+    if ((sts = pmLookupName(numnames, namelist, ref_pmids)) < 0) {
+	fprintf(stderr, "pmLookupName: %s\n", pmErrStr(sts));
+	exit(1);
+    }
+    if (traverse != NULL &&
+	(sts = pmTraversePMNS_r(traverse, count_name, &ref_numtraverse)) < 0) {
+	fprintf(stderr, "pmTraversePMNS(%s): %s\n", traverse, pmErrStr(sts));
+	exit(1);
+    }
+    pmDestroyContext(ctx);
+
+    /*
+     * report threads, aggregate rate and speedup relative to the
+     * single-threaded case ... threads doubles each time
+     */
+    for (nthreads = 1; nthreads <= maxthreads; nthreads *= 2) {
+	if ((rate = trial(nthreads)) < 0) {
+	    fprintf(stderr, "%s: trial with %d threads failed\n", pmGetProgname(), nthreads);
+	    exit(1);
+	}
+	if (nthreads == 1)
+	    base = rate;
+	printf("%d %.1f %.2f\n", nthreads, rate, base > 0 ? rate / base : 0);
+    }
+
+    return 0;
+}
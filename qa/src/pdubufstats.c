@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * Exercise PDU buffer pool reuse, trimming of idle slabs after a burst
+ * and the __pmPDUBufStats() and __pmCountPDUBuf() reporting, optionally
+ * timing allocate/unpin cycles.
+ */
+
+#include <pcp/pmapi.h>
+#include "libpcp.h"
+#include <sys/time.h>
+
+#define BURST	1000
+
+static void
+report(const char *title)
+{
+    __pmPDUBufStat	*stats;
+    int			nclass;
+    int			large;
+    int			c;
+
+    nclass = __pmPDUBufStats(0, NULL, NULL);
+    if ((stats = (__pmPDUBufStat *)calloc(nclass, sizeof(*stats))) == NULL) {
+	fprintf(stderr, "report: calloc failed\n");
+	exit(1);
+    }
+    __pmPDUBufStats(nclass, stats, &large);
+    printf("%s\n", title);
+    for (c = 0; c < nclass; c++) {
+	if (stats[c].hit == 0 && stats[c].miss == 0)
+	    continue;
+	printf("  size %d: hit %lu miss %lu inuse %d\n",
+		stats[c].size, stats[c].hit, stats[c].miss, stats[c].inuse);
+    }
+    printf("  large inuse %d\n", large);
+    free(stats);
+}
+
+/*
+ * Allocate and release a burst of 1024 byte buffers, most of the slabs
+ * should be returned to the heap rather than kept on the free list.
+ */
+static void
+burst(void)
+{
+    __pmPDUBufStat	*stats;
+    __pmPDU		*pb[BURST];
+    int			nclass;
+    int			c;
+    int			i;
+
+    for (i = 0; i < BURST; i++) {
+	if ((pb[i] = __pmFindPDUBuf(1024)) == NULL) {
+	    fprintf(stderr, "__pmFindPDUBuf(1024) failed\n");
+	    exit(1);
+	}
+    }
+    for (i = 0; i < BURST; i++)
+	__pmUnpinPDUBuf(pb[i]);
+
+    nclass = __pmPDUBufStats(0, NULL, NULL);
+    if ((stats = (__pmPDUBufStat *)calloc(nclass, sizeof(*stats))) == NULL) {
+	fprintf(stderr, "burst: calloc failed\n");
+	exit(1);
+    }
+    __pmPDUBufStats(nclass, stats, NULL);
+    for (c = 0; c < nclass; c++) {
+	if (stats[c].size != 1024)
+	    continue;
+	printf("after burst of %d\n", BURST);
+	printf("  size %d: inuse %d trimmed %s free %s\n",
+		stats[c].size, stats[c].inuse,
+		stats[c].trim > 0 ? "some" : "none",
+		stats[c].free < BURST / 4 ? "< 1/4 of burst" : ">= 1/4 of burst");
+	fprintf(stderr, "burst: trim %lu free %d\n", stats[c].trim, stats[c].free);
+    }
+    free(stats);
+}
+
+int
+main(int argc, char **argv)
+{
+    static int	sizes[] = { 12, 400, 1024, 2000, 8192, 100000 };
+    int		nsizes = sizeof(sizes) / sizeof(sizes[0]);
+    __pmPDU	*pb[8];
+    int		alloc, nfree;
+    int		iter = 0;
+    int		i, j;
+    struct timeval	start, end;
+
+    pmSetProgname(argv[0]);
+    if (argc > 1)
+	iter = atoi(argv[1]);
+
+    /* one of each size, all misses */
+    for (i = 0; i < nsizes; i++) {
+	if ((pb[i] = __pmFindPDUBuf(sizes[i])) == NULL) {
+	    fprintf(stderr, "__pmFindPDUBuf(%d) failed\n", sizes[i]);
+	    exit(1);
+	}
+    }
+    report("after first allocation");
+    /* counted by the size asked for, not by the size class */
+    __pmCountPDUBuf(400, &alloc, &nfree);
+    printf("count(400): alloc %d free %d\n", alloc, nfree);
+    __pmCountPDUBuf(1024, &alloc, &nfree);
+    printf("count(1024): alloc %d free %d\n", alloc, nfree);
+
+    /* release and allocate again, all buffers should be reused */
+    for (i = 0; i < nsizes; i++)
+	__pmUnpinPDUBuf(pb[i]);
+    for (i = 0; i < nsizes; i++)
+	pb[i] = __pmFindPDUBuf(sizes[i]);
+    report("after reuse");
+
+    /* interior pointers pin and unpin the whole buffer */
+    __pmPinPDUBuf((char *)pb[2] + 512);
+    printf("unpin interior -> %d\n", __pmUnpinPDUBuf((char *)pb[2] + 1020));
+    printf("unpin start -> %d\n", __pmUnpinPDUBuf(pb[2]));
+    printf("unpin again -> %d\n", __pmUnpinPDUBuf(pb[2]));
+    for (i = 0; i < nsizes; i++) {
+	if (i != 2)
+	    __pmUnpinPDUBuf(pb[i]);
+    }
+    report("after release");
+    __pmCountPDUBuf(1024, &alloc, &nfree);
+    printf("count(1024): alloc %d free %d\n", alloc, nfree);
+
+    burst();
+
+    if (iter > 0) {
+	/* timing, results to stderr as they are not deterministic */
+	gettimeofday(&start, NULL);
+	for (j = 0; j < iter; j++) {
+	    for (i = 0; i < nsizes - 1; i++)
+		pb[i] = __pmFindPDUBuf(sizes[i]);
+	    for (i = 0; i < nsizes - 1; i++)
+		__pmUnpinPDUBuf(pb[i]);
+	}
+	gettimeofday(&end, NULL);
+	fprintf(stderr, "%d allocate/unpin cycles: %.1f nsec per cycle\n",
+		iter * (nsizes - 1),
+		pmtimevalSub(&end, &start) * 1e9 / (iter * (nsizes - 1)));
+    }
+
+    return 0;
+}
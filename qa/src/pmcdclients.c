@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * pmcd client scaling benchmark ... open many concurrent client
+ * connections to pmcd (spread over several processes so no one client
+ * process needs more than a few hundred descriptors), then measure the
+ * round-trip latency of pmFetch() on each of them while all remain
+ * connected.
+ *
+ * Deterministic results go to stdout, timing to stderr.
+ */
+
+#include <pcp/pmapi.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <signal.h>
+
+static char	*host = "local:";
+static char	*metric = "pmcd.numclients";
+static int	nclients = 5000;
+static int	nprocs = 10;
+static int	iter = 10;
+
+/* pipe reads may be short, keep going until we have it all */
+static int
+readall(int fd, void *buf, int len)
+{
+    char	*p = (char *)buf;
+    int		have = 0;
+    int		sts;
+
+    while (have < len) {
+	if ((sts = read(fd, p + have, len - have)) <= 0)
+	    break;
+	have += sts;
+    }
+    return have;
+}
+
+static int
+cmp(const void *a, const void *b)
+{
+    double	da = *(double *)a;
+    double	db = *(double *)b;
+
+    return da < db ? -1 : (da > db ? 1 : 0);
+}
+
+/*
+ * one child process ... connect n contexts, tell the parent, wait for
+ * the go signal, then fetch iter times on each context and send back
+ * the latencies (in usec), preceded by the count of fetch errors
+ */
+static void
+child(int n, int readyfd, int gofd, int resfd)
+{
+    int		*ctx;
+    double	*lat;
+    pmID	pmid;
+    pmResult	*rp;
+    struct timeval	start, end;
+    int		errors = 0;
+    int		nlat = 0;
+    int		i, j, sts;
+    char	c = 'r';
+
+    ctx = (int *)calloc(n, sizeof(int));
+    lat = (double *)calloc(n * iter, sizeof(double));
+    if (ctx == NULL || lat == NULL) {
+	fprintf(stderr, "child: calloc failed\n");
+	exit(1);
+    }
+    for (i = 0; i < n; i++) {
+	if ((ctx[i] = pmNewContext(PM_CONTEXT_HOST, host)) < 0) {
+	    fprintf(stderr, "child: pmNewContext(%s) #%d: %s\n",
+		    host, i, pmErrStr(ctx[i]));
+	    c = 'f';
+	    break;
+	}
+    }
+    if (c == 'r' && (sts = pmLookupName(1, &metric, &pmid)) < 0) {
+	fprintf(stderr, "child: pmLookupName(%s): %s\n", metric, pmErrStr(sts));
+	c = 'f';
+    }
+
+    /* tell the parent either way, so it is not left waiting */
+    if (write(readyfd, &c, 1) != 1 || c == 'f')
+	exit(1);
+    while (read(gofd, &c, 1) > 0)
+	;
+
+    for (j = 0; j < iter; j++) {
+	for (i = 0; i < n; i++) {
+	    pmUseContext(ctx[i]);
+	    gettimeofday(&start, NULL);
+	    sts = pmFetch(1, &pmid, &rp);
+	    gettimeofday(&end, NULL);
+	    if (sts < 0) {
+		errors++;
+		continue;
+	    }
+	    pmFreeResult(rp);
+	    lat[nlat++] = pmtimevalSub(&end, &start) * 1000000;
+	}
+    }
+
+    if (write(resfd, &errors, sizeof(errors)) != sizeof(errors) ||
+	write(resfd, &nlat, sizeof(nlat)) != sizeof(nlat) ||
+	write(resfd, lat, nlat * sizeof(double)) != nlat * sizeof(double))
+	exit(1);
+    exit(0);
+}
+
+int
+main(int argc, char **argv)
+{
+    int		readypipe[2];
+    int		gopipe[2];
+    int		(*respipe)[2];
+    pid_t	*pids;
+    double	*lat;
+    double	sum = 0;
+    int		nlat = 0;
+    int		errors = 0;
+    int		ctx, n, e;
+    int		c, i, sts;
+    int		errflag = 0;
+    char	*endnum;
+    char	ch;
+    pmID	pmid;
+    pmResult	*rp;
+
+    pmSetProgname(argv[0]);
+
+    while ((c = getopt(argc, argv, "c:h:i:m:p:")) != EOF) {
+	switch (c) {
+
+	case 'c':
+	    nclients = (int)strtol(optarg, &endnum, 10);
+	    if (*endnum != '\0' || nclients < 1) {
+		fprintf(stderr, "%s: -c requires numeric argument\n", pmGetProgname());
+		errflag++;
+	    }
+	    break;
+
+	case 'h':
+	    host = optarg;
+	    break;
+
+	case 'i':
+	    iter = (int)strtol(optarg, &endnum, 10);
+	    if (*endnum != '\0' || iter < 1) {
+		fprintf(stderr, "%s: -i requires numeric argument\n", pmGetProgname());
+		errflag++;
+	    }
+	    break;
+
+	case 'm':
+	    metric = optarg;
+	    break;
+
+	case 'p':
+	    nprocs = (int)strtol(optarg, &endnum, 10);
+	    if (*endnum != '\0' || nprocs < 1) {
+		fprintf(stderr, "%s: -p requires numeric argument\n", pmGetProgname());
+		errflag++;
+	    }
+	    break;
+
+	case '?':
+	default:
+	    errflag++;
+	    break;
+	}
+    }
+
+    if (errflag || optind != argc) {
+	fprintf(stderr, "Usage: %s [options]\n", pmGetProgname());
+	fprintf(stderr, "options:\n");
+	fprintf(stderr, "  -c clients	concurrent pmcd clients [default 5000]\n");
+	fprintf(stderr, "  -h host	pmcd host [default local:]\n");
+	fprintf(stderr, "  -i iter	fetches per client [default 10]\n");
+	fprintf(stderr, "  -m metric	metric to fetch [default pmcd.numclients]\n");
+	fprintf(stderr, "  -p procs	client processes [default 10]\n");
+	exit(1);
+    }
+    if (nprocs > nclients)
+	nprocs = nclients;
+
+    respipe = calloc(nprocs, sizeof(*respipe));
+    pids = (pid_t *)calloc(nprocs, sizeof(pid_t));
+    if (respipe == NULL || pids == NULL) {
+	fprintf(stderr, "%s: calloc failed\n", pmGetProgname());
+	exit(1);
+    }
+    if (pipe(readypipe) < 0 || pipe(gopipe) < 0) {
+	perror("pipe");
+	exit(1);
+    }
+
+    for (i = 0; i < nprocs; i++) {
+	/* share clients out as evenly as possible */
+	n = nclients / nprocs + (i < nclients % nprocs);
+	if (pipe(respipe[i]) < 0) {
+	    perror("pipe");
+	    exit(1);
+	}
+	if ((pids[i] = fork()) == 0) {
+	    close(readypipe[0]);
+	    close(gopipe[1]);
+	    close(respipe[i][0]);
+	    child(n, readypipe[1], gopipe[0], respipe[i][1]);
+	    /*NOTREACHED*/
+	}
+	else if (pids[i] < 0) {
+	    perror("fork");
+	    exit(1);
+	}
+	close(respipe[i][1]);
+    }
+    close(readypipe[1]);
+    close(gopipe[0]);
+
+    /* wait for all children to connect */
+    for (i = 0; i < nprocs; i++) {
+	if (read(readypipe[0], &ch, 1) != 1 || ch != 'r') {
+	    fprintf(stderr, "%s: child failed before connecting\n", pmGetProgname());
+	    for (i = 0; i < nprocs; i++)
+		kill(pids[i], SIGTERM);
+	    exit(1);
+	}
+    }
+    printf("%d clients connected\n", nclients);
+
+    /* check pmcd agrees, before starting the clock */
+    if ((ctx = pmNewContext(PM_CONTEXT_HOST, host)) < 0) {
+	fprintf(stderr, "pmNewContext(%s): %s\n", host, pmErrStr(ctx));
+	exit(1);
+    }
+    if ((sts = pmLookupName(1, &metric, &pmid)) >= 0 &&
+	strcmp(metric, "pmcd.numclients") == 0 &&
+	(sts = pmFetch(1, &pmid, &rp)) >= 0) {
+	if (rp->numpmid == 1 && rp->vset[0]->numval == 1) {
+	    n = rp->vset[0]->vlist[0].value.lval;
+	    if (n > nclients)
+		printf("pmcd.numclients OK\n");
+	    else
+		printf("pmcd.numclients %d, expected more than %d\n", n, nclients);
+	}
+	pmFreeResult(rp);
+    }
+    pmDestroyContext(ctx);
+
+    /* start them all fetching */
+    close(gopipe[1]);
+
+    if ((lat = (double *)malloc(nclients * iter * sizeof(double))) == NULL) {
+	fprintf(stderr, "%s: malloc failed\n", pmGetProgname());
+	exit(1);
+    }
+    for (i = 0; i < nprocs; i++) {
+	if (readall(respipe[i][0], &e, sizeof(e)) != sizeof(e) ||
+	    readall(respipe[i][0], &n, sizeof(n)) != sizeof(n)) {
+	    fprintf(stderr, "%s: child %d failed\n", pmGetProgname(), i);
+	    exit(1);
+	}
+	errors += e;
+	if (n > 0 && readall(respipe[i][0], &lat[nlat], n * sizeof(double)) != n * sizeof(double)) {
+	    fprintf(stderr, "%s: child %d short read\n", pmGetProgname(), i);
+	    exit(1);
+	}
+	nlat += n;
+	close(respipe[i][0]);
+    }
+    for (i = 0; i < nprocs; i++)
+	waitpid(pids[i], &sts, 0);
+
+    printf("%d fetch errors\n", errors);
+    if (nlat > 0) {
+	qsort(lat, nlat, sizeof(double), cmp);
+	for (i = 0; i < nlat; i++)
+	    sum += lat[i];
+	fprintf(stderr, "%d fetches: mean %.1f median %.1f p99 %.1f max %.1f usec\n",
+		nlat, sum / nlat, lat[nlat / 2],
+		lat[(int)(nlat * 0.99)], lat[nlat - 1]);
+    }
+
+    return errors != 0;
+}
@@ -0,0 +1,1191 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * In-memory stand-in for a Redis server, for testing the libpcp_web time
+ * series code without one.  Linked into a QA program (ahead of libpcp_web)
+ * these hiredis client routines are used instead of those in libhiredis -
+ * commands are executed at once against a store held in this process,
+ * and the replies queued on the context until they are read.
+ *
+ * Only the commands and options used by libpcp_web are supported, and
+ * the one Lua script it loads (string map identifiers) is emulated.
+ * Commands, pipelined commands and round trips are counted, to check
+ * how the library batches its requests.
+ */
+
+#include <pcp/pmapi.h>
+#include "libpcp.h"
+#include <hiredis/hiredis.h>
+#include <pthread.h>
+#include <math.h>
+#include "redismock.h"
+
+#define MAXARGS		64
+#define HASH_INIT	2166136261U
+
+enum { MOCK_STRING = 1, MOCK_HASH, MOCK_SET, MOCK_ZSET };
+
+typedef struct {
+    char		*name;		/* hash field, set or zset member */
+    size_t		namelen;
+    char		*value;		/* hash field value */
+    size_t		length;
+    double		score;		/* zset member score */
+} member_t;
+
+typedef struct {
+    int			type;		/* MOCK_STRING, MOCK_HASH, ... */
+    char		*name;
+    char		*string;	/* MOCK_STRING value */
+    size_t		length;
+    member_t		*members;	/* in order added, zsets sorted */
+    unsigned int	count;
+    unsigned int	size;
+    int			sorted;
+} mockKey;
+
+typedef struct {
+    int			argc;
+    char		*argv[MAXARGS];
+    size_t		argl[MAXARGS];
+} command_t;
+
+typedef struct {
+    redisContext	context;	/* first, handed out to callers */
+    redisReply		**replies;	/* queued, not yet read */
+    unsigned int	head;
+    unsigned int	count;
+    unsigned int	size;
+    unsigned int	appended;	/* commands since replies last read */
+} mockContext;
+
+typedef redisReply *(*handler_t)(command_t *);
+
+typedef struct {
+    const char		*name;
+    handler_t		handler;
+    unsigned long	count;
+} mockCommand;
+
+static pthread_mutex_t	mock_lock = PTHREAD_MUTEX_INITIALIZER;
+static __pmHashCtl	keys;
+static mockKey		**allkeys;
+static unsigned int	nkeys;
+static char		*script;	/* the one script loaded */
+static char		scripthash[41];
+
+static struct {
+    unsigned long	commands;
+    unsigned long	pipelined;
+    unsigned long	synchronous;
+    unsigned long	roundtrips;
+    unsigned long	redundant;	/* HMSET changing nothing */
+    unsigned int	depth;		/* deepest pipeline */
+} counts;
+
+static unsigned int
+hash_bytes(const char *bytes, size_t length, unsigned int hash)
+{
+    while (length-- > 0)
+	hash = (hash ^ (unsigned char)*bytes++) * 16777619U;
+    return hash;
+}
+
+/*
+ * Replies
+ */
+static redisReply *
+reply_new(int type)
+{
+    redisReply	*reply;
+
+    if ((reply = (redisReply *)calloc(1, sizeof(redisReply))) == NULL) {
+	fprintf(stderr, "redismock: out of memory for reply\n");
+	exit(1);
+    }
+    reply->type = type;
+    return reply;
+}
+
+static redisReply *
+reply_string(int type, const char *string, size_t length)
+{
+    redisReply	*reply = reply_new(type);
+
+    if ((reply->str = malloc(length + 1)) == NULL) {
+	fprintf(stderr, "redismock: out of memory for reply string\n");
+	exit(1);
+    }
+    memcpy(reply->str, string, length);
+    reply->str[length] = '\0';
+    reply->len = length;
+    return reply;
+}
+
+static redisReply *
+reply_integer(long long value)
+{
+    redisReply	*reply = reply_new(REDIS_REPLY_INTEGER);
+
+    reply->integer = value;
+    return reply;
+}
+
+static redisReply *
+reply_array(size_t size)
+{
+    redisReply	*reply = reply_new(REDIS_REPLY_ARRAY);
+
+    if ((reply->element = calloc(size + 1, sizeof(redisReply *))) == NULL) {
+	fprintf(stderr, "redismock: out of memory for %zu elements\n", size);
+	exit(1);
+    }
+    return reply;
+}
+
+static void
+reply_element(redisReply *array, redisReply *reply)
+{
+    array->element[array->elements++] = reply;
+}
+
+#define reply_status(s)	reply_string(REDIS_REPLY_STATUS, s, strlen(s))
+#define reply_error(s)	reply_string(REDIS_REPLY_ERROR, s, strlen(s))
+#define reply_nil()	reply_new(REDIS_REPLY_NIL)
+#define WRONGTYPE	"WRONGTYPE Operation against a key holding the wrong kind of value"
+
+void
+freeReplyObject(void *arg)
+{
+    redisReply	*reply = (redisReply *)arg;
+    size_t	i;
+
+    if (reply == NULL)
+	return;
+    for (i = 0; i < reply->elements; i++)
+	freeReplyObject(reply->element[i]);
+    free(reply->element);
+    free(reply->str);
+    free(reply);
+}
+
+/*
+ * The key store
+ */
+static mockKey *
+key_lookup(const char *name, int type, int create, redisReply **error)
+{
+    __pmHashNode	*hp;
+    mockKey		*kp;
+    unsigned int	hash = hash_bytes(name, strlen(name), HASH_INIT);
+
+    for (hp = __pmHashSearch(hash, &keys); hp != NULL; hp = hp->next) {
+	kp = (mockKey *)hp->data;
+	if (hp->key != hash || strcmp(kp->name, name) != 0)
+	    continue;
+	if (kp->type != type) {
+	    *error = reply_error(WRONGTYPE);
+	    return NULL;
+	}
+	return kp;
+    }
+    if (!create)
+	return NULL;
+
+    if ((kp = (mockKey *)calloc(1, sizeof(mockKey))) == NULL ||
+	(kp->name = strdup(name)) == NULL ||
+	__pmHashAdd(hash, kp, &keys) < 0 ||
+	(allkeys = realloc(allkeys, (nkeys + 1) * sizeof(mockKey *))) == NULL) {
+	fprintf(stderr, "redismock: out of memory for key %s\n", name);
+	exit(1);
+    }
+    kp->type = type;
+    allkeys[nkeys++] = kp;
+    return kp;
+}
+
+static member_t *
+member_lookup(mockKey *kp, const char *name, size_t namelen)
+{
+    unsigned int	i;
+
+    for (i = 0; i < kp->count; i++)
+	if (kp->members[i].namelen == namelen &&
+	    memcmp(kp->members[i].name, name, namelen) == 0)
+	    return &kp->members[i];
+    return NULL;
+}
+
+static member_t *
+member_add(mockKey *kp, const char *name, size_t namelen)
+{
+    member_t	*mp;
+
+    if (kp->count == kp->size) {
+	kp->size = kp->size ? kp->size * 2 : 8;
+	if ((mp = realloc(kp->members, kp->size * sizeof(member_t))) == NULL) {
+	    fprintf(stderr, "redismock: out of memory for %s\n", kp->name);
+	    exit(1);
+	}
+	kp->members = mp;
+    }
+    mp = &kp->members[kp->count++];
+    memset(mp, 0, sizeof(member_t));
+    if ((mp->name = malloc(namelen + 1)) == NULL) {
+	fprintf(stderr, "redismock: out of memory for %s\n", kp->name);
+	exit(1);
+    }
+    memcpy(mp->name, name, namelen);
+    mp->name[namelen] = '\0';
+    mp->namelen = namelen;
+    kp->sorted = 0;
+    return mp;
+}
+
+static void
+member_value(member_t *mp, const char *value, size_t length)
+{
+    free(mp->value);
+    if ((mp->value = malloc(length + 1)) == NULL) {
+	fprintf(stderr, "redismock: out of memory for field %s\n", mp->name);
+	exit(1);
+    }
+    memcpy(mp->value, value, length);
+    mp->value[length] = '\0';
+    mp->length = length;
+}
+
+static int
+member_compare(const void *a, const void *b)
+{
+    const member_t	*ma = (const member_t *)a;
+    const member_t	*mb = (const member_t *)b;
+    size_t		length = ma->namelen < mb->namelen ? ma->namelen : mb->namelen;
+    int			sts;
+
+    if (ma->score != mb->score)
+	return ma->score < mb->score ? -1 : 1;
+    if ((sts = memcmp(ma->name, mb->name, length)) != 0)
+	return sts;
+    return ma->namelen < mb->namelen ? -1 : (ma->namelen > mb->namelen);
+}
+
+/* zset members in order of score, then lexically */
+static void
+key_sort(mockKey *kp)
+{
+    if (!kp->sorted)
+	qsort(kp->members, kp->count, sizeof(member_t), member_compare);
+    kp->sorted = 1;
+}
+
+/*
+ * Commands
+ */
+static redisReply *
+cmd_get(command_t *cp)
+{
+    redisReply	*error = NULL;
+    mockKey	*kp;
+
+    if ((kp = key_lookup(cp->argv[1], MOCK_STRING, 0, &error)) == NULL)
+	return error ? error : reply_nil();
+    return reply_string(REDIS_REPLY_STRING, kp->string, kp->length);
+}
+
+static redisReply *
+cmd_set(command_t *cp)
+{
+    redisReply	*error = NULL;
+    mockKey	*kp;
+
+    if ((kp = key_lookup(cp->argv[1], MOCK_STRING, 1, &error)) == NULL)
+	return error;
+    free(kp->string);
+    if ((kp->string = malloc(cp->argl[2] + 1)) == NULL) {
+	fprintf(stderr, "redismock: out of memory for %s\n", kp->name);
+	exit(1);
+    }
+    memcpy(kp->string, cp->argv[2], cp->argl[2] + 1);
+    kp->length = cp->argl[2];
+    return reply_status("OK");
+}
+
+static redisReply *
+cmd_append(command_t *cp)
+{
+    redisReply	*error = NULL;
+    mockKey	*kp;
+    char	*string;
+
+    if ((kp = key_lookup(cp->argv[1], MOCK_STRING, 1, &error)) == NULL)
+	return error;
+    if ((string = realloc(kp->string, kp->length + cp->argl[2] + 1)) == NULL) {
+	fprintf(stderr, "redismock: out of memory for %s\n", kp->name);
+	exit(1);
+    }
+    memcpy(string + kp->length, cp->argv[2], cp->argl[2] + 1);
+    kp->string = string;
+    kp->length += cp->argl[2];
+    return reply_integer(kp->length);
+}
+
+static redisReply *
+cmd_incr(command_t *cp)
+{
+    redisReply	*error = NULL;
+    mockKey	*kp;
+    long long	value;
+    char	buffer[32];
+
+    if ((kp = key_lookup(cp->argv[1], MOCK_STRING, 1, &error)) == NULL)
+	return error;
+    value = kp->string ? strtoll(kp->string, NULL, 10) + 1 : 1;
+    free(kp->string);
+    kp->length = pmsprintf(buffer, sizeof(buffer), "%lld", value);
+    kp->string = strdup(buffer);
+    return reply_integer(value);
+}
+
+static redisReply *
+cmd_hmset(command_t *cp)
+{
+    redisReply	*error = NULL;
+    member_t	*mp;
+    mockKey	*kp;
+    int		i, changed = 0, existed;
+
+    if (cp->argc < 4 || cp->argc % 2)
+	return reply_error("ERR wrong number of arguments for 'hmset'");
+    existed = (key_lookup(cp->argv[1], MOCK_HASH, 0, &error) != NULL);
+    if (error)
+	return error;
+    kp = key_lookup(cp->argv[1], MOCK_HASH, 1, &error);
+    for (i = 2; i < cp->argc; i += 2) {
+	if ((mp = member_lookup(kp, cp->argv[i], cp->argl[i])) == NULL) {
+	    mp = member_add(kp, cp->argv[i], cp->argl[i]);
+	    changed = 1;
+	} else if (mp->length != cp->argl[i+1] ||
+		   memcmp(mp->value, cp->argv[i+1], mp->length) != 0) {
+	    changed = 1;
+	}
+	member_value(mp, cp->argv[i+1], cp->argl[i+1]);
+    }
+    if (existed && !changed)
+	counts.redundant++;
+    return reply_status("OK");
+}
+
+static redisReply *
+cmd_hget(command_t *cp)
+{
+    redisReply	*error = NULL;
+    member_t	*mp;
+    mockKey	*kp;
+
+    if ((kp = key_lookup(cp->argv[1], MOCK_HASH, 0, &error)) == NULL)
+	return error ? error : reply_nil();
+    if ((mp = member_lookup(kp, cp->argv[2], cp->argl[2])) == NULL)
+	return reply_nil();
+    return reply_string(REDIS_REPLY_STRING, mp->value, mp->length);
+}
+
+static redisReply *
+cmd_hmget(command_t *cp)
+{
+    redisReply	*error = NULL, *reply;
+    member_t	*mp;
+    mockKey	*kp;
+    int		i;
+
+    kp = key_lookup(cp->argv[1], MOCK_HASH, 0, &error);
+    if (error)
+	return error;
+    reply = reply_array(cp->argc - 2);
+    for (i = 2; i < cp->argc; i++) {
+	if (kp && (mp = member_lookup(kp, cp->argv[i], cp->argl[i])) != NULL)
+	    reply_element(reply,
+			reply_string(REDIS_REPLY_STRING, mp->value, mp->length));
+	else
+	    reply_element(reply, reply_nil());
+    }
+    return reply;
+}
+
+static redisReply *
+hash_fields(command_t *cp, int values)
+{
+    redisReply	*error = NULL, *reply;
+    member_t	*mp;
+    mockKey	*kp;
+    unsigned int i;
+
+    if ((kp = key_lookup(cp->argv[1], MOCK_HASH, 0, &error)) == NULL)
+	return error ? error : reply_array(0);
+    reply = reply_array(kp->count * (values ? 2 : 1));
+    for (i = 0; i < kp->count; i++) {
+	mp = &kp->members[i];
+	reply_element(reply,
+		reply_string(REDIS_REPLY_STRING, mp->name, mp->namelen));
+	if (values)
+	    reply_element(reply,
+		reply_string(REDIS_REPLY_STRING, mp->value, mp->length));
+    }
+    return reply;
+}
+
+static redisReply *
+cmd_hgetall(command_t *cp)
+{
+    return hash_fields(cp, 1);
+}
+
+static redisReply *
+cmd_hkeys(command_t *cp)
+{
+    return hash_fields(cp, 0);
+}
+
+static redisReply *
+cmd_sadd(command_t *cp)
+{
+    redisReply	*error = NULL;
+    mockKey	*kp;
+    int		i, added = 0;
+
+    if ((kp = key_lookup(cp->argv[1], MOCK_SET, 1, &error)) == NULL)
+	return error;
+    for (i = 2; i < cp->argc; i++) {
+	if (member_lookup(kp, cp->argv[i], cp->argl[i]) == NULL) {
+	    member_add(kp, cp->argv[i], cp->argl[i]);
+	    added++;
+	}
+    }
+    return reply_integer(added);
+}
+
+static redisReply *
+cmd_smembers(command_t *cp)
+{
+    redisReply	*error = NULL, *reply;
+    member_t	*mp;
+    mockKey	*kp;
+    unsigned int i;
+
+    if ((kp = key_lookup(cp->argv[1], MOCK_SET, 0, &error)) == NULL)
+	return error ? error : reply_array(0);
+    reply = reply_array(kp->count);
+    for (i = 0; i < kp->count; i++) {
+	mp = &kp->members[i];
+	reply_element(reply,
+		reply_string(REDIS_REPLY_STRING, mp->name, mp->namelen));
+    }
+    return reply;
+}
+
+static redisReply *
+cmd_zadd(command_t *cp)
+{
+    redisReply	*error = NULL;
+    member_t	*mp;
+    mockKey	*kp;
+    double	score;
+    char	*end;
+    int		i, added = 0;
+
+    if (cp->argc < 4 || cp->argc % 2)
+	return reply_error("ERR wrong number of arguments for 'zadd'");
+    for (i = 2; i < cp->argc; i += 2) {
+	strtod(cp->argv[i], &end);
+	if (*end != '\0')
+	    return reply_error("ERR value is not a valid float");
+    }
+    if ((kp = key_lookup(cp->argv[1], MOCK_ZSET, 1, &error)) == NULL)
+	return error;
+    for (i = 2; i < cp->argc; i += 2) {
+	score = strtod(cp->argv[i], NULL);
+	if ((mp = member_lookup(kp, cp->argv[i+1], cp->argl[i+1])) == NULL) {
+	    mp = member_add(kp, cp->argv[i+1], cp->argl[i+1]);
+	    added++;
+	}
+	if (mp->score != score)
+	    kp->sorted = 0;
+	mp->score = score;
+    }
+    return reply_integer(added);
+}
+
+/* the LIMIT offset count option, if any, from argument i onward */
+static int
+range_limit(command_t *cp, int i, long *offset, long *count, int *scores)
+{
+    *offset = 0;
+    *count = -1;
+    for (; i < cp->argc; i++) {
+	if (scores && strcasecmp(cp->argv[i], "WITHSCORES") == 0)
+	    *scores = 1;
+	else if (strcasecmp(cp->argv[i], "LIMIT") == 0 && i + 2 < cp->argc) {
+	    *offset = strtol(cp->argv[i+1], NULL, 10);
+	    *count = strtol(cp->argv[i+2], NULL, 10);
+	    i += 2;
+	}
+	else
+	    return -1;
+    }
+    return 0;
+}
+
+/* compare a member to a lexical range limit: "-", "+", "[name" or "(name" */
+static int
+lex_compare(member_t *mp, const char *limit, size_t length, int *inclusive)
+{
+    size_t	n;
+    int		sts;
+
+    *inclusive = (limit[0] == '[');
+    if (limit[0] == '-')
+	return 1;
+    if (limit[0] == '+')
+	return -1;
+    n = length - 1 < mp->namelen ? length - 1 : mp->namelen;
+    if ((sts = memcmp(mp->name, limit + 1, n)) != 0)
+	return sts;
+    return mp->namelen < length - 1 ? -1 : (mp->namelen > length - 1);
+}
+
+static redisReply *
+cmd_zrangebylex(command_t *cp)
+{
+    redisReply	*error = NULL, *reply;
+    member_t	*mp;
+    mockKey	*kp;
+    unsigned int i;
+    long	offset, count, seen = 0;
+    int		c, inclusive;
+
+    if (cp->argc < 4 || range_limit(cp, 4, &offset, &count, NULL) < 0 ||
+	strchr("-+[(", cp->argv[2][0]) == NULL ||
+	strchr("-+[(", cp->argv[3][0]) == NULL)
+	return reply_error("ERR syntax error");
+    if ((kp = key_lookup(cp->argv[1], MOCK_ZSET, 0, &error)) == NULL)
+	return error ? error : reply_array(0);
+    key_sort(kp);
+    reply = reply_array(kp->count);
+    for (i = 0; i < kp->count; i++) {
+	mp = &kp->members[i];
+	c = lex_compare(mp, cp->argv[2], cp->argl[2], &inclusive);
+	if (c < 0 || (c == 0 && !inclusive))
+	    continue;
+	c = lex_compare(mp, cp->argv[3], cp->argl[3], &inclusive);
+	if (c > 0 || (c == 0 && !inclusive))
+	    break;
+	if (seen++ < offset)
+	    continue;
+	if (count >= 0 && (long)reply->elements >= count)
+	    break;
+	reply_element(reply,
+		reply_string(REDIS_REPLY_STRING, mp->name, mp->namelen));
+    }
+    return reply;
+}
+
+/* a score range limit: "+inf", "-inf", "(number" or "number" */
+static double
+score_limit(const char *limit, int *exclusive)
+{
+    if ((*exclusive = (limit[0] == '(')))
+	limit++;
+    if (strcmp(limit, "+inf") == 0 || strcmp(limit, "inf") == 0)
+	return INFINITY;
+    if (strcmp(limit, "-inf") == 0)
+	return -INFINITY;
+    return strtod(limit, NULL);
+}
+
+static redisReply *
+cmd_zrevrangebyscore(command_t *cp)
+{
+    redisReply	*error = NULL, *reply;
+    member_t	*mp;
+    mockKey	*kp;
+    double	max, min;
+    long	offset, count, seen = 0;
+    char	buffer[64];
+    int		i, maxexcl, minexcl, scores = 0, length;
+
+    if (cp->argc < 4 || range_limit(cp, 4, &offset, &count, &scores) < 0)
+	return reply_error("ERR syntax error");
+    max = score_limit(cp->argv[2], &maxexcl);
+    min = score_limit(cp->argv[3], &minexcl);
+    if ((kp = key_lookup(cp->argv[1], MOCK_ZSET, 0, &error)) == NULL)
+	return error ? error : reply_array(0);
+    key_sort(kp);
+    reply = reply_array(kp->count * 2);
+    for (i = kp->count - 1; i >= 0; i--) {
+	mp = &kp->members[i];
+	if (mp->score > max || (maxexcl && mp->score == max))
+	    continue;
+	if (mp->score < min || (minexcl && mp->score == min))
+	    break;
+	if (seen++ < offset)
+	    continue;
+	if (count >= 0 && (long)reply->elements >= count * (scores ? 2 : 1))
+	    break;
+	reply_element(reply,
+		reply_string(REDIS_REPLY_STRING, mp->name, mp->namelen));
+	if (scores) {
+	    length = pmsprintf(buffer, sizeof(buffer), "%.17g", mp->score);
+	    reply_element(reply,
+		reply_string(REDIS_REPLY_STRING, buffer, length));
+	}
+    }
+    return reply;
+}
+
+static redisReply *
+cmd_script(command_t *cp)
+{
+    unsigned int	hash;
+
+    if (cp->argc != 3 || strcasecmp(cp->argv[1], "LOAD") != 0)
+	return reply_error("ERR unknown SCRIPT subcommand");
+    free(script);
+    script = strdup(cp->argv[2]);
+    hash = hash_bytes(cp->argv[2], cp->argl[2], HASH_INIT);
+    pmsprintf(scripthash, sizeof(scripthash), "%08x%08x%08x%08x%08x",
+		hash, hash, hash, hash, hash);
+    return reply_string(REDIS_REPLY_STRING, scripthash, strlen(scripthash));
+}
+
+/*
+ * The string map script: the identifier of a string in a map (hash),
+ * adding it with the next identifier if not already there.
+ */
+static redisReply *
+cmd_evalsha(command_t *cp)
+{
+    redisReply	*error = NULL;
+    member_t	*mp;
+    mockKey	*kp;
+    char	buffer[32];
+    int		length;
+
+    if (script == NULL || strcmp(cp->argv[1], scripthash) != 0)
+	return reply_error("NOSCRIPT No matching script");
+    if (cp->argc != 5 || strcmp(cp->argv[2], "1") != 0)
+	return reply_error("ERR wrong number of arguments for script");
+    if ((kp = key_lookup(cp->argv[3], MOCK_HASH, 1, &error)) == NULL)
+	return error;
+    if ((mp = member_lookup(kp, cp->argv[4], cp->argl[4])) == NULL) {
+	length = pmsprintf(buffer, sizeof(buffer), "%u", kp->count + 1);
+	mp = member_add(kp, cp->argv[4], cp->argl[4]);
+	member_value(mp, buffer, length);
+    }
+    return reply_integer(strtoll(mp->value, NULL, 10));
+}
+
+static mockCommand commands[] = {
+    { "APPEND",			cmd_append },
+    { "EVALSHA",		cmd_evalsha },
+    { "GET",			cmd_get },
+    { "HGET",			cmd_hget },
+    { "HGETALL",		cmd_hgetall },
+    { "HKEYS",			cmd_hkeys },
+    { "HMGET",			cmd_hmget },
+    { "HMSET",			cmd_hmset },
+    { "INCR",			cmd_incr },
+    { "SADD",			cmd_sadd },
+    { "SCRIPT",			cmd_script },
+    { "SET",			cmd_set },
+    { "SMEMBERS",		cmd_smembers },
+    { "ZADD",			cmd_zadd },
+    { "ZRANGEBYLEX",		cmd_zrangebylex },
+    { "ZREVRANGEBYSCORE",	cmd_zrevrangebyscore },
+};
+
+static redisReply *
+execute(command_t *cp)
+{
+    char	msg[128];
+    int		i;
+
+    counts.commands++;
+    for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+	if (strcasecmp(cp->argv[0], commands[i].name) != 0)
+	    continue;
+	commands[i].count++;
+	if (cp->argc < 2)
+	    break;
+	return commands[i].handler(cp);
+    }
+    if (i == sizeof(commands) / sizeof(commands[0])) {
+	pmsprintf(msg, sizeof(msg), "ERR unknown command '%s'", cp->argv[0]);
+	return reply_error(msg);
+    }
+    pmsprintf(msg, sizeof(msg), "ERR wrong number of arguments for '%s'",
+		cp->argv[0]);
+    return reply_error(msg);
+}
+
+/*
+ * Commands are formatted as hiredis does - the format is split into
+ * arguments at spaces, %s and %b (pointer, length) interpolate strings
+ * into the current argument, and other conversions are as for printf.
+ */
+static void
+command_arg(command_t *cp, const char *arg, size_t length)
+{
+    if (cp->argc == MAXARGS) {
+	fprintf(stderr, "redismock: more than %d arguments\n", MAXARGS);
+	exit(1);
+    }
+    if ((cp->argv[cp->argc] = malloc(length + 1)) == NULL) {
+	fprintf(stderr, "redismock: out of memory for argument\n");
+	exit(1);
+    }
+    memcpy(cp->argv[cp->argc], arg, length);
+    cp->argv[cp->argc][length] = '\0';
+    cp->argl[cp->argc++] = length;
+}
+
+static void
+command_free(command_t *cp)
+{
+    int		i;
+
+    for (i = 0; i < cp->argc; i++)
+	free(cp->argv[i]);
+    cp->argc = 0;
+}
+
+typedef struct {
+    char	*buffer;
+    size_t	length;
+    size_t	size;
+} arg_t;
+
+static void
+arg_append(arg_t *ap, const char *bytes, size_t length)
+{
+    if (ap->length + length >= ap->size) {
+	ap->size = (ap->length + length) * 2 + 64;
+	if ((ap->buffer = realloc(ap->buffer, ap->size)) == NULL) {
+	    fprintf(stderr, "redismock: out of memory for argument\n");
+	    exit(1);
+	}
+    }
+    memcpy(ap->buffer + ap->length, bytes, length);
+    ap->length += length;
+}
+
+static int
+command_format(command_t *cp, const char *format, va_list ap)
+{
+    arg_t	arg = { 0 };
+    const char	*p, *s;
+    char	spec[32], number[512];
+    size_t	n;
+    int		longs, touched = 0, len;
+
+    memset(cp, 0, sizeof(*cp));
+    for (p = format; *p; p++) {
+	if (*p == ' ') {
+	    if (touched)
+		command_arg(cp, arg.buffer, arg.length);
+	    arg.length = 0;
+	    touched = 0;
+	    continue;
+	}
+	touched = 1;
+	if (*p != '%' || p[1] == '\0') {
+	    arg_append(&arg, p, 1);
+	    continue;
+	}
+	switch (*++p) {
+	case 's':
+	    s = va_arg(ap, char *);
+	    arg_append(&arg, s, strlen(s));
+	    continue;
+	case 'b':
+	    s = va_arg(ap, char *);
+	    n = va_arg(ap, size_t);
+	    arg_append(&arg, s, n);
+	    continue;
+	case '%':
+	    arg_append(&arg, "%", 1);
+	    continue;
+	}
+
+	/* printf conversion - flags, width, precision, length, type */
+	spec[0] = '%';
+	for (n = 1; *p && strchr("#0-+ 123456789.", *p) && n < 16; n++)
+	    spec[n] = *p++;
+	for (longs = 0; *p == 'l' || *p == 'h'; n++) {
+	    if (*p == 'l')
+		longs++;
+	    spec[n] = *p++;
+	}
+	spec[n++] = *p;
+	spec[n] = '\0';
+	if (*p != '\0' && strchr("diouxXc", *p) != NULL) {
+	    if (longs > 1)
+		len = pmsprintf(number, sizeof(number), spec, va_arg(ap, long long));
+	    else if (longs)
+		len = pmsprintf(number, sizeof(number), spec, va_arg(ap, long));
+	    else
+		len = pmsprintf(number, sizeof(number), spec, va_arg(ap, int));
+	} else if (*p != '\0' && strchr("eEfgGaA", *p) != NULL) {
+	    len = pmsprintf(number, sizeof(number), spec, va_arg(ap, double));
+	} else {
+	    free(arg.buffer);
+	    command_free(cp);
+	    return -1;
+	}
+	arg_append(&arg, number, len);
+    }
+    if (touched)
+	command_arg(cp, arg.buffer, arg.length);
+    free(arg.buffer);
+    return cp->argc ? 0 : -1;
+}
+
+/* a formatted command is in the Redis protocol, as from hiredis */
+static int
+command_encode(command_t *cp, char **target)
+{
+    size_t	length = 32;
+    char	*buffer, *p;
+    int		i;
+
+    for (i = 0; i < cp->argc; i++)
+	length += cp->argl[i] + 32;
+    if ((buffer = malloc(length)) == NULL)
+	return -1;
+    p = buffer + sprintf(buffer, "*%d\r\n", cp->argc);
+    for (i = 0; i < cp->argc; i++) {
+	p += sprintf(p, "$%zu\r\n", cp->argl[i]);
+	memcpy(p, cp->argv[i], cp->argl[i]);
+	p += cp->argl[i];
+	*p++ = '\r';
+	*p++ = '\n';
+    }
+    *target = buffer;
+    return (int)(p - buffer);
+}
+
+static int
+command_decode(command_t *cp, const char *buffer, size_t length)
+{
+    const char	*p = buffer, *end = buffer + length;
+    char	*next;
+    size_t	size;
+    long	i, count;
+
+    memset(cp, 0, sizeof(*cp));
+    if (length < 4 || *p != '*')
+	return -1;
+    count = strtol(p + 1, &next, 10);
+    if (count < 1 || count > MAXARGS || strncmp(next, "\r\n", 2) != 0)
+	return -1;
+    for (p = next + 2, i = 0; i < count; i++) {
+	if (p >= end || *p != '$')
+	    goto fail;
+	size = strtoul(p + 1, &next, 10);
+	if (strncmp(next, "\r\n", 2) != 0 || next + 2 + size + 2 > end)
+	    goto fail;
+	command_arg(cp, next + 2, size);
+	p = next + 2 + size + 2;
+    }
+    return 0;
+
+fail:
+    command_free(cp);
+    return -1;
+}
+
+/*
+ * The hiredis client interfaces
+ */
+static redisContext *
+mock_connect(void)
+{
+    mockContext	*mc;
+
+    if ((mc = (mockContext *)calloc(1, sizeof(mockContext))) == NULL)
+	return NULL;
+    pthread_mutex_lock(&mock_lock);
+    if (keys.hsize == 0)
+	__pmHashInit(&keys);
+    pthread_mutex_unlock(&mock_lock);
+    return &mc->context;
+}
+
+redisContext *
+redisConnectWithTimeout(const char *ip, int port, const struct timeval tv)
+{
+    (void)ip; (void)port; (void)tv;
+    return mock_connect();
+}
+
+redisContext *
+redisConnectUnixWithTimeout(const char *path, const struct timeval tv)
+{
+    (void)path; (void)tv;
+    return mock_connect();
+}
+
+int
+redisSetTimeout(redisContext *c, const struct timeval tv)
+{
+    (void)c; (void)tv;
+    return REDIS_OK;
+}
+
+int
+redisEnableKeepAlive(redisContext *c)
+{
+    (void)c;
+    return REDIS_OK;
+}
+
+void
+redisFree(redisContext *c)
+{
+    mockContext	*mc = (mockContext *)c;
+
+    if (mc == NULL)
+	return;
+    for (; mc->head < mc->count; mc->head++)
+	freeReplyObject(mc->replies[mc->head]);
+    free(mc->replies);
+    free(mc);
+}
+
+/* execute a command, queueing its reply on the context - lock held */
+static void
+mock_queue(mockContext *mc, command_t *cp)
+{
+    redisReply	**replies;
+
+    if (mc->count == mc->size) {
+	mc->size = mc->size ? mc->size * 2 : 64;
+	if ((replies = realloc(mc->replies, mc->size * sizeof(redisReply *))) == NULL) {
+	    fprintf(stderr, "redismock: out of memory for replies\n");
+	    exit(1);
+	}
+	mc->replies = replies;
+    }
+    mc->replies[mc->count++] = execute(cp);
+    if (mc->count - mc->head > counts.depth)
+	counts.depth = mc->count - mc->head;
+    mc->appended++;
+}
+
+int
+redisFormatCommand(char **target, const char *format, ...)
+{
+    command_t	command;
+    va_list	ap;
+    int		sts;
+
+    va_start(ap, format);
+    sts = command_format(&command, format, ap);
+    va_end(ap);
+    if (sts < 0)
+	return -1;
+    sts = command_encode(&command, target);
+    command_free(&command);
+    return sts;
+}
+
+int
+redisAppendFormattedCommand(redisContext *c, const char *cmd, size_t len)
+{
+    command_t	command;
+
+    if (command_decode(&command, cmd, len) < 0)
+	return REDIS_ERR;
+    pthread_mutex_lock(&mock_lock);
+    mock_queue((mockContext *)c, &command);
+    counts.pipelined++;
+    pthread_mutex_unlock(&mock_lock);
+    command_free(&command);
+    return REDIS_OK;
+}
+
+int
+redisvAppendCommand(redisContext *c, const char *format, va_list ap)
+{
+    command_t	command;
+
+    if (command_format(&command, format, ap) < 0)
+	return REDIS_ERR;
+    pthread_mutex_lock(&mock_lock);
+    mock_queue((mockContext *)c, &command);
+    counts.pipelined++;
+    pthread_mutex_unlock(&mock_lock);
+    command_free(&command);
+    return REDIS_OK;
+}
+
+int
+redisAppendCommand(redisContext *c, const char *format, ...)
+{
+    va_list	ap;
+    int		sts;
+
+    va_start(ap, format);
+    sts = redisvAppendCommand(c, format, ap);
+    va_end(ap);
+    return sts;
+}
+
+int
+redisGetReply(redisContext *c, void **reply)
+{
+    mockContext	*mc = (mockContext *)c;
+
+    pthread_mutex_lock(&mock_lock);
+    if (mc->head == mc->count) {
+	pthread_mutex_unlock(&mock_lock);
+	c->err = REDIS_ERR_EOF;
+	pmsprintf(c->errstr, sizeof(c->errstr), "no reply pending");
+	return REDIS_ERR;
+    }
+    if (mc->appended) {		/* sent all since the last read */
+	counts.roundtrips++;
+	mc->appended = 0;
+    }
+    *reply = mc->replies[mc->head++];
+    if (mc->head == mc->count)
+	mc->head = mc->count = 0;
+    pthread_mutex_unlock(&mock_lock);
+    return REDIS_OK;
+}
+
+/* as for hiredis, the reply is the first one queued on the context */
+void *
+redisCommand(redisContext *c, const char *format, ...)
+{
+    command_t	command;
+    va_list	ap;
+    void	*reply;
+    int		sts;
+
+    va_start(ap, format);
+    sts = command_format(&command, format, ap);
+    va_end(ap);
+    if (sts < 0)
+	return NULL;
+    pthread_mutex_lock(&mock_lock);
+    mock_queue((mockContext *)c, &command);
+    counts.synchronous++;
+    pthread_mutex_unlock(&mock_lock);
+    command_free(&command);
+    if (redisGetReply(c, &reply) != REDIS_OK)
+	return NULL;
+    return reply;
+}
+
+/*
+ * Reporting
+ */
+void
+redismock_report(FILE *f)
+{
+    int		i;
+
+    pthread_mutex_lock(&mock_lock);
+    fprintf(f, "%lu commands (%lu pipelined, %lu synchronous) "
+		"in %lu round trips, deepest pipeline %u\n",
+		counts.commands, counts.pipelined, counts.synchronous,
+		counts.roundtrips, counts.depth);
+    for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+	if (commands[i].count)
+	    fprintf(f, "    %s %lu\n", commands[i].name, commands[i].count);
+    if (counts.redundant)
+	fprintf(f, "    %lu HMSET changing nothing\n", counts.redundant);
+    pthread_mutex_unlock(&mock_lock);
+}
+
+void
+redismock_reset(void)
+{
+    int		i;
+
+    pthread_mutex_lock(&mock_lock);
+    memset(&counts, 0, sizeof(counts));
+    for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+	commands[i].count = 0;
+    pthread_mutex_unlock(&mock_lock);
+}
+
+static int
+key_compare(const void *a, const void *b)
+{
+    return strcmp((*(mockKey **)a)->name, (*(mockKey **)b)->name);
+}
+
+static int
+name_compare(const void *a, const void *b)
+{
+    const member_t	*ma = (const member_t *)a;
+    const member_t	*mb = (const member_t *)b;
+    size_t		length = ma->namelen < mb->namelen ? ma->namelen : mb->namelen;
+    int			sts;
+
+    if ((sts = memcmp(ma->name, mb->name, length)) != 0)
+	return sts;
+    return ma->namelen < mb->namelen ? -1 : (ma->namelen > mb->namelen);
+}
+
+/*
+ * Numbers of keys of each type and a checksum of the whole store - the
+ * keys in name order, and the fields and members of each in order too.
+ * The store generation counts batches of updates, not their content,
+ * so its value is left out of the checksum.
+ */
+void
+redismock_summary(FILE *f)
+{
+    mockKey		*kp;
+    member_t		*mp;
+    unsigned int	i, j, types[MOCK_ZSET + 1] = { 0 };
+    unsigned int	hash = HASH_INIT, members = 0;
+    char		score[64];
+
+    pthread_mutex_lock(&mock_lock);
+    qsort(allkeys, nkeys, sizeof(mockKey *), key_compare);
+    for (i = 0; i < nkeys; i++) {
+	kp = allkeys[i];
+	types[kp->type]++;
+	hash = hash_bytes(kp->name, strlen(kp->name) + 1, hash);
+	if (kp->type == MOCK_STRING) {
+	    if (strcmp(kp->name, "pcp:version:generation") != 0)
+		hash = hash_bytes(kp->string, kp->length, hash);
+	    continue;
+	}
+	if (kp->type == MOCK_ZSET)
+	    key_sort(kp);
+	else {
+	    qsort(kp->members, kp->count, sizeof(member_t), name_compare);
+	    kp->sorted = 0;
+	}
+	for (j = 0; j < kp->count; j++) {
+	    mp = &kp->members[j];
+	    hash = hash_bytes(mp->name, mp->namelen + 1, hash);
+	    if (kp->type == MOCK_HASH)
+		hash = hash_bytes(mp->value, mp->length + 1, hash);
+	    else if (kp->type == MOCK_ZSET) {
+		pmsprintf(score, sizeof(score), "%.17g", mp->score);
+		hash = hash_bytes(score, strlen(score) + 1, hash);
+	    }
+	}
+	members += kp->count;
+    }
+    fprintf(f, "%u keys (%u strings, %u hashes, %u sets, %u sorted sets) "
+		"holding %u members, checksum %08x\n", nkeys,
+		types[MOCK_STRING], types[MOCK_HASH], types[MOCK_SET],
+		types[MOCK_ZSET], members, hash);
+    pthread_mutex_unlock(&mock_lock);
+}
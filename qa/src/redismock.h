@@ -0,0 +1,16 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * In-memory stand-in for a Redis server, replacing the hiredis client
+ * routines used by libpcp_web - see redismock.c
+ */
+#ifndef REDISMOCK_H
+#define REDISMOCK_H
+
+#include <stdio.h>
+
+extern void redismock_report(FILE *);	/* commands and round trips */
+extern void redismock_summary(FILE *);	/* keys held, content checksum */
+extern void redismock_reset(void);	/* zero the command counters */
+
+#endif	/* REDISMOCK_H */
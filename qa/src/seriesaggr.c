@@ -0,0 +1,360 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * Check the time series aggregation kernels (libpcp_web aggregate.c)
+ * against simple scalar reference implementations - each reduction of
+ * one series, with and without time buckets, per-second rates, and
+ * reductions across a group of series.
+ */
+
+#include <pcp/pmapi.h>
+#include <math.h>
+#include "query.h"
+#include "aggregate.h"
+
+#define MAXSAMPLES	5000
+#define START		1500000000000000LL	/* usec */
+#define NSERIES		7
+
+static const struct {
+    const char	*name;
+    int		type;
+    double	quantile;
+} functions[] = {
+    { "sum",	N_SUM },
+    { "avg",	N_AVG },
+    { "min",	N_MIN },
+    { "max",	N_MAX },
+    { "count",	N_COUNT },
+    { "quantile(0)",	N_QUANTILE, 0.0 },
+    { "quantile(0.25)",	N_QUANTILE, 0.25 },
+    { "quantile(0.5)",	N_QUANTILE, 0.5 },
+    { "quantile(0.99)",	N_QUANTILE, 0.99 },
+    { "quantile(1)",	N_QUANTILE, 1.0 },
+};
+
+static const long long widths[] = {
+    0, 1000000LL, 7000000LL, 60000000LL, 3600000000LL,
+};
+
+static int
+double_compare(const void *a, const void *b)
+{
+    double	da = *(const double *)a;
+    double	db = *(const double *)b;
+
+    return da < db ? -1 : (da > db ? 1 : 0);
+}
+
+/* the value of one function over values, one at a time */
+static double
+reference(int type, double quantile, double *values, unsigned int count)
+{
+    double		result, rank;
+    unsigned int	i, low;
+
+    switch (type) {
+    case N_MIN:
+	for (result = values[0], i = 1; i < count; i++)
+	    if (values[i] < result)
+		result = values[i];
+	return result;
+    case N_MAX:
+	for (result = values[0], i = 1; i < count; i++)
+	    if (values[i] > result)
+		result = values[i];
+	return result;
+    case N_COUNT:
+	return count;
+    case N_QUANTILE:
+	qsort(values, count, sizeof(double), double_compare);
+	rank = quantile * (count - 1);
+	low = (unsigned int)floor(rank);
+	if (low >= count - 1)
+	    return values[count - 1];
+	return values[low] + (values[low + 1] - values[low]) * (rank - low);
+    default:
+	break;
+    }
+    for (result = 0, i = 0; i < count; i++)
+	result += values[i];
+    return type == N_AVG ? result / count : result;
+}
+
+/* bucket of a timestamp, by division rather than remainder */
+static long long
+reference_bucket(long long width, long long origin, long long stamp)
+{
+    if (width <= 0)
+	return 0;
+    return origin + (long long)floor((double)(stamp - origin) / width) * width;
+}
+
+/* sums may be added in a different order, so allow for rounding */
+static int
+differ(int type, double value, double expected, double magnitude)
+{
+    if (type == N_SUM || type == N_AVG)
+	return fabs(value - expected) > 1e-12 * (magnitude + 1.0);
+    return value != expected;
+}
+
+static int
+check(const char *name, const char *what, const samples_t *result,
+	unsigned int count, long long *stamps, double *values,
+	double *magnitudes, int type)
+{
+    unsigned int	i, bad = 0;
+
+    if (result->count != count) {
+	printf("%s %s: %u results, expected %u\n",
+		name, what, result->count, count);
+	return 1;
+    }
+    for (i = 0; i < count; i++) {
+	if (result->stamps[i] != stamps[i] ||
+	    differ(type, result->values[i], values[i], magnitudes[i])) {
+	    if (bad++ < 5)
+		printf("%s %s: result %u at %lld is %.17g,"
+			" expected %.17g at %lld\n", name, what, i,
+			result->stamps[i], result->values[i],
+			values[i], stamps[i]);
+	}
+    }
+    if (bad)
+	printf("%s %s: %u of %u results wrong\n", name, what, bad, count);
+    return bad != 0;
+}
+
+/*
+ * Irregularly spaced samples, with runs of equal values, negative
+ * values, large and small magnitudes, and gaps spanning buckets.
+ */
+static void
+generate(samples_t *sp, int seed, unsigned int count)
+{
+    long long		stamp = START + seed * 333333LL;
+    double		value = 0;
+    unsigned int	i;
+
+    srandom(seed);
+    for (i = 0; i < count; i++) {
+	stamp += 100000 + random() % 2000000;
+	if (random() % 50 == 0)
+	    stamp += random() % 600000000LL;
+	if (random() % 4)
+	    value = (double)(random() % 20001 - 10000) / 8;
+	if (random() % 97 == 0)
+	    value *= 1e9;
+	samples_append(sp, stamp, value);
+    }
+}
+
+/* reduce one series, each bucket collected and reduced by reference */
+static int
+check_reduce(samples_t *in, int f, long long width, long long origin)
+{
+    function_t		function = { 0 };
+    samples_t		out = { 0 };
+    double		expect[MAXSAMPLES], magnitude[MAXSAMPLES];
+    double		values[MAXSAMPLES];
+    long long		stamps[MAXSAMPLES], start;
+    unsigned int	i, j, n, count = 0;
+    char		what[64];
+    int			sts;
+
+    function.type = functions[f].type;
+    function.quantile = functions[f].quantile;
+    function.width = width;
+    function.origin = origin;
+    if ((sts = samples_reduce(&function, in, &out)) < 0) {
+	printf("samples_reduce %s: %s\n", functions[f].name, pmErrStr(sts));
+	return 1;
+    }
+
+    for (i = 0; i < in->count; i = j) {
+	start = reference_bucket(width, origin, in->stamps[i]);
+	magnitude[count] = 0;
+	for (j = i, n = 0; j < in->count; j++, n++) {
+	    if (reference_bucket(width, origin, in->stamps[j]) != start)
+		break;
+	    values[n] = in->values[j];
+	    magnitude[count] += fabs(values[n]);
+	}
+	stamps[count] = width > 0 ? start : in->stamps[j-1];
+	expect[count++] = reference(function.type, function.quantile, values, n);
+    }
+
+    pmsprintf(what, sizeof(what), "width %llds", width / 1000000);
+    sts = check(functions[f].name, what, &out, count, stamps, expect,
+		magnitude, function.type);
+    samples_free(&out);
+    return sts;
+}
+
+/* per-second rates, skipping counter drops */
+static int
+check_rate(samples_t *in)
+{
+    samples_t		copy = { 0 };
+    double		expect[MAXSAMPLES], magnitude[MAXSAMPLES];
+    long long		stamps[MAXSAMPLES];
+    unsigned int	i, count = 0;
+    int			sts;
+
+    for (i = 0; i < in->count; i++)
+	samples_append(&copy, in->stamps[i], in->values[i]);
+    samples_rate(&copy);
+
+    for (i = 1; i < in->count; i++) {
+	if (in->values[i] < in->values[i-1])
+	    continue;
+	stamps[count] = in->stamps[i];
+	magnitude[count] = 0;
+	expect[count++] = (in->values[i] - in->values[i-1]) * 1000000.0 /
+		(in->stamps[i] - in->stamps[i-1]);
+    }
+    sts = check("rate", "per second", &copy, count, stamps, expect,
+		magnitude, N_RATE);
+    samples_free(&copy);
+    return sts;
+}
+
+/* every sample of a group of series, ordered by bucket then by time */
+typedef struct {
+    long long	bucket;
+    long long	stamp;
+    double	value;
+} point_t;
+
+static int
+point_compare(const void *a, const void *b)
+{
+    const point_t	*pa = (const point_t *)a;
+    const point_t	*pb = (const point_t *)b;
+
+    if (pa->bucket != pb->bucket)
+	return pa->bucket < pb->bucket ? -1 : 1;
+    if (pa->stamp != pb->stamp)
+	return pa->stamp < pb->stamp ? -1 : 1;
+    return 0;
+}
+
+/* reduce across a group of series, each bucket collected by reference */
+static int
+check_group(samples_t *series, int f, long long width)
+{
+    function_t		function = { 0 };
+    group_t		group = { 0 };
+    samples_t		out = { 0 };
+    point_t		points[NSERIES * MAXSAMPLES / 8];
+    double		expect[MAXSAMPLES], magnitude[MAXSAMPLES];
+    double		values[NSERIES * MAXSAMPLES / 8];
+    long long		stamps[MAXSAMPLES];
+    unsigned int	s, i, j, n, npoints = 0, count = 0;
+    char		what[64];
+    int			sts;
+
+    function.type = functions[f].type;
+    function.quantile = functions[f].quantile;
+    function.width = width;
+    for (s = 0; s < NSERIES; s++) {
+	if ((sts = group_add(&group, &function, &series[s])) < 0) {
+	    printf("group_add %s: %s\n", functions[f].name, pmErrStr(sts));
+	    return 1;
+	}
+	for (i = 0; i < series[s].count; i++, npoints++) {
+	    points[npoints].bucket =
+		    reference_bucket(width, 0, series[s].stamps[i]);
+	    points[npoints].stamp = series[s].stamps[i];
+	    points[npoints].value = series[s].values[i];
+	}
+    }
+    if ((sts = group_reduce(&group, &function, &out)) < 0) {
+	printf("group_reduce %s: %s\n", functions[f].name, pmErrStr(sts));
+	group_free(&group);
+	return 1;
+    }
+
+    qsort(points, npoints, sizeof(point_t), point_compare);
+    for (i = 0; i < npoints; i = j) {
+	magnitude[count] = 0;
+	for (j = i, n = 0; j < npoints; j++, n++) {
+	    if (points[j].bucket != points[i].bucket)
+		break;
+	    values[n] = points[j].value;
+	    magnitude[count] += fabs(values[n]);
+	}
+	stamps[count] = width > 0 ? points[i].bucket : points[j-1].stamp;
+	expect[count++] = reference(function.type, function.quantile, values, n);
+    }
+
+    pmsprintf(what, sizeof(what), "group width %llds", width / 1000000);
+    sts = check(functions[f].name, what, &out, count, stamps, expect,
+		magnitude, function.type);
+    samples_free(&out);
+    group_free(&group);
+    return sts;
+}
+
+int
+main(int argc, char **argv)
+{
+    static const unsigned int	counts[] = { 1, 2, 3, 4, 5, 8, 13, 1000, MAXSAMPLES };
+    static const double		small[] = { 3, -1, 4, 1, -5, 9, 2, 6, 5 };
+    samples_t			in = { 0 }, series[NSERIES];
+    unsigned int		c, w, f, i, nwidths, nfunctions, ncounts;
+    int				bad = 0;
+
+    pmSetProgname(argv[0]);
+    nwidths = sizeof(widths) / sizeof(widths[0]);
+    nfunctions = sizeof(functions) / sizeof(functions[0]);
+    ncounts = sizeof(counts) / sizeof(counts[0]);
+
+    /* a few values worked by hand, one bucket */
+    for (i = 0; i < sizeof(small) / sizeof(small[0]); i++)
+	samples_append(&in, START + i * 1000000LL, small[i]);
+    for (f = 0; f < nfunctions; f++) {
+	function_t	function = { functions[f].type, functions[f].quantile };
+	samples_t	out = { 0 };
+
+	samples_reduce(&function, &in, &out);
+	printf("%s of 3 -1 4 1 -5 9 2 6 5: %g\n",
+		functions[f].name, out.values[0]);
+	samples_free(&out);
+    }
+    samples_rate(&in);
+    printf("rate:");
+    for (i = 0; i < in.count; i++)
+	printf(" %g", in.values[i]);
+    putchar('\n');
+    samples_free(&in);
+
+    for (c = 0; c < ncounts; c++) {
+	generate(&in, c + 1, counts[c]);
+	for (f = 0; f < nfunctions; f++)
+	    for (w = 0; w < nwidths; w++) {
+		bad += check_reduce(&in, f, widths[w], 0);
+		bad += check_reduce(&in, f, widths[w], START + 250000);
+		/* aligned to a time after the samples */
+		bad += check_reduce(&in, f, widths[w], START + (1LL << 42));
+	    }
+	bad += check_rate(&in);
+	samples_free(&in);
+    }
+    printf("series reductions: %u sample counts, %u functions, %u widths, "
+	    "%d failed\n", ncounts, nfunctions, nwidths, bad);
+
+    bad = 0;
+    memset(series, 0, sizeof(series));
+    for (i = 0; i < NSERIES; i++)
+	generate(&series[i], 100 + i, MAXSAMPLES / 8 - i * 37);
+    for (f = 0; f < nfunctions; f++)
+	for (w = 0; w < nwidths; w++)
+	    bad += check_group(series, f, widths[w]);
+    for (i = 0; i < NSERIES; i++)
+	samples_free(&series[i]);
+    printf("group reductions: %u series, %u functions, %u widths, "
+	    "%d failed\n", NSERIES, nfunctions, nwidths, bad);
+    return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * Exercise the time series query index cache (libpcp_web cache.c) -
+ * hits and misses, least recently used eviction, terms too large to
+ * cache, and the cache emptied once for each new store generation.
+ * The optional argument sets PCP_SERIES_CACHE.
+ */
+
+#include <pcp/pmapi.h>
+#include <pcp/series.h>
+#include "cache.h"
+
+static char	ids[16 * PMSIDSZ + 1];
+
+static void
+report(const char *step)
+{
+    cacheStats	stats;
+
+    index_cache_stats(&stats);
+    printf("%-28s %llu hits, %llu misses, %llu inserts, %llu evictions, "
+	    "%llu flushes, %u entries, %u of %u series\n", step,
+	    stats.hits, stats.misses, stats.inserts, stats.evictions,
+	    stats.flushes, stats.entries, stats.series, stats.limit);
+}
+
+/* count identifiers, each PMSIDSZ characters of the term's initial */
+static void
+insert(unsigned long long generation, const char *term, unsigned int count)
+{
+    char	step[64];
+
+    memset(ids, term[0], count * PMSIDSZ);
+    index_cache_insert(generation, "metric.name", term, ids, count);
+    pmsprintf(step, sizeof(step), "insert %s (%u) gen %llu",
+		term, count, generation);
+    report(step);
+}
+
+static void
+lookup(unsigned long long generation, const char *term)
+{
+    unsigned int	i, count = 0;
+    char		step[64], *found = NULL;
+    int			bad = 0;
+
+    if (index_cache_lookup(generation, "metric.name", term, &found, &count)) {
+	for (i = 0; i < count * PMSIDSZ; i++)
+	    if (found[i] != term[0])
+		bad++;
+	free(found);
+    }
+    pmsprintf(step, sizeof(step), "lookup %s gen %llu%s",
+		term, generation, bad ? " (corrupt)" : "");
+    report(step);
+}
+
+int
+main(int argc, char **argv)
+{
+    pmSetProgname(argv[0]);
+    if (argc > 1)
+	setenv("PCP_SERIES_CACHE", argv[1], 1);
+
+    printf("limit per term %u\n", index_cache_limit());
+
+    insert(1, "a", 5);
+    lookup(1, "a");
+    lookup(1, "b");
+    insert(1, "b", 10);
+    insert(1, "c", 10);
+    insert(1, "d", 10);
+    lookup(1, "a");		/* now the most recently used */
+    insert(1, "e", 8);		/* so "b" is evicted, not "a" */
+    lookup(1, "b");
+    lookup(1, "a");
+    insert(1, "f", 11);		/* too many identifiers for one term */
+    lookup(1, "f");
+    insert(1, "a", 5);		/* already cached */
+
+    lookup(2, "a");		/* a new generation empties the cache */
+    lookup(2, "c");
+    lookup(3, "c");		/* and again, though nothing to drop */
+    insert(3, "c", 10);
+    insert(4, "d", 10);
+    lookup(4, "c");
+    return 0;
+}
@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * Round trip values of every numeric type through the time series chunk
+ * encoder and decoder (libpcp_web chunk.c) - single sample chunks, signed
+ * zeros, NaN and infinities, counter wrap, irregular timestamps and many
+ * blocks appended to one chunk, then truncated and empty chunks.
+ */
+
+#include <pcp/pmapi.h>
+#include <math.h>
+#include <limits.h>
+#include "chunk.h"
+
+#define MAXSAMPLES	20000
+#define START		1500000000000000LL	/* usec */
+
+typedef struct {
+    int		type;
+    int		count;			/* samples decoded so far */
+    int		bad;			/* mismatched samples */
+    int		verbose;		/* report each sample */
+    long long	stamp[MAXSAMPLES];
+    pmAtomValue	atom[MAXSAMPLES];
+} expect_t;
+
+static expect_t	expect;
+
+static size_t
+atom_size(int type)
+{
+    switch (type) {
+    case PM_TYPE_32:
+    case PM_TYPE_U32:
+	return sizeof(__int32_t);
+    case PM_TYPE_FLOAT:
+	return sizeof(float);
+    default:
+	break;
+    }
+    return sizeof(__int64_t);
+}
+
+static void
+print_atom(int type, pmAtomValue *atom)
+{
+    switch (type) {
+    case PM_TYPE_32:
+	printf("%d", atom->l);
+	break;
+    case PM_TYPE_U32:
+	printf("%u", atom->ul);
+	break;
+    case PM_TYPE_64:
+	printf("%lld", (long long)atom->ll);
+	break;
+    case PM_TYPE_U64:
+	printf("%llu", (unsigned long long)atom->ull);
+	break;
+    case PM_TYPE_FLOAT:
+	printf("%.9g", (double)atom->f);
+	break;
+    case PM_TYPE_DOUBLE:
+	printf("%.17g", atom->d);
+	break;
+    }
+}
+
+static int
+compare(long long stamp, int type, pmAtomValue *atom, void *arg)
+{
+    expect_t	*ep = (expect_t *)arg;
+    int		i = ep->count++;
+
+    if (i >= MAXSAMPLES) {
+	printf("  sample %d: beyond those encoded\n", i);
+	ep->bad++;
+	return -E2BIG;
+    }
+    if (type != ep->type || stamp != ep->stamp[i] ||
+	memcmp(atom, &ep->atom[i], atom_size(type)) != 0) {
+	printf("  sample %d: type %d stamp %lld value ", i, type, stamp);
+	print_atom(type, atom);
+	printf(", expected type %d stamp %lld value ", ep->type, ep->stamp[i]);
+	print_atom(ep->type, &ep->atom[i]);
+	putchar('\n');
+	ep->bad++;
+    }
+    else if (ep->verbose) {
+	printf("  %lld.%06lld ", stamp / 1000000, stamp % 1000000);
+	print_atom(type, atom);
+	putchar('\n');
+    }
+    return 0;
+}
+
+/*
+ * Encode the expected samples as a chunk, starting a new block every
+ * blocksize samples (as each load appends one), and check the decoded
+ * samples match them exactly.
+ */
+static void
+roundtrip(const char *name, int type, int count, int blocksize, int verbose)
+{
+    chunk_t	*cp = NULL;
+    char	*data = NULL;
+    size_t	length = 0, size;
+    int		i, blocks = 0, sts;
+
+    printf("%s %s: ", name, pmTypeStr(type));
+    for (i = 0; i < count || (count == 0 && blocks == 0); i++) {
+	if (cp == NULL && (cp = chunk_init(type, START / 1000000)) == NULL) {
+	    printf("chunk_init failed\n");
+	    exit(1);
+	}
+	if (i < count &&
+	    (sts = chunk_append(cp, expect.stamp[i], &expect.atom[i])) < 0) {
+	    printf("chunk_append failed: %s\n", pmErrStr(sts));
+	    exit(1);
+	}
+	if ((i + 1) % blocksize == 0 || i >= count - 1) {
+	    size = chunk_finish(cp);
+	    if ((data = realloc(data, length + size)) == NULL) {
+		printf("realloc %zu failed\n", length + size);
+		exit(1);
+	    }
+	    memcpy(data + length, cp->buffer, size);
+	    length += size;
+	    chunk_free(cp);
+	    cp = NULL;
+	    blocks++;
+	}
+    }
+
+    printf("%d samples in %d blocks\n", count, blocks);
+    expect.type = type;
+    expect.count = expect.bad = 0;
+    expect.verbose = verbose;
+    sts = chunk_decode(data, length, compare, &expect);
+    if (sts != count || expect.count != count || expect.bad)
+	printf("  decoded %d (%d calls), %d mismatched\n",
+		sts, expect.count, expect.bad);
+    if (count > 0) {
+	/* a block cut short must be rejected, never over-read */
+	expect.count = expect.bad = 0;
+	expect.verbose = 0;
+	sts = chunk_decode(data, length - 1, compare, &expect);
+	printf("  truncated: %s\n", sts < 0 ? pmErrStr(sts) : "not detected");
+    }
+    free(data);
+}
+
+static void
+sample(int i, long long stamp)
+{
+    memset(&expect.atom[i], 0, sizeof(pmAtomValue));
+    expect.stamp[i] = stamp;
+}
+
+static int
+single(int type)
+{
+    sample(0, START);
+    switch (type) {
+    case PM_TYPE_32: expect.atom[0].l = -42; break;
+    case PM_TYPE_U32: expect.atom[0].ul = 42; break;
+    case PM_TYPE_64: expect.atom[0].ll = -4200000000LL; break;
+    case PM_TYPE_U64: expect.atom[0].ull = 4200000000ULL; break;
+    case PM_TYPE_FLOAT: expect.atom[0].f = 0.25; break;
+    case PM_TYPE_DOUBLE: expect.atom[0].d = 1.0e-300; break;
+    }
+    return 1;
+}
+
+/* the same values repeated, then signed zeros, NaN and infinities */
+static int
+special(int type)
+{
+    static const double	values[] = {
+	0.0, -0.0, -0.0, 0.0, 1.5, NAN, NAN, 1.5, INFINITY, -INFINITY, -0.0,
+    };
+    int			i, n = sizeof(values) / sizeof(values[0]);
+
+    for (i = 0; i < n; i++) {
+	sample(i, START + i * 1000000LL);
+	if (type == PM_TYPE_FLOAT)
+	    expect.atom[i].f = (float)values[i];
+	else
+	    expect.atom[i].d = values[i];
+    }
+    return n;
+}
+
+/* counters approaching the largest value of the type, then wrapping */
+static int
+wrap(int type)
+{
+    int		i, n = 8;
+
+    for (i = 0; i < n; i++) {
+	sample(i, START + i * 1000000LL);
+	switch (type) {
+	case PM_TYPE_32:
+	    expect.atom[i].l = (__int32_t)(INT_MAX - 4U + i * 2U);
+	    break;
+	case PM_TYPE_U32:
+	    expect.atom[i].ul = UINT_MAX - 4U + i * 2U;
+	    break;
+	case PM_TYPE_64:
+	    expect.atom[i].ll = (__int64_t)(LLONG_MAX - 4ULL + i * 2ULL);
+	    break;
+	case PM_TYPE_U64:
+	    expect.atom[i].ull = ULLONG_MAX - 4ULL + i * 2ULL;
+	    break;
+	}
+    }
+    return n;
+}
+
+/*
+ * Mostly regular samples with jitter, occasional gaps large enough to
+ * need each size of delta-of-delta encoding, and values that change
+ * a few bits, many bits or not at all.
+ */
+static int
+irregular(int type, int n)
+{
+    long long	stamp = START;
+    int		i;
+
+    srandom(type + 1);
+    for (i = 0; i < n; i++) {
+	stamp += 1000000;
+	if (i % 7 == 0)
+	    stamp += (random() % 5000) - 2500;
+	if (i % 101 == 0)
+	    stamp += random() % 600000000;
+	if (i % 997 == 0)
+	    stamp += 1LL << 40;
+	sample(i, stamp);
+	switch (type) {
+	case PM_TYPE_32:
+	    expect.atom[i].l = (i % 3) ? i * 7 - 50000 : -i;
+	    break;
+	case PM_TYPE_U32:
+	    expect.atom[i].ul = (i % 5) ? i * 1000U : (unsigned int)random();
+	    break;
+	case PM_TYPE_64:
+	    expect.atom[i].ll = -(long long)i * 123456789LL;
+	    break;
+	case PM_TYPE_U64:
+	    expect.atom[i].ull = ((unsigned long long)random() << 33) | i;
+	    break;
+	case PM_TYPE_FLOAT:
+	    expect.atom[i].f = (i % 4) ? sinf(i) * 100 : 1.0;
+	    break;
+	case PM_TYPE_DOUBLE:
+	    expect.atom[i].d = (i % 10) ? i * 0.25 : 1e300;
+	    break;
+	}
+    }
+    return n;
+}
+
+int
+main(int argc, char **argv)
+{
+    static const int	types[] = {
+	PM_TYPE_32, PM_TYPE_U32, PM_TYPE_64, PM_TYPE_U64,
+	PM_TYPE_FLOAT, PM_TYPE_DOUBLE,
+    };
+    int			i, n, ntypes = sizeof(types) / sizeof(types[0]);
+
+    pmSetProgname(argv[0]);
+
+    for (i = 0; i < ntypes; i++) {
+	n = single(types[i]);
+	roundtrip("single", types[i], n, n, 1);
+    }
+    for (i = 0; i < ntypes; i++) {
+	if (types[i] == PM_TYPE_FLOAT || types[i] == PM_TYPE_DOUBLE)
+	    continue;
+	n = wrap(types[i]);
+	roundtrip("wrap", types[i], n, n, 1);
+    }
+    n = special(PM_TYPE_FLOAT);
+    roundtrip("special", PM_TYPE_FLOAT, n, n, 1);
+    n = special(PM_TYPE_DOUBLE);
+    roundtrip("special", PM_TYPE_DOUBLE, n, n, 1);
+    /* special values split across blocks, each starting afresh */
+    roundtrip("special", PM_TYPE_DOUBLE, n, 3, 0);
+
+    for (i = 0; i < ntypes; i++) {
+	n = irregular(types[i], MAXSAMPLES);
+	roundtrip("irregular", types[i], n, MAXSAMPLES / 3, 0);
+    }
+
+    /* a block with no samples decodes to nothing */
+    roundtrip("empty", PM_TYPE_DOUBLE, 0, 1, 0);
+    return 0;
+}
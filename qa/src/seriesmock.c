@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * Load archives into, and run time series queries against, the in-memory
+ * Redis stand-in of redismock.c, using the libpcp_web pmSeries interfaces.
+ * Each argument is one step, done in order:
+ *
+ *	load:ARCHIVE	load an archive, or a directory of them
+ *	query:QUERY	run a query, reporting matching series and values
+ *	get:KEY		report the value of a string key
+ *	report		report (and reset) the command counters
+ *	summary		report the keys held, and a store checksum
+ */
+
+#include <pcp/pmapi.h>
+#include <pcp/series.h>
+#include <hiredis/hiredis.h>
+#include "redismock.h"
+
+static int	done_status;
+
+static void
+on_info(pmseries_level level, const char *message, void *arg)
+{
+    printf("[%s] %s\n", pmSeriesLevelStr(level), message);
+}
+
+static int
+on_match(pmSeriesID *sid, void *arg)
+{
+    printf("match %s\n", sid->name);
+    return 0;
+}
+
+static int
+on_value(pmSeriesID *sid, const char *stamp, const char *value, void *arg)
+{
+    printf("value %s %s %s\n", sid->name, stamp, value);
+    return 0;
+}
+
+static void
+on_done(int sts, void *arg)
+{
+    done_status = sts;
+}
+
+static pmSeriesSettings settings = {
+    .on_match = on_match,
+    .on_value = on_value,
+    .on_info = on_info,
+    .on_done = on_done,
+};
+
+static void
+get(const char *key)
+{
+    struct timeval	timeout = { 1, 0 };
+    redisContext	*redis;
+    redisReply		*reply;
+
+    redis = redisConnectWithTimeout("localhost", 6379, timeout);
+    reply = redisCommand(redis, "GET %s", key);
+    if (reply && reply->type == REDIS_REPLY_STRING)
+	printf("%s = %s\n", key, reply->str);
+    else
+	printf("%s not found\n", key);
+    freeReplyObject(reply);
+    redisFree(redis);
+}
+
+int
+main(int argc, char **argv)
+{
+    char	query[MAXPATHLEN + 64];
+    char	*arg;
+    int		c, sts, errflag = 0;
+
+    pmSetProgname(argv[0]);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    while ((c = getopt(argc, argv, "D:")) != EOF) {
+	switch (c) {
+	case 'D':
+	    if ((sts = pmSetDebug(optarg)) < 0) {
+		fprintf(stderr, "%s: unrecognized debug options specification (%s)\n",
+			pmGetProgname(), optarg);
+		errflag++;
+	    }
+	    break;
+	case '?':
+	default:
+	    errflag++;
+	    break;
+	}
+    }
+    if (errflag || optind == argc) {
+	fprintf(stderr, "Usage: %s [-D debug] step ...\n"
+		"steps: load:ARCHIVE query:QUERY get:KEY report summary\n",
+		pmGetProgname());
+	exit(1);
+    }
+
+    for (; optind < argc; optind++) {
+	arg = argv[optind];
+	done_status = 0;
+	if (strncmp(arg, "load:", 5) == 0) {
+	    printf("== load %s\n", arg + 5);
+	    pmsprintf(query, sizeof(query),
+			"{source.archive == \"%s\"}[finish: \"@2030\"]", arg + 5);
+	    pmSeriesLoad(&settings, query, 0, NULL);
+	}
+	else if (strncmp(arg, "query:", 6) == 0) {
+	    printf("== query %s\n", arg + 6);
+	    pmSeriesQuery(&settings, arg + 6, 0, NULL);
+	}
+	else if (strncmp(arg, "get:", 4) == 0)
+	    get(arg + 4);
+	else if (strcmp(arg, "report") == 0) {
+	    redismock_report(stdout);
+	    redismock_reset();
+	}
+	else if (strcmp(arg, "summary") == 0)
+	    redismock_summary(stdout);
+	else {
+	    fprintf(stderr, "%s: unknown step \"%s\"\n", pmGetProgname(), arg);
+	    exit(1);
+	}
+	if (done_status < 0)
+	    printf("failed: %s\n", pmErrStr(done_status));
+    }
+    return 0;
+}
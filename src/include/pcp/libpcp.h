@@ -412,6 +412,15 @@ PCP_CALL extern __pmPDU *__pmFindPDUBuf(int);
 PCP_CALL extern void __pmPinPDUBuf(void *);
 PCP_CALL extern int __pmUnpinPDUBuf(void *);
 PCP_CALL extern void __pmCountPDUBuf(int, int *, int *);
+typedef struct {
+    int			size;	/* buffer size for this size class */
+    unsigned long	hit;	/* allocations satisfied from a free list */
+    unsigned long	miss;	/* allocations requiring a new slab */
+    unsigned long	trim;	/* idle slabs returned to the heap */
+    int			inuse;	/* buffers currently pinned */
+    int			free;	/* buffers available for reuse */
+} __pmPDUBufStat;
+PCP_CALL extern int __pmPDUBufStats(int, __pmPDUBufStat *, int *);
 PCP_DATA extern unsigned int *__pmPDUCntIn;
 PCP_DATA extern unsigned int *__pmPDUCntOut;
 PCP_CALL extern void __pmSetPDUCntBuf(unsigned *, unsigned *);
@@ -755,6 +764,13 @@ typedef struct {
     __pmLogTI	*l_ti;		/* (when reading) temporal index */
     struct __pmnsTree	*l_pmns;        /* namespace from meta data */
     int		l_multi;	/* part of a multi-archive context */
+    int		l_numseek;	/* (when reading) no. seek table entries, */
+				/*   0 if not set up yet, -1 if unusable */
+    __pmLogTI	*l_seek;	/* (when reading) seek table, either a */
+				/*   dense table or l_ti */
+    int		l_colstate;	/* (when reading) columnar sidecar, 0 if */
+				/*   not looked for yet, -1 if none */
+    struct __pmLogColumns *l_columns; /* (when reading) columnar sidecar */
 } __pmLogCtl;
 
 /* l_state values */
@@ -797,6 +813,13 @@ typedef struct {
     int			ac_num_logs;	/* The number of archives */
     int			ac_cur_log;	/* The currently open archive */
     __pmMultiLogCtl	**ac_log_list;	/* Current set of archives */
+    /*
+     * Last key record decoded for delta result records (PM_LOG_DELTA)
+     */
+    pmResult		*ac_key;	/* full result of the key record */
+    int			ac_key_arch;	/* ... in this archive (ac_cur_log) */
+    int			ac_key_vol;	/* ... and volume */
+    long		ac_key_offset;	/* ... at this offset */
 } __pmArchCtl;
 
 /*
@@ -842,6 +865,15 @@ PCP_CALL extern int __pmLogLoadLabel(__pmArchCtl *, const char *);
 PCP_CALL extern int __pmLogLoadMeta(__pmArchCtl *);
 #define PMLOGREAD_NEXT		0
 #define PMLOGREAD_TO_EOF	1
+/*
+ * Delta result records in archive data volumes (pmlogger -d) have
+ * PM_LOG_DELTA set in numpmid, vset[0] is a header (pmid PM_ID_NULL,
+ * one insitu value holding the offset of the key record, a full result
+ * earlier in the same volume) and the other vsets hold only the values
+ * that differ from the key record.  __pmLogRead() returns full results.
+ */
+#define PM_LOG_DELTA		0x80000000
+PCP_CALL extern int __pmEncodeDeltaResult(int, const pmResult *, __pmPDU **);
 PCP_CALL extern int __pmLogRead(__pmArchCtl *, int, __pmFILE *, pmResult **, int);
 PCP_CALL extern int __pmLogRead_ctx(__pmContext *, int, __pmFILE *, pmResult **, int);
 PCP_CALL extern int __pmLogChangeVol(__pmArchCtl *, int);
@@ -857,6 +889,7 @@ PCP_CALL extern int __pmLogNameInDom(__pmArchCtl *, pmInDom, pmTimeval *, int, c
 PCP_CALL extern const char *__pmLogLocalSocketDefault(int, char *buf, size_t bufSize);
 PCP_CALL extern const char *__pmLogLocalSocketUser(int, char *buf, size_t bufSize);
 PCP_CALL extern char *__pmLogBaseName(char *);
+PCP_CALL extern int __pmLogWriteColumns(const char *, FILE *);
 PCP_DATA extern int __pmLogReads;
 
 /* Convert opaque context handle to __pmContext pointer */
@@ -121,13 +121,38 @@ static int		gotmyhostid;
 static __pmHostEnt	*myhostid;
 static char		myhostname[MAXHOSTNAMELEN+1];
 
+#ifdef PM_MULTI_THREAD
+static pthread_mutex_t	access_lock;
+#else
+void			*access_lock;
+#endif
+
+#if defined(PM_MULTI_THREAD) && defined(PM_MULTI_THREAD_DEBUG)
 /*
- * Always called with __pmLock_libpcp already held, so accessing
+ * return true if lock == access_lock
+ */
+int
+__pmIsAccessLock(void *lock)
+{
+    return lock == (void *)&access_lock;
+}
+#endif
+
+void
+init_access_lock(void)
+{
+    __pmInitMutex(&access_lock);
+}
+
+/*
+ * Always called with access_lock already held, so accessing
  * gotmyhostid, myhostname, myhostid are all thread-safe.
  */
 static int
 getmyhostid(void)
 {
+    PM_ASSERT_IS_LOCKED(access_lock);
+
     if (gethostname(myhostname, MAXHOSTNAMELEN) < 0) {
 	pmNotifyErr(LOG_ERR, "gethostname failure\n");
 	return -1;
@@ -792,8 +817,11 @@ getHostAccessSpecs(const char *name, int *sts)
     /* Assume we have a host name or address. Resolve it and contruct a list containing all of the
        resolved addresses. If the name is "localhost", then resolve using the actual host name. */
     if (strcasecmp(name, "localhost") == 0) {
+	PM_INIT_LOCKS();
+	PM_LOCK(access_lock);
 	if (!gotmyhostid) {
 	    if (getmyhostid() < 0) {
+		PM_UNLOCK(access_lock);
 		pmNotifyErr(LOG_ERR, "Can't get host name/IP address, giving up\n");
 		*sts = -EHOSTDOWN;
 		if (specs)
@@ -801,6 +829,7 @@ getHostAccessSpecs(const char *name, int *sts)
 		return NULL;	/* should never happen! */
 	    }
 	}
+	PM_UNLOCK(access_lock);
 	realname = myhostname;
     }
     else
@@ -1283,16 +1312,16 @@ getClientIds(const __pmSockAddr *hostid, int *sts)
      * consistently. First get the real host address;
      */
     PM_INIT_LOCKS();
-    PM_LOCK(__pmLock_libpcp);
+    PM_LOCK(access_lock);
     if (!gotmyhostid)
 	getmyhostid();
 
     *sts = PM_ERR_PERMISSION;
     if (gotmyhostid <= 0) {
-	PM_UNLOCK(__pmLock_libpcp);
+	PM_UNLOCK(access_lock);
 	return NULL;
     }
-    PM_UNLOCK(__pmLock_libpcp);
+    PM_UNLOCK(access_lock);
 
     /* Now construct a list containing each address. Check for the end of the list within the
        loop since we need to add an empty entry and the code to grow the list is within the
@@ -21,6 +21,9 @@
 #ifdef HAVE_IPHLPAPI_H
 #include <iphlpapi.h>
 #endif
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
 #define SOCKET_INTERNAL
 #include "internal.h"
 
@@ -1388,6 +1391,33 @@ __pmNextIpv6SubnetAddr(unsigned char *addr, int maskBits)
     return addr;
 }
 
+/*
+ * Wait for a single descriptor to become readable.  Prefer poll(2) as
+ * select(2) cannot cope with descriptors at or above FD_SETSIZE, which
+ * a busy server (e.g. pmcd with thousands of clients) will hand out.
+ */
+int
+__pmSocketWaitRead(int fd, struct timeval *timeout)
+{
+#ifdef HAVE_POLL_H
+    struct pollfd	onefd;
+    int			msec = -1;
+
+    if (timeout != NULL)
+	msec = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+    onefd.fd = fd;
+    onefd.events = POLLIN;
+    onefd.revents = 0;
+    return poll(&onefd, 1, msec);
+#else
+    __pmFdSet	onefd;
+
+    FD_ZERO(&onefd);
+    FD_SET(fd, &onefd);
+    return select(fd+1, &onefd, NULL, NULL, timeout);
+#endif
+}
+
 #if !defined(HAVE_SECURE_SOCKETS)
 
 void
@@ -1552,11 +1582,7 @@ __pmRecv(int socket, void *buffer, size_t length, int flags)
 int
 __pmSocketReady(int fd, struct timeval *timeout)
 {
-    __pmFdSet	onefd;
-
-    FD_ZERO(&onefd);
-    FD_SET(fd, &onefd);
-    return select(fd+1, &onefd, NULL, NULL, timeout);
+    return __pmSocketWaitRead(fd, timeout);
 }
 
 #endif /* !HAVE_SECURE_SOCKETS */
@@ -15,7 +15,9 @@
  *
  * Thread-safe notes
  *
- * atexit_installed is protected by the __pmLock_libpcp mutex.
+ * atexit_installed is only touched in __pmConnectLocal(), and the same
+ * single-threaded PM_SCOPE_DSO_PMDA arguments as for dsotab[] (below)
+ * apply, so no additional locking is required.
  *
  * __pmSpecLocalPMDA() uses buffer[], but this routine is only called
  * from main() in single-threaded apps like pminfo, pmprobe, pmval
@@ -467,15 +469,12 @@ connected:
 	    }
 	}
 #ifdef HAVE_ATEXIT
-	PM_INIT_LOCKS();
-	PM_LOCK(__pmLock_libpcp);
 	if (dp->dispatch.comm.pmda_interface >= PMDA_INTERFACE_5 &&
 	    atexit_installed == 0) {
 	    /* install end of local context handler */
 	    atexit(EndLocalContext);
 	    atexit_installed = 1;
 	}
-	PM_UNLOCK(__pmLock_libpcp);
 #endif
 #endif	/* HAVE_DLOPEN */
     }
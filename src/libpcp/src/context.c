@@ -798,6 +798,7 @@ initarchive(__pmContext	*ctxp, const char *name)
     acp->ac_log_list = NULL;
     acp->ac_log = NULL;
     acp->ac_mark_done = 0;
+    acp->ac_key = NULL;
 
     /*
      * The list of names may contain one or more directories. Examine the
@@ -1451,6 +1452,7 @@ pmDupContext(void)
 	newcon->c_archctl->ac_pmid_hc.nodes = 0;
 	newcon->c_archctl->ac_pmid_hc.hsize = 0;
 	newcon->c_archctl->ac_cache = NULL;
+	newcon->c_archctl->ac_key = NULL;
 
 	/*
 	 * Need a new ac_mfp, but pointing at the same volume so ac_offset
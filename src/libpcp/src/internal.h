@@ -106,6 +106,7 @@ extern void init_AF_lock(void) _PCP_HIDDEN;
 extern void init_secureserver_lock(void) _PCP_HIDDEN;
 extern void init_connect_lock(void) _PCP_HIDDEN;
 extern void init_exec_lock(void) _PCP_HIDDEN;
+extern void init_access_lock(void) _PCP_HIDDEN;
 
 #ifdef HAVE___THREAD
 /*
@@ -161,6 +162,8 @@ extern int __pmIsAFLock(void *) _PCP_HIDDEN;
 extern int __pmIsSecureserverLock(void *) _PCP_HIDDEN;
 extern int __pmIsConnectLock(void *) _PCP_HIDDEN;
 extern int __pmIsExecLock(void *) _PCP_HIDDEN;
+extern int __pmIsAccessLock(void *) _PCP_HIDDEN;
+extern int __pmIsBlockLock(void *) _PCP_HIDDEN;
 #endif
 
 /* AF_UNIX socket family internals */
@@ -219,6 +222,7 @@ extern int __pmInitSecureSockets(void) _PCP_HIDDEN;
 extern int __pmInitCertificates(void) _PCP_HIDDEN;
 extern int __pmInitSocket(int, int) _PCP_HIDDEN;
 extern int __pmSocketReady(int, struct timeval *) _PCP_HIDDEN;
+extern int __pmSocketWaitRead(int, struct timeval *) _PCP_HIDDEN;
 extern void *__pmGetSecureSocket(int) _PCP_HIDDEN;
 extern void *__pmGetUserAuthData(int) _PCP_HIDDEN;
 extern int __pmSecureServerInit(void) _PCP_HIDDEN;
@@ -389,6 +393,8 @@ extern const char *__pmLogName_r(const char *, int, char *, int) _PCP_HIDDEN;
 extern const char *__pmLogName(const char *, int) _PCP_HIDDEN;	/* NOT thread-safe */
 extern int __pmLogGenerateMark(__pmLogCtl *, int, pmResult **) _PCP_HIDDEN;
 extern int __pmLogFetchInterp(__pmContext *, int, pmID *, pmResult **) _PCP_HIDDEN;
+extern int __pmLogFetchColumns(__pmContext *, int, int, pmID *, pmResult **) _PCP_HIDDEN;
+extern void __pmLogFreeColumns(__pmLogCtl *) _PCP_HIDDEN;
 extern int __pmGetArchiveLabel(__pmLogCtl *, pmLogLabel *) _PCP_HIDDEN;
 extern pmTimeval *__pmLogStartTime(__pmArchCtl *) _PCP_HIDDEN;
 extern void __pmLogSetTime(__pmContext *) _PCP_HIDDEN;
@@ -398,6 +404,39 @@ extern int __pmLogChangeArchive(__pmContext *, int) _PCP_HIDDEN;
 extern int __pmLogChangeToNextArchive(__pmLogCtl **) _PCP_HIDDEN;
 extern int __pmLogChangeToPreviousArchive(__pmLogCtl **) _PCP_HIDDEN;
 
+/*
+ * Random access to compressed files made up of independently compressed
+ * blocks, shared by the transparent decompression i/o handlers, see
+ * io_block.c
+ */
+typedef struct {
+    __uint64_t	coffset;	/* compressed block offset in the file */
+    __uint64_t	csize;		/* compressed block size */
+    __uint64_t	start;		/* uncompressed offset, set by __pmBlockOpen */
+    __uint64_t	size;		/* uncompressed block size */
+    int		check;		/* handler private, e.g. xz integrity check */
+} __pmBlockInfo;
+typedef int (*__pmBlockDecoder)(void *, int, const __pmBlockInfo *, char *);
+typedef void (*__pmBlockRelease)(void *);
+extern void *__pmBlockOpen(__pmFILE *, int, __pmBlockInfo *, int,
+		__pmBlockDecoder, __pmBlockRelease, void *) _PCP_HIDDEN;
+extern int __pmBlockSeek(__pmFILE *, off_t, int) _PCP_HIDDEN;
+extern void __pmBlockRewind(__pmFILE *) _PCP_HIDDEN;
+extern off_t __pmBlockTell(__pmFILE *) _PCP_HIDDEN;
+extern int __pmBlockGetc(__pmFILE *) _PCP_HIDDEN;
+extern size_t __pmBlockRead(void *, size_t, size_t, __pmFILE *) _PCP_HIDDEN;
+extern size_t __pmBlockWrite(void *, size_t, size_t, __pmFILE *) _PCP_HIDDEN;
+extern int __pmBlockFlush(__pmFILE *) _PCP_HIDDEN;
+extern int __pmBlockFsync(__pmFILE *) _PCP_HIDDEN;
+extern int __pmBlockFileno(__pmFILE *) _PCP_HIDDEN;
+extern off_t __pmBlockLseek(__pmFILE *, off_t, int) _PCP_HIDDEN;
+extern int __pmBlockFstat(__pmFILE *, struct stat *) _PCP_HIDDEN;
+extern int __pmBlockFeof(__pmFILE *) _PCP_HIDDEN;
+extern int __pmBlockFerror(__pmFILE *) _PCP_HIDDEN;
+extern void __pmBlockClearerr(__pmFILE *) _PCP_HIDDEN;
+extern int __pmBlockSetvbuf(__pmFILE *, char *, int, size_t) _PCP_HIDDEN;
+extern int __pmBlockClose(__pmFILE *) _PCP_HIDDEN;
+
 /* DSO PMDA helpers */
 struct __pmDSO;			/* opaque, real definition in pmda.h */
 extern struct __pmDSO *__pmLookupDSO(int) _PCP_HIDDEN;
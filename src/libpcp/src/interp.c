@@ -94,6 +94,7 @@ typedef struct instcntl {		/* metric-instance control */
     value		v_next;
     double		t_first;	/* no records before this */
     double		t_last;		/* no records after this */
+    double		t_seen;		/* earliest or latest value in this search */
     struct pmidcntl	*metric;	/* back to metric control */
 } instcntl_t;
 
@@ -710,6 +711,14 @@ check:
 	    
 	    if (icp->inst == PM_IN_NULL)
 		assert(i == 0);
+	    if (do_mark == UPD_MARK_FORW) {
+		if (t_this > icp->t_seen)
+		    icp->t_seen = t_this;
+	    }
+	    else if (do_mark == UPD_MARK_BACK) {
+		if (icp->t_seen < 0 || t_this < icp->t_seen)
+		    icp->t_seen = t_this;
+	    }
 	    if (pmDebugOptions.interp && pmDebugOptions.desperate)
 		dumpicp("update_bounds: match", icp);
 
@@ -730,7 +739,9 @@ check:
 		    else {
 			if (icp->v_next.pval != NULL)
 			    __pmUnpinPDUBuf((void *)icp->v_next.pval);
+			/* pin moves with the value, do not unpin it below */
 			icp->v_next.pval = icp->v_prior.pval;
+			icp->v_prior.pval = NULL;
 		    }
 		}
 		icp->t_prior = t_this;
@@ -769,7 +780,9 @@ check:
 		    else {
 			if (icp->v_prior.pval != NULL)
 			    __pmUnpinPDUBuf((void *)icp->v_prior.pval);
+			/* pin moves with the value, do not unpin it below */
 			icp->v_prior.pval = icp->v_next.pval;
+			icp->v_next.pval = NULL;
 		    }
 		}
 		icp->t_next = t_this;
@@ -803,6 +816,87 @@ check:
     return 0;
 }
 
+/*
+ * A search that runs into the start or end of the log has seen every
+ * record between there and where it started (at or after t_req
+ * searching backwards, at or before t_req searching forwards), so it
+ * knows the earliest or latest value for every metric-instance of
+ * interest that it saw, not just the ones it was looking for.
+ *
+ * Remembering these in t_first and t_last means an instance that comes
+ * or goes part way through the archive (like a process) costs one
+ * search to the start or end of the log in total, rather than one each
+ * time another instance comes or goes, which is quadratic for large
+ * instance domains.
+ */
+static void
+seen_first(__pmContext *ctxp)
+{
+    instcntl_t	*icp;
+
+    for (icp = (instcntl_t *)ctxp->c_archctl->ac_want; icp != NULL; icp = icp->want) {
+	if (icp->t_seen < 0 || icp->t_seen == icp->t_first)
+	    continue;
+	icp->t_first = icp->t_seen;
+	if (pmDebugOptions.interp && pmDebugOptions.desperate)
+	    dumpicp("seen_first", icp);
+    }
+}
+
+static void
+seen_last(__pmContext *ctxp)
+{
+    instcntl_t	*icp;
+
+    for (icp = (instcntl_t *)ctxp->c_archctl->ac_want; icp != NULL; icp = icp->want) {
+	if (icp->t_seen < 0 || icp->t_seen == icp->t_last)
+	    continue;
+	icp->t_last = icp->t_seen;
+	if (pmDebugOptions.interp && pmDebugOptions.desperate)
+	    dumpicp("seen_last", icp);
+    }
+}
+
+/*
+ * Merge sort of an unbound list, descending t_first for PM_MODE_BACK
+ * searches or ascending t_last for PM_MODE_FORW searches.  Stable, so
+ * the list is ordered just as it was when each metric-instance was
+ * inserted in order (most recent first for equal times), but without
+ * the quadratic cost when thousands of instances need searching.
+ */
+static instcntl_t *
+sort_unbound(instcntl_t *list, int mode)
+{
+    instcntl_t	*slow, *fast;
+    instcntl_t	*a, *b;
+    instcntl_t	*head = NULL;
+    instcntl_t	**tail = &head;
+
+    if (list == NULL || list->unbound == NULL)
+	return list;
+    /* split in half, then sort and merge the halves */
+    slow = list;
+    for (fast = list->unbound; fast != NULL && fast->unbound != NULL; fast = fast->unbound->unbound)
+	slow = slow->unbound;
+    b = slow->unbound;
+    slow->unbound = NULL;
+    a = sort_unbound(list, mode);
+    b = sort_unbound(b, mode);
+    while (a != NULL && b != NULL) {
+	if (mode == PM_MODE_BACK ? a->t_first >= b->t_first : a->t_last <= b->t_last) {
+	    *tail = a;
+	    a = a->unbound;
+	}
+	else {
+	    *tail = b;
+	    b = b->unbound;
+	}
+	tail = &(*tail)->unbound;
+    }
+    *tail = a != NULL ? a : b;
+    return head;
+}
+
 static int
 do_roll(__pmContext *ctxp, double t_req, int *seen_mark)
 {
@@ -886,7 +980,7 @@ __pmLogFetchInterp(__pmContext *ctxp, int numpmid, pmID pmidlist[], pmResult **r
     __pmHashNode	*ihp;
     pmidcntl_t	*pcp = NULL;	/* initialize to pander to gcc */
     instcntl_t	*icp = NULL;	/* initialize to pander to gcc */
-    instcntl_t	*ub, *ub_prev;
+    instcntl_t	*ub_prev;
     int		back = 0;
     int		forw = 0;
     int		done;
@@ -1011,6 +1105,7 @@ __pmLogFetchInterp(__pmContext *ctxp, int numpmid, pmID pmidlist[], pmResult **r
 		    icp->metric = pcp;
 		    icp->inst = instlist[i];
 		    icp->t_first = icp->t_last = -1;
+		    icp->t_seen = -1;
 		    icp->t_prior = icp->t_next = -1;
 		    SET_UNDEFINED(icp->s_prior);
 		    SET_UNDEFINED(icp->s_next);
@@ -1146,6 +1241,29 @@ __pmLogFetchInterp(__pmContext *ctxp, int numpmid, pmID pmidlist[], pmResult **r
      */
     done_roll = 0;
 
+    /*
+     * t_last (or t_first if reading backwards) may be known from an
+     * earlier search, in which case there is no search to be done for
+     * that metric-instance below ... but t_prior (or t_next) may not
+     * have caught up with it yet, and nothing else may roll forwards
+     * (or backwards) to t_req, so do that first
+     */
+    for (icp = (instcntl_t *)ctxp->c_archctl->ac_want; icp != NULL; icp = icp->want) {
+	if (ctxp->c_delta > 0 ?
+	    (icp->t_last >= 0 && icp->t_last <= t_req && icp->t_prior < icp->t_last) :
+	    (icp->t_first >= 0 && icp->t_first >= t_req &&
+	     (icp->t_next < 0 || icp->t_next > icp->t_first))) {
+	    if (pmDebugOptions.interp)
+		dumpicp("roll to t_first/t_last", icp);
+	    done_roll = 1;
+	    sts = do_roll(ctxp, t_req, &seen_mark);
+	    if (sts < 0) {
+		return sts;
+	    }
+	    break;
+	}
+    }
+
     /*
      * second pass ... see which metrics are not currently bounded below
      */
@@ -1186,24 +1304,16 @@ __pmLogFetchInterp(__pmContext *ctxp, int numpmid, pmID pmidlist[], pmResult **r
 	    (IS_MARK(icp->s_next) && icp->t_prior == t_req)) {
 	    back++;
 	    icp->search = 1;
-	    /* Add it to the unbound list in descending order of t_first */
-	    ub_prev = NULL;
-	    for (ub = (instcntl_t *)ctxp->c_archctl->ac_unbound;
-		 ub != NULL;
-		 ub = ub->unbound) {
-		if (icp->t_first >= ub->t_first)
-		    break;
-		ub_prev = ub;
-	    }
-	    if (ub_prev)
-		ub_prev->unbound = icp;
-	    else
-		ctxp->c_archctl->ac_unbound = icp;
-	    icp->unbound = ub;
+	    /* Add it to the unbound list, sorted below */
+	    icp->unbound = (instcntl_t *)ctxp->c_archctl->ac_unbound;
+	    ctxp->c_archctl->ac_unbound = icp;
 	    if (pmDebugOptions.interp)
 		dumpicp("search back", icp);
 	}
     }
+    /* unbound list in descending order of t_first */
+    ctxp->c_archctl->ac_unbound = sort_unbound(
+		(instcntl_t *)ctxp->c_archctl->ac_unbound, PM_MODE_BACK);
 
     if (back) {
 	/*
@@ -1213,14 +1323,18 @@ __pmLogFetchInterp(__pmContext *ctxp, int numpmid, pmID pmidlist[], pmResult **r
 	__pmLogChangeVol(ctxp->c_archctl, ctxp->c_archctl->ac_vol);
 	__pmFseek(ctxp->c_archctl->ac_mfp, ctxp->c_archctl->ac_offset, SEEK_SET);
 	done = 0;
+	for (icp = (instcntl_t *)ctxp->c_archctl->ac_want; icp != NULL; icp = icp->want)
+	    icp->t_seen = -1;
 
 	while (done < back) {
-	    if (cache_read(ctxp, PM_MODE_BACK, &logrp) < 0) {
+	    if ((sts = cache_read(ctxp, PM_MODE_BACK, &logrp)) < 0) {
 		/* ran into start of log */
 		if (pmDebugOptions.interp) {
 		    fprintf(stderr, "Start of Log, %d metric-inst not found\n",
 			    back - done);
 		}
+		if (sts == PM_ERR_EOL)
+		    seen_first(ctxp);
 		break;
 	    }
 	    tmp.tv_sec = (__int32_t)logrp->timestamp.tv_sec;
@@ -1316,24 +1430,16 @@ __pmLogFetchInterp(__pmContext *ctxp, int numpmid, pmID pmidlist[], pmResult **r
 	    forw++;
 	    icp->search = 1;
 
-	    /* Add it to the unbound list in ascending order of t_last */
-	    ub_prev = NULL;
-	    for (ub = (instcntl_t *)ctxp->c_archctl->ac_unbound;
-		 ub != NULL;
-		 ub = ub->unbound) {
-		if (icp->t_last <= ub->t_last)
-		    break;
-		ub_prev = ub;
-	    }
-	    if (ub_prev)
-		ub_prev->unbound = icp;
-	    else
-		ctxp->c_archctl->ac_unbound = icp;
-	    icp->unbound = ub;
+	    /* Add it to the unbound list, sorted below */
+	    icp->unbound = (instcntl_t *)ctxp->c_archctl->ac_unbound;
+	    ctxp->c_archctl->ac_unbound = icp;
 	    if (pmDebugOptions.interp)
 		dumpicp("search forw", icp);
 	}
     }
+    /* unbound list in ascending order of t_last */
+    ctxp->c_archctl->ac_unbound = sort_unbound(
+		(instcntl_t *)ctxp->c_archctl->ac_unbound, PM_MODE_FORW);
 
     if (forw) {
 	/*
@@ -1343,6 +1449,8 @@ __pmLogFetchInterp(__pmContext *ctxp, int numpmid, pmID pmidlist[], pmResult **r
 	__pmLogChangeVol(ctxp->c_archctl, ctxp->c_archctl->ac_vol);
 	__pmFseek(ctxp->c_archctl->ac_mfp, ctxp->c_archctl->ac_offset, SEEK_SET);
 	done = 0;
+	for (icp = (instcntl_t *)ctxp->c_archctl->ac_want; icp != NULL; icp = icp->want)
+	    icp->t_seen = -1;
 
 	sts = 0;
 	while (done < forw) {
@@ -1352,6 +1460,8 @@ __pmLogFetchInterp(__pmContext *ctxp, int numpmid, pmID pmidlist[], pmResult **r
 		    fprintf(stderr, "End of Log, %d metric-insts not found\n",
 		    		forw - done);
 		}
+		if (sts == PM_ERR_EOL)
+		    seen_last(ctxp);
 		break;
 	    }
 	    tmp.tv_sec = (__int32_t)logrp->timestamp.tv_sec;
@@ -24,9 +24,15 @@
 #include "internal.h"
 
 extern __pm_fops __pm_stdio;
+#if HAVE_SYS_MMAN_H && defined(HAVE___THREAD)
+extern __pm_fops __pm_mmap;
+#endif
 #if HAVE_TRANSPARENT_DECOMPRESSION && HAVE_LZMA_DECOMPRESSION
 extern __pm_fops __pm_xz;
 #endif
+#if HAVE_TRANSPARENT_DECOMPRESSION && HAVE_ZSTD_DECOMPRESSION && HAVE_SYS_MMAN_H
+extern __pm_fops __pm_zstd;
+#endif
 
 /*
  * Suffixes and associated compresssion application for compressed filenames.
@@ -38,12 +44,18 @@ extern __pm_fops __pm_xz;
 #define	USE_BZIP2	1
 #define USE_GZIP	2
 #define USE_XZ		3
+#define USE_ZSTD	4
 
 #if HAVE_TRANSPARENT_DECOMPRESSION && HAVE_LZMA_DECOMPRESSION
 #define TRANSPARENT_XZ (&__pm_xz)
 #else
 #define TRANSPARENT_XZ NULL
 #endif
+#if HAVE_TRANSPARENT_DECOMPRESSION && HAVE_ZSTD_DECOMPRESSION && HAVE_SYS_MMAN_H
+#define TRANSPARENT_ZSTD (&__pm_zstd)
+#else
+#define TRANSPARENT_ZSTD NULL
+#endif
 
 static const struct {
     const char	*suff;
@@ -52,6 +64,7 @@ static const struct {
 } compress_ctl[] = {
     { ".xz",	USE_XZ,	 	TRANSPARENT_XZ },
     { ".lzma",	USE_XZ,		NULL },
+    { ".zst",	USE_ZSTD,	TRANSPARENT_ZSTD },
     { ".bz2",	USE_BZIP2,	NULL },
     { ".bz",	USE_BZIP2,	NULL },
     { ".gz",	USE_GZIP,	NULL },
@@ -247,6 +260,10 @@ fopen_compress(const char *fname, int compress_ix)
 	cmd = "gzip";
 	arg = "-dc";
     }
+    else if (compress_ctl[compress_ix].appl == USE_ZSTD) {
+	cmd = "zstd";
+	arg = "-dcq";
+    }
     else {
 	/* botch in compress_ctl[] ... should not happen */
 	if (pmDebugOptions.log) {
@@ -352,7 +369,9 @@ index_compress(char *fname, size_t flen)
 /*
  * Open a PCP file with given mode and return a __pmFILE. An i/o
  * handler is automatically chosen based on filename suffix, e.g. .xz, .gz,
- * etc. The stdio pass-thru handler will be chosen for other files.
+ * etc. If $PCP_ARCHIVE_MMAP is set, other files opened read-only are mapped
+ * into memory with the mmap handler, else the stdio pass-thru handler is
+ * chosen, which is also used if the file cannot be mapped.
  * The stdio handler is the only handler currently supporting write operations.
  * Return a valid __pmFILE pointer on success or NULL on failure.
  */
@@ -411,6 +430,28 @@ __pmFopen(const char *path, const char *mode)
     	return NULL;
 
     memset(f, 0, sizeof(__pmFILE));
+
+#if HAVE_SYS_MMAN_H && defined(HAVE___THREAD)
+    if (handler == &__pm_stdio && mode[0] == 'r' && mode[1] == '\0' &&
+	getenv("PCP_ARCHIVE_MMAP") != NULL) {		/* THREADSAFE */
+	/*
+	 * Uncompressed and read-only, and the application has asked for
+	 * mapping (which installs a SIGBUS handler, see io_mmap.c), so
+	 * try to map it ... anything that cannot be mapped (not a regular
+	 * file, mmap fails) quietly falls back to stdio.
+	 */
+	f->fops = &__pm_mmap;
+	if (f->fops->__pmopen(f, path, mode) != NULL)
+	    return f;
+	if (pmDebugOptions.log) {
+	    char	errmsg[PM_MAXERRMSGLEN];
+	    fprintf(stderr, "__pmFopen: mmap %s: %s, using stdio\n",
+		    path, osstrerror_r(errmsg, sizeof(errmsg)));
+	}
+	memset(f, 0, sizeof(__pmFILE));
+    }
+#endif
+
     f->fops = handler;
 
     /*
@@ -0,0 +1,694 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ */
+
+/*
+ * Random access, read-only i/o for compressed files that are made up of
+ * independently compressed blocks (xz blocks, zstd frames).
+ *
+ * The compressed i/o handlers find the blocks when the file is opened
+ * and provide a function to decode one block, everything else (seek,
+ * read, a small cache of decoded blocks) is done here.  Empty blocks
+ * must not be included, so every offset is in exactly one block.
+ *
+ * When the file is read sequentially, in either direction, the next few
+ * blocks are decoded ahead of the reader by a pool of worker threads
+ * shared by all open files, so replaying a compressed archive can use
+ * more than one CPU.  $PCP_ARCHIVE_DECOMPRESS_THREADS sets the number
+ * of workers (0 to decode only on demand in the calling thread), the
+ * default is the number of online CPUs, up to PCP_BLOCK_MAXTHREADS.
+ *
+ * Locking: the file itself is only ever used by one thread at a time
+ * (the caller holds the archive's l_lock), block_lock protects the
+ * work queue and the state of any cache slot that is being decoded
+ * by a worker.  The block last returned to the reader is only ever
+ * changed by the reader, so reads within that block need no locking.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "pmapi.h"
+#include "libpcp.h"
+#include "internal.h"
+
+#ifndef PCP_BLOCK_CACHE
+#define PCP_BLOCK_CACHE		4	/* decoded blocks kept, plus read-ahead */
+#endif
+#define PCP_BLOCK_MAXTHREADS	4
+
+#define SLOT_EMPTY	0
+#define SLOT_READY	1
+#define SLOT_PENDING	2	/* queued or being decoded by a worker */
+#define SLOT_FAILED	3
+
+typedef struct {
+    int			blk;		/* block number, -1 if empty */
+    int			state;
+    char		*data;
+    unsigned int	used;		/* for LRU replacement */
+} blkslot_t;
+
+typedef struct {
+    int			fd;
+    __pmBlockDecoder	decode;
+    __pmBlockRelease	release;
+    void		*arg;		/* handler private data */
+    int			nblocks;
+    __pmBlockInfo	*blocks;
+    __uint64_t		size;		/* total uncompressed size */
+    __uint64_t		offset;		/* current uncompressed position */
+    int			eof;
+    int			error;
+    int			nslots;
+    blkslot_t		*slots;
+    blkslot_t		*cur;		/* slot last returned to the reader */
+    unsigned int	clock;
+    int			last;		/* block last read, for direction */
+    int			threads;	/* workers available to this file */
+    int			pending;	/* read-ahead jobs not yet finished */
+    pid_t		pid;		/* process that queued them */
+} blkfile_t;
+
+#ifdef PM_MULTI_THREAD
+typedef struct job {
+    struct job		*next;
+    blkfile_t		*bf;
+    blkslot_t		*slot;
+    int			blk;
+} job_t;
+
+static pthread_mutex_t	block_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	block_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	block_done = PTHREAD_COND_INITIALIZER;
+static int		nthreads = -1;		/* workers, -1 until started */
+static pid_t		poolpid;		/* process owning the workers */
+static job_t		*jobhead;		/* work queue */
+static job_t		*jobtail;
+#else
+void			*block_lock;
+#endif
+
+#if defined(PM_MULTI_THREAD) && defined(PM_MULTI_THREAD_DEBUG)
+/*
+ * return true if lock == block_lock
+ */
+int
+__pmIsBlockLock(void *lock)
+{
+    return lock == (void *)&block_lock;
+}
+#endif
+
+/* decode a block into a new buffer, returns NULL and sets *sts on error */
+static char *
+decode_block(blkfile_t *bf, const __pmBlockInfo *bp, int *sts)
+{
+    char	*data;
+
+    if ((data = (char *)malloc(bp->size > 0 ? bp->size : 1)) == NULL) {
+	*sts = -oserror();
+	return NULL;
+    }
+    if ((*sts = bf->decode(bf->arg, bf->fd, bp, data)) < 0) {
+	free(data);
+	return NULL;
+    }
+    return data;
+}
+
+#ifdef PM_MULTI_THREAD
+static void *
+worker(void *arg)
+{
+    job_t		*jp;
+    blkfile_t		*bf;
+    __pmBlockInfo	info;
+    __pmBlockDecoder	decode;
+    void		*priv;
+    char		*data;
+    int			fd, sts;
+
+    PM_LOCK(block_lock);
+    for ( ; ; ) {
+	while (jobhead == NULL)
+	    pthread_cond_wait(&block_work, &block_lock);
+	jp = jobhead;
+	if ((jobhead = jp->next) == NULL)
+	    jobtail = NULL;
+	bf = jp->bf;
+	info = bf->blocks[jp->blk];
+	decode = bf->decode;
+	priv = bf->arg;
+	fd = bf->fd;
+	PM_UNLOCK(block_lock);
+
+	/* bf cannot go away until pending drops to zero, see __pmBlockClose() */
+	if ((data = (char *)malloc(info.size > 0 ? info.size : 1)) == NULL)
+	    sts = -ENOMEM;
+	else if ((sts = decode(priv, fd, &info, data)) < 0) {
+	    free(data);
+	    data = NULL;
+	}
+
+	PM_LOCK(block_lock);
+	jp->slot->data = data;
+	jp->slot->state = (data == NULL) ? SLOT_FAILED : SLOT_READY;
+	bf->pending--;
+	pthread_cond_broadcast(&block_done);
+	free(jp);
+    }
+    /*NOTREACHED*/
+    return NULL;
+}
+
+/*
+ * Start the worker pool, on first use.  Called with block_lock held.
+ * Workers are not inherited across fork(2), so a child decodes
+ * everything itself.
+ */
+static int
+pool_threads(void)
+{
+    pthread_attr_t	attr;
+    pthread_t		tid;
+    char		*val;
+    long		n;
+
+    if (nthreads >= 0)
+	return poolpid == getpid() ? nthreads : 0;
+
+    poolpid = getpid();
+    if ((val = getenv("PCP_ARCHIVE_DECOMPRESS_THREADS")) != NULL) {	/* THREADSAFE */
+	n = strtol(val, NULL, 10);
+	if (n < 0)
+	    n = 0;
+    }
+    else {
+#ifdef _SC_NPROCESSORS_ONLN
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#else
+	n = 1;
+#endif
+	if (n < 1)
+	    n = 1;
+	if (n > PCP_BLOCK_MAXTHREADS)
+	    n = PCP_BLOCK_MAXTHREADS;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (nthreads = 0; nthreads < n; nthreads++) {
+	if (pthread_create(&tid, &attr, worker, NULL) != 0)
+	    break;
+    }
+    pthread_attr_destroy(&attr);
+
+    if (pmDebugOptions.log)
+	fprintf(stderr, "__pmBlockOpen: %d decompression threads\n", nthreads);
+    return nthreads;
+}
+#endif
+
+static blkslot_t *
+findslot(blkfile_t *bf, int blk)
+{
+    int		i;
+
+    for (i = 0; i < bf->nslots; i++) {
+	if (bf->slots[i].blk == blk)
+	    return &bf->slots[i];
+    }
+    return NULL;
+}
+
+/*
+ * Least recently used slot that is not being decoded and does not
+ * hold block keep, emptied ready for reuse.
+ */
+static blkslot_t *
+victim(blkfile_t *bf, int keep)
+{
+    blkslot_t	*sp, *best = NULL;
+    int		i;
+
+    for (i = 0; i < bf->nslots; i++) {
+	sp = &bf->slots[i];
+	if (sp->state == SLOT_PENDING || (sp->blk == keep && keep >= 0))
+	    continue;
+	if (sp->state == SLOT_EMPTY) {
+	    best = sp;
+	    break;
+	}
+	if (best == NULL || sp->used < best->used)
+	    best = sp;
+    }
+    if (best != NULL) {
+	if (best == bf->cur)
+	    bf->cur = NULL;
+	free(best->data);
+	best->data = NULL;
+	best->blk = -1;
+	best->state = SLOT_EMPTY;
+    }
+    return best;
+}
+
+#ifdef PM_MULTI_THREAD
+/*
+ * Reading in sequence (either direction), queue the next blocks that
+ * are not already cached.  Called with block_lock held.
+ */
+static void
+read_ahead(blkfile_t *bf, int blk)
+{
+    blkslot_t	*sp;
+    job_t	*jp;
+    int		dir, i, next;
+
+    if (blk == bf->last + 1)
+	dir = 1;
+    else if (blk == bf->last - 1)
+	dir = -1;
+    else
+	return;
+
+    for (i = 1; i <= bf->threads; i++) {
+	next = blk + i * dir;
+	if (next < 0 || next >= bf->nblocks)
+	    break;
+	if ((sp = findslot(bf, next)) != NULL) {
+	    sp->used = ++bf->clock;
+	    continue;
+	}
+	if ((sp = victim(bf, blk)) == NULL)
+	    break;
+	if ((jp = (job_t *)malloc(sizeof(*jp))) == NULL)
+	    break;
+	sp->blk = next;
+	sp->state = SLOT_PENDING;
+	sp->used = ++bf->clock;
+	jp->next = NULL;
+	jp->bf = bf;
+	jp->slot = sp;
+	jp->blk = next;
+	if (jobtail == NULL)
+	    jobhead = jp;
+	else
+	    jobtail->next = jp;
+	jobtail = jp;
+	bf->pending++;
+	pthread_cond_signal(&block_work);
+    }
+}
+#endif
+
+/*
+ * Return the slot holding block blk, decoding it if need be,
+ * or NULL with bf->error set.
+ */
+static blkslot_t *
+getblock(blkfile_t *bf, int blk)
+{
+    blkslot_t	*sp;
+    char	*data;
+    int		sts;
+    int		locked = 0;
+
+#ifdef PM_MULTI_THREAD
+    if (bf->threads > 0 && bf->pid != getpid()) {
+	/* forked with read-ahead in flight, the workers are not here */
+	int	i;
+	for (i = 0; i < bf->nslots; i++) {
+	    if (bf->slots[i].state == SLOT_PENDING) {
+		bf->slots[i].blk = -1;
+		bf->slots[i].data = NULL;
+		bf->slots[i].state = SLOT_EMPTY;
+	    }
+	}
+	bf->threads = bf->pending = 0;
+    }
+    if (bf->threads > 0) {
+	PM_LOCK(block_lock);
+	locked = 1;
+    }
+#endif
+
+    sp = findslot(bf, blk);
+#ifdef PM_MULTI_THREAD
+    while (sp != NULL && sp->state == SLOT_PENDING)
+	pthread_cond_wait(&block_done, &block_lock);
+#endif
+    if (sp != NULL && sp->state == SLOT_FAILED) {
+	/* try again below, so the error is reported */
+	sp->blk = -1;
+	sp->state = SLOT_EMPTY;
+	sp = NULL;
+    }
+    if (sp == NULL) {
+	if ((sp = victim(bf, -1)) == NULL) {
+	    /* cannot happen, more slots than pending read-ahead */
+	    sts = -EBUSY;
+	    goto fail;
+	}
+	if (locked)
+	    PM_UNLOCK(block_lock);
+	data = decode_block(bf, &bf->blocks[blk], &sts);
+	if (locked)
+	    PM_LOCK(block_lock);
+	if (data == NULL)
+	    goto fail;
+	sp->blk = blk;
+	sp->data = data;
+	sp->state = SLOT_READY;
+    }
+    sp->used = ++bf->clock;
+    bf->cur = sp;
+#ifdef PM_MULTI_THREAD
+    if (bf->threads > 0)
+	read_ahead(bf, blk);
+#endif
+    bf->last = blk;
+    if (locked)
+	PM_UNLOCK(block_lock);
+    return sp;
+
+fail:
+    if (locked)
+	PM_UNLOCK(block_lock);
+    if (pmDebugOptions.log) {
+	char	errmsg[PM_MAXERRMSGLEN];
+	fprintf(stderr, "__pmBlockRead: block %d: %s\n",
+		blk, pmErrStr_r(sts, errmsg, sizeof(errmsg)));
+    }
+    bf->error = 1;
+    setoserror(-sts);
+    return NULL;
+}
+
+/* block containing uncompressed offset, else -1 */
+static int
+locate(blkfile_t *bf, __uint64_t offset)
+{
+    int		lo = 0, hi = bf->nblocks - 1, mid;
+
+    while (lo <= hi) {
+	mid = (lo + hi) / 2;
+	if (offset < bf->blocks[mid].start)
+	    hi = mid - 1;
+	else if (offset >= bf->blocks[mid].start + bf->blocks[mid].size)
+	    lo = mid + 1;
+	else
+	    return mid;
+    }
+    return -1;
+}
+
+/*
+ * Take over fd, already open on the compressed file, for a handler that
+ * has found the nblocks blocks (in uncompressed order) and will decode
+ * them with decode(arg, fd, ...).  The blocks array is malloc'd by the
+ * handler and is ours from now on, even if this fails.
+ */
+void *
+__pmBlockOpen(__pmFILE *f, int fd, __pmBlockInfo *blocks, int nblocks,
+		__pmBlockDecoder decode, __pmBlockRelease release, void *arg)
+{
+    blkfile_t	*bf;
+    int		i, threads = 0;
+
+    if ((bf = (blkfile_t *)calloc(1, sizeof(*bf))) == NULL) {
+	free(blocks);
+	return NULL;
+    }
+#ifdef PM_MULTI_THREAD
+    PM_LOCK(block_lock);
+    threads = pool_threads();
+    PM_UNLOCK(block_lock);
+#endif
+    bf->nslots = PCP_BLOCK_CACHE + threads;
+    if ((bf->slots = (blkslot_t *)calloc(bf->nslots, sizeof(blkslot_t))) == NULL) {
+	free(blocks);
+	free(bf);
+	return NULL;
+    }
+    for (i = 0; i < bf->nslots; i++)
+	bf->slots[i].blk = -1;
+    for (i = 0; i < nblocks; i++) {
+	blocks[i].start = bf->size;
+	bf->size += blocks[i].size;
+    }
+    bf->blocks = blocks;
+    bf->nblocks = nblocks;
+    bf->fd = fd;
+    bf->decode = decode;
+    bf->release = release;
+    bf->arg = arg;
+    bf->last = -1;
+    bf->threads = threads;
+    bf->pid = getpid();
+
+    f->priv = (void *)bf;
+    f->position = 0;
+    return f;
+}
+
+int
+__pmBlockSeek(__pmFILE *f, off_t offset, int whence)
+{
+    blkfile_t	*bf = (blkfile_t *)f->priv;
+
+    switch (whence) {
+	case SEEK_SET:
+	    break;
+	case SEEK_CUR:
+	    offset += bf->offset;
+	    break;
+	case SEEK_END:
+	    offset += bf->size;
+	    break;
+	default:
+	    setoserror(EINVAL);
+	    return -1;
+    }
+    if (offset < 0) {
+	setoserror(EINVAL);
+	return -1;
+    }
+    /* nothing is decoded until the next read */
+    bf->offset = offset;
+    bf->eof = 0;
+    f->position = offset;
+    return 0;
+}
+
+off_t
+__pmBlockLseek(__pmFILE *f, off_t offset, int whence)
+{
+    blkfile_t	*bf = (blkfile_t *)f->priv;
+
+    if (__pmBlockSeek(f, offset, whence) < 0)
+	return (off_t)-1;
+    return bf->offset;
+}
+
+void
+__pmBlockRewind(__pmFILE *f)
+{
+    blkfile_t	*bf = (blkfile_t *)f->priv;
+
+    bf->offset = 0;
+    bf->eof = bf->error = 0;
+    f->position = 0;
+}
+
+off_t
+__pmBlockTell(__pmFILE *f)
+{
+    blkfile_t	*bf = (blkfile_t *)f->priv;
+
+    return bf->offset;
+}
+
+size_t
+__pmBlockRead(void *ptr, size_t size, size_t nmemb, __pmFILE *f)
+{
+    blkfile_t		*bf = (blkfile_t *)f->priv;
+    blkslot_t		*sp;
+    __pmBlockInfo	*bp;
+    size_t		want = size * nmemb;
+    size_t		copied = 0;
+    size_t		n;
+    int			blk;
+
+    if (size == 0 || nmemb == 0)
+	return 0;
+    while (copied < want) {
+	if (bf->offset >= bf->size) {
+	    bf->eof = 1;
+	    break;
+	}
+	sp = bf->cur;
+	if (sp == NULL ||
+	    bf->offset < bf->blocks[sp->blk].start ||
+	    bf->offset >= bf->blocks[sp->blk].start + bf->blocks[sp->blk].size) {
+	    if ((blk = locate(bf, bf->offset)) < 0 ||
+		(sp = getblock(bf, blk)) == NULL) {
+		bf->error = 1;
+		break;
+	    }
+	}
+	bp = &bf->blocks[sp->blk];
+	n = bp->start + bp->size - bf->offset;
+	if (n > want - copied)
+	    n = want - copied;
+	memcpy((char *)ptr + copied, sp->data + (bf->offset - bp->start), n);
+	copied += n;
+	bf->offset += n;
+    }
+    f->position = bf->offset;
+    return copied / size;
+}
+
+int
+__pmBlockGetc(__pmFILE *f)
+{
+    unsigned char	c;
+
+    if (__pmBlockRead(&c, 1, 1, f) != 1)
+	return EOF;
+    return c;
+}
+
+size_t
+__pmBlockWrite(void *ptr, size_t size, size_t nmemb, __pmFILE *f)
+{
+    blkfile_t	*bf = (blkfile_t *)f->priv;
+
+    /* not supported */
+    bf->error = 1;
+    setoserror(EBADF);
+    return 0;
+}
+
+int
+__pmBlockFlush(__pmFILE *f)
+{
+    return 0;
+}
+
+int
+__pmBlockFsync(__pmFILE *f)
+{
+    blkfile_t	*bf = (blkfile_t *)f->priv;
+
+    return fsync(bf->fd);
+}
+
+int
+__pmBlockFileno(__pmFILE *f)
+{
+    blkfile_t	*bf = (blkfile_t *)f->priv;
+
+    return bf->fd;
+}
+
+int
+__pmBlockFstat(__pmFILE *f, struct stat *buf)
+{
+    blkfile_t	*bf = (blkfile_t *)f->priv;
+    int		sts;
+
+    /* what the caller really wants for st_size is the uncompressed size */
+    if ((sts = fstat(bf->fd, buf)) == 0)
+	buf->st_size = bf->size;
+    return sts;
+}
+
+int
+__pmBlockFeof(__pmFILE *f)
+{
+    blkfile_t	*bf = (blkfile_t *)f->priv;
+
+    return bf->eof;
+}
+
+int
+__pmBlockFerror(__pmFILE *f)
+{
+    blkfile_t	*bf = (blkfile_t *)f->priv;
+
+    return bf->error;
+}
+
+void
+__pmBlockClearerr(__pmFILE *f)
+{
+    blkfile_t	*bf = (blkfile_t *)f->priv;
+
+    bf->eof = bf->error = 0;
+}
+
+int
+__pmBlockSetvbuf(__pmFILE *f, char *buf, int mode, size_t size)
+{
+    /* the block cache is the buffer */
+    return 0;
+}
+
+/*
+ * Release everything, including the handler's private data, and close
+ * the file descriptor.
+ */
+int
+__pmBlockClose(__pmFILE *f)
+{
+    blkfile_t	*bf = (blkfile_t *)f->priv;
+    int		i, sts;
+
+#ifdef PM_MULTI_THREAD
+    if (bf->threads > 0 && bf->pid == getpid()) {
+	job_t	*jp, **prev;
+
+	/* drop queued read-ahead, wait for any in progress */
+	PM_LOCK(block_lock);
+	for (prev = &jobhead, jobtail = NULL; (jp = *prev) != NULL; ) {
+	    if (jp->bf == bf) {
+		*prev = jp->next;
+		bf->pending--;
+		free(jp);
+	    }
+	    else {
+		jobtail = jp;
+		prev = &jp->next;
+	    }
+	}
+	while (bf->pending > 0)
+	    pthread_cond_wait(&block_done, &block_lock);
+	PM_UNLOCK(block_lock);
+    }
+#endif
+
+    for (i = 0; i < bf->nslots; i++) {
+	if (bf->slots[i].state != SLOT_PENDING)
+	    free(bf->slots[i].data);
+    }
+    free(bf->slots);
+    free(bf->blocks);
+    if (bf->release != NULL)
+	bf->release(bf->arg);
+    sts = close(bf->fd);
+    free(bf);
+    f->priv = NULL;
+    return sts;
+}
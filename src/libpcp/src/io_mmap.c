@@ -0,0 +1,433 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ */
+
+/*
+ * Read-only i/o handler for uncompressed archive files, using mmap(2),
+ * chosen by __pmFopen() only when $PCP_ARCHIVE_MMAP is set.
+ *
+ * Reads are a single copy from the page cache into the caller's buffer
+ * (a PDU buffer for __pmLogRead), with no stdio buffer in between and
+ * no system calls per record.  Seeking is simply moving an offset, so
+ * reading an archive backwards costs the same as reading it forwards,
+ * unlike stdio where every backwards fseek discards the buffer.
+ *
+ * Archives may still be growing (pmlogger writing the current volume),
+ * so when a read or SEEK_END would go beyond the end of the mapping the
+ * file size is checked again and the mapping extended if need be.
+ *
+ * A file may also shrink while it is mapped (truncated or rewritten in
+ * place), and touching a mapped page beyond the new end of file raises
+ * SIGBUS.  Copies from the mapping are guarded by a SIGBUS handler that
+ * jumps back to mmap_read(), which then drops the mapping and switches
+ * the __pmFILE over to the stdio handler, so the caller sees a short
+ * read at the new end of file instead of the process being killed.
+ * SIGBUS not raised by one of these copies is passed on to whatever
+ * handler was installed before ours.
+ *
+ * That handler is process-wide, which is why mapping is opt-in: the
+ * application asks for it with $PCP_ARCHIVE_MMAP, and the handler is
+ * installed by the first file mapped.  An application that installs its
+ * own SIGBUS handler after that loses the recovery above.
+ *
+ * The guard needs a per-thread jump buffer, so without __thread support
+ * none of this is compiled and files are never mapped.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <setjmp.h>
+#include "pmapi.h"
+#include "libpcp.h"
+#include "internal.h"
+#if HAVE_SYS_MMAN_H && defined(HAVE___THREAD)
+#include <sys/mman.h>
+
+extern __pm_fops __pm_stdio;
+
+typedef struct {
+    int		fd;
+    char	*base;		/* mapping, NULL if nothing mapped yet */
+    size_t	size;		/* bytes mapped */
+    off_t	offset;		/* current file position */
+    int		eof;
+    int		error;
+} mmap_file_t;
+
+static __thread sigjmp_buf * volatile mmap_jmp;	/* set while copying from a mapping */
+static struct sigaction	mmap_oldbus;	/* SIGBUS disposition before ours */
+#ifdef PM_MULTI_THREAD
+static pthread_once_t	mmap_once = PTHREAD_ONCE_INIT;
+#else
+static int		mmap_once;
+#endif
+
+static void
+mmap_sigbus(int sig, siginfo_t *si, void *context)
+{
+    if (mmap_jmp != NULL)
+	siglongjmp(*mmap_jmp, 1);
+
+    /* not a fault in one of our copies, pass it on */
+    if (mmap_oldbus.sa_flags & SA_SIGINFO)
+	mmap_oldbus.sa_sigaction(sig, si, context);
+    else if (mmap_oldbus.sa_handler != SIG_DFL &&
+	     mmap_oldbus.sa_handler != SIG_IGN)
+	mmap_oldbus.sa_handler(sig);
+    else
+	/* faulting access is retried, with the default action this time */
+	sigaction(SIGBUS, &mmap_oldbus, NULL);
+}
+
+static void
+mmap_guard_init(void)
+{
+    struct sigaction	sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = mmap_sigbus;
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, &mmap_oldbus);
+}
+
+/*
+ * Map (or re-map) the whole file, if it is now larger than the current
+ * mapping.  Returns 0 if nothing changed or the mapping has grown, else
+ * -1 with errno set.
+ */
+static int
+mmap_remap(mmap_file_t *mp)
+{
+    struct stat	sbuf;
+    void	*base;
+
+    if (fstat(mp->fd, &sbuf) < 0)
+	return -1;
+    if ((size_t)sbuf.st_size <= mp->size)
+	return 0;
+    base = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, mp->fd, 0);
+    if (base == MAP_FAILED)
+	return -1;
+    if (mp->base != NULL)
+	munmap(mp->base, mp->size);
+    mp->base = (char *)base;
+    mp->size = sbuf.st_size;
+    return 0;
+}
+
+static void *
+mmap_fdopen(__pmFILE *f, int fd, const char *mode)
+{
+    mmap_file_t	*mp;
+    struct stat	sbuf;
+
+    if (mode[0] != 'r' || mode[1] != '\0') {
+	/* read-only, stdio handles everything else */
+	setoserror(EINVAL);
+	return NULL;
+    }
+    if (fstat(fd, &sbuf) < 0)
+	return NULL;
+    if (!S_ISREG(sbuf.st_mode)) {
+	setoserror(EINVAL);
+	return NULL;
+    }
+#ifdef PM_MULTI_THREAD
+    pthread_once(&mmap_once, mmap_guard_init);
+#else
+    if (!mmap_once) {
+	mmap_guard_init();
+	mmap_once = 1;
+    }
+#endif
+    if ((mp = (mmap_file_t *)calloc(1, sizeof(*mp))) == NULL)
+	return NULL;
+    mp->fd = fd;
+    if (mmap_remap(mp) < 0) {
+	free(mp);
+	return NULL;
+    }
+
+    f->priv = (void *)mp;
+    f->position = 0;
+
+    return f;
+}
+
+static void *
+mmap_open(__pmFILE *f, const char *path, const char *mode)
+{
+    int		fd;
+    int		sts;
+
+    if (mode[0] != 'r' || mode[1] != '\0') {
+	setoserror(EINVAL);
+	return NULL;
+    }
+    if ((fd = open(path, O_RDONLY)) < 0)
+	return NULL;
+    if (mmap_fdopen(f, fd, mode) == NULL) {
+	sts = oserror();
+	close(fd);
+	setoserror(sts);
+	return NULL;
+    }
+    return f;
+}
+
+static int
+mmap_seek(__pmFILE *f, off_t offset, int whence)
+{
+    mmap_file_t	*mp = (mmap_file_t *)f->priv;
+
+    switch (whence) {
+	case SEEK_SET:
+	    break;
+	case SEEK_CUR:
+	    offset += mp->offset;
+	    break;
+	case SEEK_END:
+	    if (mmap_remap(mp) < 0)
+		return -1;
+	    offset += mp->size;
+	    break;
+	default:
+	    setoserror(EINVAL);
+	    return -1;
+    }
+    if (offset < 0) {
+	setoserror(EINVAL);
+	return -1;
+    }
+    mp->offset = offset;
+    mp->eof = 0;
+    f->position = offset;
+    return 0;
+}
+
+static void
+mmap_rewind(__pmFILE *f)
+{
+    mmap_file_t	*mp = (mmap_file_t *)f->priv;
+
+    mp->offset = 0;
+    mp->eof = mp->error = 0;
+    f->position = 0;
+}
+
+static off_t
+mmap_tell(__pmFILE *f)
+{
+    mmap_file_t	*mp = (mmap_file_t *)f->priv;
+
+    return mp->offset;
+}
+
+/*
+ * The file has shrunk beneath the mapping ... unmap it and carry on
+ * with the stdio handler from the current offset.
+ */
+static int
+mmap_to_stdio(__pmFILE *f)
+{
+    mmap_file_t	*mp = (mmap_file_t *)f->priv;
+    FILE	*fp;
+
+    if (pmDebugOptions.log)
+	fprintf(stderr, "mmap_read: fd=%d shrank below offset %ld, using stdio\n",
+		mp->fd, (long)mp->offset);
+    if ((fp = fdopen(mp->fd, "r")) == NULL)
+	return -1;
+    if (fseek(fp, mp->offset, SEEK_SET) < 0) {
+	/* fclose() has closed the descriptor */
+	fclose(fp);
+	mp->fd = -1;
+	return -1;
+    }
+    munmap(mp->base, mp->size);
+    f->fops = &__pm_stdio;
+    f->priv = (void *)fp;
+    free(mp);
+    return 0;
+}
+
+static size_t
+mmap_read(void *ptr, size_t size, size_t nmemb, __pmFILE *f)
+{
+    mmap_file_t	*mp = (mmap_file_t *)f->priv;
+    size_t	want = size * nmemb;
+    size_t	have;
+    sigjmp_buf	jb;
+
+    if (size == 0 || nmemb == 0)
+	return 0;
+    if (mp->offset + want > mp->size && mmap_remap(mp) < 0) {
+	mp->error = 1;
+	return 0;
+    }
+    if (mp->offset >= (off_t)mp->size)
+	have = 0;
+    else if ((have = mp->size - mp->offset) > want)
+	have = want;
+    if (sigsetjmp(jb, 1) != 0) {
+	/* SIGBUS, the file shrank after the mapping was made */
+	mmap_jmp = NULL;
+	if (mmap_to_stdio(f) < 0) {
+	    mp->error = 1;
+	    return 0;
+	}
+	return f->fops->__pmread(ptr, size, nmemb, f);
+    }
+    mmap_jmp = &jb;
+    memcpy(ptr, mp->base + mp->offset, have);
+    mmap_jmp = NULL;
+    if (have < want)
+	mp->eof = 1;
+    mp->offset += have;
+    f->position = mp->offset;
+    return have / size;
+}
+
+static int
+mmap_getc(__pmFILE *f)
+{
+    unsigned char	c;
+
+    if (mmap_read(&c, 1, 1, f) != 1)
+	return EOF;
+    return c;
+}
+
+static size_t
+mmap_write(void *ptr, size_t size, size_t nmemb, __pmFILE *f)
+{
+    mmap_file_t	*mp = (mmap_file_t *)f->priv;
+
+    /* not supported */
+    mp->error = 1;
+    setoserror(EBADF);
+    return 0;
+}
+
+static int
+mmap_flush(__pmFILE *f)
+{
+    return 0;
+}
+
+static int
+mmap_fsync(__pmFILE *f)
+{
+    mmap_file_t	*mp = (mmap_file_t *)f->priv;
+
+    return fsync(mp->fd);
+}
+
+static int
+mmap_fileno(__pmFILE *f)
+{
+    mmap_file_t	*mp = (mmap_file_t *)f->priv;
+
+    return mp->fd;
+}
+
+static off_t
+mmap_lseek(__pmFILE *f, off_t offset, int whence)
+{
+    mmap_file_t	*mp = (mmap_file_t *)f->priv;
+
+    /* the file position is ours, not the descriptor's */
+    if (mmap_seek(f, offset, whence) < 0)
+	return (off_t)-1;
+    return mp->offset;
+}
+
+static int
+mmap_fstat(__pmFILE *f, struct stat *buf)
+{
+    mmap_file_t	*mp = (mmap_file_t *)f->priv;
+
+    return fstat(mp->fd, buf);
+}
+
+static int
+mmap_feof(__pmFILE *f)
+{
+    mmap_file_t	*mp = (mmap_file_t *)f->priv;
+
+    return mp->eof;
+}
+
+static int
+mmap_ferror(__pmFILE *f)
+{
+    mmap_file_t	*mp = (mmap_file_t *)f->priv;
+
+    return mp->error;
+}
+
+static void
+mmap_clearerr(__pmFILE *f)
+{
+    mmap_file_t	*mp = (mmap_file_t *)f->priv;
+
+    mp->eof = mp->error = 0;
+}
+
+static int
+mmap_setvbuf(__pmFILE *f, char *buf, int mode, size_t size)
+{
+    /* nothing is buffered */
+    return 0;
+}
+
+static int
+mmap_close(__pmFILE *f)
+{
+    mmap_file_t	*mp = (mmap_file_t *)f->priv;
+    int		sts;
+
+    if (mp->base != NULL)
+	munmap(mp->base, mp->size);
+    sts = close(mp->fd);
+    free(mp);
+    return sts;
+}
+
+__pm_fops __pm_mmap = {
+    /*
+     * mmap - read-only, no compression
+     */
+    .__pmopen = mmap_open,
+    .__pmfdopen = mmap_fdopen,
+    .__pmseek = mmap_seek,
+    .__pmrewind = mmap_rewind,
+    .__pmtell = mmap_tell,
+    .__pmfgetc = mmap_getc,
+    .__pmread = mmap_read,
+    .__pmwrite = mmap_write,
+    .__pmflush = mmap_flush,
+    .__pmfsync = mmap_fsync,
+    .__pmfileno = mmap_fileno,
+    .__pmlseek = mmap_lseek,
+    .__pmfstat = mmap_fstat,
+    .__pmfeof = mmap_feof,
+    .__pmferror = mmap_ferror,
+    .__pmclearerr = mmap_clearerr,
+    .__pmsetvbuf = mmap_setvbuf,
+    .__pmclose = mmap_close
+};
+#endif /* HAVE_SYS_MMAN_H && HAVE___THREAD */
@@ -44,52 +44,21 @@
 #include <lzma.h>
 #include "pmapi.h"
 #include "libpcp.h"
-
-#ifndef PCP_XZ_CACHE_BLOCKS
-#define PCP_XZ_CACHE_BLOCKS 4 /* 4 blocks in the cache, for now */
-#endif
+#include "internal.h"
 
 #define XZ_HEADER_MAGIC     "\xfd" "7zXZ\0"
 #define XZ_HEADER_MAGIC_LEN 6
 #define XZ_FOOTER_MAGIC     "YZ"
 #define XZ_FOOTER_MAGIC_LEN 2
 
-/* A block cache. Implemented as a very simple LRU list with a fixed depth. */
-#if 0 /* not used yet */
-typedef struct blkcache_stats {
-    size_t hits;
-    size_t misses;
-} blkcache_stats;
-#endif
-
-/* A buffer of uncompressed blocks */
-typedef struct block {
-    uint64_t start;
-    uint64_t size;
-    uint64_t current_offset;
-    char *data;
-} block;
-
-typedef struct blkcache {
-    int maxdepth;
-    block *blocks;
-#if 0 /* not used yet */
-    blkcache_stats stats;
-#endif
-} blkcache;
-
-/* The file handle */
-typedef struct xzfile {
-    FILE *f;
-    int fd;
-    lzma_index *idx;
-    size_t nr_streams;
-    size_t nr_blocks;
-    blkcache *cache;
-    off_t uncompressed_offset;
-  __uint64_t uncompressed_size;
-  __uint64_t max_uncompressed_block_size;
-} xzfile;
+/*
+ * The blocks are decoded, cached and read ahead in io_block.c, all
+ * that is needed here is to find them (from the stream indexes) and
+ * to decode one of them.  xz(1) writes a single block per file unless
+ * --block-size or -T is used, so a file needs to be compressed with
+ * something like "xz --block-size=10MiB" for blocks to be decoded in
+ * parallel, or for random access to be cheap.
+ */
 
 static void
 xz_debug(const char *fmt, ...)
@@ -102,72 +71,6 @@ xz_debug(const char *fmt, ...)
 #endif
 }
 
-blkcache *
-new_blkcache(size_t maxdepth)
-{
-  blkcache *c;
-
-  c = malloc(sizeof *c);
-  if (!c) {
-    xz_debug("malloc: %m");
-    return NULL;
-  }
-
-  c->blocks = calloc(maxdepth, sizeof(block));
-  if (!c->blocks) {
-    xz_debug("calloc: %m");
-    free(c);
-    return NULL;
-  }
-  c->maxdepth = maxdepth;
-#if 0 /* not used yet */
-  c->stats.hits = c->stats.misses = 0;
-#endif
-
-  return c;
-}
-
-void
-free_blkcache(blkcache *c)
-{
-  size_t i;
-
-  for (i = 0; i < c->maxdepth; ++i)
-    free(c->blocks[i].data);
-  free(c->blocks);
-  free(c);
-}
-
-#if 0 /* not used yet */
-void
-blkcache_get_stats(blkcache *c, blkcache_stats *ret)
-{
-  memcpy(ret, &c->stats, sizeof(c->stats));
-}
-#endif
-
-static int
-xz_feof(__pmFILE *f)
-{
-    xzfile *xz = f->priv;
-    if (xz->uncompressed_offset >= xz->uncompressed_size)
-	return 1;
-    return 0;
-}
-
-static int
-xz_ferror(__pmFILE *f)
-{
-    xz_debug("libpcp internal error: %s not implemented\n", __func__);
-    return 0;
-}
-
-static void
-xz_clearerr(__pmFILE *f)
-{
-    /* Do nothing --- for now */
-}
-
 static int
 check_header_magic(FILE *f)
 {
@@ -187,6 +90,42 @@ check_header_magic(FILE *f)
   return 0; /* ok */
 }
 
+/*
+ * An archive volume still being written by pmlogger (see its -Z option)
+ * may end part way through a stream.  Search back from pos for the end
+ * of the last complete stream, so that those before it can be read.
+ * Stream ends are 4-byte aligned and the footer has a CRC, so a false
+ * match is not a practical concern.  Returns -1 if there is none.
+ */
+static off_t
+last_stream_end(FILE *f, off_t pos)
+{
+  uint8_t buf[65536];
+  lzma_stream_flags flags;
+  off_t start, end;
+  size_t n, i;
+
+  end = pos & ~(off_t)3;
+  while (end >= 2 * LZMA_STREAM_HEADER_SIZE) {
+      start = end > (off_t)sizeof(buf) ? end - (off_t)sizeof(buf) : 0;
+      n = end - start;
+      if (fseeko(f, start, SEEK_SET) != 0 || fread(buf, 1, n, f) != n)
+	  return -1;
+      for (i = n; i >= LZMA_STREAM_HEADER_SIZE; i -= 4) {
+	  if (buf[i-2] != 'Y' || buf[i-1] != 'Z')
+	      continue;
+	  if (lzma_stream_footer_decode(&flags,
+		      buf + i - LZMA_STREAM_HEADER_SIZE) == LZMA_OK)
+	      return start + i;
+      }
+      if (start == 0)
+	  break;
+      /* overlap, for a footer that straddles the two reads */
+      end = start + LZMA_STREAM_HEADER_SIZE - 4;
+  }
+  return -1;
+}
+
 /* For explanation of this function, see src/xz/list.c:parse_indexes
  * in the xz sources.
  */
@@ -195,7 +134,7 @@ parse_indexes(FILE *f, size_t *nr_streams)
 {
   lzma_ret r;
   off_t index_size;
-  int pos;
+  off_t pos;
   int sts;
   uint8_t footer[LZMA_STREAM_HEADER_SIZE];
   uint8_t header[LZMA_STREAM_HEADER_SIZE];
@@ -213,12 +152,23 @@ parse_indexes(FILE *f, size_t *nr_streams)
   sts = fseek(f, 0, SEEK_END);
   if (sts != 0)
       goto err;
-  pos = ftell(f);
+  pos = ftello(f);
   if (pos == -1)
       goto err;
-  if ((pos & 3) != 0) {
-      setoserror(-PM_ERR_LOGREC);
-      goto err;
+  if ((pos & 3) == 0 && pos >= LZMA_STREAM_HEADER_SIZE) {
+      if (fseeko(f, pos - LZMA_STREAM_HEADER_SIZE, SEEK_SET) != 0 ||
+	  fread(footer, 1, LZMA_STREAM_HEADER_SIZE, f) != LZMA_STREAM_HEADER_SIZE)
+	  goto err;
+  }
+  if ((pos & 3) != 0 || pos < LZMA_STREAM_HEADER_SIZE ||
+      ((footer[8] | footer[9] | footer[10] | footer[11]) != 0 &&
+       lzma_stream_footer_decode(&footer_flags, footer) != LZMA_OK)) {
+      /* not padding nor a stream footer, a stream is being written */
+      if ((pos = last_stream_end(f, pos)) < 0) {
+	  setoserror(-PM_ERR_LOGREC);
+	  goto err;
+      }
+      xz_debug("%s: incomplete stream, reading to %ld", __func__, (long)pos);
   }
 
   /* Jump backwards through the file identifying each stream. */
@@ -228,7 +178,8 @@ parse_indexes(FILE *f, size_t *nr_streams)
 	  goto err;
       }
 
-      if (fseek(f, -LZMA_STREAM_HEADER_SIZE, SEEK_CUR) != 0) {
+      /* Not SEEK_CUR, after the first stream we were last at a header. */
+      if (fseeko(f, pos - LZMA_STREAM_HEADER_SIZE, SEEK_SET) != 0) {
 	  xz_debug("%s: fseek: %m", __func__);
 	  setoserror(-PM_ERR_LOGREC);
 	  goto err;
@@ -249,7 +200,7 @@ parse_indexes(FILE *f, size_t *nr_streams)
       pos -= LZMA_STREAM_HEADER_SIZE;
       (*nr_streams)++;
 
-      xz_debug("decode stream footer at pos = %d", pos);
+      xz_debug("decode stream footer at pos = %ld", (long)pos);
 
       /* Does the stream footer look reasonable? */
       r = lzma_stream_footer_decode(&footer_flags, footer);
@@ -268,10 +219,10 @@ parse_indexes(FILE *f, size_t *nr_streams)
       }
 
       pos -= index_size;
-      xz_debug("decode index at pos = %d", pos);
+      xz_debug("decode index at pos = %ld", (long)pos);
 
       /* Seek backwards to the index of this stream. */
-      if (fseek(f, pos, SEEK_SET) != 0) {
+      if (fseeko(f, pos, SEEK_SET) != 0) {
 	  xz_debug("%s: fseek: %m", __func__);
 	  setoserror(-PM_ERR_LOGREC);
 	  goto err;
@@ -313,10 +264,10 @@ parse_indexes(FILE *f, size_t *nr_streams)
 
       pos -= lzma_index_total_size(this_index) + LZMA_STREAM_HEADER_SIZE;
 
-      xz_debug("decode stream header at pos = %d", pos);
+      xz_debug("decode stream header at pos = %ld", (long)pos);
 
       /* Read and decode the stream header. */
-      if (fseek(f, pos, SEEK_SET) != 0) {
+      if (fseeko(f, pos, SEEK_SET) != 0) {
 	  xz_debug("%s: fseek: %m", __func__);
 	  setoserror(-PM_ERR_LOGREC);
 	  goto err;
@@ -387,540 +338,181 @@ parse_indexes(FILE *f, size_t *nr_streams)
   return NULL;
 }
 
-/* Iterate over the indexes to find the number of blocks and
- * the largest block.
+/*
+ * Decode one block, from its header to the end of its padding and check,
+ * straight into the caller's buffer.  Called from reader and read-ahead
+ * worker threads alike, so pread(2) and no shared state.
  */
 static int
-iter_indexes(lzma_index *idx,
-              size_t *nr_blocks, __uint64_t *max_uncompressed_block_size)
+xz_decode(void *arg, int fd, const __pmBlockInfo *bp, char *out)
 {
-  lzma_index_iter iter;
-
-  *nr_blocks = 0;
-  *max_uncompressed_block_size = 0;
-
-  lzma_index_iter_init(&iter, idx);
-  while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK)) {
-    if (iter.block.uncompressed_size > *max_uncompressed_block_size)
-      *max_uncompressed_block_size = iter.block.uncompressed_size;
-    (*nr_blocks)++;
-  }
-
-  return 0;
-}
-
-static int
-init(xzfile *xz)
-{
-  /* Check file magic. */
-  if (check_header_magic(xz->f) != 0)
-      return 1; /* error */
-
-  /* Read and parse the indexes. */
-  xz->idx = parse_indexes(xz->f, &xz->nr_streams);
-  if (xz->idx == NULL)
-      return 1; /* error */
-
-  /* Iterate over indexes to find the number of and largest block. */
-  if (iter_indexes(xz->idx,
-                    &xz->nr_blocks, &xz->max_uncompressed_block_size) == -1)
-      return 1; /* error */
-
-  xz->uncompressed_size = lzma_index_uncompressed_size(xz->idx);
-  xz->uncompressed_offset = 0;
-  xz->cache = new_blkcache(PCP_XZ_CACHE_BLOCKS);
-  
-  return 0; /* ok */
-}
-
-static void *
-xz_open(__pmFILE *f, const char *path, const char *mode)
-{
-  xzfile *xz;
-
-  xz = malloc(sizeof *xz);
-  if (xz == NULL) {
-      pmNoMem("xz_open", sizeof(*xz), PM_FATAL_ERR);
-      return NULL;
-  }
-
-  /* Open the file. */
-  xz->f = fopen(path, mode);
-  if (xz->f == NULL)
-      goto err;
-
-  if (init(xz) == 0) {
-      xz->fd = fileno(xz->f);
-      f->priv = xz;
-      return xz;
-  }
-
-  fclose(xz->f);
- err:
-  free(xz);
-  return NULL;
-}
-
-static void *
-xz_fdopen(__pmFILE *f, int fd, const char *mode)
-{
-  xzfile *xz;
-
-  xz = malloc(sizeof *xz);
-  if (xz == NULL) {
-      pmNoMem("xz_open", sizeof(*xz), PM_FATAL_ERR);
-      return NULL;
-  }
-
-  /* Open the file. */
-  xz->f = fdopen(fd, mode);
-  if (xz->f == NULL)
-      goto err;
-
-  if (init(xz) == 0) {
-      xz->fd = fd;
-      f->priv = xz;
-      return xz;
-  }
-
-  fclose(xz->f);
- err:
-  free(xz);
-  return NULL;
-}
-
-static int
-xz_seek(__pmFILE *f, off_t offset, int whence)
-{
-    xzfile *xz = (xzfile *)f->priv;;
-    __int64_t new_offset;
-
-    switch (whence) {
-    case SEEK_SET:
-	new_offset = offset;
-	break;
-    case SEEK_CUR:
-	new_offset = xz->uncompressed_offset + offset;
-	break;
-    case SEEK_END:
-	new_offset = xz->uncompressed_size + offset;
-	break;
-    default:
-	errno = EINVAL;
-	return -1;
-    }
-
-    if (new_offset < 0) {
-	errno = EINVAL;
-	return -1;
-    }
-
-    /* Don't actually seek to the requested offset now. Just record it. */
-    xz->uncompressed_offset = new_offset;
-    return 0;
-}
-
-static off_t
-xz_lseek(__pmFILE *f, off_t offset, int whence)
-{
-    /* The same as xz_seek for our purposes */
-    return xz_seek(f, offset, whence);
-}
-
-static void
-xz_rewind(__pmFILE *f)
-{
-    xzfile *xz = (xzfile *)f->priv;;
-
-    /* Don't actually seek to the requested offset now. Just record it. */
-    xz->uncompressed_offset = 0;
-
-    /* The function also requires that any error flag be reset. */
-    xz_clearerr(f);
-}
-
-static off_t
-xz_tell(__pmFILE *f)
-{
-    xzfile *xz = (xzfile *)f->priv;;
-    return xz->uncompressed_offset;
-}
-
-static block *
-cache_block_used(blkcache *cache, int slot)
-{
-    /* Move this block into the first slot, if it is not already there */
-    if (slot != 0) {
-	block used = cache->blocks[slot];
-	int i;
-	for (i = slot; i > 0; --i)
-	    cache->blocks[i] = cache->blocks[i - 1];
-	cache->blocks[0] = used;
-    }
-    return &cache->blocks[0];
-}
-
-static char *
-read_block(xzfile *xz, uint64_t offset,
-                   uint64_t *start_rtn, uint64_t *size_rtn)
-{
-  lzma_index_iter iter;
-  uint8_t header[LZMA_BLOCK_HEADER_SIZE_MAX];
   lzma_block block;
   lzma_filter filters[LZMA_FILTERS_MAX + 1];
   lzma_ret r;
-  lzma_stream strm = LZMA_STREAM_INIT;
-  char *data;
+  uint8_t *in;
+  size_t in_pos, out_pos = 0;
   ssize_t n;
   size_t i;
-
-  /* Locate the block containing the uncompressed offset. */
-  lzma_index_iter_init(&iter, xz->idx);
-  if (lzma_index_iter_locate(&iter, offset)) {
-    xz_debug("cannot find offset %lu in the xz file", offset);
-    return NULL;
-  }
-
-  *start_rtn = iter.block.uncompressed_file_offset;
-  *size_rtn = iter.block.uncompressed_size;
-
-  xz_debug("seek: block number %d at file offset %lu",
-                (int) iter.block.number_in_file,
-                (uint64_t) iter.block.compressed_file_offset);
-
-  if (lseek(xz->fd, iter.block.compressed_file_offset, SEEK_SET) == -1) {
-    xz_debug("lseek: %m");
-    return NULL;
+  int sts = 0;
+
+  if ((in = malloc(bp->csize)) == NULL)
+    return -ENOMEM;
+  n = pread(fd, in, bp->csize, bp->coffset);
+  if (n < 0) {
+    sts = -oserror();
+    goto out;
   }
-
-  /* Read the block header.  Start by reading a single byte which
-   * tell us how big the block header is.
-   */
-  n = read(xz->fd, header, 1);
-  if (n == 0) {
-    xz_debug("read: unexpected end of file reading block header byte");
-    return NULL;
-  }
-  if (n == -1) {
-    xz_debug("read: %m");
-    return NULL;
-  }
-
-  if (header[0] == '\0') {
-    xz_debug("read: unexpected invalid block in file, header[0] = 0");
-    return NULL;
+  if ((size_t)n != bp->csize || in[0] == '\0') {
+    xz_debug("xz_decode: short read or invalid block at offset %lu\n",
+	     (unsigned long)bp->coffset);
+    sts = PM_ERR_LOGREC;
+    goto out;
   }
 
   block.version = 0;
-  block.check = iter.stream.flags->check;
+  block.check = bp->check;
   block.filters = filters;
-  block.header_size = lzma_block_header_size_decode(header[0]);
-
-  /* Now read and decode the block header. */
-  n = read(xz->fd, &header[1], block.header_size-1);
-  if (n >= 0 && n != block.header_size-1) {
-    xz_debug("read: unexpected end of file reading block header");
-    return NULL;
-  }
-  if (n == -1) {
-    xz_debug("read: %m");
-    return NULL;
+  block.header_size = lzma_block_header_size_decode(in[0]);
+  if (block.header_size > bp->csize) {
+    sts = PM_ERR_LOGREC;
+    goto out;
   }
-
-  r = lzma_block_header_decode(&block, NULL, header);
+  filters[0].id = LZMA_VLI_UNKNOWN;
+  r = lzma_block_header_decode(&block, NULL, in);
   if (r != LZMA_OK) {
-    xz_debug("invalid block header (error %d)", r);
-    return NULL;
+    xz_debug("xz_decode: invalid block header (error %d)\n", r);
+    sts = PM_ERR_LOGREC;
+    goto out;
   }
 
-  /* What this actually does is it checks that the block header
-   * matches the index.
-   */
-  r = lzma_block_compressed_size(&block, iter.block.unpadded_size);
-  if (r != LZMA_OK) {
-    xz_debug("cannot calculate compressed size (error %d)", r);
-    goto err1;
-  }
-
-  /* Read the block data. */
-  r = lzma_block_decoder(&strm, &block);
-  if (r != LZMA_OK) {
-    xz_debug("invalid block (error %d)", r);
-    goto err1;
-  }
-
-  data = malloc(*size_rtn);
-  if (data == NULL) {
-    xz_debug("malloc(%lu bytes): %m\n"
-                  "NOTE: If this error occurs, you need to recompress your xz files with a smaller block size.  Use: 'xz --block-size=16777216 ...'.",
-                  *size_rtn);
-    goto err1;
-  }
-
-  strm.next_in = NULL;
-  strm.avail_in = 0;
-  strm.next_out = (uint8_t *) data;
-  strm.avail_out = block.uncompressed_size;
-
-  do {
-    uint8_t buf[BUFSIZ];
-    lzma_action action = LZMA_RUN;
-
-    if (strm.avail_in == 0) {
-      strm.next_in = buf;
-      n = read(xz->fd, buf, sizeof buf);
-      if (n == -1) {
-        xz_debug("read: %m");
-        goto err2;
-      }
-      strm.avail_in = n;
-      if (n == 0)
-        action = LZMA_FINISH;
-    }
-
-    strm.avail_in = n;
-    strm.next_in = buf;
-    r = lzma_code(&strm, action);
-  } while (r == LZMA_OK);
-
-  if (r != LZMA_OK && r != LZMA_STREAM_END) {
-    xz_debug("could not parse block data (error %d)", r);
-    goto err2;
+  in_pos = block.header_size;
+  r = lzma_block_buffer_decode(&block, NULL, in, &in_pos, bp->csize,
+			       (uint8_t *)out, &out_pos, bp->size);
+  if (r != LZMA_OK || out_pos != bp->size) {
+    xz_debug("xz_decode: could not decode block data (error %d)\n", r);
+    sts = (r == LZMA_MEM_ERROR) ? -ENOMEM : PM_ERR_LOGREC;
   }
-
-  lzma_end(&strm);
-
   for (i = 0; filters[i].id != LZMA_VLI_UNKNOWN; ++i)
     free(filters[i].options);
 
-  return data;
-
- err2:
-  free(data);
-  lzma_end(&strm);
- err1:
-  for (i = 0; filters[i].id != LZMA_VLI_UNKNOWN; ++i)
-    free(filters[i].options);
-
-  return NULL;
-}
-
-static block *
-read_new_block(xzfile *xz, int slot)
-{
-    blkcache *cache;
-    block *blk;
-    char *data;
-    uint64_t start = 0, size = 0; /* silence coverity */
-
-    /* Decompress a new block into the given slot. */
-    data = read_block(xz, xz->uncompressed_offset, &start, &size);
-    if (data == NULL)
-	return NULL;
-
-    /* Add the data to this block */
-    cache = xz->cache;
-    blk = &cache->blocks[slot];
-    if (blk->data != NULL)
-	free(blk->data);
-    blk->data = data;
-    blk->start = start;
-    blk->size = size;
-    blk->current_offset = xz->uncompressed_offset - blk->start;
-
-    /* Mark this block as most recently used */
-    blk = cache_block_used(cache, slot);
-	    
-    return blk;
+ out:
+  free(in);
+  return sts;
 }
 
 /*
- * Find the block containing the current uncompressed offset and update the
- * current offset within that block..
+ * Check the magic and parse the indexes (using a separate stdio stream
+ * on a dup of fd), then hand the non-empty blocks to io_block.c.
+ * Does not close fd on failure.
  */
-static block *
-reposition(xzfile *xz)
-{
-    blkcache *cache;
-    block *blk;
-    int slot;
-
-    /*
-     * Search the cache for the block we want.
-     * The cache is sorted by most recently used blocks. This works out well
-     * since the data we want is most often in the block which will be checked
-     * first.
-     */
-    cache = xz->cache;
-    for (slot = 0; slot < cache->maxdepth; ++slot) {
-	blk = &cache->blocks[slot];
-	if (blk->data == NULL)
-	    break; /* end of cache */
-
-	if (xz->uncompressed_offset >= blk->start &&
-	    xz->uncompressed_offset < blk->start + blk->size) {
-	    /* found it */
-	    blk->current_offset = xz->uncompressed_offset - blk->start;
-	    blk = cache_block_used(cache, slot);
-	    return blk;
-	}
-    }
-
-    /*
-     * No cached block contains the uncompressed offset that we want.
-     * Decompress a new block into an empty slot, or into the least recently
-     * used slot, which is the last one.
-     */
-    if (slot >= cache->maxdepth)
-	slot = cache->maxdepth - 1;
-    blk = read_new_block(xz, slot);
-
-    return blk;
-}
-
-static int
-xz_getc(__pmFILE *f)
-{
-    xzfile *xz = (xzfile *)f->priv;;
-    block *blk = reposition(xz);
-    int c;
-
-    if (blk == NULL)
-	return EOF;
-
-    /* It's a single byte. It is guaranteed that we can copy it. */
-    c = *(blk->data + blk->current_offset);
-    ++xz->uncompressed_offset;
-    ++blk->current_offset;
-    return c;
-}
-
-static size_t
-xz_read(void *ptr, size_t size, size_t nmemb, __pmFILE *f)
-{
-    xzfile *xz = (xzfile *)f->priv;;
-    block *blk;
-    const char *p;
-    size_t n;
-    size_t copied;
-
-    /* Obtain the requested size in bytes. */
-    size *= nmemb;
-
-    /*
-     * Copy data from the current block and possibly from subsequent blocks
-     * until we have copied the requested number of bytes. */
-    copied = 0;
-    while (size > 0) {
-	blk = reposition(xz);
-	if (blk == NULL)
-	    return 0; /* error */
-
-	/* See how many bytes we can copy from the current block. */
-	p =  blk->data + blk->current_offset;
-	n = size;
-	if (n > blk->size - blk->current_offset)
-	    n = blk->size - blk->current_offset;
-
-	/*
-	 * Copy the requested number of bytes from the current block to the
-	 * output buffer. We are guaranteed to be able to copy at least one
-	 * byte.
-	 */
-	memcpy(ptr, p, n);
-	copied += n;
-	xz->uncompressed_offset += n;
-	blk->current_offset += n;
-	ptr = ((char *)ptr) + n;
-	size -= n;
-    }
-
-    return copied;
-}
-
-static size_t
-xz_write(void *ptr, size_t size, size_t nmemb, __pmFILE *f)
+static void *
+xz_init(__pmFILE *f, int fd)
 {
-    xz_debug("libpcp internal error: %s not implemented\n", __func__);
-    return 0;
-}
+  lzma_index *idx;
+  lzma_index_iter iter;
+  __pmBlockInfo *blocks;
+  size_t nr_streams;
+  int nblocks = 0;
+  FILE *fp;
+  int newfd;
+  int sts;
 
-static int
-xz_flush(__pmFILE *f)
-{
-    xz_debug("libpcp internal error: %s not implemented\n", __func__);
-    return EOF;
-}
+  if ((newfd = dup(fd)) < 0)
+      return NULL;
+  if ((fp = fdopen(newfd, "r")) == NULL) {
+      sts = oserror();
+      close(newfd);
+      setoserror(sts);
+      return NULL;
+  }
+  if (check_header_magic(fp) != 0) {
+      sts = oserror();
+      fclose(fp);
+      setoserror(sts);
+      return NULL;
+  }
+  idx = parse_indexes(fp, &nr_streams);
+  sts = oserror();
+  fclose(fp);
+  if (idx == NULL) {
+      setoserror(sts);
+      return NULL;
+  }
 
-static int
-xz_fsync(__pmFILE *f)
-{
-    xz_debug("libpcp internal error: %s not implemented\n", __func__);
-    return -1;
-}
+  blocks = calloc(lzma_index_block_count(idx) + 1, sizeof(*blocks));
+  if (blocks == NULL) {
+      lzma_index_end(idx, NULL);
+      setoserror(ENOMEM);
+      return NULL;
+  }
+  lzma_index_iter_init(&iter, idx);
+  while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK)) {
+      blocks[nblocks].coffset = iter.block.compressed_file_offset;
+      blocks[nblocks].csize = iter.block.total_size;
+      blocks[nblocks].size = iter.block.uncompressed_size;
+      blocks[nblocks].check = iter.stream.flags->check;
+      nblocks++;
+  }
+  lzma_index_end(idx, NULL);
 
-static int
-xz_fileno(__pmFILE *f)
-{
-    xzfile *xz = f->priv;
-    return xz->fd;
+  if (pmDebugOptions.log)
+      fprintf(stderr, "xz_init: %d streams, %d blocks\n",
+		(int)nr_streams, nblocks);
+  return __pmBlockOpen(f, fd, blocks, nblocks, xz_decode, NULL, NULL);
 }
 
-static int
-xz_fstat(__pmFILE *f, struct stat *buf)
+static void *
+xz_open(__pmFILE *f, const char *path, const char *mode)
 {
-    xzfile *xz = f->priv;
-    FILE *fp = xz->f;
-    int rc = fstat(fileno(fp), buf);
-
-    /* What the caller really wants for st_size is the uncompressed size. */
-    if (rc != -1)
-	buf->st_size = xz->uncompressed_size;
-    
-    return rc;
-}
+  int fd;
+  int sts;
 
-static int
-xz_setvbuf(__pmFILE *f, char *buf, int mode, size_t size)
-{
-    xz_debug("libpcp internal error: %s not implemented\n", __func__);
-    return -1;
+  if (mode[0] != 'r' || mode[1] != '\0') {
+      setoserror(EINVAL);
+      return NULL;
+  }
+  if ((fd = open(path, O_RDONLY)) < 0)
+      return NULL;
+  if (xz_init(f, fd) == NULL) {
+      sts = oserror();
+      close(fd);
+      setoserror(sts);
+      return NULL;
+  }
+  return f;
 }
 
-static int
-xz_close(__pmFILE *f)
+static void *
+xz_fdopen(__pmFILE *f, int fd, const char *mode)
 {
-    xzfile *xz = f->priv;
-    int sts;
-    
-    lzma_index_end (xz->idx, NULL);
-    sts = fclose(xz->f);
-    free_blkcache(xz->cache);
-    free(xz);
-    return sts;
+  if (mode[0] != 'r' || mode[1] != '\0') {
+      setoserror(EINVAL);
+      return NULL;
+  }
+  return xz_init(f, fd);
 }
 
 __pm_fops __pm_xz = {
     /*
-     * xz decompression
+     * xz decompression, see io_block.c for everything but open
      */
     .__pmopen = xz_open,
     .__pmfdopen = xz_fdopen,
-    .__pmseek = xz_seek,
-    .__pmrewind = xz_rewind,
-    .__pmtell = xz_tell,
-    .__pmfgetc = xz_getc,
-    .__pmread = xz_read,
-    .__pmwrite = xz_write,
-    .__pmflush = xz_flush,
-    .__pmfsync = xz_fsync,
-    .__pmfileno = xz_fileno,
-    .__pmlseek = xz_lseek,
-    .__pmfstat = xz_fstat,
-    .__pmfeof = xz_feof,
-    .__pmferror = xz_ferror,
-    .__pmclearerr = xz_clearerr,
-    .__pmsetvbuf = xz_setvbuf,
-    .__pmclose = xz_close
+    .__pmseek = __pmBlockSeek,
+    .__pmrewind = __pmBlockRewind,
+    .__pmtell = __pmBlockTell,
+    .__pmfgetc = __pmBlockGetc,
+    .__pmread = __pmBlockRead,
+    .__pmwrite = __pmBlockWrite,
+    .__pmflush = __pmBlockFlush,
+    .__pmfsync = __pmBlockFsync,
+    .__pmfileno = __pmBlockFileno,
+    .__pmlseek = __pmBlockLseek,
+    .__pmfstat = __pmBlockFstat,
+    .__pmfeof = __pmBlockFeof,
+    .__pmferror = __pmBlockFerror,
+    .__pmclearerr = __pmBlockClearerr,
+    .__pmsetvbuf = __pmBlockSetvbuf,
+    .__pmclose = __pmBlockClose
 };
 #endif /* HAVE_LZMA_DECOMPRESSION */
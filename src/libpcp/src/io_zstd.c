@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ */
+
+/*
+ * Read-only i/o handler for zstd compressed archive files, in-process
+ * rather than with zstd -dc into a temporary file.
+ *
+ * Each zstd frame is treated as a block by io_block.c, which does the
+ * caching, seeking and read-ahead.  zstd(1) writes a single frame per
+ * file, so random access (and parallel decoding) needs files made up
+ * of several frames, e.g. independently compressed chunks concatenated
+ * together, which is what zstd -dc already handles.
+ *
+ * The compressed file is mapped into memory, so finding the frames and
+ * decoding them needs no copying and no system calls.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "pmapi.h"
+#include "libpcp.h"
+#include "internal.h"
+#if HAVE_ZSTD_DECOMPRESSION && HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#include <zstd.h>
+#include <zstd_errors.h>
+
+typedef struct {
+    const char	*base;		/* mapping of the whole compressed file */
+    size_t	size;
+} zstd_map_t;
+
+static int
+zstd_decode(void *arg, int fd, const __pmBlockInfo *bp, char *out)
+{
+    zstd_map_t	*zp = (zstd_map_t *)arg;
+    size_t	sts;
+
+    sts = ZSTD_decompress(out, bp->size, zp->base + bp->coffset, bp->csize);
+    if (ZSTD_isError(sts)) {
+	if (pmDebugOptions.log)
+	    fprintf(stderr, "zstd_decode: frame at offset %llu: %s\n",
+		    (unsigned long long)bp->coffset, ZSTD_getErrorName(sts));
+	return PM_ERR_LOGREC;
+    }
+    return (sts == bp->size) ? 0 : PM_ERR_LOGREC;
+}
+
+static void
+zstd_release(void *arg)
+{
+    zstd_map_t	*zp = (zstd_map_t *)arg;
+
+    munmap((void *)zp->base, zp->size);
+    free(zp);
+}
+
+/*
+ * Uncompressed size of a frame that does not record it (written by a
+ * streaming compressor), found the hard way by decoding the frame.
+ */
+static unsigned long long
+frame_size(const char *src, size_t len)
+{
+    ZSTD_DStream	*ds;
+    ZSTD_inBuffer	in = { src, len, 0 };
+    ZSTD_outBuffer	out;
+    unsigned long long	total = 0;
+    char		*buf;
+    size_t		sts;
+
+    if ((ds = ZSTD_createDStream()) == NULL)
+	return ZSTD_CONTENTSIZE_ERROR;
+    if ((buf = (char *)malloc(ZSTD_DStreamOutSize())) == NULL) {
+	ZSTD_freeDStream(ds);
+	return ZSTD_CONTENTSIZE_ERROR;
+    }
+    ZSTD_initDStream(ds);
+    do {
+	out.dst = buf;
+	out.size = ZSTD_DStreamOutSize();
+	out.pos = 0;
+	sts = ZSTD_decompressStream(ds, &out, &in);
+	if (ZSTD_isError(sts)) {
+	    total = ZSTD_CONTENTSIZE_ERROR;
+	    break;
+	}
+	total += out.pos;
+    } while (sts != 0 && (in.pos < in.size || out.pos == out.size));
+    if (sts != 0 && total != ZSTD_CONTENTSIZE_ERROR)
+	total = ZSTD_CONTENTSIZE_ERROR;		/* truncated */
+    free(buf);
+    ZSTD_freeDStream(ds);
+    return total;
+}
+
+/*
+ * Map the file and walk the frames, then hand the non-empty ones
+ * to io_block.c.  Does not close fd on failure.
+ */
+static void *
+zstd_init(__pmFILE *f, int fd)
+{
+    zstd_map_t		*zp;
+    __pmBlockInfo	*blocks = NULL, *tmp;
+    struct stat		sbuf;
+    unsigned long long	usize;
+    const unsigned char	*p;
+    unsigned int	magic;
+    size_t		offset, csize;
+    void		*base;
+    int			nblocks = 0, maxblocks = 0;
+    int			sts;
+
+    if (fstat(fd, &sbuf) < 0)
+	return NULL;
+    if (sbuf.st_size < 4) {
+	setoserror(-PM_ERR_LOGREC);
+	return NULL;
+    }
+    base = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+	return NULL;
+    if ((zp = (zstd_map_t *)malloc(sizeof(*zp))) == NULL) {
+	munmap(base, sbuf.st_size);
+	setoserror(ENOMEM);
+	return NULL;
+    }
+    zp->base = (const char *)base;
+    zp->size = sbuf.st_size;
+
+    for (offset = 0; offset < zp->size; offset += csize) {
+	csize = ZSTD_findFrameCompressedSize(zp->base + offset, zp->size - offset);
+	if (ZSTD_isError(csize) && nblocks > 0 &&
+	    ZSTD_getErrorCode(csize) == ZSTD_error_srcSize_wrong) {
+	    /* last frame is still being written (pmlogger -Z), stop here */
+	    if (pmDebugOptions.log)
+		fprintf(stderr, "zstd_init: incomplete frame at offset %llu\n",
+			(unsigned long long)offset);
+	    break;
+	}
+	if (ZSTD_isError(csize)) {
+	    if (pmDebugOptions.log)
+		fprintf(stderr, "zstd_init: frame at offset %llu: %s\n",
+			(unsigned long long)offset, ZSTD_getErrorName(csize));
+	    sts = PM_ERR_LOGREC;
+	    goto fail;
+	}
+	/* frame magic is little-endian, skippable frames hold no data */
+	p = (const unsigned char *)zp->base + offset;
+	magic = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+	if ((magic & ZSTD_MAGIC_SKIPPABLE_MASK) == ZSTD_MAGIC_SKIPPABLE_START)
+	    continue;
+	usize = ZSTD_getFrameContentSize(zp->base + offset, csize);
+	if (usize == ZSTD_CONTENTSIZE_UNKNOWN)
+	    usize = frame_size(zp->base + offset, csize);
+	if (usize == ZSTD_CONTENTSIZE_ERROR) {
+	    sts = PM_ERR_LOGREC;
+	    goto fail;
+	}
+	if (usize == 0)
+	    continue;
+	if (nblocks == maxblocks) {
+	    maxblocks = maxblocks ? 2 * maxblocks : 8;
+	    if ((tmp = (__pmBlockInfo *)realloc(blocks, maxblocks * sizeof(*tmp))) == NULL) {
+		sts = -ENOMEM;
+		goto fail;
+	    }
+	    blocks = tmp;
+	}
+	memset(&blocks[nblocks], 0, sizeof(*blocks));
+	blocks[nblocks].coffset = offset;
+	blocks[nblocks].csize = csize;
+	blocks[nblocks].size = usize;
+	nblocks++;
+    }
+
+    if (pmDebugOptions.log)
+	fprintf(stderr, "zstd_init: %d frames\n", nblocks);
+    if (__pmBlockOpen(f, fd, blocks, nblocks, zstd_decode, zstd_release, zp) == NULL) {
+	sts = -oserror();
+	zstd_release(zp);
+	setoserror(-sts);
+	return NULL;
+    }
+    return f;
+
+fail:
+    free(blocks);
+    zstd_release(zp);
+    setoserror(-sts);
+    return NULL;
+}
+
+static void *
+zstd_open(__pmFILE *f, const char *path, const char *mode)
+{
+    int		fd;
+    int		sts;
+
+    if (mode[0] != 'r' || mode[1] != '\0') {
+	setoserror(EINVAL);
+	return NULL;
+    }
+    if ((fd = open(path, O_RDONLY)) < 0)
+	return NULL;
+    if (zstd_init(f, fd) == NULL) {
+	sts = oserror();
+	close(fd);
+	setoserror(sts);
+	return NULL;
+    }
+    return f;
+}
+
+static void *
+zstd_fdopen(__pmFILE *f, int fd, const char *mode)
+{
+    if (mode[0] != 'r' || mode[1] != '\0') {
+	setoserror(EINVAL);
+	return NULL;
+    }
+    return zstd_init(f, fd);
+}
+
+__pm_fops __pm_zstd = {
+    /*
+     * zstd decompression, see io_block.c for everything but open
+     */
+    .__pmopen = zstd_open,
+    .__pmfdopen = zstd_fdopen,
+    .__pmseek = __pmBlockSeek,
+    .__pmrewind = __pmBlockRewind,
+    .__pmtell = __pmBlockTell,
+    .__pmfgetc = __pmBlockGetc,
+    .__pmread = __pmBlockRead,
+    .__pmwrite = __pmBlockWrite,
+    .__pmflush = __pmBlockFlush,
+    .__pmfsync = __pmBlockFsync,
+    .__pmfileno = __pmBlockFileno,
+    .__pmlseek = __pmBlockLseek,
+    .__pmfstat = __pmBlockFstat,
+    .__pmfeof = __pmBlockFeof,
+    .__pmferror = __pmBlockFerror,
+    .__pmclearerr = __pmBlockClearerr,
+    .__pmsetvbuf = __pmBlockSetvbuf,
+    .__pmclose = __pmBlockClose
+};
+#endif /* HAVE_ZSTD_DECOMPRESSION && HAVE_SYS_MMAN_H */
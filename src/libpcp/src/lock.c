@@ -65,7 +65,11 @@ __pmIsLockLock(void *lock)
 }
 #endif
 
-/* the big libpcp lock */
+/*
+ * the big libpcp lock ... no longer acquired anywhere within libpcp
+ * (each subsystem and each context has its own mutex), but retained
+ * for applications and PMDAs that reference it at the shlib ABI level
+ */
 #ifdef PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP
 pthread_mutex_t	__pmLock_libpcp = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 #else
@@ -172,6 +176,10 @@ static char
 	return "connect";
     else if (__pmIsExecLock(lock))
 	return "exec";
+    else if (__pmIsAccessLock(lock))
+	return "access";
+    else if (__pmIsBlockLock(lock))
+	return "block";
     else if (lock == (void *)&__pmLock_extcall)
 	return "global_extcall";
     else if ((ctxid = __pmIsContextLock(lock)) != -1) {
@@ -404,6 +412,7 @@ __pmInitLocks(void)
 	init_secureserver_lock();
 	init_connect_lock();
 	init_exec_lock();
+	init_access_lock();
 
 	done = 1;
     }
@@ -0,0 +1,1377 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ */
+
+/*
+ * Columnar sidecar for archives.
+ *
+ * Fetching one or two metrics from an archive means reading and decoding
+ * every pmResult in every volume, even though almost all of the values
+ * are thrown away again in __pmLogFetch().  The sidecar (<base>.col,
+ * built from an existing archive by __pmLogWriteColumns() and pmlogcolumn)
+ * holds the same values re-arranged by metric, so a fetch of a few
+ * metrics need only decode the columns for those metrics.
+ *
+ * File format (integers are unsigned LEB128 varints unless noted,
+ * signed quantities are zigzag encoded first) ...
+ *
+ *	magic, version		two 32-bit ints, network byte order
+ *	header length
+ *	header:
+ *	    archive label	magic, pid, start sec, start usec
+ *	    volumes		minvol, maxvol, then the size of each volume
+ *				file when the sidecar was built (0 if
+ *				missing)
+ *	    records		count, then for each record in the archive
+ *				vol delta, start (delta from the end of the
+ *				previous record in the same volume, else
+ *				absolute), length << 1 | mark flag, and
+ *				the timestamp in usec as a delta-of-delta
+ *	    columns		count, then for each metric (ascending pmID)
+ *				pmid, valfmt, vtype, vlen, entries, blocks,
+ *				data offset, data length and for each block
+ *				first record (delta) and offset (delta)
+ *	column data		one bitstream per metric
+ *
+ * Each column has one entry for every record containing the metric, in
+ * blocks of COL_BLOCK entries that can be decoded independently.  An
+ * entry is the record number (delta), numval, the instance list (one bit
+ * if unchanged from the previous entry, else zigzag deltas) and then the
+ * values as 64-bit patterns, XOR'd with the value in the same position of
+ * the previous entry and encoded as for Gorilla (Pelkonen et al., VLDB
+ * 2015) ... a 0 bit if unchanged, 10 and the meaningful bits if they fit
+ * in the previous window, else 11, 6 bits of leading zeroes, 6 bits of
+ * length and the meaningful bits.  Counters and slowly changing gauges
+ * cost a few bits per value, instead of the 12 or more bytes per value
+ * in a pmResult.
+ *
+ * Only metrics with numeric values (32 and 64-bit integers, float and
+ * double) that are consistently encoded are covered, anything else is
+ * left out of the sidecar and fetched from the archive as usual.
+ *
+ * Reading, the sidecar is loaded on the first __pmLogFetch() for each
+ * archive, if it matches the archive label and the volume sizes (a
+ * sidecar that is out of date is quietly ignored), unless
+ * $PCP_ARCHIVE_NO_COLUMNS is set.  __pmLogFetchColumns() stands in for
+ * __pmLogRead() for forward and backward fetches when the current
+ * position is exactly at a record boundary the sidecar knows about and
+ * every requested metric has a column, otherwise (volume and archive
+ * boundaries, records appended since the sidecar was built, metrics not
+ * covered) __pmLogRead() is used as before.  The file position is moved
+ * exactly as __pmLogRead() would, so the two may be mixed freely.
+ *
+ * Thread-safe notes
+ *
+ * The sidecar state hangs off the __pmLogCtl (shared by all contexts
+ * using the archive) and is protected by l_lock, including the cache of
+ * decoded blocks.
+ */
+
+#include <sys/stat.h>
+#include "pmapi.h"
+#include "libpcp.h"
+#include "internal.h"
+
+#define COL_MAGIC	0x50434f4c	/* "PCOL" */
+#define COL_VERSION	1
+#define COL_BLOCK	256		/* entries per independently decoded block */
+#define COL_MAXLEN	(256*1024*1024)	/* sanity limit for header length */
+
+#define ZIGZAG(x)	(((__uint64_t)(x) << 1) ^ (__uint64_t)((__int64_t)(x) >> 63))
+#define UNZIGZAG(u)	((__int64_t)((u) >> 1) ^ -(__int64_t)((u) & 1))
+
+/*
+ * growable buffer, appended to a bit at a time (most significant first)
+ * or a byte at a time
+ */
+typedef struct {
+    unsigned char	*buf;
+    size_t		len;
+    size_t		size;
+    int			free;		/* unused bits in buf[len-1] */
+} colbuf_t;
+
+typedef struct {
+    const unsigned char	*buf;
+    size_t		len;
+    size_t		bit;		/* next bit to read */
+} colread_t;
+
+typedef struct {
+    __uint64_t		prev;		/* previous value in this position */
+    int			lz;		/* leading zeroes of window, -1 if none */
+    int			tz;		/* trailing zeroes of window */
+} xorstate_t;
+
+typedef struct {
+    pmTimeval		stamp;
+    int			vol;
+    int			mark;
+    long		start;		/* offset of record in volume */
+    long		len;		/* including header and trailer */
+} colrec_t;
+
+typedef struct {
+    int			first;		/* record number of first entry */
+    size_t		offset;		/* byte offset into column data */
+} colblock_t;
+
+typedef struct {
+    int			rec;		/* record number */
+    int			numval;		/* or error code */
+    int			idx;		/* first inst and value in cache */
+} colent_t;
+
+typedef struct {
+    pmID		pmid;
+    int			valfmt;
+    int			vtype;
+    int			vlen;
+    int			nent;
+    int			nblock;
+    colblock_t		*block;
+    long		offset;		/* of data, from start of data */
+    size_t		length;
+    unsigned char	*data;		/* NULL until first used */
+    int			cached;		/* decoded block, -1 if none */
+    int			ncache;		/* entries in cache */
+    colent_t		*ent;
+    int			nval;		/* values in cache */
+    int			maxval;
+    int			*inst;
+    __uint64_t		*val;
+    int			maxxs;
+    xorstate_t		*xs;
+} column_t;
+
+struct __pmLogColumns {
+    FILE		*fp;
+    long		dataoff;	/* start of column data in file */
+    int			nrec;
+    colrec_t		*rec;
+    int			ncol;
+    column_t		*col;
+};
+
+/*
+ * bit and varint i/o
+ */
+static int
+bufgrow(colbuf_t *b, size_t need)
+{
+    size_t		size;
+    unsigned char	*buf;
+
+    if (b->len + need <= b->size)
+	return 0;
+    size = b->size ? b->size : 1024;
+    while (size < b->len + need)
+	size *= 2;
+    if ((buf = (unsigned char *)realloc(b->buf, size)) == NULL)
+	return -ENOMEM;
+    b->buf = buf;
+    b->size = size;
+    return 0;
+}
+
+static int
+putbits(colbuf_t *b, __uint64_t v, int n)
+{
+    int		take;
+    unsigned int	chunk;
+
+    while (n > 0) {
+	if (b->free == 0) {
+	    if (bufgrow(b, 1) < 0)
+		return -ENOMEM;
+	    b->buf[b->len++] = 0;
+	    b->free = 8;
+	}
+	take = n < b->free ? n : b->free;
+	chunk = (unsigned int)(v >> (n - take)) & ((1u << take) - 1);
+	b->buf[b->len-1] |= chunk << (b->free - take);
+	b->free -= take;
+	n -= take;
+    }
+    return 0;
+}
+
+static int
+putvar(colbuf_t *b, __uint64_t v)
+{
+    while (v >= 0x80) {
+	if (putbits(b, (v & 0x7f) | 0x80, 8) < 0)
+	    return -ENOMEM;
+	v >>= 7;
+    }
+    return putbits(b, v, 8);
+}
+
+/* start a byte aligned block */
+static void
+putalign(colbuf_t *b)
+{
+    b->free = 0;
+}
+
+static int
+getbits(colread_t *r, int n, __uint64_t *vp)
+{
+    __uint64_t	v = 0;
+    int		avail, take;
+
+    if (r->bit + n > r->len * 8)
+	return -1;
+    while (n > 0) {
+	avail = 8 - (int)(r->bit & 7);
+	take = n < avail ? n : avail;
+	v = (v << take) | ((r->buf[r->bit >> 3] >> (avail - take)) & ((1u << take) - 1));
+	r->bit += take;
+	n -= take;
+    }
+    *vp = v;
+    return 0;
+}
+
+static int
+getvar(colread_t *r, __uint64_t *vp)
+{
+    __uint64_t	v = 0;
+    __uint64_t	byte;
+    int		shift;
+
+    for (shift = 0; shift < 64; shift += 7) {
+	if (getbits(r, 8, &byte) < 0)
+	    return -1;
+	v |= (byte & 0x7f) << shift;
+	if ((byte & 0x80) == 0) {
+	    *vp = v;
+	    return 0;
+	}
+    }
+    return -1;
+}
+
+/* varint that must fit in a non-negative int */
+static int
+getint(colread_t *r, int *ip)
+{
+    __uint64_t	v;
+
+    if (getvar(r, &v) < 0 || v > 0x7fffffff)
+	return -1;
+    *ip = (int)v;
+    return 0;
+}
+
+/*
+ * XOR compression of one value
+ */
+static int
+putxor(colbuf_t *b, xorstate_t *xs, __uint64_t v)
+{
+    __uint64_t	x = v ^ xs->prev;
+    int		lz, tz, sts;
+
+    xs->prev = v;
+    if (x == 0)
+	return putbits(b, 0, 1);
+    for (lz = 0; (x & ((__uint64_t)1 << (63 - lz))) == 0; lz++)
+	;
+    for (tz = 0; (x & ((__uint64_t)1 << tz)) == 0; tz++)
+	;
+    if (xs->lz >= 0 && lz >= xs->lz && tz >= xs->tz) {
+	if ((sts = putbits(b, 2, 2)) < 0)
+	    return sts;
+	return putbits(b, x >> xs->tz, 64 - xs->lz - xs->tz);
+    }
+    if ((sts = putbits(b, 3, 2)) < 0 ||
+	(sts = putbits(b, lz, 6)) < 0 ||
+	(sts = putbits(b, 64 - lz - tz - 1, 6)) < 0)
+	return sts;
+    xs->lz = lz;
+    xs->tz = tz;
+    return putbits(b, x >> tz, 64 - lz - tz);
+}
+
+static int
+getxor(colread_t *r, xorstate_t *xs, __uint64_t *vp)
+{
+    __uint64_t	ctl, x, lz, len;
+
+    if (getbits(r, 1, &ctl) < 0)
+	return -1;
+    if (ctl == 0) {
+	*vp = xs->prev;
+	return 0;
+    }
+    if (getbits(r, 1, &ctl) < 0)
+	return -1;
+    if (ctl == 1) {
+	if (getbits(r, 6, &lz) < 0 || getbits(r, 6, &len) < 0)
+	    return -1;
+	len++;
+	if (lz + len > 64)
+	    return -1;
+	xs->lz = (int)lz;
+	xs->tz = 64 - (int)lz - (int)len;
+    }
+    else if (xs->lz < 0)
+	return -1;
+    if (getbits(r, 64 - xs->lz - xs->tz, &x) < 0)
+	return -1;
+    xs->prev ^= x << xs->tz;
+    *vp = xs->prev;
+    return 0;
+}
+
+static void
+xorreset(xorstate_t *xs, int n)
+{
+    int		i;
+
+    for (i = 0; i < n; i++) {
+	xs[i].prev = 0;
+	xs[i].lz = -1;
+	xs[i].tz = 0;
+    }
+}
+
+/*
+ * Building the sidecar
+ */
+
+typedef struct {
+    pmID		pmid;
+    int			skip;		/* not representable, leave it out */
+    int			valfmt;		/* -1 until first value seen */
+    int			vtype;
+    int			vlen;
+    int			nent;
+    int			nblock;
+    int			maxblock;
+    colblock_t		*block;
+    colbuf_t		data;
+    int			prevrec;
+    int			ninst;		/* instances in inst[], -1 if none */
+    int			maxinst;
+    int			*inst;
+    xorstate_t		*xs;
+} colbuild_t;
+
+static void
+buildfree(colbuild_t *cbp)
+{
+    free(cbp->block);
+    free(cbp->data.buf);
+    free(cbp->inst);
+    free(cbp->xs);
+    cbp->block = NULL;
+    cbp->data.buf = NULL;
+    cbp->inst = NULL;
+    cbp->xs = NULL;
+}
+
+/*
+ * Check one pmValueSet has a value encoding the columns can represent,
+ * and the same one as before for this metric.
+ */
+static int
+buildcheck(colbuild_t *cbp, const pmValueSet *vsp)
+{
+    const pmValueBlock	*vbp;
+    int			j;
+
+    if (vsp->numval <= 0)
+	return 0;
+    if (cbp->valfmt == -1) {
+	cbp->valfmt = vsp->valfmt;
+	if (vsp->valfmt == PM_VAL_INSITU) {
+	    cbp->vtype = PM_TYPE_32;
+	    cbp->vlen = 0;
+	}
+	else if (vsp->valfmt == PM_VAL_DPTR) {
+	    vbp = vsp->vlist[0].value.pval;
+	    cbp->vtype = vbp->vtype;
+	    cbp->vlen = vbp->vlen;
+	    switch (vbp->vtype) {
+		case PM_TYPE_32:
+		case PM_TYPE_U32:
+		case PM_TYPE_FLOAT:
+		    if (vbp->vlen != PM_VAL_HDR_SIZE + 4)
+			return -1;
+		    break;
+		case PM_TYPE_64:
+		case PM_TYPE_U64:
+		case PM_TYPE_DOUBLE:
+		    if (vbp->vlen != PM_VAL_HDR_SIZE + 8)
+			return -1;
+		    break;
+		default:
+		    return -1;
+	    }
+	}
+	else
+	    return -1;
+    }
+    if (vsp->valfmt != cbp->valfmt)
+	return -1;
+    if (vsp->valfmt == PM_VAL_DPTR) {
+	for (j = 0; j < vsp->numval; j++) {
+	    vbp = vsp->vlist[j].value.pval;
+	    if (vbp->vtype != cbp->vtype || vbp->vlen != cbp->vlen)
+		return -1;
+	}
+    }
+    return 0;
+}
+
+static __uint64_t
+getvalue(const colbuild_t *cbp, const pmValue *vp)
+{
+    __uint32_t		u32;
+    __uint64_t		u64;
+
+    if (cbp->valfmt == PM_VAL_INSITU)
+	return (__uint32_t)vp->value.lval;
+    if (cbp->vlen == PM_VAL_HDR_SIZE + 4) {
+	memcpy(&u32, vp->value.pval->vbuf, sizeof(u32));
+	return u32;
+    }
+    memcpy(&u64, vp->value.pval->vbuf, sizeof(u64));
+    return u64;
+}
+
+static int
+buildadd(colbuild_t *cbp, int rec, const pmValueSet *vsp)
+{
+    colblock_t	*bp;
+    int		same, size, j;
+    int		sts;
+
+    if (cbp->nent % COL_BLOCK == 0) {
+	/* new block, nothing carried over from the previous one */
+	if (cbp->nblock == cbp->maxblock) {
+	    size = cbp->maxblock ? 2 * cbp->maxblock : 16;
+	    if ((bp = (colblock_t *)realloc(cbp->block, size * sizeof(*bp))) == NULL)
+		return -ENOMEM;
+	    cbp->block = bp;
+	    cbp->maxblock = size;
+	}
+	putalign(&cbp->data);
+	cbp->block[cbp->nblock].first = rec;
+	cbp->block[cbp->nblock].offset = cbp->data.len;
+	cbp->nblock++;
+	cbp->prevrec = rec;
+	cbp->ninst = -1;
+	xorreset(cbp->xs, cbp->maxinst);
+    }
+    cbp->nent++;
+
+    if ((sts = putvar(&cbp->data, rec - cbp->prevrec)) < 0 ||
+	(sts = putvar(&cbp->data, ZIGZAG(vsp->numval))) < 0)
+	return sts;
+    cbp->prevrec = rec;
+    if (vsp->numval <= 0)
+	return 0;
+
+    if (vsp->numval > cbp->maxinst) {
+	int		*inst;
+	xorstate_t	*xs;
+
+	if ((inst = (int *)realloc(cbp->inst, vsp->numval * sizeof(*inst))) == NULL)
+	    return -ENOMEM;
+	cbp->inst = inst;
+	if ((xs = (xorstate_t *)realloc(cbp->xs, vsp->numval * sizeof(*xs))) == NULL)
+	    return -ENOMEM;
+	cbp->xs = xs;
+	xorreset(&cbp->xs[cbp->maxinst], vsp->numval - cbp->maxinst);
+	cbp->maxinst = vsp->numval;
+    }
+    same = (cbp->ninst == vsp->numval);
+    for (j = 0; same && j < vsp->numval; j++) {
+	if (cbp->inst[j] != vsp->vlist[j].inst)
+	    same = 0;
+    }
+    if ((sts = putbits(&cbp->data, same, 1)) < 0)
+	return sts;
+    if (!same) {
+	for (j = 0; j < vsp->numval; j++) {
+	    sts = putvar(&cbp->data, ZIGZAG((__int64_t)vsp->vlist[j].inst -
+				(j ? cbp->inst[j-1] : 0)));
+	    if (sts < 0)
+		return sts;
+	    cbp->inst[j] = vsp->vlist[j].inst;
+	}
+	cbp->ninst = vsp->numval;
+    }
+    for (j = 0; j < vsp->numval; j++) {
+	if ((sts = putxor(&cbp->data, &cbp->xs[j], getvalue(cbp, &vsp->vlist[j]))) < 0)
+	    return sts;
+    }
+    return 0;
+}
+
+static int
+pmidcmp(const void *a, const void *b)
+{
+    pmID	pa = (*(colbuild_t **)a)->pmid;
+    pmID	pb = (*(colbuild_t **)b)->pmid;
+
+    return pa < pb ? -1 : (pa > pb ? 1 : 0);
+}
+
+typedef struct {
+    colbuild_t	**list;
+    int		n;
+} buildlist_t;
+
+static __pmHashWalkState
+buildcollect(const __pmHashNode *hp, void *cp)
+{
+    buildlist_t	*blp = (buildlist_t *)cp;
+
+    blp->list[blp->n++] = (colbuild_t *)hp->data;
+    return PM_HASH_WALK_NEXT;
+}
+
+/*
+ * Walk every record of an archive and write the <base>.col sidecar for
+ * it, reporting on what was done to f if it is not NULL.
+ */
+int
+__pmLogWriteColumns(const char *name, FILE *f)
+{
+    __pmContext	*ctxp;
+    __pmArchCtl	*acp;
+    __pmLogCtl	*lcp;
+    __pmHashCtl	hc;
+    __pmHashNode	*hp;
+    colbuild_t	*cbp;
+    buildlist_t	bl = { NULL, 0 };
+    colbuf_t	hdr = { NULL, 0, 0, 0 };
+    colrec_t	*rec = NULL;
+    colrec_t	*rp;
+    pmResult	*result;
+    struct stat	sbuf;
+    FILE	*fp = NULL;
+    char	path[MAXPATHLEN];
+    char	tmppath[MAXPATHLEN];
+    long	offset, dataoff, size;
+    long	end = 0;
+    long	ncovered = 0;
+    __int64_t	t, prevt = 0, delta = 0, prevdelta = 0;
+    int		nrec = 0;
+    int		maxrec = 0;
+    int		vol, prevvol = 0;
+    int		ctx, sts, i, j;
+    unsigned char	prefix[8];
+    __uint32_t	word;
+
+    if ((ctx = pmNewContext(PM_CONTEXT_ARCHIVE, name)) < 0)
+	return ctx;
+    if ((ctxp = __pmHandleToPtr(ctx)) == NULL) {
+	pmDestroyContext(ctx);
+	return PM_ERR_NOCONTEXT;
+    }
+    acp = ctxp->c_archctl;
+    lcp = acp->ac_log;
+    if (acp->ac_num_logs != 1) {
+	/* one sidecar per archive, not per multi-archive context */
+	PM_UNLOCK(ctxp->c_lock);
+	pmDestroyContext(ctx);
+	return -EINVAL;
+    }
+    __pmHashInit(&hc);
+
+    /* offsets are only meaningful for uncompressed volumes */
+    for (vol = lcp->l_minvol; vol <= lcp->l_maxvol; vol++) {
+	pmsprintf(path, sizeof(path), "%s.%d", lcp->l_name, vol);
+	if (stat(path, &sbuf) < 0 && __pmLogChangeVol(acp, vol) >= 0) {
+	    sts = -EOPNOTSUPP;
+	    goto done;
+	}
+    }
+
+    if ((sts = __pmLogChangeVol(acp, lcp->l_minvol)) < 0)
+	goto done;
+    __pmFseek(acp->ac_mfp, (long)(sizeof(__pmLogLabel) + 2 * sizeof(int)), SEEK_SET);
+    for ( ; ; ) {
+	prevvol = acp->ac_curvol;
+	offset = __pmFtell(acp->ac_mfp);
+	if ((sts = __pmLogRead_ctx(ctxp, PM_MODE_FORW, NULL, &result, PMLOGREAD_NEXT)) < 0)
+	    break;
+	if (nrec == maxrec) {
+	    maxrec = maxrec ? 2 * maxrec : 1024;
+	    if ((rp = (colrec_t *)realloc(rec, maxrec * sizeof(*rp))) == NULL) {
+		pmFreeResult(result);
+		sts = -ENOMEM;
+		goto done;
+	    }
+	    rec = rp;
+	}
+	rp = &rec[nrec];
+	rp->vol = acp->ac_curvol;
+	if (rp->vol != prevvol)
+	    /* volume switch, record is first in the new volume */
+	    offset = sizeof(__pmLogLabel) + 2 * sizeof(int);
+	rp->start = offset;
+	rp->len = __pmFtell(acp->ac_mfp) - offset;
+	rp->stamp.tv_sec = (__int32_t)result->timestamp.tv_sec;
+	rp->stamp.tv_usec = (__int32_t)result->timestamp.tv_usec;
+	rp->mark = (result->numpmid == 0);
+
+	for (i = 0; i < result->numpmid; i++) {
+	    pmValueSet	*vsp = result->vset[i];
+
+	    if ((hp = __pmHashSearch(vsp->pmid, &hc)) == NULL) {
+		if ((cbp = (colbuild_t *)calloc(1, sizeof(*cbp))) == NULL) {
+		    sts = -ENOMEM;
+		    break;
+		}
+		cbp->pmid = vsp->pmid;
+		cbp->valfmt = -1;
+		cbp->ninst = -1;
+		cbp->prevrec = -1;
+		if ((sts = __pmHashAdd(vsp->pmid, (void *)cbp, &hc)) < 0) {
+		    free(cbp);
+		    break;
+		}
+		bl.n++;
+	    }
+	    else
+		cbp = (colbuild_t *)hp->data;
+	    if (cbp->skip || (cbp->nent > 0 && cbp->prevrec == nrec))
+		/* not wanted, or repeated in this record */
+		continue;
+	    if (buildcheck(cbp, vsp) < 0) {
+		if (pmDebugOptions.log) {
+		    char	strbuf[20];
+		    fprintf(stderr, "__pmLogWriteColumns: %s not columnar\n",
+			    pmIDStr_r(cbp->pmid, strbuf, sizeof(strbuf)));
+		}
+		cbp->skip = 1;
+		buildfree(cbp);
+		continue;
+	    }
+	    if ((sts = buildadd(cbp, nrec, vsp)) < 0)
+		break;
+	}
+	pmFreeResult(result);
+	if (sts < 0)
+	    goto done;
+	nrec++;
+    }
+    if (sts != PM_ERR_EOL)
+	goto done;
+
+    /* columns in pmID order */
+    if (bl.n > 0 &&
+	(bl.list = (colbuild_t **)malloc(bl.n * sizeof(colbuild_t *))) == NULL) {
+	sts = -ENOMEM;
+	goto done;
+    }
+    bl.n = 0;
+    __pmHashWalkCB(buildcollect, &bl, &hc);
+    qsort(bl.list, bl.n, sizeof(colbuild_t *), pmidcmp);
+
+    /* header */
+    sts = 0;
+    sts |= putvar(&hdr, (__uint32_t)lcp->l_label.ill_magic);
+    sts |= putvar(&hdr, (__uint32_t)lcp->l_label.ill_pid);
+    sts |= putvar(&hdr, (__uint32_t)lcp->l_label.ill_start.tv_sec);
+    sts |= putvar(&hdr, (__uint32_t)lcp->l_label.ill_start.tv_usec);
+    sts |= putvar(&hdr, ZIGZAG(lcp->l_minvol));
+    sts |= putvar(&hdr, ZIGZAG(lcp->l_maxvol));
+    for (vol = lcp->l_minvol; vol <= lcp->l_maxvol; vol++) {
+	pmsprintf(path, sizeof(path), "%s.%d", lcp->l_name, vol);
+	size = stat(path, &sbuf) < 0 ? 0 : (long)sbuf.st_size;
+	sts |= putvar(&hdr, size);
+    }
+    sts |= putvar(&hdr, nrec);
+    prevvol = lcp->l_minvol;
+    for (i = 0; i < nrec; i++) {
+	rp = &rec[i];
+	sts |= putvar(&hdr, ZIGZAG(rp->vol - prevvol));
+	if (i == 0 || rp->vol != prevvol)
+	    sts |= putvar(&hdr, ZIGZAG(rp->start));
+	else
+	    sts |= putvar(&hdr, ZIGZAG(rp->start - end));
+	sts |= putvar(&hdr, ((__uint64_t)rp->len << 1) | rp->mark);
+	t = (__int64_t)rp->stamp.tv_sec * 1000000 + rp->stamp.tv_usec;
+	delta = t - prevt;
+	sts |= putvar(&hdr, ZIGZAG(delta - prevdelta));
+	prevt = t;
+	prevdelta = delta;
+	prevvol = rp->vol;
+	end = rp->start + rp->len;
+    }
+    for (i = j = 0; i < bl.n; i++) {
+	if (!bl.list[i]->skip)
+	    j++;
+    }
+    sts |= putvar(&hdr, j);
+    dataoff = 0;
+    for (i = 0; i < bl.n; i++) {
+	cbp = bl.list[i];
+	if (cbp->skip)
+	    continue;
+	if (cbp->valfmt == -1) {
+	    /* never had any values, any encoding will do */
+	    cbp->valfmt = PM_VAL_INSITU;
+	    cbp->vtype = PM_TYPE_32;
+	}
+	sts |= putvar(&hdr, cbp->pmid);
+	sts |= putvar(&hdr, cbp->valfmt);
+	sts |= putvar(&hdr, cbp->vtype);
+	sts |= putvar(&hdr, cbp->vlen);
+	sts |= putvar(&hdr, cbp->nent);
+	sts |= putvar(&hdr, cbp->nblock);
+	sts |= putvar(&hdr, dataoff);
+	sts |= putvar(&hdr, cbp->data.len);
+	for (j = 0; j < cbp->nblock; j++) {
+	    sts |= putvar(&hdr, cbp->block[j].first - (j ? cbp->block[j-1].first : 0));
+	    sts |= putvar(&hdr, cbp->block[j].offset - (j ? cbp->block[j-1].offset : 0));
+	}
+	dataoff += cbp->data.len;
+	ncovered++;
+    }
+    if (sts < 0) {
+	sts = -ENOMEM;
+	goto done;
+    }
+
+    /* write a new file, then rename it into place */
+    pmsprintf(path, sizeof(path), "%s.col", lcp->l_name);
+    pmsprintf(tmppath, sizeof(tmppath), "%s.col.new", lcp->l_name);
+    if ((fp = fopen(tmppath, "w")) == NULL) {
+	sts = -oserror();
+	goto done;
+    }
+    word = htonl(COL_MAGIC);
+    memcpy(&prefix[0], &word, sizeof(word));
+    word = htonl(COL_VERSION);
+    memcpy(&prefix[4], &word, sizeof(word));
+    fwrite(prefix, 1, sizeof(prefix), fp);
+    for (size = hdr.len; size >= 0x80; size >>= 7)
+	fputc((size & 0x7f) | 0x80, fp);
+    fputc(size, fp);
+    fwrite(hdr.buf, 1, hdr.len, fp);
+    for (i = 0; i < bl.n; i++) {
+	if (!bl.list[i]->skip)
+	    fwrite(bl.list[i]->data.buf, 1, bl.list[i]->data.len, fp);
+    }
+    if (fflush(fp) != 0 || ferror(fp))
+	sts = -oserror();
+    else
+	sts = 0;
+    fclose(fp);
+    fp = NULL;
+    if (sts == 0 && rename(tmppath, path) < 0)
+	sts = -oserror();
+    if (sts < 0) {
+	unlink(tmppath);
+	goto done;
+    }
+
+    if (f != NULL) {
+	fprintf(f, "%s: %d records, %ld of %d metrics in columns, %ld bytes\n",
+		path, nrec, ncovered, bl.n,
+		(long)(sizeof(prefix) + hdr.len + dataoff));
+    }
+    sts = (int)ncovered;
+
+done:
+    if (fp != NULL)
+	fclose(fp);
+    for (i = 0; i < hc.hsize; i++) {
+	for (hp = hc.hash[i]; hp != NULL; hp = hp->next) {
+	    buildfree((colbuild_t *)hp->data);
+	    free(hp->data);
+	}
+    }
+    free(bl.list);
+    __pmHashClear(&hc);
+    free(hdr.buf);
+    free(rec);
+    PM_UNLOCK(ctxp->c_lock);
+    pmDestroyContext(ctx);
+    return sts;
+}
+
+/*
+ * Reading the sidecar
+ */
+
+static void
+freeColumns(struct __pmLogColumns *cp)
+{
+    column_t	*col;
+    int		i;
+
+    for (i = 0; i < cp->ncol; i++) {
+	col = &cp->col[i];
+	free(col->block);
+	free(col->data);
+	free(col->ent);
+	free(col->inst);
+	free(col->val);
+	free(col->xs);
+    }
+    free(cp->col);
+    free(cp->rec);
+    if (cp->fp != NULL)
+	fclose(cp->fp);
+    free(cp);
+}
+
+void
+__pmLogFreeColumns(__pmLogCtl *lcp)
+{
+    if (lcp->l_columns != NULL)
+	freeColumns(lcp->l_columns);
+    lcp->l_columns = NULL;
+    lcp->l_colstate = 0;
+}
+
+static struct __pmLogColumns *
+loadColumns(__pmArchCtl *acp)
+{
+    __pmLogCtl		*lcp = acp->ac_log;
+    struct __pmLogColumns	*cp;
+    colread_t		r = { NULL, 0, 0 };
+    colrec_t		*rp;
+    column_t		*col;
+    struct stat		sbuf;
+    unsigned char	*hdr = NULL;
+    unsigned char	prefix[8];
+    __uint32_t		word;
+    __uint64_t		v;
+    __int64_t		t = 0, delta = 0;
+    long		end = 0;
+    int			minvol, maxvol, vol;
+    int			c, i, j, shift;
+    char		*why;
+    char		path[MAXPATHLEN];
+
+    pmsprintf(path, sizeof(path), "%s.col", lcp->l_name);
+    if ((cp = (struct __pmLogColumns *)calloc(1, sizeof(*cp))) == NULL)
+	return NULL;
+    if ((cp->fp = fopen(path, "r")) == NULL) {
+	free(cp);
+	return NULL;
+    }
+
+    why = "bad magic or version";
+    if (fread(prefix, 1, sizeof(prefix), cp->fp) != sizeof(prefix))
+	goto bad;
+    memcpy(&word, &prefix[0], sizeof(word));
+    if (ntohl(word) != COL_MAGIC)
+	goto bad;
+    memcpy(&word, &prefix[4], sizeof(word));
+    if (ntohl(word) != COL_VERSION)
+	goto bad;
+    why = "bad header";
+    for (shift = 0, r.len = 0; shift < 35; shift += 7) {
+	if ((c = fgetc(cp->fp)) == EOF)
+	    goto bad;
+	r.len |= (size_t)(c & 0x7f) << shift;
+	if ((c & 0x80) == 0)
+	    break;
+    }
+    if (shift >= 35 || r.len > COL_MAXLEN)
+	goto bad;
+    if ((hdr = (unsigned char *)malloc(r.len)) == NULL)
+	goto bad;
+    if (fread(hdr, 1, r.len, cp->fp) != r.len)
+	goto bad;
+    r.buf = hdr;
+    cp->dataoff = ftell(cp->fp);
+
+    why = "archive label mismatch";
+    if (getvar(&r, &v) < 0 || v != (__uint32_t)lcp->l_label.ill_magic ||
+	getvar(&r, &v) < 0 || v != (__uint32_t)lcp->l_label.ill_pid ||
+	getvar(&r, &v) < 0 || v != (__uint32_t)lcp->l_label.ill_start.tv_sec ||
+	getvar(&r, &v) < 0 || v != (__uint32_t)lcp->l_label.ill_start.tv_usec)
+	goto bad;
+
+    why = "volumes changed";
+    if (getvar(&r, &v) < 0)
+	goto bad;
+    minvol = (int)UNZIGZAG(v);
+    if (getvar(&r, &v) < 0)
+	goto bad;
+    maxvol = (int)UNZIGZAG(v);
+    if (minvol > maxvol || maxvol - minvol > 65535)
+	goto bad;
+    for (vol = minvol; vol <= maxvol; vol++) {
+	if (getvar(&r, &v) < 0)
+	    goto bad;
+	if (v == 0)
+	    continue;
+	pmsprintf(path, sizeof(path), "%s.%d", lcp->l_name, vol);
+	if (stat(path, &sbuf) < 0)
+	    goto bad;
+	/* only the last volume may have grown since */
+	if ((__uint64_t)sbuf.st_size < v ||
+	    (vol < maxvol && (__uint64_t)sbuf.st_size != v))
+	    goto bad;
+    }
+
+    why = "bad record table";
+    if (getint(&r, &cp->nrec) < 0)
+	goto bad;
+    if (cp->nrec > 0 &&
+	(cp->rec = (colrec_t *)malloc(cp->nrec * sizeof(colrec_t))) == NULL)
+	goto bad;
+    vol = minvol;
+    for (i = 0; i < cp->nrec; i++) {
+	rp = &cp->rec[i];
+	if (getvar(&r, &v) < 0 || UNZIGZAG(v) < 0 || vol + UNZIGZAG(v) > maxvol)
+	    goto bad;
+	rp->vol = vol + (int)UNZIGZAG(v);
+	if (getvar(&r, &v) < 0)
+	    goto bad;
+	if (i == 0 || rp->vol != vol)
+	    rp->start = (long)UNZIGZAG(v);
+	else
+	    rp->start = end + (long)UNZIGZAG(v);
+	if (rp->start < (long)(sizeof(__pmLogLabel) + 2 * sizeof(int)) ||
+	    (i > 0 && rp->vol == vol && rp->start < end))
+	    goto bad;
+	if (getvar(&r, &v) < 0 || (v >> 1) == 0 || (v >> 1) > 0x7fffffff)
+	    goto bad;
+	rp->len = (long)(v >> 1);
+	rp->mark = (int)(v & 1);
+	if (getvar(&r, &v) < 0)
+	    goto bad;
+	delta += UNZIGZAG(v);
+	t += delta;
+	rp->stamp.tv_sec = (__int32_t)(t / 1000000);
+	rp->stamp.tv_usec = (__int32_t)(t % 1000000);
+	vol = rp->vol;
+	end = rp->start + rp->len;
+    }
+
+    why = "bad column directory";
+    if (getint(&r, &cp->ncol) < 0)
+	goto bad;
+    if (cp->ncol > 0 &&
+	(cp->col = (column_t *)calloc(cp->ncol, sizeof(column_t))) == NULL)
+	goto bad;
+    for (i = 0; i < cp->ncol; i++) {
+	col = &cp->col[i];
+	col->cached = -1;
+	if (getvar(&r, &v) < 0 || v > 0xffffffff)
+	    goto bad;
+	col->pmid = (pmID)v;
+	if (i > 0 && col->pmid <= cp->col[i-1].pmid)
+	    goto bad;
+	if (getint(&r, &col->valfmt) < 0 || getint(&r, &col->vtype) < 0 ||
+	    getint(&r, &col->vlen) < 0 || getint(&r, &col->nent) < 0 ||
+	    getint(&r, &col->nblock) < 0)
+	    goto bad;
+	if (col->valfmt != PM_VAL_INSITU && col->valfmt != PM_VAL_DPTR)
+	    goto bad;
+	if (col->valfmt == PM_VAL_DPTR && col->vlen != PM_VAL_HDR_SIZE + 4 &&
+	    col->vlen != PM_VAL_HDR_SIZE + 8)
+	    goto bad;
+	if (col->nent > cp->nrec ||
+	    col->nblock != (col->nent + COL_BLOCK - 1) / COL_BLOCK)
+	    goto bad;
+	if (getvar(&r, &v) < 0)
+	    goto bad;
+	col->offset = (long)v;
+	if (getvar(&r, &v) < 0)
+	    goto bad;
+	col->length = (size_t)v;
+	if (col->nblock > 0 &&
+	    (col->block = (colblock_t *)malloc(col->nblock * sizeof(colblock_t))) == NULL)
+	    goto bad;
+	for (j = 0; j < col->nblock; j++) {
+	    if (getvar(&r, &v) < 0)
+		goto bad;
+	    col->block[j].first = (j ? col->block[j-1].first : 0) + (int)v;
+	    if (getvar(&r, &v) < 0)
+		goto bad;
+	    col->block[j].offset = (j ? col->block[j-1].offset : 0) + (size_t)v;
+	    if (col->block[j].first >= cp->nrec ||
+		col->block[j].offset >= col->length ||
+		(j > 0 && (col->block[j].first <= col->block[j-1].first ||
+			   col->block[j].offset <= col->block[j-1].offset)))
+		goto bad;
+	}
+    }
+    free(hdr);
+
+    if (pmDebugOptions.log)
+	fprintf(stderr, "__pmLogLoadColumns: %s.col: %d records, %d columns\n",
+		lcp->l_name, cp->nrec, cp->ncol);
+    return cp;
+
+bad:
+    if (pmDebugOptions.log)
+	fprintf(stderr, "__pmLogLoadColumns: %s.col: ignored, %s\n",
+		lcp->l_name, why);
+    free(hdr);
+    freeColumns(cp);
+    return NULL;
+}
+
+/*
+ * Decode one block of a column into the column's cache, reading the
+ * column data from the sidecar first if need be.
+ */
+static int
+decodeBlock(struct __pmLogColumns *cp, column_t *col, int b)
+{
+    colread_t	r;
+    colent_t	*ep;
+    __uint64_t	v;
+    size_t	need;
+    int		rec, previdx = 0, prevn = -1;
+    int		i, j, n;
+
+    if (col->cached == b)
+	return 0;
+    col->cached = -1;
+    if (col->data == NULL) {
+	if ((col->data = (unsigned char *)malloc(col->length)) == NULL)
+	    return -ENOMEM;
+	if (fseek(cp->fp, cp->dataoff + col->offset, SEEK_SET) < 0 ||
+	    fread(col->data, 1, col->length, cp->fp) != col->length) {
+	    free(col->data);
+	    col->data = NULL;
+	    return PM_ERR_LOGREC;
+	}
+    }
+    if (col->ent == NULL &&
+	(col->ent = (colent_t *)malloc(COL_BLOCK * sizeof(colent_t))) == NULL)
+	return -ENOMEM;
+
+    r.buf = col->data + col->block[b].offset;
+    r.len = (b + 1 < col->nblock ? col->block[b+1].offset : col->length) -
+		col->block[b].offset;
+    r.bit = 0;
+    n = col->nent - b * COL_BLOCK;
+    if (n > COL_BLOCK)
+	n = COL_BLOCK;
+    rec = col->block[b].first;
+    col->nval = 0;
+    xorreset(col->xs, col->maxxs);
+
+    for (i = 0; i < n; i++) {
+	ep = &col->ent[i];
+	if (getvar(&r, &v) < 0 || v > (__uint64_t)(cp->nrec - rec - 1) ||
+	    (i > 0 && v == 0))
+	    return PM_ERR_LOGREC;
+	rec += (int)v;
+	ep->rec = rec;
+	if (getvar(&r, &v) < 0 || UNZIGZAG(v) > 0x7fffffff || UNZIGZAG(v) < -0x7fffffff)
+	    return PM_ERR_LOGREC;
+	ep->numval = (int)UNZIGZAG(v);
+	ep->idx = col->nval;
+	if (ep->numval <= 0)
+	    continue;
+
+	need = (size_t)col->nval + ep->numval;
+	if (need > (size_t)col->maxval) {
+	    int		*inst;
+	    __uint64_t	*val;
+
+	    if (need > 0x7fffffff)
+		return PM_ERR_LOGREC;
+	    if ((inst = (int *)realloc(col->inst, need * sizeof(int))) == NULL)
+		return -ENOMEM;
+	    col->inst = inst;
+	    if ((val = (__uint64_t *)realloc(col->val, need * sizeof(__uint64_t))) == NULL)
+		return -ENOMEM;
+	    col->val = val;
+	    col->maxval = (int)need;
+	}
+	if (ep->numval > col->maxxs) {
+	    xorstate_t	*xs;
+
+	    if ((xs = (xorstate_t *)realloc(col->xs, ep->numval * sizeof(*xs))) == NULL)
+		return -ENOMEM;
+	    col->xs = xs;
+	    xorreset(&col->xs[col->maxxs], ep->numval - col->maxxs);
+	    col->maxxs = ep->numval;
+	}
+
+	if (getbits(&r, 1, &v) < 0)
+	    return PM_ERR_LOGREC;
+	if (v) {
+	    /* same instances as the previous entry */
+	    if (prevn != ep->numval)
+		return PM_ERR_LOGREC;
+	    memcpy(&col->inst[ep->idx], &col->inst[previdx], prevn * sizeof(int));
+	}
+	else {
+	    for (j = 0; j < ep->numval; j++) {
+		if (getvar(&r, &v) < 0)
+		    return PM_ERR_LOGREC;
+		col->inst[ep->idx + j] = (int)((j ? col->inst[ep->idx + j - 1] : 0) + UNZIGZAG(v));
+	    }
+	}
+	previdx = ep->idx;
+	prevn = ep->numval;
+	for (j = 0; j < ep->numval; j++) {
+	    if (getxor(&r, &col->xs[j], &col->val[ep->idx + j]) < 0)
+		return PM_ERR_LOGREC;
+	}
+	col->nval += ep->numval;
+    }
+    col->ncache = n;
+    col->cached = b;
+    return 0;
+}
+
+/*
+ * Entry in col for record number rec ... -1 if the metric is not in that
+ * record, else < -1 for errors.
+ */
+static int
+findEntry(struct __pmLogColumns *cp, column_t *col, int rec)
+{
+    int		lo, hi, mid;
+    int		sts;
+
+    lo = 0;
+    hi = col->nblock;
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (col->block[mid].first <= rec)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if (lo == 0)
+	return -1;
+    if ((sts = decodeBlock(cp, col, lo - 1)) < 0)
+	return sts;
+    lo = 0;
+    hi = col->ncache;
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (col->ent[mid].rec < rec)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if (lo < col->ncache && col->ent[lo].rec == rec)
+	return lo;
+    return -1;
+}
+
+/*
+ * Record starting (forward) or ending (backward) exactly at offset in
+ * volume vol, else -1.
+ */
+static int
+findRecord(const struct __pmLogColumns *cp, int vol, long offset, int mode)
+{
+    const colrec_t	*rp;
+    long	key;
+    int		lo = 0, hi = cp->nrec, mid;
+
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	rp = &cp->rec[mid];
+	key = mode == PM_MODE_FORW ? rp->start : rp->start + rp->len;
+	if (rp->vol < vol || (rp->vol == vol && key < offset))
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if (lo == cp->nrec)
+	return -1;
+    rp = &cp->rec[lo];
+    key = mode == PM_MODE_FORW ? rp->start : rp->start + rp->len;
+    if (rp->vol != vol || key != offset)
+	return -1;
+    return lo;
+}
+
+static column_t *
+findColumn(struct __pmLogColumns *cp, pmID pmid)
+{
+    int		lo = 0, hi = cp->ncol, mid;
+
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (cp->col[mid].pmid == pmid)
+	    return &cp->col[mid];
+	if (cp->col[mid].pmid < pmid)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return NULL;
+}
+
+static pmValueSet *
+columnValues(__pmContext *ctxp, column_t *col, int e)
+{
+    pmValueSet	*vsp;
+    pmValue	*vp;
+    pmDesc	desc;
+    colent_t	*ep = &col->ent[e];
+    size_t	need;
+    __uint32_t	u32;
+    int		i, kval;
+
+    need = sizeof(pmValueSet);
+    if (ep->numval > 1)
+	need += (ep->numval - 1) * sizeof(pmValue);
+    if ((vsp = (pmValueSet *)malloc(need)) == NULL)
+	pmNoMem("__pmLogFetchColumns.vset", need, PM_FATAL_ERR);
+    vsp->pmid = col->pmid;
+    vsp->valfmt = PM_VAL_INSITU;
+    vsp->numval = ep->numval;
+    if (ep->numval <= 0)
+	return vsp;
+
+    /* instance profile filtering, as for the records themselves */
+    if (__pmLogLookupDesc(ctxp->c_archctl, col->pmid, &desc) < 0)
+	desc.indom = PM_INDOM_NULL;
+    vsp->valfmt = col->valfmt;
+    for (i = kval = 0; i < ep->numval; i++) {
+	if (desc.indom != PM_INDOM_NULL &&
+	    !__pmInProfile(desc.indom, ctxp->c_instprof, col->inst[ep->idx + i]))
+	    continue;
+	vp = &vsp->vlist[kval++];
+	vp->inst = col->inst[ep->idx + i];
+	if (col->valfmt == PM_VAL_INSITU) {
+	    vp->value.lval = (__int32_t)(__uint32_t)col->val[ep->idx + i];
+	    continue;
+	}
+	need = col->vlen < sizeof(pmValueBlock) ? sizeof(pmValueBlock) : col->vlen;
+	if ((vp->value.pval = (pmValueBlock *)malloc(need)) == NULL)
+	    pmNoMem("__pmLogFetchColumns.pval", need, PM_FATAL_ERR);
+	vp->value.pval->vlen = col->vlen;
+	vp->value.pval->vtype = col->vtype;
+	if (col->vlen == PM_VAL_HDR_SIZE + 4) {
+	    u32 = (__uint32_t)col->val[ep->idx + i];
+	    memcpy(vp->value.pval->vbuf, &u32, sizeof(u32));
+	}
+	else
+	    memcpy(vp->value.pval->vbuf, &col->val[ep->idx + i], sizeof(__uint64_t));
+    }
+    vsp->numval = kval;
+    return vsp;
+}
+
+/*
+ * Stand-in for __pmLogRead() in __pmLogFetch() ... if the sidecar can
+ * answer for the record at the current position, return 1 with a result
+ * containing just the requested metrics (or no metrics at all if none of
+ * them are in this record, or it is a mark record) and move the file
+ * position over the record, else return 0 and do nothing.
+ */
+int
+__pmLogFetchColumns(__pmContext *ctxp, int mode, int numpmid, pmID pmidlist[], pmResult **result)
+{
+    __pmArchCtl	*acp = ctxp->c_archctl;
+    __pmLogCtl	*lcp = acp->ac_log;
+    struct __pmLogColumns	*cp;
+    column_t	**cols = NULL;
+    int		*ents = NULL;
+    colrec_t	*rp;
+    pmResult	*rslt;
+    size_t	need;
+    long	offset;
+    int		found = 0;
+    int		served = 0;
+    int		k, j;
+
+    mode &= __PM_MODE_MASK;
+    if (numpmid <= 0 || (mode != PM_MODE_FORW && mode != PM_MODE_BACK) ||
+	lcp->l_colstate < 0)
+	return 0;
+
+    PM_LOCK(lcp->l_lock);
+    if (lcp->l_colstate == 0) {
+	if (getenv("PCP_ARCHIVE_NO_COLUMNS") == NULL)	/* THREADSAFE */
+	    lcp->l_columns = loadColumns(acp);
+	lcp->l_colstate = lcp->l_columns != NULL ? 1 : -1;
+    }
+    if ((cp = lcp->l_columns) == NULL)
+	goto done;
+    offset = __pmFtell(acp->ac_mfp);
+    if ((k = findRecord(cp, acp->ac_curvol, offset, mode)) < 0)
+	goto done;
+    rp = &cp->rec[k];
+
+    if (!rp->mark) {
+	cols = (column_t **)malloc(numpmid * sizeof(column_t *));
+	ents = (int *)malloc(numpmid * sizeof(int));
+	if (cols == NULL || ents == NULL)
+	    goto done;
+	for (j = 0; j < numpmid; j++) {
+	    if ((cols[j] = findColumn(cp, pmidlist[j])) == NULL)
+		goto done;
+	    if ((ents[j] = findEntry(cp, cols[j], k)) < -1) {
+		/* corrupt or unreadable, give up on the sidecar */
+		if (pmDebugOptions.log) {
+		    char	errmsg[PM_MAXERRMSGLEN];
+		    fprintf(stderr, "__pmLogFetchColumns: %s.col: dropped, %s\n",
+			    lcp->l_name, pmErrStr_r(ents[j], errmsg, sizeof(errmsg)));
+		}
+		__pmLogFreeColumns(lcp);
+		lcp->l_colstate = -1;
+		goto done;
+	    }
+	    if (ents[j] >= 0)
+		found++;
+	}
+    }
+
+    /* none of the metrics wanted (or a mark) means no pmValueSets at all */
+    need = sizeof(pmResult);
+    if (found)
+	need += (numpmid - 1) * sizeof(pmValueSet *);
+    if ((rslt = (pmResult *)malloc(need)) == NULL)
+	pmNoMem("__pmLogFetchColumns.result", need, PM_FATAL_ERR);
+    rslt->timestamp.tv_sec = rp->stamp.tv_sec;
+    rslt->timestamp.tv_usec = rp->stamp.tv_usec;
+    rslt->numpmid = found ? numpmid : 0;
+    for (j = 0; found && j < numpmid; j++) {
+	if (ents[j] >= 0)
+	    rslt->vset[j] = columnValues(ctxp, cols[j], ents[j]);
+	else {
+	    if ((rslt->vset[j] = (pmValueSet *)malloc(sizeof(pmValueSet))) == NULL)
+		pmNoMem("__pmLogFetchColumns.vset", sizeof(pmValueSet), PM_FATAL_ERR);
+	    rslt->vset[j]->pmid = pmidlist[j];
+	    rslt->vset[j]->numval = 0;
+	    rslt->vset[j]->valfmt = PM_VAL_INSITU;
+	}
+    }
+    *result = rslt;
+
+    /* leave the file where __pmLogRead() would have */
+    __pmFseek(acp->ac_mfp, mode == PM_MODE_FORW ? rp->start + rp->len : rp->start, SEEK_SET);
+    if (pmDebugOptions.log) {
+	fprintf(stderr, "__pmLogFetchColumns: %s vol=%d posn=%ld record %d @",
+		mode == PM_MODE_FORW ? "forw" : "back", rp->vol, offset, k);
+	pmPrintStamp(stderr, &rslt->timestamp);
+	fprintf(stderr, " metrics=%d\n", found);
+    }
+    served = 1;
+
+done:
+    PM_UNLOCK(lcp->l_lock);
+    free(cols);
+    free(ents);
+    return served;
+}
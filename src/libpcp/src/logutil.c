@@ -333,53 +333,55 @@ __pmLogLoadIndex(__pmLogCtl *lcp)
 {
     int		sts = 0;
     __pmFILE	*f = lcp->l_tifp;
+    int		numti;
     int		n;
+    long	hdr = (long)(sizeof(__pmLogLabel) + 2*sizeof(int));
     __pmLogTI	*tip;
+    struct stat	sbuf;
 
     lcp->l_numti = 0;
     lcp->l_ti = NULL;
+    lcp->l_numseek = 0;
+    lcp->l_seek = NULL;
 
     if (lcp->l_tifp != NULL) {
-	__pmFseek(f, (long)(sizeof(__pmLogLabel) + 2*sizeof(int)), SEEK_SET);
-	for ( ; ; ) {
-	    lcp->l_ti = (__pmLogTI *)realloc(lcp->l_ti, (1 + lcp->l_numti) * sizeof(__pmLogTI));
-	    if (lcp->l_ti == NULL) {
+	/*
+	 * size the table from the file, then read it in one go ... a
+	 * trailing partial entry (index still being written) is ignored
+	 */
+	if (__pmFstat(f, &sbuf) < 0)
+	    return -oserror();
+	if (sbuf.st_size <= hdr)
+	    return 0;
+	numti = (int)((sbuf.st_size - hdr) / sizeof(__pmLogTI));
+	if (numti == 0)
+	    return 0;
+	if ((lcp->l_ti = (__pmLogTI *)malloc(numti * sizeof(__pmLogTI))) == NULL)
+	    return -oserror();
+	__pmFseek(f, hdr, SEEK_SET);
+	n = (int)__pmFread(lcp->l_ti, sizeof(__pmLogTI), numti, f);
+	if (n != numti) {
+	    if (pmDebugOptions.log)
+		fprintf(stderr, "__pmLogLoadIndex: short read: %d of %d TI entries\n",
+			n, numti);
+	    if (__pmFerror(f)) {
+		__pmClearerr(f);
 		sts = -oserror();
-		break;
-	    }
-	    tip = &lcp->l_ti[lcp->l_numti];
-	    n = (int)__pmFread(tip, 1, sizeof(__pmLogTI), f);
-
-            if (n != sizeof(__pmLogTI)) {
-		if (__pmFeof(f)) {
-		    __pmClearerr(f);
-		    sts = 0; 
-		    break;
-		}
-	  	if (pmDebugOptions.log)
-	    	    fprintf(stderr, "__pmLogLoadIndex: bad TI entry len=%d: expected %d\n",
-		            n, (int)sizeof(__pmLogTI));
-		if (__pmFerror(f)) {
-		    __pmClearerr(f);
-		    sts = -oserror();
-		    break;
-		}
-		else {
-		    sts = PM_ERR_LOGREC;
-		    break;
-		}
-	    }
-	    else {
-		/* swab the temporal index record */
-		tip->ti_stamp.tv_sec = ntohl(tip->ti_stamp.tv_sec);
-		tip->ti_stamp.tv_usec = ntohl(tip->ti_stamp.tv_usec);
-		tip->ti_vol = ntohl(tip->ti_vol);
-		tip->ti_meta = ntohl(tip->ti_meta);
-		tip->ti_log = ntohl(tip->ti_log);
+		free(lcp->l_ti);
+		lcp->l_ti = NULL;
+		return sts;
 	    }
-
-	    lcp->l_numti++;
-	}/*for*/
+	    __pmClearerr(f);
+	}
+	for (tip = lcp->l_ti; tip < &lcp->l_ti[n]; tip++) {
+	    /* swab the temporal index record */
+	    tip->ti_stamp.tv_sec = ntohl(tip->ti_stamp.tv_sec);
+	    tip->ti_stamp.tv_usec = ntohl(tip->ti_stamp.tv_usec);
+	    tip->ti_vol = ntohl(tip->ti_vol);
+	    tip->ti_meta = ntohl(tip->ti_meta);
+	    tip->ti_log = ntohl(tip->ti_log);
+	}
+	lcp->l_numti = n;
     }/*not null*/
 
     return sts;
@@ -759,6 +761,11 @@ __pmLogClose(__pmArchCtl *acp)
 	lcp->l_seen = NULL;
 	lcp->l_numseen = 0;
     }
+    if (lcp->l_seek != NULL && lcp->l_seek != lcp->l_ti)
+	free(lcp->l_seek);
+    lcp->l_seek = NULL;
+    lcp->l_numseek = 0;
+    __pmLogFreeColumns(lcp);
     if (lcp->l_ti != NULL)
 	free(lcp->l_ti);
 }
@@ -1431,6 +1438,153 @@ clearMarkDone(__pmContext *ctxp)
     }
 }
 
+/*
+ * Rebuild the full result for a delta result record (PM_LOG_DELTA) from
+ * the values in the key record, overlaid by the values in delta ...
+ * pmlogger only writes a delta record when the metrics, instances and
+ * value formats match those of the key record exactly, so the vsets and
+ * instances in delta are in the same order as those in key.
+ *
+ * The full result is malloc'd, so pmFreeResult() does the right thing.
+ */
+static int
+LogMergeDelta(const pmResult *key, const pmResult *delta, pmResult **result)
+{
+    pmResult	*rp;
+    pmValueSet	*kvsp;
+    pmValueSet	*dvsp;
+    pmValueSet	*vsp;
+    pmValue	*vp;
+    int		d = 1;		/* skip the header vset */
+    int		i;
+    int		j;
+    int		k;
+
+    if ((rp = (pmResult *)calloc(1, sizeof(pmResult) + (key->numpmid - 1) * sizeof(pmValueSet *))) == NULL)
+	return -oserror();
+    rp->timestamp = delta->timestamp;
+
+    for (i = 0; i < key->numpmid; i++) {
+	kvsp = key->vset[i];
+	dvsp = NULL;
+	if (d < delta->numpmid && delta->vset[d]->pmid == kvsp->pmid)
+	    dvsp = delta->vset[d++];
+	if (dvsp != NULL && (dvsp->numval <= 0 || kvsp->numval <= 0 ||
+			     dvsp->valfmt != kvsp->valfmt))
+	    goto corrupt;
+	if ((vsp = (pmValueSet *)malloc(sizeof(pmValueSet) + (kvsp->numval > 0 ? kvsp->numval - 1 : 0) * sizeof(pmValue))) == NULL) {
+	    rp->numpmid = i;
+	    pmFreeResult(rp);
+	    return -oserror();
+	}
+	rp->vset[i] = vsp;
+	rp->numpmid = i + 1;
+	vsp->pmid = kvsp->pmid;
+	vsp->numval = kvsp->numval;
+	vsp->valfmt = kvsp->valfmt == PM_VAL_INSITU ? PM_VAL_INSITU : PM_VAL_DPTR;
+	for (j = k = 0; j < kvsp->numval; j++) {
+	    vp = &kvsp->vlist[j];
+	    if (dvsp != NULL && k < dvsp->numval &&
+		dvsp->vlist[k].inst == vp->inst)
+		vp = &dvsp->vlist[k++];
+	    vsp->vlist[j].inst = vp->inst;
+	    if (vsp->valfmt == PM_VAL_INSITU)
+		vsp->vlist[j].value.lval = vp->value.lval;
+	    else {
+		pmValueBlock	*vbp = vp->value.pval;
+
+		if ((vsp->vlist[j].value.pval = (pmValueBlock *)malloc(vbp->vlen)) == NULL) {
+		    vsp->numval = j;
+		    pmFreeResult(rp);
+		    return -oserror();
+		}
+		memcpy(vsp->vlist[j].value.pval, vbp, vbp->vlen);
+	    }
+	}
+	if (dvsp != NULL && k != dvsp->numval)
+	    goto corrupt;
+    }
+    if (d != delta->numpmid)
+	goto corrupt;
+
+    *result = rp;
+    return 0;
+
+corrupt:
+    if (pmDebugOptions.log)
+	fprintf(stderr, "LogMergeDelta: delta record does not match key record\n");
+    pmFreeResult(rp);
+    return PM_ERR_LOGREC;
+}
+
+/*
+ * Replace *result, decoded from the delta result record that starts at
+ * offset recstart in f, by the full result ... the key record is found
+ * at the offset in the header vset, and the last one is cached in the
+ * __pmArchCtl as consecutive delta records usually share a key record.
+ */
+static int
+LogDeltaResult(__pmContext *ctxp, __pmFILE *f, __pmFILE *peekf, long recstart, pmResult **result, int option)
+{
+    __pmArchCtl	*acp = ctxp->c_archctl;
+    pmResult	*delta = *result;
+    pmResult	*key;
+    pmValueSet	*hvsp;
+    long	keyoff;
+    long	here;
+    int		sts;
+
+    hvsp = delta->vset[0];
+    if (delta->numpmid < 1 || hvsp->pmid != PM_ID_NULL ||
+	hvsp->numval != 1 || hvsp->valfmt != PM_VAL_INSITU) {
+	if (pmDebugOptions.log)
+	    fprintf(stderr, "LogDeltaResult: bad header vset\n");
+	return PM_ERR_LOGREC;
+    }
+    keyoff = (long)(unsigned int)hvsp->vlist[0].value.lval;
+    if (keyoff >= recstart) {
+	/* key records always come first, which also stops any recursion */
+	if (pmDebugOptions.log)
+	    fprintf(stderr, "LogDeltaResult: key offset %ld not before record at %ld\n", keyoff, recstart);
+	return PM_ERR_LOGREC;
+    }
+
+    if (peekf == NULL && acp->ac_key != NULL &&
+	acp->ac_key_arch == acp->ac_cur_log &&
+	acp->ac_key_vol == acp->ac_curvol &&
+	acp->ac_key_offset == keyoff) {
+	key = acp->ac_key;
+    }
+    else {
+	here = __pmFtell(f);
+	assert(here >= 0);
+	__pmFseek(f, keyoff, SEEK_SET);
+	sts = __pmLogRead_ctx(ctxp, PM_MODE_FORW, f, &key, option);
+	__pmFseek(f, here, SEEK_SET);
+	if (sts < 0) {
+	    if (pmDebugOptions.log)
+		fprintf(stderr, "LogDeltaResult: key record at %ld: %s\n", keyoff, pmErrStr(sts));
+	    return PM_ERR_LOGREC;
+	}
+	if (peekf == NULL) {
+	    if (acp->ac_key != NULL)
+		pmFreeResult(acp->ac_key);
+	    acp->ac_key = key;
+	    acp->ac_key_arch = acp->ac_cur_log;
+	    acp->ac_key_vol = acp->ac_curvol;
+	    acp->ac_key_offset = keyoff;
+	}
+    }
+
+    sts = LogMergeDelta(key, delta, result);
+    if (key != acp->ac_key)
+	pmFreeResult(key);
+    if (sts < 0)
+	return sts;
+    pmFreeResult(delta);
+    return 0;
+}
+
 /*
  * read next forward or backward from the log
  *
@@ -1456,6 +1610,8 @@ __pmLogRead_ctx(__pmContext *ctxp, int mode, __pmFILE *peekf, pmResult **result,
     __pmPDU	*pb;
     __pmFILE	*f;
     int		n;
+    int		delta;
+    long	recstart;
     ctx_ctl_t	ctx_ctl = { NULL, 0 };
 
     sts = lock_ctx(ctxp, &ctx_ctl);
@@ -1754,6 +1910,17 @@ again:
 	goto func_return;
     }
 
+    /*
+     * numpmid follows the fake __pmPDUHdr and the timestamp ... for a
+     * delta result record, clear PM_LOG_DELTA so the record can be
+     * checked and decoded as usual, then fill in the values that were
+     * not logged from the key record below
+     */
+    delta = rlen >= 3 * (int)sizeof(__pmPDU) &&
+	    (ntohl(pb[5]) & PM_LOG_DELTA) != 0;
+    if (delta)
+	pb[5] = htonl(ntohl(pb[5]) & ~PM_LOG_DELTA);
+
     if (option == PMLOGREAD_TO_EOF && paranoidCheck(head, pb) == -1) {
 	__pmUnpinPDUBuf(pb);
 	sts = PM_ERR_LOGREC;
@@ -1763,6 +1930,10 @@ again:
     if (mode == PM_MODE_BACK)
 	__pmFseek(f, -(long)sizeof(trail), SEEK_CUR);
 
+    recstart = __pmFtell(f);
+    if (mode == PM_MODE_FORW)
+	recstart -= head;
+
     __pmOverrideLastFd(__pmFileno(f));
     sts = __pmDecodeResult_ctx(ctxp, pb, result); /* also swabs the result */
 
@@ -1793,6 +1964,12 @@ again:
 	goto func_return;
     }
 
+    if (delta && (sts = LogDeltaResult(ctxp, f, peekf, recstart, result, option)) < 0) {
+	pmFreeResult(*result);
+	__pmUnpinPDUBuf(pb);
+	goto func_return;
+    }
+
     if (pmDebugOptions.pdu) {
 	fprintf(stderr, "__pmLogRead timestamp=");
 	pmPrintStamp(stderr, &(*result)->timestamp);
@@ -1852,6 +2029,22 @@ check_all_derived(int numpmid, pmID pmidlist[])
     return 1;
 }
 
+/*
+ * Next record for __pmLogFetch() ... from the columnar sidecar if it has
+ * this record and all of the metrics, else from the archive itself.
+ */
+static int
+LogFetchRead(__pmContext *ctxp, int mode, int numpmid, pmID pmidlist[], pmResult **result, int *projected)
+{
+    if (__pmLogFetchColumns(ctxp, mode, numpmid, pmidlist, result)) {
+	clearMarkDone(ctxp);
+	*projected = 1;
+	return 0;
+    }
+    *projected = 0;
+    return __pmLogRead_ctx(ctxp, mode, NULL, result, PMLOGREAD_NEXT);
+}
+
 int
 __pmLogFetch(__pmContext *ctxp, int numpmid, pmID pmidlist[], pmResult **result)
 {
@@ -1870,6 +2063,7 @@ __pmLogFetch(__pmContext *ctxp, int numpmid, pmID pmidlist[], pmResult **result)
     int		nskip;
     pmTimeval	tmp;
     int		ctxp_mode;
+    int		projected = 0;
     ctx_ctl_t	ctx_ctl = { NULL, 0 };
 
     sts = lock_ctx(ctxp, &ctx_ctl);
@@ -1907,7 +2101,7 @@ more:
 		tmp_mode = PM_MODE_BACK;
 	    else
 		tmp_mode = PM_MODE_FORW;
-	    while (__pmLogRead_ctx(ctxp, tmp_mode, NULL, result, PMLOGREAD_NEXT) >= 0) {
+	    while (LogFetchRead(ctxp, tmp_mode, numpmid, pmidlist, result, &projected) >= 0) {
 		nskip++;
 		tmp.tv_sec = (__int32_t)(*result)->timestamp.tv_sec;
 		tmp.tv_usec = (__int32_t)(*result)->timestamp.tv_usec;
@@ -1947,7 +2141,7 @@ more:
 	}
 	if (found)
 	    break;
-	if ((sts = __pmLogRead_ctx(ctxp, ctxp->c_mode, NULL, result, PMLOGREAD_NEXT)) < 0)
+	if ((sts = LogFetchRead(ctxp, ctxp->c_mode, numpmid, pmidlist, result, &projected)) < 0)
 	    break;
 	tmp.tv_sec = (__int32_t)(*result)->timestamp.tv_sec;
 	tmp.tv_usec = (__int32_t)(*result)->timestamp.tv_usec;
@@ -1992,6 +2186,13 @@ more:
 	    goto more;
 	}
     }
+    else if (found && projected) {
+	/*
+	 * from the columnar sidecar, already just the metrics we
+	 * wanted with the instance profile applied
+	 */
+	;
+    }
     else if (found) {
 	if (numpmid > 0) {
 	    /*
@@ -2140,16 +2341,289 @@ func_return:
     return sts;
 }
 
+/*
+ * Positioning from a sparse temporal index means reading (and decoding)
+ * every record between the closest index entry and the origin, which
+ * for archives with few index entries (created by libpcp_import or
+ * pmlogextract, or with no index at all) can be most of the archive.
+ *
+ * So the first __pmLogSetTime() for a sparse archive builds a denser
+ * seek table by walking the record headers in each data volume, keeping
+ * the first and last record of each volume and then one record every
+ * LOG_SEEK_RECORDS records (but not closer than LOG_SEEK_BYTES) in
+ * between.  Entries have the same meaning as those pmlogger writes to
+ * the temporal index (timestamp of a record and the offset where it
+ * starts), so __pmLogSetTime() uses either table the same way, with a
+ * binary search if the table is in time order.
+ */
+#define LOG_SEEK_SPARSE		(1024*1024)	/* data bytes per index entry */
+#define LOG_SEEK_RECORDS	32
+#define LOG_SEEK_BYTES		(16*1024)
+
+static int
+addSeek(__pmLogTI **seek, int *numseek, int *maxseek, const __pmLogTI *tip)
+{
+    __pmLogTI	*tmp;
+    int		need;
+
+    if (*numseek == *maxseek) {
+	need = *maxseek == 0 ? 256 : *maxseek * 2;
+	if ((tmp = (__pmLogTI *)realloc(*seek, need * sizeof(__pmLogTI))) == NULL)
+	    return -oserror();
+	*seek = tmp;
+	*maxseek = need;
+    }
+    (*seek)[(*numseek)++] = *tip;
+    return 0;
+}
+
+/*
+ * Walk the records of every data volume, return the number of records
+ * seen, 0 if the archive is not worth it (index dense enough, or the
+ * volumes are compressed and a walk would mean decompressing them) or
+ * a negative error code.  The table is returned via seek and numseek.
+ */
+static long
+buildSeek(__pmArchCtl *acp, __pmLogTI **seek, int *numseek)
+{
+    __pmLogCtl	*lcp = acp->ac_log;
+    __pmFILE	*f;
+    __pmLogTI	ti;
+    __pmLogTI	pending;
+    struct stat	sbuf;
+    __pm_off_t	hdr = (__pm_off_t)(sizeof(__pmLogLabel) + 2*sizeof(int));
+    __pm_off_t	offset;
+    __pm_off_t	lastoff;
+    __int32_t	buf[3];		/* record length and timestamp */
+    long	total = 0;
+    long	nrec = 0;
+    int		maxseek = 0;
+    int		since;
+    int		len;
+    int		vol;
+    int		sts;
+    char	fname[MAXPATHLEN];
+
+    for (vol = lcp->l_minvol; vol <= lcp->l_maxvol; vol++) {
+	pmsprintf(fname, sizeof(fname), "%s.%d", lcp->l_name, vol);
+	if (stat(fname, &sbuf) < 0)
+	    /* compressed or missing */
+	    return 0;
+	total += sbuf.st_size - hdr;
+    }
+    if (total / (lcp->l_numti + 1) < LOG_SEEK_SPARSE)
+	return 0;
+
+    for (vol = lcp->l_minvol; vol <= lcp->l_maxvol; vol++) {
+	if ((f = _logpeek(acp, vol)) == NULL)
+	    continue;
+	if (__pmFstat(f, &sbuf) < 0) {
+	    __pmFclose(f);
+	    continue;
+	}
+	pending.ti_vol = -1;
+	since = LOG_SEEK_RECORDS;
+	lastoff = -LOG_SEEK_BYTES;
+	for (offset = hdr; ; offset += len) {
+	    __pmFseek(f, (long)offset, SEEK_SET);
+	    if (__pmFread(buf, sizeof(buf), 1, f) != 1)
+		break;
+	    len = ntohl(buf[0]);
+	    if (len < (int)(sizeof(buf) + sizeof(int)) || offset + len > sbuf.st_size)
+		/* corrupt or incomplete, stop here */
+		break;
+	    ti.ti_stamp.tv_sec = ntohl(buf[1]);
+	    ti.ti_stamp.tv_usec = ntohl(buf[2]);
+	    ti.ti_vol = vol;
+	    ti.ti_meta = 0;	/* not used for positioning */
+	    ti.ti_log = offset;
+	    if (since >= LOG_SEEK_RECORDS && offset - lastoff >= LOG_SEEK_BYTES) {
+		if ((sts = addSeek(seek, numseek, &maxseek, &ti)) < 0) {
+		    __pmFclose(f);
+		    return sts;
+		}
+		since = 0;
+		lastoff = offset;
+		pending.ti_vol = -1;
+	    }
+	    else
+		pending = ti;
+	    since++;
+	    nrec++;
+	}
+	__pmFclose(f);
+	if (pending.ti_vol >= 0 &&
+	    (sts = addSeek(seek, numseek, &maxseek, &pending)) < 0)
+	    return sts;
+    }
+
+    return nrec;
+}
+
+/*
+ * Choose the table for __pmLogSetTime() to use, building a seek table
+ * the first time if the temporal index is sparse.  The table (NULL and
+ * 0 if there is no usable one) is returned via ti and numti, as the
+ * __pmLogCtl may be shared with other contexts.
+ */
+static void
+setupSeek(__pmArchCtl *acp, __pmLogTI **ti, int *numti)
+{
+    __pmLogCtl		*lcp = acp->ac_log;
+    __pmLogTI		*seek = NULL;
+    struct timeval	start;
+    struct timeval	end;
+    long		nrec;
+    int			numseek = 0;
+    int			i;
+
+    PM_LOCK(lcp->l_lock);
+    if (lcp->l_numseek != 0)
+	/* already done, maybe by another context sharing this archive */
+	goto done;
+
+    if (pmDebugOptions.log)
+	gettimeofday(&start, NULL);
+    if ((nrec = buildSeek(acp, &seek, &numseek)) > 0 && numseek > 0) {
+	lcp->l_seek = seek;
+	lcp->l_numseek = numseek;
+	if (pmDebugOptions.log) {
+	    gettimeofday(&end, NULL);
+	    fprintf(stderr, "setupSeek: %d seek table entries from %ld records, %d index entries, %.3f msec\n",
+		    numseek, nrec, lcp->l_numti,
+		    pmtimevalSub(&end, &start) * 1000);
+	}
+	goto done;
+    }
+
+    if (nrec < 0 && pmDebugOptions.log) {
+	char	errmsg[PM_MAXERRMSGLEN];
+	fprintf(stderr, "setupSeek: seek table failed: %s\n",
+		pmErrStr_r((int)nrec, errmsg, sizeof(errmsg)));
+    }
+    if (seek != NULL)
+	free(seek);
+    /*
+     * fall back to the temporal index ... binary search is only
+     * possible if it is in time order, else use a linear scan
+     */
+    lcp->l_seek = lcp->l_ti;
+    lcp->l_numseek = lcp->l_numti;
+    for (i = 1; i < lcp->l_numti; i++) {
+	if (lcp->l_ti[i].ti_vol < lcp->l_ti[i-1].ti_vol ||
+	    __pmTimevalSub(&lcp->l_ti[i].ti_stamp, &lcp->l_ti[i-1].ti_stamp) < 0) {
+	    lcp->l_seek = NULL;
+	    break;
+	}
+    }
+    if (lcp->l_seek == NULL || lcp->l_numseek == 0)
+	lcp->l_numseek = -1;
+    if (pmDebugOptions.log)
+	fprintf(stderr, "setupSeek: %s temporal index, %d entries\n",
+		lcp->l_numseek > 0 ? "sorted" : "unsorted or empty",
+		lcp->l_numti);
+
+done:
+    *ti = lcp->l_numseek > 0 ? lcp->l_seek : NULL;
+    *numti = lcp->l_numseek > 0 ? lcp->l_numseek : 0;
+    PM_UNLOCK(lcp->l_lock);
+}
+
+/*
+ * physical size of the last volume, to check for index entries beyond
+ * the end of a truncated or incomplete archive
+ */
+static __pm_off_t
+lastVolSize(__pmArchCtl *acp)
+{
+    __pmLogCtl	*lcp = acp->ac_log;
+    __pmFILE	*f;
+    struct stat	sbuf;
+    int		vol = lcp->l_maxvol;
+
+    sbuf.st_size = 0;
+    if (vol >= 0 && vol < lcp->l_numseen && lcp->l_seen[vol])
+	__pmFstat(acp->ac_mfp, &sbuf);
+    else if ((f = _logpeek(acp, lcp->l_maxvol)) != NULL) {
+	__pmFstat(f, &sbuf);
+	__pmFclose(f);
+    }
+    return (__pm_off_t)sbuf.st_size;
+}
+
+/*
+ * Find the first entry of ti[] at or after origin (in a volume we have),
+ * return numti if there is none.  If an entry for the last volume that
+ * lies beyond its physical end comes first, return that instead and set
+ * *toobig.  Set *match if the entry is exactly at origin.
+ *
+ * The table must be in time (and volume) order, for a binary search.
+ */
+static int
+searchTI(__pmArchCtl *acp, const __pmLogTI *ti, int numti,
+	const pmTimeval *origin, int *match, int *toobig)
+{
+    __pmLogCtl	*lcp = acp->ac_log;
+    __pm_off_t	physend;
+    int		first;
+    int		lo, hi, mid;
+    int		j;
+
+    /* skip missing preliminary volumes */
+    for (lo = 0, hi = numti; lo < hi; ) {
+	mid = (lo + hi) / 2;
+	if (ti[mid].ti_vol < lcp->l_minvol)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    first = lo;
+
+    for (hi = numti; lo < hi; ) {
+	mid = (lo + hi) / 2;
+	if (__pmTimevalSub(&ti[mid].ti_stamp, origin) < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    j = lo;
+
+    /* truncated check for last volume, entries first..j inclusive */
+    for (lo = first, hi = (j < numti ? j + 1 : numti); lo < hi; ) {
+	mid = (lo + hi) / 2;
+	if (ti[mid].ti_vol < lcp->l_maxvol)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    hi = (j < numti ? j + 1 : numti);
+    if (lo < hi && ti[hi-1].ti_log > (physend = lastVolSize(acp))) {
+	while (lo < hi) {
+	    mid = (lo + hi) / 2;
+	    if (ti[mid].ti_log <= physend)
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+	*toobig = 1;
+	return lo;
+    }
+
+    if (j < numti && __pmTimevalSub(&ti[j].ti_stamp, origin) == 0)
+	*match = 1;
+    return j;
+}
+
 /*
  * error handling wrapper around __pmLogChangeVol() to deal with
- * missing volumes ... return lcp->l_ti[] index for entry matching
+ * missing volumes ... return ti[] index for entry matching
  * success
  */
 static int
-VolSkip(__pmArchCtl *acp, int mode,  int j)
+VolSkip(__pmArchCtl *acp, const __pmLogTI *ti, int numti, int mode, int j)
 {
     __pmLogCtl	*lcp = acp->ac_log;
-    int		vol = lcp->l_ti[j].ti_vol;
+    int		vol = ti[j].ti_vol;
 
     while (lcp->l_minvol <= vol && vol <= lcp->l_maxvol) {
 	if (__pmLogChangeVol(acp, vol) >= 0)
@@ -2158,20 +2632,20 @@ VolSkip(__pmArchCtl *acp, int mode,  int j)
 	    fprintf(stderr, "VolSkip: Skip missing vol %d\n", vol);
 	}
 	if (mode == PM_MODE_FORW) {
-	    for (j++; j < lcp->l_numti; j++)
-		if (lcp->l_ti[j].ti_vol != vol)
+	    for (j++; j < numti; j++)
+		if (ti[j].ti_vol != vol)
 		    break;
-	    if (j == lcp->l_numti)
+	    if (j == numti)
 		return PM_ERR_EOL;
-	    vol = lcp->l_ti[j].ti_vol;
+	    vol = ti[j].ti_vol;
 	}
 	else {
 	    for (j--; j >= 0; j--)
-		if (lcp->l_ti[j].ti_vol != vol)
+		if (ti[j].ti_vol != vol)
 		    break;
 	    if (j < 0)
 		return PM_ERR_EOL;
-	    vol = lcp->l_ti[j].ti_vol;
+	    vol = ti[j].ti_vol;
 	}
     }
     return PM_ERR_EOL;
@@ -2185,6 +2659,8 @@ __pmLogSetTime(__pmContext *ctxp)
     pmTimeval	save_origin;
     int		save_mode;
     double	t_hi;
+    __pmLogTI	*seek;
+    int		numseek;
     int		mode;
     int		i;
 
@@ -2232,90 +2708,94 @@ __pmLogSetTime(__pmContext *ctxp)
     ctxp->c_origin = save_origin;
     ctxp->c_mode = save_mode;
 
-    if (lcp->l_numti) {
-	/* we have a temporal index, use it! */
+    setupSeek(acp, &seek, &numseek);
+
+    if (numseek > 0 || lcp->l_numti) {
+	/* we have a seek table or temporal index, use it! */
 	int		j = -1;
 	int		toobig = 0;
 	int		match = 0;
-	int		vol;
-	int		numti = lcp->l_numti;
-	__pmFILE		*f;
-	__pmLogTI	*tip = lcp->l_ti;
+	int		numti;
+	__pmLogTI	*ti;
+	__pmLogTI	*tip;
+	__pm_off_t	physend = -1;
 	double		t_lo;
-	struct stat	sbuf;
-
-	sbuf.st_size = -1;
 
-	for (i = 0; i < numti; i++, tip++) {
-	    if (tip->ti_vol < lcp->l_minvol)
-		/* skip missing preliminary volumes */
-		continue;
-	    if (tip->ti_vol == lcp->l_maxvol) {
-		/* truncated check for last volume */
-		if (sbuf.st_size < 0) {
-		    sbuf.st_size = 0;
-		    vol = lcp->l_maxvol;
-		    if (vol >= 0 && vol < lcp->l_numseen && lcp->l_seen[vol])
-			__pmFstat(acp->ac_mfp, &sbuf);
-		    else if ((f = _logpeek(acp, lcp->l_maxvol)) != NULL) {
-			__pmFstat(f, &sbuf);
-			__pmFclose(f);
+	if (numseek > 0) {
+	    ti = seek;
+	    numti = numseek;
+	    j = searchTI(acp, ti, numti, &ctxp->c_origin, &match, &toobig);
+	    if (pmDebugOptions.log)
+		fprintf(stderr, " %s[%d of %d]",
+			ti == lcp->l_ti ? "ti" : "seek", j, numti);
+	}
+	else {
+	    /* temporal index not in time order, linear scan */
+	    ti = tip = lcp->l_ti;
+	    numti = lcp->l_numti;
+	    for (i = 0; i < numti; i++, tip++) {
+		if (tip->ti_vol < lcp->l_minvol)
+		    /* skip missing preliminary volumes */
+		    continue;
+		if (tip->ti_vol == lcp->l_maxvol) {
+		    /* truncated check for last volume */
+		    if (physend < 0)
+			physend = lastVolSize(acp);
+		    if (tip->ti_log > physend) {
+			j = i;
+			toobig++;
+			break;
 		    }
 		}
-		if (tip->ti_log > sbuf.st_size) {
+		t_hi = __pmTimevalSub(&tip->ti_stamp, &ctxp->c_origin);
+		if (t_hi > 0) {
 		    j = i;
-		    toobig++;
+		    break;
+		}
+		else if (t_hi == 0) {
+		    j = i;
+		    match = 1;
 		    break;
 		}
 	    }
-	    t_hi = __pmTimevalSub(&tip->ti_stamp, &ctxp->c_origin);
-	    if (t_hi > 0) {
-		j = i;
-		break;
-	    }
-	    else if (t_hi == 0) {
-		j = i;
-		match = 1;
-		break;
-	    }
+	    if (i == numti)
+		j = numti;
 	}
-	if (i == numti)
-	    j = numti;
 
 	acp->ac_serial = 1;
 
 	if (match) {
-	    j = VolSkip(acp, mode, j);
+	    j = VolSkip(acp, ti, numti, mode, j);
 	    if (j < 0)
 		return;
-	    __pmFseek(acp->ac_mfp, (long)lcp->l_ti[j].ti_log, SEEK_SET);
+	    __pmFseek(acp->ac_mfp, (long)ti[j].ti_log, SEEK_SET);
 	    if (mode == PM_MODE_BACK)
 		acp->ac_serial = 0;
 	    if (pmDebugOptions.log) {
 		fprintf(stderr, " at ti[%d]@", j);
-		__pmPrintTimeval(stderr, &lcp->l_ti[j].ti_stamp);
+		__pmPrintTimeval(stderr, &ti[j].ti_stamp);
 	    }
 	}
 	else if (j < 1) {
-	    j = VolSkip(acp, PM_MODE_FORW, 0);
+	    j = VolSkip(acp, ti, numti, PM_MODE_FORW, 0);
 	    if (j < 0)
 		return;
-	    __pmFseek(acp->ac_mfp, (long)lcp->l_ti[j].ti_log, SEEK_SET);
+	    __pmFseek(acp->ac_mfp, (long)ti[j].ti_log, SEEK_SET);
 	    if (pmDebugOptions.log) {
 		fprintf(stderr, " before start ti@");
-		__pmPrintTimeval(stderr, &lcp->l_ti[j].ti_stamp);
+		__pmPrintTimeval(stderr, &ti[j].ti_stamp);
 	    }
 	}
 	else if (j == numti) {
-	    j = VolSkip(acp, PM_MODE_BACK, numti-1);
+	    j = VolSkip(acp, ti, numti, PM_MODE_BACK, numti-1);
 	    if (j < 0)
 		return;
-	    __pmFseek(acp->ac_mfp, (long)lcp->l_ti[j].ti_log, SEEK_SET);
+	    __pmFseek(acp->ac_mfp, (long)ti[j].ti_log, SEEK_SET);
 	    if (mode == PM_MODE_BACK)
 		acp->ac_serial = 0;
 	    if (pmDebugOptions.log) {
 		fprintf(stderr, " after end ti@");
-		__pmPrintTimeval(stderr, &lcp->l_ti[j].ti_stamp);
+		__pmPrintTimeval(stderr, &ti[j].ti_stamp);
 	    }
 	}
 	else {
@@ -2326,30 +2806,30 @@ __pmLogSetTime(__pmContext *ctxp)
 	     * choose closest index point.  if toobig, [j] is not
 	     * really valid (log truncated or incomplete)
 	     */
-	    t_hi = __pmTimevalSub(&lcp->l_ti[j].ti_stamp, &ctxp->c_origin);
-	    t_lo = __pmTimevalSub(&ctxp->c_origin, &lcp->l_ti[j-1].ti_stamp);
+	    t_hi = __pmTimevalSub(&ti[j].ti_stamp, &ctxp->c_origin);
+	    t_lo = __pmTimevalSub(&ctxp->c_origin, &ti[j-1].ti_stamp);
 	    if (t_hi <= t_lo && !toobig) {
-		j = VolSkip(acp, mode, j);
+		j = VolSkip(acp, ti, numti, mode, j);
 		if (j < 0)
 		    return;
-		__pmFseek(acp->ac_mfp, (long)lcp->l_ti[j].ti_log, SEEK_SET);
+		__pmFseek(acp->ac_mfp, (long)ti[j].ti_log, SEEK_SET);
 		if (mode == PM_MODE_FORW)
 		    acp->ac_serial = 0;
 		if (pmDebugOptions.log) {
 		    fprintf(stderr, " before ti[%d]@", j);
-		    __pmPrintTimeval(stderr, &lcp->l_ti[j].ti_stamp);
+		    __pmPrintTimeval(stderr, &ti[j].ti_stamp);
 		}
 	    }
 	    else {
-		j = VolSkip(acp, mode, j-1);
+		j = VolSkip(acp, ti, numti, mode, j-1);
 		if (j < 0)
 		    return;
-		__pmFseek(acp->ac_mfp, (long)lcp->l_ti[j].ti_log, SEEK_SET);
+		__pmFseek(acp->ac_mfp, (long)ti[j].ti_log, SEEK_SET);
 		if (mode == PM_MODE_BACK)
 		    acp->ac_serial = 0;
 		if (pmDebugOptions.log) {
 		    fprintf(stderr, " after ti[%d]@", j);
-		    __pmPrintTimeval(stderr, &lcp->l_ti[j].ti_stamp);
+		    __pmPrintTimeval(stderr, &ti[j].ti_stamp);
 		}
 	    }
 	    if (acp->ac_serial && mode == PM_MODE_FORW) {
@@ -3100,6 +3580,10 @@ __pmArchCtlFree(__pmArchCtl *acp)
     if (acp->ac_cache != NULL)
 	free(acp->ac_cache);
 
+    /* ... and the key record for delta results */
+    if (acp->ac_key != NULL)
+	pmFreeResult(acp->ac_key);
+
     if (acp->ac_mfp != NULL) {
 	__pmResetIPC(__pmFileno(acp->ac_mfp));
 	__pmFclose(acp->ac_mfp);
@@ -608,6 +608,25 @@ corrupt:
     return PM_ERR_IPC;
 }
 
+/*
+ * Encode a delta result record for an archive (see PM_LOG_DELTA in
+ * libpcp.h) ... the caller has already built vset[0], the header
+ */
+int
+__pmEncodeDeltaResult(int targetfd, const pmResult *delta, __pmPDU **pdubuf)
+{
+    result_t	*pp;
+    int		sts;
+
+    if (delta->numpmid < 1 || delta->vset[0]->pmid != PM_ID_NULL)
+	return PM_ERR_TOOSMALL;
+    if ((sts = __pmEncodeResult(targetfd, delta, pdubuf)) < 0)
+	return sts;
+    pp = (result_t *)*pdubuf;
+    pp->numpmid = htonl(delta->numpmid | PM_LOG_DELTA);
+    return 0;
+}
+
 int
 __pmDecodeResult(__pmPDU *pdubuf, pmResult **result)
 {
@@ -1,26 +1,55 @@
 /*
  * Copyright (c) 1995 Silicon Graphics, Inc.  All Rights Reserved.
- * Copyright (c) 2015 Red Hat, Inc.
- * 
+ * Copyright (c) 2015,2018 Red Hat, Inc.
+ *
  * This library is free software; you can redistribute it and/or modify it
  * under the terms of the GNU Lesser General Public License as published
  * by the Free Software Foundation; either version 2.1 of the License, or
  * (at your option) any later version.
- * 
+ *
  * This library is distributed in the hope that it will be useful, but
  * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
  * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
  * License for more details.
  *
+ * PDU buffers are carved from size-classed slabs and recycled through
+ * per-class free lists, rather than being malloc'd and free'd for every
+ * PDU.  Each buffer is preceded by an inline bufctl_t header holding the
+ * pin count.  Buffers larger than the biggest size class are malloc'd
+ * individually and released on the final unpin.
+ *
+ * Callers may pin and unpin using any address within a buffer (e.g. a
+ * pmValueSet inside a pmResult PDU), and __pmUnpinPDUBuf() is routinely
+ * handed addresses that are not PDU buffers at all, so every slab is
+ * recorded in segs[], sorted by address.  Finding the buffer for an
+ * address is a binary search over the (small) number of slabs followed
+ * by simple arithmetic, not a search over every buffer.  Large buffers
+ * come and go individually, so they are kept in a tsearch(3) tree keyed
+ * by address instead, where adding or removing one is O(log n).
+ *
+ * When a burst of PDUs leaves more than BC_FREEHIGH slabs' worth of
+ * buffers on a class's shared free list, slabs whose buffers are all on
+ * that free list are returned to malloc until no more than BC_FREEKEEP
+ * slabs' worth remain, so a transient peak does not pin its memory for
+ * the life of the process.
+ *
  * Thread-safe notes
  *
  * To avoid buffer trampling, on success __pmFindPDUBuf() now returns
  * a pinned PDU buffer.  It is the caller's responsibility to unpin the
  * PDU buffer when safe to do so.
+ *
+ * segs[], the large buffer tree, the free lists, pin counts and
+ * statistics are all protected by
+ * the pdubuf_lock mutex.  When the compiler supports __thread, each
+ * thread also keeps a small cache of free buffers per size class, so
+ * the common allocation path takes no lock at all; buffers in a thread's
+ * cache are returned to the shared free lists when the thread exits.
  */
 
 #include "pmapi.h"
 #include "libpcp.h"
+#include "internal.h"
 #include "compiler.h"
 #include <assert.h>
 #include <search.h>
@@ -28,14 +57,61 @@
 
 typedef struct bufctl
 {
-    int		bc_pincnt;
-    int		bc_size;
-    char	*bc_buf;
-    /* The actual buffer happens to follow this struct. */
+    struct bufctl	*bc_next;	/* free list linkage */
+    int			bc_pincnt;
+    int			bc_size;	/* size requested by the caller */
+    int			bc_class;	/* size class, BC_LARGE if malloc'd */
+    int			bc_free;	/* on the shared free list */
+    char		*bc_buf;	/* the buffer, for the large buffer tree */
+    /* The actual buffer follows this header, at offset BC_HDRSZ. */
 } bufctl_t;
 
+/* keep the buffer itself aligned for any type */
+#define BC_HDRSZ	((sizeof(bufctl_t) + 15) & ~((size_t)15))
+#define BC_BUF(pcp)	((char *)(pcp) + BC_HDRSZ)
+
+#define BC_LARGE	-1
+
+/*
+ * Size classes are powers of two from 1 << BC_MINSHIFT to
+ * 1 << BC_MAXSHIFT bytes (of buffer, excluding the header).
+ */
+#define BC_MINSHIFT	9
+#define BC_MAXSHIFT	16
+#define BC_NCLASS	(BC_MAXSHIFT - BC_MINSHIFT + 1)
+#define BC_CLASSSIZE(c)	(1 << ((c) + BC_MINSHIFT))
+
+/* aim for slabs of about this many bytes, but at least BC_MINSLAB buffers */
+#define BC_SLABSIZE	(64 * 1024)
+#define BC_MINSLAB	2
+
+/* free list high-water mark and trim target, in slabs per size class */
+#define BC_FREEHIGH	4
+#define BC_FREEKEEP	2
+
+typedef struct {
+    char		*sg_base;	/* first bufctl_t */
+    char		*sg_end;	/* one beyond the last byte */
+    size_t		sg_stride;	/* header + buffer size */
+    int			sg_class;	/* size class */
+} seg_t;
+
+typedef struct {
+    unsigned long	hit;		/* allocations satisfied from a free list */
+    unsigned long	miss;		/* allocations needing new memory */
+    unsigned long	trim;		/* slabs released by trimslabs() */
+    int			nbuf;		/* buffers in slabs of this class */
+    int			nfree;		/* buffers on the shared free list */
+} classstat_t;
+
 /* Protected by the pdubuf_lock mutex. */
-static void *buf_tree;
+static seg_t		*segs;
+static int		nsegs;
+static int		maxsegs;
+static bufctl_t		*freelist[BC_NCLASS];
+static classstat_t	classstat[BC_NCLASS];
+static void		*large_tree;
+static unsigned long	large_alloc;
 
 #ifdef PM_MULTI_THREAD
 static pthread_mutex_t	pdubuf_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -54,36 +130,124 @@ __pmIsPdubufLock(void *lock)
 }
 #endif
 
+#if defined(PM_MULTI_THREAD) && defined(HAVE___THREAD)
+#define BC_TCACHE	1
+#define BC_TCACHEMAX	8		/* buffers per size class per thread */
+
+typedef struct tcache {
+    struct tcache	*tc_next;	/* all thread caches, for statistics */
+    bufctl_t		*tc_list[BC_NCLASS];
+    int			tc_count[BC_NCLASS];
+    unsigned long	tc_hit[BC_NCLASS];
+} tcache_t;
+
+static __thread tcache_t *tcache;	/* this thread's cache */
+static tcache_t		*tcache_all;	/* protected by pdubuf_lock */
+static unsigned long	tcache_hit[BC_NCLASS];	/* from exited threads */
+static pthread_key_t	tcache_key;
+static pthread_once_t	tcache_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Thread exit ... return cached buffers to the shared free lists.
+ */
 static void
-pdubufdump1(const void *nodep, const VISIT which, const int depth)
+tcache_destroy(void *arg)
 {
-    const bufctl_t	*pcp = *(bufctl_t **)nodep;
+    tcache_t	*tcp = (tcache_t *)arg;
+    tcache_t	**tcpp;
+    bufctl_t	*pcp;
+    int		c;
 
-    if (which == postorder || which == leaf)	/* called once per node */
-	fprintf(stderr, " " PRINTF_P_PFX "%p...%p[%d](%d)",
-		pcp->bc_buf, &pcp->bc_buf[pcp->bc_size - 1], pcp->bc_size,
-		pcp->bc_pincnt);
+    PM_LOCK(pdubuf_lock);
+    for (c = 0; c < BC_NCLASS; c++) {
+	while ((pcp = tcp->tc_list[c]) != NULL) {
+	    tcp->tc_list[c] = pcp->bc_next;
+	    pcp->bc_free = 1;
+	    pcp->bc_next = freelist[c];
+	    freelist[c] = pcp;
+	    classstat[c].nfree++;
+	}
+	tcache_hit[c] += tcp->tc_hit[c];
+    }
+    for (tcpp = &tcache_all; *tcpp != NULL; tcpp = &(*tcpp)->tc_next) {
+	if (*tcpp == tcp) {
+	    *tcpp = tcp->tc_next;
+	    break;
+	}
+    }
+    PM_UNLOCK(pdubuf_lock);
+    if (tcache == tcp)
+	tcache = NULL;
+    free(tcp);
 }
 
 static void
-pdubufdump(void)
+tcache_init(void)
 {
-    /*
-     * There is no longer a pdubuf free list, ergo no
-     * fprintf(stderr, "   free pdubuf[size]:\n");
-     */
-    PM_LOCK(pdubuf_lock);
-    if (buf_tree != NULL) {
-	fprintf(stderr, "   pinned pdubuf[size](pincnt):");
-	/* THREADSAFE - no locks acquired in pdubufdump1() */
-	twalk(buf_tree, &pdubufdump1);
-	fprintf(stderr, "\n");
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+static tcache_t *
+tcache_get(void)
+{
+    tcache_t	*tcp;
+
+    if (likely(tcache != NULL))
+	return tcache;
+    if ((tcp = (tcache_t *)calloc(1, sizeof(*tcp))) == NULL)
+	return NULL;
+    pthread_once(&tcache_once, tcache_init);
+    if (pthread_setspecific(tcache_key, tcp) != 0) {
+	free(tcp);
+	return NULL;
     }
+    PM_LOCK(pdubuf_lock);
+    tcp->tc_next = tcache_all;
+    tcache_all = tcp;
     PM_UNLOCK(pdubuf_lock);
+    tcache = tcp;
+    return tcp;
+}
+#endif /* BC_TCACHE */
+
+static int
+size2class(int need)
+{
+    int		c;
+
+    for (c = 0; c < BC_NCLASS; c++) {
+	if (need <= BC_CLASSSIZE(c))
+	    return c;
+    }
+    return BC_LARGE;
 }
 
 /*
- * A tsearch(3) comparison function for the buffer-segments used here.
+ * Find the segment containing addr, or NULL if none.
+ */
+static seg_t *
+findseg(const char *addr)
+{
+    int		lo = 0;
+    int		hi = nsegs - 1;
+    int		mid;
+
+    PM_ASSERT_IS_LOCKED(pdubuf_lock);
+
+    while (lo <= hi) {
+	mid = (lo + hi) / 2;
+	if (addr < segs[mid].sg_base)
+	    hi = mid - 1;
+	else if (addr >= segs[mid].sg_end)
+	    lo = mid + 1;
+	else
+	    return &segs[mid];
+    }
+    return NULL;
+}
+
+/*
+ * A tsearch(3) comparison function for the large buffer tree.
  */
 static int
 bufctl_t_compare(const void *a, const void *b)
@@ -99,11 +263,238 @@ bufctl_t_compare(const void *a, const void *b)
     return 0;		/* overlap */
 }
 
+/*
+ * Find the large buffer containing addr, or NULL if none.
+ */
+static bufctl_t *
+findlarge(const char *addr)
+{
+    bufctl_t	pcp_search;
+    void	*bcp;
+
+    PM_ASSERT_IS_LOCKED(pdubuf_lock);
+
+    /*
+     * Initialize a dummy bufctl_t to use only as search key;
+     * only its bc_buf & bc_size fields need to be set, as that's
+     * all that bufctl_t_compare will look at.
+     */
+    pcp_search.bc_buf = (char *)addr;
+    pcp_search.bc_size = 1;
+    /* THREADSAFE - no locks acquired in bufctl_t_compare() */
+    if ((bcp = tfind(&pcp_search, &large_tree, &bufctl_t_compare)) == NULL)
+	return NULL;
+    return *(bufctl_t **)bcp;
+}
+
+/*
+ * Map an arbitrary address to the pinned buffer containing it, or NULL
+ * if the address is not within the caller-requested part of a buffer
+ * in the pool.
+ */
+static bufctl_t *
+findbuf(const char *addr)
+{
+    seg_t	*sgp;
+    bufctl_t	*pcp;
+    size_t	i;
+
+    if ((sgp = findseg(addr)) == NULL)
+	return findlarge(addr);
+    i = (addr - sgp->sg_base) / sgp->sg_stride;
+    pcp = (bufctl_t *)(sgp->sg_base + i * sgp->sg_stride);
+    if (addr < BC_BUF(pcp) || addr >= BC_BUF(pcp) + pcp->bc_size)
+	return NULL;
+    if (pcp->bc_pincnt <= 0)
+	return NULL;
+    return pcp;
+}
+
+/*
+ * Record a new slab in segs[].  Slabs are few and long lived, so keeping
+ * the array sorted by moving entries along is cheap enough.
+ */
+static int
+addseg(char *base, size_t len, size_t stride, int class)
+{
+    seg_t	*sgp;
+    int		i;
+
+    PM_ASSERT_IS_LOCKED(pdubuf_lock);
+
+    if (nsegs == maxsegs) {
+	int	want = maxsegs ? maxsegs * 2 : 16;
+	if ((sgp = (seg_t *)realloc(segs, want * sizeof(seg_t))) == NULL)
+	    return -ENOMEM;
+	segs = sgp;
+	maxsegs = want;
+    }
+    for (i = nsegs; i > 0 && segs[i-1].sg_base > base; i--)
+	segs[i] = segs[i-1];
+    segs[i].sg_base = base;
+    segs[i].sg_end = base + len;
+    segs[i].sg_stride = stride;
+    segs[i].sg_class = class;
+    nsegs++;
+    return 0;
+}
+
+static void
+delseg(seg_t *sgp)
+{
+    int		i = (int)(sgp - segs);
+
+    PM_ASSERT_IS_LOCKED(pdubuf_lock);
+
+    nsegs--;
+    if (i < nsegs)
+	memmove(&segs[i], &segs[i+1], (nsegs - i) * sizeof(seg_t));
+}
+
+/* number of buffers in each slab of size class c */
+static int
+slabbufs(int c)
+{
+    int		nbuf = BC_SLABSIZE / (BC_HDRSZ + BC_CLASSSIZE(c));
+
+    return nbuf < BC_MINSLAB ? BC_MINSLAB : nbuf;
+}
+
+/*
+ * Add a new slab for size class c, and put all of its buffers on the
+ * shared free list.
+ */
+static int
+newslab(int c)
+{
+    size_t	stride = BC_HDRSZ + BC_CLASSSIZE(c);
+    int		nbuf = slabbufs(c);
+    char	*base;
+    bufctl_t	*pcp;
+    int		i;
+
+    PM_ASSERT_IS_LOCKED(pdubuf_lock);
+
+    if ((base = (char *)malloc(nbuf * stride)) == NULL)
+	return -ENOMEM;
+    if (addseg(base, nbuf * stride, stride, c) < 0) {
+	free(base);
+	return -ENOMEM;
+    }
+    for (i = nbuf - 1; i >= 0; i--) {
+	pcp = (bufctl_t *)(base + i * stride);
+	pcp->bc_pincnt = 0;
+	pcp->bc_size = 0;
+	pcp->bc_class = c;
+	pcp->bc_free = 1;
+	pcp->bc_next = freelist[c];
+	freelist[c] = pcp;
+    }
+    classstat[c].nbuf += nbuf;
+    classstat[c].nfree += nbuf;
+    return 0;
+}
+
+/*
+ * The shared free list for size class c has passed its high-water mark,
+ * release slabs with every buffer on that list (none pinned, none in a
+ * thread's cache) until it is back down to BC_FREEKEEP slabs' worth.
+ */
+static void
+trimslabs(int c)
+{
+    int		nbuf = slabbufs(c);
+    int		keep = BC_FREEKEEP * nbuf;
+    bufctl_t	**pcpp;
+    bufctl_t	*pcp;
+    seg_t	*sgp;
+    char	*p;
+    int		i;
+
+    PM_ASSERT_IS_LOCKED(pdubuf_lock);
+
+    for (i = nsegs - 1; i >= 0 && classstat[c].nfree - nbuf >= keep; i--) {
+	sgp = &segs[i];
+	if (sgp->sg_class != c)
+	    continue;
+	for (p = sgp->sg_base; p < sgp->sg_end; p += sgp->sg_stride) {
+	    if (!((bufctl_t *)p)->bc_free)
+		break;
+	}
+	if (p < sgp->sg_end)
+	    continue;
+	/* unlink this slab's buffers from the free list */
+	for (pcpp = &freelist[c]; (pcp = *pcpp) != NULL; ) {
+	    if ((char *)pcp >= sgp->sg_base && (char *)pcp < sgp->sg_end)
+		*pcpp = pcp->bc_next;
+	    else
+		pcpp = &pcp->bc_next;
+	}
+	p = sgp->sg_base;
+	delseg(sgp);
+	free(p);
+	classstat[c].nbuf -= nbuf;
+	classstat[c].nfree -= nbuf;
+	classstat[c].trim++;
+    }
+}
+
+static void
+pdubufdump1(const void *nodep, const VISIT which, const int depth)
+{
+    const bufctl_t	*pcp = *(bufctl_t **)nodep;
+
+    if (which == postorder || which == leaf)	/* called once per node */
+	fprintf(stderr, " " PRINTF_P_PFX "%p...%p[%d](%d)",
+		pcp->bc_buf, &pcp->bc_buf[pcp->bc_size - 1], pcp->bc_size,
+		pcp->bc_pincnt);
+}
+
+static void
+pdubufdump(void)
+{
+    bufctl_t	*pcp;
+    char	*p;
+    int		first = 1;
+    int		i;
+
+    /*
+     * Only pinned buffers are reported, free buffers are summarized
+     * by __pmPDUBufStats()
+     */
+    PM_LOCK(pdubuf_lock);
+    for (i = 0; i < nsegs; i++) {
+	for (p = segs[i].sg_base; p < segs[i].sg_end; p += segs[i].sg_stride) {
+	    pcp = (bufctl_t *)p;
+	    if (pcp->bc_pincnt <= 0)
+		continue;
+	    if (first) {
+		fprintf(stderr, "   pinned pdubuf[size](pincnt):");
+		first = 0;
+	    }
+	    fprintf(stderr, " " PRINTF_P_PFX "%p...%p[%d](%d)",
+		    BC_BUF(pcp), &BC_BUF(pcp)[pcp->bc_size - 1], pcp->bc_size,
+		    pcp->bc_pincnt);
+	}
+    }
+    if (large_tree != NULL) {
+	if (first) {
+	    fprintf(stderr, "   pinned pdubuf[size](pincnt):");
+	    first = 0;
+	}
+	/* THREADSAFE - no locks acquired in pdubufdump1() */
+	twalk(large_tree, &pdubufdump1);
+    }
+    if (!first)
+	fprintf(stderr, "\n");
+    PM_UNLOCK(pdubuf_lock);
+}
+
 __pmPDU *
 __pmFindPDUBuf(int need)
 {
-    bufctl_t	*pcp;
-    void	*bcp;
+    bufctl_t	*pcp = NULL;
+    int		c;
 
     if (unlikely(need < 0)) {
 	/* special diagnostic case ... dump buffer state */
@@ -112,60 +503,78 @@ __pmFindPDUBuf(int need)
 	return NULL;
     }
 
-    if ((pcp = (bufctl_t *)malloc(sizeof(*pcp) + need)) == NULL) {
-	return NULL;
-    }
-
-    pcp->bc_pincnt = 1;
-    pcp->bc_size = need;
-    pcp->bc_buf = ((char *)pcp) + sizeof(*pcp);
-
-    PM_LOCK(pdubuf_lock);
-    /* Insert the node in the tree. */
-    /* THREADSAFE - no locks acquired in bufctl_t_compare() */
-    bcp = tsearch((void *)pcp, &buf_tree, &bufctl_t_compare);
-    if (unlikely(bcp == NULL)) {	/* ENOMEM */
+    if ((c = size2class(need)) == BC_LARGE) {
+	if (need > INT_MAX - BC_HDRSZ)
+	    return NULL;
+	if ((pcp = (bufctl_t *)malloc(BC_HDRSZ + need)) == NULL)
+	    return NULL;
+	pcp->bc_class = BC_LARGE;
+	pcp->bc_free = 0;
+	pcp->bc_buf = BC_BUF(pcp);
+	pcp->bc_size = need;
+	pcp->bc_pincnt = 1;
+	PM_LOCK(pdubuf_lock);
+	/* THREADSAFE - no locks acquired in bufctl_t_compare() */
+	if (unlikely(tsearch((void *)pcp, &large_tree, &bufctl_t_compare) == NULL)) {
+	    PM_UNLOCK(pdubuf_lock);	/* ENOMEM */
+	    free(pcp);
+	    return NULL;
+	}
+	large_alloc++;
 	PM_UNLOCK(pdubuf_lock);
-	free(pcp);
-	return NULL;
     }
-    PM_UNLOCK(pdubuf_lock);
+    else {
+#ifdef BC_TCACHE
+	tcache_t	*tcp = tcache_get();
+
+	if (tcp != NULL && (pcp = tcp->tc_list[c]) != NULL) {
+	    /* lock-free fast path, buffer is private to this thread */
+	    tcp->tc_list[c] = pcp->bc_next;
+	    tcp->tc_count[c]--;
+	    tcp->tc_hit[c]++;
+	    pcp->bc_size = need;
+	    pcp->bc_pincnt = 1;
+	}
+#endif
+	if (pcp == NULL) {
+	    PM_LOCK(pdubuf_lock);
+	    if (freelist[c] != NULL)
+		classstat[c].hit++;
+	    else {
+		classstat[c].miss++;
+		if (newslab(c) < 0) {
+		    PM_UNLOCK(pdubuf_lock);
+		    return NULL;
+		}
+	    }
+	    pcp = freelist[c];
+	    freelist[c] = pcp->bc_next;
+	    pcp->bc_free = 0;
+	    classstat[c].nfree--;
+	    pcp->bc_size = need;
+	    pcp->bc_pincnt = 1;
+	    PM_UNLOCK(pdubuf_lock);
+	}
+    }
 
     if (unlikely(pmDebugOptions.pdubuf)) {
 	fprintf(stderr, "__pmFindPDUBuf(%d) -> " PRINTF_P_PFX "%p\n",
-		need, pcp->bc_buf);
+		need, BC_BUF(pcp));
 	pdubufdump();
     }
 
-    return (__pmPDU *)pcp->bc_buf;
+    return (__pmPDU *)BC_BUF(pcp);
 }
 
 void
 __pmPinPDUBuf(void *handle)
 {
-    bufctl_t	*pcp, pcp_search;
-    void	*bcp;
+    bufctl_t	*pcp;
 
     assert(((__psint_t)handle % sizeof(int)) == 0);
-    /*
-     * Initialize a dummy bufctl_t to use only as search key;
-     * only its bc_buf & bc_size fields need to be set, as that's
-     * all that bufctl_t_compare will look at.
-     */
-    pcp_search.bc_buf = handle;
-    pcp_search.bc_size = 1;
 
     PM_LOCK(pdubuf_lock);
-    /* THREADSAFE - no locks acquired in bufctl_t_compare() */
-    bcp = tfind(&pcp_search, &buf_tree, &bufctl_t_compare);
-    /*
-     * NB: don't release the lock until final disposition of this object;
-     * we don't want to play TOCTOU.
-     */
-    if (likely(bcp != NULL)) {
-	pcp = *(bufctl_t **)bcp;
-	assert((&pcp->bc_buf[0] <= (char *)handle) &&
-	       ((char *)handle < &pcp->bc_buf[pcp->bc_size]));
+    if (likely((pcp = findbuf((char *)handle)) != NULL)) {
 	pcp->bc_pincnt++;
     } else {
 	PM_UNLOCK(pdubuf_lock);
@@ -178,7 +587,7 @@ __pmPinPDUBuf(void *handle)
     if (unlikely(pmDebugOptions.pdubuf))
 	fprintf(stderr, "__pmPinPDUBuf(" PRINTF_P_PFX "%p) -> pdubuf="
 			PRINTF_P_PFX "%p, pincnt=%d\n", handle,
-		pcp->bc_buf, pcp->bc_pincnt);
+		BC_BUF(pcp), pcp->bc_pincnt);
 
     PM_UNLOCK(pdubuf_lock);
 }
@@ -186,29 +595,17 @@ __pmPinPDUBuf(void *handle)
 int
 __pmUnpinPDUBuf(void *handle)
 {
-    bufctl_t	*pcp, pcp_search;
-    void	*bcp;
+    bufctl_t	*pcp;
+    int		c;
 
     assert(((__psint_t)handle % sizeof(int)) == 0);
     PM_LOCK(pdubuf_lock);
 
-    /*
-     * Initialize a dummy bufctl_t to use only as search key;
-     * only its bc_buf & bc_size fields need to be set, as that's
-     * all that bufctl_t_compare will look at.
-     */
-    pcp_search.bc_buf = handle;
-    pcp_search.bc_size = 1;
-
-    /* THREADSAFE - no locks acquired in bufctl_t_compare() */
-    bcp = tfind(&pcp_search, &buf_tree, &bufctl_t_compare);
     /*
      * NB: don't release the lock until final disposition of this object;
      * we don't want to play TOCTOU.
      */
-    if (likely(bcp != NULL)) {
-	pcp = *(bufctl_t **)bcp;
-    } else {
+    if (unlikely((pcp = findbuf((char *)handle)) == NULL)) {
 	PM_UNLOCK(pdubuf_lock);
 	if (pmDebugOptions.pdubuf) {
 	    fprintf(stderr, "__pmUnpinPDUBuf(" PRINTF_P_PFX "%p) -> fails\n",
@@ -221,20 +618,34 @@ __pmUnpinPDUBuf(void *handle)
     if (unlikely(pmDebugOptions.pdubuf))
 	fprintf(stderr, "__pmUnpinPDUBuf(" PRINTF_P_PFX "%p) -> pdubuf="
 			PRINTF_P_PFX "%p, pincnt=%d\n", handle,
-		pcp->bc_buf, pcp->bc_pincnt - 1);
-
-    assert((&pcp->bc_buf[0] <= (char*)handle) &&
-	   ((char*)handle < &pcp->bc_buf[pcp->bc_size]));
+		BC_BUF(pcp), pcp->bc_pincnt - 1);
 
     if (likely(--pcp->bc_pincnt == 0)) {
-	/* THREADSAFE - no locks acquired in bufctl_t_compare() */
-	tdelete(pcp, &buf_tree, &bufctl_t_compare);
-	PM_UNLOCK(pdubuf_lock);
-	free(pcp);
-    }
-    else {
-	PM_UNLOCK(pdubuf_lock);
+	if ((c = pcp->bc_class) == BC_LARGE) {
+	    /* THREADSAFE - no locks acquired in bufctl_t_compare() */
+	    tdelete(pcp, &large_tree, &bufctl_t_compare);
+	    large_alloc--;
+	    PM_UNLOCK(pdubuf_lock);
+	    free(pcp);
+	    return 1;
+	}
+#ifdef BC_TCACHE
+	if (tcache != NULL && tcache->tc_count[c] < BC_TCACHEMAX) {
+	    /* no other references, safe to cache without the lock */
+	    PM_UNLOCK(pdubuf_lock);
+	    pcp->bc_next = tcache->tc_list[c];
+	    tcache->tc_list[c] = pcp;
+	    tcache->tc_count[c]++;
+	    return 1;
+	}
+#endif
+	pcp->bc_free = 1;
+	pcp->bc_next = freelist[c];
+	freelist[c] = pcp;
+	if (++classstat[c].nfree > BC_FREEHIGH * slabbufs(c))
+	    trimslabs(c);
     }
+    PM_UNLOCK(pdubuf_lock);
 
     return 1;
 }
@@ -256,18 +667,80 @@ pdubufcount(const void *nodep, const VISIT which, const int depth)
 	    pdu_bufcnt++;
 }
 
+/*
+ * Count the in-use (pinned) PDU buffers of at least need bytes, by the
+ * size the caller asked for.  Free buffers are not counted here (*free
+ * is always zero), they are reported by size class by __pmPDUBufStats().
+ */
 void
 __pmCountPDUBuf(int need, int *alloc, int *free)
 {
+    bufctl_t	*pcp;
+    char	*p;
+    int		i;
+
     PM_LOCK(pdubuf_lock);
 
     pdu_bufcnt_need = need;
     pdu_bufcnt = 0;
+    for (i = 0; i < nsegs; i++) {
+	if (BC_CLASSSIZE(segs[i].sg_class) < need)
+	    continue;
+	for (p = segs[i].sg_base; p < segs[i].sg_end; p += segs[i].sg_stride) {
+	    pcp = (bufctl_t *)p;
+	    if (pcp->bc_pincnt > 0 && pcp->bc_size >= need)
+		pdu_bufcnt++;
+	}
+    }
     /* THREADSAFE - no locks acquired in pdubufcount() */
-    twalk(buf_tree, &pdubufcount);
+    twalk(large_tree, &pdubufcount);
     *alloc = pdu_bufcnt;
 
-    *free = 0;			/* We don't retain freed nodes. */
+    *free = 0;
 
     PM_UNLOCK(pdubuf_lock);
 }
+
+/*
+ * Report pool statistics, for each of the first maxclass size classes:
+ * size, hits (allocations served from a free list), misses (allocations
+ * requiring a new slab), slabs trimmed, buffers in use and buffers free.  Returns the
+ * number of size classes, and with maxclass == 0 simply returns that.
+ * Large (individually malloc'd) buffers in use are reported via *large.
+ */
+int
+__pmPDUBufStats(int maxclass, __pmPDUBufStat *stats, int *large)
+{
+    int		c;
+#ifdef BC_TCACHE
+    tcache_t	*tcp;
+#endif
+
+    if (maxclass <= 0)
+	return BC_NCLASS;
+    if (maxclass > BC_NCLASS)
+	maxclass = BC_NCLASS;
+
+    PM_LOCK(pdubuf_lock);
+    for (c = 0; c < maxclass; c++) {
+	stats[c].size = BC_CLASSSIZE(c);
+	stats[c].hit = classstat[c].hit;
+	stats[c].miss = classstat[c].miss;
+	stats[c].trim = classstat[c].trim;
+	stats[c].free = classstat[c].nfree;
+#ifdef BC_TCACHE
+	stats[c].hit += tcache_hit[c];
+	for (tcp = tcache_all; tcp != NULL; tcp = tcp->tc_next) {
+	    /* racy reads of other threads' counters, good enough here */
+	    stats[c].hit += tcp->tc_hit[c];
+	    stats[c].free += tcp->tc_count[c];
+	}
+#endif
+	stats[c].inuse = classstat[c].nbuf - stats[c].free;
+    }
+    if (large != NULL)
+	*large = (int)large_alloc;
+    PM_UNLOCK(pdubuf_lock);
+
+    return BC_NCLASS;
+}
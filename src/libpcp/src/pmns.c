@@ -206,6 +206,23 @@ lock_ctx_and_pmns(__pmContext *ctxp, ctx_ctl_t *ccp)
     return handle;
 }
 
+/*
+ * For PMNS_REMOTE the namespace lives in pmcd, and the PDU exchange
+ * only needs the (locked) context ... drop pmns_lock (if we acquired
+ * it) so that namespace operations on other contexts are not serialized
+ * behind this round trip.
+ */
+static void
+unlock_pmns_for_remote(ctx_ctl_t *ccp)
+{
+    if (ccp->ctxp != NULL)
+	PM_ASSERT_IS_LOCKED(ccp->ctxp->c_lock);
+    if (ccp->need_pmns_unlock) {
+	PM_UNLOCK(pmns_lock);
+	ccp->need_pmns_unlock = 0;
+    }
+}
+
 /*
  * Helper routine to report all the names for a metric ...
  * numnames and names[] would typically by returned from
@@ -1859,6 +1876,7 @@ pmLookupName_ctx(__pmContext *ctxp, int numpmid, char *namelist[], pmID pmidlist
 	 * PMNS_REMOTE so there must be a current host context
 	 */
 	assert(c_type == PM_CONTEXT_HOST);
+	unlock_pmns_for_remote(&ctx_ctl);
 	if (pmDebugOptions.pmns) {
 	    fprintf(stderr, "pmLookupName: request_names ->");
 	    for (i = 0; i < numpmid; i++)
@@ -2361,6 +2379,7 @@ getchildren(__pmContext *ctxp, int needlocks, const char *name, char ***offsprin
 	 * PMNS_REMOTE so there must be a current host context
 	 */
 	assert(ctxp != NULL && ctxp->c_type == PM_CONTEXT_HOST);
+	unlock_pmns_for_remote(&ctx_ctl);
 	num = GetChildrenStatusRemote(ctxp, name, offspring, statuslist);
     }
 
@@ -2594,6 +2613,7 @@ pmNameID(pmID pmid, char **name)
     else {
 	/* assume PMNS_REMOTE */
 	assert(c_type == PM_CONTEXT_HOST);
+	unlock_pmns_for_remote(&ctx_ctl);
 	if ((sts = request_namebypmid(ctxp, pmid)) >= 0) {
 	    sts = receive_a_name(ctxp, name);
 	}
@@ -2764,6 +2784,7 @@ pmNameAll_ctx(__pmContext *ctxp, pmID pmid, char ***namelist)
     else {
 	/* assume PMNS_REMOTE */
 	assert(c_type == PM_CONTEXT_HOST);
+	unlock_pmns_for_remote(&ctx_ctl);
 	if ((sts = request_namebypmid (ctxp, pmid)) >= 0) {
 	    sts = receive_namesbyid (ctxp, namelist);
 	}
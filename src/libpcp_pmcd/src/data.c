@@ -34,6 +34,11 @@ PMCD_DATA char *pmcd_labels;		/* Current set of context labels */
 
 PMCD_DATA unsigned pmcd_sighups;	/* Count of SIGHUPS responded to */
 
+PMCD_DATA int	pmcd_fetch_window;	/* Fetch cache lifetime (msec) */
+PMCD_DATA int	pmcd_fetch_entries;	/* Fetch cache current size */
+PMCD_DATA __uint64_t pmcd_fetch_hits;	/* Fetch cache lookups found */
+PMCD_DATA __uint64_t pmcd_fetch_misses;	/* Fetch cache lookups not found */
+
 /*
  * File descriptors are used as an internal index with the advent
  * of NSPR in libpcp.  We (may) need to first decode the index to
@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ */
+#include "query.h"
+#include "aggregate.h"
+
+/*
+ * The reduction kernels run over a contiguous array of the values in
+ * one bucket.  Sums, minima and maxima are kept in four independent
+ * lanes so the compiler can use vector instructions without having
+ * to reorder floating point arithmetic (i.e. without -ffast-math).
+ */
+static double
+kernel_sum(const double *values, unsigned int count)
+{
+    double		s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    unsigned int	i;
+
+    for (i = 0; i + 4 <= count; i += 4) {
+	s0 += values[i];
+	s1 += values[i+1];
+	s2 += values[i+2];
+	s3 += values[i+3];
+    }
+    for (; i < count; i++)
+	s0 += values[i];
+    return (s0 + s1) + (s2 + s3);
+}
+
+static double
+kernel_min(const double *values, unsigned int count)
+{
+    double		m0, m1, m2, m3;
+    unsigned int	i;
+
+    m0 = m1 = m2 = m3 = values[0];
+    for (i = 0; i + 4 <= count; i += 4) {
+	m0 = values[i] < m0 ? values[i] : m0;
+	m1 = values[i+1] < m1 ? values[i+1] : m1;
+	m2 = values[i+2] < m2 ? values[i+2] : m2;
+	m3 = values[i+3] < m3 ? values[i+3] : m3;
+    }
+    for (; i < count; i++)
+	m0 = values[i] < m0 ? values[i] : m0;
+    m0 = m1 < m0 ? m1 : m0;
+    m2 = m3 < m2 ? m3 : m2;
+    return m2 < m0 ? m2 : m0;
+}
+
+static double
+kernel_max(const double *values, unsigned int count)
+{
+    double		m0, m1, m2, m3;
+    unsigned int	i;
+
+    m0 = m1 = m2 = m3 = values[0];
+    for (i = 0; i + 4 <= count; i += 4) {
+	m0 = values[i] > m0 ? values[i] : m0;
+	m1 = values[i+1] > m1 ? values[i+1] : m1;
+	m2 = values[i+2] > m2 ? values[i+2] : m2;
+	m3 = values[i+3] > m3 ? values[i+3] : m3;
+    }
+    for (; i < count; i++)
+	m0 = values[i] > m0 ? values[i] : m0;
+    m0 = m1 > m0 ? m1 : m0;
+    m2 = m3 > m2 ? m3 : m2;
+    return m2 > m0 ? m2 : m0;
+}
+
+static int
+double_compare(const void *a, const void *b)
+{
+    double	da = *(const double *)a;
+    double	db = *(const double *)b;
+
+    if (da == db)
+	return 0;
+    return da < db ? -1 : 1;
+}
+
+/* sorts values in place, interpolating between the closest ranks */
+static double
+kernel_quantile(double *values, unsigned int count, double quantile)
+{
+    double		rank, fraction;
+    unsigned int	low;
+
+    qsort(values, count, sizeof(double), double_compare);
+    rank = quantile * (count - 1);
+    low = (unsigned int)rank;
+    if (low + 1 >= count)
+	return values[count - 1];
+    fraction = rank - low;
+    return values[low] + (values[low + 1] - values[low]) * fraction;
+}
+
+static double
+kernel_reduce(const function_t *fp, double *values, unsigned int count)
+{
+    switch (fp->type) {
+    case N_SUM:
+	return kernel_sum(values, count);
+    case N_MIN:
+	return kernel_min(values, count);
+    case N_MAX:
+	return kernel_max(values, count);
+    case N_COUNT:
+	return count;
+    case N_QUANTILE:
+	return kernel_quantile(values, count, fp->quantile);
+    case N_AVG:
+    default:
+	break;
+    }
+    return kernel_sum(values, count) / count;
+}
+
+/* start of the bucket holding a timestamp, zero for a single bucket */
+static long long
+bucket_start(const function_t *fp, long long stamp)
+{
+    long long	offset;
+
+    if (fp->width <= 0)
+	return 0;
+    offset = (stamp - fp->origin) % fp->width;
+    if (offset < 0)
+	offset += fp->width;
+    return stamp - offset;
+}
+
+int
+samples_append(samples_t *sp, long long stamp, double value)
+{
+    unsigned int	size;
+    long long		*stamps;
+    double		*values;
+
+    if (sp->count == sp->size) {
+	size = sp->size ? sp->size * 2 : 64;
+	if ((stamps = realloc(sp->stamps, size * sizeof(long long))) == NULL)
+	    return -ENOMEM;
+	sp->stamps = stamps;
+	if ((values = realloc(sp->values, size * sizeof(double))) == NULL)
+	    return -ENOMEM;
+	sp->values = values;
+	sp->size = size;
+    }
+    sp->stamps[sp->count] = stamp;
+    sp->values[sp->count] = value;
+    sp->count++;
+    return 0;
+}
+
+void
+samples_free(samples_t *sp)
+{
+    free(sp->stamps);
+    free(sp->values);
+    memset(sp, 0, sizeof(*sp));
+}
+
+/*
+ * Per-second rate of change between each sample and the one before,
+ * in place, stamped with the later sample.  For counters, so drops in
+ * value (counter wrap or reset) give no rate.
+ */
+void
+samples_rate(samples_t *sp)
+{
+    unsigned int	i, count = 0;
+    long long		delta;
+    double		change;
+
+    for (i = 1; i < sp->count; i++) {
+	delta = sp->stamps[i] - sp->stamps[i-1];
+	change = sp->values[i] - sp->values[i-1];
+	if (delta <= 0 || change < 0)
+	    continue;
+	sp->stamps[count] = sp->stamps[i];
+	sp->values[count] = change * 1000000.0 / delta;
+	count++;
+    }
+    sp->count = count;
+}
+
+/*
+ * One value for each time bucket holding samples, stamped with the
+ * bucket start - or, with no bucket width, one value for all of the
+ * samples stamped with the newest of them.
+ */
+int
+samples_reduce(const function_t *fp, const samples_t *in, samples_t *out)
+{
+    unsigned int	i, j;
+    long long		start, stamp;
+    double		*scratch = NULL;
+    double		*values;
+    int			sts = 0;
+
+    out->count = 0;
+    if (fp->type == N_QUANTILE && in->count > 0 &&
+	(scratch = malloc(in->count * sizeof(double))) == NULL)
+	return -ENOMEM;
+
+    for (i = 0; i < in->count && sts == 0; i = j) {
+	start = bucket_start(fp, in->stamps[i]);
+	for (j = i + 1; j < in->count; j++)
+	    if (fp->width > 0 && in->stamps[j] >= start + fp->width)
+		break;
+	values = in->values + i;
+	if (scratch) {	/* quantiles sort a copy */
+	    memcpy(scratch, values, (j - i) * sizeof(double));
+	    values = scratch;
+	}
+	stamp = fp->width > 0 ? start : in->stamps[j-1];
+	sts = samples_append(out, stamp, kernel_reduce(fp, values, j - i));
+    }
+    free(scratch);
+    return sts;
+}
+
+static bucket_t *
+group_bucket(group_t *gp, long long start)
+{
+    unsigned int	low = 0, high = gp->count, middle, size;
+    bucket_t		*buckets;
+
+    while (low < high) {
+	middle = low + (high - low) / 2;
+	if (gp->buckets[middle].start < start)
+	    low = middle + 1;
+	else
+	    high = middle;
+    }
+    if (low < gp->count && gp->buckets[low].start == start)
+	return &gp->buckets[low];
+
+    if (gp->count == gp->size) {
+	size = gp->size ? gp->size * 2 : 16;
+	if ((buckets = realloc(gp->buckets, size * sizeof(bucket_t))) == NULL)
+	    return NULL;
+	gp->buckets = buckets;
+	gp->size = size;
+    }
+    memmove(&gp->buckets[low + 1], &gp->buckets[low],
+		(gp->count - low) * sizeof(bucket_t));
+    memset(&gp->buckets[low], 0, sizeof(bucket_t));
+    gp->buckets[low].start = start;
+    gp->count++;
+    return &gp->buckets[low];
+}
+
+/*
+ * Add the (already downsampled) values of one series to the buckets
+ * of a group of series.
+ */
+int
+group_add(group_t *gp, const function_t *fp, const samples_t *sp)
+{
+    bucket_t		*bp;
+    unsigned int	i, size;
+    double		*values, value;
+
+    for (i = 0; i < sp->count; i++) {
+	if ((bp = group_bucket(gp, bucket_start(fp, sp->stamps[i]))) == NULL)
+	    return -ENOMEM;
+	value = sp->values[i];
+	if (bp->count == 0 || sp->stamps[i] > bp->last)
+	    bp->last = sp->stamps[i];
+	if (bp->count == 0 || value < bp->min)
+	    bp->min = value;
+	if (bp->count == 0 || value > bp->max)
+	    bp->max = value;
+	bp->sum += value;
+	if (fp->type == N_QUANTILE) {
+	    if (bp->count == bp->size) {
+		size = bp->size ? bp->size * 2 : 16;
+		if ((values = realloc(bp->values, size * sizeof(double))) == NULL)
+		    return -ENOMEM;
+		bp->values = values;
+		bp->size = size;
+	    }
+	    bp->values[bp->count] = value;
+	}
+	bp->count++;
+    }
+    return 0;
+}
+
+int
+group_reduce(group_t *gp, const function_t *fp, samples_t *out)
+{
+    bucket_t		*bp;
+    unsigned int	i;
+    long long		stamp;
+    double		value;
+    int			sts = 0;
+
+    out->count = 0;
+    for (i = 0; i < gp->count && sts == 0; i++) {
+	bp = &gp->buckets[i];
+	switch (fp->type) {
+	case N_SUM:
+	    value = bp->sum;
+	    break;
+	case N_MIN:
+	    value = bp->min;
+	    break;
+	case N_MAX:
+	    value = bp->max;
+	    break;
+	case N_COUNT:
+	    value = bp->count;
+	    break;
+	case N_QUANTILE:
+	    value = kernel_quantile(bp->values, bp->count, fp->quantile);
+	    break;
+	case N_AVG:
+	default:
+	    value = bp->sum / bp->count;
+	    break;
+	}
+	stamp = fp->width > 0 ? bp->start : bp->last;
+	sts = samples_append(out, stamp, value);
+    }
+    return sts;
+}
+
+void
+group_free(group_t *gp)
+{
+    unsigned int	i;
+
+    for (i = 0; i < gp->count; i++)
+	free(gp->buckets[i].values);
+    free(gp->buckets);
+    memset(gp, 0, sizeof(*gp));
+}
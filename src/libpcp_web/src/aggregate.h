@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ */
+#ifndef SERIES_AGGREGATE_H
+#define SERIES_AGGREGATE_H
+
+/*
+ * Functions of time series values, evaluated over arrays of samples
+ * in time order: per-second rates, and reduction of the samples in
+ * each time bucket (avg, min, max, sum, count, quantile) - either for
+ * one series (downsampling) or across a group of series.
+ */
+typedef struct samples {
+    long long		*stamps;	/* usec, ascending */
+    double		*values;
+    unsigned int	count;
+    unsigned int	size;
+} samples_t;
+
+typedef struct function {
+    int			type;		/* N_AVG, N_MIN, ... (query.h) */
+    double		quantile;	/* N_QUANTILE, from 0 to 1 */
+    long long		width;		/* bucket width, usec, or zero */
+    long long		origin;		/* bucket alignment, usec */
+} function_t;
+
+typedef struct bucket {
+    long long		start;		/* bucket start time, usec */
+    long long		last;		/* newest sample in the bucket */
+    double		sum;
+    double		min;
+    double		max;
+    unsigned int	count;
+    unsigned int	size;
+    double		*values;	/* only kept for quantiles */
+} bucket_t;
+
+typedef struct group {
+    bucket_t		*buckets;	/* ascending start times */
+    unsigned int	count;
+    unsigned int	size;
+} group_t;
+
+extern int samples_append(samples_t *, long long, double);
+extern void samples_free(samples_t *);
+extern void samples_rate(samples_t *);
+extern int samples_reduce(const function_t *, const samples_t *, samples_t *);
+
+extern int group_add(group_t *, const function_t *, const samples_t *);
+extern int group_reduce(group_t *, const function_t *, samples_t *);
+extern void group_free(group_t *);
+
+#endif	/* SERIES_AGGREGATE_H */
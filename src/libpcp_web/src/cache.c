@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ */
+#include <limits.h>
+#include <pthread.h>
+#include "pmapi.h"
+#include "libpcp.h"
+#include "series.h"
+#include "cache.h"
+
+#define DEFAULT_CACHE_SIZE	262144	/* series identifiers, ~10MB */
+#define CACHE_HASH_INIT		2166136261U
+
+typedef struct cacheEntry {
+    struct cacheEntry	*prev;		/* least recently used list */
+    struct cacheEntry	*next;
+    unsigned int	hash;
+    unsigned int	count;		/* series identifiers */
+    char		*ids;		/* sorted, PMSIDSZ bytes each */
+    char		*value;		/* follows the name and NUL */
+    char		name[1];
+} cacheEntry;
+
+typedef struct indexCache {
+    pthread_mutex_t	lock;
+    int			setup;
+    __pmHashCtl		terms;		/* name and value -> entry */
+    cacheEntry		*newest;
+    cacheEntry		*oldest;
+    unsigned long long	generation;	/* of the store, when cached */
+    cacheStats		stats;
+} indexCache;
+
+static indexCache	cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* FNV-1a, with a NUL after each string hashed */
+static unsigned int
+cache_hash(const char *string, unsigned int hash)
+{
+    while (*string)
+	hash = (hash ^ (unsigned char)*string++) * 16777619U;
+    return hash * 16777619U;
+}
+
+/* PCP_SERIES_CACHE in environment sets series identifiers cached */
+static void
+cache_setup(void)
+{
+    char	*value, *endnum;
+    long	size;
+
+    cache.stats.limit = DEFAULT_CACHE_SIZE;
+    if ((value = getenv("PCP_SERIES_CACHE")) != NULL) {
+	size = strtol(value, &endnum, 10);
+	if (*endnum != '\0' || size < 0 || size > INT_MAX / PMSIDSZ)
+	    fprintf(stderr, "%s: ignored bad PCP_SERIES_CACHE (%s)\n",
+		    pmGetProgname(), value);
+	else
+	    cache.stats.limit = size;
+    }
+    __pmHashInit(&cache.terms);
+    cache.setup = 1;
+}
+
+static void
+cache_unlink(cacheEntry *entry)
+{
+    if (entry->prev)
+	entry->prev->next = entry->next;
+    else
+	cache.newest = entry->next;
+    if (entry->next)
+	entry->next->prev = entry->prev;
+    else
+	cache.oldest = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void
+cache_link(cacheEntry *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache.newest;
+    if (cache.newest)
+	cache.newest->prev = entry;
+    else
+	cache.oldest = entry;
+    cache.newest = entry;
+}
+
+static void
+cache_drop(cacheEntry *entry)
+{
+    cache_unlink(entry);
+    __pmHashDel(entry->hash, entry, &cache.terms);
+    cache.stats.entries--;
+    cache.stats.series -= entry->count;
+    free(entry->ids);
+    free(entry);
+}
+
+/* a load may have added series to any index, so drop all of them */
+static void
+cache_generation(unsigned long long generation)
+{
+    if (!cache.setup)
+	cache_setup();
+    if (generation == cache.generation)
+	return;
+    if (cache.oldest)
+	cache.stats.flushes++;
+    while (cache.oldest)
+	cache_drop(cache.oldest);
+    cache.generation = generation;
+}
+
+static cacheEntry *
+cache_search(unsigned int hash, const char *name, const char *value)
+{
+    __pmHashNode	*hp;
+    cacheEntry		*entry;
+
+    for (hp = __pmHashSearch(hash, &cache.terms); hp != NULL; hp = hp->next) {
+	if (hp->key != hash)
+	    continue;
+	entry = (cacheEntry *)hp->data;
+	if (strcmp(entry->name, name) == 0 && strcmp(entry->value, value) == 0)
+	    return entry;
+    }
+    return NULL;
+}
+
+/*
+ * Copy of the series matching a name and value, if cached for this
+ * generation of the store - returns 1 if found, else 0.
+ */
+int
+index_cache_lookup(unsigned long long generation, const char *name,
+		const char *value, char **ids, unsigned int *count)
+{
+    cacheEntry		*entry;
+    unsigned int	hash = cache_hash(value, cache_hash(name, CACHE_HASH_INIT));
+    int			found = 0;
+
+    pthread_mutex_lock(&cache.lock);
+    cache_generation(generation);
+    if ((entry = cache_search(hash, name, value)) == NULL) {
+	cache.stats.misses++;
+    } else if ((*ids = malloc(entry->count * PMSIDSZ + 1)) != NULL) {
+	memcpy(*ids, entry->ids, entry->count * PMSIDSZ);
+	*count = entry->count;
+	cache_unlink(entry);
+	cache_link(entry);
+	cache.stats.hits++;
+	found = 1;
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return found;
+}
+
+/* most series identifiers worth collecting for one term, or zero */
+unsigned int
+index_cache_limit(void)
+{
+    unsigned int	limit;
+
+    pthread_mutex_lock(&cache.lock);
+    if (!cache.setup)
+	cache_setup();
+    limit = cache.stats.limit / 4;
+    pthread_mutex_unlock(&cache.lock);
+    return limit;
+}
+
+/*
+ * Remember the series matching a name and value, read in full at the
+ * given generation of the store, dropping the least recently used.
+ */
+void
+index_cache_insert(unsigned long long generation, const char *name,
+		const char *value, const char *ids, unsigned int count)
+{
+    cacheEntry		*entry;
+    size_t		namelen = strlen(name), length;
+    unsigned int	hash = cache_hash(value, cache_hash(name, CACHE_HASH_INIT));
+
+    pthread_mutex_lock(&cache.lock);
+    cache_generation(generation);
+    if (cache.stats.limit == 0 || count > cache.stats.limit / 4 ||
+	cache_search(hash, name, value) != NULL)
+	goto unlock;
+
+    while (cache.oldest && cache.stats.series + count > cache.stats.limit) {
+	cache_drop(cache.oldest);
+	cache.stats.evictions++;
+    }
+
+    length = sizeof(cacheEntry) + namelen + 1 + strlen(value);
+    if ((entry = (cacheEntry *)calloc(1, length)) == NULL)
+	goto unlock;
+    if ((entry->ids = malloc(count * PMSIDSZ + 1)) == NULL) {
+	free(entry);
+	goto unlock;
+    }
+    memcpy(entry->ids, ids, count * PMSIDSZ);
+    entry->count = count;
+    entry->hash = hash;
+    strcpy(entry->name, name);
+    entry->value = entry->name + namelen + 1;
+    strcpy(entry->value, value);
+    if (__pmHashAdd(hash, entry, &cache.terms) < 0) {
+	free(entry->ids);
+	free(entry);
+	goto unlock;
+    }
+    cache_link(entry);
+    cache.stats.entries++;
+    cache.stats.series += count;
+    cache.stats.inserts++;
+
+unlock:
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void
+index_cache_stats(cacheStats *stats)
+{
+    pthread_mutex_lock(&cache.lock);
+    *stats = cache.stats;
+    pthread_mutex_unlock(&cache.lock);
+}
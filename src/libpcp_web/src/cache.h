@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ */
+#ifndef SERIES_CACHE_H
+#define SERIES_CACHE_H
+
+/*
+ * In-process cache of the inverted indices used by queries - for each
+ * search term (a metric, instance or label name and a value) the full
+ * sorted set of series identifiers matching it.  The least recently
+ * used terms are dropped first, and every term is dropped when the
+ * store generation changes (a load may have added series).
+ */
+typedef struct cacheStats {
+    unsigned long long	hits;
+    unsigned long long	misses;
+    unsigned long long	inserts;
+    unsigned long long	evictions;	/* dropped for space */
+    unsigned long long	flushes;	/* emptied for a new generation */
+    unsigned int	entries;
+    unsigned int	series;		/* identifiers cached */
+    unsigned int	limit;		/* ... maximum, zero if disabled */
+} cacheStats;
+
+extern int index_cache_lookup(unsigned long long, const char *, const char *,
+		char **, unsigned int *);
+extern unsigned int index_cache_limit(void);
+extern void index_cache_insert(unsigned long long, const char *, const char *,
+		const char *, unsigned int);
+extern void index_cache_stats(cacheStats *);
+
+#endif	/* SERIES_CACHE_H */
@@ -0,0 +1,450 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+#include "chunk.h"
+
+/*
+ * Block layout: a CHUNK_HEADER byte header (version, value type, two
+ * bytes of padding, then big-endian sample count and encoded length),
+ * followed by the bit stream, most significant bit first.
+ *
+ * The first sample is the full 64 bit timestamp (usec) and value.  For
+ * each sample after that, the change in timestamp delta is encoded as
+ *	'0'				unchanged
+ *	'10'	+ 7 bits		[-64, 63]
+ *	'110'	+ 9 bits		[-256, 255]
+ *	'1110'	+ 12 bits		[-2048, 2047]
+ *	'11110'	+ 32 bits		[-2^31, 2^31-1]
+ *	'11111'	+ 64 bits		anything else
+ * and the value XOR the previous value as
+ *	'0'				unchanged
+ *	'10'	+ meaningful bits	within the previous XOR window
+ *	'11'	+ 6 bits leading zeros, 6 bits (meaningful bits - 1),
+ *		  then the meaningful bits
+ */
+
+static const struct {
+    unsigned int	prefix;
+    unsigned int	prefixbits;
+    unsigned int	bits;
+} buckets[] = {
+    { 0x2,  2, 7 },
+    { 0x6,  3, 9 },
+    { 0xe,  4, 12 },
+    { 0x1e, 5, 32 },
+    { 0x1f, 5, 64 },
+};
+
+/* values of every type are XOR'd as 64 bit patterns */
+static unsigned long long
+atom_bits(int type, pmAtomValue *atom)
+{
+    union { double d; unsigned long long ull; } u;
+
+    switch (type) {
+    case PM_TYPE_32:
+	return (unsigned long long)(long long)atom->l;
+    case PM_TYPE_U32:
+	return atom->ul;
+    case PM_TYPE_64:
+	return (unsigned long long)atom->ll;
+    case PM_TYPE_U64:
+	return atom->ull;
+    case PM_TYPE_FLOAT:
+	u.d = atom->f;
+	return u.ull;
+    case PM_TYPE_DOUBLE:
+	u.d = atom->d;
+	return u.ull;
+    default:
+	break;
+    }
+    return 0;
+}
+
+static void
+bits_atom(int type, unsigned long long bits, pmAtomValue *atom)
+{
+    union { double d; unsigned long long ull; } u;
+
+    memset(atom, 0, sizeof(*atom));
+    switch (type) {
+    case PM_TYPE_32:
+	atom->l = (__int32_t)bits;
+	break;
+    case PM_TYPE_U32:
+	atom->ul = (__uint32_t)bits;
+	break;
+    case PM_TYPE_64:
+	atom->ll = (__int64_t)bits;
+	break;
+    case PM_TYPE_U64:
+	atom->ull = bits;
+	break;
+    case PM_TYPE_FLOAT:
+	u.ull = bits;
+	atom->f = (float)u.d;
+	break;
+    case PM_TYPE_DOUBLE:
+	u.ull = bits;
+	atom->d = u.d;
+	break;
+    default:
+	break;
+    }
+}
+
+static unsigned int
+leading_zeros(unsigned long long bits)
+{
+#if defined(__GNUC__)
+    return bits ? __builtin_clzll(bits) : 64;
+#else
+    unsigned int	n = 0;
+
+    if (bits == 0)
+	return 64;
+    while (!(bits & (1ULL << 63))) {
+	bits <<= 1;
+	n++;
+    }
+    return n;
+#endif
+}
+
+static unsigned int
+trailing_zeros(unsigned long long bits)
+{
+#if defined(__GNUC__)
+    return bits ? __builtin_ctzll(bits) : 64;
+#else
+    unsigned int	n = 0;
+
+    if (bits == 0)
+	return 64;
+    while (!(bits & 1)) {
+	bits >>= 1;
+	n++;
+    }
+    return n;
+#endif
+}
+
+static int
+put_bits(chunk_t *cp, unsigned long long value, unsigned int nbits)
+{
+    unsigned char	*buffer, *p;
+    unsigned int	used, room, n;
+    size_t		need = CHUNK_HEADER + (cp->bits + nbits + 7) / 8;
+    size_t		size;
+
+    if (need > cp->size) {
+	size = cp->size * 2;
+	while (size < need)
+	    size *= 2;
+	if ((buffer = (unsigned char *)realloc(cp->buffer, size)) == NULL)
+	    return -ENOMEM;
+	memset(buffer + cp->size, 0, size - cp->size);
+	cp->buffer = buffer;
+	cp->size = size;
+    }
+
+    while (nbits > 0) {
+	p = cp->buffer + CHUNK_HEADER + cp->bits / 8;
+	used = cp->bits % 8;
+	room = 8 - used;
+	n = nbits < room ? nbits : room;
+	*p |= ((value >> (nbits - n)) & ((1U << n) - 1)) << (room - n);
+	cp->bits += n;
+	nbits -= n;
+    }
+    return 0;
+}
+
+chunk_t *
+chunk_init(int type, long long start)
+{
+    chunk_t		*cp;
+
+    if ((cp = (chunk_t *)calloc(1, sizeof(chunk_t))) == NULL)
+	return NULL;
+    cp->size = 256;
+    if ((cp->buffer = (unsigned char *)calloc(1, cp->size)) == NULL) {
+	free(cp);
+	return NULL;
+    }
+    cp->type = type;
+    cp->start = start;
+    cp->leading = ~0U;
+    return cp;
+}
+
+void
+chunk_free(chunk_t *cp)
+{
+    if (cp) {
+	free(cp->buffer);
+	free(cp);
+    }
+}
+
+static int
+append_stamp(chunk_t *cp, long long stamp)
+{
+    long long		delta = stamp - cp->stamp;
+    long long		dod = delta - cp->delta;
+    long long		limit;
+    int			i, sts;
+
+    cp->stamp = stamp;
+    cp->delta = delta;
+    if (dod == 0)
+	return put_bits(cp, 0, 1);
+    for (i = 0; i < sizeof(buckets) / sizeof(buckets[0]) - 1; i++) {
+	limit = 1LL << (buckets[i].bits - 1);
+	if (dod >= -limit && dod < limit)
+	    break;
+    }
+    if ((sts = put_bits(cp, buckets[i].prefix, buckets[i].prefixbits)) < 0)
+	return sts;
+    return put_bits(cp, (unsigned long long)dod, buckets[i].bits);
+}
+
+static int
+append_value(chunk_t *cp, unsigned long long bits)
+{
+    unsigned long long	xor = bits ^ cp->value;
+    unsigned int	leading, trailing, meaningful;
+    int			sts;
+
+    cp->value = bits;
+    if (xor == 0)
+	return put_bits(cp, 0, 1);
+
+    leading = leading_zeros(xor);
+    trailing = trailing_zeros(xor);
+    if (cp->leading != ~0U &&
+	leading >= cp->leading && trailing >= cp->trailing) {
+	meaningful = 64 - cp->leading - cp->trailing;
+	if ((sts = put_bits(cp, 0x2, 2)) < 0)
+	    return sts;
+	return put_bits(cp, xor >> cp->trailing, meaningful);
+    }
+
+    meaningful = 64 - leading - trailing;
+    cp->leading = leading;
+    cp->trailing = trailing;
+    if ((sts = put_bits(cp, 0x3, 2)) < 0 ||
+	(sts = put_bits(cp, leading, 6)) < 0 ||
+	(sts = put_bits(cp, meaningful - 1, 6)) < 0)
+	return sts;
+    return put_bits(cp, xor >> trailing, meaningful);
+}
+
+int
+chunk_append(chunk_t *cp, long long stamp, pmAtomValue *atom)
+{
+    unsigned long long	bits = atom_bits(cp->type, atom);
+    int			sts;
+
+    if (cp->count == 0) {
+	cp->stamp = stamp;
+	cp->value = bits;
+	if ((sts = put_bits(cp, (unsigned long long)stamp, 64)) < 0 ||
+	    (sts = put_bits(cp, bits, 64)) < 0)
+	    return sts;
+    }
+    else if ((sts = append_stamp(cp, stamp)) < 0 ||
+	     (sts = append_value(cp, bits)) < 0)
+	return sts;
+    cp->count++;
+    return 0;
+}
+
+static void
+put_int(unsigned char *p, unsigned int value)
+{
+    p[0] = (value >> 24) & 0xff;
+    p[1] = (value >> 16) & 0xff;
+    p[2] = (value >> 8) & 0xff;
+    p[3] = value & 0xff;
+}
+
+static unsigned int
+get_int(const unsigned char *p)
+{
+    return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/*
+ * Fill in the header, returns the length of the block at cp->buffer.
+ */
+size_t
+chunk_finish(chunk_t *cp)
+{
+    size_t		length = (cp->bits + 7) / 8;
+
+    cp->buffer[0] = CHUNK_VERSION;
+    cp->buffer[1] = (unsigned char)cp->type;
+    cp->buffer[2] = cp->buffer[3] = 0;
+    put_int(cp->buffer + 4, cp->count);
+    put_int(cp->buffer + 8, (unsigned int)length);
+    return CHUNK_HEADER + length;
+}
+
+typedef struct {
+    const unsigned char	*data;
+    size_t		bits;		/* total bits in the stream */
+    size_t		offset;		/* next bit to be read */
+} reader_t;
+
+static int
+get_bits(reader_t *rp, unsigned int nbits, unsigned long long *value)
+{
+    unsigned long long	result = 0;
+    unsigned int	used, room, n;
+    unsigned char	byte;
+
+    if (rp->offset + nbits > rp->bits)
+	return -EPROTO;
+    while (nbits > 0) {
+	byte = rp->data[rp->offset / 8];
+	used = rp->offset % 8;
+	room = 8 - used;
+	n = nbits < room ? nbits : room;
+	result = (result << n) | ((byte >> (room - n)) & ((1U << n) - 1));
+	rp->offset += n;
+	nbits -= n;
+    }
+    *value = result;
+    return 0;
+}
+
+static int
+get_stamp(reader_t *rp, long long *stamp, long long *delta)
+{
+    unsigned long long	bit, bits;
+    long long		dod;
+    unsigned int	ones = 0;
+    int			sts;
+
+    /* count leading ones of the prefix, up to the '11111' bucket */
+    while (ones < 5) {
+	if ((sts = get_bits(rp, 1, &bit)) < 0)
+	    return sts;
+	if (!bit)
+	    break;
+	ones++;
+    }
+    if (ones == 0) {
+	*stamp += *delta;
+	return 0;
+    }
+    ones--;
+    if ((sts = get_bits(rp, buckets[ones].bits, &bits)) < 0)
+	return sts;
+    if (buckets[ones].bits < 64 && (bits & (1ULL << (buckets[ones].bits - 1))))
+	bits |= ~0ULL << buckets[ones].bits;	/* sign extend */
+    dod = (long long)bits;
+    *delta += dod;
+    *stamp += *delta;
+    return 0;
+}
+
+static int
+get_value(reader_t *rp, unsigned long long *value,
+		unsigned int *leading, unsigned int *trailing)
+{
+    unsigned long long	bit, bits;
+    unsigned int	meaningful;
+    int			sts;
+
+    if ((sts = get_bits(rp, 1, &bit)) < 0)
+	return sts;
+    if (!bit)
+	return 0;
+    if ((sts = get_bits(rp, 1, &bit)) < 0)
+	return sts;
+    if (bit) {
+	if ((sts = get_bits(rp, 6, &bits)) < 0)
+	    return sts;
+	*leading = (unsigned int)bits;
+	if ((sts = get_bits(rp, 6, &bits)) < 0)
+	    return sts;
+	meaningful = (unsigned int)bits + 1;
+	if (*leading + meaningful > 64)
+	    return -EPROTO;
+	*trailing = 64 - *leading - meaningful;
+    }
+    else if (*leading == ~0U)
+	return -EPROTO;		/* no previous window */
+    meaningful = 64 - *leading - *trailing;
+    if ((sts = get_bits(rp, meaningful, &bits)) < 0)
+	return sts;
+    *value ^= bits << *trailing;
+    return 0;
+}
+
+/*
+ * Decode every block of a chunk, calling back for each sample with
+ * its timestamp (usec), type and value.  Returns the number of samples
+ * decoded, or a negative error code if the chunk is corrupt or the
+ * callback fails.
+ */
+int
+chunk_decode(const char *data, size_t length, chunk_callback callback,
+		void *arg)
+{
+    const unsigned char	*block = (const unsigned char *)data;
+    unsigned long long	value, bits;
+    unsigned int	i, count, leading = ~0U, trailing = ~0U;
+    long long		stamp = 0, delta = 0;
+    pmAtomValue		atom;
+    reader_t		reader;
+    size_t		size;
+    int			type, sts, total = 0;
+
+    while (length > 0) {
+	if (length < CHUNK_HEADER || block[0] != CHUNK_VERSION)
+	    return -EPROTO;
+	type = (signed char)block[1];
+	count = get_int(block + 4);
+	size = get_int(block + 8);
+	if (size > length - CHUNK_HEADER)
+	    return -EPROTO;
+
+	reader.data = block + CHUNK_HEADER;
+	reader.bits = size * 8;
+	reader.offset = 0;
+	for (i = 0; i < count; i++) {
+	    if (i == 0) {
+		if ((sts = get_bits(&reader, 64, &bits)) < 0 ||
+		    (sts = get_bits(&reader, 64, &value)) < 0)
+		    return sts;
+		stamp = (long long)bits;
+		delta = 0;
+		leading = trailing = ~0U;
+	    }
+	    else if ((sts = get_stamp(&reader, &stamp, &delta)) < 0 ||
+		     (sts = get_value(&reader, &value, &leading, &trailing)) < 0)
+		return sts;
+	    bits_atom(type, value, &atom);
+	    if ((sts = callback(stamp, type, &atom, arg)) < 0)
+		return sts;
+	    total++;
+	}
+	block += CHUNK_HEADER + size;
+	length -= CHUNK_HEADER + size;
+    }
+    return total;
+}
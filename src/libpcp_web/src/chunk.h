@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+#ifndef SERIES_CHUNK_H
+#define SERIES_CHUNK_H
+
+#include "pmapi.h"
+
+/*
+ * Time series values are stored in fixed-duration chunks, one Redis
+ * string per series per chunk.  A chunk is made up of one or more
+ * blocks (one per load that added values to it, appended), each a
+ * header and a bit stream of delta-of-delta encoded timestamps and
+ * XOR encoded values (after Facebook's Gorilla TSDB).
+ */
+#define CHUNK_DURATION	7200	/* seconds of samples in each chunk */
+#define CHUNK_MAXBYTES	4096	/* block size before it is sent early */
+#define CHUNK_VERSION	1
+#define CHUNK_HEADER	12	/* version, type, pad, count, length */
+
+typedef struct chunk {
+    int			type;		/* PM_TYPE_* of the values */
+    unsigned int	count;		/* samples encoded */
+    long long		start;		/* chunk start time, seconds */
+    long long		stamp;		/* previous timestamp, usec */
+    long long		delta;		/* previous timestamp delta */
+    unsigned long long	value;		/* previous value, as bits */
+    unsigned int	leading;	/* previous XOR window, or ~0 */
+    unsigned int	trailing;
+    size_t		bits;		/* encoded bits after the header */
+    size_t		size;		/* bytes allocated in buffer */
+    unsigned char	*buffer;	/* header and encoded samples */
+} chunk_t;
+
+typedef int (*chunk_callback)(long long, int, pmAtomValue *, void *);
+
+static inline long long
+chunk_start(long long seconds)
+{
+    return seconds - (seconds % CHUNK_DURATION);
+}
+
+extern chunk_t *chunk_init(int, long long);
+extern int chunk_append(chunk_t *, long long, pmAtomValue *);
+extern size_t chunk_finish(chunk_t *);
+extern void chunk_free(chunk_t *);
+
+extern int chunk_decode(const char *, size_t, chunk_callback, void *);
+
+#endif	/* SERIES_CHUNK_H */
@@ -13,14 +13,18 @@
  */
 
 #include <math.h>
+#include <glob.h>
 #include <stdarg.h>
 #include <limits.h>
 #include <assert.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "series.h"
 #include "query.h"
 #include "redis.h"
+#include "chunk.h"
 #include "load.h"
 #include "util.h"
 #include "sha1.h"
@@ -28,7 +32,7 @@
 #include "libpcp.h"
 
 typedef struct {
-    redisContext	*redis;
+    redisBatch		*batch;
 
     settings_t		*settings;
     void		*arg;
@@ -48,18 +52,50 @@ typedef struct {
 #define ERRSIZE		PM_MAXERRMSGLEN
 #define MSGSIZE		(ERRSIZE + 128)
 #define loadmsg(SP, level, message)		\
-	((SP)->settings->on_info((level), (message), (SP)->arg))
+	load_message((SP)->settings, (level), (message), (SP)->arg)
+
+/* diagnostics from several loading threads, one at a time */
+static pthread_mutex_t	loadmsg_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+load_message(settings_t *settings, pmseries_level level,
+		const char *message, void *arg)
+{
+    pthread_mutex_lock(&loadmsg_lock);
+    settings->on_info(level, message, arg);
+    pthread_mutex_unlock(&loadmsg_lock);
+}
 
 static void
 series_cache_addvalue(SOURCE *sp, metric_t *metric, value_t *value)
 {
-    redis_series_addvalue(sp->redis, metric, value);
+    redis_series_addvalue(sp->batch, metric, value);
+}
+
+/* send the values of every series not yet in a chunk */
+static void
+series_cache_chunks(SOURCE *sp)
+{
+    __pmHashNode	*node;
+    metric_t		*metric;
+    int			i;
+
+    for (node = __pmHashWalk(&sp->pmidhash, PM_HASH_WALK_START);
+	 node != NULL;
+	 node = __pmHashWalk(&sp->pmidhash, PM_HASH_WALK_NEXT)) {
+	metric = (metric_t *)node->data;
+	for (i = 0; i < metric->listsize; i++)
+	    redis_series_chunk(sp->batch, metric->vlist[i]);
+    }
 }
 
 static void
 series_cache_metadata(SOURCE *sp, metric_t *metric, value_t *value)
 {
-    redis_series_metadata(sp->redis, metric, value);
+    /* an identical series may have been loaded from another archive */
+    if (redis_cache_series(sp->batch->cache, value->hash))
+	return;
+    redis_series_metadata(sp->batch, metric, value);
 }
 
 static void
@@ -630,10 +666,14 @@ free_metric(metric_t *metric)
     for (i = 0; i < metric->listsize; i++) {
 	value = metric->vlist[i];
 	if (value->name) free(value->name);
+	if (value->labels) pmFreeLabelSets(value->labels, 1);
+	if (value->chunk) chunk_free(value->chunk);
 	if (value) free(value);
     }
     if (metric->vlist) free(metric->vlist);
     if (metric->names) free(metric->names);
+    if (metric->mapids) free(metric->mapids);
+    if (metric->labels) pmFreeLabelSets(metric->labels, 1);
     free(metric);
 }
 
@@ -869,6 +909,7 @@ series_cache_load(SOURCE *sp, timing_t *tp, pmseries_flags flags)
 	    (finish->tv_sec == result->timestamp.tv_sec &&
 	     finish->tv_usec >= result->timestamp.tv_usec)) {
 	    series_cache_update(sp, result, flags);
+	    redis_batch_check(sp->batch);
 	    pmFreeResult(result);
 	    count++;
 	}
@@ -879,6 +920,9 @@ series_cache_load(SOURCE *sp, timing_t *tp, pmseries_flags flags)
 	}
     }
 
+    series_cache_chunks(sp);
+    redis_batch_flush(sp->batch);
+
     pmsprintf(msg, sizeof(msg), "processed %d archive records from %s",
 		count, sp->context.source);
     loadmsg(sp, PMSERIES_INFO, msg);
@@ -1057,32 +1101,430 @@ load_destroy_source(SOURCE *sp)
     cp->context = -1;
 }
 
+static __pmHashWalkState
+free_domain(const __pmHashNode *tp, void *cp)
+{
+    domain_t	*domain = (domain_t *)tp->data;
+
+    if (domain->labels) pmFreeLabelSets(domain->labels, 1);
+    free(domain);
+    return PM_HASH_WALK_DELETE_NEXT;
+}
+
+static __pmHashWalkState
+free_cluster(const __pmHashNode *tp, void *cp)
+{
+    cluster_t	*cluster = (cluster_t *)tp->data;
+
+    if (cluster->labels) pmFreeLabelSets(cluster->labels, 1);
+    free(cluster);
+    return PM_HASH_WALK_DELETE_NEXT;
+}
+
+static __pmHashWalkState
+free_indom(const __pmHashNode *tp, void *cp)
+{
+    indom_t	*indom = (indom_t *)tp->data;
+
+    if (indom->labels) pmFreeLabelSets(indom->labels, 1);
+    free(indom);
+    return PM_HASH_WALK_DELETE_NEXT;
+}
+
+static __pmHashWalkState
+free_pmid(const __pmHashNode *tp, void *cp)
+{
+    free_metric((metric_t *)tp->data);
+    return PM_HASH_WALK_DELETE_NEXT;
+}
+
+static __pmHashWalkState
+free_name(const __pmHashNode *tp, void *cp)
+{
+    if (tp->data) free(tp->data);
+    return PM_HASH_WALK_DELETE_NEXT;
+}
+
+/*
+ * Release everything cached for one archive, so a worker can go
+ * on to load the next one.
+ */
+static void
+load_free_source(SOURCE *sp)
+{
+    __pmHashWalkCB(free_pmid, NULL, &sp->pmidhash);
+    __pmHashClear(&sp->pmidhash);
+    __pmHashWalkCB(free_indom, NULL, &sp->indomhash);
+    __pmHashClear(&sp->indomhash);
+    __pmHashWalkCB(free_cluster, NULL, &sp->clusterhash);
+    __pmHashClear(&sp->clusterhash);
+    __pmHashWalkCB(free_domain, NULL, &sp->domainhash);
+    __pmHashClear(&sp->domainhash);
+    __pmHashWalkCB(free_name, NULL, &sp->errorhash);
+    __pmHashClear(&sp->errorhash);
+    __pmHashWalkCB(free_name, NULL, &sp->wanthash);
+    __pmHashClear(&sp->wanthash);
+    if (sp->context.labels) {
+	pmFreeLabelSets(sp->context.labels, 1);
+	sp->context.labels = NULL;
+    }
+}
+
+/*
+ * Load one source, the context type, name and any metric names
+ * have already been set up.
+ */
+static int
+load_source(SOURCE *sp, timing_t *timing, pmseries_flags flags)
+{
+    int		sts;
+
+    if ((sts = load_resolve_source(sp)) < 0)
+	return sts;
+
+    /* metric and time-based filtering */
+    if ((sts = load_prepare_metrics(sp)) < 0 ||
+	(sts = load_prepare_timing(sp, timing)) < 0) {
+	load_destroy_source(sp);
+	return sts;
+    }
+
+    sts = series_cache_load(sp, timing, flags);
+    load_destroy_source(sp);
+    return sts;
+}
+
+/*
+ * Archives can be named by a directory (searched recursively), a
+ * glob(3) pattern, or directly.  Each is loaded separately, found
+ * via the (one and only) metadata file of each archive.
+ */
+typedef struct archives {
+    char	**names;
+    int		count;
+    int		size;
+} archives_t;
+
+static int
+add_archive(archives_t *ap, const char *path)
+{
+    char	**names;
+    char	*name;
+    int		size;
+
+    if ((name = strdup(path)) == NULL)
+	return -ENOMEM;
+    if (ap->count == ap->size) {
+	size = ap->size ? ap->size * 2 : 16;
+	if ((names = realloc(ap->names, size * sizeof(char *))) == NULL) {
+	    free(name);
+	    return -ENOMEM;
+	}
+	ap->names = names;
+	ap->size = size;
+    }
+    ap->names[ap->count++] = name;
+    return 0;
+}
+
+/* add the archive if path is its metadata file, else ignore it */
+static int
+add_archive_meta(archives_t *ap, const char *path)
+{
+    char	name[MAXPATHLEN];
+    size_t	length;
+
+    pmsprintf(name, sizeof(name), "%s", path);
+    if (__pmLogBaseName(name) == NULL)
+	return 0;
+    length = strlen(name);
+    if (strncmp(path + length, ".meta", 5) != 0 ||
+	(path[length + 5] != '\0' && path[length + 5] != '.'))
+	return 0;
+    return add_archive(ap, name);
+}
+
+static int
+add_archive_dir(archives_t *ap, const char *dir)
+{
+    struct dirent	*dp;
+    struct stat		sbuf;
+    char		path[MAXPATHLEN];
+    DIR			*dirp;
+    int			sts = 0;
+
+    if ((dirp = opendir(dir)) == NULL)
+	return -oserror();
+    while (sts == 0 && (dp = readdir(dirp)) != NULL) {
+	if (dp->d_name[0] == '.')
+	    continue;
+	pmsprintf(path, sizeof(path), "%s%c%s", dir, pmPathSeparator(), dp->d_name);
+	if (stat(path, &sbuf) < 0)
+	    continue;
+	if (S_ISDIR(sbuf.st_mode))
+	    sts = add_archive_dir(ap, path);
+	else if (S_ISREG(sbuf.st_mode))
+	    sts = add_archive_meta(ap, path);
+    }
+    closedir(dirp);
+    return sts;
+}
+
+static int
+archive_compare(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int
+load_expand_archives(const char *source, archives_t *ap)
+{
+    struct stat		sbuf;
+    glob_t		paths;
+    size_t		i;
+    int			sts = 0;
+
+    if (strpbrk(source, "*?[") != NULL) {
+	memset(&paths, 0, sizeof(paths));
+	if (glob(source, 0, NULL, &paths) != 0) {
+	    globfree(&paths);
+	    return -ENOENT;
+	}
+	for (i = 0; sts == 0 && i < paths.gl_pathc; i++) {
+	    if (stat(paths.gl_pathv[i], &sbuf) < 0)
+		continue;
+	    if (S_ISDIR(sbuf.st_mode))
+		sts = add_archive_dir(ap, paths.gl_pathv[i]);
+	    else
+		sts = add_archive_meta(ap, paths.gl_pathv[i]);
+	}
+	globfree(&paths);
+    }
+    else if (stat(source, &sbuf) == 0 && S_ISDIR(sbuf.st_mode))
+	sts = add_archive_dir(ap, source);
+    else
+	sts = add_archive(ap, source);	/* as is, for pmNewContext */
+
+    if (sts == 0 && ap->count > 1)
+	qsort(ap->names, ap->count, sizeof(char *), archive_compare);
+    return sts;
+}
+
+/*
+ * Pool of threads loading archives, each with its own PCP context
+ * and Redis connections, taking the next archive when done with the
+ * last one so the work stays balanced however sizes vary.
+ */
+typedef struct loadpool {
+    pthread_mutex_t	lock;
+    SOURCE		*source;	/* settings and metric names */
+    timing_t		*timing;
+    pmseries_flags	flags;
+    archives_t		*archives;
+    int			next;		/* next archive to be loaded */
+    int			errors;
+} loadpool_t;
+
+typedef struct loader {
+    pthread_t		thread;
+    loadpool_t		*pool;
+    redisBatch		*batch;
+    int			id;
+    int			count;		/* archives loaded */
+} loader_t;
+
+static void *
+load_worker(void *arg)
+{
+    loader_t		*lp = (loader_t *)arg;
+    loadpool_t		*pool = lp->pool;
+    SOURCE		source;
+    int			next;
+
+    for (;;) {
+	pthread_mutex_lock(&pool->lock);
+	next = pool->next++;
+	pthread_mutex_unlock(&pool->lock);
+	if (next >= pool->archives->count)
+	    break;
+
+	memset(&source, 0, sizeof(source));
+	source.batch = lp->batch;
+	source.settings = pool->source->settings;
+	source.arg = pool->source->arg;
+	source.verbose = pool->source->verbose;
+	source.context.type = PM_CONTEXT_ARCHIVE;
+	source.context.source = pool->archives->names[next];
+	source.context.metrics = pool->source->context.metrics;
+	source.context.nmetrics = pool->source->context.nmetrics;
+
+	if (load_source(&source, pool->timing, pool->flags) != 0) {
+	    pthread_mutex_lock(&pool->lock);
+	    pool->errors++;
+	    pthread_mutex_unlock(&pool->lock);
+	}
+	load_free_source(&source);
+	lp->count++;
+    }
+    return NULL;
+}
+
+static int
+load_workers(void)
+{
+    char	*value, *endnum;
+    long	count = 1;
+
+#ifdef HAVE___THREAD
+    /* PCP_SERIES_WORKERS in environment sets the loading threads */
+    if ((value = getenv("PCP_SERIES_WORKERS")) != NULL) {
+	count = strtol(value, &endnum, 10);
+	if (*endnum != '\0' || count < 1 || count > 1024) {
+	    fprintf(stderr, "%s: ignored bad PCP_SERIES_WORKERS (%s)\n",
+		    pmGetProgname(), value);
+	    count = 0;
+	}
+    }
+    else
+	count = 0;
+    if (count == 0 && (count = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+	count = 1;
+#endif
+    return (int)count;
+}
+
+static int
+load_parallel(SOURCE *sp, archives_t *archives, timing_t *timing,
+		pmseries_flags flags)
+{
+    loadpool_t		pool = { .source = sp, .timing = timing,
+				 .flags = flags, .archives = archives };
+    loader_t		*loaders;
+    redisBatch		*bp;
+    struct timeval	start, end;
+    unsigned long long	values = 0, commands = 0, flushes = 0;
+    double		elapsed;
+    char		msg[MSGSIZE];
+    char		worker[MSGSIZE];
+    int			i, nloaders, started, sts;
+
+    if ((nloaders = load_workers()) > archives->count)
+	nloaders = archives->count;
+    if ((loaders = calloc(nloaders, sizeof(loader_t))) == NULL) {
+	pmsprintf(msg, sizeof(msg), "out of memory (%s, %lld bytes)",
+		"loaders", (long long)nloaders * sizeof(loader_t));
+	loadmsg(sp, PMSERIES_ERROR, msg);
+	return -ENOMEM;
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    gettimeofday(&start, NULL);
+
+    for (i = 0; i < nloaders; i++) {
+	loaders[i].id = i;
+	loaders[i].pool = &pool;
+	loaders[i].batch = (i == 0) ? sp->batch : redis_batch_init(sp->batch->cache);
+	if ((sts = pthread_create(&loaders[i].thread, NULL, load_worker, &loaders[i])) != 0) {
+	    pmsprintf(msg, sizeof(msg), "failed to start loader %d: %s",
+		    i, pmErrStr(-sts));
+	    loadmsg(sp, PMSERIES_WARNING, msg);
+	    if (i > 0)
+		redis_batch_stop(loaders[i].batch);
+	    break;
+	}
+    }
+    if ((started = i) == 0) {
+	load_worker(&loaders[0]);	/* no threads at all, load here */
+	nloaders = 1;
+    } else {
+	nloaders = started;
+    }
+
+    for (i = 0; i < nloaders; i++) {
+	if (started)
+	    pthread_join(loaders[i].thread, NULL);
+	bp = loaders[i].batch;
+	redis_batch_flush(bp);
+	redis_batch_stats(bp, msg, sizeof(msg));
+	pmsprintf(worker, sizeof(worker), "loader %d: %d archives, %s",
+		loaders[i].id, loaders[i].count, msg);
+	loadmsg(sp, PMSERIES_INFO, worker);
+	values += bp->values;
+	commands += bp->commands;
+	flushes += bp->flushes;
+	if (i > 0)
+	    redis_batch_stop(bp);
+    }
+
+    gettimeofday(&end, NULL);
+    elapsed = pmtimevalSub(&end, &start);
+    pmsprintf(msg, sizeof(msg), "loaded %llu values from %d archives "
+		"in %.3f sec (%.0f values/sec) with %d loaders, "
+		"%llu commands in %llu round trips",
+		values, archives->count, elapsed,
+		elapsed > 0 ? values / elapsed : 0.0, nloaders,
+		commands, flushes);
+    loadmsg(sp, PMSERIES_INFO, msg);
+    if (pool.errors) {
+	pmsprintf(msg, sizeof(msg), "failed to load %d of %d archives",
+		pool.errors, archives->count);
+	loadmsg(sp, PMSERIES_WARNING, msg);
+    }
+
+    pthread_mutex_destroy(&pool.lock);
+    free(loaders);
+    return (pool.errors == archives->count) ? -ESRCH : 0;
+}
+
 int
 series_source(pmSeriesSettings *settings,
 	node_t *root, timing_t *timing, pmseries_flags flags, void *arg)
 {
     SOURCE	source = { .settings = settings, .arg = arg };
+    archives_t	archives = { 0 };
+    struct redisCache	*cache;
     char	msg[MSGSIZE];
-    int		sts;
-
-    source.redis = redis_init();
+    int		i, sts;
 
     load_prepare_source(&source, root, 0);
-    if (source.context.type) {
+    if (!source.context.type) {
 	pmsprintf(msg, sizeof(msg), "found no context to load");
 	loadmsg(&source, PMSERIES_ERROR, msg);
 	return -ESRCH;
     }
-    if ((sts = load_resolve_source(&source)) < 0)
-	return sts;
 
-    /* metric and time-based filtering */
-    if ((sts = load_prepare_metrics(&source)) < 0 ||
-	(sts = load_prepare_timing(&source, timing)) < 0) {
-	load_destroy_source(&source);
-	return sts;
+    if (source.context.type == PM_CONTEXT_ARCHIVE &&
+	source.context.source != NULL &&
+	(sts = load_expand_archives(source.context.source, &archives)) < 0) {
+	pmsprintf(msg, sizeof(msg), "no archives found for \"%s\": %s",
+		source.context.source, pmErrStr(sts));
+	loadmsg(&source, PMSERIES_ERROR, msg);
+	sts = -ESRCH;
     }
+    else {
+	cache = redis_cache_init();
+	source.batch = redis_batch_init(cache);
+
+	if (archives.count > 1) {
+	    sts = load_parallel(&source, &archives, timing, flags);
+	} else {
+	    if (archives.count == 1)
+		source.context.source = archives.names[0];
+	    if ((sts = load_source(&source, timing, flags)) >= 0) {
+		redis_batch_flush(source.batch);
+		redis_batch_stats(source.batch, msg, sizeof(msg));
+		loadmsg(&source, PMSERIES_INFO, msg);
+		sts = 0;
+	    }
+	    load_free_source(&source);
+	}
 
-    series_cache_load(&source, timing, flags);
-    return 0;
+	redis_batch_stop(source.batch);
+	redis_cache_free(cache);
+    }
+
+    for (i = 0; i < archives.count; i++)
+	free(archives.names[i]);
+    free(archives.names);
+    free(source.context.metrics);
+    return sts;
 }
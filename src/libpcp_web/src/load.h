@@ -71,6 +71,7 @@ typedef struct value {
     struct timeval	firsttime;	/* time of first sample */
     struct timeval	lasttime;	/* time of previous sample */
     pmAtomValue		lastval;	/* value from previous sample */
+    struct chunk	*chunk;		/* samples not yet sent */
 } value_t;
 
 #endif	/* SERIES_LOAD_H */
@@ -13,14 +13,23 @@
  */
 
 #include <ctype.h>
+#include <limits.h>
 #include "util.h"
 #include "redis.h"
+#include "chunk.h"
 #include "query.h"
 #include "series.h"
+#include "aggregate.h"
+#include "cache.h"
+#include "sha1.h"
 #include "libpcp.h"
 
 typedef struct {
     redisContext	*redis;
+    unsigned int	version;	/* schema version of the store */
+    unsigned int	pagesize;	/* series identifiers per page */
+    int			caching;	/* series indices cached in-process */
+    unsigned long long	generation;	/* of the store, for the cache */
 
     settings_t		*settings;
     void		*arg;
@@ -28,8 +37,55 @@ typedef struct {
     unsigned int	index;
     unsigned int	count;
     redisReply		**replies;
+
+    unsigned int	nfunctions;	/* applied to values, innermost first */
+    function_t		*functions;
+    int			grouped;	/* last function is across series */
+    unsigned int	nbynames;	/* grouping label names, "by" */
+    struct byname	*bynames;
+    int			*members;	/* label value per name, this page */
+    unsigned int	ngroups;	/* groups of series, by label values */
+    unsigned int	groupsize;
+    struct seriesgroup	*groups;
 } SOLVER;
 
+/*
+ * Sorted stream of series identifiers for one node of the query.
+ * Leaves page through their index of series in lexical order, one
+ * page at a time, and interior nodes merge the streams of their
+ * children - so memory use depends on the page size, not on the
+ * number of series matched.
+ */
+typedef struct cursor {
+    char		*ids;		/* page of identifiers, sorted */
+    unsigned int	size;		/* identifiers allocated */
+    unsigned int	count;		/* identifiers in the page */
+    unsigned int	index;		/* current one in the page */
+    unsigned int	done;		/* no more pages to come */
+    unsigned int	collect;	/* read in full from the start, so */
+    unsigned int	nfound;		/* keep every identifier to cache */
+    char		*found;
+} cursor_t;
+
+#define DEFAULT_PAGE_SIZE	1024
+
+/*
+ * Grouping of series for an aggregate across them - each name in the
+ * "by" list has one leaf (with a cursor) per value the name takes, so
+ * the series in each page are matched to values as for any leaf.
+ */
+typedef struct byname {
+    node_t		*name;
+    node_t		*values;	/* N_EQ leaf per label value */
+    unsigned int	count;
+} byname_t;
+
+typedef struct seriesgroup {
+    int			*members;	/* value per name, or -1 if none */
+    char		*labels;	/* JSON names and values */
+    group_t		group;
+} seriesgroup_t;
+
 typedef __pmHashCtl	reverseMap;
 typedef __pmHashNode	*reverseMapNode;
 
@@ -121,6 +177,23 @@ node_subtype(node_t *np)
     return NULL;
 }
 
+static const char *
+node_operator(node_t *np)
+{
+    switch (np->type) {
+	case N_LT:	return "<";
+	case N_LEQ:	return "<=";
+	case N_GEQ:	return ">=";
+	case N_GT:	return ">";
+	case N_NEQ:	return "!=";
+	case N_REQ:	return "=~";
+	case N_RNE:	return "!~";
+	case N_NEG:	return "-";
+	default: break;
+    }
+    return "?";
+}
+
 /*
  * Report a timeseries result - value + timestamp (score) pairs
  */
@@ -153,7 +226,6 @@ series_values_reply(SOLVER *sp, pmSeriesID *seriesid,
 /*--		printf("      \"%.*s\": \"%s\"",
 				15, score->str, value->str);--*TODO*/
 		solvervalue(sp, seriesid, score->str, value->str);
-		sp->settings->on_value(seriesid, score->str, value->str, sp->arg);
 	    } else {
 		pmsprintf(msg, sizeof(msg),
 			"expected string stamp for series %.*s (type=%s)",
@@ -177,193 +249,395 @@ series_values_reply(SOLVER *sp, pmSeriesID *seriesid,
     return sts;
 }
 
+static int
+series_compare(const void *a, const void *b)
+{
+    return memcmp(a, b, PMSIDSZ);
+}
+
 /*
- * Save the series hash identifiers contained in a Redis response.
- * Used at the leaves of the query tree, then merged result sets
- * are propagated upward.
+ * Save a page of series identifiers from a Redis response at a leaf
+ * of the query tree, in place of the previous page.
  */
 static int
 node_series_reply(SOLVER *sp, node_t *np, int nelements, redisReply **elements)
 {
+    cursor_t	*cp = np->cursor;
     redisReply	*series;
     char	msg[MSGSIZE];
-    char	*seriesp;
-    int		i, sts = 0;
+    char	*ids;
+    int		i;
 
-    if ((np->nseries = nelements) <= 0)
-	return nelements;
+    cp->count = cp->index = 0;
+    if (nelements <= 0)
+	return 0;
 
-    np->series = malloc(nelements * PMSIDSZ);
-    seriesp = (char *)np->series;
+    if (nelements > cp->size) {
+	if ((ids = realloc(cp->ids, nelements * PMSIDSZ)) == NULL) {
+	    pmsprintf(msg, sizeof(msg), "out of memory for %d series in %s",
+			nelements, np->key);
+	    solvermsg(sp, PMSERIES_ERROR, msg);
+	    return -ENOMEM;
+	}
+	cp->ids = ids;
+	cp->size = nelements;
+    }
 
     for (i = 0; i < nelements; i++) {
 	series = elements[i];
-	if (series->type == REDIS_REPLY_STRING) {
-	    if (pmDebugOptions.series)
-	        printf("    %s\n", series->str);
-	    memcpy(seriesp, series->str, PMSIDSZ);
-	    seriesp += PMSIDSZ;
-	} else {
+	if (series->type != REDIS_REPLY_STRING || series->len != PMSIDSZ) {
 	    pmsprintf(msg, sizeof(msg),
-		    "expected string in %s set \"%s\" (type=%s)",
+		    "expected series in %s set \"%s\" (type=%s)",
 		    node_subtype(np->left), np->left->key,
 		    redis_reply(series->type));
-	    solvermsg(sp, PMSERIES_REQUEST, msg);
-	    free(np->series);
-	    np->series = NULL;
-	    np->nseries = 0;
-	    sts = -EPROTO;
+	    solvermsg(sp, PMSERIES_RESPONSE, msg);
+	    cp->count = 0;
+	    return -EPROTO;
 	}
+	if (pmDebugOptions.series)
+	    printf("    %s\n", series->str);
+	memcpy(cp->ids + cp->count * PMSIDSZ, series->str, PMSIDSZ);
+	cp->count++;
     }
-    if (sts < 0)
-	return sts;
     return nelements;
 }
 
-static void
-free_child_series(node_t *left, node_t *right)
+/*
+ * Queue the request for the next page of a leaf - from the start,
+ * or from the given identifier onward (inclusive or not).  Stores with
+ * indices of series as sets (schema version 2 and earlier) cannot be
+ * paged in order, so the whole set is the one and only page.
+ */
+static int
+node_series_request(SOLVER *sp, node_t *np, const char *from, int inclusive)
 {
-    if (left->series) {
-	free(left->series);
-	left->series = NULL;
+    char	msg[MSGSIZE];
+    char	start[PMSIDSZ+2];
+    int		sts;
+
+    if (sp->version < PCP_SCHEMA_LEXSETS) {
+	sts = redisAppendCommand(sp->redis, "SMEMBERS %s", np->key);
+    } else {
+	if (from == NULL)
+	    pmsprintf(start, sizeof(start), "-");
+	else
+	    pmsprintf(start, sizeof(start), "%c%.*s",
+			inclusive ? '[' : '(', PMSIDSZ, from);
+	sts = redisAppendCommand(sp->redis,
+			"ZRANGEBYLEX %s %s + LIMIT 0 %u",
+			np->key, start, sp->pagesize);
     }
-    if (right->series) {
-	free(right->series);
-	right->series = NULL;
+    if (sts != REDIS_OK) {
+	pmsprintf(msg, sizeof(msg), "failed series page request (key=%s)",
+			np->key);
+	solvermsg(sp, PMSERIES_REQUEST, msg);
+	return -EPROTO;
     }
-    right->nseries = left->nseries = 0;
+    return 0;
 }
 
-static int
-series_compare(const void *a, const void *b)
+static void
+node_series_uncollect(cursor_t *cp)
 {
-    return memcmp(a, b, PMSIDSZ);
+    free(cp->found);
+    cp->found = NULL;
+    cp->nfound = cp->collect = 0;
 }
 
 /*
- * Form resulting set via intersection of two child sets.
- * Algorithm:
- * - sort the larger set
- * - for each identifier in the smaller set
- *   o bisect to find match in sorted set
- *   o if matching, add it to the current saved set
- *
- * Memory from the smaller set is re-used to hold the result,
- * its memory is trimmed (via realloc) if the final resulting
- * set is smaller, and the larger set is freed on completion.
+ * Keep each page of a leaf read in order from the start, and cache
+ * the whole index once the last page arrives - unless it is too big.
  */
+static void
+node_series_collect(SOLVER *sp, node_t *np, int failed)
+{
+    cursor_t	*cp = np->cursor;
+    char	*found;
+
+    if (failed || cp->nfound + cp->count > index_cache_limit()) {
+	node_series_uncollect(cp);
+	return;
+    }
+    if (cp->done && cp->nfound == 0) {	/* all in one page */
+	index_cache_insert(sp->generation, np->left->value, np->right->value,
+			cp->ids, cp->count);
+	node_series_uncollect(cp);
+	return;
+    }
+    if (cp->count) {
+	if ((found = realloc(cp->found,
+			(cp->nfound + cp->count) * PMSIDSZ)) == NULL) {
+	    node_series_uncollect(cp);
+	    return;
+	}
+	memcpy(found + cp->nfound * PMSIDSZ, cp->ids, cp->count * PMSIDSZ);
+	cp->found = found;
+	cp->nfound += cp->count;
+    }
+    if (cp->done) {
+	index_cache_insert(sp->generation, np->left->value, np->right->value,
+			cp->found, cp->nfound);
+	node_series_uncollect(cp);
+    }
+}
+
 static int
-node_series_intersect(node_t *np, node_t *left, node_t *right)
+node_series_page(SOLVER *sp, node_t *np)
 {
-    char	*small, *large, *cp, *saved;
-    int		i, nsmall, nlarge, total;
+    cursor_t	*cp = np->cursor;
+    redisReply	*reply;
+    char	msg[MSGSIZE];
+    int		sts;
 
+    if (redisGetReply(sp->redis, (void **)&reply) != REDIS_OK) {
+	pmsprintf(msg, sizeof(msg), "map table %s key %s not found",
+			np->left->key, np->right->value);
+	solvermsg(sp, PMSERIES_CORRUPT, msg);
+	cp->count = cp->index = 0;
+	cp->done = 1;
+	return -EPROTO;
+    }
+    if (reply->type != REDIS_REPLY_ARRAY) {
+	pmsprintf(msg, sizeof(msg), "expected array for %s set \"%s\" (type=%s)",
+			node_subtype(np->left), np->right->value,
+			redis_reply(reply->type));
+	solvermsg(sp, PMSERIES_CORRUPT, msg);
+	freeReplyObject(reply);
+	cp->count = cp->index = 0;
+	cp->done = 1;
+	return -EPROTO;
+    }
     if (pmDebugOptions.series)
-	printf("Intersect left(%d) and right(%d) series\n",
-		left->nseries, right->nseries);
-
-    if (left->nseries >= right->nseries) {
-	small = right->series;	nsmall = right->nseries;
-	large = left->series;	nlarge = left->nseries;
-	right->series = NULL;	/* do-not-free marker for small set */
-    } else {
-	small = left->series;	nsmall = left->nseries;
-	large = right->series;	nlarge = right->nseries;
-	left->series = NULL;	/* do-not-free marker for small set */
+	printf("%s %s\n", node_subtype(np->left), np->key);
+    sts = node_series_reply(sp, np, reply->elements, reply->element);
+    if (sp->version < PCP_SCHEMA_LEXSETS) {
+	qsort(cp->ids, cp->count, PMSIDSZ, series_compare);
+	cp->done = 1;
+    } else if (sts < 0 || reply->elements < sp->pagesize) {
+	cp->done = 1;
     }
+    freeReplyObject(reply);
+    if (cp->collect)
+	node_series_collect(sp, np, sts < 0);
+    return sts;
+}
 
-    qsort(large, nlarge, PMSIDSZ, series_compare);
+static int
+node_series_fetch(SOLVER *sp, node_t *np, const char *from, int inclusive)
+{
+    int		sts;
 
-    for (i = 0, cp = saved = small; i < nsmall; i++, cp += PMSIDSZ) {
-	if (bsearch(cp, large, nlarge, PMSIDSZ, series_compare) == NULL)
-	    continue;		/* no match, continue advancing cp only */
-	if (saved != cp)
-	    memcpy(saved, cp, PMSIDSZ);
-	saved += PMSIDSZ;	/* stashed, advance cp & saved pointers */
+    if (inclusive && np->cursor->collect)	/* skipping, not all read */
+	node_series_uncollect(np->cursor);
+    if ((sts = node_series_request(sp, np, from, inclusive)) < 0) {
+	np->cursor->count = np->cursor->index = 0;
+	np->cursor->done = 1;
+	return sts;
     }
+    return node_series_page(sp, np);
+}
 
-    if ((total = (saved - small) / PMSIDSZ) < nsmall) {
-	/* shrink the smaller set down further */
-	if ((small = realloc(small, total * PMSIDSZ)) == NULL)
-	    return -ENOMEM;
-    }
+static const char *series_peek(SOLVER *, node_t *);
+static void series_seek(SOLVER *, node_t *, const char *);
 
-    np->nseries = total;
-    np->series = small;
+/*
+ * Current (smallest remaining) identifier of the stream for a node,
+ * or NULL when there are no more.
+ */
+static const char *
+series_peek(SOLVER *sp, node_t *np)
+{
+    cursor_t	*cp = np->cursor;
+    const char	*left, *right;
+    char	last[PMSIDSZ];
+    int		sts;
 
-    if (pmDebugOptions.series) {
-	printf("Intersect result set contains %d series:\n", total);
-	for (i = 0, cp = small; i < total; cp += PMSIDSZ, i++)
-	    printf("    %.*s\n", PMSIDSZ, cp);
-    }
+    switch (np->type) {
+    case N_EQ:
+	while (cp->index == cp->count) {
+	    if (cp->done || cp->count == 0)
+		return NULL;
+	    memcpy(last, cp->ids + (cp->count - 1) * PMSIDSZ, PMSIDSZ);
+	    if (node_series_fetch(sp, np, last, 0) < 0)
+		return NULL;
+	}
+	return cp->ids + cp->index * PMSIDSZ;
+
+    case N_AND:	/* leapfrog until both sides agree */
+	for (;;) {
+	    if ((left = series_peek(sp, np->left)) == NULL ||
+		(right = series_peek(sp, np->right)) == NULL)
+		return NULL;
+	    if ((sts = memcmp(left, right, PMSIDSZ)) == 0)
+		return left;
+	    if (sts < 0)
+		series_seek(sp, np->left, right);
+	    else
+		series_seek(sp, np->right, left);
+	}
 
-    free_child_series(left, right);
-    return total;
+    case N_OR:	/* the smaller of the two sides */
+	left = series_peek(sp, np->left);
+	right = series_peek(sp, np->right);
+	if (left == NULL)
+	    return right;
+	if (right == NULL)
+	    return left;
+	return memcmp(left, right, PMSIDSZ) <= 0 ? left : right;
+
+    default:	/* rejected by series_resolve_expr */
+	break;
+    }
+    return NULL;
 }
 
 /*
- * Form the resulting set from union of two child sets.
- * The larger set is realloc-ated to form the result, if we
- * need to (i.e. if there are entries in the smaller set not
- * in the larger).
- *
- * Iterates over the smaller set doing a binary search of
- * each series identifier, and tracks which ones in the small
- * need to be added to the large set.  Then, at end, add more
- * space to the larger set if needed and append.
+ * Advance the stream for a node past its current identifier.
  */
-static int
-node_series_union(node_t *np, node_t *left, node_t *right)
+static void
+series_next(SOLVER *sp, node_t *np)
 {
-    char	*small, *large, *cp, *saved;
-    int		i, nsmall, nlarge, total, need;
+    const char	*left, *right;
+    char	current[PMSIDSZ];
 
-    if (pmDebugOptions.series)
-	printf("Union of left(%d) and right(%d) series\n",
-		left->nseries, right->nseries);
+    switch (np->type) {
+    case N_EQ:
+	if (series_peek(sp, np) != NULL)
+	    np->cursor->index++;
+	break;
 
-    if (left->nseries >= right->nseries) {
-	small = right->series;	nsmall = right->nseries;
-	large = left->series;	nlarge = left->nseries;
-	left->series = NULL;	/* do-not-free marker for large set */
-    } else {
-	small = left->series;	nsmall = left->nseries;
-	large = right->series;	nlarge = right->nseries;
-	right->series = NULL;	/* do-not-free marker for large set */
+    case N_AND:
+    case N_OR:
+	if ((left = series_peek(sp, np)) == NULL)
+	    break;
+	memcpy(current, left, PMSIDSZ);
+	if ((left = series_peek(sp, np->left)) != NULL &&
+	    memcmp(left, current, PMSIDSZ) == 0)
+	    series_next(sp, np->left);
+	if ((right = series_peek(sp, np->right)) != NULL &&
+	    memcmp(right, current, PMSIDSZ) == 0)
+	    series_next(sp, np->right);
+	break;
+
+    default:
+	break;
     }
+}
+
+/*
+ * Advance the stream for a node to the first identifier not less
+ * than target - within the current page where possible, else by
+ * starting the next page of a leaf from the target itself.
+ */
+static void
+series_seek(SOLVER *sp, node_t *np, const char *target)
+{
+    cursor_t	*cp = np->cursor;
+    char	from[PMSIDSZ];
+    unsigned int low, high, middle;
+
+    switch (np->type) {
+    case N_EQ:
+	if (cp->index == cp->count && (cp->done || cp->count == 0))
+	    break;
+	if (cp->count > 0 &&
+	    memcmp(cp->ids + (cp->count - 1) * PMSIDSZ, target, PMSIDSZ) >= 0) {
+	    low = cp->index;
+	    high = cp->count;
+	    while (low < high) {
+		middle = low + (high - low) / 2;
+		if (memcmp(cp->ids + middle * PMSIDSZ, target, PMSIDSZ) < 0)
+		    low = middle + 1;
+		else
+		    high = middle;
+	    }
+	    cp->index = low;
+	} else if (cp->done) {
+	    cp->index = cp->count;
+	} else {
+	    memcpy(from, target, PMSIDSZ);
+	    node_series_fetch(sp, np, from, 1);
+	}
+	break;
 
-    qsort(large, nlarge, PMSIDSZ, series_compare);
+    case N_AND:
+    case N_OR:
+	series_seek(sp, np->left, target);
+	series_seek(sp, np->right, target);
+	break;
 
-    for (i = 0, cp = saved = small; i < nsmall; i++, cp += PMSIDSZ) {
-	if (bsearch(cp, large, nlarge, PMSIDSZ, series_compare) != NULL)
-	    continue;		/* already present, no need to save */
-	if (saved != cp)
-	    memcpy(saved, cp, PMSIDSZ);
-	saved += PMSIDSZ;	/* stashed, advance both cp & saved */
+    default:
+	break;
     }
+}
 
-    if ((need = (saved - small) / PMSIDSZ) > 0) {
-	/* grow the larger set to cater for new entries, then add 'em */
-	if ((large = realloc(large, (nlarge + need) * PMSIDSZ)) == NULL)
-	    return -ENOMEM;
-	cp = large + (nlarge * PMSIDSZ);
-	memcpy(cp, small, need * PMSIDSZ);
-	total = nlarge + need;
-    } else {
-	total = nlarge;
+static void
+free_series_cursors(node_t *np)
+{
+    if (np == NULL)
+	return;
+    free_series_cursors(np->left);
+    free_series_cursors(np->right);
+    if (np->cursor) {
+	free(np->cursor->found);
+	free(np->cursor->ids);
+	free(np->cursor);
+	np->cursor = NULL;
     }
+}
+
+/*
+ * Leaves with their whole index found in the in-process cache need
+ * no names mapped, nor any index pages read.
+ */
+static int
+node_cached(node_t *np)
+{
+    return np->type == N_EQ && np->cursor != NULL;
+}
 
-    np->nseries = total;
-    np->series = large;
+static void
+series_cache_lookup(SOLVER *sp, node_t *np)
+{
+    cursor_t		*cp;
+    char		*ids;
+    unsigned int	count;
 
-    if (pmDebugOptions.series) {
-	printf("Union result set contains %d series:\n", total);
-	for (i = 0, cp = large; i < total; cp += PMSIDSZ, i++)
-	    printf("    %.*s\n", PMSIDSZ, cp);
+    if (np == NULL)
+	return;
+    if (np->type != N_EQ) {
+	series_cache_lookup(sp, np->left);
+	series_cache_lookup(sp, np->right);
+	return;
     }
+    if (!index_cache_lookup(sp->generation, np->left->value,
+			np->right->value, &ids, &count))
+	return;
+    if ((cp = calloc(1, sizeof(cursor_t))) == NULL) {
+	free(ids);
+	return;
+    }
+    cp->ids = ids;
+    cp->size = cp->count = count;
+    cp->done = 1;
+    np->cursor = cp;
+}
 
-    free_child_series(left, right);
-    return total;
+static void
+series_cache_report(SOLVER *sp)
+{
+    cacheStats		stats;
+    unsigned long long	lookups;
+
+    index_cache_stats(&stats);
+    lookups = stats.hits + stats.misses;
+    fprintf(stderr, "index cache: %llu hits, %llu misses (%.1f%% hit rate), "
+		"%llu inserts, %llu evictions, %llu flushes, "
+		"%u entries, %u of %u series\n",
+		stats.hits, stats.misses,
+		lookups ? stats.hits * 100.0 / lookups : 0.0,
+		stats.inserts, stats.evictions, stats.flushes,
+		stats.entries, stats.series, stats.limit);
 }
 
 /*
@@ -376,7 +650,7 @@ series_prepare_maps(SOLVER *sp, node_t *np, int level)
     char	*name, *cmd;
     char	msg[MSGSIZE];
 
-    if (np == NULL)
+    if (np == NULL || node_cached(np))
 	return 0;
 
     if ((sts = series_prepare_maps(sp, np->left, level+1)) < 0)
@@ -435,7 +709,7 @@ series_resolve_maps(SOLVER *sp, node_t *np, int level)
     char	id[128];
     int		sts = 0;
 
-    if (np == NULL)
+    if (np == NULL || node_cached(np))
 	return 0;
 
     series_resolve_maps(sp, np->left, level+1);
@@ -473,10 +747,11 @@ series_resolve_maps(SOLVER *sp, node_t *np, int level)
     default:
 	break;
     }
-    if (sts < 0)
-	return sts;
 
-    return series_resolve_maps(sp, np->right, level+1);
+    /* always continue, so every pipelined reply is consumed */
+    if (series_resolve_maps(sp, np->right, level+1) < 0 && sts == 0)
+	sts = -EPROTO;
+    return sts;
 }
 
 /*
@@ -489,7 +764,7 @@ series_prepare_eval(SOLVER *sp, node_t *np, int level)
     char	msg[MSGSIZE];
     char	*key, *value, *cmd;
 
-    if (np == NULL)
+    if (np == NULL || node_cached(np))
 	return 0;
 
     if ((sts = series_prepare_eval(sp, np->left, level+1)) < 0)
@@ -536,7 +811,7 @@ series_resolve_eval(SOLVER *sp, node_t *np, int level)
     char	msg[MSGSIZE];
     int		sts;
 
-    if (np == NULL)
+    if (np == NULL || node_cached(np))
 	return 0;
 
     if ((sts = series_resolve_eval(sp, np->left, level+1)) < 0)
@@ -589,9 +864,8 @@ series_resolve_eval(SOLVER *sp, node_t *np, int level)
 static int
 series_prepare_expr(SOLVER *sp, node_t *np, int level)
 {
-    int		length, sts;
     char	msg[MSGSIZE];
-    char	*cmd;
+    int		sts;
 
     if (np == NULL)
 	return 0;
@@ -602,16 +876,19 @@ series_prepare_expr(SOLVER *sp, node_t *np, int level)
 	return sts;
 
     switch (np->type) {
-    case N_EQ:	/* direct hash lookup */
-	length = redisFormatCommand(&cmd, "SMEMBERS %s", np->key);
-	if (redisAppendFormattedCommand(sp->redis, cmd, length) == REDIS_OK) {
+    case N_EQ:	/* first page of the series index */
+	if (node_cached(np))
+	    break;
+	if ((np->cursor = calloc(1, sizeof(cursor_t))) == NULL) {
+	    pmsprintf(msg, sizeof(msg), "out of memory for %s cursor", np->key);
+	    solvermsg(sp, PMSERIES_ERROR, msg);
+	    sts = -ENOMEM;
+	} else if (np->key == NULL) {	/* value never mapped, no matches */
+	    np->cursor->done = 1;
+	} else if ((sts = node_series_request(sp, np, NULL, 0)) == 0) {
+	    np->cursor->collect = sp->caching;
 	    sp->count++;
-	} else {
-	    pmsprintf(msg, sizeof(msg), "failed SMEMBERS (key=%s)", np->key);
-	    solvermsg(sp, PMSERIES_REQUEST, msg);
-	    sts = -EPROTO;
 	}
-	free(cmd);
 	break;
 
     case N_LT:  case N_LEQ: case N_GEQ: case N_GT:  case N_NEQ:
@@ -628,7 +905,6 @@ series_prepare_expr(SOLVER *sp, node_t *np, int level)
 static int
 series_resolve_expr(SOLVER *sp, node_t *np, int level)
 {
-    redisReply	*reply;
     char	msg[MSGSIZE];
     int		sts;
 
@@ -643,42 +919,21 @@ series_resolve_expr(SOLVER *sp, node_t *np, int level)
 
     switch (np->type) {
     case N_EQ:
-	if (redisGetReply(sp->redis, (void **)&reply) != REDIS_OK) {
-	    pmsprintf(msg, sizeof(msg),
-			"map table %s key %s not found",
-			np->left->key, np->right->value);
-	    solvermsg(sp, PMSERIES_CORRUPT, msg);
-	    sts = -EPROTO;
-	} else if (reply->type != REDIS_REPLY_ARRAY) {
-	    pmsprintf(msg, sizeof(msg),
-			"expected array for %s set \"%s\" (type=%s)",
-			node_subtype(np->left), np->right->value,
-			redis_reply(reply->type));
-	    solvermsg(sp, PMSERIES_CORRUPT, msg);
-	    sts = -EPROTO;
-	} else {
-	    sp->replies[sp->index++] = reply;
-	    if (pmDebugOptions.series)
-		printf("%s %s\n", node_subtype(np->left), np->key);
-	    sts = node_series_reply(sp, np, reply->elements, reply->element);
-	}
+	if (np->cursor && !np->cursor->done)
+	    sts = node_series_page(sp, np);
 	break;
 
     case N_LT:  case N_LEQ: case N_GEQ: case N_GT:  case N_NEQ:
     case N_RNE: case N_REQ: case N_NEG:
-	/* TODO */
-	break;
-
-    case N_AND:
-	node_series_intersect(np, np->left, np->right);
-	/* TODO: error handling */
+	/* no series index for these yet, see series_peek */
+	pmsprintf(msg, sizeof(msg), "operator \"%s\" not supported in"
+			" series queries", node_operator(np));
+	solvermsg(sp, PMSERIES_ERROR, msg);
+	sts = PM_ERR_NYI;
 	break;
 
+    case N_AND:	/* merged as the identifiers are read, see series_peek */
     case N_OR:
-	node_series_union(np, np->left, np->right);
-	/* TODO: error handling */
-	break;
-
     default:
 	break;
     }
@@ -689,31 +944,59 @@ int
 seriesid_copy(const char *series, pmSeriesID *seriesid)
 {
     char *name = (char *)seriesid->name;
-    int	bytes = pmsprintf(name, PMSIDSZ, "%.*s", PMSIDSZ, series);
-    name[PMSIDSZ] = '\0';
+    int	bytes = pmsprintf(name, sizeof(seriesid->name), "%.*s", PMSIDSZ, series);
     return bytes == PMSIDSZ? 0 : -E2BIG;
 }
 
 #define DEFAULT_VALUE_COUNT 10
+#define MAXIMUM_ROUND_CHUNKS 16	/* chunks of a series per round trip */
+
+/*
+ * Values of one series within the time window, decoded from the
+ * chunks overlapping it, newest chunk first, until enough are found.
+ */
+typedef struct {
+    long long		stamp;		/* usec */
+    pmAtomValue		atom;
+} sample_t;
+
+typedef struct {
+    pmSeriesID		seriesid;
+    redisReply		*chunks;	/* chunk start times, newest first */
+    redisReply		*legacy;	/* values zset, schema version 1 */
+    unsigned int	asked;		/* legacy values requested */
+    unsigned int	limit;		/* samples needed, newest first */
+    unsigned int	next;		/* next chunk to be fetched */
+    unsigned int	fetch;		/* chunks fetched this round */
+    unsigned int	count;		/* distinct samples, newest first */
+    unsigned int	size;
+    sample_t		*samples;
+    long long		start;		/* time window, usec */
+    long long		end;
+    int			type;
+} window_t;
+
+static void
+series_window(timing_t *tp, char *start, char *end, size_t length)
+{
+    pmsprintf(start, length, "%.64g", tv2real(&tp->start));
+    if (tp->end.tv_sec)
+	pmsprintf(end, length, "%.64g", tv2real(&tp->end));
+    else
+	pmsprintf(end, length, "+inf");
+}
 
 static int
 series_prepare_time(SOLVER *sp, timing_t *tp, int nseries, char *series)
 {
-    char	start[64], end[64];
+    char	start[64], end[64], first[64];
     char	msg[MSGSIZE], *cmd;
     pmSeriesID	seriesid;
     int		sts = 0, len, i;
 
-    pmsprintf(start, sizeof(start), "%.64g", tv2real(&tp->start));
-    if (pmDebugOptions.series)
-	fprintf(stderr, "START: %s\n", start);
-
-    if (tp->end.tv_sec)
-	pmsprintf(end, sizeof(end), "%.64g", tv2real(&tp->end));
-    else
-	pmsprintf(end, sizeof(end), "+inf");
+    series_window(tp, start, end, sizeof(start));
     if (pmDebugOptions.series)
-	fprintf(stderr, "END: %s\n", end);
+	fprintf(stderr, "START: %s\nEND: %s\n", start, end);
 
     if (tp->count == 0)
 	tp->count = DEFAULT_VALUE_COUNT;
@@ -723,9 +1006,11 @@ series_prepare_time(SOLVER *sp, timing_t *tp, int nseries, char *series)
 	fprintf(stderr, "LIMIT: %u %u\n", tp->offset, tp->count);
 
     /*
-     * Query cache for the time series range (time:value pairs)
-     * - ZSET values are metric values, score is the timestamp.
+     * Query cache for the chunks overlapping the time window - the
+     * ZSET values are chunk start times, as is the score.
      */
+    pmsprintf(first, sizeof(first), "(%.64g",
+		tv2real(&tp->start) - CHUNK_DURATION);
 
     for (i = 0; i < nseries; i++, series += PMSIDSZ) {
 	if (seriesid_copy(series, &seriesid) < 0) {
@@ -733,14 +1018,13 @@ series_prepare_time(SOLVER *sp, timing_t *tp, int nseries, char *series)
 	    continue;
 	}
 
-	/* ZREVRANGEBYSCORE key max min [WITHSCORES] [LIMIT offset count] */
+	/* ZREVRANGEBYSCORE key max min */
 	len = redisFormatCommand(&cmd, "ZREVRANGEBYSCORE"
-		" pcp:values:series:%s %s %s WITHSCORES LIMIT %u %u",
-		seriesid.name, end, start, tp->offset, tp->count);
+		" pcp:chunks:series:%s %s %s", seriesid.name, end, first);
 
 	if (redisAppendFormattedCommand(sp->redis, cmd, len) != REDIS_OK) {
 	    pmsprintf(msg, sizeof(msg),
-			"failed pcp:values:series:%.*s ZREVRANGEBYSCORE",
+			"failed pcp:chunks:series:%.*s ZREVRANGEBYSCORE",
 			PMSIDSZ, series);
 	    solvermsg(sp, PMSERIES_REQUEST, msg);
 	    sts = -EPROTO;
@@ -766,68 +1050,567 @@ series_result(int nseries)
 #endif
 
 static int
-series_resolve_time(SOLVER *sp, int nseries, char *series)
+series_sample(long long stamp, int type, pmAtomValue *atom, void *arg)
 {
-    redisReply		*reply;
-    pmSeriesID		seriesid;
-    char		msg[MSGSIZE];
-    int			i, sts = 0;
-
-/*--printf("{\n  \"result\": \"%s\",\n", series_result(nseries));
-    printf("  \"series\": {\n");--*TODO*/
-
-    for (i = 0; i < nseries; i++, series += PMSIDSZ) {
-	if (redisGetReply(sp->redis, (void **)&reply) != REDIS_OK) {
-	    pmsprintf(msg, sizeof(msg), "failed series %.*s ZSET query",
-			PMSIDSZ, series);
-	    solvermsg(sp, PMSERIES_RESPONSE, msg);
-	    sts = -EPROTO;
-	} else if (reply->type != REDIS_REPLY_ARRAY) {
-	    pmsprintf(msg, sizeof(msg),
-			"expected array from %.*s zset values (type=%s)",
-			PMSIDSZ, series, redis_reply(reply->type));
-	    solvermsg(sp, PMSERIES_RESPONSE, msg);
-	    sts = -EPROTO;
-	} else {
-	    memcpy(seriesid.name, series, PMSIDSZ);
-	    seriesid.name[PMSIDSZ] = '\0';
-	    sts |= series_values_reply(sp, &seriesid,
-				reply->elements, reply->element);
-	}
-	freeReplyObject(reply);
+    window_t		*wp = (window_t *)arg;
+    sample_t		*samples;
+    unsigned int	size;
 
-/*--	if (i + 1 < nseries)
-	    fputc(',', stdout);
-	fputc('\n', stdout);--*TODO*/
+    if (stamp < wp->start || stamp > wp->end)
+	return 0;
+    if (wp->count == wp->size) {
+	size = wp->size ? wp->size * 2 : 64;
+	if ((samples = realloc(wp->samples, size * sizeof(sample_t))) == NULL)
+	    return -ENOMEM;
+	wp->samples = samples;
+	wp->size = size;
     }
-/*--fputs("  }\n}\n", stdout);--*TODO*/
-
-    return sts;
+    wp->samples[wp->count].stamp = stamp;
+    wp->samples[wp->count].atom = *atom;
+    wp->count++;
+    wp->type = type;
+    return 0;
 }
 
-void
-new_solver_replies(SOLVER *sp)
+static int
+sample_compare(const void *a, const void *b)
 {
-    sp->replies = calloc(sp->count, sizeof(redisReply *));
-    /* TODO: error handling */
-    sp->index = 0;
+    const sample_t	*sa = (const sample_t *)a;
+    const sample_t	*sb = (const sample_t *)b;
+
+    if (sa->stamp == sb->stamp)
+	return 0;
+    return sa->stamp < sb->stamp ? 1 : -1;	/* newest first */
 }
 
+/*
+ * Newest first, and one value per timestamp - an archive loaded more
+ * than once appends the same samples to a chunk again.
+ */
 static void
-free_solver_replies(SOLVER *sp)
+series_samples_sort(window_t *wp)
 {
-#if 0	/* TODO */
-    for (sp->index = 0; sp->index < sp->count; sp->index++)
-	freeReplyObject(&sp->replies[sp->index]);
-    free(sp->replies);
-#endif
-    sp->index = sp->count = 0;
+    unsigned int	i, count;
+
+    if (wp->count < 2)
+	return;
+    qsort(wp->samples, wp->count, sizeof(sample_t), sample_compare);
+    for (i = count = 1; i < wp->count; i++) {
+	if (wp->samples[i].stamp != wp->samples[count-1].stamp)
+	    wp->samples[count++] = wp->samples[i];
+    }
+    wp->count = count;
 }
 
-static int
-series_report_set(SOLVER *sp, int nseries, char *series)
+static const char *
+series_stamp(long long stamp, char *timestamp, size_t length)
 {
-    pmSeriesID		seriesid;
+    int			len;
+
+    len = pmsprintf(timestamp, length, "%lld.%06lld",
+			stamp / 1000000, stamp % 1000000);
+    /* trailing zeros dropped, as for the version 1 ZSET scores */
+    while (len > 0 && timestamp[len-1] == '0')
+	timestamp[--len] = '\0';
+    if (len > 0 && timestamp[len-1] == '.')
+	timestamp[--len] = '\0';
+    return timestamp;
+}
+
+static void
+series_samples_reply(SOLVER *sp, window_t *wp, timing_t *tp)
+{
+    unsigned int	i, last = tp->offset + tp->count;
+    char		timestamp[64], value[128];
+
+    for (i = tp->offset; i < wp->count && i < last; i++) {
+	series_stamp(wp->samples[i].stamp, timestamp, sizeof(timestamp));
+	atom_string(wp->type, &wp->samples[i].atom, value, sizeof(value));
+	solvervalue(sp, &wp->seriesid, timestamp, value);
+    }
+}
+
+/*
+ * Queue the next round of requests for the values of one series,
+ * the chunks from the newest down (round of them at a time) or, for
+ * a series without chunks, the schema version 1 values ZSET.
+ */
+static int
+series_window_fetch(SOLVER *sp, timing_t *tp, window_t *wp,
+		unsigned int round)
+{
+    redisReply	*chunk;
+    char	start[64], end[64];
+    char	msg[MSGSIZE];
+    int		sts, pending = 0;
+
+    if (wp->chunks == NULL || wp->legacy || wp->asked)
+	return 0;
+
+    if (wp->chunks->elements == 0) {
+	series_window(tp, start, end, sizeof(start));
+	if (wp->limit == UINT_MAX)
+	    sts = redisAppendCommand(sp->redis, "ZREVRANGEBYSCORE"
+		" pcp:values:series:%s %s %s WITHSCORES LIMIT 0 -1",
+		wp->seriesid.name, end, start);
+	else
+	    sts = redisAppendCommand(sp->redis, "ZREVRANGEBYSCORE"
+		" pcp:values:series:%s %s %s WITHSCORES LIMIT %u %u",
+		wp->seriesid.name, end, start, tp->offset, tp->count);
+	if (sts != REDIS_OK) {
+	    pmsprintf(msg, sizeof(msg),
+			"failed pcp:values:series:%.*s ZREVRANGEBYSCORE",
+			PMSIDSZ, wp->seriesid.name);
+	    solvermsg(sp, PMSERIES_REQUEST, msg);
+	    return -EPROTO;
+	}
+	wp->asked = 1;
+	return 1;
+    }
+
+    while (wp->fetch < round && wp->next < wp->chunks->elements &&
+	   wp->count < wp->limit) {
+	chunk = wp->chunks->element[wp->next];
+	if (chunk->type != REDIS_REPLY_STRING) {
+	    pmsprintf(msg, sizeof(msg),
+			"expected string chunk for series %.*s (type=%s)",
+			PMSIDSZ, wp->seriesid.name, redis_reply(chunk->type));
+	    solvermsg(sp, PMSERIES_RESPONSE, msg);
+	    wp->next = wp->chunks->elements;
+	    return -EPROTO;
+	}
+	sts = redisAppendCommand(sp->redis, "GET pcp:chunk:series:%s:%s",
+			wp->seriesid.name, chunk->str);
+	if (sts != REDIS_OK) {
+	    pmsprintf(msg, sizeof(msg), "failed pcp:chunk:series:%.*s:%s GET",
+			PMSIDSZ, wp->seriesid.name, chunk->str);
+	    solvermsg(sp, PMSERIES_REQUEST, msg);
+	    wp->next = wp->chunks->elements;
+	    return -EPROTO;
+	}
+	wp->next++;
+	wp->fetch++;
+	pending++;
+    }
+    return pending;
+}
+
+static int
+series_window_reply(SOLVER *sp, window_t *wp)
+{
+    redisReply	*reply;
+    char	msg[MSGSIZE];
+    int		sts = 0;
+
+    if (wp->asked && wp->legacy == NULL) {
+	if (redisGetReply(sp->redis, (void **)&reply) != REDIS_OK) {
+	    pmsprintf(msg, sizeof(msg), "failed series %.*s ZSET query",
+			PMSIDSZ, wp->seriesid.name);
+	    solvermsg(sp, PMSERIES_RESPONSE, msg);
+	    return -EPROTO;
+	}
+	if (reply->type != REDIS_REPLY_ARRAY) {
+	    pmsprintf(msg, sizeof(msg),
+			"expected array from %.*s zset values (type=%s)",
+			PMSIDSZ, wp->seriesid.name, redis_reply(reply->type));
+	    solvermsg(sp, PMSERIES_RESPONSE, msg);
+	    freeReplyObject(reply);
+	    return -EPROTO;
+	}
+	wp->legacy = reply;
+	return 0;
+    }
+
+    for (; wp->fetch > 0; wp->fetch--) {
+	if (redisGetReply(sp->redis, (void **)&reply) != REDIS_OK) {
+	    pmsprintf(msg, sizeof(msg), "failed series %.*s chunk query",
+			PMSIDSZ, wp->seriesid.name);
+	    solvermsg(sp, PMSERIES_RESPONSE, msg);
+	    sts = -EPROTO;
+	    continue;
+	}
+	if (reply->type == REDIS_REPLY_STRING) {
+	    if (chunk_decode(reply->str, reply->len, series_sample, wp) < 0) {
+		pmsprintf(msg, sizeof(msg), "bad chunk for series %.*s",
+			PMSIDSZ, wp->seriesid.name);
+		solvermsg(sp, PMSERIES_CORRUPT, msg);
+		sts = -EPROTO;
+	    }
+	} else if (reply->type != REDIS_REPLY_NIL) {
+	    pmsprintf(msg, sizeof(msg),
+			"expected string chunk for series %.*s (type=%s)",
+			PMSIDSZ, wp->seriesid.name, redis_reply(reply->type));
+	    solvermsg(sp, PMSERIES_RESPONSE, msg);
+	    sts = -EPROTO;
+	}
+	freeReplyObject(reply);
+    }
+    series_samples_sort(wp);
+    /* older samples than those wanted are never reported, so drop them */
+    if (wp->count > wp->limit)
+	wp->count = wp->limit;
+    return sts;
+}
+
+/*
+ * Functions of the values of each series - the values of the series
+ * in time order are passed through each function in turn, innermost
+ * first.  A last function across series ("by") is applied to groups
+ * of series, once the values of every series have been added.
+ */
+static int
+series_atom_double(int type, pmAtomValue *atom, double *value)
+{
+    switch (type) {
+    case PM_TYPE_32:
+	*value = atom->l;
+	break;
+    case PM_TYPE_U32:
+	*value = atom->ul;
+	break;
+    case PM_TYPE_64:
+	*value = atom->ll;
+	break;
+    case PM_TYPE_U64:
+	*value = atom->ull;
+	break;
+    case PM_TYPE_FLOAT:
+	*value = atom->f;
+	break;
+    case PM_TYPE_DOUBLE:
+	*value = atom->d;
+	break;
+    default:
+	return -EINVAL;
+    }
+    return 0;
+}
+
+/* samples of one series, oldest first, from the chunks or legacy ZSET */
+static int
+series_function_samples(SOLVER *sp, window_t *wp, samples_t *out)
+{
+    redisReply		*value, *score;
+    double		number;
+    char		msg[MSGSIZE], *end;
+    int			i, sts = 0;
+
+    if (wp->legacy) {
+	if (wp->legacy->elements % 2) {
+	    pmsprintf(msg, sizeof(msg),
+		    "expected time:value pairs from %.*s values ZSET",
+		    PMSIDSZ, wp->seriesid.name);
+	    solvermsg(sp, PMSERIES_RESPONSE, msg);
+	    return -EPROTO;
+	}
+	for (i = wp->legacy->elements - 2; i >= 0 && sts == 0; i -= 2) {
+	    value = wp->legacy->element[i];
+	    score = wp->legacy->element[i+1];
+	    if (value->type != REDIS_REPLY_STRING ||
+		score->type != REDIS_REPLY_STRING)
+		continue;
+	    number = strtod(value->str, &end);
+	    if (*end != '\0')
+		continue;
+	    sts = samples_append(out,
+			(long long)(strtod(score->str, NULL) * 1000000.0 + 0.5),
+			number);
+	}
+	return sts;
+    }
+
+    for (i = wp->count; i > 0 && sts == 0; i--) {
+	if (series_atom_double(wp->type, &wp->samples[i-1].atom, &number) < 0)
+	    break;	/* not a numeric series */
+	sts = samples_append(out, wp->samples[i-1].stamp, number);
+    }
+    return sts;
+}
+
+/* report a result, newest value first, as for the series values */
+static void
+series_function_values(SOLVER *sp, pmSeriesID *seriesid,
+		samples_t *result, timing_t *tp)
+{
+    unsigned int	i, n, last = tp->offset + tp->count;
+    pmAtomValue		atom;
+    char		timestamp[64], value[128];
+
+    for (i = result->count, n = 0; i > 0 && n < last; i--, n++) {
+	if (n < tp->offset)
+	    continue;
+	atom.d = result->values[i-1];
+	series_stamp(result->stamps[i-1], timestamp, sizeof(timestamp));
+	atom_string(PM_TYPE_DOUBLE, &atom, value, sizeof(value));
+	solvervalue(sp, seriesid, timestamp, value);
+    }
+}
+
+static int
+member_compare(const int *a, const int *b, unsigned int count)
+{
+    unsigned int	i;
+
+    for (i = 0; i < count; i++)
+	if (a[i] != b[i])
+	    return a[i] < b[i] ? -1 : 1;
+    return 0;
+}
+
+static void
+labels_append(char *buffer, size_t length, size_t *offset, const char *s)
+{
+    size_t		off = *offset;
+
+    for (; *s && off + 2 < length; s++) {
+	if (*s == '"' || *s == '\\')
+	    buffer[off++] = '\\';
+	buffer[off++] = *s;
+    }
+    buffer[off] = '\0';
+    *offset = off;
+}
+
+/* JSON names and values of the labels a group of series has in common */
+static char *
+series_group_labels(SOLVER *sp, int *members)
+{
+    byname_t		*bp;
+    char		labels[PM_MAXLABELJSONLEN];
+    size_t		off = 0;
+    unsigned int	i;
+
+    off += pmsprintf(labels, sizeof(labels), "{");
+    for (i = 0; i < sp->nbynames; i++) {
+	bp = &sp->bynames[i];
+	off += pmsprintf(labels + off, sizeof(labels) - off,
+			"%s\"", i ? "," : "");
+	labels_append(labels, sizeof(labels), &off, bp->name->value);
+	if (members[i] < 0) {
+	    off += pmsprintf(labels + off, sizeof(labels) - off, "\":null");
+	} else {
+	    off += pmsprintf(labels + off, sizeof(labels) - off, "\":\"");
+	    labels_append(labels, sizeof(labels), &off,
+			bp->values[members[i]].right->value);
+	    off += pmsprintf(labels + off, sizeof(labels) - off, "\"");
+	}
+    }
+    pmsprintf(labels + off, sizeof(labels) - off, "}");
+    return strdup(labels);
+}
+
+/* find, or else insert, the group for the given label values */
+static seriesgroup_t *
+series_group(SOLVER *sp, int *members)
+{
+    seriesgroup_t	*groups, *gp;
+    unsigned int	low = 0, high = sp->ngroups, middle, size;
+    int			sts;
+
+    while (low < high) {
+	middle = low + (high - low) / 2;
+	sts = member_compare(sp->groups[middle].members, members, sp->nbynames);
+	if (sts == 0)
+	    return &sp->groups[middle];
+	if (sts < 0)
+	    low = middle + 1;
+	else
+	    high = middle;
+    }
+
+    if (sp->ngroups == sp->groupsize) {
+	size = sp->groupsize ? sp->groupsize * 2 : 16;
+	if ((groups = realloc(sp->groups, size * sizeof(seriesgroup_t))) == NULL)
+	    return NULL;
+	sp->groups = groups;
+	sp->groupsize = size;
+    }
+    gp = &sp->groups[low];
+    memmove(gp + 1, gp, (sp->ngroups - low) * sizeof(seriesgroup_t));
+    memset(gp, 0, sizeof(seriesgroup_t));
+    if ((gp->members = calloc(sp->nbynames + 1, sizeof(int))) == NULL ||
+	(gp->labels = series_group_labels(sp, members)) == NULL) {
+	free(gp->members);
+	memmove(gp, gp + 1, (sp->ngroups - low) * sizeof(seriesgroup_t));
+	return NULL;
+    }
+    memcpy(gp->members, members, sp->nbynames * sizeof(int));
+    sp->ngroups++;
+    return gp;
+}
+
+/*
+ * Apply functions to the values of one series (the index-th of this
+ * page) and report the result - or, for an aggregate across series,
+ * add the mean of each time bucket to the group the series is in.
+ */
+static int
+series_function_reply(SOLVER *sp, window_t *wp, timing_t *tp, int index)
+{
+    samples_t		samples[2], *in = &samples[0], *out = &samples[1];
+    samples_t		*swap;
+    seriesgroup_t	*gp;
+    function_t		*fp, mean;
+    unsigned int	i, last = sp->nfunctions - (sp->grouped != 0);
+    char		msg[MSGSIZE];
+    int			sts;
+
+    memset(samples, 0, sizeof(samples));
+    if ((sts = series_function_samples(sp, wp, in)) < 0)
+	goto done;
+
+    for (i = 0; i < last; i++) {
+	fp = &sp->functions[i];
+	if (fp->type == N_RATE) {
+	    samples_rate(in);
+	    continue;
+	}
+	if ((sts = samples_reduce(fp, in, out)) < 0)
+	    goto done;
+	swap = in; in = out; out = swap;
+    }
+
+    if (!sp->grouped) {
+	series_function_values(sp, &wp->seriesid, in, tp);
+	goto done;
+    }
+
+    mean = sp->functions[last];
+    mean.type = N_AVG;
+    if ((sts = samples_reduce(&mean, in, out)) < 0)
+	goto done;
+    if ((gp = series_group(sp, sp->members + index * sp->nbynames)) == NULL)
+	sts = -ENOMEM;
+    else
+	sts = group_add(&gp->group, &sp->functions[last], out);
+
+done:
+    if (sts < 0) {
+	pmsprintf(msg, sizeof(msg), "failed %.*s functions: %s",
+			PMSIDSZ, wp->seriesid.name, pmErrStr(sts));
+	solvermsg(sp, PMSERIES_ERROR, msg);
+    }
+    samples_free(&samples[0]);
+    samples_free(&samples[1]);
+    return sts;
+}
+
+static int
+series_resolve_time(SOLVER *sp, timing_t *tp, int nseries, char *series)
+{
+    redisReply		*reply;
+    window_t		*windows, *wp;
+    char		msg[MSGSIZE];
+    unsigned int	round;
+    int			i, count, pending, sts = 0;
+
+/*--printf("{\n  \"result\": \"%s\",\n", series_result(nseries));
+    printf("  \"series\": {\n");--*TODO*/
+
+    if (nseries <= 0)
+	return 0;
+    if ((windows = calloc(nseries, sizeof(window_t))) == NULL) {
+	pmsprintf(msg, sizeof(msg), "out of memory for %d series", nseries);
+	solvermsg(sp, PMSERIES_ERROR, msg);
+	return -ENOMEM;
+    }
+
+    for (i = 0; i < nseries; i++, series += PMSIDSZ) {
+	wp = &windows[i];
+	memcpy(wp->seriesid.name, series, PMSIDSZ);
+	wp->seriesid.name[PMSIDSZ] = '\0';
+	wp->start = tp->start.tv_sec * 1000000LL + tp->start.tv_usec;
+	wp->end = tp->end.tv_sec ?
+		tp->end.tv_sec * 1000000LL + tp->end.tv_usec : LLONG_MAX;
+	/* functions need every value in the window */
+	wp->limit = sp->nfunctions ? UINT_MAX : tp->offset + tp->count;
+
+	if (redisGetReply(sp->redis, (void **)&reply) != REDIS_OK) {
+	    pmsprintf(msg, sizeof(msg), "failed series %.*s chunks query",
+			PMSIDSZ, series);
+	    solvermsg(sp, PMSERIES_RESPONSE, msg);
+	    sts = -EPROTO;
+	} else if (reply->type != REDIS_REPLY_ARRAY) {
+	    pmsprintf(msg, sizeof(msg),
+			"expected array from %.*s zset chunks (type=%s)",
+			PMSIDSZ, series, redis_reply(reply->type));
+	    solvermsg(sp, PMSERIES_RESPONSE, msg);
+	    freeReplyObject(reply);
+	    sts = -EPROTO;
+	} else {
+	    wp->chunks = reply;
+	}
+    }
+
+    /*
+     * Chunks cover disjoint time ranges, so once enough values are
+     * found in the newest ones the older ones are not needed.  Each
+     * round is one round trip for all series, with twice as many
+     * chunks per series as the last, up to a maximum - so the values
+     * held for each series are bounded by the count asked for plus
+     * one round of chunks (functions need every value in the window).
+     */
+    for (round = 1; ; round *= (round < MAXIMUM_ROUND_CHUNKS) ? 2 : 1) {
+	for (i = pending = 0; i < nseries; i++) {
+	    if ((count = series_window_fetch(sp, tp, &windows[i], round)) < 0)
+		sts = count;
+	    else
+		pending += count;
+	}
+	if (pending == 0)
+	    break;
+	for (i = 0; i < nseries; i++)
+	    sts |= series_window_reply(sp, &windows[i]);
+    }
+
+    for (i = 0; i < nseries; i++) {
+	wp = &windows[i];
+	if (sp->nfunctions)
+	    sts |= series_function_reply(sp, wp, tp, i);
+	else if (wp->legacy)
+	    sts |= series_values_reply(sp, &wp->seriesid,
+				wp->legacy->elements, wp->legacy->element);
+	else
+	    series_samples_reply(sp, wp, tp);
+	if (wp->legacy)
+	    freeReplyObject(wp->legacy);
+	if (wp->chunks)
+	    freeReplyObject(wp->chunks);
+	free(wp->samples);
+
+/*--	if (i + 1 < nseries)
+	    fputc(',', stdout);
+	fputc('\n', stdout);--*TODO*/
+    }
+    free(windows);
+/*--fputs("  }\n}\n", stdout);--*TODO*/
+
+    return sts;
+}
+
+void
+new_solver_replies(SOLVER *sp)
+{
+    sp->replies = calloc(sp->count, sizeof(redisReply *));
+    /* TODO: error handling */
+    sp->index = 0;
+}
+
+static void
+free_solver_replies(SOLVER *sp)
+{
+    /* replies kept while resolving, released per page when streaming */
+    while (sp->index > 0)
+	freeReplyObject(sp->replies[--sp->index]);
+    free(sp->replies);
+    sp->replies = NULL;
+    sp->count = 0;
+}
+
+static int
+series_report_set(SOLVER *sp, int nseries, char *series)
+{
+    pmSeriesID		seriesid;
     int			i;
 
 /*--printf("{\n  \"result\": \"%s\",\n", series_result(nseries));
@@ -856,14 +1639,352 @@ series_time_window(timing_t *tp)
     return 0;
 }
 
+/* PCP_SERIES_PAGE in environment sets series identifiers per page */
+static unsigned int
+series_page_size(SOLVER *sp)
+{
+    char	msg[MSGSIZE];
+    char	*value, *endnum;
+    long	size;
+
+    if ((value = getenv("PCP_SERIES_PAGE")) == NULL)
+	return DEFAULT_PAGE_SIZE;
+    size = strtol(value, &endnum, 10);
+    if (*endnum != '\0' || size < 1 || size > INT_MAX / PMSIDSZ) {
+	pmsprintf(msg, sizeof(msg), "ignored bad PCP_SERIES_PAGE (%s)", value);
+	solvermsg(sp, PMSERIES_WARNING, msg);
+	return DEFAULT_PAGE_SIZE;
+    }
+    return size;
+}
+
+static int
+series_function_node(node_t *np)
+{
+    switch (np->type) {
+    case N_RATE: case N_AVG: case N_COUNT: case N_MAX: case N_MIN:
+    case N_SUM:  case N_QUANTILE:
+	return 1;
+    default:
+	break;
+    }
+    return 0;
+}
+
+static const char *
+series_function_name(function_t *fp, char *buffer, size_t length)
+{
+    const char		*name;
+
+    switch (fp->type) {
+    case N_RATE:	name = "rate"; break;
+    case N_COUNT:	name = "count"; break;
+    case N_MAX:		name = "max"; break;
+    case N_MIN:		name = "min"; break;
+    case N_SUM:		name = "sum"; break;
+    case N_QUANTILE:
+	pmsprintf(buffer, length, "quantile(%.16g)", fp->quantile);
+	return buffer;
+    case N_AVG:
+    default:		name = "avg"; break;
+    }
+    pmsprintf(buffer, length, "%s", name);
+    return buffer;
+}
+
+/*
+ * Setup the functions at the root of a query, innermost first, for
+ * time buckets of the query interval (and alignment, if any).  The
+ * series the functions apply to are those of the operand beneath.
+ */
+static node_t *
+series_prepare_functions(SOLVER *sp, node_t *root, timing_t *tp)
+{
+    function_t		*fp;
+    node_t		*np;
+    char		msg[MSGSIZE];
+    unsigned int	count = 0;
+
+    for (np = root; np && series_function_node(np); np = np->left)
+	count++;
+    if (count == 0)
+	return root;
+    if ((sp->functions = calloc(count, sizeof(function_t))) == NULL) {
+	pmsprintf(msg, sizeof(msg), "out of memory for %u functions", count);
+	solvermsg(sp, PMSERIES_ERROR, msg);
+	return NULL;
+    }
+    sp->nfunctions = count;
+    sp->grouped = (root->subtype == N_GROUPBY);
+
+    for (np = root; np && series_function_node(np); np = np->left) {
+	fp = &sp->functions[--count];
+	fp->type = np->type;
+	if (np->type == N_QUANTILE)
+	    fp->quantile = strtod(np->value, NULL);
+	fp->width = tp->delta.tv_sec * 1000000LL + tp->delta.tv_usec;
+	if (tp->aligns)
+	    fp->origin = tp->align.tv_sec * 1000000LL + tp->align.tv_usec;
+    }
+    return np;
+}
+
+/*
+ * Find all of the values taken by each "by" name, from its map, and
+ * setup a leaf (series index) for each one.
+ */
+static int
+series_prepare_groups(SOLVER *sp, node_t *root)
+{
+    redisReply		*reply, *value, *id;
+    byname_t		*bp;
+    node_t		*np, *vp;
+    char		msg[MSGSIZE], key[128];
+    unsigned int	i, j, count = 0, pending = 0;
+    int			sts = 0;
+
+    for (np = root->right; np; np = np->right)
+	count++;
+    if (count == 0)
+	return 0;
+    if ((sp->bynames = calloc(count, sizeof(byname_t))) == NULL ||
+	(sp->members = calloc(count * sp->pagesize, sizeof(int))) == NULL) {
+	pmsprintf(msg, sizeof(msg), "out of memory for %u group names", count);
+	solvermsg(sp, PMSERIES_ERROR, msg);
+	return -ENOMEM;
+    }
+    sp->nbynames = count;
+
+    for (np = root->right, i = 0; np; np = np->right, i++) {
+	sp->bynames[i].name = np;
+	if (np->key == NULL)	/* name never mapped, no values */
+	    continue;
+	if (redisAppendCommand(sp->redis, "HGETALL %s", np->key) != REDIS_OK) {
+	    pmsprintf(msg, sizeof(msg), "failed %s HGETALL", np->key);
+	    solvermsg(sp, PMSERIES_REQUEST, msg);
+	    sts = -EPROTO;
+	    break;
+	}
+	pending++;
+    }
+
+    for (i = 0; i < sp->nbynames && pending > 0; i++) {
+	bp = &sp->bynames[i];
+	np = bp->name;
+	if (np->key == NULL)
+	    continue;
+	pending--;
+	if (redisGetReply(sp->redis, (void **)&reply) != REDIS_OK) {
+	    pmsprintf(msg, sizeof(msg), "failed %s values query", np->key);
+	    solvermsg(sp, PMSERIES_RESPONSE, msg);
+	    sts = -EPROTO;
+	    continue;
+	}
+	if (reply->type != REDIS_REPLY_ARRAY || reply->elements % 2) {
+	    pmsprintf(msg, sizeof(msg), "expected array for %s map (type=%s)",
+			np->key, redis_reply(reply->type));
+	    solvermsg(sp, PMSERIES_RESPONSE, msg);
+	    freeReplyObject(reply);
+	    sts = -EPROTO;
+	    continue;
+	}
+	if (reply->elements &&
+	    (bp->values = calloc(reply->elements / 2, sizeof(node_t))) == NULL) {
+	    freeReplyObject(reply);
+	    sts = -ENOMEM;
+	    continue;
+	}
+	for (j = 0; j < reply->elements; j += 2) {
+	    value = reply->element[j];
+	    id = reply->element[j+1];
+	    if (value->type != REDIS_REPLY_STRING ||
+		id->type != REDIS_REPLY_STRING)
+		continue;
+	    pmsprintf(key, sizeof(key), "pcp:series:%s:%s",
+			np->key + sizeof("pcp:map:") - 1, id->str);
+	    vp = &bp->values[bp->count];
+	    vp->type = N_EQ;
+	    vp->left = np;
+	    if ((vp->right = calloc(1, sizeof(node_t))) == NULL ||
+		(vp->right->value = strdup(value->str)) == NULL ||
+		(vp->key = strdup(key)) == NULL ||
+		(vp->cursor = calloc(1, sizeof(cursor_t))) == NULL) {
+		bp->count++;	/* partially setup, freed with the rest */
+		sts = -ENOMEM;
+		break;
+	    }
+	    vp->right->type = N_STRING;
+	    bp->count++;
+
+	    /* whole value index cached, no pages to read */
+	    if (sp->caching &&
+		index_cache_lookup(sp->generation, np->value, value->str,
+			&vp->cursor->ids, &vp->cursor->count)) {
+		vp->cursor->size = vp->cursor->count;
+		vp->cursor->done = 1;
+	    }
+	}
+	freeReplyObject(reply);
+    }
+    return sts;
+}
+
+/*
+ * Find the label values of each series in a page, for grouping.  All
+ * value leaves are first moved to the start of the page in a single
+ * round trip, after that most of them are found within leaf pages.
+ */
+static void
+series_group_page(SOLVER *sp, int nseries, char *page)
+{
+    cursor_t		*cp;
+    byname_t		*bp;
+    node_t		*vp;
+    const char		*series, *id;
+    unsigned int	i, j, k;
+    int			member, pass;
+
+    for (pass = 0; pass < 2; pass++) {
+	for (i = 0; i < sp->nbynames; i++) {
+	    bp = &sp->bynames[i];
+	    for (j = 0; j < bp->count; j++) {
+		vp = &bp->values[j];
+		cp = vp->cursor;
+		if (cp->done || (cp->count > 0 &&
+		    memcmp(cp->ids + (cp->count - 1) * PMSIDSZ,
+				page, PMSIDSZ) >= 0))
+		    continue;
+		if (pass == 1)
+		    node_series_page(sp, vp);
+		else if (node_series_request(sp, vp, page, 1) < 0) {
+		    cp->count = cp->index = 0;
+		    cp->done = 1;
+		}
+	    }
+	}
+    }
+
+    for (i = 0; i < nseries; i++) {
+	series = page + i * PMSIDSZ;
+	for (j = 0; j < sp->nbynames; j++) {
+	    bp = &sp->bynames[j];
+	    for (k = 0, member = -1; k < bp->count && member < 0; k++) {
+		vp = &bp->values[k];
+		series_seek(sp, vp, series);
+		if ((id = series_peek(sp, vp)) != NULL &&
+		    memcmp(id, series, PMSIDSZ) == 0)
+		    member = k;
+	    }
+	    sp->members[i * sp->nbynames + j] = member;
+	}
+    }
+}
+
+static int
+group_compare(const void *a, const void *b)
+{
+    const seriesgroup_t	*ga = (const seriesgroup_t *)a;
+    const seriesgroup_t	*gb = (const seriesgroup_t *)b;
+
+    return strcmp(ga->labels, gb->labels);
+}
+
+/*
+ * Report the aggregate for each group of series, in order of their
+ * labels - identified by the SHA1 hash of the function and labels.
+ */
+static int
+series_group_report(SOLVER *sp, timing_t *tp)
+{
+    seriesgroup_t	*gp;
+    function_t		*fp = &sp->functions[sp->nfunctions - 1];
+    samples_t		result = {0};
+    pmSeriesID		seriesid;
+    SHA1_CTX		shactx;
+    unsigned char	hash[20];
+    char		identifier[PM_MAXLABELJSONLEN+64];
+    char		name[64], msg[MSGSIZE];
+    unsigned int	i, j, off;
+    int			bytes, sts = 0;
+
+    qsort(sp->groups, sp->ngroups, sizeof(seriesgroup_t), group_compare);
+    for (i = 0; i < sp->ngroups; i++) {
+	gp = &sp->groups[i];
+	bytes = pmsprintf(identifier, sizeof(identifier), "%s%s",
+			series_function_name(fp, name, sizeof(name)),
+			gp->labels);
+	SHA1Init(&shactx);
+	SHA1Update(&shactx, (unsigned char *)identifier, bytes);
+	SHA1Final(hash, &shactx);
+	for (j = off = 0; j < sizeof(hash); j++)
+	    off += pmsprintf((char *)seriesid.name + off, sizeof(seriesid.name) - off,
+			"%02x", hash[j]);
+
+	if ((sts = group_reduce(&gp->group, fp, &result)) < 0) {
+	    pmsprintf(msg, sizeof(msg), "failed %s aggregate of %s: %s",
+			name, gp->labels, pmErrStr(sts));
+	    solvermsg(sp, PMSERIES_ERROR, msg);
+	    break;
+	}
+	if (sp->settings->on_labels)
+	    querylabels(sp->settings, &seriesid, gp->labels, sp->arg);
+	series_function_values(sp, &seriesid, &result, tp);
+    }
+    samples_free(&result);
+    return sts;
+}
+
+static void
+free_series_functions(SOLVER *sp)
+{
+    byname_t		*bp;
+    node_t		*vp;
+    unsigned int	i, j;
+
+    for (i = 0; i < sp->nbynames; i++) {
+	bp = &sp->bynames[i];
+	for (j = 0; j < bp->count; j++) {
+	    vp = &bp->values[j];
+	    if (vp->right) {
+		free(vp->right->value);
+		free(vp->right);
+	    }
+	    free(vp->key);
+	    vp->left = vp->right = NULL;
+	    free_series_cursors(vp);
+	}
+	free(bp->values);
+    }
+    for (i = 0; i < sp->ngroups; i++) {
+	free(sp->groups[i].members);
+	free(sp->groups[i].labels);
+	group_free(&sp->groups[i].group);
+    }
+    free(sp->groups);
+    free(sp->bynames);
+    free(sp->members);
+    free(sp->functions);
+}
+
 int
 series_solve(settings_t *settings,
 	node_t *root, timing_t *timing, pmseries_flags flags, void *arg)
 {
     SOLVER	solver = { .settings = settings, .arg = arg };
     SOLVER	*sp = &solver;
-
-    solver.redis = redis_init();
+    node_t	*expr = root;
+    const char	*series;
+    char	*page, msg[MSGSIZE];
+    int		nseries, values, sts = 0;
+
+    solver.redis = redis_init(&solver.version);
+    solver.pagesize = series_page_size(sp);
+
+    /* Whole series indices cached from earlier queries, if still valid */
+    if (redis_get_generation(solver.redis, &solver.generation) == 0) {
+	solver.caching = 1;
+	series_cache_lookup(sp, root);
+    }
 
     /* Resolve label and note key names (via their map keys) */
     if (pmDebugOptions.series)
@@ -873,6 +1994,17 @@ series_solve(settings_t *settings,
     series_resolve_maps(sp, root, 0);
     free_solver_replies(sp);
 
+    /* Functions of the values of the series (not of their metadata) */
+    if (flags & PMSERIES_METADATA) {
+	while (series_function_node(expr))
+	    expr = expr->left;
+    } else if ((expr = series_prepare_functions(sp, root, timing)) == NULL) {
+	sts = -ENOMEM;
+	goto done;
+    } else if (sp->grouped && (sts = series_prepare_groups(sp, root)) < 0) {
+	goto done;
+    }
+
     /* Resolve sets of series identifiers for leaf nodes */
     if (pmDebugOptions.series)
 	fprintf(stderr, "series_eval\n");
@@ -881,29 +2013,68 @@ series_solve(settings_t *settings,
     series_resolve_eval(sp, root, 0);
     free_solver_replies(sp);
 
-    /* Perform final matching (set of) series solving */
+    /* Fetch the first page of series identifiers for leaf nodes */
     if (pmDebugOptions.series)
 	fprintf(stderr, "series_expr\n");
     series_prepare_expr(sp, root, 0);
     new_solver_replies(sp);
-    series_resolve_expr(sp, root, 0);
+    sts = series_resolve_expr(sp, root, 0);
     free_solver_replies(sp);
+    if (sts < 0)
+	goto done;
 
-    /* Report the matching series ids, unless time window given */
-    if ((flags & PMSERIES_METADATA) || !series_time_window(timing)) {
-	series_report_set(sp, root->nseries, root->series);
-	return 0;
+    if ((page = malloc(solver.pagesize * PMSIDSZ)) == NULL) {
+	pmsprintf(msg, sizeof(msg), "out of memory for %u series page",
+			solver.pagesize);
+	solvermsg(sp, PMSERIES_ERROR, msg);
+	sts = -ENOMEM;
+	goto done;
     }
 
-    /* Extract values within the given time window */
-    if (pmDebugOptions.series)
-	fprintf(stderr, "series_time\n");
-    series_prepare_time(sp, timing, root->nseries, root->series);
-    new_solver_replies(sp);
-    series_resolve_time(sp, root->nseries, root->series);
-    free_solver_replies(sp);
+    /*
+     * Perform final matching (set of) series solving, one page at a
+     * time, reporting the matching series ids - or their values in
+     * the time window, if one was given or functions are applied.
+     */
+    values = !(flags & PMSERIES_METADATA) &&
+		(series_time_window(timing) || sp->nfunctions);
+    do {
+	for (nseries = 0; nseries < solver.pagesize; nseries++) {
+	    if ((series = series_peek(sp, expr)) == NULL)
+		break;
+	    memcpy(page + nseries * PMSIDSZ, series, PMSIDSZ);
+	    series_next(sp, expr);
+	}
+	if (nseries == 0)
+	    break;
 
-    return 0;
+	if (!values) {
+	    series_report_set(sp, nseries, page);
+	    continue;
+	}
+
+	/* Extract values within the given time window */
+	if (pmDebugOptions.series)
+	    fprintf(stderr, "series_time\n");
+	if (sp->nbynames)
+	    series_group_page(sp, nseries, page);
+	series_prepare_time(sp, timing, nseries, page);
+	new_solver_replies(sp);
+	series_resolve_time(sp, timing, nseries, page);
+	free_solver_replies(sp);
+    } while (nseries == solver.pagesize);
+
+    if (sp->grouped)
+	sts = series_group_report(sp, timing);
+    free(page);
+
+done:
+    if (pmDebugOptions.series && solver.caching)
+	series_cache_report(sp);
+    free_series_functions(sp);
+    free_series_cursors(root);
+    redis_stop(solver.redis);
+    return sts;
 }
 
 /* build a reverse hash mapping */
@@ -1044,7 +2215,7 @@ void
 pmSeriesLabel(pmSeriesSettings *settings,
 	int nseries, pmSeriesID *series, void *arg)
 {
-    redisContext	*redis = redis_init();
+    redisContext	*redis = redis_init(NULL);
     redisReply		*reply, *rp;
     pmSeriesID		seriesid;
     reverseMap		map;
@@ -1250,7 +2421,7 @@ void
 pmSeriesMetric(pmSeriesSettings *settings,
 	int nseries, pmSeriesID *series, void *arg)
 {
-    redisContext	*redis = redis_init();
+    redisContext	*redis = redis_init(NULL);
     redisReply		*reply, *rp;
     reverseMap		map;
     char		*cmd;
@@ -1458,7 +2629,7 @@ void
 pmSeriesDesc(pmSeriesSettings *settings,
 	int nseries, pmSeriesID *series, void *arg)
 {
-    redisContext	*redis = redis_init();
+    redisContext	*redis = redis_init(NULL);
     redisReply		*reply;
     char		msg[MSGSIZE];
     char		*cmd;
@@ -1605,7 +2776,7 @@ void
 pmSeriesInstance(pmSeriesSettings *settings,
 	int nseries, pmSeriesID *series, void *arg)
 {
-    redisContext	*redis = redis_init();
+    redisContext	*redis = redis_init(NULL);
     redisReply		*reply, *rp;
     reverseMap		map;
     char		*cmd;
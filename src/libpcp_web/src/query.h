@@ -37,6 +37,7 @@ typedef struct node {
     char		*key;
     int			nseries;
     void		*series;
+    struct cursor	*cursor;	/* stream of matching series */
 } node_t;
 
 typedef struct timing {
@@ -109,6 +110,7 @@ extern char *series_note_name(char *, size_t);
 #define N_RESCALE	29
 #define N_SCALE		30
 #define N_DEFINED	31
+#define N_QUANTILE	32
 
 /* node_t time-related sub-types */
 #define N_RANGE		100
@@ -126,4 +128,7 @@ extern char *series_note_name(char *, size_t);
 #define N_INSTANCE	202
 #define N_LABEL		203
 
+/* node_t function-related sub-types */
+#define N_GROUPBY	300	/* aggregate across series, by names */
+
 #endif	/* SERIES_QUERY_H */
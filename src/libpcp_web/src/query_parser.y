@@ -49,6 +49,7 @@ static node_t *newnode(int);
 static node_t *newmetric(char *);
 static node_t *newmetricquery(char *, node_t *);
 static node_t *newtree(int, node_t *, node_t *);
+static node_t *newquantile(PARSER *, node_t *, node_t *);
 static void newaligntime(PARSER *, const char *);
 static void newstarttime(PARSER *, const char *);
 static void newinterval(PARSER *, const char *);
@@ -107,6 +108,8 @@ static const char initial_str[]  = "Unexpected initial";
 %token      L_ANON
 %token      L_RATE
 %token      L_INSTANT
+%token      L_QUANTILE
+%token      L_BY
 %token      L_LT
 %token      L_LEQ
 %token      L_EQ
@@ -151,6 +154,10 @@ static const char initial_str[]  = "Unexpected initial";
 %type  <n>  string
 %type  <s>  timespec
 %type  <n>  vector
+%type  <n>  operand
+%type  <n>  function
+%type  <n>  aggregate
+%type  <n>  namelist
 
 %left  L_AND L_OR
 %left  L_LT L_LEQ L_EQ L_COLON L_ASSIGN L_GEQ L_GT L_NEQ L_REQ L_RNE
@@ -163,39 +170,88 @@ static const char initial_str[]  = "Unexpected initial";
  * yacc productions
  ***********************************************************************/
 
-query	: vector
-	| L_NAME L_ASSIGN vector
+query	: vector L_EOS
+		{ lp->yy_series.expr = $1; YYACCEPT; }
+	| L_NAME L_ASSIGN vector L_EOS
 		{ lp->yy_series.name = $1;
-		  $$ = lp->yy_series.expr;
+		  $$ = lp->yy_series.expr = $3;
 		  YYACCEPT;
 		}
-	/* TODO: vector expressions (many) */
-	;
-
-vector:	L_NAME L_LBRACE exprlist L_RBRACE L_EOS
-		{ lp->yy_np = newmetricquery($1, $3);
+	| function L_EOS
+		{ lp->yy_series.expr = $1; YYACCEPT; }
+	| aggregate L_BY L_LPAREN namelist L_RPAREN L_EOS
+		{ lp->yy_np = $1;
+		  lp->yy_np->subtype = N_GROUPBY;
+		  lp->yy_np->right = $4;
 		  $$ = lp->yy_series.expr = lp->yy_np;
 		  YYACCEPT;
 		}
-	| L_NAME L_LBRACE exprlist L_RBRACE L_LSQUARE timelist L_RSQUARE L_EOS
-		{ lp->yy_np = newmetricquery($1, $3);
+	| aggregate L_BY L_LPAREN L_RPAREN L_EOS
+		{ lp->yy_np = $1;
+		  lp->yy_np->subtype = N_GROUPBY;
 		  $$ = lp->yy_series.expr = lp->yy_np;
 		  YYACCEPT;
 		}
-	| L_LBRACE exprlist L_RBRACE L_LSQUARE timelist L_RSQUARE L_EOS
-		{ lp->yy_np = lp->yy_series.expr = $2; YYACCEPT; }
-	| L_LBRACE exprlist L_RBRACE L_EOS
-		{ lp->yy_np = lp->yy_series.expr = $2; YYACCEPT; }
-	| L_NAME L_LSQUARE timelist L_RSQUARE L_EOS
-		{ lp->yy_np = newmetric($1);
-		  $$ = lp->yy_series.expr = lp->yy_np;
-		  YYACCEPT;
+	/* TODO: vector expressions (many) */
+	;
+
+vector:	L_NAME L_LBRACE exprlist L_RBRACE
+		{ $$ = lp->yy_np = newmetricquery($1, $3); }
+	| L_NAME L_LBRACE exprlist L_RBRACE L_LSQUARE timelist L_RSQUARE
+		{ $$ = lp->yy_np = newmetricquery($1, $3); }
+	| L_LBRACE exprlist L_RBRACE L_LSQUARE timelist L_RSQUARE
+		{ $$ = lp->yy_np = $2; }
+	| L_LBRACE exprlist L_RBRACE
+		{ $$ = lp->yy_np = $2; }
+	| L_NAME L_LSQUARE timelist L_RSQUARE
+		{ $$ = lp->yy_np = newmetric($1); }
+	| L_NAME
+		{ $$ = lp->yy_np = newmetric($1); }
+	;
+
+operand	: vector
+	| function
+	;
+
+function : /* functions of the values of each series */
+	  L_RATE L_LPAREN operand L_RPAREN
+		{ $$ = lp->yy_np = newtree(N_RATE, $3, NULL); }
+	| aggregate
+	;
+
+aggregate : /* over time buckets, or across series with "by" */
+	  L_AVG L_LPAREN operand L_RPAREN
+		{ $$ = lp->yy_np = newtree(N_AVG, $3, NULL); }
+	| L_COUNT L_LPAREN operand L_RPAREN
+		{ $$ = lp->yy_np = newtree(N_COUNT, $3, NULL); }
+	| L_MAX L_LPAREN operand L_RPAREN
+		{ $$ = lp->yy_np = newtree(N_MAX, $3, NULL); }
+	| L_MIN L_LPAREN operand L_RPAREN
+		{ $$ = lp->yy_np = newtree(N_MIN, $3, NULL); }
+	| L_SUM L_LPAREN operand L_RPAREN
+		{ $$ = lp->yy_np = newtree(N_SUM, $3, NULL); }
+	| L_QUANTILE L_LPAREN number L_COMMA operand L_RPAREN
+		{ lp->yy_np = newquantile(lp, $3, $5);
+		  if (lp->yy_np == NULL)
+		      YYABORT;
+		  $$ = lp->yy_np;
 		}
-	| L_NAME L_EOS
-		{ lp->yy_np = newmetric($1);
-		  $$ = lp->yy_series.expr = lp->yy_np;
-		  YYACCEPT;
+	;
+
+namelist : namelist L_COMMA L_NAME
+		{ node_t *np = $1;
+		  while (np->right)
+		      np = np->right;
+		  np->right = newnode(N_NAME);
+		  np->right->value = $3;
+		  $$ = $1;
+		}
+	| L_NAME
+		{ lp->yy_np = newnode(N_NAME);
+		  lp->yy_np->value = $1;
+		  $$ = lp->yy_np;
 		}
+	;
 
 exprlist : exprlist L_COMMA expr
 		{ lp->yy_np = newnode(N_AND);
@@ -403,6 +459,7 @@ static const struct {
     { L_MIN,    sizeof("min")-1,	"min" },
     { L_SUM,    sizeof("sum")-1,	"sum" },
     { L_RATE,   sizeof("rate")-1,	"rate" },
+    { L_QUANTILE, sizeof("quantile")-1,	"quantile" },
     { L_UNDEF,  0,			NULL }
 };
 
@@ -443,6 +500,8 @@ static struct {
     { L_ANON,		N_ANON,		"ANON",		NULL },
     { L_RATE,		N_RATE,		"RATE",		NULL },
     { L_INSTANT,	N_INSTANT,	"INSTANT",	NULL },
+    { L_QUANTILE,	N_QUANTILE,	"QUANTILE",	NULL },
+    { L_BY,		0,		"BY",		NULL },
     { L_MKCONST,	0,		"MKCONST",	NULL },
     { L_RESCALE,	N_RESCALE,	"RESCALE",	NULL },
     { 0,		N_SCALE,	"SCALE",	NULL },
@@ -532,6 +591,26 @@ newtree(int type, node_t *left, node_t *right)
     return tree;
 }
 
+/* quantile(q, operand) - q is kept as the node value */
+static node_t *
+newquantile(PARSER *lp, node_t *quantile, node_t *operand)
+{
+    node_t	*np;
+    char	*end;
+    double	q;
+
+    q = strtod(quantile->value, &end);
+    if (*end != '\0' || q < 0.0 || q > 1.0) {
+	lp->yy_errstr = "Quantile must be from 0 to 1";
+	lp->yy_error = -EINVAL;
+	return NULL;
+    }
+    np = newtree(N_QUANTILE, operand, NULL);
+    np->value = quantile->value;
+    free(quantile);
+    return np;
+}
+
 static node_t *
 newmetric(char *name)
 {
@@ -1030,6 +1109,10 @@ series_lex(YYSTYPE *lvalp, PARSER *lp)
 		    ret = L_OFFSET;
 		    break;
 		}
+		else if (strcmp(lp->yy_tokbuf, "by") == 0) {
+		    ret = L_BY;
+		    break;
+		}
 		else if (strcmp(lp->yy_tokbuf, "align") == 0 ||
 			 strcmp(lp->yy_tokbuf, "alignment") == 0) {
 		    ret = L_ALIGN;
@@ -1179,7 +1262,12 @@ series_dumpexpr(node_t *np, int level)
 	break;
     case N_AVG: case N_COUNT:   case N_DELTA:   case N_MAX:     case N_MIN:
     case N_SUM: case N_ANON:    case N_RATE:    case N_INSTANT: case N_RESCALE:
-	fprintf(stderr, "%*s%s()", level*4, "", n_type_str(np->type));
+	fprintf(stderr, "%*s%s()%s", level*4, "", n_type_str(np->type),
+		np->subtype == N_GROUPBY ? " by" : "");
+	break;
+    case N_QUANTILE:
+	fprintf(stderr, "%*s%s(%s)%s", level*4, "", n_type_str(np->type),
+		np->value, np->subtype == N_GROUPBY ? " by" : "");
 	break;
     case N_SCALE: {
 	char	strbuf[60];
@@ -11,11 +11,16 @@
  * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
  * for more details.
  */
+#include <limits.h>
+#include <pthread.h>
 #include <hiredis/hiredis.h>
 #include "redis.h"
+#include "chunk.h"
+#include "slots.h"
 #include "util.h"
+#include "libpcp.h"
 
-#define PCP_SCHEMA_VERSION 1
+#define DEFAULT_BATCH	1024	/* commands queued per flush */
 
 typedef struct redis_script {
     const char	*script;
@@ -44,6 +49,26 @@ enum {
     NSCRIPTS
 };
 
+static pthread_mutex_t	scripts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * String map identifiers and series already described, shared by all
+ * the threads of one load so each is sent to Redis just the once.
+ * This lives only as long as the load, so a Redis server reset
+ * between loads cannot leave stale identifiers here.
+ */
+typedef struct redisCache {
+    pthread_mutex_t	lock;
+    __pmHashCtl		maps;		/* map name and string -> ID */
+    __pmHashCtl		series;		/* series with metadata loaded */
+} redisCache;
+
+typedef struct {
+    int			id;
+    char		*value;		/* follows the map name and NUL */
+    char		map[1];
+} strmapEntry;
+
 static void
 redis_load_scripts(redisContext *redis)
 {
@@ -51,6 +76,13 @@ redis_load_scripts(redisContext *redis)
     char	*cmd;
     int		i, len, sts;
 
+    /* script hashes are the same for every connection */
+    pthread_mutex_lock(&scripts_lock);
+    if (scripts[0].hash != NULL) {
+	pthread_mutex_unlock(&scripts_lock);
+	return;
+    }
+
     for (i = 0; i < NSCRIPTS; i++) {
 	len = redisFormatCommand(&cmd, "SCRIPT LOAD %s", scripts[i].script);
 	if (redisAppendFormattedCommand(redis, cmd, len) != REDIS_OK) {
@@ -77,6 +109,7 @@ redis_load_scripts(redisContext *redis)
 	if (pmDebugOptions.series)
 	    fprintf(stderr, "Registered script[%d] as %s\n", i, scripts[i].hash);
     }
+    pthread_mutex_unlock(&scripts_lock);
 }
 
 static void
@@ -109,18 +142,130 @@ checkInteger(redisReply *reply, const char *format, ...)
     exit(1);
 }
 
+redisCache *
+redis_cache_init(void)
+{
+    redisCache	*cache;
+
+    if ((cache = (redisCache *)calloc(1, sizeof(redisCache))) == NULL) {
+	fprintf(stderr, "%s: out of memory for Redis cache\n", pmGetProgname());
+	exit(1);
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    __pmHashInit(&cache->maps);
+    __pmHashInit(&cache->series);
+    return cache;
+}
+
+static __pmHashWalkState
+redis_cache_release(const __pmHashNode *tp, void *cp)
+{
+    free(tp->data);
+    return PM_HASH_WALK_DELETE_NEXT;
+}
+
+void
+redis_cache_free(redisCache *cache)
+{
+    __pmHashWalkCB(redis_cache_release, NULL, &cache->maps);
+    __pmHashClear(&cache->maps);
+    __pmHashWalkCB(redis_cache_release, NULL, &cache->series);
+    __pmHashClear(&cache->series);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+#define STRHASH_INIT	2166136261U
+
+/* FNV-1a, with a NUL after each string hashed */
+static unsigned int
+strhash(const char *string, unsigned int hash)
+{
+    while (*string)
+	hash = (hash ^ (unsigned char)*string++) * 16777619U;
+    return hash * 16777619U;
+}
+
+static strmapEntry *
+strmap_search(redisCache *cache, unsigned int hash, const char *map,
+		const char *value)
+{
+    __pmHashNode	*hp;
+    strmapEntry		*entry;
+
+    for (hp = __pmHashSearch(hash, &cache->maps); hp != NULL; hp = hp->next) {
+	if (hp->key != hash)
+	    continue;
+	entry = (strmapEntry *)hp->data;
+	if (strcmp(entry->map, map) == 0 && strcmp(entry->value, value) == 0)
+	    return entry;
+    }
+    return NULL;
+}
+
+/*
+ * Returns 1 if the metadata for this series has been loaded already,
+ * else remembers it (the caller is about to load it) and returns 0.
+ */
+int
+redis_cache_series(redisCache *cache, const char *hash)
+{
+    __pmHashNode	*hp;
+    unsigned int	key = strhash(hash, STRHASH_INIT);
+    char		*copy;
+    int			seen = 0;
+
+    pthread_mutex_lock(&cache->lock);
+    for (hp = __pmHashSearch(key, &cache->series); hp != NULL; hp = hp->next) {
+	if (hp->key == key && strcmp((char *)hp->data, hash) == 0) {
+	    seen = 1;
+	    break;
+	}
+    }
+    if (!seen && (copy = strdup(hash)) != NULL &&
+	__pmHashAdd(key, copy, &cache->series) < 0)
+	free(copy);
+    pthread_mutex_unlock(&cache->lock);
+    return seen;
+}
+
 static int
-redis_strmap(redisContext *redis, char *map, char *value)
+redis_strmap(redisBatch *batch, char *map, char *value)
 {
+    redisCache	*cache = batch->cache;
     redisReply	*reply;
+    strmapEntry	*entry;
+    size_t	maplen = strlen(map), length;
+    unsigned int hash = strhash(value, strhash(map, STRHASH_INIT));
     int		mapID;
 
-    reply = redisCommand(redis,
+    pthread_mutex_lock(&cache->lock);
+    entry = strmap_search(cache, hash, map, value);
+    mapID = entry ? entry->id : 0;
+    pthread_mutex_unlock(&cache->lock);
+    if (mapID)
+	return mapID;
+
+    reply = redisCommand(batch->redis,
 			"EVALSHA %s 1 %s %s",
 			scripts[HASH_MAP_ID].hash, map, value);
     if (reply && reply->type == REDIS_REPLY_INTEGER) {
 	mapID = reply->integer;
 	freeReplyObject(reply);
+
+	/* another thread may have mapped it meanwhile, to the same ID */
+	length = sizeof(strmapEntry) + maplen + 1 + strlen(value);
+	pthread_mutex_lock(&cache->lock);
+	if (strmap_search(cache, hash, map, value) == NULL &&
+	    (entry = (strmapEntry *)malloc(length)) != NULL) {
+	    entry->id = mapID;
+	    strcpy(entry->map, map);
+	    entry->value = entry->map + maplen + 1;
+	    strcpy(entry->value, value);
+	    if (__pmHashAdd(hash, entry, &cache->maps) < 0)
+		free(entry);
+	}
+	pthread_mutex_unlock(&cache->lock);
 	return mapID;
     }
 
@@ -129,14 +274,160 @@ redis_strmap(redisContext *redis, char *map, char *value)
     exit(1);
 }
 
+static redisPipe *
+redis_batch_pipe(redisBatch *batch, const char *key)
+{
+    redisContext	*redis;
+    redisPipe		*pp;
+
+    if ((redis = redisGet(batch->slots, key, strlen(key))) == NULL) {
+	fprintf(stderr, "%s: no Redis server for %s\n", pmGetProgname(), key);
+	exit(1);
+    }
+    for (pp = batch->pipes; pp != NULL; pp = pp->next)
+	if (pp->redis == redis)
+	    return pp;
+
+    if ((pp = (redisPipe *)calloc(1, sizeof(redisPipe))) == NULL) {
+	fprintf(stderr, "%s: out of memory for Redis pipeline\n",
+		pmGetProgname());
+	exit(1);
+    }
+    pp->redis = redis;
+    pp->next = batch->pipes;
+    batch->pipes = pp;
+    return pp;
+}
+
+/*
+ * Queue a command to the server for key, the reply (of the given
+ * type) is checked when the batch is flushed.
+ */
+static void
+redis_batch_append(redisBatch *batch, const char *key, int type,
+		const char *format, ...)
+{
+    redisPending	*pending;
+    redisPipe		*pp = redis_batch_pipe(batch, key);
+    va_list		arg;
+    size_t		size;
+    int			sts;
+
+    va_start(arg, format);
+    sts = redisvAppendCommand(pp->redis, format, arg);
+    va_end(arg);
+    if (sts != REDIS_OK) {
+	fprintf(stderr, "%s: failed to queue %s update: %s\n",
+		pmGetProgname(), key, pp->redis->errstr);
+	exit(1);
+    }
+
+    if (pp->count == pp->maxcount) {
+	pp->maxcount = pp->maxcount ? pp->maxcount * 2 : batch->size;
+	size = pp->maxcount * sizeof(redisPending);
+	if ((pending = (redisPending *)realloc(pp->pending, size)) == NULL) {
+	    fprintf(stderr, "%s: out of memory for Redis pipeline\n",
+		    pmGetProgname());
+	    exit(1);
+	}
+	pp->pending = pending;
+    }
+    pending = &pp->pending[pp->count++];
+    pending->type = type;
+    pmsprintf(pending->key, sizeof(pending->key), "%s", key);
+    batch->commands++;
+    batch->queued++;
+}
+
+/*
+ * Send all queued commands and check the replies, one round trip
+ * per server.  Series may have been added, so the store generation
+ * is then updated - queries running during a long load must not
+ * keep using indices they cached before this batch.
+ */
 void
-redis_series_desc(redisContext *redis, metric_t *metric, value_t *value)
+redis_batch_flush(redisBatch *batch)
 {
-    redisReply	*reply;
+    redisPending	*pending;
+    redisReply		*reply;
+    redisPipe		*pp;
+    unsigned int	i, flushed = 0;
+
+    for (pp = batch->pipes; pp != NULL; pp = pp->next) {
+	if (pp->count == 0)
+	    continue;
+	for (i = 0; i < pp->count; i++) {
+	    pending = &pp->pending[i];
+	    if (redisGetReply(pp->redis, (void **)&reply) != REDIS_OK) {
+		fprintf(stderr, "%s: no reply for %s update: %s\n",
+			pmGetProgname(), pending->key, pp->redis->errstr);
+		exit(1);
+	    }
+	    if (pending->type == REDIS_REPLY_STATUS)
+		checkStatusOK(reply, "%s setup\n", pending->key);
+	    else
+		checkInteger(reply, "%s update\n", pending->key);
+	    freeReplyObject(reply);
+	}
+	pp->count = 0;
+	batch->flushes++;
+	flushed++;
+    }
+    batch->queued = 0;
+    if (flushed)
+	redis_update_generation(batch->redis);
+}
+
+/*
+ * Called between results, flushes once enough commands are queued.
+ */
+void
+redis_batch_check(redisBatch *batch)
+{
+    if (batch->queued >= batch->size)
+	redis_batch_flush(batch);
+}
 
+void
+redis_batch_stats(redisBatch *batch, char *buffer, size_t length)
+{
+    struct timeval	now;
+    double		elapsed;
+
+    gettimeofday(&now, NULL);
+    elapsed = pmtimevalSub(&now, &batch->start);
+    pmsprintf(buffer, length, "loaded %llu values in %.3f sec "
+		"(%.0f values/sec), %llu commands in %llu round trips",
+		batch->values, elapsed,
+		elapsed > 0 ? batch->values / elapsed : 0.0,
+		batch->commands, batch->flushes);
+}
+
+/*
+ * Add a series to one of the indices of series, from schema version 3
+ * these are zsets (all scores zero) so queries can page through them
+ * in order.
+ */
+static void
+redis_series_index(redisBatch *batch, const char *key, const char *hash)
+{
+    if (batch->version >= PCP_SCHEMA_LEXSETS)
+	redis_batch_append(batch, key, REDIS_REPLY_INTEGER,
+		"ZADD %s 0 %s", key, hash);
+    else
+	redis_batch_append(batch, key, REDIS_REPLY_INTEGER,
+		"SADD %s %s", key, hash);
+}
+
+void
+redis_series_desc(redisBatch *batch, metric_t *metric, value_t *value)
+{
+    char	key[128];
+
+    pmsprintf(key, sizeof(key), "pcp:desc:series:%s", value->hash);
     if (metric->desc.indom != PM_INDOM_NULL) {
-	reply = redisCommand(redis,
-		"HMSET pcp:desc:series:%s"
+	redis_batch_append(batch, key, REDIS_REPLY_STATUS,
+		"HMSET %s"
 		" cluster %u"
 		" domain %u"
 		" item %u"
@@ -144,7 +435,7 @@ redis_series_desc(redisContext *redis, metric_t *metric, value_t *value)
 		" serial %d"
 		" type %u"
 		" units %s",
-	    value->hash,
+	    key,
 	    pmID_cluster(metric->desc.pmid),
 	    pmID_domain(metric->desc.pmid),
 	    pmID_item(metric->desc.pmid),
@@ -153,15 +444,15 @@ redis_series_desc(redisContext *redis, metric_t *metric, value_t *value)
 	    metric->desc.type,
 	    pmUnitsStr(&metric->desc.units));
     } else {
-	reply = redisCommand(redis,
-		"HMSET pcp:desc:series:%s"
+	redis_batch_append(batch, key, REDIS_REPLY_STATUS,
+		"HMSET %s"
 		" cluster %u"
 		" domain %u"
 		" item %u"
 		" semantics %u"
 		" type %u"
 		" units %s",
-	    value->hash,
+	    key,
 	    pmID_cluster(metric->desc.pmid),
 	    pmID_domain(metric->desc.pmid),
 	    pmID_item(metric->desc.pmid),
@@ -169,69 +460,60 @@ redis_series_desc(redisContext *redis, metric_t *metric, value_t *value)
 	    metric->desc.type,
 	    pmUnitsStr(&metric->desc.units));
     }
-    checkStatusOK(reply, "pcp:desc:series:%s setup\n", value->hash);
-    freeReplyObject(reply);
 }
 
 void
-redis_series_inst(redisContext *redis, metric_t *metric, value_t *value)
+redis_series_inst(redisBatch *batch, metric_t *metric, value_t *value)
 {
-    redisReply	*reply;
+    char	key[128];
     int		mapID;
 
     if (!value->name)
 	return;
-    mapID = redis_strmap(redis, "pcp:map:inst.name", value->name);
+    mapID = redis_strmap(batch, "pcp:map:inst.name", value->name);
 
-    reply = redisCommand(redis,
-		"HMSET pcp:inst:series:%s id %u name %u",
-		value->hash, value_instid(value), mapID);
-    checkStatusOK(reply, "pcp:inst:series:%s setup\n", value->hash);
-    freeReplyObject(reply);
+    pmsprintf(key, sizeof(key), "pcp:inst:series:%s", value->hash);
+    redis_batch_append(batch, key, REDIS_REPLY_STATUS,
+		"HMSET %s id %u name %u", key, value_instid(value), mapID);
 
-    reply = redisCommand(redis,
-		"SADD pcp:series:inst.name:%u %s", mapID, value->hash);
-    checkInteger(reply, "pcp:series:inst.name:%u (sadd %s)\n", mapID, value->hash);
-    freeReplyObject(reply);
+    pmsprintf(key, sizeof(key), "pcp:series:inst.name:%u", mapID);
+    redis_series_index(batch, key, value->hash);
 }
 
 static int
-redis_series_name(redisContext *redis, metric_t *mp, int index, value_t *value)
+redis_series_name(redisBatch *batch, metric_t *mp, int index, value_t *value)
 {
-    redisReply	*reply;
+    char	key[128];
     char	*name = mp->names[index];
     int		mapID = mp->mapids[index];
 
     if (!name)
 	return -EINVAL;
     if (!mapID) {
-	mapID = redis_strmap(redis, "pcp:map:metric.name", name);
+	mapID = redis_strmap(batch, "pcp:map:metric.name", name);
 	mp->mapids[index] = mapID;
     }
 
-    reply = redisCommand(redis,
-		"SADD pcp:metric.name:series:%s %u", value->hash, mapID);
-    checkInteger(reply, "pcp:series:metric.name:%s (sadd %u)\n", value->hash, mapID);
-    freeReplyObject(reply);
+    pmsprintf(key, sizeof(key), "pcp:metric.name:series:%s", value->hash);
+    redis_batch_append(batch, key, REDIS_REPLY_INTEGER,
+		"SADD %s %u", key, mapID);
 
-    reply = redisCommand(redis,
-		"SADD pcp:series:metric.name:%u %s", mapID, value->hash);
-    checkInteger(reply, "pcp:series:metric.name:%u (sadd %s)\n", mapID, value->hash);
-    freeReplyObject(reply);
+    pmsprintf(key, sizeof(key), "pcp:series:metric.name:%u", mapID);
+    redis_series_index(batch, key, value->hash);
     return 0;
 }
 
 static void
-redis_series_pmns(redisContext *redis, metric_t *metric, value_t *value)
+redis_series_pmns(redisBatch *batch, metric_t *metric, value_t *value)
 {
     int		i;
 
     for (i = 0; i < metric->numnames; i++)
-	redis_series_name(redis, metric, i, value);
+	redis_series_name(batch, metric, i, value);
 }
 
 typedef struct {
-    redisContext	*redis;
+    redisBatch		*batch;
     metric_t		*metric;
     value_t		*value;
     const char		*type;
@@ -240,7 +522,6 @@ typedef struct {
 static int
 cache_annotation(const pmLabel *label, const char *json, annotate_t *my)
 {
-    redisReply	*reply;
     const char	*offset;
     size_t	length;
     char	key[256];
@@ -251,7 +532,7 @@ cache_annotation(const pmLabel *label, const char *json, annotate_t *my)
     offset = json + label->name;
     snprintf(val, sizeof(val), "%.*s", label->namelen, offset);
     snprintf(key, sizeof(key), "pcp:map:%s.name", my->type);
-    name_mapID = redis_strmap(my->redis, key, val);
+    name_mapID = redis_strmap(my->batch, key, val);
 
     offset = json + label->value;
     length = label->valuelen;
@@ -265,21 +546,16 @@ cache_annotation(const pmLabel *label, const char *json, annotate_t *my)
 
     snprintf(val, sizeof(val), "%.*s", (int)length, offset);
     snprintf(key, sizeof(key), "pcp:map:%s.%d.value", my->type, name_mapID);
-    value_mapID = redis_strmap(my->redis, key, val);
+    value_mapID = redis_strmap(my->batch, key, val);
 
-    reply = redisCommand(my->redis,
-		"SADD pcp:%s.name:series:%s %d",
-		my->type, my->value->hash, name_mapID);
-    checkInteger(reply, "pcp:%s.name:series:%s (sadd %d)\n",
-		my->type, my->value->hash, name_mapID);
-    freeReplyObject(reply);
+    snprintf(key, sizeof(key), "pcp:%s.name:series:%s",
+		my->type, my->value->hash);
+    redis_batch_append(my->batch, key, REDIS_REPLY_INTEGER,
+		"SADD %s %d", key, name_mapID);
 
-    reply = redisCommand(my->redis,
-		"SADD pcp:series:%s.%d.value:%d %s",
-		my->type, name_mapID, value_mapID, my->value->hash);
-    checkInteger(reply, "pcp:series:%s.%d.value:%d (sadd %s)\n",
-		my->type, name_mapID, value_mapID, my->value->hash);
-    freeReplyObject(reply);
+    snprintf(key, sizeof(key), "pcp:series:%s.%d.value:%d",
+		my->type, name_mapID, value_mapID);
+    redis_series_index(my->batch, key, my->value->hash);
     return 0;
 }
 
@@ -300,7 +576,7 @@ cache_note(const pmLabel *label, const char *json, void *arg)
 }
 
 void
-redis_series_annotate(redisContext *redis,
+redis_series_annotate(redisBatch *batch,
 	metric_t *metric, value_t *value, const char *type,
 	int (*filter)(const pmLabel *, const char *, void *))
 {
@@ -308,7 +584,7 @@ redis_series_annotate(redisContext *redis,
     char	buf[PM_MAXLABELJSONLEN];
     int		sts;
 
-    annotate.redis = redis;
+    annotate.batch = batch;
     annotate.metric = metric;
     annotate.value = value;
     annotate.type = type;
@@ -322,35 +598,88 @@ redis_series_annotate(redisContext *redis,
 }
 
 void
-redis_series_metadata(redisContext *redis, metric_t *metric, value_t *value)
+redis_series_metadata(redisBatch *batch, metric_t *metric, value_t *value)
 {
-    redis_series_pmns(redis, metric, value);
-    redis_series_inst(redis, metric, value);
-    redis_series_desc(redis, metric, value);
+    redis_series_pmns(batch, metric, value);
+    redis_series_inst(batch, metric, value);
+    redis_series_desc(batch, metric, value);
 
-    redis_series_annotate(redis, metric, value, "label", cache_label);
-    redis_series_annotate(redis, metric, value, "note", cache_note);
+    redis_series_annotate(batch, metric, value, "label", cache_label);
+    redis_series_annotate(batch, metric, value, "note", cache_note);
 }
 
+/*
+ * Send the samples of a series encoded so far, appended to the chunk
+ * for their time window, which is added to the index of chunks.
+ */
 void
-redis_series_addvalue(redisContext *redis, metric_t *metric, value_t *value)
+redis_series_chunk(redisBatch *batch, value_t *value)
 {
-    redisReply	*reply;
-    double	timestamp = pmtimevalToReal(&value->lasttime);
+    chunk_t	*chunk = value->chunk;
+    size_t	length;
+    char	key[128];
 
-    reply = redisCommand(redis, "ZADD pcp:values:series:%s %.64g %s",
-		value->hash, timestamp, value_atomstr(metric, value));
-    checkInteger(reply, "pcp:values:series:%s sorted set update", value->hash);
-    freeReplyObject(reply);
+    if (chunk == NULL)
+	return;
+    if (chunk->count > 0) {
+	length = chunk_finish(chunk);
+	pmsprintf(key, sizeof(key), "pcp:chunk:series:%s:%lld",
+			value->hash, chunk->start);
+	redis_batch_append(batch, key, REDIS_REPLY_INTEGER,
+			"APPEND %s %b", key, chunk->buffer, length);
+
+	pmsprintf(key, sizeof(key), "pcp:chunks:series:%s", value->hash);
+	redis_batch_append(batch, key, REDIS_REPLY_INTEGER,
+			"ZADD %s %lld %lld", key, chunk->start, chunk->start);
+    }
+    chunk_free(chunk);
+    value->chunk = NULL;
 }
 
-static void
+void
+redis_series_addvalue(redisBatch *batch, metric_t *metric, value_t *value)
+{
+    struct timeval	*stamp = &value->lasttime;
+    long long		start = chunk_start(stamp->tv_sec);
+    chunk_t		*chunk = value->chunk;
+
+    if (chunk && (chunk->start != start ||
+		  chunk->bits / 8 >= CHUNK_MAXBYTES)) {
+	redis_series_chunk(batch, value);
+	chunk = NULL;
+    }
+    if (chunk == NULL &&
+	(chunk = value->chunk = chunk_init(metric->outype, start)) == NULL) {
+	fprintf(stderr, "%s: out of memory for series %s chunk\n",
+		pmGetProgname(), value->hash);
+	exit(1);
+    }
+    if (chunk_append(chunk, stamp->tv_sec * 1000000LL + stamp->tv_usec,
+			&value->lastval) < 0) {
+	fprintf(stderr, "%s: out of memory for series %s values\n",
+		pmGetProgname(), value->hash);
+	exit(1);
+    }
+    batch->values++;
+}
+
+/*
+ * Schema version 1 stored each sample as a member of a values zset,
+ * version 2 stores them in compressed chunks, and version 3 keeps the
+ * indices of series (pcp:series:*) as lexically ordered zsets rather
+ * than sets.  Version 1 values are still read (for series without
+ * chunks) so such a store is upgraded to version 2 in place - the
+ * indices stay sets, and are added to as sets, until the store is
+ * rebuilt.  Returns the version in use.
+ */
+static unsigned int
 redis_check_schema(redisContext *redis)
 {
     redisReply	*reply = redisCommand(redis, "GET pcp:version:schema");
+    unsigned int version = 0, upgrade;
 
     if (reply->type == REDIS_REPLY_STRING) {
-	unsigned int	version = (unsigned int) atoi(reply->str);
+	version = (unsigned int) atoi(reply->str);
 
 	if (!version || version > PCP_SCHEMA_VERSION) {
 	    fprintf(stderr, "%s: unknown schema version in use (%u)\n",
@@ -361,24 +690,68 @@ redis_check_schema(redisContext *redis)
 	fprintf(stderr, "%s: unknown schema version type (%u)\n",
 		pmGetProgname(), reply->type);
 	exit(1);
-    } else {
-	freeReplyObject(reply);
+    }
+    freeReplyObject(reply);
 
-	reply = redisCommand(redis,
-		"SET pcp:version:schema %u", PCP_SCHEMA_VERSION);
+    upgrade = version ? PCP_SCHEMA_CHUNKS : PCP_SCHEMA_VERSION;
+    if (version < upgrade) {
+	if (version && pmDebugOptions.series)
+	    fprintf(stderr, "Upgrading schema version %u to %u\n",
+		    version, upgrade);
+	reply = redisCommand(redis, "SET pcp:version:schema %u", upgrade);
 	checkStatusOK(reply, "pcp:schema:version setup");
 	freeReplyObject(reply);
+	version = upgrade;
     }
+    return version;
+}
+
+/*
+ * The generation of the store changes with every batch of updates, so
+ * that caches of the series indices kept by queries (cache.c) can tell
+ * when series may have been added to them since.
+ */
+void
+redis_update_generation(redisContext *redis)
+{
+    redisReply	*reply = redisCommand(redis, "INCR pcp:version:generation");
+
+    if (reply == NULL || reply->type != REDIS_REPLY_INTEGER)
+	fprintf(stderr, "%s: failed to update store generation\n",
+		pmGetProgname());
+    if (reply)
+	freeReplyObject(reply);
+}
+
+int
+redis_get_generation(redisContext *redis, unsigned long long *generation)
+{
+    redisReply	*reply = redisCommand(redis, "GET pcp:version:generation");
+    int		sts = 0;
+
+    if (reply == NULL)
+	return -EPROTO;
+    if (reply->type == REDIS_REPLY_STRING)
+	*generation = strtoull(reply->str, NULL, 10);
+    else if (reply->type == REDIS_REPLY_NIL)
+	*generation = 0;
+    else
+	sts = -EPROTO;
+    freeReplyObject(reply);
+    return sts;
 }
 
 redisContext *
-redis_init(void)
+redis_init(unsigned int *version)
 {
     redisContext	*context;   /* TODO: redisSlots */
+    unsigned int	schema;
 
     if ((context = redis_connect(NULL, NULL)) == NULL)
 	exit(1);	/* TODO: improve error handling */
-    redis_check_schema(context);
+    schema = redis_check_schema(context);
+    if (version)
+	*version = schema;
     redis_load_scripts(context);
     return context;
 }
@@ -388,3 +761,57 @@ redis_stop(redisContext *redis)
 {
     redisFree(redis);
 }
+
+/*
+ * Setup for loading, with a batch size from the environment.  The
+ * string maps use a separate (synchronous) connection to the pipelined
+ * updates - those never touch the pcp:map keys, so ordering between
+ * the two does not matter.
+ */
+redisBatch *
+redis_batch_init(redisCache *cache)
+{
+    redisBatch	*batch;
+    char	*value, *endnum;
+    long	size;
+
+    if ((batch = (redisBatch *)calloc(1, sizeof(redisBatch))) == NULL) {
+	fprintf(stderr, "%s: out of memory for Redis batch\n", pmGetProgname());
+	exit(1);
+    }
+    batch->redis = redis_init(&batch->version);
+    batch->cache = cache;
+    if ((batch->slots = redisSlotsInit(NULL, NULL)) == NULL) {
+	fprintf(stderr, "%s: out of memory for Redis slots\n", pmGetProgname());
+	exit(1);
+    }
+
+    /* PCP_SERIES_BATCH in environment sets commands queued per flush */
+    batch->size = DEFAULT_BATCH;
+    if ((value = getenv("PCP_SERIES_BATCH")) != NULL) {
+	size = strtol(value, &endnum, 10);
+	if (*endnum != '\0' || size < 1 || size > INT_MAX)
+	    fprintf(stderr, "%s: ignored bad PCP_SERIES_BATCH (%s)\n",
+		    pmGetProgname(), value);
+	else
+	    batch->size = size;
+    }
+    gettimeofday(&batch->start, NULL);
+    return batch;
+}
+
+void
+redis_batch_stop(redisBatch *batch)
+{
+    redisPipe	*pp, *next;
+
+    redis_batch_flush(batch);
+    for (pp = batch->pipes; pp != NULL; pp = next) {
+	next = pp->next;
+	free(pp->pending);
+	free(pp);
+    }
+    redisFreeSlots(batch->slots);
+    redis_stop(batch->redis);
+    free(batch);
+}
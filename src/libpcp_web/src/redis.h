@@ -17,11 +17,63 @@
 #include "load.h"
 #include <hiredis/hiredis.h>
 
-extern redisContext *redis_init(void);
+#define PCP_SCHEMA_CHUNKS	2	/* values in compressed chunks */
+#define PCP_SCHEMA_LEXSETS	3	/* series indices are ordered zsets */
+#define PCP_SCHEMA_VERSION	3
+
+struct redisSlots;
+struct redisCache;
+
+/*
+ * Commands that need no reply before the next one is sent (everything
+ * but the string map lookups) are queued and pipelined, one queue per
+ * Redis server, found from the cluster slot of the command key.
+ */
+typedef struct redisPending {
+    int			type;		/* expected reply type */
+    char		key[128];	/* for diagnostics */
+} redisPending;
+
+typedef struct redisPipe {
+    redisContext	*redis;
+    redisPending	*pending;	/* replies awaited, in command order */
+    unsigned int	count;
+    unsigned int	maxcount;
+    struct redisPipe	*next;
+} redisPipe;
+
+typedef struct redisBatch {
+    redisContext	*redis;		/* string maps, schema and scripts */
+    struct redisCache	*cache;		/* shared by all batches of a load */
+    unsigned int	version;	/* schema version of the store */
+    struct redisSlots	*slots;		/* pipelined commands */
+    redisPipe		*pipes;
+    unsigned int	size;		/* commands queued before a flush */
+    unsigned int	queued;		/* commands queued since last flush */
+    unsigned long long	commands;	/* statistics, all pipelined commands */
+    unsigned long long	flushes;	/* ... and the round trips for them */
+    unsigned long long	values;		/* samples added to chunks */
+    struct timeval	start;
+} redisBatch;
+
+extern redisContext *redis_init(unsigned int *);
 extern redisContext *redis_connect(char *, struct timeval *);
 extern void redis_stop(redisContext *);
+extern void redis_update_generation(redisContext *);
+extern int redis_get_generation(redisContext *, unsigned long long *);
+
+extern struct redisCache *redis_cache_init(void);
+extern int redis_cache_series(struct redisCache *, const char *);
+extern void redis_cache_free(struct redisCache *);
+
+extern redisBatch *redis_batch_init(struct redisCache *);
+extern void redis_batch_flush(redisBatch *);
+extern void redis_batch_check(redisBatch *);
+extern void redis_batch_stats(redisBatch *, char *, size_t);
+extern void redis_batch_stop(redisBatch *);
 
-extern void redis_series_metadata(redisContext *, metric_t *, value_t *);
-extern void redis_series_addvalue(redisContext *, metric_t *, value_t *);
+extern void redis_series_metadata(redisBatch *, metric_t *, value_t *);
+extern void redis_series_addvalue(redisBatch *, metric_t *, value_t *);
+extern void redis_series_chunk(redisBatch *, value_t *);
 
 #endif	/* REDIS_SERIES_H */
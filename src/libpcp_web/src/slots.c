@@ -24,6 +24,10 @@ typedef struct redisSlots {
     struct timeval	timeout;
 } redisSlots;
 
+/* TODO: externalise Redis configuration */
+static char default_server[] = "localhost:6379";
+static struct timeval default_timeout = { 1, 500000 }; /* 1.5 secs */
+
 redisSlots *
 redisSlotsInit(const char *hostspec, struct timeval *timeout)
 {
@@ -32,23 +36,26 @@ redisSlotsInit(const char *hostspec, struct timeval *timeout)
     if ((pool = (redisSlots *)calloc(1, sizeof(redisSlots))) == NULL)
 	return NULL;
     pool->hostspec = hostspec;
-    pool->timeout = *timeout;
+    pool->timeout = timeout ? *timeout : default_timeout;
     return pool;
 }
 
 void
 redisFreeSlots(redisSlots *pool)
 {
-    int			i;
+    redisContext	*ctxp;
+    int			i, j;
 
     for (i = 0; i < MAXSLOTS; i++) {
-	if (pool->contexts[i]) {
-	    redisFree(pool->contexts[i]);
-	    pool->contexts[i] = NULL;
-	}
+	if ((ctxp = pool->contexts[i]) == NULL)
+	    continue;
+	/* one context serves many slots, free it just the once */
+	for (j = i; j < MAXSLOTS; j++)
+	    if (pool->contexts[j] == ctxp)
+		pool->contexts[j] = NULL;
+	redisFree(ctxp);
     }
-    free(pool->contexts);
-    memset(pool, 0, sizeof(*pool));
+    free(pool);
 }
 
 /*
@@ -80,10 +87,6 @@ keySlot(const char *key, unsigned int keylen)
     return crc16(key + start + 1, end - start - 1) & SLOTMASK;
 }
 
-/* TODO: externalise Redis configuration */
-static char default_server[] = "localhost:6379";
-static struct timeval default_timeout = { 1, 500000 }; /* 1.5 secs */
-
 redisContext *
 redisGet(redisSlots *pool, const char *key, unsigned int keylen)
 {
@@ -111,9 +114,13 @@ redisContext *
 redis_connect(char *server, struct timeval *timeout)
 {
     redisContext *redis;
+    char	buffer[sizeof(default_server)];
 
-    if (server == NULL)
-	server = strdup(default_server);
+    if (server == NULL) {
+	/* a copy, the port is split off in place below */
+	memcpy(buffer, default_server, sizeof(buffer));
+	server = buffer;
+    }
     if (timeout == NULL)
 	timeout = &default_timeout;
 
@@ -15,8 +15,9 @@
 #define SLOTS_H
 
 struct redisSlots;
-extern struct redisSlots *redisInitSlots(const char *);
+extern struct redisSlots *redisSlotsInit(const char *, struct timeval *);
 extern void redisFreeSlots(struct redisSlots *);
+extern unsigned int keySlot(const char *, unsigned int);
 extern redisContext *redisGet(struct redisSlots *, const char *, unsigned int);
 
 #endif	/* SLOTS_H */
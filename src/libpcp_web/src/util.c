@@ -15,6 +15,13 @@
 #include "pmapi.h"
 #include "util.h"
 
+#ifdef HAVE___THREAD
+/* result buffers are private to each (loading) thread */
+#define THREAD_PRIVATE	__thread
+#else
+#define THREAD_PRIVATE
+#endif
+
 /* time manipulation */
 int
 tsub(struct timeval *a, struct timeval *b)
@@ -42,7 +49,7 @@ tadd(struct timeval *a, struct timeval *b)
 void
 fputstamp(struct timeval *stamp, int delimiter, FILE *out)
 {
-    static char	timebuf[32];
+    char	timebuf[32];
     char	*ddmm;
     char	*yr;
 
@@ -58,7 +65,7 @@ fputstamp(struct timeval *stamp, int delimiter, FILE *out)
 const char *
 value_instname(value_t *value)
 {
-    static char	namebuf[2048];
+    static THREAD_PRIVATE char	namebuf[2048];
     const char	*n;
 
     if ((n = value->name) != NULL) {
@@ -99,53 +106,58 @@ value_precision(char *buf, int maxlen, int usedlen)
     }
 }
 
+/*
+ * Format a value of the given type, as stored for each sample
+ */
 const char *
-value_atomstr(metric_t *metric, value_t *value)
+atom_string(int type, pmAtomValue *atom, char *buffer, int length)
 {
-    static char	valuebuf[512];
     int		len;
 
-    switch (metric->desc.type) {
+    switch (type) {
     case PM_TYPE_32:
-	pmsprintf(valuebuf, sizeof(valuebuf), "%ld",
-		(long)value->lastval.l);
+	pmsprintf(buffer, length, "%ld", (long)atom->l);
 	break;
     case PM_TYPE_U32:
-	pmsprintf(valuebuf, sizeof(valuebuf), "%lu",
-		(unsigned long)value->lastval.ul);
+	pmsprintf(buffer, length, "%lu", (unsigned long)atom->ul);
 	break;
     case PM_TYPE_64:
-	pmsprintf(valuebuf, sizeof(valuebuf), "%lld",
-		(long long)value->lastval.ll);
+	pmsprintf(buffer, length, "%lld", (long long)atom->ll);
 	break;
     case PM_TYPE_U64:
-	pmsprintf(valuebuf, sizeof(valuebuf), "%llu",
-		(unsigned long long)value->lastval.ull);
+	pmsprintf(buffer, length, "%llu", (unsigned long long)atom->ull);
 	break;
     case PM_TYPE_DOUBLE:
-	if ((long long)value->lastval.d == value->lastval.d)
-	    pmsprintf(valuebuf, sizeof(valuebuf), "%lld",
-			(long long)value->lastval.d);
+	if ((long long)atom->d == atom->d)
+	    pmsprintf(buffer, length, "%lld", (long long)atom->d);
 	else {
-	    len = pmsprintf(valuebuf, sizeof(valuebuf), "%f", value->lastval.d);
-	    value_precision(valuebuf, sizeof(valuebuf), len);
+	    len = pmsprintf(buffer, length, "%f", atom->d);
+	    value_precision(buffer, length, len);
 	}
 	break;
     case PM_TYPE_FLOAT:
-	if ((long long)value->lastval.f == value->lastval.f)
-	    pmsprintf(valuebuf, sizeof(valuebuf), "%lld",
-			(long long)value->lastval.f);
+	if ((long long)atom->f == atom->f)
+	    pmsprintf(buffer, length, "%lld", (long long)atom->f);
 	else {
-	    len = pmsprintf(valuebuf, sizeof(valuebuf), "%f", value->lastval.f);
-	    value_precision(valuebuf, sizeof(valuebuf), len);
+	    len = pmsprintf(buffer, length, "%f", atom->f);
+	    value_precision(buffer, length, len);
 	}
 	break;
     default:
 	/* TODO: support remaining data types - indirect maps */
-	pmsprintf(valuebuf, sizeof(valuebuf), "%lu", 0UL);
+	pmsprintf(buffer, length, "%lu", 0UL);
 	break;
     }
-    return valuebuf;
+    return buffer;
+}
+
+const char *
+value_atomstr(metric_t *metric, value_t *value)
+{
+    static THREAD_PRIVATE char	valuebuf[512];
+
+    return atom_string(metric->outype, &value->lastval,
+			valuebuf, sizeof(valuebuf));
 }
 
 int
@@ -187,7 +199,7 @@ labels(const pmLabel *label, const char *json, void *arg)
 char *
 value_labels(metric_t *metric, value_t *value)
 {
-    static char	lbuf[PM_MAXLABELJSONLEN];
+    static THREAD_PRIVATE char	lbuf[PM_MAXLABELJSONLEN];
     int		sts;
 
     sts = merge_labelsets(metric, value, lbuf, sizeof(lbuf), labels, NULL);
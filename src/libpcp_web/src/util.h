@@ -34,6 +34,7 @@ extern int merge_labelsets(struct metric *, struct value *,
 extern unsigned int value_instid(struct value *);
 extern const char *value_instname(struct value *);
 
+extern const char *atom_string(int, pmAtomValue *, char *, int);
 extern const char *value_atomstr(struct metric *, struct value *);
 extern char *value_labels(struct metric *, struct value *);
 
@@ -16,13 +16,19 @@
 #include "pmapi.h"
 #include "libpcp.h"
 #include "pmcd.h"
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 #define MIN_CLIENTS_ALLOC 8
 
 int		maxClientFd = -1;	/* largest fd for a client */
 __pmFdSet	clientFds;		/* for client select() */
+int		clientPollFd = -1;	/* epoll descriptor, -1 for select() */
 
 static int	clientSize;
+static int	*fdClient;		/* client[] index for each fd (epoll) */
+static int	fdClientSize;
 
 /*
  * For PMDA_INTERFACE_5 or later PMDAs, post a notification that
@@ -70,12 +76,77 @@ NotifyEndContext(int ctx)
     }
 }
 
+/*
+ * Add a new client socket to the epoll set, remembering which client[]
+ * slot it belongs to so events can be mapped straight back to a client.
+ */
+static int
+WatchClient(int fd, int i)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event	ev;
+    int			*tmp;
+    int			sz, j;
+
+    if (clientPollFd < 0)
+	return 0;
+    if (fd >= fdClientSize) {
+	sz = fdClientSize ? fdClientSize : MIN_CLIENTS_ALLOC;
+	while (sz <= fd)
+	    sz *= 2;
+	if ((tmp = (int *)realloc(fdClient, sz * sizeof(int))) == NULL)
+	    return -ENOMEM;
+	for (j = fdClientSize; j < sz; j++)
+	    tmp[j] = -1;
+	fdClient = tmp;
+	fdClientSize = sz;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(clientPollFd, EPOLL_CTL_ADD, fd, &ev) < 0)
+	return -oserror();
+    fdClient[fd] = i;
+#endif
+    return 0;
+}
+
+static void
+UnwatchClient(int fd)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event	ev;
+
+    if (clientPollFd < 0 || fd >= fdClientSize || fdClient[fd] < 0)
+	return;
+    fdClient[fd] = -1;
+    /* non-NULL event for kernels before 2.6.9 */
+    epoll_ctl(clientPollFd, EPOLL_CTL_DEL, fd, &ev);
+#endif
+}
+
+/*
+ * Map a descriptor reported by epoll_wait() back to its client, or
+ * NULL if it is not (or is no longer) a connected client socket.
+ */
+ClientInfo *
+FdToClient(int fd)
+{
+    int		i;
+
+    if (fd < 0 || fd >= fdClientSize || (i = fdClient[fd]) < 0)
+	return NULL;
+    if (i >= nClients || !client[i].status.connected || client[i].fd != fd)
+	return NULL;
+    return &client[i];
+}
+
 /* Establish a new socket connection to a client */
 ClientInfo *
 AcceptNewClient(int reqfd)
 {
     static unsigned int	seq = 0;
-    int			i, fd;
+    int			i, fd, sts;
     __pmSockLen		addrlen;
     struct timeval	now;
 
@@ -103,12 +174,30 @@ AcceptNewClient(int reqfd)
 	DeleteClient(&client[i]);
 	return NULL;	
     }
+    if (clientPollFd < 0 && fd >= FD_SETSIZE) {
+	/* select() cannot watch this one, refuse rather than corrupt */
+	pmNotifyErr(LOG_ERR, "AcceptNewClient(%d): fd %d exceeds select limit (%d), "
+			"client refused\n", reqfd, fd, FD_SETSIZE);
+	__pmCloseSocket(fd);
+	client[i].fd = -1;
+	DeleteClient(&client[i]);
+	return NULL;
+    }
+    if ((sts = WatchClient(fd, i)) < 0) {
+	pmNotifyErr(LOG_ERR, "AcceptNewClient(%d): cannot watch fd %d: %s\n",
+			reqfd, fd, pmErrStr(sts));
+	__pmCloseSocket(fd);
+	client[i].fd = -1;
+	DeleteClient(&client[i]);
+	return NULL;
+    }
     if (fd > maxClientFd)
 	maxClientFd = fd;
 
     pmcd_openfds_sethi(fd);
 
-    __pmFD_SET(fd, &clientFds);
+    if (fd < FD_SETSIZE)
+	__pmFD_SET(fd, &clientFds);
     __pmSetVersionIPC(fd, UNKNOWN_VERSION);	/* before negotiation */
     __pmSetSocketIPC(fd);
 
@@ -188,7 +277,9 @@ DeleteClient(ClientInfo *cp)
 	return;
     }
     if (cp->fd != -1) {
-	__pmFD_CLR(cp->fd, &clientFds);
+	UnwatchClient(cp->fd);
+	if (cp->fd < FD_SETSIZE)
+	    __pmFD_CLR(cp->fd, &clientFds);
 	__pmCloseSocket(cp->fd);
     }
     if (i == nClients-1) {
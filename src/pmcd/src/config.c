@@ -21,6 +21,9 @@
 #include "pmcd.h"
 #include <ctype.h>
 #include <sys/stat.h>
+#if defined(HAVE_POLL_H)
+#include <poll.h>
+#endif
 #if defined(HAVE_SYS_WAIT_H)
 #include <sys/wait.h>
 #endif
@@ -2377,6 +2380,27 @@ DupAgent(AgentInfo *dest, AgentInfo *src)
 	dest->ipc.pipe.agentPid = src->ipc.pipe.agentPid;
 }
 
+/* try to discover more about an agent that has died, then clean up */
+static void
+CleanupDeceasedAgent(AgentInfo *ap)
+{
+    __pmPDU	*pb;
+    int		sts;
+
+    sts = __pmGetPDU(ap->outFd, ANY_SIZE, TIMEOUT_NEVER, &pb);
+    if (sts > 0)
+	pmcd_trace(TR_RECV_PDU, ap->outFd, sts, (int)((__psint_t)pb & 0xffffffff));
+    if (sts == 0)
+	pmcd_trace(TR_EOF, ap->outFd, -1, -1);
+    else {
+	pmcd_trace(TR_WRONG_PDU, ap->outFd, -1, sts);
+	if (sts > 0)
+	    __pmUnpinPDUBuf(pb);
+    }
+
+    CleanupAgent(ap, AT_COMM, ap->outFd);
+}
+
 void
 ParseRestartAgents(char *fileName)
 {
@@ -2386,12 +2410,55 @@ ParseRestartAgents(char *fileName)
     AgentInfo	*oldAgent;
     int		oldNAgents;
     AgentInfo	*ap;
+#ifdef HAVE_POLL_H
+    struct pollfd *pfd = NULL;
+#else
     __pmFdSet	fds;
+#endif
 
     /* Clean up any deceased agents.  We haven't seen an agent's death unless
      * a PDU transfer involving the agent has occurred.  This cleans up others
      * as well.
+     *
+     * Any agent with output ready has either closed the file descriptor or
+     * sent an unsolicited PDU.  Clean up the agent in either case.  poll(2)
+     * is used where available as agent descriptors may be beyond the reach
+     * of select(2) when many clients are connected.
      */
+#ifdef HAVE_POLL_H
+    j = 0;
+    if (nAgents > 0 &&
+	(pfd = (struct pollfd *)calloc(nAgents, sizeof(*pfd))) == NULL)
+	pmNoMem("ParseRestartAgents.pfd", nAgents * sizeof(*pfd), PM_RECOV_ERR);
+    else {
+	for (i = 0; i < nAgents; i++) {
+	    ap = &agent[i];
+	    if (ap->status.connected &&
+		(ap->ipcType == AGENT_SOCKET || ap->ipcType == AGENT_PIPE)) {
+		pfd[j].fd = ap->outFd;
+		pfd[j].events = POLLIN;
+		j++;
+	    }
+	}
+    }
+    if (j) {
+	sts = poll(pfd, j, 0);
+	if (sts > 0) {
+	    for (i = j = 0; i < nAgents; i++) {
+		ap = &agent[i];
+		if (ap->status.connected &&
+		    (ap->ipcType == AGENT_SOCKET || ap->ipcType == AGENT_PIPE) &&
+		    pfd[j++].revents)
+		    CleanupDeceasedAgent(ap);
+	    }
+	}
+	else if (sts < 0)
+	    fprintf(stderr, "pmcd: deceased agents poll: %s\n",
+			 osstrerror());
+    }
+    if (pfd != NULL)
+	free(pfd);
+#else
     __pmFD_ZERO(&fds);
     j = -1;
     for (i = 0; i < nAgents; i++) {
@@ -2405,9 +2472,6 @@ ParseRestartAgents(char *fileName)
 	}
     }
     if (++j) {
-	/* any agent with output ready has either closed the file descriptor or
-	 * sent an unsolicited PDU.  Clean up the agent in either case.
-	 */
 	struct timeval	timeout = {0, 0};
 
 	sts = __pmSelectRead(j, &fds, &timeout);
@@ -2416,29 +2480,15 @@ ParseRestartAgents(char *fileName)
 		ap = &agent[i];
 		if (ap->status.connected &&
 		    (ap->ipcType == AGENT_SOCKET || ap->ipcType == AGENT_PIPE) &&
-		    __pmFD_ISSET(ap->outFd, &fds)) {
-
-		    /* try to discover more ... */
-		    __pmPDU	*pb;
-		    sts = __pmGetPDU(ap->outFd, ANY_SIZE, TIMEOUT_NEVER, &pb);
-		    if (sts > 0)
-			pmcd_trace(TR_RECV_PDU, ap->outFd, sts, (int)((__psint_t)pb & 0xffffffff));
-		    if (sts == 0)
-			pmcd_trace(TR_EOF, ap->outFd, -1, -1);
-		    else {
-			pmcd_trace(TR_WRONG_PDU, ap->outFd, -1, sts);
-			if (sts > 0)
-			    __pmUnpinPDUBuf(pb);
-		    }
-
-		    CleanupAgent(ap, AT_COMM, ap->outFd);
-		}
+		    __pmFD_ISSET(ap->outFd, &fds))
+		    CleanupDeceasedAgent(ap);
 	    }
 	}
 	else if (sts < 0)
 	    fprintf(stderr, "pmcd: deceased agents select: %s\n",
 			 netstrerror());
     }
+#endif
 
     /* gather any deceased children */
     HarvestAgents(0);
@@ -16,6 +16,9 @@
 #include "pmapi.h"
 #include "libpcp.h"
 #include "pmcd.h"
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
 
 /* Freq. histogram: pmids for each agent in current fetch request */
 
@@ -191,6 +194,314 @@ MakeBadResult(int npmids, pmID *list, int sts)
     return result;
 }
 
+/*
+ * Fetch result cache, enabled by -F window ... the pmResult from each
+ * agent is kept for window msec, keyed on the per-domain pmID list and
+ * the client's instance profile, so that identical requests arriving
+ * from several clients in quick succession are answered once by the
+ * PMDA.  All entries have the same lifetime, so a FIFO list is also
+ * the expiry order.
+ */
+
+#define FETCH_CACHE_MAX	1024	/* limit on cache entries */
+#define PMCD_PMDA	2	/* domain of pmcd's own (per-client) metrics */
+
+typedef struct fetchent {
+    struct fetchent	*next;		/* FIFO, oldest first */
+    unsigned int	key;		/* hash of profile and pmIDs */
+    int			npmids;
+    int			nsig;		/* ints in sig[] */
+    int			*sig;		/* profile signature then pmIDs */
+    struct timeval	expires;
+    pmResult		*result;
+} FetchEnt;
+
+static __pmHashCtl	fetchcache;
+static FetchEnt		*fetchhead;
+static FetchEnt		*fetchtail;
+
+/* cache state of each agent's result, during DoFetch */
+#define FC_NONE		0	/* not cacheable */
+#define FC_MISS		1	/* cacheable, add once sent */
+#define FC_HIT		2	/* result belongs to the cache */
+
+static unsigned int
+FetchHash(unsigned int h, const int *ip, int n)
+{
+    const unsigned char	*p = (const unsigned char *)ip;
+    const unsigned char	*end = p + n * sizeof(int);
+
+    /* FNV-1a */
+    for (; p < end; p++)
+	h = (h ^ *p) * 16777619;
+    return h;
+}
+
+/*
+ * Flatten a profile into an array of ints, for hashing and comparison
+ */
+static int
+ProfileSig(pmProfile *profile, int **sigp)
+{
+    static int		*sig;
+    static int		nsig;
+    pmInDomProfile	*ip;
+    int			need, i, n;
+
+    need = 2;
+    for (i = 0; i < profile->profile_len; i++)
+	need += 3 + profile->profile[i].instances_len;
+    if (need > nsig) {
+	if ((sig = (int *)realloc(sig, need * sizeof(int))) == NULL)
+	    pmNoMem("ProfileSig", need * sizeof(int), PM_FATAL_ERR);
+	nsig = need;
+    }
+    n = 0;
+    sig[n++] = profile->state;
+    sig[n++] = profile->profile_len;
+    for (i = 0; i < profile->profile_len; i++) {
+	ip = &profile->profile[i];
+	sig[n++] = ip->indom;
+	sig[n++] = ip->state;
+	sig[n++] = ip->instances_len;
+	memcpy(&sig[n], ip->instances, ip->instances_len * sizeof(int));
+	n += ip->instances_len;
+    }
+    *sigp = sig;
+    return n;
+}
+
+static void
+FetchCacheDrop(void)
+{
+    FetchEnt	*fp = fetchhead;
+
+    if ((fetchhead = fp->next) == NULL)
+	fetchtail = NULL;
+    __pmHashDel(fp->key, fp, &fetchcache);
+    pmFreeResult(fp->result);
+    free(fp->sig);
+    free(fp);
+    pmcd_fetch_entries--;
+}
+
+/* discard expired entries */
+static void
+FetchCachePurge(struct timeval *now)
+{
+    while (fetchhead != NULL && pmtimevalSub(&fetchhead->expires, now) <= 0)
+	FetchCacheDrop();
+}
+
+void
+FetchCacheFlush(void)
+{
+    while (fetchhead != NULL)
+	FetchCacheDrop();
+}
+
+static FetchEnt *
+FetchCacheLookup(unsigned int key, DomPmidList *dp, int *psig, int nsig)
+{
+    __pmHashNode	*hp;
+    FetchEnt		*fp;
+
+    for (hp = __pmHashSearch(key, &fetchcache); hp != NULL; hp = hp->next) {
+	if (hp->key != key)
+	    continue;
+	fp = (FetchEnt *)hp->data;
+	if (fp->npmids == dp->listSize && fp->nsig == nsig + dp->listSize &&
+	    memcmp(fp->sig, psig, nsig * sizeof(int)) == 0 &&
+	    memcmp(&fp->sig[nsig], dp->list, dp->listSize * sizeof(pmID)) == 0)
+	    return fp;
+    }
+    return NULL;
+}
+
+/*
+ * Add an agent's pmResult to the cache, the cache takes ownership
+ */
+static void
+FetchCacheAdd(unsigned int key, DomPmidList *dp, int *psig, int nsig,
+		pmResult *result)
+{
+    FetchEnt	*fp;
+    int		need = (nsig + dp->listSize) * sizeof(int);
+
+    if (pmcd_fetch_entries >= FETCH_CACHE_MAX)
+	FetchCacheDrop();
+    if ((fp = (FetchEnt *)malloc(sizeof(*fp))) == NULL ||
+	(fp->sig = (int *)malloc(need)) == NULL) {
+	pmNoMem("FetchCacheAdd", sizeof(*fp) + need, PM_FATAL_ERR);
+    }
+    fp->next = NULL;
+    fp->key = key;
+    fp->npmids = dp->listSize;
+    fp->nsig = nsig + dp->listSize;
+    memcpy(fp->sig, psig, nsig * sizeof(int));
+    memcpy(&fp->sig[nsig], dp->list, dp->listSize * sizeof(pmID));
+    pmtimevalNow(&fp->expires);
+    fp->expires.tv_sec += pmcd_fetch_window / 1000;
+    fp->expires.tv_usec += (pmcd_fetch_window % 1000) * 1000;
+    if (fp->expires.tv_usec >= 1000000) {
+	fp->expires.tv_usec -= 1000000;
+	fp->expires.tv_sec++;
+    }
+    fp->result = result;
+    __pmHashAdd(key, fp, &fetchcache);
+    if (fetchtail == NULL)
+	fetchhead = fp;
+    else
+	fetchtail->next = fp;
+    fetchtail = fp;
+    pmcd_fetch_entries++;
+}
+
+/*
+ * A DSO's pmResult is only borrowed, so the cache needs its own copy
+ */
+static pmResult *
+FetchCacheCopy(ClientInfo *cip, pmResult *result)
+{
+    __pmPDU	*pdubuf;
+    pmResult	*copy;
+    int		sts;
+
+    if ((sts = __pmEncodeResult(cip->fd, result, &pdubuf)) < 0)
+	return NULL;
+    sts = __pmDecodeResult(pdubuf, &copy);
+    __pmUnpinPDUBuf(pdubuf);
+    return sts < 0 ? NULL : copy;
+}
+
+/*
+ * Results from pmcd's own PMDA may be specific to the client, as are
+ * results from PMDAs that receive connection attributes (credentials,
+ * container name) if this client has any.
+ */
+static int
+FetchCacheable(ClientInfo *cip, AgentInfo *ap)
+{
+    if (ap->pmDomainId == PMCD_PMDA)
+	return 0;
+    if ((ap->status.flags & (PDU_FLAG_AUTH|PDU_FLAG_CONTAINER)) &&
+	cip->attrs.nodes > 0)
+	return 0;
+    return 1;
+}
+
+/*
+ * Account for the time taken by an agent to answer (or fail to answer)
+ * a fetch request, for the pmcd.agent.fetch metrics.
+ */
+static void
+FetchDone(AgentInfo *ap)
+{
+    FetchStats		*fsp = &ap->fetchStats;
+    struct timeval	now;
+    double		usec;
+    double		limit;
+    int			b;
+
+    pmtimevalNow(&now);
+    usec = pmtimevalSub(&now, &ap->fetchStart) * 1000000;
+    if (usec < 0)
+	usec = 0;
+    fsp->count++;
+    fsp->total += (__uint64_t)usec;
+    if (usec > fsp->max)
+	fsp->max = (__uint32_t)usec;
+    /* buckets are decades, starting with under 100 usec */
+    for (b = 0, limit = 100; b < FETCH_NBUCKETS - 1 && usec >= limit; b++)
+	limit *= 10;
+    fsp->bucket[b]++;
+}
+
+/*
+ * Wait for responses from busy agents, until the deadline (or forever
+ * if deadline is NULL), setting ready[i] for each agent[i] that has a
+ * response pending.  Returns the number of ready agents, 0 on timeout,
+ * or a negative error code.
+ *
+ * poll(2) is preferred as agents restarted while thousands of clients
+ * are connected may have descriptors beyond the reach of select(2).
+ */
+int
+WaitForAgents(struct timeval *deadline, char *ready)
+{
+    struct timeval	now;
+    struct timeval	wait;
+    int			i, sts;
+#ifdef HAVE_POLL_H
+    static struct pollfd *pfd;
+    static int		npfd;
+    int			n, msec = -1;
+#else
+    __pmFdSet		readyFds;
+    int			maxFd = -1;
+#endif
+
+    if (deadline != NULL) {
+	pmtimevalNow(&now);
+	wait.tv_sec = deadline->tv_sec - now.tv_sec;
+	wait.tv_usec = deadline->tv_usec - now.tv_usec;
+	if (wait.tv_usec < 0) {
+	    wait.tv_usec += 1000000;
+	    wait.tv_sec--;
+	}
+	if (wait.tv_sec < 0)
+	    wait.tv_sec = wait.tv_usec = 0;
+    }
+    memset(ready, 0, nAgents);
+
+#ifdef HAVE_POLL_H
+    if (nAgents > npfd) {
+	if ((pfd = (struct pollfd *)realloc(pfd, nAgents * sizeof(*pfd))) == NULL)
+	    pmNoMem("WaitForAgents.pfd", nAgents * sizeof(*pfd), PM_FATAL_ERR);
+	npfd = nAgents;
+    }
+    for (i = n = 0; i < nAgents; i++) {
+	if (!agent[i].status.busy)
+	    continue;
+	pfd[n].fd = agent[i].outFd;
+	pfd[n].events = POLLIN;
+	pfd[n].revents = 0;
+	n++;
+    }
+    if (deadline != NULL)
+	msec = wait.tv_sec * 1000 + (wait.tv_usec + 999) / 1000;
+    if ((sts = poll(pfd, n, msec)) < 0)
+	return -oserror();
+    if (sts == 0)
+	return 0;
+    for (i = n = 0; i < nAgents; i++) {
+	if (!agent[i].status.busy)
+	    continue;
+	if (pfd[n++].revents)
+	    ready[i] = 1;
+    }
+#else
+    __pmFD_ZERO(&readyFds);
+    for (i = 0; i < nAgents; i++) {
+	if (!agent[i].status.busy)
+	    continue;
+	__pmFD_SET(agent[i].outFd, &readyFds);
+	if (agent[i].outFd > maxFd)
+	    maxFd = agent[i].outFd;
+    }
+    sts = __pmSelectRead(maxFd+1, &readyFds, deadline ? &wait : NULL);
+    if (sts < 0)
+	return -neterror();
+    if (sts == 0)
+	return 0;
+    for (i = 0; i < nAgents; i++) {
+	if (agent[i].status.busy && __pmFD_ISSET(agent[i].outFd, &readyFds))
+	    ready[i] = 1;
+    }
+#endif
+    return sts;
+}
+
 static pmResult *
 SendFetch(DomPmidList *dpList, AgentInfo *aPtr, ClientInfo *cPtr, int ctxnum)
 {
@@ -350,24 +661,35 @@ DoFetch(ClientInfo *cip, __pmPDU* pb)
     static int		nDoms = 0;
     static pmResult	**results = NULL;
     static int		*resIndex = NULL;
-    __pmFdSet		waitFds;
-    __pmFdSet		readyFds;
+    static char		*ready = NULL;
+    static char		*cstate = NULL;
     int			nWait;
-    int			maxFd;
-    struct timeval	timeout;
+    struct timeval	deadline;
     __pmHashCtl		*hcp;
     __pmHashNode	*hp;
     pmProfile		*profile;
+    FetchEnt		*fp;
+    int			*psig = NULL;
+    int			nsig = 0;
+    unsigned int	pkey = 0;
+    unsigned int	key;
+    pmResult		*copy;
 
     if (nAgents > nDoms) {
 	if (results != NULL)
 	    free(results);
 	if (resIndex != NULL)
 	    free(resIndex);
+	if (ready != NULL)
+	    free(ready);
+	if (cstate != NULL)
+	    free(cstate);
 	results = (pmResult **)malloc((nAgents + 1) * sizeof (pmResult *));
 	resIndex = (int *)malloc((nAgents + 1) * sizeof(int));
-	if (results == NULL || resIndex == NULL) {
-	    pmNoMem("DoFetch.results", (nAgents + 1) * sizeof (pmResult *) + (nAgents + 1) * sizeof(int), PM_FATAL_ERR);
+	ready = (char *)malloc(nAgents + 1);
+	cstate = (char *)malloc(nAgents + 1);
+	if (results == NULL || resIndex == NULL || ready == NULL || cstate == NULL) {
+	    pmNoMem("DoFetch.results", (nAgents + 1) * (sizeof (pmResult *) + sizeof(int) + 2), PM_FATAL_ERR);
 	}
 	nDoms = nAgents;
     }
@@ -407,44 +729,80 @@ DoFetch(ClientInfo *cip, __pmPDU* pb)
 
     dList = SplitPmidList(nPmids, pmidList);
 
+    /* Satisfy what we can from the fetch cache, if enabled */
+    memset(cstate, FC_NONE, nAgents + 1);
+    if (fetchhead != NULL) {
+	pmtimevalNow(&deadline);
+	FetchCachePurge(&deadline);
+    }
+    if (pmcd_fetch_window > 0) {
+	nsig = ProfileSig(profile, &psig);
+	pkey = FetchHash(2166136261U, psig, nsig);
+	for (i = 0; dList[i].domain != -1; i++) {
+	    j = mapdom[dList[i].domain];
+	    if (!FetchCacheable(cip, &agent[j]))
+		continue;
+	    key = FetchHash(pkey, (int *)dList[i].list, dList[i].listSize);
+	    if ((fp = FetchCacheLookup(key, &dList[i], psig, nsig)) != NULL) {
+		results[j] = fp->result;
+		cstate[j] = FC_HIT;
+		pmcd_fetch_hits++;
+	    }
+	    else {
+		cstate[j] = FC_MISS;
+		pmcd_fetch_misses++;
+	    }
+	}
+    }
+
     /* For each domain in the split pmidList, dispatch the per-domain subset
-     * of pmIDs to the appropriate agent.  For DSO agents, the pmResult will
-     * come back immediately.  If a request cannot be sent to an agent, a
-     * suitable pmResult (containing metric not available values) will be
-     * returned.
+     * of pmIDs to the appropriate agent.  Daemon agents are sent their
+     * requests first, so they all work in parallel while any DSO agents
+     * are called (synchronously, their pmResult comes back immediately).
+     * If a request cannot be sent to an agent, a suitable pmResult
+     * (containing metric not available values) will be returned.
      */
-    __pmFD_ZERO(&waitFds);
     nWait = 0;
-    maxFd = -1;
     for (i = 0; dList[i].domain != -1; i++) {
 	j = mapdom[dList[i].domain];
+	if (agent[j].ipcType == AGENT_DSO || cstate[j] == FC_HIT)
+	    continue;
+	pmtimevalNow(&agent[j].fetchStart);
 	results[j] = SendFetch(&dList[i], &agent[j], cip, ctxnum);
 	if (results[j] == NULL) { /* Wait for agent's response */
-	    int fd = agent[j].outFd;
 	    agent[j].status.busy = 1;
-	    __pmFD_SET(fd, &waitFds);
-	    if (fd > maxFd)
-		maxFd = fd;
 	    nWait++;
 	}
+	else {
+	    FetchDone(&agent[j]);
+	    cstate[j] = FC_NONE;
+	}
+    }
+    for (i = 0; dList[i].domain != -1; i++) {
+	j = mapdom[dList[i].domain];
+	if (agent[j].ipcType != AGENT_DSO || cstate[j] == FC_HIT)
+	    continue;
+	pmtimevalNow(&agent[j].fetchStart);
+	results[j] = SendFetch(&dList[i], &agent[j], cip, ctxnum);
+	FetchDone(&agent[j]);
+	if (agent[j].status.madeDsoResult)
+	    cstate[j] = FC_NONE;
     }
     /* Construct pmResult for bad-pmID list */
     if (dList[i].listSize != 0)
 	results[nAgents] = MakeBadResult(dList[i].listSize, dList[i].list, PM_ERR_NOAGENT);
 
-    /* Wait for results to roll in from agents */
+    /* Wait for results to roll in from agents, in whatever order they
+     * arrive ... pmcd_timeout bounds the wait for all of them, not each
+     */
+    pmtimevalNow(&deadline);
+    deadline.tv_sec += pmcd_timeout;
     while (nWait > 0) {
-        __pmFD_COPY(&readyFds, &waitFds);
 	if (nWait > 1) {
-	    timeout.tv_sec = pmcd_timeout;
-	    timeout.tv_usec = 0;
-
-            retry:
-	    setoserror(0);
-	    sts = __pmSelectRead(maxFd+1, &readyFds, &timeout);
+	    sts = WaitForAgents(pmcd_timeout == TIMEOUT_NEVER ? NULL : &deadline, ready);
 
 	    if (sts == 0) {
-		pmNotifyErr(LOG_INFO, "DoFetch: select timeout");
+		pmNotifyErr(LOG_INFO, "DoFetch: timeout waiting for agents");
 
 		/* Timeout, terminate agents with undelivered results */
 		for (i = 0; i < nAgents; i++) {
@@ -456,33 +814,40 @@ DoFetch(ClientInfo *cip, __pmPDU* pb)
 			results[i] = MakeBadResult(dList[j].listSize,
 						   dList[j].list,
 						   PM_ERR_NOAGENT);
+			cstate[i] = FC_NONE;
+			FetchDone(&agent[i]);
 			pmcd_trace(TR_RECV_TIMEOUT, agent[i].outFd, PDU_RESULT, 0);
 			CleanupAgent(&agent[i], AT_COMM, agent[i].inFd);
 		    }
 		}
 		break;
 	    }
+	    else if (sts == -EINTR)
+		continue;
 	    else if (sts < 0) {
-		if (neterror() == EINTR)
-		    goto retry;
 		/* this is not expected to happen! */
-		pmNotifyErr(LOG_ERR, "DoFetch: fatal select failure: %s\n",
-			netstrerror());
+		pmNotifyErr(LOG_ERR, "DoFetch: fatal wait failure: %s\n",
+			pmErrStr(sts));
 		Shutdown();
 		exit(1);
 	    }
 	}
+	else {
+	    /* just the one, let __pmGetPDU do the waiting */
+	    for (i = 0; i < nAgents; i++)
+		ready[i] = agent[i].status.busy;
+	}
 
 	/* Read results from agents that have them ready */
 	for (i = 0; i < nAgents; i++) {
 	    AgentInfo	*ap = &agent[i];
 	    int		pinpdu;
-	    if (!ap->status.busy || !__pmFD_ISSET(ap->outFd, &readyFds))
+	    if (!ap->status.busy || !ready[i])
 		continue;
 	    ap->status.busy = 0;
-	    __pmFD_CLR(ap->outFd, &waitFds);
 	    nWait--;
 	    pinpdu = sts = __pmGetPDU(ap->outFd, ANY_SIZE, pmcd_timeout, &pb);
+	    FetchDone(ap);
 	    if (sts > 0)
 		pmcd_trace(TR_RECV_PDU, ap->outFd, sts, (int)((__psint_t)pb & 0xffffffff));
 	    if (sts == PDU_RESULT) {
@@ -519,6 +884,7 @@ DoFetch(ClientInfo *cip, __pmPDU* pb)
 			break;
 		results[i] = MakeBadResult(dList[j].listSize,
 					   dList[j].list, sts);
+		cstate[i] = FC_NONE;
 
 		if (sts == PM_ERR_PMDANOTREADY) {
 		    /* the agent is indicating it can't handle PDUs for now */
@@ -572,10 +938,22 @@ DoFetch(ClientInfo *cip, __pmPDU* pb)
     }
 
     /*
-     * pmFreeResult() all the accumulated results.
+     * pmFreeResult() all the accumulated results, unless they belong to
+     * (or are now handed over to) the fetch cache.
      */
     for (i = 0; dList[i].domain != -1; i++) {
 	j = mapdom[dList[i].domain];
+	if (cstate[j] == FC_HIT)
+	    continue;
+	if (cstate[j] == FC_MISS && agent[j].status.connected) {
+	    key = FetchHash(pkey, (int *)dList[i].list, dList[i].listSize);
+	    if (agent[j].ipcType != AGENT_DSO) {
+		FetchCacheAdd(key, &dList[i], psig, nsig, results[j]);
+		continue;
+	    }
+	    if ((copy = FetchCacheCopy(cip, results[j])) != NULL)
+		FetchCacheAdd(key, &dList[i], psig, nsig, copy);
+	}
 	if (agent[j].ipcType == AGENT_DSO && agent[j].status.connected &&
 	    !agent[j].status.madeDsoResult)
 	    /* Living DSO's manage their own pmResult skeleton unless
@@ -134,25 +134,31 @@ DoStore(ClientInfo *cp, __pmPDU* pb)
     pmResult	*result;
     pmResult	**dResult;
     int		i;
-    __pmFdSet	readyFds;
-    __pmFdSet	waitFds;
+    static char	*ready;
+    static int	nready;
     int		nWait = 0;
-    int		maxFd = -1;
     int		badStore;		/* != 0 => store to nonexistent agent */
     int		notReady = 0;		/* != 0 => store to agent that's not ready */
-    struct timeval	timeout;
+    struct timeval	deadline;
 
 
     if ((sts = __pmDecodeResult(pb, &result)) < 0)
 	return sts;
 
+    /* cached fetch results may be invalidated by the store */
+    FetchCacheFlush();
+
     dResult = SplitResult(result);
 
+    if (nAgents > nready) {
+	if ((ready = (char *)realloc(ready, nAgents)) == NULL)
+	    pmNoMem("DoStore.ready", nAgents, PM_FATAL_ERR);
+	nready = nAgents;
+    }
+
     /* Send the per-domain results to their respective agents */
 
-    __pmFD_ZERO(&waitFds);
     for (i = 0; dResult[i]->numpmid > 0; i++) {
-	int fd;
 	ap = FindDomainAgent(((__pmID_int *)&dResult[i]->vset[0]->pmid)->domain);
 	/* If it's in a "good" list, pmID has agent that is connected */
 	assert(ap != NULL);
@@ -170,10 +176,6 @@ DoStore(ClientInfo *cp, __pmPDU* pb)
 		s = __pmSendResult(ap->inFd, cp - client, dResult[i]);
 		if (s >= 0) {
 		    ap->status.busy = 1;
-		    fd = ap->outFd;
-		    __pmFD_SET(fd, &waitFds);
-		    if (fd > maxFd)
-			maxFd = fd;
 		    nWait++;
 		}
 		else if (s == PM_ERR_IPC || sts == PM_ERR_TIMEOUT || s == -EPIPE) {
@@ -200,17 +202,15 @@ DoStore(ClientInfo *cp, __pmPDU* pb)
     /* Collect error PDUs containing store status from each active agent */
 
     while (nWait > 0) {
-        __pmFD_COPY(&readyFds, &waitFds);
 	if (nWait > 1) {
-	    timeout.tv_sec = pmcd_timeout;
-	    timeout.tv_usec = 0;
+	    pmtimevalNow(&deadline);
+	    deadline.tv_sec += pmcd_timeout;
 
 	    retry:
-	    setoserror(0);
-	    s = __pmSelectRead(maxFd+1, &readyFds, &timeout);
+	    s = WaitForAgents(pmcd_timeout == TIMEOUT_NEVER ? NULL : &deadline, ready);
 
 	    if (s == 0) {
-		pmNotifyErr(LOG_INFO, "DoStore: select timeout");
+		pmNotifyErr(LOG_INFO, "DoStore: timeout waiting for agents");
 
 		/* Timeout, terminate agents that haven't responded */
 		for (i = 0; i < nAgents; i++) {
@@ -223,23 +223,27 @@ DoStore(ClientInfo *cp, __pmPDU* pb)
 		break;
 	    }
 	    else if (s < 0) {
-		if (neterror() == EINTR)
+		if (s == -EINTR)
 		    goto retry;
 		/* this is not expected to happen! */
-		pmNotifyErr(LOG_ERR, "DoStore: fatal select failure: %s\n",
-			netstrerror());
+		pmNotifyErr(LOG_ERR, "DoStore: fatal wait failure: %s\n",
+			pmErrStr(s));
 		Shutdown();
 		exit(1);
 	    }
 	}
+	else {
+	    /* just the one, let __pmGetPDU do the waiting */
+	    for (i = 0; i < nAgents; i++)
+		ready[i] = agent[i].status.busy;
+	}
 
 	for (i = 0; i < nAgents; i++) {
 	    int		pinpdu;
 	    ap = &agent[i];
-	    if (!ap->status.busy || !__pmFD_ISSET(ap->outFd, &readyFds))
+	    if (!ap->status.busy || !ready[i])
 		continue;
 	    ap->status.busy = 0;
-	    __pmFD_CLR(ap->outFd, &waitFds);
 	    nWait--;
 	    pinpdu = s = __pmGetPDU(ap->outFd, ANY_SIZE, pmcd_timeout, &pb);
 	    if (s > 0)
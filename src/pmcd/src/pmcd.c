@@ -17,11 +17,18 @@
 #include "libpcp.h"
 #include <sys/stat.h>
 #include <assert.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
 
 #define PMDAROOT	1	/* domain identifier for pmdaroot(1) */
 #define SHUTDOWNWAIT	15	/* PMDAs wait time, in 10msec increments */
 #define MAXPENDING	5	/* maximum number of pending connections */
 #define FDNAMELEN	80	/* maximum length of a fd description */
+#define MAXEVENTS	128	/* epoll events handled per wakeup */
 #define STRINGIFY(s)	#s
 #define TO_STRING(s)	STRINGIFY(s)
 
@@ -34,6 +41,7 @@ int		labelChanged;		/* For SIGHUP labels check */
 static int	timeToDie;		/* For SIGINT handling */
 static int	restart;		/* For SIGHUP restart */
 static int	maxReqPortFd;		/* Largest request port fd */
+static __pmFdSet reqPortFds;		/* Request port fds, for epoll */
 static char	configFileName[MAXPATHLEN]; /* path to pmcd.conf */
 static char	*logfile = "pmcd.log";	/* log file name */
 static int	run_daemon = 1;		/* run as a daemon, see -f */
@@ -101,6 +109,7 @@ static pmLongOptions longopts[] = {
     { "config", 1, 'c', "PATH", "path to configuration file" },
     { "certdb", 1, 'C', "PATH", "path to NSS certificate database" },
     { "passfile", 1, 'P', "PATH", "password file for certificate database access" },
+    { "fetchcache", 1, 'F', "MSEC", "share identical fetch results for MSEC [default 0, off]" },
     { "", 1, 'L', "BYTES", "maximum size for PDUs from clients [default 65536]" },
     { "", 1, 'q', "TIME", "PMDA initial negotiation timeout (seconds) [default 3]" },
     { "", 1, 't', "TIME", "PMDA response timeout (seconds) [default 5]" },
@@ -118,7 +127,7 @@ static pmLongOptions longopts[] = {
 
 static pmOptions opts = {
     .flags = PM_OPTFLAG_POSIX,
-    .short_options = "Ac:C:D:fH:i:l:L:M:N:n:p:P:q:Qs:St:T:U:vx:?",
+    .short_options = "Ac:C:D:fF:H:i:l:L:M:N:n:p:P:q:Qs:St:T:U:vx:?",
     .long_options = longopts,
 };
 
@@ -159,6 +168,17 @@ ParseOptions(int argc, char *argv[], int *nports)
 		}
 		break;
 
+	    case 'F':
+		val = (int)strtol(opts.optarg, &endptr, 10);
+		if (*endptr != '\0' || val < 0) {
+		    pmprintf("%s: -F requires a positive numeric argument\n",
+			pmGetProgname());
+		    opts.errors++;
+		} else {
+		    pmcd_fetch_window = val;
+		}
+		break;
+
 	    case 'f':
 		/* foreground, i.e. do _not_ run as a daemon */
 		run_daemon = 0;
@@ -296,136 +316,145 @@ ParseOptions(int argc, char *argv[], int *nports)
 }
 
 /*
- * Determine which clients (if any) have sent data to the server and handle it
- * as required.
+ * Read one PDU from client[i] and handle it as required.
  */
-void
-HandleClientInput(__pmFdSet *fdsPtr)
+static void
+ClientInput(int i)
 {
     int		sts;
-    int		i;
+    int		pinpdu;
     __pmPDU	*pb;
     __pmPDUHdr	*php;
     ClientInfo	*cp;
 
-    for (i = 0; i < nClients; i++) {
-	int		pinpdu;
+    cp = &client[i];
+    this_client_id = i;
 
-	if (!client[i].status.connected || !__pmFD_ISSET(client[i].fd, fdsPtr))
-	    continue;
+    pinpdu = sts = __pmGetPDU(cp->fd, LIMIT_SIZE, pmcd_timeout, &pb);
+    if (sts > 0) {
+	pmcd_trace(TR_RECV_PDU, cp->fd, sts, (int)((__psint_t)pb & 0xffffffff));
+    } else {
+	CleanupClient(cp, sts);
+	return;
+    }
 
-	cp = &client[i];
-	this_client_id = i;
+    php = (__pmPDUHdr *)pb;
+    if (__pmVersionIPC(cp->fd) == UNKNOWN_VERSION && php->type != PDU_CREDS) {
+	/* old V1 client protocol, no longer supported */
+	sts = PM_ERR_IPC;
+	CleanupClient(cp, sts);
+	__pmUnpinPDUBuf(pb);
+	return;
+    }
 
-	pinpdu = sts = __pmGetPDU(cp->fd, LIMIT_SIZE, pmcd_timeout, &pb);
-	if (sts > 0) {
-	    pmcd_trace(TR_RECV_PDU, cp->fd, sts, (int)((__psint_t)pb & 0xffffffff));
-	} else {
-	    CleanupClient(cp, sts);
-	    continue;
-	}
+    if (pmDebugOptions.appl0)
+	ShowClients(stderr);
 
-	php = (__pmPDUHdr *)pb;
-	if (__pmVersionIPC(cp->fd) == UNKNOWN_VERSION && php->type != PDU_CREDS) {
-	    /* old V1 client protocol, no longer supported */
-	    sts = PM_ERR_IPC;
-	    CleanupClient(cp, sts);
-	    __pmUnpinPDUBuf(pb);
-	    continue;
-	}
+    switch (php->type) {
+	case PDU_PROFILE:
+	    sts = (cp->denyOps & PMCD_OP_FETCH) ?
+		  PM_ERR_PERMISSION : DoProfile(cp, pb);
+	    break;
 
-	if (pmDebugOptions.appl0)
-	    ShowClients(stderr);
+	case PDU_FETCH:
+	    sts = (cp->denyOps & PMCD_OP_FETCH) ?
+		  PM_ERR_PERMISSION : DoFetch(cp, pb);
+	    break;
 
-	switch (php->type) {
-	    case PDU_PROFILE:
-		sts = (cp->denyOps & PMCD_OP_FETCH) ?
-		      PM_ERR_PERMISSION : DoProfile(cp, pb);
-		break;
+	case PDU_INSTANCE_REQ:
+	    sts = (cp->denyOps & PMCD_OP_FETCH) ?
+		  PM_ERR_PERMISSION : DoInstance(cp, pb);
+	    break;
 
-	    case PDU_FETCH:
-		sts = (cp->denyOps & PMCD_OP_FETCH) ?
-		      PM_ERR_PERMISSION : DoFetch(cp, pb);
-		break;
+	case PDU_LABEL_REQ:
+	    sts = (cp->denyOps & PMCD_OP_FETCH) ?
+		  PM_ERR_PERMISSION : DoLabel(cp, pb);
+	    break;
 
-	    case PDU_INSTANCE_REQ:
-		sts = (cp->denyOps & PMCD_OP_FETCH) ?
-		      PM_ERR_PERMISSION : DoInstance(cp, pb);
-		break;
+	case PDU_DESC_REQ:
+	    sts = (cp->denyOps & PMCD_OP_FETCH) ?
+		  PM_ERR_PERMISSION : DoDesc(cp, pb);
+	    break;
 
-	    case PDU_LABEL_REQ:
-		sts = (cp->denyOps & PMCD_OP_FETCH) ?
-		      PM_ERR_PERMISSION : DoLabel(cp, pb);
-		break;
+	case PDU_TEXT_REQ:
+	    sts = (cp->denyOps & PMCD_OP_FETCH) ?
+		  PM_ERR_PERMISSION : DoText(cp, pb);
+	    break;
 
-	    case PDU_DESC_REQ:
-		sts = (cp->denyOps & PMCD_OP_FETCH) ?
-		      PM_ERR_PERMISSION : DoDesc(cp, pb);
-		break;
+	case PDU_RESULT:
+	    sts = (cp->denyOps & PMCD_OP_STORE) ?
+		  PM_ERR_PERMISSION : DoStore(cp, pb);
+	    break;
 
-	    case PDU_TEXT_REQ:
-		sts = (cp->denyOps & PMCD_OP_FETCH) ?
-		      PM_ERR_PERMISSION : DoText(cp, pb);
-		break;
+	case PDU_PMNS_IDS:
+	    sts = (cp->denyOps & PMCD_OP_FETCH) ?
+		  PM_ERR_PERMISSION : DoPMNSIDs(cp, pb);
+	    break;
 
-	    case PDU_RESULT:
-		sts = (cp->denyOps & PMCD_OP_STORE) ?
-		      PM_ERR_PERMISSION : DoStore(cp, pb);
-		break;
+	case PDU_PMNS_NAMES:
+	    sts = (cp->denyOps & PMCD_OP_FETCH) ?
+		  PM_ERR_PERMISSION : DoPMNSNames(cp, pb);
+	    break;
 
-	    case PDU_PMNS_IDS:
-		sts = (cp->denyOps & PMCD_OP_FETCH) ?
-		      PM_ERR_PERMISSION : DoPMNSIDs(cp, pb);
-		break;
+	case PDU_PMNS_CHILD:
+	    sts = (cp->denyOps & PMCD_OP_FETCH) ?
+		  PM_ERR_PERMISSION : DoPMNSChild(cp, pb);
+	    break;
 
-	    case PDU_PMNS_NAMES:
-		sts = (cp->denyOps & PMCD_OP_FETCH) ?
-		      PM_ERR_PERMISSION : DoPMNSNames(cp, pb);
-		break;
+	case PDU_PMNS_TRAVERSE:
+	    sts = (cp->denyOps & PMCD_OP_FETCH) ?
+		  PM_ERR_PERMISSION : DoPMNSTraverse(cp, pb);
+	    break;
 
-	    case PDU_PMNS_CHILD:
-		sts = (cp->denyOps & PMCD_OP_FETCH) ?
-		      PM_ERR_PERMISSION : DoPMNSChild(cp, pb);
-		break;
+	case PDU_CREDS:
+	    sts = DoCreds(cp, pb);
+	    break;
 
-	    case PDU_PMNS_TRAVERSE:
-		sts = (cp->denyOps & PMCD_OP_FETCH) ?
-		      PM_ERR_PERMISSION : DoPMNSTraverse(cp, pb);
-		break;
+	default:
+	    sts = PM_ERR_IPC;
+    }
+    if (sts < 0) {
+	if (pmDebugOptions.appl0)
+	    fprintf(stderr, "PDU:  %s client[%d]: %s\n",
+		__pmPDUTypeStr(php->type), i, pmErrStr(sts));
+	/* Make sure client still alive before sending. */
+	if (cp->status.connected) {
+	    pmcd_trace(TR_XMIT_PDU, cp->fd, PDU_ERROR, sts);
+	    sts = __pmSendError(cp->fd, FROM_ANON, sts);
+	    if (sts < 0)
+		pmNotifyErr(LOG_ERR, "HandleClientInput: "
+		    "error sending Error PDU to client[%d] %s\n", i, pmErrStr(sts));
+	}
+    }
+    if (pinpdu > 0)
+	__pmUnpinPDUBuf(pb);
 
-	    case PDU_CREDS:
-		sts = DoCreds(cp, pb);
-		break;
+    /*
+     * May need to send connection attributes to interested PMDAs, if
+     * something changed for this client during this PDU exchange.
+     */
+    if (client[i].status.attributes) {
+	if (pmDebugOptions.appl1)
+	    pmNotifyErr(LOG_INFO, "Client idx=%d,seq=%d attrs reset\n",
+			    i, client[i].seq);
+	AgentsAttributes(i);
+    }
+}
 
-	    default:
-		sts = PM_ERR_IPC;
-	}
-	if (sts < 0) {
-	    if (pmDebugOptions.appl0)
-		fprintf(stderr, "PDU:  %s client[%d]: %s\n",
-		    __pmPDUTypeStr(php->type), i, pmErrStr(sts));
-	    /* Make sure client still alive before sending. */
-	    if (cp->status.connected) {
-		pmcd_trace(TR_XMIT_PDU, cp->fd, PDU_ERROR, sts);
-		sts = __pmSendError(cp->fd, FROM_ANON, sts);
-		if (sts < 0)
-		    pmNotifyErr(LOG_ERR, "HandleClientInput: "
-			"error sending Error PDU to client[%d] %s\n", i, pmErrStr(sts));
-	    }
-	}
-	if (pinpdu > 0)
-	    __pmUnpinPDUBuf(pb);
+/*
+ * Determine which clients (if any) have sent data to the server and handle it
+ * as required.
+ */
+void
+HandleClientInput(__pmFdSet *fdsPtr)
+{
+    int		i;
 
-	/*
-	 * May need to send connection attributes to interested PMDAs, if
-	 * something changed for this client during this PDU exchange.
-	 */
-	if (client[i].status.attributes) {
-	    if (pmDebugOptions.appl1)
-		pmNotifyErr(LOG_INFO, "Client idx=%d,seq=%d attrs reset\n",
-				i, client[i].seq);
-	    AgentsAttributes(i);
-	}
+    for (i = 0; i < nClients; i++) {
+	if (!client[i].status.connected || client[i].fd >= FD_SETSIZE ||
+	    !__pmFD_ISSET(client[i].fd, fdsPtr))
+	    continue;
+	ClientInput(i);
     }
 }
 
@@ -555,6 +584,7 @@ SignalRestart(void)
     ShowClients(stderr);
     ResetBadHosts();
     CheckLabelChange();
+    FetchCacheFlush();
     ParseRestartAgents(configFileName);
 }
 
@@ -594,70 +624,79 @@ SignalReloadPMNS(void)
     }
 }
 
+/* Process I/O on the file descriptor from an agent that was marked as not
+ * ready to handle PDUs.  Returns 1 if the agent is now ready, else 0.
+ */
+static int
+AgentReady(AgentInfo *ap)
+{
+    int		s, sts;
+    int		fd = ap->outFd;
+    int		reason;
+    int		pinpdu;
+    int		ready = 0;
+    __pmPDU	*pb;
+
+    /* Expect an error PDU containing PM_ERR_PMDAREADY */
+    reason = AT_COMM;	/* most errors are protocol failures */
+    pinpdu = sts = __pmGetPDU(ap->outFd, ANY_SIZE, pmcd_timeout, &pb);
+    if (sts > 0)
+	pmcd_trace(TR_RECV_PDU, ap->outFd, sts, (int)((__psint_t)pb & 0xffffffff));
+    if (sts == PDU_ERROR) {
+	s = __pmDecodeError(pb, &sts);
+	if (s < 0) {
+	    sts = s;
+	    pmcd_trace(TR_RECV_ERR, ap->outFd, PDU_ERROR, sts);
+	}
+	else {
+	    /* sts is the status code from the error PDU */
+	    if (pmDebugOptions.appl0)
+		pmNotifyErr(LOG_INFO,
+		     "%s agent (not ready) sent %s status(%d)\n",
+		     ap->pmDomainLabel,
+		     sts == PM_ERR_PMDAREADY ?
+				 "ready" : "unknown", sts);
+	    if (sts == PM_ERR_PMDAREADY) {
+		ap->status.notReady = 0;
+		sts = 1;
+		ready++;
+	    }
+	    else {
+		pmcd_trace(TR_RECV_ERR, ap->outFd, PDU_ERROR, sts);
+		sts = PM_ERR_IPC;
+	    }
+	}
+    }
+    else {
+	if (sts < 0)
+	    pmcd_trace(TR_RECV_ERR, ap->outFd, PDU_RESULT, sts);
+	else
+	    pmcd_trace(TR_WRONG_PDU, ap->outFd, PDU_ERROR, sts);
+	sts = PM_ERR_IPC; /* Wrong PDU type */
+    }
+    if (pinpdu > 0)
+	__pmUnpinPDUBuf(pb);
+
+    if (ap->ipcType != AGENT_DSO && sts <= 0)
+	CleanupAgent(ap, reason, fd);
+    return ready;
+}
+
 /* Process I/O on file descriptors from agents that were marked as not ready
  * to handle PDUs.
  */
 static int
 HandleReadyAgents(__pmFdSet *readyFds)
 {
-    int		i, s, sts;
-    int		fd;
-    int		reason;
+    int		i;
     int		ready = 0;
     AgentInfo	*ap;
-    __pmPDU	*pb;
 
     for (i = 0; i < nAgents; i++) {
 	ap = &agent[i];
-	if (ap->status.notReady) {
-	    fd = ap->outFd;
-	    if (__pmFD_ISSET(fd, readyFds)) {
-		int		pinpdu;
-
-		/* Expect an error PDU containing PM_ERR_PMDAREADY */
-		reason = AT_COMM;	/* most errors are protocol failures */
-		pinpdu = sts = __pmGetPDU(ap->outFd, ANY_SIZE, pmcd_timeout, &pb);
-		if (sts > 0)
-		    pmcd_trace(TR_RECV_PDU, ap->outFd, sts, (int)((__psint_t)pb & 0xffffffff));
-		if (sts == PDU_ERROR) {
-		    s = __pmDecodeError(pb, &sts);
-		    if (s < 0) {
-			sts = s;
-			pmcd_trace(TR_RECV_ERR, ap->outFd, PDU_ERROR, sts);
-		    }
-		    else {
-			/* sts is the status code from the error PDU */
-			if (pmDebugOptions.appl0)
-			    pmNotifyErr(LOG_INFO,
-				 "%s agent (not ready) sent %s status(%d)\n",
-				 ap->pmDomainLabel,
-				 sts == PM_ERR_PMDAREADY ?
-					     "ready" : "unknown", sts);
-			if (sts == PM_ERR_PMDAREADY) {
-			    ap->status.notReady = 0;
-			    sts = 1;
-			    ready++;
-			}
-			else {
-			    pmcd_trace(TR_RECV_ERR, ap->outFd, PDU_ERROR, sts);
-			    sts = PM_ERR_IPC;
-			}
-		    }
-		}
-		else {
-		    if (sts < 0)
-			pmcd_trace(TR_RECV_ERR, ap->outFd, PDU_RESULT, sts);
-		    else
-			pmcd_trace(TR_WRONG_PDU, ap->outFd, PDU_ERROR, sts);
- 		    sts = PM_ERR_IPC; /* Wrong PDU type */
-		}
-		if (pinpdu > 0)
-		    __pmUnpinPDUBuf(pb);
-
-		if (ap->ipcType != AGENT_DSO && sts <= 0)
-		    CleanupAgent(ap, reason, fd);
-	    }
-	}
+	if (ap->status.notReady && ap->outFd < FD_SETSIZE &&
+	    __pmFD_ISSET(ap->outFd, readyFds))
+	    ready += AgentReady(ap);
     }
     return ready;
 }
@@ -738,62 +777,227 @@ CheckNewClient(__pmFdSet * fdset, int rfd, int family)
     }
 }
 
-/* Loop, synchronously processing requests from clients. */
-
-static void
-ClientLoop(void)
+/*
+ * Wait for input from clients and not ready agents using select(2), and
+ * handle it.  Returns -1 on a fatal error, else 0.
+ */
+static int
+SelectInput(int *reload_namespace)
 {
     int		i, fd, sts;
     int		maxFd;
     int		checkAgents;
-    int		reload_namespace = 0;
-    int		restartAgents = -1;	/* initial state unknown */
     __pmFdSet	readableFds;
 
-    for (;;) {
+    /* Figure out which file descriptors to wait for input on.  Keep
+     * track of the highest numbered descriptor for the select call.
+     */
+    readableFds = clientFds;
+    maxFd = maxClientFd + 1;
 
-	/* Figure out which file descriptors to wait for input on.  Keep
-	 * track of the highest numbered descriptor for the select call.
-	 */
-	readableFds = clientFds;
-	maxFd = maxClientFd + 1;
+    /* If an agent was not ready, it may send an ERROR PDU to indicate it
+     * is now ready.  Add such agents to the list of file descriptors.
+     */
+    checkAgents = 0;
+    for (i = 0; i < nAgents; i++) {
+	AgentInfo	*ap = &agent[i];
 
-	/* If an agent was not ready, it may send an ERROR PDU to indicate it
-	 * is now ready.  Add such agents to the list of file descriptors.
-	 */
-	checkAgents = 0;
+	if (ap->status.notReady && ap->outFd < FD_SETSIZE) {
+	    fd = ap->outFd;
+	    __pmFD_SET(fd, &readableFds);
+	    if (fd > maxFd)
+		maxFd = fd + 1;
+	    checkAgents = 1;
+	    if (pmDebugOptions.appl0)
+		pmNotifyErr(LOG_INFO,
+			     "not ready: check %s agent on fd %d (max = %d)\n",
+			     ap->pmDomainLabel, fd, maxFd);
+	}
+    }
+
+    sts = __pmSelectRead(maxFd, &readableFds, NULL);
+    if (sts > 0) {
+	if (pmDebugOptions.appl0)
+	    for (i = 0; i <= maxClientFd && i < FD_SETSIZE; i++)
+		if (__pmFD_ISSET(i, &readableFds))
+		    fprintf(stderr, "DATA: from %s (fd %d)\n",
+			    FdToString(i), i);
+	__pmServerAddNewClients(&readableFds, CheckNewClient);
+	if (checkAgents)
+	    *reload_namespace = HandleReadyAgents(&readableFds);
+	HandleClientInput(&readableFds);
+    }
+    else if (sts == -1 && neterror() != EINTR) {
+	pmNotifyErr(LOG_ERR, "ClientLoop select: %s\n", netstrerror());
+	return -1;
+    }
+    return 0;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/*
+ * Switch ClientLoop over to epoll(7), with the request ports registered.
+ * Client sockets are added and removed as they come and go (client.c).
+ * Any failure here is not fatal, we just stay with select(2) and the
+ * FD_SETSIZE limit on the number of clients that implies.
+ */
+static void
+SetupEventLoop(void)
+{
+    struct epoll_event	ev;
+    char		*env;
+    int			fd;
+
+    if ((env = getenv("PMCD_USE_SELECT")) != NULL && strcmp(env, "0") != 0) {
+	fprintf(stderr, "Warning: using select from PMCD_USE_SELECT=%s in environment\n", env);
+	return;
+    }
+    if ((clientPollFd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+	pmNotifyErr(LOG_WARNING, "SetupEventLoop: epoll_create1: %s, using select\n",
+			osstrerror());
+	return;
+    }
+    __pmFD_ZERO(&reqPortFds);
+    for (fd = 0; fd <= maxReqPortFd; fd++) {
+	if (!__pmFD_ISSET(fd, &clientFds))
+	    continue;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(clientPollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+	    pmNotifyErr(LOG_WARNING, "SetupEventLoop: epoll_ctl(%s): %s, using select\n",
+			FdToString(fd), osstrerror());
+	    close(clientPollFd);
+	    clientPollFd = -1;
+	    return;
+	}
+	__pmFD_SET(fd, &reqPortFds);
+    }
+
+#ifdef HAVE_SYS_RESOURCE_H
+    {
+	struct rlimit	rlim;
+
+	/* no FD_SETSIZE ceiling now, allow as many clients as we may */
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < rlim.rlim_max) {
+	    rlim.rlim_cur = rlim.rlim_max;
+	    if (setrlimit(RLIMIT_NOFILE, &rlim) < 0 && pmDebugOptions.appl0)
+		fprintf(stderr, "SetupEventLoop: setrlimit: %s\n", osstrerror());
+	}
+    }
+#endif
+}
+
+/*
+ * Wait for input from clients and not ready agents using epoll(7), and
+ * handle it.  Only descriptors with input pending are visited, so the
+ * cost of a wakeup no longer grows with the number of clients.
+ * Level-triggered throughout - each wakeup consumes one PDU with a
+ * blocking read, so edge-triggering would strand pipelined requests.
+ * Returns -1 on a fatal error, else 0.
+ */
+static int
+EpollInput(int *reload_namespace)
+{
+    static struct epoll_event	events[MAXEVENTS];
+    struct epoll_event	ev;
+    __pmFdSet		readyPorts;
+    AgentInfo		*ap;
+    ClientInfo		*cp;
+    int			i, j, fd, nfds;
+    int			checkAgents = 0;
+    int			checkPorts = 0;
+
+    /* Agents are rarely not ready, and then only briefly, so add any
+     * such agents to the epoll set for the duration of this wait only.
+     */
+    for (i = 0; i < nAgents; i++) {
+	ap = &agent[i];
+	if (!ap->status.notReady)
+	    continue;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = ap->outFd;
+	if (epoll_ctl(clientPollFd, EPOLL_CTL_ADD, ap->outFd, &ev) == 0)
+	    checkAgents = 1;
+	if (pmDebugOptions.appl0)
+	    pmNotifyErr(LOG_INFO, "not ready: check %s agent on fd %d\n",
+			 ap->pmDomainLabel, ap->outFd);
+    }
+
+    nfds = epoll_wait(clientPollFd, events, MAXEVENTS, -1);
+
+    if (checkAgents) {
 	for (i = 0; i < nAgents; i++) {
-	    AgentInfo	*ap = &agent[i];
-
-	    if (ap->status.notReady) {
-		fd = ap->outFd;
-		__pmFD_SET(fd, &readableFds);
-		if (fd > maxFd)
-		    maxFd = fd + 1;
-		checkAgents = 1;
-		if (pmDebugOptions.appl0)
-		    pmNotifyErr(LOG_INFO,
-				 "not ready: check %s agent on fd %d (max = %d)\n",
-				 ap->pmDomainLabel, fd, maxFd);
-	    }
+	    if (agent[i].status.notReady)
+		epoll_ctl(clientPollFd, EPOLL_CTL_DEL, agent[i].outFd, &ev);
 	}
+    }
+    if (nfds < 0) {
+	if (oserror() == EINTR)
+	    return 0;
+	pmNotifyErr(LOG_ERR, "ClientLoop epoll_wait: %s\n", osstrerror());
+	return -1;
+    }
 
-	sts = __pmSelectRead(maxFd, &readableFds, NULL);
-	if (sts > 0) {
-	    if (pmDebugOptions.appl0)
-		for (i = 0; i <= maxClientFd; i++)
-		    if (__pmFD_ISSET(i, &readableFds))
-			fprintf(stderr, "DATA: from %s (fd %d)\n",
-				FdToString(i), i);
-	    __pmServerAddNewClients(&readableFds, CheckNewClient);
-	    if (checkAgents)
-		reload_namespace = HandleReadyAgents(&readableFds);
-	    HandleClientInput(&readableFds);
+    __pmFD_ZERO(&readyPorts);
+    for (j = 0; j < nfds; j++) {
+	fd = events[j].data.fd;
+	if (pmDebugOptions.appl0)
+	    fprintf(stderr, "DATA: from %s (fd %d)\n", FdToString(fd), fd);
+	if (fd <= maxReqPortFd && __pmFD_ISSET(fd, &reqPortFds)) {
+	    __pmFD_SET(fd, &readyPorts);
+	    checkPorts = 1;
 	}
-	else if (sts == -1 && neterror() != EINTR) {
-	    pmNotifyErr(LOG_ERR, "ClientLoop select: %s\n", netstrerror());
-	    break;
+    }
+    if (checkPorts)
+	__pmServerAddNewClients(&readyPorts, CheckNewClient);
+
+    if (checkAgents) {
+	*reload_namespace = 0;
+	for (j = 0; j < nfds; j++) {
+	    fd = events[j].data.fd;
+	    for (i = 0; i < nAgents; i++) {
+		ap = &agent[i];
+		if (ap->status.notReady && ap->outFd == fd) {
+		    *reload_namespace += AgentReady(ap);
+		    break;
+		}
+	    }
 	}
+    }
+
+    for (j = 0; j < nfds; j++) {
+	if ((cp = FdToClient(events[j].data.fd)) != NULL)
+	    ClientInput(cp - client);
+    }
+    return 0;
+}
+#endif
+
+/* Loop, synchronously processing requests from clients. */
+
+static void
+ClientLoop(void)
+{
+    int		i, sts;
+    int		reload_namespace = 0;
+    int		restartAgents = -1;	/* initial state unknown */
+
+#ifdef HAVE_SYS_EPOLL_H
+    SetupEventLoop();
+#endif
+
+    for (;;) {
+
+#ifdef HAVE_SYS_EPOLL_H
+	if (clientPollFd >= 0)
+	    sts = EpollInput(&reload_namespace);
+	else
+#endif
+	    sts = SelectInput(&reload_namespace);
+	if (sts < 0)
+	    break;
 	if (AgentDied) {
 	    if (restartAgents == -1) {
 		char *args;
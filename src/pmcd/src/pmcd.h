@@ -71,6 +71,19 @@ typedef struct {
     pid_t agentPid;			/* Process ID of the agent */
 } PipeInfo;
 
+/*
+ * Per-agent fetch latency accounting, exported via pmcd.agent.fetch.*
+ * Histogram buckets are decades: <100us, <1ms, <10ms, <100ms, <1s, >=1s
+ */
+#define FETCH_NBUCKETS	6
+
+typedef struct {
+    __uint64_t	count;			/* fetch requests completed */
+    __uint64_t	total;			/* cumulative response time (usec) */
+    __uint32_t	max;			/* worst response time (usec) */
+    __uint64_t	bucket[FETCH_NBUCKETS];	/* response time histogram */
+} FetchStats;
+
 /* The agent table and its size. */
 
 typedef struct {
@@ -101,6 +114,8 @@ typedef struct {
 	SocketInfo socket;
 	PipeInfo   pipe;
     } ipc;
+    struct timeval fetchStart;		/* When current fetch was sent */
+    FetchStats fetchStats;		/* Fetch response time statistics */
 } AgentInfo;
 
 PMCD_DATA extern AgentInfo	*agent;		/* Array of domain agent structs */
@@ -147,6 +162,7 @@ extern int		AgentDied;	/* for updating mapdom[] */
 extern AgentInfo *FindDomainAgent(int);
 extern void CleanupAgent(AgentInfo *, int, int);
 extern int HarvestAgents(unsigned int);
+extern int WaitForAgents(struct timeval *, char *);
 
 /* pmdaroot file descriptor */
 extern int	pmdarootfd;
@@ -247,6 +263,16 @@ PMCD_DATA extern char *pmcd_labels;
 /* Counter of SIGHUPs received and responded to by pmcd */
 PMCD_DATA extern unsigned pmcd_sighups;
 
+/*
+ * Fetch result cache (-F), pmcd.fetch_cache metrics ...
+ * window is the lifetime of cached results in msec, 0 disables the cache
+ */
+PMCD_DATA extern int pmcd_fetch_window;
+PMCD_DATA extern int pmcd_fetch_entries;
+PMCD_DATA extern __uint64_t pmcd_fetch_hits;
+PMCD_DATA extern __uint64_t pmcd_fetch_misses;
+extern void FetchCacheFlush(void);
+
 /* pmcd's pid */
 PMCD_DATA extern pid_t pmcd_pid;
 
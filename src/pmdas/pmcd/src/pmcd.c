@@ -18,6 +18,7 @@
 #include "deprecated.h"
 #include "pmda.h"
 #include "stats.h"
+#include "pmlogger/src/stats.h"
 #include "pmcd/src/pmcd.h"
 #include "pmcd/src/client.h"
 #include <sys/stat.h>
@@ -179,11 +180,43 @@ static pmDesc	desctab[] = {
     { PMDA_PMID(3,2), PM_TYPE_STRING, PM_INDOM_NULL, PM_SEM_DISCRETE, PMDA_PMUNITS(0,0,0,0,0,0) },
 /* pmlogger.host */
     { PMDA_PMID(3,3), PM_TYPE_STRING, PM_INDOM_NULL, PM_SEM_DISCRETE, PMDA_PMUNITS(0,0,0,0,0,0) },
+/* pmlogger.write.queue */
+    { PMDA_PMID(3,4), PM_TYPE_U32, PM_INDOM_NULL, PM_SEM_INSTANT, PMDA_PMUNITS(1,0,0,PM_SPACE_BYTE,0,0) },
+/* pmlogger.write.commits */
+    { PMDA_PMID(3,5), PM_TYPE_U64, PM_INDOM_NULL, PM_SEM_COUNTER, PMDA_PMUNITS(0,0,1,0,0,PM_COUNT_ONE) },
+/* pmlogger.write.bytes */
+    { PMDA_PMID(3,6), PM_TYPE_U64, PM_INDOM_NULL, PM_SEM_COUNTER, PMDA_PMUNITS(1,0,0,PM_SPACE_BYTE,0,0) },
+/* pmlogger.write.time */
+    { PMDA_PMID(3,7), PM_TYPE_U64, PM_INDOM_NULL, PM_SEM_COUNTER, PMDA_PMUNITS(0,1,0,0,PM_TIME_USEC,0) },
+/* pmlogger.write.max */
+    { PMDA_PMID(3,8), PM_TYPE_U32, PM_INDOM_NULL, PM_SEM_INSTANT, PMDA_PMUNITS(0,1,0,0,PM_TIME_USEC,0) },
+/* pmlogger.samples.dropped */
+    { PMDA_PMID(3,9), PM_TYPE_U32, PM_INDOM_NULL, PM_SEM_COUNTER, PMDA_PMUNITS(0,0,1,0,0,PM_COUNT_ONE) },
+/* pmlogger.samples.late */
+    { PMDA_PMID(3,10), PM_TYPE_U32, PM_INDOM_NULL, PM_SEM_COUNTER, PMDA_PMUNITS(0,0,1,0,0,PM_COUNT_ONE) },
 
 /* agent.type */
     { PMDA_PMID(4,0), PM_TYPE_U32, PM_INDOM_NULL, PM_SEM_DISCRETE, PMDA_PMUNITS(0,0,0,0,0,0) },
 /* agent.status */
     { PMDA_PMID(4,1), PM_TYPE_32, PM_INDOM_NULL, PM_SEM_DISCRETE, PMDA_PMUNITS(0,0,0,0,0,0) },
+/* agent.fetch.count */
+    { PMDA_PMID(4,2), PM_TYPE_U64, PM_INDOM_NULL, PM_SEM_COUNTER, PMDA_PMUNITS(0,0,1,0,0,PM_COUNT_ONE) },
+/* agent.fetch.time */
+    { PMDA_PMID(4,3), PM_TYPE_U64, PM_INDOM_NULL, PM_SEM_COUNTER, PMDA_PMUNITS(0,1,0,0,PM_TIME_USEC,0) },
+/* agent.fetch.max */
+    { PMDA_PMID(4,4), PM_TYPE_U32, PM_INDOM_NULL, PM_SEM_INSTANT, PMDA_PMUNITS(0,1,0,0,PM_TIME_USEC,0) },
+/* agent.fetch.latency.under_100us */
+    { PMDA_PMID(4,5), PM_TYPE_U64, PM_INDOM_NULL, PM_SEM_COUNTER, PMDA_PMUNITS(0,0,1,0,0,PM_COUNT_ONE) },
+/* agent.fetch.latency.under_1ms */
+    { PMDA_PMID(4,6), PM_TYPE_U64, PM_INDOM_NULL, PM_SEM_COUNTER, PMDA_PMUNITS(0,0,1,0,0,PM_COUNT_ONE) },
+/* agent.fetch.latency.under_10ms */
+    { PMDA_PMID(4,7), PM_TYPE_U64, PM_INDOM_NULL, PM_SEM_COUNTER, PMDA_PMUNITS(0,0,1,0,0,PM_COUNT_ONE) },
+/* agent.fetch.latency.under_100ms */
+    { PMDA_PMID(4,8), PM_TYPE_U64, PM_INDOM_NULL, PM_SEM_COUNTER, PMDA_PMUNITS(0,0,1,0,0,PM_COUNT_ONE) },
+/* agent.fetch.latency.under_1sec */
+    { PMDA_PMID(4,9), PM_TYPE_U64, PM_INDOM_NULL, PM_SEM_COUNTER, PMDA_PMUNITS(0,0,1,0,0,PM_COUNT_ONE) },
+/* agent.fetch.latency.over_1sec */
+    { PMDA_PMID(4,10), PM_TYPE_U64, PM_INDOM_NULL, PM_SEM_COUNTER, PMDA_PMUNITS(0,0,1,0,0,PM_COUNT_ONE) },
 
 /* pmie.configfile */
     { PMDA_PMID(5,0), PM_TYPE_STRING, PM_INDOM_NULL, PM_SEM_DISCRETE, PMDA_PMUNITS(0,0,0,0,0,0) },
@@ -239,6 +272,15 @@ static pmDesc	desctab[] = {
 /* pmcd.feature.client_cert_required */
     { PMDA_PMID(8,9), PM_TYPE_U32, PM_INDOM_NULL, PM_SEM_INSTANT, PMDA_PMUNITS(0,0,0,0,0,0) },
 
+/* pmcd.fetch_cache.window */
+    { PMDA_PMID(9,0), PM_TYPE_U32, PM_INDOM_NULL, PM_SEM_DISCRETE, PMDA_PMUNITS(0,1,0,0,PM_TIME_MSEC,0) },
+/* pmcd.fetch_cache.entries */
+    { PMDA_PMID(9,1), PM_TYPE_U32, PM_INDOM_NULL, PM_SEM_INSTANT, PMDA_PMUNITS(0,0,0,0,0,0) },
+/* pmcd.fetch_cache.hits */
+    { PMDA_PMID(9,2), PM_TYPE_U64, PM_INDOM_NULL, PM_SEM_COUNTER, PMDA_PMUNITS(0,0,1,0,0,PM_COUNT_ONE) },
+/* pmcd.fetch_cache.misses */
+    { PMDA_PMID(9,3), PM_TYPE_U64, PM_INDOM_NULL, PM_SEM_COUNTER, PMDA_PMUNITS(0,0,1,0,0,PM_COUNT_ONE) },
+
 /* End-of-List */
     { PM_ID_NULL, 0, 0, 0, PMDA_PMUNITS(0, 0, 0, 0, 0, 0) }
 };
@@ -272,6 +314,14 @@ typedef struct {
 static pmie_t		*pmies;
 static unsigned int	npmies;
 
+typedef struct {
+    pid_t	pid;
+    int		size;
+    void	*mmap;
+} pmlogger_t;
+static pmlogger_t	*pmloggers;
+static unsigned int	npmloggers;
+
 static struct {
     int		inst;
     char	*iname;
@@ -533,6 +583,134 @@ refresh_pmie_indom(void)
     return npmies;
 }
 
+static void
+remove_pmlogger_stats(void)
+{
+    int n;
+
+    for (n = 0; n < npmloggers; n++)
+	__pmMemoryUnmap(pmloggers[n].mmap, pmloggers[n].size);
+    free(pmloggers);
+    pmloggers = NULL;
+    npmloggers = 0;
+}
+
+/*
+ * use a static timestamp, stat PMLOGGER_STATS_SUBDIR, if changed
+ * update "pmloggers" ... like refresh_pmie_indom(), but the instances
+ * come from the pmlogger port files, so only the stats are kept here
+ */
+static void
+refresh_pmlogger_stats(void)
+{
+    static struct stat	lastsbuf;
+    pid_t		pid;
+    struct dirent	*dp;
+    struct stat		statbuf;
+    size_t		size;
+    char		*endp;
+    char		fullpath[MAXPATHLEN];
+    void		*ptr;
+    DIR			*statsdir;
+    int			fd;
+    int			sep = pmPathSeparator();
+
+    pmsprintf(fullpath, sizeof(fullpath), "%s%c%s",
+	     pmGetConfig("PCP_TMP_DIR"), sep, PMLOGGER_STATS_SUBDIR);
+    if (stat(fullpath, &statbuf) == 0) {
+	if (stat_time_differs(&statbuf, &lastsbuf)) {
+
+	    lastsbuf = statbuf;
+
+	    if (pmloggers)
+		remove_pmlogger_stats();
+
+	    if ((statsdir = opendir(fullpath)) == NULL) {
+		pmNotifyErr(LOG_ERR, "pmcd pmda cannot open %s: %s",
+				fullpath, osstrerror());
+		return;
+	    }
+	    /* NOTE:  all valid files are already mmapped by pmlogger */
+	    while ((dp = readdir(statsdir)) != NULL) {
+		size = (npmloggers+1) * sizeof(pmlogger_t);
+		pid = (pid_t)strtoul(dp->d_name, &endp, 10);
+		if (*endp != '\0')	/* skips over "." and ".." here */
+		    continue;
+		if (!__pmProcessExists(pid))
+		    continue;
+		pmsprintf(fullpath, sizeof(fullpath), "%s%c%s%c%s",
+			 pmGetConfig("PCP_TMP_DIR"), sep, PMLOGGER_STATS_SUBDIR,
+			 sep, dp->d_name);
+		if (stat(fullpath, &statbuf) < 0) {
+		    pmNotifyErr(LOG_WARNING, "pmcd pmda cannot stat %s: %s",
+				fullpath, osstrerror());
+		    continue;
+		}
+		if (statbuf.st_size != sizeof(pmloggerstats_t))
+		    continue;
+		if ((pmloggers = (pmlogger_t *)realloc(pmloggers, size)) == NULL) {
+		    pmNoMem("pmlogger stats", size, PM_RECOV_ERR);
+		    npmloggers = 0;
+		    break;
+		}
+		if ((fd = open(fullpath, O_RDONLY)) < 0) {
+		    pmNotifyErr(LOG_WARNING, "pmcd pmda cannot open %s: %s",
+				fullpath, osstrerror());
+		    continue;
+		}
+		ptr = __pmMemoryMap(fd, statbuf.st_size, 0);
+		close(fd);
+		if (ptr == NULL) {
+		    pmNotifyErr(LOG_ERR, "pmcd pmda memmap of %s failed: %s",
+				fullpath, osstrerror());
+		    continue;
+		}
+		else if (((pmloggerstats_t *)ptr)->version != 1) {
+		    pmNotifyErr(LOG_WARNING, "incompatible pmlogger version: %s",
+				fullpath);
+		    __pmMemoryUnmap(ptr, statbuf.st_size);
+		    continue;
+		}
+		pmloggers[npmloggers].pid = pid;
+		pmloggers[npmloggers].size = statbuf.st_size;
+		pmloggers[npmloggers].mmap = ptr;
+		npmloggers++;
+	    }
+	    closedir(statsdir);
+	}
+    }
+    else {
+	remove_pmlogger_stats();
+    }
+    setoserror(0);
+}
+
+/*
+ * find the writer stats for pmlogger port j, if any ... the primary
+ * pmlogger instance is matched to its process via the control port
+ */
+static pmloggerstats_t *
+find_pmlogger_stats(__pmLogPort *lpp, int nports, int j)
+{
+    pid_t	pid = lpp[j].pid;
+    int		k;
+
+    if (pid == PM_LOG_PRIMARY_PID) {
+	for (k = 0; k < nports; k++) {
+	    if (lpp[k].pid != PM_LOG_PRIMARY_PID && lpp[k].port == lpp[j].port)
+		break;
+	}
+	if (k == nports)
+	    return NULL;
+	pid = lpp[k].pid;
+    }
+    for (k = 0; k < npmloggers; k++) {
+	if (pmloggers[k].pid == pid)
+	    return (pmloggerstats_t *)pmloggers[k].mmap;
+    }
+    return NULL;
+}
+
 static int
 pmcd_instance_reg(int inst, char *name, pmInResult **result)
 {
@@ -1282,6 +1460,7 @@ pmcd_fetch(int numpmid, pmID pmidlist[], pmResult **resp, pmdaExt *pmda)
     static int		maxnpmids = 0;
     char		*host = NULL;	/* refresh max once per fetch */
     pmiestats_t		*pmie;
+    pmloggerstats_t	*logger;
     pmValueSet		*vset;
     pmDesc		*dp = NULL;	/* initialize to pander to gcc */
     pmAtomValue		atom;
@@ -1533,7 +1712,12 @@ pmcd_fetch(int numpmid, pmID pmidlist[], pmResult **resp, pmdaExt *pmda)
 			sts = nports;
 			break;
 		    }
+		    /* writer stats, only for pmloggers that export them */
+		    if (item >= 4)
+			refresh_pmlogger_stats();
 		    for (j = numval = 0; j < nports; j++) {
+			if (item >= 4 && find_pmlogger_stats(lpp, nports, j) == NULL)
+			    continue;
 			if (__pmInProfile(logindom, _profile, lpp[j].pid))
 			    numval++;
 		    }
@@ -1547,6 +1731,10 @@ pmcd_fetch(int numpmid, pmID pmidlist[], pmResult **resp, pmdaExt *pmda)
 		    for (j = numval = 0; j < nports; j++) {
 			if (!__pmInProfile(logindom, _profile, lpp[j].pid))
 			    continue;
+			logger = NULL;
+			if (item >= 4 &&
+			    (logger = find_pmlogger_stats(lpp, nports, j)) == NULL)
+			    continue;
 			vset->vlist[numval].inst = lpp[j].pid;
 			switch (item) {
 			    case 0:		/* pmlogger.port */
@@ -1564,6 +1752,27 @@ pmcd_fetch(int numpmid, pmID pmidlist[], pmResult **resp, pmdaExt *pmda)
 				    host = hostnameinfo();
                                 atom.cp = host;
 				break;
+			    case 4:		/* pmlogger.write.queue */
+				atom.ul = logger->write_queue;
+				break;
+			    case 5:		/* pmlogger.write.commits */
+				atom.ull = logger->write_commits;
+				break;
+			    case 6:		/* pmlogger.write.bytes */
+				atom.ull = logger->write_bytes;
+				break;
+			    case 7:		/* pmlogger.write.time */
+				atom.ull = logger->write_time;
+				break;
+			    case 8:		/* pmlogger.write.max */
+				atom.ul = logger->write_max;
+				break;
+			    case 9:		/* pmlogger.samples.dropped */
+				atom.ul = logger->samples_dropped;
+				break;
+			    case 10:		/* pmlogger.samples.late */
+				atom.ul = logger->samples_late;
+				break;
 			    default:
 				sts = atom.l = PM_ERR_PMID;
 				break;
@@ -1605,6 +1814,23 @@ pmcd_fetch(int numpmid, pmID pmidlist[], pmResult **resp, pmdaExt *pmda)
 			    else
 				atom.l = agent[j].reason;
 			    break;
+			case 2:		/* agent.fetch.count */
+			    atom.ull = agent[j].fetchStats.count;
+			    break;
+			case 3:		/* agent.fetch.time */
+			    atom.ull = agent[j].fetchStats.total;
+			    break;
+			case 4:		/* agent.fetch.max */
+			    atom.ul = agent[j].fetchStats.max;
+			    break;
+			case 5:		/* agent.fetch.latency.* */
+			case 6:
+			case 7:
+			case 8:
+			case 9:
+			case 10:
+			    atom.ull = agent[j].fetchStats.bucket[item - 5];
+			    break;
 			default:
 			    sts = atom.l = PM_ERR_PMID;
 			    break;
@@ -1757,6 +1983,26 @@ pmcd_fetch(int numpmid, pmID pmidlist[], pmResult **resp, pmdaExt *pmda)
 	    case 8:	/* feature metrics */
 		sts = fetch_feature(item, &atom);
 		break;
+
+	    case 9:	/* fetch cache metrics */
+		switch (item) {
+		    case 0:		/* fetch_cache.window */
+			atom.ul = pmcd_fetch_window;
+			break;
+		    case 1:		/* fetch_cache.entries */
+			atom.ul = pmcd_fetch_entries;
+			break;
+		    case 2:		/* fetch_cache.hits */
+			atom.ull = pmcd_fetch_hits;
+			break;
+		    case 3:		/* fetch_cache.misses */
+			atom.ull = pmcd_fetch_misses;
+			break;
+		    default:
+			sts = PM_ERR_PMID;
+			break;
+		}
+		break;
 	}
 
 	if (sts == 0 && valfmt == -1 && vset->numval == 1)
@@ -1895,6 +2141,14 @@ pmcd_store(pmResult *result, pmdaExt *pmda)
 		break;
 	    }
 	}
+	else if (cluster == 9 && item == 0) { /* pmcd.fetch_cache.window */
+	    val = vsp->vlist[0].value.lval;
+	    if (val < 0) {
+		sts = PM_ERR_SIGN;
+		break;
+	    }
+	    pmcd_fetch_window = val;
+	}
 	else if (cluster == 6) {
 	    if (item == 0 ||	/* pmcd.client.whoami */
 		item == 2) {	/* pmcd.client.container */
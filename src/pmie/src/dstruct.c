@@ -584,6 +584,7 @@ freeHost(Host *h)
 	    freeTask(h->task);
 	}
 	symFree(h->name);
+	if (h->pmids) free(h->pmids);
 	free(h);
     }
 }
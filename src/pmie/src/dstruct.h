@@ -65,6 +65,7 @@ typedef double		RealTime;	/* wall clock time or interval */
 #define RETRY		5		/* initial retry interval */
 #define DELTA_DFLT	10		/* default sample interval */
 #define DELTA_MIN	0.1		/* minimum sample interval */
+#define COINCIDE	0.001		/* evaluation times this close coincide */
 
 
 /***********************************************************************
@@ -174,15 +175,16 @@ typedef struct profile {
     int		    need_all;	/* all instances required */
 } Profile;
 
-/* bundled fetch request for multiple metrics */
+/* bundled fetch request for multiple metrics, for live hosts shared
+   by all Tasks using the same host connection */
 typedef struct fetch {
     struct profile *profiles;   /* list of Profiles for this Fetch */
     struct host    *host;	/* Host owning this Fetch */
     struct fetch   *next;	/* fetch list forward pointer */
     struct fetch   *prev;	/* fetch list backward pointer */
     int            handle;      /* PMCS context handle */
-    int		   npmids;	/* number of metrics in fetch */
-    pmID	   *pmids;	/* array of metric ids to fetch */
+    int		   npmids;	/* number of metrics in fetch, all Tasks */
+    pmID	   *pmids;	/* array of metric ids to fetch, all Tasks */
     pmResult       *result;     /* result of fetch */
 } Fetch;
 
@@ -199,6 +201,9 @@ typedef struct host {
     int	    	    down;	/* host is not delivering metrics */
     Metric	    *waits;	/* wait list of Metrics */
     Metric          *duds;	/* bad Metrics discovered during evaluation */
+    int		    npmids;	/* number of metrics fetched for this Task */
+    pmID	    *pmids;	/* metric ids fetched for this Task */
+    RealTime	    delivered;	/* values fetched for another Task at this time */
 } Host;
 
 /* element of evaluator task queue */
@@ -181,7 +181,15 @@ enable(Task *t)
 
     if (waiting(t) == 0) {
 	/* all clear now ... */
-	t->epoch = t->eval;
+	if (archives)
+	    t->epoch = t->eval;
+	else {
+	    /*
+	     * back onto the common time base shared by all Tasks, so
+	     * fetches coincide again with those of other Tasks
+	     */
+	    t->tick = (TickTime)((t->eval - t->epoch) / t->delta);
+	}
 	t->retry = 0;
     }
 }
@@ -260,21 +260,61 @@ getDoubleAsXTB(double *realtime, int *ival, int *mode)
 }
 
 
+/*
+ * find Fetch bundle of another Task for the same live host, so one
+ * pmFetch serves every Task due for evaluation at the same time
+ */
+static Fetch *
+sharedFetch(Host *h)
+{
+    Task	*t;
+    Host	*h2;
+
+    for (t = taskq; t != NULL; t = t->next) {
+	for (h2 = t->hosts; h2 != NULL; h2 = h2->next) {
+	    if (h2 != h && h2->conn == h->conn && h2->fetches != NULL)
+		return h2->fetches;
+	}
+    }
+    return NULL;
+}
+
+/* add pmid to the array of n pmids at *pmids, if not already there */
+static void
+addId(pmID pmid, int *n, pmID **pmids)
+{
+    pmID	*p = *pmids;
+    int		i;
+
+    for (i = 0; i < *n; i++) {
+	if (p[i] == pmid)
+	    return;
+    }
+    p = ralloc(p, (*n + 1) * sizeof(pmID));
+    p[*n] = pmid;
+    *n = *n + 1;
+    *pmids = p;
+}
+
 /* find Fetch bundle for Metric */
 static Fetch *
 findFetch(Host *h, Metric *m)
 {
     Fetch	    *f;
     int		    sts;
-    int		    i;
-    int		    n;
-    pmID	    pmid = m->desc.pmid;
-    pmID	    *p;
     struct timeval  tv;
 
     /* find existing Fetch bundle */
     f = h->fetches;
 
+    /* share Fetch bundle with other Tasks, live hosts only */
+    if (! f && ! archives && (f = sharedFetch(h)) != NULL) {
+	if (pmDebugOptions.appl1) {
+	    fprintf(stderr, "findFetch: fetch=0x%p host=0x%p delta=%.6f shared with host=0x%p\n", f, h, h->task->delta, f->host);
+	}
+	h->fetches = f;
+    }
+
     /* create new Fetch bundle */
     if (! f) {
 	f = newFetch(h);
@@ -304,22 +344,9 @@ findFetch(Host *h, Metric *m)
 	h->fetches = f;
     }
 
-    /* look for existing pmid */
-    p = f->pmids;
-    n = f->npmids;
-    for (i = 0; i < n; i++) {
-	if (*p == pmid) break;
-	p++;
-    }
-
-    /* add new pmid */
-    if (i == n) {
-	p = f->pmids;
-	p = ralloc(p, (n+1) * sizeof(pmID));
-	p[n] = pmid;
-	f->npmids = n + 1;
-	f->pmids = p;
-    }
+    /* add pmid for the bundle, and for this Task */
+    addId(m->desc.pmid, &f->npmids, &f->pmids);
+    addId(m->desc.pmid, &h->npmids, &h->pmids);
 
     return f;
 }
@@ -1081,28 +1108,112 @@ mark_all(Host *hdown)
     }
 }
 
+/*
+ * is Host h2 fed by the same fetch as Host h, which is about to be
+ * fetched for the Task being evaluated now?
+ */
+static int
+sameFetch(Host *h2, Host *h)
+{
+    return h2 == h ||
+	   (h2->fetches == h->fetches && ! h2->down &&
+	    fabs(h2->task->eval - now) < COINCIDE);
+}
+
+static int
+compareId(const void *a, const void *b)
+{
+    pmID	ia = *(pmID *)a;
+    pmID	ib = *(pmID *)b;
+
+    return ia < ib ? -1 : (ia > ib ? 1 : 0);
+}
+
+/*
+ * pmids to fetch from Fetch bundle f for Host h ... the metrics of all
+ * Tasks sharing f whose evaluation times coincide with now
+ */
+static int
+dueIds(Host *h, Fetch *f, pmID **pmids)
+{
+    static pmID	*ids;
+    static int	maxids;
+    Task	*t;
+    Host	*h2;
+    int		nhosts = 0;
+    int		ndue = 0;
+    int		n = 0;
+    int		i, j;
+
+    for (t = taskq; t != NULL; t = t->next) {
+	for (h2 = t->hosts; h2 != NULL; h2 = h2->next) {
+	    if (h2->fetches != f)
+		continue;
+	    nhosts++;
+	    if (! sameFetch(h2, h))
+		continue;
+	    ndue++;
+	    if (n + h2->npmids > maxids) {
+		maxids = n + h2->npmids;
+		ids = ralloc(ids, maxids * sizeof(pmID));
+	    }
+	    memcpy(&ids[n], h2->pmids, h2->npmids * sizeof(pmID));
+	    n += h2->npmids;
+	}
+    }
+
+    if (ndue == nhosts) {
+	/* usual case, everything in the bundle */
+	*pmids = f->pmids;
+	return f->npmids;
+    }
+
+    /* merge, dropping duplicates */
+    qsort(ids, n, sizeof(pmID), compareId);
+    for (i = j = 0; i < n; i++) {
+	if (j == 0 || ids[i] != ids[j-1])
+	    ids[j++] = ids[i];
+    }
+    *pmids = ids;
+    return j;
+}
+
 /* execute fetches for given Task */
 void
 taskFetch(Task *t)
 {
     Host	*h;
+    Host	*h2;
+    Task	*u;
     Fetch	*f;
     Profile	*p;
     Metric	*m;
     pmResult	*r;
     pmValueSet	**v;
+    pmID	*pmids;
+    int		npmids;
     int		i;
     int		sts;
 
     /* do all fetches, quick as you can */
     h = t->hosts;
     while (h) {
+	if (fabs(h->delivered - now) < COINCIDE) {
+	    /* values fetched along with another Task due now */
+	    h = h->next;
+	    continue;
+	}
 	f = h->fetches;
 	while (f) {
 	    if (f->result) pmFreeResult(f->result);
 	    if (! h->down) {
 		pmUseContext(f->handle);
-		if ((sts = pmFetch(f->npmids, f->pmids, &f->result)) < 0) {
+		npmids = dueIds(h, f, &pmids);
+		if (pmDebugOptions.appl2) {
+		    fprintf(stderr, "taskFetch: task " PRINTF_P_PFX "%p fetch " PRINTF_P_PFX "%p %d of %d pmids\n",
+			    t, f, npmids, f->npmids);
+		}
+		if ((sts = pmFetch(npmids, pmids, &f->result)) < 0) {
 		    if (archives) {
 			if (sts == PM_ERR_LOGREC) {
 			    fprintf(stderr, "%s: pmFetch failed: %s\n", pmGetProgname(),
@@ -1130,6 +1241,11 @@ taskFetch(Task *t)
     /* sort and distribute pmValueSets to requesting Metrics */
     h = t->hosts;
     while (h) {
+	if (fabs(h->delivered - now) < COINCIDE) {
+	    /* already distributed */
+	    h = h->next;
+	    continue;
+	}
 	if (! h->down) {
 	    f = h->fetches;
 	    while (f && (r = f->result)) {
@@ -1143,11 +1259,15 @@ taskFetch(Task *t)
 		    v++;
 		}
 
-		/* distribute pmValueSets to Metrics */
+		/* distribute pmValueSets to Metrics of all Tasks due now */
 		p = f->profiles;
 		while (p) {
 		    m = p->metrics;
 		    while (m) {
+			if (! sameFetch(m->host, h)) {
+			    m = m->next;
+			    continue;
+			}
 			for (i = 0; i < r->numpmid; i++) {
 			    if (m->desc.pmid == r->vset[i]->pmid) {
 				if (r->vset[i]->numval > 0) {
@@ -1161,6 +1281,14 @@ taskFetch(Task *t)
 		    }
 		    p = p->next;
 		}
+
+		/* other Tasks due now need not fetch again */
+		for (u = taskq; u != NULL; u = u->next) {
+		    for (h2 = u->hosts; h2 != NULL; h2 = h2->next) {
+			if (h2 != h && sameFetch(h2, h))
+			    h2->delivered = now;
+		    }
+		}
 		f = f->next;
 	    }
 	}
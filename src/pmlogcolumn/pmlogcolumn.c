@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * Build the columnar sidecar for one or more archives, see
+ * __pmLogWriteColumns() in libpcp for the format and how it is used.
+ */
+
+#include "pmapi.h"
+#include "libpcp.h"
+
+static pmLongOptions longopts[] = {
+    PMAPI_OPTIONS_HEADER("Options"),
+    PMOPT_DEBUG,
+    { "remove", 0, 'r', 0, "remove the sidecar instead of building it" },
+    { "verbose", 0, 'v', 0, "report on each sidecar written" },
+    PMOPT_HELP,
+    PMAPI_OPTIONS_END
+};
+
+static pmOptions opts = {
+    .short_options = "D:rv?",
+    .long_options = longopts,
+    .short_usage = "[options] archive ...",
+};
+
+int
+main(int argc, char *argv[])
+{
+    int		c;
+    int		sts;
+    int		rflag = 0;
+    int		verbose = 0;
+    int		status = 0;
+    char	*archive;
+    char	path[MAXPATHLEN];
+
+    while ((c = pmgetopt_r(argc, argv, &opts)) != EOF) {
+	switch (c) {
+	case 'D':	/* debug options */
+	    sts = pmSetDebug(opts.optarg);
+	    if (sts < 0) {
+		pmprintf("%s: unrecognized debug options specification (%s)\n",
+			pmGetProgname(), opts.optarg);
+		opts.errors++;
+	    }
+	    break;
+
+	case 'r':	/* remove */
+	    rflag = 1;
+	    break;
+
+	case 'v':	/* verbose */
+	    verbose = 1;
+	    break;
+
+	case '?':
+	default:
+	    opts.errors++;
+	    break;
+	}
+    }
+
+    if (opts.errors || opts.optind >= argc) {
+	pmUsageMessage(&opts);
+	exit(1);
+    }
+
+    for (c = opts.optind; c < argc; c++) {
+	archive = argv[c];
+	if (rflag) {
+	    if ((archive = strdup(archive)) == NULL) {
+		pmNoMem("archive", strlen(argv[c]) + 1, PM_FATAL_ERR);
+		/* NOTREACHED */
+	    }
+	    /* strip .meta, .index or .N if given, as for pmNewContext */
+	    __pmLogBaseName(archive);
+	    pmsprintf(path, sizeof(path), "%s.col", archive);
+	    free(archive);
+	    if (unlink(path) < 0 && oserror() != ENOENT) {
+		fprintf(stderr, "%s: cannot remove %s: %s\n",
+			pmGetProgname(), path, osstrerror());
+		status = 1;
+	    }
+	    else if (verbose)
+		printf("%s: removed\n", path);
+	    continue;
+	}
+	if ((sts = __pmLogWriteColumns(archive, verbose ? stdout : NULL)) < 0) {
+	    if (sts == -EOPNOTSUPP)
+		fprintf(stderr, "%s: %s: compressed archive volumes are not supported\n",
+			pmGetProgname(), archive);
+	    else if (sts == -EINVAL)
+		fprintf(stderr, "%s: %s: not a single archive\n",
+			pmGetProgname(), archive);
+	    else
+		fprintf(stderr, "%s: %s: %s\n",
+			pmGetProgname(), archive, pmErrStr(sts));
+	    status = 1;
+	}
+    }
+
+    exit(status);
+}
@@ -63,10 +63,13 @@ CONTROLDIR=$PCP_PMLOGGERCONTROL_PATH.d
 CULLAFTER=14
 
 # default compression program and days until starting compression
+# ... xz blocks are decompressed independently (and in parallel) when
+# archives are read, so random access does not mean decompressing
+# everything up to the point of interest
 # 
-COMPRESS=xz
+COMPRESS="xz --block-size=10MiB"
 COMPRESSAFTER=""
-COMPRESSREGEX="\.(meta|index|Z|gz|bz2|zip|xz|lzma|lzo|lz4)$"
+COMPRESSREGEX="\.(meta|index|Z|gz|bz2|zip|xz|lzma|lzo|lz4|zst)$"
 
 # threshold size to roll $PCP_LOG_DIR/NOTICES
 #
@@ -66,6 +66,8 @@ pmnewlog options:
 pmlogger options:
   --debug
   -c=FILE, --config=FILE  file to load configuration from
+  -d, --delta             log only values changed since the last full result
+  -F=DELTA, --commit=DELTA commit archive writes at most once per interval
   -H=LABELHOST, --labelhost override the hostname written into the label
   -l=FILE, --log=FILE     redirect diagnostics and trace output
   -L, --linger            run even if not primary logger instance and nothing to log
@@ -74,11 +76,13 @@ pmlogger options:
   -K=SPEC, --spec-local=SPEC optional additional PMDA spec for local connection
   -o, --local-PMDA        metrics source is local connection to a PMDA
   -P, --primary           execute as primary logger instance
+  -Q=SIZE, --queue=SIZE   limit archive writes queued to size
   -r, --report            report record sizes and archive growth rate
   -t=DELTA, --interval=DELTA default logging interval
   -T=TIME, --finish=TIME  end of the time window
   -v=SIZE, --volsize=SIZE switch log volumes after size has been accumulated
   -y                      set timezone for times to local time rather than from PMCD host
+  -Z=TYPE, --compress=TYPE write data volumes compressed with xz or zstd
 EOF
 
 _abandon()
@@ -280,11 +284,11 @@ do
 # pmlogger flags passed through
 #
 
-	-L|-o|-r|-y)
+	-d|-L|-o|-r|-y)
 		args="${args}$1 "
 		;;
 
-	-D|-H|-K|-m|-t|-T|-v)
+	-D|-F|-H|-K|-m|-Q|-t|-T|-v|-Z)
 		args="${args}$1 $2 "
 		shift
 		;;
@@ -40,6 +40,9 @@ typedef struct _lastfetch {
     fetchctl_t		*lf_fp;
     pmResult		*lf_resp;
     __pmPDU		*lf_pb;
+    pmResult		*lf_key;	/* last result logged in full (-d) */
+    int			lf_keyoff;	/* ... at this offset */
+    int			lf_keyvol;	/* ... in this volume */
 } lastfetch_t;
 
 typedef struct _AFctl {
@@ -528,6 +531,150 @@ log_callback(int afid, void *data)
     }
 }
 
+/*
+ * -d support ... has a value changed since the key record?
+ */
+static int
+valchanged(int valfmt, const pmValue *kvp, const pmValue *vp)
+{
+    if (valfmt == PM_VAL_INSITU)
+	return kvp->value.lval != vp->value.lval;
+    if (kvp->value.pval->vlen != vp->value.pval->vlen)
+	return 1;
+    return memcmp(kvp->value.pval, vp->value.pval, vp->value.pval->vlen) != 0;
+}
+
+static void
+freedelta(pmResult *dp)
+{
+    int		i;
+
+    /* values belong to the result the delta was built from */
+    for (i = 0; i < dp->numpmid; i++)
+	free(dp->vset[i]);
+    free(dp);
+}
+
+/*
+ * Build the delta result record (see PM_LOG_DELTA in libpcp.h) for
+ * resp, holding only the values that differ from those in the key
+ * record for this fetch group.  Returns NULL if resp is to be logged
+ * in full instead (and become the new key record), because there is
+ * no key record in this volume, the metrics, instances or value formats
+ * have changed, or more than half of the values have changed.
+ */
+static pmResult *
+deltaresult(lastfetch_t *lfp, pmResult *resp)
+{
+    pmResult	*key = lfp->lf_key;
+    pmResult	*dp;
+    pmValueSet	*kvsp;
+    pmValueSet	*vsp;
+    pmValueSet	*dvsp;
+    int		nvset = 0;	/* vsets with changed values */
+    int		nvalue = 0;	/* values */
+    int		nchange = 0;	/* changed values */
+    int		i;
+    int		j;
+    int		n;
+
+    if (key == NULL || lfp->lf_keyvol != archctl.ac_curvol ||
+	key->numpmid != resp->numpmid)
+	return NULL;
+    for (i = 0; i < resp->numpmid; i++) {
+	kvsp = key->vset[i];
+	vsp = resp->vset[i];
+	if (kvsp->pmid != vsp->pmid || kvsp->numval != vsp->numval)
+	    return NULL;
+	if (vsp->numval <= 0)
+	    continue;
+	if (kvsp->valfmt != vsp->valfmt)
+	    return NULL;
+	for (j = n = 0; j < vsp->numval; j++) {
+	    if (kvsp->vlist[j].inst != vsp->vlist[j].inst)
+		return NULL;
+	    n += valchanged(vsp->valfmt, &kvsp->vlist[j], &vsp->vlist[j]);
+	}
+	nvalue += vsp->numval;
+	nchange += n;
+	if (n > 0)
+	    nvset++;
+    }
+    if (nchange * 2 > nvalue)
+	return NULL;
+
+    /* vset[0] is the header, then one vset for each changed metric */
+    if ((dp = (pmResult *)calloc(1, sizeof(pmResult) + nvset * sizeof(pmValueSet *))) == NULL)
+	pmNoMem("deltaresult: result", sizeof(pmResult) + nvset * sizeof(pmValueSet *), PM_FATAL_ERR);
+    dp->timestamp = resp->timestamp;
+    if ((dvsp = (pmValueSet *)malloc(sizeof(pmValueSet))) == NULL)
+	pmNoMem("deltaresult: header", sizeof(pmValueSet), PM_FATAL_ERR);
+    dvsp->pmid = PM_ID_NULL;
+    dvsp->numval = 1;
+    dvsp->valfmt = PM_VAL_INSITU;
+    dvsp->vlist[0].inst = PM_IN_NULL;
+    dvsp->vlist[0].value.lval = lfp->lf_keyoff;
+    dp->vset[dp->numpmid++] = dvsp;
+
+    for (i = 0; i < resp->numpmid; i++) {
+	kvsp = key->vset[i];
+	vsp = resp->vset[i];
+	for (j = n = 0; j < vsp->numval; j++)
+	    n += valchanged(vsp->valfmt, &kvsp->vlist[j], &vsp->vlist[j]);
+	if (n == 0)
+	    continue;
+	if ((dvsp = (pmValueSet *)malloc(sizeof(pmValueSet) + (n - 1) * sizeof(pmValue))) == NULL)
+	    pmNoMem("deltaresult: vset", sizeof(pmValueSet) + (n - 1) * sizeof(pmValue), PM_FATAL_ERR);
+	dvsp->pmid = vsp->pmid;
+	dvsp->numval = n;
+	dvsp->valfmt = vsp->valfmt;
+	for (j = n = 0; j < vsp->numval; j++) {
+	    if (valchanged(vsp->valfmt, &kvsp->vlist[j], &vsp->vlist[j]))
+		dvsp->vlist[n++] = vsp->vlist[j];	/* struct assignment */
+	}
+	dp->vset[dp->numpmid++] = dvsp;
+    }
+    return dp;
+}
+
+/*
+ * -d output path ... log resp as a delta result record if possible,
+ * else in full, when it becomes the key record for this fetch group
+ */
+static void
+putresult(lastfetch_t *lfp, pmResult *resp)
+{
+    __pmPDU	*pdubuf;
+    pmResult	*dp;
+    int		sts;
+
+    if ((dp = deltaresult(lfp, resp)) != NULL) {
+	sts = __pmEncodeDeltaResult(__pmFileno(archctl.ac_mfp), dp, &pdubuf);
+	freedelta(dp);
+	if (sts < 0) {
+	    fprintf(stderr, "__pmEncodeDeltaResult: %s\n", pmErrStr(sts));
+	    exit(1);
+	}
+    }
+    else {
+	if ((sts = __pmEncodeResult(__pmFileno(archctl.ac_mfp), resp, &pdubuf)) < 0) {
+	    fprintf(stderr, "__pmEncodeResult: %s\n", pmErrStr(sts));
+	    exit(1);
+	}
+	if (lfp->lf_key != NULL && lfp->lf_key != lfp->lf_resp)
+	    pmFreeResult(lfp->lf_key);
+	lfp->lf_key = resp;
+	lfp->lf_keyoff = last_log_offset;
+	lfp->lf_keyvol = archctl.ac_curvol;
+    }
+    if ((sts = __pmLogPutResult2(&archctl, pdubuf)) < 0) {
+	fprintf(stderr, "__pmLogPutResult2: %s\n", pmErrStr(sts));
+	exit(1);
+    }
+    __pmUnpinPDUBuf(pdubuf);
+    __pmOverrideLastFd(__pmFileno(archctl.ac_mfp));
+}
+
 /*
  * do real work from callback ...
  */
@@ -573,6 +720,10 @@ do_work(task_t *tp)
 	/* ignore callbacks until all of the config file has been parsed */
 	return;
 
+    if (writer_sample_begin() < 0)
+	/* archive writer is too far behind, skip this sample */
+	return;
+
     /* find AFctl_t for this afid */
     for (acp = achead; acp != (AFctl_t *)0; acp = acp->ac_next) {
 	if (acp->ac_afid == tp->t_afid)
@@ -597,6 +748,9 @@ do_work(task_t *tp)
 	    }
 	    if (fp == (fetchctl_t *)0) {
 		lfp->lf_fp = (fetchctl_t *)0;	/* mark lastfetch_t as free */
+		if (lfp->lf_key != NULL && lfp->lf_key != lfp->lf_resp)
+		    pmFreeResult(lfp->lf_key);
+		lfp->lf_key = NULL;
 		if (lfp->lf_resp != (pmResult *)0) {
 		    pmFreeResult(lfp->lf_resp);
 		    lfp->lf_resp =(pmResult *)0;
@@ -696,11 +850,12 @@ do_work(task_t *tp)
 	 * Unfortunately, if we have derived metrics we need to rewrite
 	 * the PMIDs, and this can't be done until after the pmResult
 	 * is decoded ... so we have 2 "write" paths for the PDU buffer
-	 * ... more sighing
+	 * ... more sighing.  And with -d, the record to be written
+	 * depends on the decoded values, so a third path.
 	 */
 	last_log_offset = __pmFtell(archctl.ac_mfp);
 	assert(last_log_offset >= 0);
-	if (tp->t_dm == 0) {
+	if (tp->t_dm == 0 && !dflag) {
 	    if ((sts = __pmLogPutResult2(&archctl, pb)) < 0) {
 		fprintf(stderr, "__pmLogPutResult2: %s\n", pmErrStr(sts));
 		exit(1);
@@ -732,6 +887,8 @@ do_work(task_t *tp)
 	     * This forces the PMID in the archive to NOT look like
 	     * the PMID of a derived metric, which is need to replay
 	     * the archive correctly.
+	     *
+	     * Fetch groups with derived metrics are always logged in full.
 	     */
 	    __pmPDU	*pdubuf;
 	    for (i = 0; i < resp->numpmid; i++) {
@@ -755,6 +912,10 @@ do_work(task_t *tp)
 		    vsp->pmid = CLEAR_DERIVED_LOGGED(vsp->pmid);
 	    }
 	}
+	else if (dflag) {
+	    /* log a delta, or a new key record, via putresult() */
+	    putresult(lfp, resp);
+	}
 
 	needti = 0;
 	old_meta_offset = __pmFtell(logctl.l_mdfp);
@@ -909,9 +1070,10 @@ do_work(task_t *tp)
 
 	last_stamp = resp->timestamp;	/* struct assignment */
 
-	if (lfp->lf_resp != (pmResult *)0) {
+	if (lfp->lf_resp != (pmResult *)0 && lfp->lf_resp != lfp->lf_key) {
 	    /*
 	     * release memory that is allocated and pinned in pmDecodeResult
+	     * (unless still needed as the key record for -d)
 	     */
 	    pmFreeResult(lfp->lf_resp);
 	}
@@ -970,6 +1132,8 @@ do_work(task_t *tp)
 	}
     }
 
+    writer_sample_end();
+
     if (exit_samples > 0)
 	exit_samples--;
 
@@ -1350,11 +1350,12 @@ do_request(__pmPDU *pb)
 
 	case LOG_REQUEST_SYNC:
 	    /*
-	     * Don't need to check access controls, as this is now
-	     * a no-op with unbuffered I/O from pmlogger.
+	     * Don't need to check access controls, as this only
+	     * waits for the archive writer thread to catch up.
 	     *
-	     * Do nothing, simply send status 0 back to pmlc.
+	     * Then simply send status 0 back to pmlc.
 	     */
+	    writer_sync();
 	    sts = __pmSendError(clientfd, FROM_ANON, 0);
 	    break;
 
@@ -149,6 +149,7 @@ extern char		*pmcd_host;		/* collecting from PMCD on this host */
 extern char		*pmcd_host_conn;	/* ... and this is how we connected to it */
 extern int		primary;		/* Non-zero for primary logger */
 extern int		rflag;
+extern int		dflag;			/* delta result records */
 extern struct timeval	delta;			/* default logging interval */
 extern int		ctlport;		/* pmlogger control port number */
 extern char		*note;			/* note for port map file */
@@ -180,6 +181,19 @@ extern int		sig_code;
 /* event record handling */
 extern int do_events(pmValueSet *);
 
+/* archive writer thread */
+#define WRITER_META	0	/* metadata, written first in each commit */
+#define WRITER_DATA	1	/* data volume */
+#define WRITER_INDEX	2	/* temporal index, written last */
+#define WRITER_NKINDS	3
+extern int writer_start(const struct timeval *, __int64_t);
+extern __pmFILE *writer_attach(__pmFILE *, int);
+extern __pmFILE *writer_attach_volume(__pmFILE *, const char *, int);
+extern int writer_compression(const char *);
+extern void writer_sync(void);
+extern int writer_sample_begin(void);
+extern void writer_sample_end(void);
+
 /* QA testing and error injection support ... see do_request() */
 extern int	qa_case;
 #define QA_OFF		100
@@ -29,6 +29,8 @@ struct timeval  exit_time;               /* time interval 'til exit */
 int		vol_switch_samples = -1; /* number of samples 'til vol switch */
 __int64_t	vol_switch_bytes = -1;   /* number of bytes 'til vol switch */
 struct timeval	vol_switch_time;         /* time interval 'til vol switch */
+struct timeval	commit_time;		 /* group commit interval, see -F */
+__int64_t	queue_bytes = 4*1024*1024; /* writer queue limit, see -Q */
 int		vol_samples_counter;     /* Counts samples - reset for new vol*/
 int		vol_switch_afid = -1;    /* afid of event for vol switch */
 int		vol_switch_flag;         /* sighup received - switch vol now */
@@ -45,6 +47,7 @@ int		host_context = PM_CONTEXT_HOST;	 /* pmcd / local context mode */
 int		archive_version = PM_LOG_VERS02; /* Type of archive to create */
 int		linger = 0;		/* linger with no tasks/events */
 int		rflag;			/* report sizes */
+int		dflag;			/* delta result records, see -d */
 int		Cflag;			/* parse config and exit */
 struct timeval	epoch;
 struct timeval	delta = { 60, 0 };	/* default logging interval */
@@ -494,8 +497,10 @@ static pmLongOptions longopts[] = {
     { "config", 1, 'c', "FILE", "file to load configuration from" },
     { "check", 0, 'C', 0, "parse configuration and exit" },
     PMOPT_DEBUG,
+    { "delta", 0, 'd', 0, "log only values changed since the last full result" },
     PMOPT_HOST,
     { "labelhost", 1, 'H', "LABELHOST", "override the hostname written into the label" },
+    { "commit", 1, 'F', "DELTA", "commit archive writes at most once per interval" },
     { "log", 1, 'l', "FILE", "redirect diagnostics and trace output" },
     { "linger", 0, 'L', 0, "run even if not primary logger instance and nothing to log" },
     { "note", 1, 'm', "MSG", "descriptive note to be added to the port map file" },
@@ -504,6 +509,7 @@ static pmLongOptions longopts[] = {
     PMOPT_NAMESPACE,
     { "PID", 1, 'p', "PID", "Log specified metric for the lifetime of the pid" },
     { "primary", 0, 'P', 0, "execute as primary logger instance" },
+    { "queue", 1, 'Q', "SIZE", "limit archive writes queued to size [default 4Mb]" },
     { "report", 0, 'r', 0, "report record sizes and archive growth rate" },
     { "size", 1, 's', "SIZE", "terminate after endsize has been accumulated" },
     { "interval", 1, 't', "DELTA", "default logging interval [default 60.0 seconds]" },
@@ -512,6 +518,7 @@ static pmLongOptions longopts[] = {
     { "username", 1, 'U', "USER", "in daemon mode, run as named user [default pcp]" },
     { "volsize", 1, 'v', "SIZE", "switch log volumes after size has been accumulated" },
     { "version", 1, 'V', "NUM", "version for archive (default and only version is 2)" },
+    { "compress", 1, 'Z', "TYPE", "write data volumes compressed with xz or zstd" },
     { "", 1, 'x', "FD", "control file descriptor for running from pmRecordControl(3)" },
     { "", 0, 'y', 0, "set timezone for times to local time rather than from PMCD host" },
     PMOPT_HELP,
@@ -519,7 +526,7 @@ static pmLongOptions longopts[] = {
 };
 
 static pmOptions opts = {
-    .short_options = "c:CD:h:H:l:K:Lm:n:op:Prs:T:t:uU:v:V:x:y?",
+    .short_options = "c:CdD:F:h:H:l:K:Lm:n:op:PQ:rs:T:t:uU:v:V:x:yZ:?",
     .long_options = longopts,
     .short_usage = "[options] archive",
 };
@@ -636,6 +643,10 @@ main(int argc, char **argv)
 	    Cflag = 1;
 	    break;
 
+	case 'd':		/* delta result records */
+	    dflag = 1;
+	    break;
+
 	case 'D':	/* debug flag */
 	    sts = pmSetDebug(opts.optarg);
 	    if (sts < 0) {
@@ -645,6 +656,14 @@ main(int argc, char **argv)
 	    }
 	    break;
 
+	case 'F':		/* group commit interval */
+	    if (pmParseInterval(opts.optarg, &commit_time, &p) < 0) {
+		pmprintf("%s: illegal -F argument\n%s", pmGetProgname(), p);
+		free(p);
+		opts.errors++;
+	    }
+	    break;
+
 	case 'h':		/* hostname for PMCD to contact */
 	    pmcd_host_conn = opts.optarg;
 	    break;
@@ -708,6 +727,20 @@ main(int argc, char **argv)
 	    isdaemon = 1;
 	    break;
 
+	case 'Q':		/* writer queue limit */
+	    {
+		int		samples;
+		struct timeval	interval;
+
+		sts = ParseSize(opts.optarg, &samples, &queue_bytes, &interval);
+		if (sts < 0 || queue_bytes <= 0) {
+		    pmprintf("%s: illegal size argument '%s' for queue size\n",
+			    pmGetProgname(), opts.optarg);
+		    opts.errors++;
+		}
+	    }
+	    break;
+
 	case 'r':		/* report sizes of pmResult records */
 	    rflag = 1;
 	    break;
@@ -743,8 +776,8 @@ main(int argc, char **argv)
 
 	case 'u':		/* flush output buffers after each fetch */
 	    /*
-	     * all archive write I/O is unbuffered now, so maintain -u
-	     * for backwards compatibility only
+	     * archive writes are committed by the writer thread now
+	     * (see -F), so maintain -u for backwards compatibility only
 	     */
 	    break;
 
@@ -786,6 +819,14 @@ main(int argc, char **argv)
 	    use_localtime = 1;
 	    break;
 
+	case 'Z':		/* compressed data volumes */
+	    if (writer_compression(opts.optarg) < 0) {
+		pmprintf("%s: unsupported compression type (%s)\n",
+			pmGetProgname(), opts.optarg);
+		opts.errors++;
+	    }
+	    break;
+
 	case '?':
 	default:
 	    opts.errors++;
@@ -1016,6 +1057,13 @@ main(int argc, char **argv)
 
     fprintf(stderr, "Archive basename: %s\n", archBase);
 
+    /* from here on, archive writes are queued for the writer thread */
+    if (writer_start(&commit_time, queue_bytes) == 0) {
+	archctl.ac_mfp = writer_attach_volume(archctl.ac_mfp, archBase, 0);
+	logctl.l_mdfp = writer_attach(logctl.l_mdfp, WRITER_META);
+	logctl.l_tifp = writer_attach(logctl.l_tifp, WRITER_INDEX);
+    }
+
 #ifndef IS_MINGW
     /* detach yourself from the launching process */
     if (isdaemon)
@@ -1277,6 +1325,7 @@ newvolume(int vol_switch_type)
     }
 
     if ((newfp = __pmLogNewFile(archBase, nextvol)) != NULL) {
+	newfp = writer_attach_volume(newfp, archBase, nextvol);
 	if (logctl.l_state == PM_LOG_STATE_NEW) {
 	    /*
 	     * nothing has been logged as yet, force out the label records
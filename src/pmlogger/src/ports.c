@@ -87,6 +87,7 @@ cleanup(void)
      * we have QA than camps on the control file(s) and assumes the
      * log file is complete once the control file(s) is removed.
      */
+    writer_sync();
     fflush(NULL);
 
     if (linkfile != NULL) {
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+#ifndef PMLOGGER_STATS_H
+#define PMLOGGER_STATS_H
+
+#include <sys/types.h>
+
+/*
+ * subdir nested under PCP_TMP_DIR ... not the "pmlogger" port file
+ * directory, where every file named by a pid is taken to be a port file
+ */
+#define PMLOGGER_STATS_SUBDIR	"pmlogger_stats"
+
+/* pmlogger archive writer instrumentation */
+typedef struct {
+    __uint64_t		write_bytes;		/* pmcd.pmlogger.write.bytes   */
+    __uint64_t		write_commits;		/* pmcd.pmlogger.write.commits */
+    __uint64_t		write_time;		/* pmcd.pmlogger.write.time    */
+    unsigned int	write_max;		/* pmcd.pmlogger.write.max     */
+    unsigned int	write_queue;		/* pmcd.pmlogger.write.queue   */
+    unsigned int	samples_dropped;	/* pmcd.pmlogger.samples.dropped */
+    unsigned int	samples_late;		/* pmcd.pmlogger.samples.late  */
+    unsigned int	version;
+} pmloggerstats_t;
+
+#endif /* PMLOGGER_STATS_H */
@@ -0,0 +1,910 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * Archive writer thread.
+ *
+ * The data volume, metadata and temporal index files are wrapped in a
+ * write-behind __pmFILE handler (writer_attach), so each record written
+ * by do_work() and the __pmLogPut*() routines is copied to a queue and
+ * the sampling thread carries on with the next fetch.  The handler keeps
+ * its own file positions, so the __pmFtell() and __pmFseek() calls that
+ * locate records for the temporal index never wait for the disk.
+ *
+ * The writer thread takes everything queued as one group commit: the
+ * metadata is written and flushed first, then the data volume, then the
+ * temporal index, so a reader never finds an index entry or a result
+ * that refers to something not yet written.  With -F, commits are at
+ * most one interval apart, trading visibility for fewer, larger writes.
+ *
+ * The queue is bounded (-Q).  A record written while it is full waits for
+ * the writer, and the sample is counted as late; a sample that comes due
+ * while it is full is dropped rather than fetched late.
+ *
+ * With -Z, data volumes are written compressed, as a series of xz streams
+ * or zstd frames that libpcp decodes independently.  The data for a frame
+ * is gathered by the writer thread, and the frame is written out whenever
+ * a commit includes a temporal index entry (so every offset in the index
+ * is in a complete frame), when the volume is closed, and on writer_sync().
+ */
+#include "logger.h"
+#include "stats.h"
+#include <signal.h>
+#include <sys/stat.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#if HAVE_LZMA_DECOMPRESSION
+#include <lzma.h>
+#endif
+#if HAVE_ZSTD_DECOMPRESSION
+#include <zstd.h>
+#endif
+
+#define WRITER_BUFSIZE	65536		/* stdio buffer for each file */
+
+typedef struct {
+    const char	*name;		/* -Z argument */
+    const char	*suffix;	/* appended to data volume file names */
+    int		(*compress)(const char *, size_t, char **, size_t *);
+} compressor_t;
+
+#if HAVE_LZMA_DECOMPRESSION
+/*
+ * One single-block xz stream per frame.  The frames are far smaller
+ * than the preset dictionary, so it is trimmed to suit, which keeps
+ * the encoder memory (and its setup cost) down.
+ */
+static int
+xz_compress(const char *in, size_t len, char **out, size_t *outlen)
+{
+    lzma_options_lzma	opts;
+    lzma_filter		filters[2];
+    lzma_ret		sts;
+    size_t		max = lzma_stream_buffer_bound(len);
+    size_t		pos = 0;
+
+    if (lzma_lzma_preset(&opts, LZMA_PRESET_DEFAULT))
+	return -EINVAL;
+    if (opts.dict_size > len)
+	opts.dict_size = len < LZMA_DICT_SIZE_MIN ? LZMA_DICT_SIZE_MIN : len;
+    filters[0].id = LZMA_FILTER_LZMA2;
+    filters[0].options = &opts;
+    filters[1].id = LZMA_VLI_UNKNOWN;
+    if ((*out = (char *)malloc(max)) == NULL)
+	return -ENOMEM;
+    sts = lzma_stream_buffer_encode(filters, LZMA_CHECK_CRC64, NULL,
+		(const uint8_t *)in, len, (uint8_t *)*out, &pos, max);
+    if (sts != LZMA_OK) {
+	free(*out);
+	return sts == LZMA_MEM_ERROR ? -ENOMEM : -EINVAL;
+    }
+    *outlen = pos;
+    return 0;
+}
+#endif
+
+#if HAVE_ZSTD_DECOMPRESSION
+/* one zstd frame per frame, with the content size recorded */
+static int
+zstd_compress(const char *in, size_t len, char **out, size_t *outlen)
+{
+    size_t	max = ZSTD_compressBound(len);
+    size_t	sts;
+
+    if ((*out = (char *)malloc(max)) == NULL)
+	return -ENOMEM;
+    sts = ZSTD_compress(*out, max, in, len, 3);
+    if (ZSTD_isError(sts)) {
+	free(*out);
+	return -EINVAL;
+    }
+    *outlen = sts;
+    return 0;
+}
+#endif
+
+static const compressor_t compressors[] = {
+#if HAVE_LZMA_DECOMPRESSION
+    { "xz",	".xz",	xz_compress },
+#endif
+#if HAVE_ZSTD_DECOMPRESSION
+    { "zstd",	".zst",	zstd_compress },
+#endif
+    { NULL }
+};
+
+static const compressor_t *compressor;	/* from -Z, else NULL */
+
+static pmloggerstats_t	instrument;	/* used if no mmap */
+static pmloggerstats_t	*perf = &instrument;
+static char		perffile[MAXPATHLEN];
+static pid_t		perfpid;
+
+#ifdef HAVE_PTHREAD_H
+
+typedef struct wfile {
+    __pmFILE	*real;		/* file opened by libpcp */
+    int		kind;		/* WRITER_META, WRITER_DATA, WRITER_INDEX */
+    off_t	posn;		/* logical position, sampling thread */
+    off_t	size;		/* logical size, sampling thread */
+    off_t	wposn;		/* position of real, writer thread */
+    int		dirty;		/* written in this commit, writer thread */
+    int		closing;	/* closed in this commit, writer thread */
+    const compressor_t *zip;	/* compressed data volume, else NULL */
+    char	*frame;		/* data for the next frame, writer thread */
+    size_t	framelen;
+    size_t	framemax;
+    struct wfile *znext;	/* list of compressed files */
+} wfile_t;
+
+typedef struct wop {
+    struct wop	*next;
+    wfile_t	*file;
+    int		close;		/* close the file, after any writes */
+    off_t	offset;
+    size_t	len;
+    char	data[1];
+} wop_t;
+
+static pthread_mutex_t	writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	writer_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	writer_space = PTHREAD_COND_INITIALIZER;
+
+/* all protected by writer_lock */
+static wop_t		*writer_head;
+static wop_t		*writer_tail;
+static size_t		writer_queued;		/* bytes in the queue */
+static size_t		writer_limit;
+static int		writer_busy;		/* writer has a commit in hand */
+static int		writer_draining;	/* writer_sync() is waiting */
+static int		writer_stalled;		/* a write waited for space */
+static int		writer_error;		/* first write error, sticky */
+static size_t		writer_framed;		/* bytes held for frames */
+static wfile_t		*writer_zfiles;		/* compressed files, see below */
+
+static struct timeval	writer_interval;
+static int		writer_started;
+static pid_t		writer_pid;
+
+static void
+writer_failed(void)
+{
+    int		sts = oserror() ? oserror() : EIO;
+
+    pthread_mutex_lock(&writer_lock);
+    if (writer_error == 0) {
+	writer_error = sts;
+	fprintf(stderr, "%s: archive write failed: %s\n",
+		pmGetProgname(), pmErrStr(-sts));
+    }
+    pthread_mutex_unlock(&writer_lock);
+}
+
+/*
+ * Add data to the next frame of a compressed data volume, which can
+ * only be appended to.
+ */
+static int
+writer_gather(wfile_t *w, const wop_t *op)
+{
+    size_t	need = w->framelen + op->len;
+    char	*frame;
+
+    if (op->offset != w->wposn) {
+	setoserror(ESPIPE);
+	return -1;
+    }
+    if (need > w->framemax) {
+	need = need < 2 * w->framemax ? 2 * w->framemax : need;
+	if ((frame = (char *)realloc(w->frame, need)) == NULL) {
+	    setoserror(ENOMEM);
+	    return -1;
+	}
+	w->frame = frame;
+	w->framemax = need;
+    }
+    memcpy(w->frame + w->framelen, op->data, op->len);
+    w->framelen += op->len;
+    w->wposn += op->len;
+    return 0;
+}
+
+/* compress and write out the data gathered for a frame */
+static int
+writer_frame(wfile_t *w)
+{
+    char	*out;
+    size_t	outlen;
+    int		sts;
+
+    if (w->framelen == 0)
+	return 0;
+    if ((sts = w->zip->compress(w->frame, w->framelen, &out, &outlen)) < 0) {
+	setoserror(-sts);
+	return -1;
+    }
+    if (__pmFwrite(out, 1, outlen, w->real) != outlen)
+	sts = -1;
+    free(out);
+    w->framelen = 0;
+    w->dirty = 1;
+    return sts;
+}
+
+/*
+ * Write out one batch of queued records, file kind by file kind, and
+ * then close any files that are finished with.  If sync is set, or the
+ * batch holds a temporal index entry, all pending frames are written out
+ * too.  Returns the number of bytes the batch held.
+ */
+static size_t
+writer_commit(wop_t *batch, int sync)
+{
+    wop_t	*op, *next;
+    wfile_t	*w, *zfiles;
+    size_t	bytes = 0;
+    int		kind;
+    int		failed = 0;
+
+    for (op = batch; op != NULL; op = op->next) {
+	if (op->close)
+	    op->file->closing = 1;
+	else if (op->file->kind == WRITER_INDEX)
+	    sync = 1;
+    }
+    /* only this thread removes files from the list, see writer_attach */
+    pthread_mutex_lock(&writer_lock);
+    zfiles = writer_zfiles;
+    pthread_mutex_unlock(&writer_lock);
+
+    for (kind = 0; kind < WRITER_NKINDS; kind++) {
+	for (op = batch; op != NULL; op = op->next) {
+	    w = op->file;
+	    if (w->kind != kind || op->len == 0 || failed)
+		continue;
+	    if (w->zip != NULL) {
+		if (writer_gather(w, op) < 0) {
+		    failed = 1;
+		    break;
+		}
+		continue;
+	    }
+	    if (w->wposn != op->offset &&
+		__pmFseek(w->real, op->offset, SEEK_SET) < 0) {
+		failed = 1;
+		break;
+	    }
+	    if (__pmFwrite(op->data, 1, op->len, w->real) != op->len) {
+		failed = 1;
+		break;
+	    }
+	    w->wposn = op->offset + op->len;
+	    w->dirty = 1;
+	}
+	for (w = zfiles; w != NULL && !failed; w = w->znext) {
+	    if (w->kind != kind || !(sync || w->closing))
+		continue;
+	    if (writer_frame(w) < 0 ||
+		(w->dirty && __pmFflush(w->real) != 0))
+		failed = 1;
+	    w->dirty = 0;
+	}
+	for (op = batch; op != NULL; op = op->next) {
+	    w = op->file;
+	    if (w->kind != kind || !w->dirty)
+		continue;
+	    w->dirty = 0;
+	    if (!failed && __pmFflush(w->real) != 0)
+		failed = 1;
+	}
+	if (failed) {
+	    writer_failed();
+	    /* nothing more will be written, so give up on any frames */
+	    for (w = zfiles; w != NULL; w = w->znext)
+		w->framelen = 0;
+	    break;
+	}
+    }
+
+    for (op = batch; op != NULL; op = next) {
+	next = op->next;
+	bytes += op->len;
+	if (op->close) {
+	    w = op->file;
+	    if (w->zip != NULL) {
+		wfile_t	**wp;
+
+		pthread_mutex_lock(&writer_lock);
+		for (wp = &writer_zfiles; *wp != NULL; wp = &(*wp)->znext) {
+		    if (*wp == w) {
+			*wp = w->znext;
+			break;
+		    }
+		}
+		pthread_mutex_unlock(&writer_lock);
+		free(w->frame);
+	    }
+	    __pmFclose(w->real);
+	    free(w);
+	}
+	free(op);
+    }
+    return bytes;
+}
+
+/* bytes gathered for frames not yet written out */
+static size_t
+writer_pending(void)
+{
+    wfile_t	*w;
+    size_t	bytes = 0;
+
+    for (w = writer_zfiles; w != NULL; w = w->znext)
+	bytes += w->framelen;
+    return bytes;
+}
+
+static void *
+writer_main(void *arg)
+{
+    wop_t		*batch;
+    size_t		bytes;
+    int			sync;
+    struct timeval	last = { 0, 0 };
+    struct timeval	start, end;
+    struct timespec	wake;
+    unsigned int	usec;
+    double		elapsed;
+
+    (void)arg;
+    pthread_mutex_lock(&writer_lock);
+    for ( ; ; ) {
+	while (writer_head == NULL && !(writer_draining && writer_framed))
+	    pthread_cond_wait(&writer_work, &writer_lock);
+
+	/* group commit: hold off until the interval is up, unless pushed */
+	if ((writer_interval.tv_sec || writer_interval.tv_usec) &&
+	    !writer_draining && writer_queued < writer_limit) {
+	    struct timeval	due = last;
+
+	    pmtimevalInc(&due, &writer_interval);
+	    pmtimevalNow(&start);
+	    if (pmtimevalSub(&due, &start) > 0) {
+		wake.tv_sec = due.tv_sec;
+		wake.tv_nsec = due.tv_usec * 1000;
+		pthread_cond_timedwait(&writer_work, &writer_lock, &wake);
+		continue;
+	    }
+	}
+
+	batch = writer_head;
+	writer_head = writer_tail = NULL;
+	writer_busy = 1;
+	sync = writer_draining;
+	pthread_mutex_unlock(&writer_lock);
+
+	pmtimevalNow(&start);
+	bytes = writer_commit(batch, sync);
+	pmtimevalNow(&end);
+	elapsed = pmtimevalSub(&end, &start);
+	usec = elapsed < 0 ? 0 : (unsigned int)(elapsed * 1000000);
+
+	pthread_mutex_lock(&writer_lock);
+	writer_busy = 0;
+	writer_framed = writer_pending();
+	writer_queued -= bytes;
+	perf->write_queue = writer_queued;
+	perf->write_bytes += bytes;
+	perf->write_commits++;
+	perf->write_time += usec;
+	if (usec > perf->write_max)
+	    perf->write_max = usec;
+	last = end;
+	pthread_cond_broadcast(&writer_space);
+    }
+    /*NOTREACHED*/
+    return NULL;
+}
+
+/*
+ * Queue a write (or close) of the given file, at its current logical
+ * position, waiting for space if the queue is already full.
+ */
+static int
+writer_queue(wfile_t *w, const void *data, size_t len, int close)
+{
+    wop_t	*op;
+    size_t	need = sizeof(wop_t) + len;
+
+    if ((op = (wop_t *)malloc(need)) == NULL)
+	pmNoMem("writer_queue", need, PM_FATAL_ERR);
+    op->next = NULL;
+    op->file = w;
+    op->close = close;
+    op->offset = w->posn;
+    op->len = len;
+    if (len > 0)
+	memcpy(op->data, data, len);
+
+    pthread_mutex_lock(&writer_lock);
+    while (!close && writer_error == 0 && writer_queued >= writer_limit) {
+	writer_stalled = 1;
+	pthread_cond_wait(&writer_space, &writer_lock);
+    }
+    if (!close && writer_error != 0) {
+	setoserror(writer_error);
+	pthread_mutex_unlock(&writer_lock);
+	free(op);
+	return -1;
+    }
+    if (writer_tail == NULL)
+	writer_head = op;
+    else
+	writer_tail->next = op;
+    writer_tail = op;
+    writer_queued += len;
+    perf->write_queue = writer_queued;
+    pthread_cond_signal(&writer_work);
+    pthread_mutex_unlock(&writer_lock);
+    return 0;
+}
+
+/*
+ * __pmFILE handler for archive files being written by the writer
+ * thread.  These files are write-only, so the read methods all fail.
+ */
+static void *
+writer_open(__pmFILE *f, const char *path, const char *mode)
+{
+    (void)f; (void)path; (void)mode;
+    setoserror(EINVAL);
+    return NULL;
+}
+
+static void *
+writer_fdopen(__pmFILE *f, int fd, const char *mode)
+{
+    (void)f; (void)fd; (void)mode;
+    setoserror(EINVAL);
+    return NULL;
+}
+
+static int
+writer_seek(__pmFILE *f, off_t offset, int whence)
+{
+    wfile_t	*w = (wfile_t *)f->priv;
+
+    if (whence == SEEK_CUR)
+	offset += w->posn;
+    else if (whence == SEEK_END)
+	offset += w->size;
+    else if (whence != SEEK_SET)
+	offset = -1;
+    if (offset < 0) {
+	setoserror(EINVAL);
+	return -1;
+    }
+    f->position = w->posn = offset;
+    return 0;
+}
+
+static void
+writer_rewind(__pmFILE *f)
+{
+    (void)writer_seek(f, 0, SEEK_SET);
+}
+
+static off_t
+writer_tell(__pmFILE *f)
+{
+    return ((wfile_t *)f->priv)->posn;
+}
+
+static int
+writer_getc(__pmFILE *f)
+{
+    (void)f;
+    setoserror(EBADF);
+    return EOF;
+}
+
+static size_t
+writer_read(void *ptr, size_t size, size_t nmemb, __pmFILE *f)
+{
+    (void)ptr; (void)size; (void)nmemb; (void)f;
+    setoserror(EBADF);
+    return 0;
+}
+
+static size_t
+writer_write(void *ptr, size_t size, size_t nmemb, __pmFILE *f)
+{
+    wfile_t	*w = (wfile_t *)f->priv;
+    size_t	len = size * nmemb;
+
+    if (len == 0)
+	return nmemb;
+    if (writer_queue(w, ptr, len, 0) < 0)
+	return 0;
+    w->posn += len;
+    if (w->posn > w->size)
+	w->size = w->posn;
+    f->position = w->posn;
+    return nmemb;
+}
+
+static int
+writer_flush(__pmFILE *f)
+{
+    /*
+     * Nothing to do: records reach the disk in the order they were
+     * written, and writer_sync() waits for them when that matters.
+     */
+    (void)f;
+    return 0;
+}
+
+static int
+writer_fsync(__pmFILE *f)
+{
+    writer_sync();
+    return __pmFsync(((wfile_t *)f->priv)->real);
+}
+
+static int
+writer_fileno(__pmFILE *f)
+{
+    return __pmFileno(((wfile_t *)f->priv)->real);
+}
+
+static off_t
+writer_lseek(__pmFILE *f, off_t offset, int whence)
+{
+    if (writer_seek(f, offset, whence) < 0)
+	return (off_t)-1;
+    return ((wfile_t *)f->priv)->posn;
+}
+
+static int
+writer_fstat(__pmFILE *f, struct stat *buf)
+{
+    writer_sync();
+    return __pmFstat(((wfile_t *)f->priv)->real, buf);
+}
+
+static int
+writer_feof(__pmFILE *f)
+{
+    (void)f;
+    return 0;
+}
+
+static int
+writer_ferror(__pmFILE *f)
+{
+    int		sts;
+
+    (void)f;
+    pthread_mutex_lock(&writer_lock);
+    sts = writer_error != 0;
+    pthread_mutex_unlock(&writer_lock);
+    return sts;
+}
+
+static void
+writer_clearerr(__pmFILE *f)
+{
+    (void)f;
+}
+
+static int
+writer_setvbuf(__pmFILE *f, char *buf, int mode, size_t size)
+{
+    /* the writer thread chooses the buffering of the real file */
+    (void)f; (void)buf; (void)mode; (void)size;
+    return 0;
+}
+
+static int
+writer_close(__pmFILE *f)
+{
+    /* the writer thread closes the real file, once written */
+    return writer_queue((wfile_t *)f->priv, NULL, 0, 1);
+}
+
+static __pm_fops writer_fops = {
+    .__pmopen = writer_open,
+    .__pmfdopen = writer_fdopen,
+    .__pmseek = writer_seek,
+    .__pmrewind = writer_rewind,
+    .__pmtell = writer_tell,
+    .__pmfgetc = writer_getc,
+    .__pmread = writer_read,
+    .__pmwrite = writer_write,
+    .__pmflush = writer_flush,
+    .__pmfsync = writer_fsync,
+    .__pmfileno = writer_fileno,
+    .__pmlseek = writer_lseek,
+    .__pmfstat = writer_fstat,
+    .__pmfeof = writer_feof,
+    .__pmferror = writer_ferror,
+    .__pmclearerr = writer_clearerr,
+    .__pmsetvbuf = writer_setvbuf,
+    .__pmclose = writer_close
+};
+
+#endif /* HAVE_PTHREAD_H */
+
+static void
+stopstats(void)
+{
+    if (*perffile && getpid() == perfpid)
+	unlink(perffile);
+}
+
+/*
+ * Create the memory mapped file from which the pmcd PMDA exports the
+ * pmcd.pmlogger.write.* and pmcd.pmlogger.samples.* metrics.
+ */
+static void
+startstats(void)
+{
+    void	*ptr;
+    int		fd;
+    int		sep = pmPathSeparator();
+    char	zero = '\0';
+    char	stats_dir[MAXPATHLEN];
+
+    /* try to create the stats file directory. OK if it already exists */
+    pmsprintf(stats_dir, sizeof(stats_dir), "%s%c%s",
+	     pmGetConfig("PCP_TMP_DIR"), sep, PMLOGGER_STATS_SUBDIR);
+    if (mkdir2(stats_dir, S_IRWXU | S_IRWXG | S_IRWXO) < 0) {
+	if (oserror() != EEXIST) {
+	    fprintf(stderr, "%s: warning cannot create stats file dir %s: %s\n",
+		    pmGetProgname(), stats_dir, osstrerror());
+	}
+    }
+    perfpid = getpid();
+    atexit(stopstats);
+
+    /* create and initialize memory mapped performance data file */
+    pmsprintf(perffile, sizeof(perffile),
+		"%s%c%" FMT_PID, stats_dir, sep, perfpid);
+    unlink(perffile);
+    if ((fd = open(perffile, O_RDWR | O_CREAT | O_EXCL | O_TRUNC,
+			     S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+	/* cannot create stats file; too bad, so sad, continue on without it */
+	perffile[0] = '\0';
+	return;
+    }
+    /* seek to struct size and write one zero */
+    lseek(fd, sizeof(pmloggerstats_t)-1, SEEK_SET);
+    if (write(fd, &zero, 1) != 1) {
+	fprintf(stderr, "%s: Warning: write failed for stats file %s: %s\n",
+		pmGetProgname(), perffile, osstrerror());
+    }
+
+    /* map perffile & associate the instrumentation struct with it */
+    if ((ptr = __pmMemoryMap(fd, sizeof(pmloggerstats_t), 1)) == NULL) {
+	fprintf(stderr, "%s: memory map failed for stats file %s: %s\n",
+		pmGetProgname(), perffile, osstrerror());
+    } else {
+	perf = (pmloggerstats_t *)ptr;
+    }
+    close(fd);
+    perf->version = 1;
+}
+
+/*
+ * Start the writer thread, committing at most every interval (if set),
+ * with at most limit bytes queued.  If there is no writer thread, the
+ * archive files are left as they are and written synchronously.
+ */
+int
+writer_start(const struct timeval *interval, __int64_t limit)
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_t	thread;
+    sigset_t	sigs, oldsigs;
+    int		sts;
+#endif
+
+    startstats();
+
+#ifdef HAVE_PTHREAD_H
+    writer_interval = *interval;
+    writer_limit = (size_t)limit;
+
+    /* signals (the AF timer included) are for the sampling thread only */
+    sigfillset(&sigs);
+    pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+    sts = pthread_create(&thread, NULL, writer_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+    if (sts != 0) {
+	fprintf(stderr, "%s: Warning: cannot start archive writer thread: %s\n",
+		pmGetProgname(), pmErrStr(-sts));
+	return -sts;
+    }
+    pthread_detach(thread);
+    writer_pid = getpid();
+    writer_started = 1;
+    return 0;
+#else
+    (void)interval;
+    (void)limit;
+    return -ENOTSUP;
+#endif
+}
+
+/*
+ * Hand an archive file just created by libpcp over to the writer
+ * thread; kind orders the files within each commit.
+ */
+__pmFILE *
+writer_attach(__pmFILE *f, int kind)
+{
+#ifdef HAVE_PTHREAD_H
+    __pmFILE	*wf;
+    wfile_t	*w;
+
+    if (!writer_started || f == NULL)
+	return f;
+
+    if ((wf = (__pmFILE *)calloc(1, sizeof(__pmFILE))) == NULL)
+	pmNoMem("writer_attach", sizeof(__pmFILE), PM_FATAL_ERR);
+    if ((w = (wfile_t *)calloc(1, sizeof(wfile_t))) == NULL)
+	pmNoMem("writer_attach", sizeof(wfile_t), PM_FATAL_ERR);
+    w->real = f;
+    w->kind = kind;
+    w->posn = w->size = w->wposn = __pmFtell(f);
+    /* each commit is flushed explicitly, so let stdio gather the records */
+    __pmSetvbuf(f, NULL, _IOFBF, WRITER_BUFSIZE);
+
+    wf->fops = &writer_fops;
+    wf->priv = (void *)w;
+    wf->position = w->posn;
+    return wf;
+#else
+    (void)kind;
+    return f;
+#endif
+}
+
+/*
+ * As for writer_attach(), for data volume vol of archive base.  If
+ * the volume is to be compressed, the file is renamed to have the
+ * compressor's suffix, so that libpcp knows to decode it.
+ */
+__pmFILE *
+writer_attach_volume(__pmFILE *f, const char *base, int vol)
+{
+#ifdef HAVE_PTHREAD_H
+    wfile_t	*w;
+    char	path[MAXPATHLEN];
+    char	zpath[MAXPATHLEN];
+
+    if ((f = writer_attach(f, WRITER_DATA)) == NULL || compressor == NULL)
+	return f;
+    if (f->fops != &writer_fops) {
+	/* compression is done by the writer thread, so there is none */
+	fprintf(stderr, "%s: Warning: volume %d written uncompressed\n",
+		pmGetProgname(), vol);
+	return f;
+    }
+    pmsprintf(path, sizeof(path), "%s.%d", base, vol);
+    pmsprintf(zpath, sizeof(zpath), "%s%s", path, compressor->suffix);
+    if (rename(path, zpath) < 0) {
+	fprintf(stderr, "%s: Warning: cannot rename %s to %s, volume written uncompressed: %s\n",
+		pmGetProgname(), path, zpath, osstrerror());
+	return f;
+    }
+    w = (wfile_t *)f->priv;
+    w->zip = compressor;
+    pthread_mutex_lock(&writer_lock);
+    w->znext = writer_zfiles;
+    writer_zfiles = w;
+    pthread_mutex_unlock(&writer_lock);
+    return f;
+#else
+    (void)base;
+    (void)vol;
+    return writer_attach(f, WRITER_DATA);
+#endif
+}
+
+/*
+ * Select the compression (-Z) for data volumes, returns -1 if name
+ * is not one of the supported compressors.
+ */
+int
+writer_compression(const char *name)
+{
+    const compressor_t	*cp;
+
+    for (cp = compressors; cp->name != NULL; cp++) {
+	if (strcmp(cp->name, name) == 0) {
+	    compressor = cp;
+	    return 0;
+	}
+    }
+    return -1;
+}
+
+/*
+ * Wait until everything queued so far has been written.
+ */
+void
+writer_sync(void)
+{
+#ifdef HAVE_PTHREAD_H
+    /* a child of fork() has no writer thread to wait for */
+    if (!writer_started || getpid() != writer_pid)
+	return;
+    pthread_mutex_lock(&writer_lock);
+    writer_draining++;
+    pthread_cond_signal(&writer_work);
+    while (writer_head != NULL || writer_busy || writer_framed)
+	pthread_cond_wait(&writer_space, &writer_lock);
+    writer_draining--;
+    pthread_mutex_unlock(&writer_lock);
+#endif
+}
+
+/*
+ * Called as each sample comes due ... returns -1 if the sample should
+ * be dropped, because the writer is too far behind to take it.
+ */
+int
+writer_sample_begin(void)
+{
+    int		full = 0;
+    static int	dropping;
+
+#ifdef HAVE_PTHREAD_H
+    if (!writer_started)
+	return 0;
+    pthread_mutex_lock(&writer_lock);
+    if ((full = (writer_queued >= writer_limit)) != 0)
+	perf->samples_dropped++;
+    writer_stalled = 0;
+    pthread_mutex_unlock(&writer_lock);
+#endif
+
+    if (full && !dropping)
+	fprintf(stderr, "%s: archive writes are falling behind, dropping samples\n",
+		pmGetProgname());
+    else if (!full && dropping)
+	fprintf(stderr, "%s: archive writes have caught up\n", pmGetProgname());
+    dropping = full;
+    return full ? -1 : 0;
+}
+
+/*
+ * Called once a sample has been written (queued), to count it as
+ * late if any of its records had to wait for space in the queue.
+ */
+void
+writer_sample_end(void)
+{
+#ifdef HAVE_PTHREAD_H
+    if (!writer_started)
+	return;
+    pthread_mutex_lock(&writer_lock);
+    if (writer_stalled)
+	perf->samples_late++;
+    writer_stalled = 0;
+    pthread_mutex_unlock(&writer_lock);
+#endif
+}
@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * Buffering for the non-blocking sockets of client and shared pmcd
+ * connections - bytes read but not yet written on, and PDUs or lines
+ * of the protocol being framed.
+ */
+#include "pmproxy.h"
+
+int
+WouldBlock(int sts)
+{
+    return sts == EAGAIN || sts == EWOULDBLOCK || sts == EINTR;
+}
+
+int
+ChannelPending(Channel *ch)
+{
+    return ch->head < ch->tail;
+}
+
+void
+ChannelFree(Channel *ch)
+{
+    free(ch->buf);
+    ch->buf = NULL;
+    ch->head = ch->tail = ch->size = 0;
+}
+
+/* Keep the unwritten remainder of a relayed read, to write later */
+int
+ChannelKeep(Channel *ch, const char *p, unsigned int count)
+{
+    if ((ch->buf = (char *)malloc(count)) == NULL)
+	return -ENOMEM;
+    memcpy(ch->buf, p, count);
+    ch->head = 0;
+    ch->tail = ch->size = count;
+    return 0;
+}
+
+/*
+ * Write bytes to a socket, after any already waiting for it, keeping
+ * whatever cannot be written now.
+ */
+int
+ChannelWrite(Channel *ch, Endpoint *to, const char *p, unsigned int count)
+{
+    unsigned int	size;
+    ssize_t		sent;
+    char		*buf;
+
+    if (!ChannelPending(ch)) {
+	if ((sent = __pmSend(to->fd, p, count, 0)) < 0) {
+	    if (!WouldBlock(neterror()))
+		return -neterror();
+	    sent = 0;
+	}
+	if (sent == count)
+	    return 0;
+	ChannelFree(ch);
+	return ChannelKeep(ch, p + sent, count - sent);
+    }
+    if (ch->size - ch->tail < count) {
+	size = ch->tail + count;
+	if ((buf = (char *)realloc(ch->buf, size)) == NULL)
+	    return -ENOMEM;
+	ch->buf = buf;
+	ch->size = size;
+    }
+    memcpy(ch->buf + ch->tail, p, count);
+    ch->tail += count;
+    return 0;
+}
+
+/*
+ * Read whatever is available into the channel buffer, while the bytes
+ * are needed in one piece (protocol strings and whole PDUs).
+ */
+int
+ReadFrame(Endpoint *ep, Channel *ch, unsigned int limit)
+{
+    unsigned int	size;
+    ssize_t		bytes;
+    char		*buf;
+
+    if (ch->head > 0) {
+	memmove(ch->buf, ch->buf + ch->head, ch->tail - ch->head);
+	ch->tail -= ch->head;
+	ch->head = 0;
+    }
+    if (ch->tail == ch->size) {
+	size = ch->size ? ch->size * 2 : PDU_CHUNK;
+	if (ch->size >= limit)
+	    return PM_ERR_TOOBIG;
+	if ((buf = (char *)realloc(ch->buf, size)) == NULL)
+	    return -ENOMEM;
+	ch->buf = buf;
+	ch->size = size;
+    }
+    bytes = __pmRecv(ep->fd, ch->buf + ch->tail, ch->size - ch->tail, 0);
+    if (bytes == 0)
+	return PEER_CLOSED;
+    if (bytes < 0)
+	return WouldBlock(neterror()) ? 0 : -neterror();
+    ch->tail += bytes;
+    return 0;
+}
+
+/* length of a complete line at the head of a channel, else -1 */
+int
+FramedLine(Channel *ch)
+{
+    unsigned int	i;
+
+    for (i = ch->head; i < ch->tail; i++)
+	/* end of line means no more ... */
+	if (ch->buf[i] == '\n' || ch->buf[i] == '\r')
+	    return i - ch->head;
+    return -1;
+}
+
+/* length of a complete PDU at the head of a channel, else 0 */
+int
+FramedPDU(Channel *ch, unsigned int ceiling)
+{
+    unsigned int	len;
+
+    if (ch->tail - ch->head < sizeof(__pmPDUHdr))
+	return 0;
+    memcpy(&len, ch->buf + ch->head, sizeof(len));
+    len = ntohl(len);
+    if (len < sizeof(__pmPDUHdr))
+	return PM_ERR_IPC;
+    if (ceiling && len > ceiling)
+	return PM_ERR_TOOBIG;
+    if (ch->tail - ch->head < len)
+	return 0;
+    return len;
+}
+
+/* copy of a complete PDU, as __pmGetPDU would return it (pinned) */
+__pmPDU *
+CopyPDU(Channel *ch, int len)
+{
+    __pmPDU	*pb;
+    __pmPDUHdr	*php;
+
+    if ((pb = __pmFindPDUBuf(len)) == NULL)
+	return NULL;
+    memcpy(pb, ch->buf + ch->head, len);
+    php = (__pmPDUHdr *)pb;
+    php->len = ntohl(php->len);
+    php->type = ntohl(php->type);
+    php->from = ntohl(php->from);
+    return pb;
+}
+
+/* Write out pending bytes, as far as the socket allows */
+int
+FlushChannel(Channel *ch, Endpoint *to)
+{
+    ssize_t	bytes;
+
+    while (ch->head < ch->tail) {
+	bytes = __pmSend(to->fd, ch->buf + ch->head, ch->tail - ch->head, 0);
+	if (bytes < 0)
+	    return WouldBlock(neterror()) ? 0 : -neterror();
+	ch->head += bytes;
+    }
+    /* all written, hold no memory while idle */
+    ChannelFree(ch);
+    return 0;
+}
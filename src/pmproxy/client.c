@@ -1,260 +1,718 @@
 /*
- * Copyright (c) 2012-2016 Red Hat.
+ * Copyright (c) 2012-2016,2018 Red Hat.
  * Copyright (c) 1995-2002 Silicon Graphics, Inc.  All Rights Reserved.
- * 
+ *
  * This program is free software; you can redistribute it and/or modify it
  * under the terms of the GNU General Public License as published by the
  * Free Software Foundation; either version 2 of the License, or (at your
  * option) any later version.
- * 
+ *
  * This program is distributed in the hope that it will be useful, but
  * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
  * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
  * for more details.
  */
 
+/*
+ * Each client connection is a state machine driven by socket events in
+ * its worker thread (see worker.c), never blocking on either socket -
+ * a client is read only as far as is needed for the current state, and
+ * then only while pmcd is keeping up (and likewise in the other
+ * direction), so a slow client or pmcd holds up nobody else.  Once
+ * its credentials are seen, a client may instead be relayed over a
+ * pmcd connection shared with others (see pool.c).
+ */
 #include "pmproxy.h"
+#include <fcntl.h>
 
-#define MIN_CLIENTS_ALLOC 8
-
-ClientInfo	*client;
-int		nClients;		/* Number in array, (not all in use) */
-int		maxReqPortFd;		/* highest request port fd */
-int		maxSockFd;		/* largest fd for a client */
-__pmFdSet	sockFds;		/* for client select() */
+/* MY_BUFLEN needs to big enough to hold "hostname port" */
+#define MY_BUFLEN (MAXHOSTNAMELEN+10)
+#define MY_VERSION "pmproxy-server 1\n"
 
-static int
+static ClientInfo *
 NewClient(void)
 {
-    int		i;
-    static int	clientSize;
-
-    for (i = 0; i < nClients; i++)
-	if (!client[i].status.connected)
-	    break;
+    ClientInfo	*cp;
 
-    if (i == clientSize) {
-	int j, sz;
-
-	clientSize = clientSize ? clientSize * 2 : MIN_CLIENTS_ALLOC;
-	sz = sizeof(ClientInfo) * clientSize;
-	client = (ClientInfo *) realloc(client, sz);
-	if (client == NULL) {
-	    pmNoMem("NewClient", sz, PM_RECOV_ERR);
-	    Shutdown();
-	    exit(1);
-	}
-	for (j = i; j < clientSize; j++) {
-	    client[j].addr = NULL;
-	}
+    if ((cp = (ClientInfo *)calloc(1, sizeof(ClientInfo))) == NULL) {
+	pmNoMem("NewClient", sizeof(ClientInfo), PM_RECOV_ERR);
+	return NULL;
     }
-    client[i].addr = __pmSockAddrAlloc();
-    if (client[i].addr == NULL) {
+    if ((cp->addr = __pmSockAddrAlloc()) == NULL) {
         pmNoMem("NewClient", __pmSockAddrSize(), PM_RECOV_ERR);
-	Shutdown();
-	exit(1);
+	free(cp);
+	return NULL;
     }
-    if (i >= nClients)
-	nClients = i + 1;
-    return i;
+    cp->client.fd = cp->pmcd.fd = -1;
+    cp->client.events = cp->pmcd.events = -1;
+    cp->client.cp = cp->pmcd.cp = cp;
+    return cp;
 }
 
-/* MY_BUFLEN needs to big enough to hold "hostname port" */
-#define MY_BUFLEN (MAXHOSTNAMELEN+10)
-#define MY_VERSION "pmproxy-server 1\n"
-
-/* Establish a new socket connection to a client */
+/*
+ * Establish a new socket connection to a client, in the main thread.
+ * The rest happens in a worker thread, starting with StartClient.
+ */
 ClientInfo *
 AcceptNewClient(int reqfd)
 {
-    int		i;
+    ClientInfo	*cp;
     int		fd;
     __pmSockLen	addrlen;
-    int		ok = 0;
-    char	buf[MY_BUFLEN];
-    char	*bp;
-    char	*endp;
-    char	*abufp;
 
-    i = NewClient();
+    if ((cp = NewClient()) == NULL)
+	return NULL;
     addrlen = __pmSockAddrSize();
-    fd = __pmAccept(reqfd, client[i].addr, &addrlen);
+    fd = __pmAccept(reqfd, cp->addr, &addrlen);
     if (fd == -1) {
+	/* out of descriptors, most likely - drop this one, keep going */
 	pmNotifyErr(LOG_ERR, "AcceptNewClient(%d) __pmAccept failed: %s",
 			reqfd, netstrerror());
-	Shutdown();
-	exit(1);
+	DeleteClient(cp);
+	return NULL;
     }
     __pmSetSocketIPC(fd);
-    if (fd > maxSockFd)
-	maxSockFd = fd;
-    __pmFD_SET(fd, &sockFds);
-
-    client[i].fd = fd;
-    client[i].pmcd_fd = -1;
-    client[i].status.connected = 1;
-    client[i].status.allowed = 0;
-    client[i].pmcd_hostname = NULL;
-
-    /*
-     * version negotiation (converse to negotiate_proxy() logic in
-     * libpcp
-     *
-     *   __pmRecv client version message
-     *   __pmSend my server version message
-     *   __pmRecv pmcd hostname and pmcd port
-     */
-    for (bp = buf; bp < &buf[MY_BUFLEN]; bp++) {
-	if (__pmRecv(fd, bp, 1, 0) != 1) {
-	    *bp = '\0';		/* null terminate what we have */
-	    bp = &buf[MY_BUFLEN];	/* flag error */
+    __pmSetFileStatusFlags(fd, __pmGetFileStatusFlags(fd) | FNDELAY);
+    cp->client.fd = fd;
+    return cp;
+}
+
+/*
+ * version negotiation (converse to negotiate_proxy() logic in libpcp)
+ *
+ *   __pmRecv client version message
+ *   __pmSend my server version message
+ *   __pmRecv pmcd hostname and pmcd port
+ */
+void
+StartClient(ClientInfo *cp)
+{
+    cp->state = CLIENT_VERSION;
+    WatchEndpoint(&cp->client, PROXY_READ);
+}
+
+/*
+ * Follow PDU boundaries through a stream of client bytes as they are
+ * relayed, checking each length before any of that PDU is sent on -
+ * the same limits __pmGetPDU(LIMIT_SIZE) applied when PDUs were read
+ * whole.
+ */
+static int
+ScanPDUs(ClientInfo *cp, Channel *ch, const char *p, unsigned int count)
+{
+    unsigned int	len, take;
+
+    while (count > 0) {
+	if (ch->remain > 0) {
+	    take = count < ch->remain ? count : ch->remain;
+	    ch->remain -= take;
+	    p += take;
+	    count -= take;
+	    continue;
+	}
+	take = sizeof(ch->hdr) - ch->nhdr;
+	if (take > count)
+	    take = count;
+	memcpy(ch->hdr + ch->nhdr, p, take);
+	ch->nhdr += take;
+	p += take;
+	count -= take;
+	if (ch->nhdr < sizeof(ch->hdr))
 	    break;
+	ch->nhdr = 0;
+	memcpy(&len, ch->hdr, sizeof(len));
+	len = ntohl(len);
+	if (len < sizeof(__pmPDUHdr)) {
+	    pmNotifyErr(LOG_ERR, "ScanPDUs: fd=%d illegal PDU len=%u in hdr",
+			cp->client.fd, len);
+	    return PM_ERR_IPC;
+	}
+	if (len > (unsigned int)maxClientPDU) {
+	    pmNotifyErr(LOG_ERR, "ScanPDUs: fd=%d bad PDU len=%u in hdr exceeds maximum client PDU size (%d)",
+			cp->client.fd, len, maxClientPDU);
+	    return PM_ERR_TOOBIG;
 	}
-	/* end of line means no more ... */
-	if (*bp == '\n' || *bp == '\r') {
-	    *bp = '\0';
+	ch->remain = len - sizeof(ch->hdr);
+    }
+    return 0;
+}
+
+#ifdef SPLICE_F_MOVE
+/*
+ * Move pmcd data straight to the client through the worker pipe, not
+ * copying it into pmproxy.  Whatever the client socket cannot take now
+ * is read out into the channel, so the pipe is always left empty for
+ * the next connection.
+ */
+static int
+SpliceInput(ClientInfo *cp, Endpoint *from, Channel *ch, Endpoint *to)
+{
+    Worker	*wp = cp->worker;
+    ssize_t	bytes, moved, sent = 0;
+    int		sts = 0;
+
+    bytes = splice(from->fd, NULL, wp->pipe[1], NULL, WORKER_BUFSIZE,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (bytes == 0)
+	return PEER_CLOSED;
+    if (bytes < 0)
+	return WouldBlock(oserror()) ? 0 : -oserror();
+
+    while (sent < bytes) {
+	moved = splice(wp->pipe[0], NULL, to->fd, NULL, bytes - sent,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (moved < 0) {
+	    if (!WouldBlock(oserror()))
+		sts = -oserror();
 	    break;
 	}
+	sent += moved;
     }
-    if (bp < &buf[MY_BUFLEN]) {
-	/* looks OK so far ... is this a version we can support? */
-	if (strcmp(buf, "pmproxy-client 1") == 0) {
-	    client[i].version = 1;
-	    ok = 1;
+    if (sent == bytes)
+	return 0;
+
+    /* drain the pipe, keeping the data unless the connection is done */
+    for (bytes -= sent, sent = 0; sent < bytes; sent += moved) {
+	moved = read(wp->pipe[0], wp->scratch + sent, bytes - sent);
+	if (moved <= 0) {
+	    pmNotifyErr(LOG_ERR, "SpliceInput: pipe read: %s\n", osstrerror());
+	    Shutdown();
+	    exit(1);
 	}
     }
+    if (sts < 0)
+	return sts;
+    return ChannelKeep(ch, wp->scratch, bytes);
+}
+#endif
 
-    if (!ok) {
-	if (pmDebugOptions.context) {
-	    abufp = __pmSockAddrToString(client[i].addr);
-	    pmNotifyErr(LOG_INFO, "Bad version string from client at %s",
-			abufp);
-	    free(abufp);
-	    fprintf(stderr, "AcceptNewClient: bad version string was \"");
-	    for (bp = buf; *bp && bp < &buf[MY_BUFLEN]; bp++)
-		fputc(*bp & 0xff, stderr);
-	    fprintf(stderr, "\"\n");
+/*
+ * Relay whatever is available from one socket to the other, once the
+ * previous data has all been written.  Client PDUs are checked as they
+ * pass through, pmcd PDUs are not.
+ */
+static int
+RelayInput(ClientInfo *cp, Endpoint *from, Channel *ch, Endpoint *to)
+{
+    Worker	*wp = cp->worker;
+    ssize_t	bytes, sent;
+    int		sts;
+
+    if (ChannelPending(ch))
+	return 0;
+#ifdef SPLICE_F_MOVE
+    if (ch == &cp->toClient && wp->pipe[0] >= 0 && !cp->status.secure)
+	return SpliceInput(cp, from, ch, to);
+#endif
+
+    bytes = __pmRecv(from->fd, wp->scratch, WORKER_BUFSIZE, 0);
+    if (bytes == 0)
+	return PEER_CLOSED;
+    if (bytes < 0)
+	return WouldBlock(neterror()) ? 0 : -neterror();
+    if (ch == &cp->toPmcd && (sts = ScanPDUs(cp, ch, wp->scratch, bytes)) < 0)
+	return sts;
+    if ((sent = __pmSend(to->fd, wp->scratch, bytes, 0)) < 0) {
+	if (!WouldBlock(neterror()))
+	    return -neterror();
+	sent = 0;
+    }
+    if (sent < bytes)
+	return ChannelKeep(ch, wp->scratch + sent, bytes - sent);
+    return 0;
+}
+
+/*
+ * Try each PMCD address in turn, without waiting for the connection.
+ * These connect a client to its own pmcd, or a shared one (pool.c).
+ */
+int
+ConnectNext(Worker *wp, Connector *cn, Endpoint *ep)
+{
+    __pmSockAddr	*myAddr;
+    int			fd, flags, sts = -ECONNREFUSED;
+
+    while ((myAddr = __pmHostEntGetSockAddr(cn->servInfo, &cn->enumIx)) != NULL) {
+	/* the same address comes once per socket type, try it just once */
+	if (cn->tried && __pmSockAddrCompare(myAddr, cn->tried) == 0) {
+	    __pmSockAddrFree(myAddr);
+	    continue;
 	}
-	DeleteClient(&client[i]);
-	return NULL;
+	if (cn->tried)
+	    __pmSockAddrFree(cn->tried);
+	cn->tried = myAddr;
+
+	if (__pmSockAddrIsInet(myAddr))
+	    fd = __pmCreateSocket();
+	else if (__pmSockAddrIsIPv6(myAddr))
+	    fd = __pmCreateIPv6Socket();
+	else
+	    continue;
+	if (fd < 0) {
+	    sts = fd;
+	    continue;
+	}
+	if (wp->pollfd < 0 && fd >= FD_SETSIZE) {
+	    /* select(2) cannot wait for this one */
+	    __pmCloseSocket(fd);
+	    return -EMFILE;
+	}
+	if ((flags = __pmConnectTo(fd, myAddr, cn->port)) < 0) {
+	    /* __pmConnectTo() has closed the fd, try next address. */
+	    sts = flags;
+	    continue;
+	}
+	cn->fdFlags = flags;
+	ep->fd = fd;
+	WatchEndpoint(ep, PROXY_WRITE);
+	return 0;
     }
+    return sts;
+}
 
-    if (__pmSend(fd, MY_VERSION, strlen(MY_VERSION), 0) != strlen(MY_VERSION)) {
-	abufp = __pmSockAddrToString(client[i].addr);
-	pmNotifyErr(LOG_WARNING, "AcceptNewClient: failed to send version "
-			"string (%s) to client at %s\n", MY_VERSION, abufp);
+int
+ConnectStart(Worker *wp, Connector *cn, Endpoint *ep, const char *hostname)
+{
+    if ((cn->servInfo = __pmGetAddrInfo(hostname)) == NULL)
+	return -EHOSTUNREACH;
+    cn->enumIx = NULL;
+    cn->deadline = time(NULL) + (time_t)(__pmConnectTimeout() + 0.999);
+    wp->nconnecting++;
+    return ConnectNext(wp, cn, ep);
+}
+
+void
+ConnectEnd(Worker *wp, Connector *cn)
+{
+    if (cn->servInfo) {
+	wp->nconnecting--;
+	__pmHostEntFree(cn->servInfo);
+	cn->servInfo = NULL;
+    }
+    if (cn->tried) {
+	__pmSockAddrFree(cn->tried);
+	cn->tried = NULL;
+    }
+}
+
+/* The PMCD socket is writable, or failed, while connecting */
+int
+ConnectDone(Worker *wp, Connector *cn, Endpoint *ep)
+{
+    int		sts, fd = ep->fd;
+
+    if ((sts = __pmConnectCheckError(fd)) != 0) {
+	UnwatchEndpoint(ep);
+	__pmCloseSocket(fd);
+	ep->fd = -1;
+	return ConnectNext(wp, cn, ep);
+    }
+    /* still not blocking, as for clients */
+    if ((fd = __pmConnectRestoreFlags(fd, cn->fdFlags | FNDELAY)) < 0) {
+	ep->fd = -1;
+	return fd;
+    }
+    __pmSetSocketIPC(fd);
+    ConnectEnd(wp, cn);
+    return 0;
+}
+
+static int
+StartConnect(ClientInfo *cp)
+{
+    int		sts;
+
+    cp->connect.port = cp->pmcd_port;
+    cp->state = CLIENT_CONNECT;
+    if ((sts = ConnectStart(cp->worker, &cp->connect, &cp->pmcd,
+			    cp->pmcd_hostname)) < 0 && pmDebugOptions.context)
+	fprintf(stderr, "StartConnect(%s,%d) failed: %s\n",
+		    cp->pmcd_hostname, cp->pmcd_port, pmErrStr(sts));
+    return sts;
+}
+
+static int
+ClientConnected(ClientInfo *cp)
+{
+    int		sts;
+
+    if ((sts = ConnectDone(cp->worker, &cp->connect, &cp->pmcd)) < 0 ||
+	cp->connect.servInfo != NULL)	/* failed, or trying the next one */
+	return sts;
+    cp->state = CLIENT_CREDS;
+
+    if (pmDebugOptions.context) {
+	char	*abufp = __pmSockAddrToString(cp->addr);
+	fprintf(stderr, "AcceptNewClient fd=%d from %s to %s (port %d) fd=%d\n",
+		cp->client.fd, abufp, cp->pmcd_hostname, cp->pmcd_port,
+		cp->pmcd.fd);
 	free(abufp);
-	DeleteClient(&client[i]);
-	return NULL;
     }
+    return 0;
+}
 
-    for (bp = buf; bp < &buf[MY_BUFLEN]; bp++) {
-	if (__pmRecv(fd, bp, 1, 0) != 1) {
-	    *bp = '\0';		/* null terminate what we have */
-	    bp = &buf[MY_BUFLEN];	/* flag error */
-	    break;
-	}
-	/* end of line means no more ... */
-	if (*bp == '\n' || *bp == '\r') {
-	    *bp = '\0';
-	    break;
+/*
+ * We need to know if the pmcd has PDU_FLAG_CERT_REQD so we can
+ * setup our own secure connection with the client. Need to intercept
+ * the first message from the pmcd.  See __pmConnectHandshake
+ * discussion in connect.c.  This happens before VerifyClient.
+ */
+static int
+PmcdFeatures(ClientInfo *cp)
+{
+    __pmPDU	*pb;
+    int		len;
+
+    if ((len = FramedPDU(&cp->toClient, 0)) <= 0)
+	return len;
+    if ((pb = CopyPDU(&cp->toClient, len)) == NULL)
+	return -oserror();
+    if (((__pmPDUHdr *)pb)->type == PDU_ERROR) {
+	unsigned int server_features;
+	server_features = __pmServerGetFeaturesFromPDU(pb);
+	if (server_features & PDU_FLAG_CERT_REQD) {
+	    /* Add as a server feature */
+	    cp->server_features |= PDU_FLAG_CERT_REQD;
 	}
     }
-    if (bp < &buf[MY_BUFLEN]) {
+    __pmUnpinPDUBuf(pb);
+    cp->status.features = 1;
+    if (cp->status.replayed) {
+	/* the client has this already, from a shared connection */
+	cp->toClient.head += len;
+    }
+    return FlushChannel(&cp->toClient, &cp->client);
+}
+
+/* Handle client input received before the relay starts */
+static int
+ClientNegotiate(ClientInfo *cp)
+{
+    Channel	*ch = &cp->toPmcd;
+    __pmPDU	*pb;
+    char	*abufp, *bp, *endp;
+    int		len, sts;
+
+    switch (cp->state) {
+    case CLIENT_VERSION:
+	if ((len = FramedLine(ch)) < 0)
+	    return ch->tail - ch->head < MY_BUFLEN ? 0 : PM_ERR_IPC;
+	ch->buf[ch->head + len] = '\0';
+	bp = ch->buf + ch->head;
+	ch->head += len + 1;
+	/* looks OK so far ... is this a version we can support? */
+	if (strcmp(bp, "pmproxy-client 1") != 0) {
+	    if (pmDebugOptions.context) {
+		abufp = __pmSockAddrToString(cp->addr);
+		pmNotifyErr(LOG_INFO, "Bad version string from client at %s",
+			    abufp);
+		free(abufp);
+		fprintf(stderr, "AcceptNewClient: bad version string was \"%s\"\n",
+			bp);
+	    }
+	    return PM_ERR_IPC;
+	}
+	cp->version = 1;
+	/* first output on a new socket, cannot block */
+	if (__pmSend(cp->client.fd, MY_VERSION, strlen(MY_VERSION), 0) != strlen(MY_VERSION)) {
+	    abufp = __pmSockAddrToString(cp->addr);
+	    pmNotifyErr(LOG_WARNING, "AcceptNewClient: failed to send version "
+			"string (%s) to client at %s\n", MY_VERSION, abufp);
+	    free(abufp);
+	    return PM_ERR_IPC;
+	}
+	cp->state = CLIENT_HOST;
+	/* FALLTHROUGH */
+
+    case CLIENT_HOST:
+	if ((len = FramedLine(ch)) < 0)
+	    return ch->tail - ch->head < MY_BUFLEN ? 0 : PM_ERR_IPC;
+	ch->buf[ch->head + len] = '\0';
+	bp = ch->buf + ch->head;
+	ch->head += len + 1;
 	/* looks OK so far ... get hostname and port */
-	for (bp = buf; *bp && *bp != ' '; bp++)
-	    ;
-	if (bp != buf) {
-	    *bp = '\0';
-	    client[i].pmcd_hostname = strdup(buf);
-	    if (client[i].pmcd_hostname == NULL)
-		pmNoMem("PMCD.hostname", strlen(buf), PM_FATAL_ERR);
-	    bp++;
-	    client[i].pmcd_port = (int)strtoul(bp, &endp, 10);
+	if ((endp = strchr(bp, ' ')) != NULL && endp != bp) {
+	    *endp++ = '\0';
+	    if ((cp->pmcd_hostname = strdup(bp)) == NULL)
+		pmNoMem("PMCD.hostname", strlen(bp), PM_FATAL_ERR);
+	    bp = endp;
+	    cp->pmcd_port = (int)strtoul(bp, &endp, 10);
 	    if (*endp != '\0') {
-		abufp = __pmSockAddrToString(client[i].addr);
+		abufp = __pmSockAddrToString(cp->addr);
 		pmNotifyErr(LOG_WARNING, "AcceptNewClient: bad pmcd port "
 				"\"%s\" from client at %s", bp, abufp);
 		free(abufp);
-		DeleteClient(&client[i]);
-		return NULL;
+		return PM_ERR_IPC;
 	    }
 	}
-	/* error, fall through */
+	if (cp->pmcd_hostname == NULL) {
+	    abufp = __pmSockAddrToString(cp->addr);
+	    pmNotifyErr(LOG_WARNING, "AcceptNewClient: failed to get PMCD "
+				"hostname (%s) from client at %s", bp, abufp);
+	    free(abufp);
+	    return PM_ERR_IPC;
+	}
+	/* share a connection to pmcd, else establish a new one */
+	if (maxShared > 1 && (sts = PoolAttach(cp)) != 0)
+	    return sts < 0 ? sts : 0;
+	return StartConnect(cp);
+
+    case CLIENT_CREDS:
+	if (cp->upstream) {
+	    /* joined, or waiting to, unless it cannot share after all */
+	    if ((sts = PoolJoin(cp)) <= 0)
+		return sts;
+	    cp->status.features = 0;	/* from its own pmcd, this time */
+	    return StartConnect(cp);
+	}
+	/* the client replies to pmcd, but need not have waited */
+	if (!cp->status.features)
+	    return 0;
+	if ((len = FramedPDU(ch, maxClientPDU)) <= 0)
+	    return len;
+
+	/* We *must* see a credentials PDU as the first PDU */
+	if ((pb = CopyPDU(ch, len)) == NULL)
+	    return -oserror();
+	sts = VerifyClient(cp, pb);
+	__pmUnpinPDUBuf(pb);
+	if (sts < 0)
+	    return sts;
+	if (sts > 0) {
+	    /* sent to pmcd already, within the secure handshakes */
+	    cp->status.secure = 1;
+	    ch->head += len;
+	    len = 0;
+	}
+	/* the client may have sent more requests right behind it */
+	if ((sts = ScanPDUs(cp, ch, ch->buf + ch->head + len,
+			    ch->tail - ch->head - len)) < 0)
+	    return sts;
+	cp->status.allowed = 1;
+	cp->state = CLIENT_RELAY;
+	return FlushChannel(ch, &cp->pmcd);
+
+    default:
+	break;
     }
+    return 0;
+}
 
-    if (client[i].pmcd_hostname == NULL) {
-	abufp = __pmSockAddrToString(client[i].addr);
-	pmNotifyErr(LOG_WARNING, "AcceptNewClient: failed to get PMCD "
-				"hostname (%s) from client at %s", buf, abufp);
-	free(abufp);
-	DeleteClient(&client[i]);
-	return NULL;
+/* Watch for what each socket of a connection can do next */
+static void
+UpdateEvents(ClientInfo *cp)
+{
+    int		client = 0, pmcd = 0;
+
+    switch (cp->state) {
+    case CLIENT_VERSION:
+    case CLIENT_HOST:
+	client = PROXY_READ;
+	break;
+    case CLIENT_CONNECT:
+	pmcd = PROXY_WRITE;
+	break;
+    case CLIENT_CREDS:
+	/* one PDU each way, pmcd first, not relayed until checked */
+	if (!cp->status.features)
+	    pmcd = PROXY_READ;
+	else if (ChannelPending(&cp->toClient))
+	    client = PROXY_WRITE;
+	if (FramedPDU(&cp->toPmcd, maxClientPDU) == 0)
+	    client |= PROXY_READ;
+	break;
+    case CLIENT_RELAY:
+	if (cp->status.pooled) {
+	    /* one request at a time, once the last reply is all written */
+	    if (ChannelPending(&cp->toClient))
+		client = PROXY_WRITE;
+	    else if (!cp->status.waiting &&
+		     FramedPDU(&cp->toPmcd, maxClientPDU) == 0)
+		client = PROXY_READ;
+	    break;
+	}
+	/* read only once the previous data is all written */
+	if (ChannelPending(&cp->toPmcd))
+	    pmcd |= PROXY_WRITE;
+	else
+	    client |= PROXY_READ;
+	if (ChannelPending(&cp->toClient))
+	    client |= PROXY_WRITE;
+	else
+	    pmcd |= PROXY_READ;
+	break;
     }
+    WatchEndpoint(&cp->client, client);
+    WatchEndpoint(&cp->pmcd, pmcd);
+}
 
-    if (pmDebugOptions.context) {
-	/*
-	 * note error message gets appended to once pmcd connection is
-	 * made in ClientLoop()
-	 */
-	abufp = __pmSockAddrToString(client[i].addr);
-	fprintf(stderr, "AcceptNewClient [%d] fd=%d from %s to %s (port %s)",
-		i, fd, abufp, client[i].pmcd_hostname, bp);
-	free(abufp);
+static void
+CleanupClient(ClientInfo *cp, int sts)
+{
+    if (pmDebugOptions.appl0) {
+	fprintf(stderr, "CleanupClient: client fd=%d pmcd fd=%d %s (%d)\n",
+	    cp->client.fd, cp->pmcd.fd, pmErrStr(sts), sts);
     }
 
-    return &client[i];
+    DeleteClient(cp);
+}
+
+static void
+ClientStatus(ClientInfo *cp, int sts)
+{
+    if (sts != 0)
+	CleanupClient(cp, sts < 0 ? sts : 0);
+    else
+	UpdateEvents(cp);
 }
 
+/* Handle an event on one socket of a connection, in its worker thread */
 void
-DeleteClient(ClientInfo *cp)
+ClientEvent(Endpoint *ep, int events)
 {
-    int		i;
+    ClientInfo	*cp = ep->cp;
+    int		sts = 0;
 
-    for (i = 0; i < nClients; i++)
-	if (cp == &client[i])
-	    break;
+    if (ep->fd < 0)		/* deleted earlier in this round of events */
+	return;
 
-    if (i == nClients) {
-	fprintf(stderr, "DeleteClient: Botch: tried to delete non-existent client @" PRINTF_P_PFX "%p\n", cp);
+    if (cp->state == CLIENT_CONNECT) {
+	if (ep == &cp->pmcd)
+	    sts = ClientConnected(cp);
+    }
+    else if ((events & PROXY_ERROR) && !(events & PROXY_READ))
+	sts = PM_ERR_IPC;
+    else {
+	if (events & PROXY_WRITE) {
+	    if (ep == &cp->pmcd)
+		sts = FlushChannel(&cp->toPmcd, ep);
+	    else if ((sts = FlushChannel(&cp->toClient, ep)) == 0 &&
+		     cp->status.pooled)
+		/* reply written, on to any requests behind it */
+		sts = PoolInput(cp);
+	}
+	if (sts == 0 && (events & PROXY_READ) && (ep->events & PROXY_READ)) {
+	    if (cp->status.pooled) {
+		if ((sts = ReadFrame(ep, &cp->toPmcd, maxClientPDU)) == 0)
+		    sts = PoolInput(cp);
+	    }
+	    else if (cp->state == CLIENT_RELAY) {
+		if (ep == &cp->client)
+		    sts = RelayInput(cp, ep, &cp->toPmcd, &cp->pmcd);
+		else
+		    sts = RelayInput(cp, ep, &cp->toClient, &cp->client);
+	    }
+	    else if (ep == &cp->client) {
+		if ((sts = ReadFrame(ep, &cp->toPmcd, maxClientPDU)) == 0)
+		    sts = ClientNegotiate(cp);
+	    }
+	    else {
+		if ((sts = ReadFrame(ep, &cp->toClient, maxClientPDU)) == 0 &&
+		    (sts = PmcdFeatures(cp)) == 0)
+		    sts = ClientNegotiate(cp);
+	    }
+	}
+    }
+    ClientStatus(cp, sts);
+}
+
+/*
+ * Carry on with a connection after progress on the shared pmcd
+ * connection it is using, or waiting to use (see pool.c).
+ */
+void
+ClientResume(ClientInfo *cp)
+{
+    int		sts;
+
+    if (cp->state == CLIENT_CLOSED)
 	return;
+    if (cp->state == CLIENT_RELAY)
+	/* requests cannot be sent on, once a shared pmcd has gone */
+	sts = cp->upstream ? PoolInput(cp) : PM_ERR_IPC;
+    else
+	sts = ClientNegotiate(cp);
+    ClientStatus(cp, sts);
+}
+
+/* Give up on any PMCD connection taking too long */
+void
+ClientTimeouts(Worker *wp, time_t now)
+{
+    ClientInfo	*cp;
+
+    for (cp = wp->clients; cp; cp = cp->next) {
+	if (cp->state != CLIENT_CONNECT || now < cp->connect.deadline)
+	    continue;
+	if (pmDebugOptions.context)
+	    fprintf(stderr, "ClientTimeouts: connect to %s (port %d) timed out\n",
+			cp->pmcd_hostname, cp->pmcd_port);
+	CleanupClient(cp, -ETIMEDOUT);
     }
+}
+
+/*
+ * Close a connection.  In a worker, the memory is released later by
+ * ReapClients, since other events for it may still be waiting to be
+ * handled (and are then ignored) - or a list walk may be at it.
+ */
+void
+DeleteClient(ClientInfo *cp)
+{
+    Worker	*wp = cp->worker;
 
     if (pmDebugOptions.context)
-	fprintf(stderr, "DeleteClient [%d]\n", i);
+	fprintf(stderr, "DeleteClient fd=%d\n", cp->client.fd);
 
-    if (cp->fd >= 0) {
-	__pmFD_CLR(cp->fd, &sockFds);
-	__pmCloseSocket(cp->fd);
-    }
-    if (cp->pmcd_fd >= 0) {
-	__pmFD_CLR(cp->pmcd_fd, &sockFds);
-	__pmCloseSocket(cp->pmcd_fd);
+    if (wp)
+	ConnectEnd(wp, &cp->connect);
+    if (cp->upstream)
+	PoolDetach(cp);
+    if (cp->client.fd >= 0) {
+	UnwatchEndpoint(&cp->client);
+	__pmCloseSocket(cp->client.fd);
+	cp->client.fd = -1;
     }
-    if (i == nClients-1) {
-	i--;
-	while (i >= 0 && !client[i].status.connected)
-	    i--;
-	nClients = (i >= 0) ? i + 1 : 0;
-    }
-    if (cp->fd == maxSockFd || cp->pmcd_fd == maxSockFd) {
-	maxSockFd = maxReqPortFd;
-	for (i = 0; i < nClients; i++) {
-	    if (cp->status.connected == 0)
-		continue;
-	    if (client[i].fd > maxSockFd)
-		maxSockFd = client[i].fd;
-	    if (client[i].pmcd_fd > maxSockFd)
-		maxSockFd = client[i].pmcd_fd;
-	}
+    if (cp->pmcd.fd >= 0) {
+	UnwatchEndpoint(&cp->pmcd);
+	__pmCloseSocket(cp->pmcd.fd);
+	cp->pmcd.fd = -1;
     }
+    ChannelFree(&cp->toPmcd);
+    ChannelFree(&cp->toClient);
+    free(cp->ctxmap);
+    cp->ctxmap = NULL;
     __pmSockAddrFree(cp->addr);
     cp->addr = NULL;
-    cp->status.connected = 0;
-    cp->fd = -1;
-    cp->pmcd_fd = -1;
     if (cp->pmcd_hostname != NULL) {
 	free(cp->pmcd_hostname);
 	cp->pmcd_hostname = NULL;
     }
+    if (wp == NULL) {
+	free(cp);
+	return;
+    }
+
+    /* unlinked, but cp->next is left for any walk of the list */
+    if (cp->prev)
+	cp->prev->next = cp->next;
+    else
+	wp->clients = cp->next;
+    if (cp->next)
+	cp->next->prev = cp->prev;
+    wp->nclients--;
+    cp->state = CLIENT_CLOSED;
+    cp->reap = wp->closed;
+    wp->closed = cp;
+}
+
+void
+ReapClients(Worker *wp)
+{
+    ClientInfo	*cp;
+
+    while ((cp = wp->closed) != NULL) {
+	wp->closed = cp->reap;
+	free(cp);
+    }
 }
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2012-2015 Red Hat.
+ * Copyright (c) 2012-2015,2018 Red Hat.
  * Copyright (c) 2002 Silicon Graphics, Inc.  All Rights Reserved.
  * 
  * This program is free software; you can redistribute it and/or modify it
@@ -20,12 +20,19 @@
 #endif
 
 #define MAXPENDING	5	/* maximum number of pending connections */
+#define MAXWORKERS	64	/* maximum number of worker threads */
 #define FDNAMELEN	40	/* maximum length of a fd description */
 #define STRINGIFY(s)    #s
 #define TO_STRING(s)    STRINGIFY(s)
 
 static char	*FdToString(int);
 
+int		maxReqPortFd;		/* highest request port fd */
+int		maxSockFd;		/* largest request port fd */
+__pmFdSet	sockFds;		/* for request port select() */
+int		maxClientPDU;		/* ceiling on client PDU sizes */
+int		maxShared = 32;		/* clients per pmcd connection, see -s */
+
 static int	timeToDie;		/* For SIGINT handling */
 static char	*logfile = "pmproxy.log";	/* log file name */
 static int	run_daemon = 1;		/* run as a daemon, see -f */
@@ -35,6 +42,7 @@ static char	*certdb;		/* certificate DB path (NSS) */
 static char	*dbpassfile;		/* certificate DB password file */
 static char     *cert_nickname;         /* Alternate nickname to use for server certificate */
 static char	*hostname;
+static int	nworkers;		/* worker threads, see -t */
 
 static void
 DontStart(void)
@@ -73,6 +81,8 @@ static pmLongOptions longopts[] = {
     { "certdb", 1, 'C', "PATH", "path to NSS certificate database" },
     { "passfile", 1, 'P', "PATH", "password file for certificate database access" },
     { "", 1, 'L', "BYTES", "maximum size for PDUs from clients [default 65536]" },
+    { "shared", 1, 's', "N", "clients sharing each pmcd connection [default 32]" },
+    { "threads", 1, 't', "N", "number of threads handling connections [default one per CPU]" },
     PMAPI_OPTIONS_HEADER("Connection options"),
     { "interface", 1, 'i', "ADDR", "accept connections on this IP address" },
     { "port", 1, 'p', "N", "accept connections on this port" },
@@ -83,7 +93,7 @@ static pmLongOptions longopts[] = {
 };
 
 static pmOptions opts = {
-    .short_options = "A:C:D:fi:l:L:M:p:P:U:x:?",
+    .short_options = "A:C:D:fi:l:L:M:p:P:s:t:U:x:?",
     .long_options = longopts,
 };
 
@@ -93,6 +103,7 @@ ParseOptions(int argc, char *argv[], int *nports)
     int		c;
     int		sts;
     int		usage = 0;
+    char	*endnum;
 
     while ((c = pmgetopt_r(argc, argv, &opts)) != EOF) {
 	switch (c) {
@@ -155,6 +166,24 @@ ParseOptions(int argc, char *argv[], int *nports)
 	    dbpassfile = opts.optarg;
 	    break;
 
+	case 's':	/* clients sharing each pmcd connection */
+	    maxShared = (int)strtol(opts.optarg, &endnum, 10);
+	    if (*endnum != '\0' || maxShared < 1) {
+		pmprintf("%s: -s requires a positive numeric argument\n",
+			pmGetProgname());
+		opts.errors++;
+	    }
+	    break;
+
+	case 't':	/* number of worker threads */
+	    nworkers = (int)strtol(opts.optarg, &endnum, 10);
+	    if (*endnum != '\0' || nworkers < 1 || nworkers > MAXWORKERS) {
+		pmprintf("%s: -t requires a value between 1 and %d\n",
+			pmGetProgname(), MAXWORKERS);
+		opts.errors++;
+	    }
+	    break;
+
 	case 'U':	/* run as user username */
 	    username = opts.optarg;
 	    break;
@@ -191,26 +220,16 @@ CheckCertRequired(ClientInfo *cp)
     return 0;
 }
 
-static void
-CleanupClient(ClientInfo *cp, int sts)
-{
-    if (pmDebugOptions.appl0) {
-	int		i;
-	for (i = 0; i < nClients; i++) {
-	    if (cp == &client[i])
-		break;
-	}
-	fprintf(stderr, "CleanupClient: client[%d] fd=%d %s (%d)\n",
-	    i, cp->fd, pmErrStr(sts), sts);
-    }
-
-    DeleteClient(cp);
-}
-
-static int
+/*
+ * Check the credentials PDU from a client, and set up secure sockets
+ * if they were asked for.  Returns 1 if the PDU has been sent on to
+ * pmcd already, 0 if it is for the caller to send, else an error.
+ */
+int
 VerifyClient(ClientInfo *cp, __pmPDU *pb)
 {
     int	i, sts, flags = 0, sender = 0, credcount = 0;
+    int	cflags, pflags;
     __pmPDUHdr *header = (__pmPDUHdr *)pb;
     __pmHashCtl attrs = { 0 }; /* TODO */
     __pmCred *credlist;
@@ -253,25 +272,42 @@ VerifyClient(ClientInfo *cp, __pmPDU *pb)
 	    return PM_ERR_NEEDCLIENTCERT;
     }
 
-    /* need to ensure both the pmcd and client channel use flags */
+    /*
+     * Without secure sockets the credentials PDU is relayed along with
+     * the PDUs that follow it, by the caller.
+     */
+    if (flags == 0)
+	return 0;
 
-    if (sts >= 0 && flags)
-	sts = __pmSecureServerHandshake(cp->fd, flags, &attrs);
+    /*
+     * Handshakes are not event driven, both sockets block for these
+     * (the rest of this worker's connections wait) and are then put
+     * back as they were.
+     */
+    cflags = __pmGetFileStatusFlags(cp->client.fd);
+    pflags = __pmGetFileStatusFlags(cp->pmcd.fd);
+    __pmSetFileStatusFlags(cp->client.fd, cflags & ~FNDELAY);
+    __pmSetFileStatusFlags(cp->pmcd.fd, pflags & ~FNDELAY);
+
+    /* need to ensure both the pmcd and client channel use flags */
+    sts = __pmSecureServerHandshake(cp->client.fd, flags, &attrs);
 
     /* send credentials PDU through to pmcd now (order maintained) */
     if (sts >= 0)
-	sts = __pmXmitPDU(cp->pmcd_fd, pb);
+	sts = __pmXmitPDU(cp->pmcd.fd, pb);
 
     /*
      * finally perform any additional handshaking needed with pmcd.
      * Do not initialize NSS again.
      */
-    if (sts >= 0 && flags)
-	sts = __pmSecureClientHandshake(cp->pmcd_fd,
+    if (sts >= 0)
+	sts = __pmSecureClientHandshake(cp->pmcd.fd,
 					flags | PDU_FLAG_NO_NSS_INIT,
 					cp->pmcd_hostname, &attrs);
-   
-    return sts;
+
+    __pmSetFileStatusFlags(cp->client.fd, cflags);
+    __pmSetFileStatusFlags(cp->pmcd.fd, pflags);
+    return sts < 0 ? sts : 1;
 }
 
 
@@ -287,99 +323,10 @@ __ntohpmPDUInfo(__pmPDUInfo info)
     return info;
 }
 
-/* Determine which clients (if any) have sent data to the server and handle it
- * as required.
- */
-void
-HandleInput(__pmFdSet *fdsPtr)
-{
-    int		i, sts;
-    __pmPDU	*pb;
-    ClientInfo	*cp;
-
-    /* input from clients */
-    for (i = 0; i < nClients; i++) {
-	if (!client[i].status.connected || !__pmFD_ISSET(client[i].fd, fdsPtr))
-	    continue;
-
-	cp = &client[i];
-
-	sts = __pmGetPDU(cp->fd, LIMIT_SIZE, 0, &pb);
-	if (sts <= 0) {
-	    CleanupClient(cp, sts);
-	    continue;
-	}
-
-	/* We *must* see a credentials PDU as the first PDU */
-	if (!cp->status.allowed) {
-	    sts = VerifyClient(cp, pb);
-	    __pmUnpinPDUBuf(pb);
-	    if (sts < 0) {
-		CleanupClient(cp, sts);
-		continue;
-	    }
-	    cp->status.allowed = 1;
-	    continue;
-	}
-
-	sts = __pmXmitPDU(cp->pmcd_fd, pb);
-	__pmUnpinPDUBuf(pb);
-	if (sts <= 0) {
-	    CleanupClient(cp, sts);
-	    continue;
-	}
-    }
-
-    /* input from pmcds */
-    for (i = 0; i < nClients; i++) {
-	if (!client[i].status.connected ||
-	    !__pmFD_ISSET(client[i].pmcd_fd, fdsPtr))
-	    continue;
-
-	cp = &client[i];
-
-	sts = __pmGetPDU(cp->pmcd_fd, ANY_SIZE, 0, &pb);
-
-	/*
-	 * We need to know if the pmcd has PDU_FLAG_CERT_REQD so we can
-	 * setup our own secure connection with the client. Need to intercept
-	 * the first message from the pmcd.  See __pmConnectHandshake
-	 * discussion in connect.c. This code happens before VerifyClient
-	 * above.
-	 */
-
-	if( (!cp->status.allowed) && (sts == PDU_ERROR) ){
-	    unsigned int server_features;
-	    server_features = __pmServerGetFeaturesFromPDU( pb );
-	    if( server_features & PDU_FLAG_CERT_REQD ){
-		/* Add as a server feature */
-		cp->server_features |= PDU_FLAG_CERT_REQD;
-	    }
-	}
-
-	if (sts <= 0) {
-	    CleanupClient(cp, sts);
-	    continue;
-	}
-
-	sts = __pmXmitPDU(cp->fd, pb);
-	__pmUnpinPDUBuf(pb);
-	if (sts <= 0) {
-	    CleanupClient(cp, sts);
-	    continue;
-	}
-    }
-}
-
 /* Called to shutdown pmproxy in an orderly manner */
 void
 Shutdown(void)
 {
-    int	i;
-
-    for (i = 0; i < nClients; i++)
-	if (client[i].status.connected)
-	    __pmCloseSocket(client[i].fd);
     __pmServerCloseRequestPorts();
     __pmSecureServerShutdown();
     pmNotifyErr(LOG_INFO, "pmproxy Shutdown\n");
@@ -401,31 +348,14 @@ CheckNewClient(__pmFdSet * fdset, int rfd, int family)
 
     if (__pmFD_ISSET(rfd, fdset)) {
 	if ((cp = AcceptNewClient(rfd)) == NULL)
-	    /* failed to negotiate, already cleaned up */
+	    /* failed to accept, already cleaned up */
 	    return;
-
-	/* establish a new connection to pmcd */
-	if ((cp->pmcd_fd = __pmAuxConnectPMCDPort(cp->pmcd_hostname, cp->pmcd_port)) < 0) {
-	    if (pmDebugOptions.context)
-		/* append to message started in AcceptNewClient() */
-		fprintf(stderr, " oops!\n"
-			"__pmAuxConnectPMCDPort(%s,%d) failed: %s\n",
-			cp->pmcd_hostname, cp->pmcd_port,
-			pmErrStr(-oserror()));
-	    CleanupClient(cp, -oserror());
-	}
-	else {
-	    if (cp->pmcd_fd > maxSockFd)
-		maxSockFd = cp->pmcd_fd;
-	    __pmFD_SET(cp->pmcd_fd, &sockFds);
-	    if (pmDebugOptions.context)
-		/* append to message started in AcceptNewClient() */
-		fprintf(stderr, " fd=%d\n", cp->pmcd_fd);
-	}
+	/* negotiation and the connection to pmcd happen in a worker */
+	AssignClient(cp);
     }
 }
 
-/* Loop, synchronously processing requests from clients. */
+/* Loop, accepting new clients for the worker threads. */
 static void
 ClientLoop(void)
 {
@@ -449,7 +379,6 @@ ClientLoop(void)
 			fprintf(stderr, "__pmSelectRead(): from %s fd=%d\n",
 				FdToString(i), i);
 	    __pmServerAddNewClients(&readableFds, CheckNewClient);
-	    HandleInput(&readableFds);
 	}
 	else if (sts == -1 && neterror() != EINTR) {
 	    pmNotifyErr(LOG_ERR, "ClientLoop select: %s\n", netstrerror());
@@ -567,6 +496,10 @@ main(int argc, char *argv[])
     __pmSetSignalHandler(SIGTERM, SigIntProc);
     __pmSetSignalHandler(SIGBUS, SigBad);
     __pmSetSignalHandler(SIGSEGV, SigBad);
+#ifdef HAVE_SIGPIPE
+    /* closed sockets are noticed as write errors, connection by connection */
+    __pmSetSignalHandler(SIGPIPE, SIG_IGN);
+#endif
 
     /* Open request ports for client connections */
     if ((sts = __pmServerOpenRequestPorts(&sockFds, maxpending)) < 0)
@@ -587,6 +520,21 @@ main(int argc, char *argv[])
     if (__pmSecureServerCertificateSetup(certdb, dbpassfile, cert_nickname) < 0)
 	DontStart();
 
+    /* client PDUs are checked as they pass through, not read whole */
+    maxClientPDU = __pmSetPDUCeiling(0);
+
+    if (nworkers == 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+	nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (nworkers < 1)
+	    nworkers = 1;
+	else if (nworkers > MAXWORKERS)
+	    nworkers = MAXWORKERS;
+    }
+    if (StartWorkers(nworkers) == 0)
+	DontStart();
+
     /* all the work is done here */
     ClientLoop();
 
@@ -600,21 +548,11 @@ FdToString(int fd)
 {
     static char fdStr[FDNAMELEN];
     static char *stdFds[4] = {"*UNKNOWN FD*", "stdin", "stdout", "stderr"};
-    int		i;
 
+    /* only request ports here, client sockets belong to the workers */
     if (fd >= -1 && fd < 3)
 	return stdFds[fd + 1];
     if (__pmServerRequestPortString(fd, fdStr, FDNAMELEN) != NULL)
 	return fdStr;
-    for (i = 0; i < nClients; i++) {
-	if (client[i].status.connected && fd == client[i].fd) {
-	    pmsprintf(fdStr, FDNAMELEN, "client[%d] client socket", i);
-	    return fdStr;
-	}
-	if (client[i].status.connected && fd == client[i].pmcd_fd) {
-	    pmsprintf(fdStr, FDNAMELEN, "client[%d] pmcd socket", i);
-	    return fdStr;
-	}
-    }
     return stdFds[0];
 }
@@ -1,12 +1,12 @@
 /*
- * Copyright (c) 2012-2013 Red Hat.
+ * Copyright (c) 2012-2013,2018 Red Hat.
  * Copyright (c) 2002 Silicon Graphics, Inc.  All Rights Reserved.
- * 
+ *
  * This program is free software; you can redistribute it and/or modify it
  * under the terms of the GNU General Public License as published by the
  * Free Software Foundation; either version 2 of the License, or (at your
  * option) any later version.
- * 
+ *
  * This program is distributed in the hope that it will be useful, but
  * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
  * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
@@ -17,32 +17,198 @@
 
 #include "pmapi.h"
 #include "libpcp.h"
+#include <pthread.h>
 
-/* The table of clients, used by pmproxy */
+/* Events on a socket, as watched and reported by the worker threads */
+#define PROXY_READ	0x1
+#define PROXY_WRITE	0x2
+#define PROXY_ERROR	0x4
+
+/* Progress of a client connection through the proxy protocol */
+enum {
+    CLIENT_VERSION,	/* awaiting client version string */
+    CLIENT_HOST,	/* awaiting pmcd hostname and port */
+    CLIENT_CONNECT,	/* connecting to pmcd, not blocking */
+    CLIENT_CREDS,	/* awaiting first pmcd PDU, then client credentials */
+    CLIENT_RELAY,	/* allowed, forwarding PDUs in both directions */
+    CLIENT_CLOSED,	/* deleted, memory freed by ReapClients */
+};
+
+/* Progress of a pmcd connection shared by several clients */
+enum {
+    UPSTREAM_CONNECT,	/* connecting to pmcd, not blocking */
+    UPSTREAM_FEATURES,	/* awaiting first pmcd PDU */
+    UPSTREAM_CREDS,	/* awaiting credentials from a client */
+    UPSTREAM_PROBE,	/* awaiting reply to a request of our own */
+    UPSTREAM_READY,	/* requests from clients being multiplexed */
+    UPSTREAM_FAILED,	/* unusable, clients connect on their own */
+};
+
+#define PEER_CLOSED	1	/* end of file on a socket, not an error */
+
+struct ClientInfo;
+struct Upstream;
+struct Worker;
+
+/* One socket of a proxied connection, client or pmcd */
+typedef struct {
+    int			fd;		/* socket descriptor, or -1 */
+    int			events;		/* PROXY_READ/PROXY_WRITE watched */
+    struct ClientInfo	*cp;		/* owning connection, or NULL */
+    struct Upstream	*up;		/* owning shared connection, or NULL */
+} Endpoint;
+
+/* A non-blocking connect to pmcd, trying each address in turn */
+typedef struct {
+    int			port;		/* PMCD port */
+    __pmHostEnt		*servInfo;	/* PMCD addresses */
+    void		*enumIx;	/* next PMCD address to try */
+    __pmSockAddr	*tried;		/* PMCD address last tried */
+    int			fdFlags;	/* PMCD socket flags before connect */
+    time_t		deadline;	/* PMCD connect timeout */
+} Connector;
+
+/*
+ * Bytes moving in one direction, read from one socket of a connection
+ * and not yet written to the other.  Nothing is held here while a
+ * connection is idle - data is written straight through, and only the
+ * remainder of a short write is kept until the other socket drains.
+ */
 typedef struct {
-    int			fd;		/* client socket descriptor */
+    char		*buf;		/* pending bytes, or NULL */
+    unsigned int	head;		/* first byte not yet written */
+    unsigned int	tail;		/* end of bytes read */
+    unsigned int	size;		/* allocated size of buf */
+    unsigned int	remain;		/* bytes left of the current PDU */
+    unsigned int	nhdr;		/* bytes seen of its length field */
+    unsigned char	hdr[4];		/* length field, network order */
+} Channel;
+
+/* A client connection, owned by exactly one worker thread */
+typedef struct ClientInfo {
+    int			state;		/* CLIENT_VERSION ... CLIENT_RELAY */
     int			version;	/* proxy-client protocol version */
     struct {				/* Status of connection to client */
-	unsigned int	connected : 1;	/* Client connected, socket level */
 	unsigned int	allowed : 1;	/* Creds seen, OK to talk to pmcd */
+	unsigned int	features : 1;	/* First pmcd PDU has been seen */
+	unsigned int	secure : 1;	/* Secure sockets, no splicing */
+	unsigned int	replayed : 1;	/* First pmcd PDU sent from a pool */
+	unsigned int	pooled : 1;	/* Requests go to a shared pmcd */
+	unsigned int	waiting : 1;	/* Shared pmcd reply outstanding */
     } status;
+    Endpoint		client;		/* client socket */
+    Endpoint		pmcd;		/* PMCD socket */
+    Channel		toPmcd;		/* client PDUs (credentials, requests) */
+    Channel		toClient;	/* pmcd PDUs (features, results) */
     char		*pmcd_hostname;	/* PMCD hostname */
     int			pmcd_port;	/* PMCD port */
-    int			pmcd_fd;	/* PMCD socket file descriptor */
     __pmSockAddr	*addr;		/* address of client */
     unsigned int	server_features;/* features the server is advertising */
+    Connector		connect;	/* PMCD connect, in CLIENT_CONNECT */
+    struct Upstream	*upstream;	/* shared PMCD connection, or NULL */
+    int			*ctxmap;	/* client and shared context pairs */
+    int			nctxmap;
+    unsigned int	changes;	/* pmcd state changes not yet seen */
+    struct Worker	*worker;	/* thread handling this connection */
+    struct ClientInfo	*next;		/* worker list of connections */
+    struct ClientInfo	*prev;
+    struct ClientInfo	*reap;		/* worker list of closed connections */
 } ClientInfo;
 
-extern ClientInfo	*client;	/* Array of clients */
-extern int		nClients;	/* Number of entries in array */
+/* A client request awaiting its reply from a shared pmcd */
+typedef struct {
+    ClientInfo		*cp;		/* requester, NULL once it has gone */
+    int			type;		/* request PDU type */
+} Request;
+
+/*
+ * A pmcd connection shared by clients of one worker, all with the same
+ * pmcd and plain credentials.  Requests are sent whole, in the order
+ * the clients make them, and pmcd replies in that same order.
+ */
+typedef struct Upstream {
+    int			state;		/* UPSTREAM_CONNECT ... FAILED */
+    char		*hostname;	/* PMCD hostname */
+    Endpoint		pmcd;		/* PMCD socket */
+    Connector		connect;	/* PMCD connect, in UPSTREAM_CONNECT */
+    Channel		toPmcd;		/* whole client PDUs, not yet written */
+    Channel		fromPmcd;	/* pmcd PDUs, delivered once whole */
+    char		*features;	/* first pmcd PDU, sent to each client */
+    unsigned int	featlen;
+    Request		*queue;		/* requests awaiting replies, in order */
+    unsigned int	qhead;
+    unsigned int	qcount;
+    unsigned int	qsize;
+    unsigned char	*ctxused;	/* context numbers given out */
+    int			nctxused;
+    int			nusers;		/* clients attached */
+    time_t		retry;		/* when FAILED, pool again after this */
+    struct Worker	*worker;
+    struct Upstream	*next;		/* worker list of shared connections */
+    struct Upstream	*prev;
+} Upstream;
+
+/* An event loop thread, and the connections assigned to it */
+typedef struct Worker {
+    int			id;
+    pthread_t		thread;
+    int			wakefd[2];	/* new clients, from the main thread */
+    int			pollfd;		/* epoll(7) descriptor, or -1 */
+    ClientInfo		*clients;	/* connections owned by this thread */
+    ClientInfo		*closed;	/* closed, not yet freed */
+    Upstream		*upstreams;	/* shared PMCD connections */
+    int			nclients;
+    int			nconnecting;	/* PMCD connects in progress */
+    char		*scratch;	/* relay buffer, WORKER_BUFSIZE */
+    int			pipe[2];	/* splice(2) pipe, or -1 */
+} Worker;
+
+#define WORKER_BUFSIZE	(PDU_CHUNK * 64)
+
 extern int		maxReqPortFd;	/* highest request port fd */
-extern int		maxSockFd;	/* largest fd for a clients
-					 * and pmcd connections */
+extern int		maxSockFd;	/* largest request port fd */
 extern __pmFdSet	sockFds;	/* for select() */
+extern int		maxClientPDU;	/* ceiling on client PDU sizes */
+extern int		maxShared;	/* clients per shared PMCD connection */
 
 /* prototypes */
+extern int WouldBlock(int);
+extern int ChannelPending(Channel *);
+extern void ChannelFree(Channel *);
+extern int ChannelKeep(Channel *, const char *, unsigned int);
+extern int ChannelWrite(Channel *, Endpoint *, const char *, unsigned int);
+extern int ReadFrame(Endpoint *, Channel *, unsigned int);
+extern int FramedLine(Channel *);
+extern int FramedPDU(Channel *, unsigned int);
+extern __pmPDU *CopyPDU(Channel *, int);
+extern int FlushChannel(Channel *, Endpoint *);
+
 extern ClientInfo *AcceptNewClient(int);
 extern void DeleteClient(ClientInfo *);
+extern void StartClient(ClientInfo *);
+extern void ClientEvent(Endpoint *, int);
+extern void ClientTimeouts(Worker *, time_t);
+extern void ReapClients(Worker *);
+extern void ClientResume(ClientInfo *);
+extern int ConnectStart(Worker *, Connector *, Endpoint *, const char *);
+extern int ConnectNext(Worker *, Connector *, Endpoint *);
+extern int ConnectDone(Worker *, Connector *, Endpoint *);
+extern void ConnectEnd(Worker *, Connector *);
+extern int VerifyClient(ClientInfo *, __pmPDU *);
+
+extern int PoolAttach(ClientInfo *);
+extern void PoolDetach(ClientInfo *);
+extern int PoolJoin(ClientInfo *);
+extern int PoolInput(ClientInfo *);
+extern void UpstreamEvent(Endpoint *, int);
+extern void UpstreamTimeouts(Worker *, time_t);
+extern void ReapUpstreams(Worker *);
+
+extern int StartWorkers(int);
+extern void AssignClient(ClientInfo *);
+extern void WatchEndpoint(Endpoint *, int);
+extern void UnwatchEndpoint(Endpoint *);
+
 extern void StartDaemon(int, char **);
 extern void Shutdown(void);
 
@@ -0,0 +1,716 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * Shared pmcd connections.  Clients of a worker asking for the same
+ * pmcd, with plain credentials (no secure sockets, authentication or
+ * container), are given one pmcd connection between up to maxShared
+ * of them, rather than one each.
+ *
+ * pmcd handles the PDUs from one connection strictly in turn, sending
+ * exactly one reply for each request (some have none), so whole client
+ * requests are interleaved on the shared connection and each reply is
+ * returned to whichever client is first in the queue of those waiting.
+ * Each client has at most one request outstanding.  The few PDUs with
+ * no reply are sent only once pmcd would surely accept them - profiles
+ * are decoded here first, and the credentials from the first client
+ * stand for them all - and a probe request (a descriptor from pmcd's
+ * own PMDA) confirms pmcd accepts requests before any client joins.
+ *
+ * pmcd keeps the instance profiles of its clients per context number,
+ * so these are mapped to numbers unique within the shared connection
+ * in the profile and fetch PDUs.  Notice of pmcd state changes comes
+ * once per connection, before a fetch result, and is passed on to each
+ * client sharing it ahead of its own next fetch result.
+ *
+ * Anything else - a pmcd that fails the probe, or wants credentials
+ * or certificates - and the clients connect to pmcd on their own.
+ */
+#include "pmproxy.h"
+
+#define RETRY_DELAY	60	/* seconds before sharing again after failure */
+#define PROBE_DOMAIN	2	/* pmcd PMDA, pmcd.control.debug for probes */
+
+/* header and context number of profile and fetch PDUs */
+typedef struct {
+    __pmPDUHdr	hdr;
+    int		ctxnum;
+} ctx_pdu_t;
+
+typedef struct {
+    __pmPDUHdr	hdr;
+    int		code;
+} error_pdu_t;
+
+typedef struct {
+    __pmPDUHdr	hdr;
+    pmID	pmid;
+} desc_req_t;
+
+static int
+PduType(const char *p)
+{
+    __pmPDUHdr	hdr;
+
+    memcpy(&hdr, p, sizeof(hdr));
+    return ntohl(hdr.type);
+}
+
+static void
+UpstreamWatch(Upstream *up)
+{
+    int		events;
+
+    if (up->state == UPSTREAM_CONNECT)
+	events = PROXY_WRITE;
+    else if (ChannelPending(&up->toPmcd))
+	events = PROXY_READ | PROXY_WRITE;
+    else
+	events = PROXY_READ;
+    WatchEndpoint(&up->pmcd, events);
+}
+
+/*
+ * Stop using a shared connection.  Clients using it are dealt with by
+ * ReapUpstreams, outside of any handling of their own events - those
+ * still negotiating connect to pmcd on their own, the others are closed
+ * (and their libpcp reconnects them).  If it never worked, new clients
+ * for this pmcd do not share for a while.
+ */
+static void
+UpstreamFail(Upstream *up, int sts)
+{
+    if (up->state == UPSTREAM_FAILED)
+	return;
+    if (pmDebugOptions.context)
+	fprintf(stderr, "UpstreamFail: %s (port %d) fd=%d users=%d: %s\n",
+		up->hostname, up->connect.port, up->pmcd.fd, up->nusers,
+		pmErrStr(sts));
+    ConnectEnd(up->worker, &up->connect);
+    if (up->pmcd.fd >= 0) {
+	UnwatchEndpoint(&up->pmcd);
+	__pmCloseSocket(up->pmcd.fd);
+	up->pmcd.fd = -1;
+    }
+    up->retry = up->state == UPSTREAM_READY ? 0 : time(NULL) + RETRY_DELAY;
+    up->state = UPSTREAM_FAILED;
+}
+
+static void
+UpstreamFree(Upstream *up)
+{
+    Worker	*wp = up->worker;
+
+    if (up->prev)
+	up->prev->next = up->next;
+    else
+	wp->upstreams = up->next;
+    if (up->next)
+	up->next->prev = up->prev;
+    ConnectEnd(wp, &up->connect);
+    if (up->pmcd.fd >= 0) {
+	UnwatchEndpoint(&up->pmcd);
+	__pmCloseSocket(up->pmcd.fd);
+    }
+    ChannelFree(&up->toPmcd);
+    ChannelFree(&up->fromPmcd);
+    free(up->features);
+    free(up->queue);
+    free(up->ctxused);
+    free(up->hostname);
+    free(up);
+}
+
+static Upstream *
+UpstreamStart(ClientInfo *cp)
+{
+    Worker	*wp = cp->worker;
+    Upstream	*up;
+    int		sts;
+
+    if ((up = (Upstream *)calloc(1, sizeof(Upstream))) == NULL) {
+	pmNoMem("UpstreamStart", sizeof(Upstream), PM_RECOV_ERR);
+	return NULL;
+    }
+    if ((up->hostname = strdup(cp->pmcd_hostname)) == NULL) {
+	pmNoMem("UpstreamStart", strlen(cp->pmcd_hostname), PM_RECOV_ERR);
+	free(up);
+	return NULL;
+    }
+    up->pmcd.fd = -1;
+    up->pmcd.events = -1;
+    up->pmcd.up = up;
+    up->connect.port = cp->pmcd_port;
+    up->state = UPSTREAM_CONNECT;
+    up->worker = wp;
+    up->next = wp->upstreams;
+    if (wp->upstreams)
+	wp->upstreams->prev = up;
+    wp->upstreams = up;
+
+    if ((sts = ConnectStart(wp, &up->connect, &up->pmcd, up->hostname)) < 0) {
+	/* the client finds out for itself */
+	if (pmDebugOptions.context)
+	    fprintf(stderr, "UpstreamStart(%s,%d) failed: %s\n",
+			up->hostname, up->connect.port, pmErrStr(sts));
+	UpstreamFree(up);
+	return NULL;
+    }
+    return up;
+}
+
+/* Send the first pmcd PDU, as pmcd sends it to each new client */
+static int
+ReplayFeatures(ClientInfo *cp)
+{
+    Upstream	*up = cp->upstream;
+
+    cp->status.features = cp->status.replayed = 1;
+    return ChannelWrite(&cp->toClient, &cp->client, up->features, up->featlen);
+}
+
+/*
+ * Attach a new client to a shared connection to its pmcd, starting one
+ * if need be.  Returns 1 if attached, 0 if the client should connect
+ * to pmcd on its own, else an error.
+ */
+int
+PoolAttach(ClientInfo *cp)
+{
+    Worker	*wp = cp->worker;
+    Upstream	*up;
+
+    for (up = wp->upstreams; up; up = up->next) {
+	if (up->connect.port != cp->pmcd_port ||
+	    strcmp(up->hostname, cp->pmcd_hostname) != 0)
+	    continue;
+	if (up->state == UPSTREAM_FAILED) {
+	    if (up->retry && time(NULL) < up->retry)
+		return 0;
+	    continue;
+	}
+	if (up->nusers < maxShared)
+	    break;
+    }
+    if (up == NULL && (up = UpstreamStart(cp)) == NULL)
+	return 0;
+    cp->upstream = up;
+    up->nusers++;
+    cp->state = CLIENT_CREDS;
+    if (up->features != NULL) {
+	int	sts;
+	if ((sts = ReplayFeatures(cp)) < 0)
+	    return sts;
+    }
+    return 1;
+}
+
+/* Forget a client, including its context numbers and any reply due */
+void
+PoolDetach(ClientInfo *cp)
+{
+    Upstream	*up = cp->upstream;
+    unsigned int	i;
+    int			ctx;
+
+    for (i = 0; i < up->qcount; i++)
+	if (up->queue[(up->qhead + i) % up->qsize].cp == cp)
+	    up->queue[(up->qhead + i) % up->qsize].cp = NULL;
+    for (i = 0; i < cp->nctxmap; i++) {
+	ctx = cp->ctxmap[i * 2 + 1];
+	up->ctxused[ctx] = 0;
+    }
+    cp->nctxmap = 0;
+    cp->status.pooled = 0;
+    cp->status.waiting = 0;
+    cp->upstream = NULL;
+    up->nusers--;
+}
+
+/* Credentials asking for nothing beyond the current protocol version */
+static int
+PlainCredentials(Channel *ch, int len)
+{
+    __pmPDU		*pb;
+    __pmCred		*credlist = NULL;
+    __pmVersionCred	*vcp;
+    int			sender, credcount, sts;
+
+    if ((pb = CopyPDU(ch, len)) == NULL)
+	return 0;
+    sts = ((__pmPDUHdr *)pb)->type == PDU_CREDS &&
+	  __pmDecodeCreds(pb, &sender, &credcount, &credlist) >= 0 &&
+	  credcount == 1 && credlist[0].c_type == CVERSION;
+    if (sts) {
+	vcp = (__pmVersionCred *)&credlist[0];
+	sts = vcp->c_version == PDU_VERSION && vcp->c_flags == 0;
+    }
+    if (credlist != NULL)
+	free(credlist);
+    __pmUnpinPDUBuf(pb);
+    return sts;
+}
+
+static int
+UpstreamWrite(Upstream *up, const char *p, unsigned int len)
+{
+    int		sts;
+
+    if ((sts = ChannelWrite(&up->toPmcd, &up->pmcd, p, len)) < 0)
+	UpstreamFail(up, sts);
+    else
+	UpstreamWatch(up);
+    return sts;
+}
+
+static int
+UpstreamProbe(Upstream *up)
+{
+    desc_req_t	probe;
+
+    probe.hdr.len = htonl(sizeof(probe));
+    probe.hdr.type = htonl(PDU_DESC_REQ);
+    probe.hdr.from = htonl(FROM_ANON);
+    probe.pmid = htonl(pmID_build(PROBE_DOMAIN, 0, 0));
+    return UpstreamWrite(up, (const char *)&probe, sizeof(probe));
+}
+
+/*
+ * A client has credentials for pmcd, and a shared connection to it.
+ * Returns 0 if joined or still waiting to, 1 if the client must
+ * connect to pmcd on its own after all, else an error.
+ */
+int
+PoolJoin(ClientInfo *cp)
+{
+    Upstream	*up = cp->upstream;
+    Channel	*ch = &cp->toPmcd;
+    int		len;
+
+    if (up->state == UPSTREAM_FAILED) {
+	PoolDetach(cp);
+	return 1;
+    }
+    if (!cp->status.features)
+	return 0;
+    if ((len = FramedPDU(ch, maxClientPDU)) <= 0)
+	return len;
+    if (!PlainCredentials(ch, len)) {
+	PoolDetach(cp);
+	return 1;
+    }
+    if (up->state == UPSTREAM_CREDS) {
+	/* the first credentials stand for all, as they are all the same */
+	if (UpstreamWrite(up, ch->buf + ch->head, len) < 0 ||
+	    UpstreamProbe(up) < 0)
+	    return 0;	/* resumed once the failure is dealt with */
+	up->state = UPSTREAM_PROBE;
+    }
+    if (up->state != UPSTREAM_READY)
+	return 0;
+
+    ch->head += len;
+    cp->status.allowed = 1;
+    cp->status.pooled = 1;
+    cp->state = CLIENT_RELAY;
+    if (pmDebugOptions.context) {
+	char	*abufp = __pmSockAddrToString(cp->addr);
+	fprintf(stderr, "AcceptNewClient fd=%d from %s to %s (port %d) fd=%d shared\n",
+		cp->client.fd, abufp, cp->pmcd_hostname, cp->pmcd_port,
+		up->pmcd.fd);
+	free(abufp);
+    }
+    return PoolInput(cp);
+}
+
+/* Shared context number for a client context number, else an error */
+static int
+MapContext(ClientInfo *cp, int ctxnum)
+{
+    Upstream	*up = cp->upstream;
+    unsigned char	*used;
+    int			*map;
+    int			i, n;
+
+    for (i = 0; i < cp->nctxmap; i++)
+	if (cp->ctxmap[i * 2] == ctxnum)
+	    return cp->ctxmap[i * 2 + 1];
+
+    for (i = 0; i < up->nctxused; i++)
+	if (up->ctxused[i] == 0)
+	    break;
+    if (i == up->nctxused) {
+	n = up->nctxused ? up->nctxused * 2 : 16;
+	if ((used = (unsigned char *)realloc(up->ctxused, n)) == NULL)
+	    return -ENOMEM;
+	memset(used + up->nctxused, 0, n - up->nctxused);
+	up->ctxused = used;
+	up->nctxused = n;
+    }
+    n = (cp->nctxmap + 1) * 2;
+    if ((map = (int *)realloc(cp->ctxmap, n * sizeof(int))) == NULL)
+	return -ENOMEM;
+    map[n - 2] = ctxnum;
+    map[n - 1] = i;
+    cp->ctxmap = map;
+    cp->nctxmap++;
+    up->ctxused[i] = 1;
+    return i;
+}
+
+/* Rewrite the context number of a profile or fetch PDU, in place */
+static int
+RemapPDU(ClientInfo *cp, char *p, int len)
+{
+    ctx_pdu_t	pdu;
+    int		ctxnum;
+
+    if (len < (int)sizeof(pdu))
+	return 0;	/* pmcd rejects these itself */
+    memcpy(&pdu, p, sizeof(pdu));
+    if ((ctxnum = ntohl(pdu.ctxnum)) < 0)
+	return 0;	/* pmcd rejects these itself */
+    if ((ctxnum = MapContext(cp, ctxnum)) < 0)
+	return ctxnum;
+    pdu.ctxnum = htonl(ctxnum);
+    memcpy(p, &pdu, sizeof(pdu));
+    return 0;
+}
+
+/* Decode a profile as pmcd will, since pmcd replies only if it fails */
+static int
+CheckProfile(Channel *ch, int len)
+{
+    __pmPDU	*pb;
+    pmProfile	*profile;
+    int		ctxnum, sts;
+
+    if ((pb = CopyPDU(ch, len)) == NULL)
+	return -oserror();
+    if ((sts = __pmDecodeProfile(pb, &ctxnum, &profile)) >= 0)
+	__pmFreeProfile(profile);
+    __pmUnpinPDUBuf(pb);
+    return sts;
+}
+
+static int
+ErrorReply(ClientInfo *cp, int code)
+{
+    error_pdu_t	pdu;
+
+    pdu.hdr.len = htonl(sizeof(pdu));
+    pdu.hdr.type = htonl(PDU_ERROR);
+    pdu.hdr.from = htonl(FROM_ANON);
+    pdu.code = htonl(code);
+    return ChannelWrite(&cp->toClient, &cp->client, (const char *)&pdu, sizeof(pdu));
+}
+
+static int
+QueueRequest(Upstream *up, ClientInfo *cp, int type)
+{
+    Request	*queue;
+    unsigned int	i, size;
+
+    if (up->qcount == up->qsize) {
+	size = up->qsize ? up->qsize * 2 : 16;
+	if ((queue = (Request *)malloc(size * sizeof(Request))) == NULL)
+	    return -ENOMEM;
+	for (i = 0; i < up->qcount; i++)
+	    queue[i] = up->queue[(up->qhead + i) % up->qsize];
+	free(up->queue);
+	up->queue = queue;
+	up->qsize = size;
+	up->qhead = 0;
+    }
+    i = (up->qhead + up->qcount) % up->qsize;
+    up->queue[i].cp = cp;
+    up->queue[i].type = type;
+    up->qcount++;
+    return 0;
+}
+
+/* Send one client request on to the shared pmcd */
+static int
+PoolRequest(ClientInfo *cp, int len)
+{
+    Upstream	*up = cp->upstream;
+    Channel	*ch = &cp->toPmcd;
+    char	*p = ch->buf + ch->head;
+    int		type = PduType(p);
+    int		sts;
+
+    switch (type) {
+    case PDU_CREDS:
+	/* already given, for all the clients sharing pmcd */
+	return 0;
+
+    case PDU_PROFILE:
+	if (CheckProfile(ch, len) < 0)
+	    return ErrorReply(cp, PM_ERR_IPC);
+	if ((sts = RemapPDU(cp, p, len)) < 0)
+	    return sts;
+	UpstreamWrite(up, p, len);
+	return 0;
+
+    case PDU_FETCH:
+	if ((sts = RemapPDU(cp, p, len)) < 0)
+	    return sts;
+	/* FALLTHROUGH */
+    case PDU_INSTANCE_REQ:
+    case PDU_LABEL_REQ:
+    case PDU_DESC_REQ:
+    case PDU_TEXT_REQ:
+    case PDU_RESULT:
+    case PDU_PMNS_IDS:
+    case PDU_PMNS_NAMES:
+    case PDU_PMNS_CHILD:
+    case PDU_PMNS_TRAVERSE:
+	if ((sts = QueueRequest(up, cp, type)) < 0)
+	    return sts;
+	cp->status.waiting = 1;
+	UpstreamWrite(up, p, len);
+	return 0;
+
+    default:
+	/* as pmcd would reply, without disturbing the shared connection */
+	return ErrorReply(cp, PM_ERR_IPC);
+    }
+}
+
+/* Send on whole client requests, one at a time, as replies are written */
+int
+PoolInput(ClientInfo *cp)
+{
+    Channel	*ch = &cp->toPmcd;
+    int		len, sts;
+
+    while (!cp->status.waiting && !ChannelPending(&cp->toClient)) {
+	if (cp->upstream->state == UPSTREAM_FAILED)
+	    return 0;	/* resumed once the failure is dealt with */
+	if ((len = FramedPDU(ch, maxClientPDU)) <= 0) {
+	    if (len == 0 && !ChannelPending(ch))
+		ChannelFree(ch);	/* hold no memory while idle */
+	    return len;
+	}
+	if ((sts = PoolRequest(cp, len)) < 0)
+	    return sts;
+	ch->head += len;
+    }
+    return 0;
+}
+
+/* The first pmcd PDU, which each client needs to see for itself */
+static int
+UpstreamFeatures(Upstream *up, int len)
+{
+    Channel	*ch = &up->fromPmcd;
+    ClientInfo	*cp;
+    __pmPDU	*pb;
+    unsigned int	features = 0;
+    int		sts, code = PM_ERR_IPC, challenge;
+
+    if ((pb = CopyPDU(ch, len)) == NULL)
+	return -oserror();
+    if (((__pmPDUHdr *)pb)->type == PDU_ERROR &&
+	__pmDecodeXtendError(pb, &code, &challenge) >= 0)
+	features = __pmServerGetFeaturesFromPDU(pb);
+    __pmUnpinPDUBuf(pb);
+    if (code < 0)
+	return code;
+    /* clients need credentials or certificates of their own */
+    if (features & (PDU_FLAG_CREDS_REQD | PDU_FLAG_CERT_REQD))
+	return PM_ERR_PERMISSION;
+
+    if ((up->features = (char *)malloc(len)) == NULL)
+	return -ENOMEM;
+    memcpy(up->features, ch->buf + ch->head, len);
+    up->featlen = len;
+    up->state = UPSTREAM_CREDS;
+
+    for (cp = up->worker->clients; cp; cp = cp->next) {
+	if (cp->upstream != up || cp->status.features)
+	    continue;
+	if ((sts = ReplayFeatures(cp)) < 0)
+	    DeleteClient(cp);
+	else
+	    ClientResume(cp);
+    }
+    return 0;
+}
+
+/* Resume clients waiting for the shared connection to be ready */
+static void
+UpstreamReady(Upstream *up)
+{
+    ClientInfo	*cp;
+
+    up->state = UPSTREAM_READY;
+    if (pmDebugOptions.context)
+	fprintf(stderr, "UpstreamReady: %s (port %d) fd=%d users=%d\n",
+		up->hostname, up->connect.port, up->pmcd.fd, up->nusers);
+    for (cp = up->worker->clients; cp; cp = cp->next)
+	if (cp->upstream == up && cp->state == CLIENT_CREDS)
+	    ClientResume(cp);
+}
+
+/* Pass a reply back to the client first in line for one */
+static int
+UpstreamReply(Upstream *up, int len)
+{
+    Channel	*ch = &up->fromPmcd;
+    const char	*p = ch->buf + ch->head;
+    error_pdu_t	pdu;
+    Request	rq;
+    ClientInfo	*cp;
+    int		type = PduType(p);
+    int		sts = 0;
+
+    if (up->qcount == 0)
+	return PM_ERR_IPC;	/* nothing was asked for */
+    rq = up->queue[up->qhead];
+
+    if (type == PDU_ERROR && rq.type == PDU_FETCH &&
+	len >= (int)sizeof(pdu)) {
+	memcpy(&pdu, p, sizeof(pdu));
+	if ((int)ntohl(pdu.code) > 0) {
+	    /* state change notice, ahead of the result - for everyone */
+	    for (cp = up->worker->clients; cp; cp = cp->next)
+		if (cp->upstream == up)
+		    cp->changes |= ntohl(pdu.code);
+	    return 0;
+	}
+    }
+    up->qhead = (up->qhead + 1) % up->qsize;
+    up->qcount--;
+    if ((cp = rq.cp) == NULL)
+	return 0;	/* the client has gone */
+
+    cp->status.waiting = 0;
+    if (type == PDU_RESULT && cp->changes) {
+	sts = ErrorReply(cp, (int)cp->changes);
+	cp->changes = 0;
+    }
+    if (sts == 0)
+	sts = ChannelWrite(&cp->toClient, &cp->client, p, len);
+    if (sts < 0)
+	DeleteClient(cp);
+    else
+	ClientResume(cp);
+    return 0;
+}
+
+static int
+UpstreamInput(Upstream *up)
+{
+    Channel	*ch = &up->fromPmcd;
+    int		len, sts;
+
+    if ((sts = ReadFrame(&up->pmcd, ch, UINT_MAX)) != 0)
+	return sts;
+    while ((len = FramedPDU(ch, 0)) > 0) {
+	switch (up->state) {
+	case UPSTREAM_FEATURES:
+	    sts = UpstreamFeatures(up, len);
+	    break;
+	case UPSTREAM_PROBE:
+	    if (PduType(ch->buf + ch->head) != PDU_DESC)
+		sts = PM_ERR_PERMISSION;
+	    else
+		UpstreamReady(up);
+	    break;
+	case UPSTREAM_READY:
+	    sts = UpstreamReply(up, len);
+	    break;
+	default:
+	    sts = PM_ERR_IPC;	/* nothing expected from pmcd now */
+	    break;
+	}
+	if (sts < 0)
+	    return sts;
+	ch->head += len;
+    }
+    return len;
+}
+
+/* Handle an event on a shared pmcd socket, in its worker thread */
+void
+UpstreamEvent(Endpoint *ep, int events)
+{
+    Upstream	*up = ep->up;
+    int		sts = 0;
+
+    if (ep->fd < 0)		/* failed earlier in this round of events */
+	return;
+
+    if (up->state == UPSTREAM_CONNECT) {
+	if ((sts = ConnectDone(up->worker, &up->connect, ep)) == 0 &&
+	    up->connect.servInfo == NULL)
+	    up->state = UPSTREAM_FEATURES;
+    }
+    else if ((events & PROXY_ERROR) && !(events & PROXY_READ))
+	sts = PM_ERR_IPC;
+    else {
+	if (events & PROXY_WRITE)
+	    sts = FlushChannel(&up->toPmcd, ep);
+	if (sts == 0 && (events & PROXY_READ))
+	    sts = UpstreamInput(up);
+    }
+
+    if (sts != 0)
+	UpstreamFail(up, sts < 0 ? sts : -ECONNRESET);
+    else if (up->state != UPSTREAM_FAILED)
+	UpstreamWatch(up);
+}
+
+/* Give up on any shared PMCD connection taking too long */
+void
+UpstreamTimeouts(Worker *wp, time_t now)
+{
+    Upstream	*up;
+
+    for (up = wp->upstreams; up; up = up->next)
+	if (up->state == UPSTREAM_CONNECT && now >= up->connect.deadline)
+	    UpstreamFail(up, -ETIMEDOUT);
+}
+
+/*
+ * At the end of each round of events - move clients off failed shared
+ * connections, close those no longer used, and forget failures once
+ * it is time to try sharing again.
+ */
+void
+ReapUpstreams(Worker *wp)
+{
+    Upstream	*up, *next;
+    ClientInfo	*cp;
+    time_t	now = 0;
+
+    for (up = wp->upstreams; up; up = next) {
+	next = up->next;
+	if (up->state != UPSTREAM_FAILED) {
+	    if (up->nusers == 0)
+		UpstreamFree(up);
+	    continue;
+	}
+	for (cp = wp->clients; up->nusers > 0 && cp; cp = cp->next) {
+	    if (cp->upstream != up)
+		continue;
+	    if (cp->state == CLIENT_RELAY)
+		PoolDetach(cp);
+	    ClientResume(cp);
+	}
+	if (up->retry == 0 || (now ? now : (now = time(NULL))) >= up->retry)
+	    UpstreamFree(up);
+    }
+}
@@ -0,0 +1,402 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * Event loop threads.  The main thread accepts new clients and hands
+ * each one to a worker (chosen by socket descriptor) over a pipe, and
+ * from then on that worker alone handles the connection, for both the
+ * client and pmcd sockets (and any pmcd connection it shares, pool.c).  Each worker waits using epoll(7) where it
+ * is available, otherwise select(2) over its own connections.
+ */
+#include "pmproxy.h"
+#include <fcntl.h>
+#include <signal.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
+
+#define MAXEVENTS	256	/* events handled per epoll_wait */
+#define MAXWAKE		64	/* new clients read per wakeup */
+
+static Worker	*workers;
+static int	nworkers;
+static int	useSelect;	/* PMPROXY_USE_SELECT, or no epoll */
+
+#ifdef HAVE_SYS_EPOLL_H
+static int
+EpollEvents(int events)
+{
+    int		ev = 0;
+
+    if (events & PROXY_READ)
+	ev |= EPOLLIN;
+    if (events & PROXY_WRITE)
+	ev |= EPOLLOUT;
+    return ev;
+}
+#endif
+
+static Worker *
+EndpointWorker(Endpoint *ep)
+{
+    return ep->cp ? ep->cp->worker : ep->up->worker;
+}
+
+/* Handle events on a client or pmcd socket, whichever it is */
+static void
+EndpointEvent(Endpoint *ep, int events)
+{
+    if (ep->up)
+	UpstreamEvent(ep, events);
+    else
+	ClientEvent(ep, events);
+}
+
+/* Deal with time passing, and whatever closed in this round of events */
+static void
+EndOfRound(Worker *wp)
+{
+    time_t	now;
+
+    if (wp->nconnecting) {
+	now = time(NULL);
+	ClientTimeouts(wp, now);
+	UpstreamTimeouts(wp, now);
+    }
+    ReapUpstreams(wp);
+    ReapClients(wp);
+}
+
+/*
+ * Change the events being watched on one socket of a connection,
+ * called only from the thread owning the connection.  Registrations
+ * are level-triggered, so a socket left unread (while the other side
+ * catches up) is simply reported again later.
+ */
+void
+WatchEndpoint(Endpoint *ep, int events)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event	ev;
+    Worker		*wp = EndpointWorker(ep);
+    int			op;
+
+    if (ep->fd < 0 || ep->events == events)
+	return;
+    if (wp->pollfd >= 0) {
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EpollEvents(events);
+	ev.data.ptr = ep;
+	op = ep->events < 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+	if (epoll_ctl(wp->pollfd, op, ep->fd, &ev) < 0) {
+	    pmNotifyErr(LOG_ERR, "WatchEndpoint: epoll_ctl(%d): %s\n",
+			ep->fd, osstrerror());
+	    return;
+	}
+    }
+#else
+    if (ep->fd < 0)
+	return;
+#endif
+    ep->events = events;
+}
+
+void
+UnwatchEndpoint(Endpoint *ep)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event	ev;
+    Worker		*wp = EndpointWorker(ep);
+
+    /* non-NULL event for kernels before 2.6.9 */
+    if (ep->fd >= 0 && ep->events >= 0 && wp && wp->pollfd >= 0)
+	epoll_ctl(wp->pollfd, EPOLL_CTL_DEL, ep->fd, &ev);
+#endif
+    ep->events = -1;
+}
+
+/* Hand a newly accepted client over to the worker for its descriptor */
+void
+AssignClient(ClientInfo *cp)
+{
+    Worker	*wp = &workers[cp->client.fd % nworkers];
+
+    if (useSelect && cp->client.fd >= FD_SETSIZE) {
+	pmNotifyErr(LOG_WARNING, "AssignClient: fd=%d exceeds FD_SETSIZE (%d),"
+			" client refused\n", cp->client.fd, FD_SETSIZE);
+	DeleteClient(cp);
+	return;
+    }
+    if (write(wp->wakefd[1], &cp, sizeof(cp)) != sizeof(cp)) {
+	pmNotifyErr(LOG_ERR, "AssignClient: worker %d: %s\n",
+			wp->id, osstrerror());
+	DeleteClient(cp);
+    }
+}
+
+/* Take ownership of new clients sent by the main thread */
+static void
+WorkerAccept(Worker *wp)
+{
+    ClientInfo	*clients[MAXWAKE];
+    ssize_t	bytes;
+    int		i;
+
+    bytes = read(wp->wakefd[0], clients, sizeof(clients));
+    for (i = 0; i < bytes / (ssize_t)sizeof(ClientInfo *); i++) {
+	clients[i]->worker = wp;
+	clients[i]->next = wp->clients;
+	if (wp->clients)
+	    wp->clients->prev = clients[i];
+	wp->clients = clients[i];
+	wp->nclients++;
+	StartClient(clients[i]);
+    }
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static void
+EpollLoop(Worker *wp)
+{
+    struct epoll_event	events[MAXEVENTS];
+    struct epoll_event	ev;
+    Endpoint		*ep;
+    int			i, nfds, flags;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;		/* the wakeup pipe */
+    if (epoll_ctl(wp->pollfd, EPOLL_CTL_ADD, wp->wakefd[0], &ev) < 0) {
+	pmNotifyErr(LOG_ERR, "EpollLoop: worker %d epoll_ctl: %s\n",
+			wp->id, osstrerror());
+	return;
+    }
+
+    for (;;) {
+	/* wake once a second while connects are outstanding, to time out */
+	nfds = epoll_wait(wp->pollfd, events, MAXEVENTS,
+			  wp->nconnecting ? 1000 : -1);
+	if (nfds < 0) {
+	    if (oserror() == EINTR)
+		continue;
+	    pmNotifyErr(LOG_ERR, "EpollLoop: worker %d epoll_wait: %s\n",
+			wp->id, osstrerror());
+	    return;
+	}
+	for (i = 0; i < nfds; i++) {
+	    if ((ep = (Endpoint *)events[i].data.ptr) == NULL) {
+		WorkerAccept(wp);
+		continue;
+	    }
+	    flags = 0;
+	    if (events[i].events & EPOLLIN)
+		flags |= PROXY_READ;
+	    if (events[i].events & EPOLLOUT)
+		flags |= PROXY_WRITE;
+	    if (events[i].events & (EPOLLERR|EPOLLHUP))
+		flags |= PROXY_ERROR;
+	    EndpointEvent(ep, flags);
+	}
+	EndOfRound(wp);
+    }
+}
+#endif
+
+static int
+SelectSet(Endpoint *ep, __pmFdSet *readFds, __pmFdSet *writeFds, int maxFd)
+{
+    if (ep->fd < 0 || ep->events <= 0)
+	return maxFd;
+    if (ep->events & PROXY_READ)
+	__pmFD_SET(ep->fd, readFds);
+    if (ep->events & PROXY_WRITE)
+	__pmFD_SET(ep->fd, writeFds);
+    return ep->fd > maxFd ? ep->fd : maxFd;
+}
+
+static int
+SelectEvent(Endpoint *ep, __pmFdSet *readFds, __pmFdSet *writeFds)
+{
+    int		flags = 0;
+
+    if (ep->fd < 0 || ep->events <= 0)
+	return 0;
+    if (__pmFD_ISSET(ep->fd, readFds))
+	flags |= PROXY_READ;
+    if (__pmFD_ISSET(ep->fd, writeFds))
+	flags |= PROXY_WRITE;
+    if (flags)
+	EndpointEvent(ep, flags);
+    return flags != 0;
+}
+
+static void
+SelectLoop(Worker *wp)
+{
+    __pmFdSet		readFds, writeFds;
+    struct timeval	timeout, *tp;
+    ClientInfo		*cp;
+    Upstream		*up;
+    int			sts, maxFd;
+
+    for (;;) {
+	__pmFD_ZERO(&readFds);
+	__pmFD_ZERO(&writeFds);
+	__pmFD_SET(wp->wakefd[0], &readFds);
+	maxFd = wp->wakefd[0];
+	for (cp = wp->clients; cp; cp = cp->next) {
+	    maxFd = SelectSet(&cp->client, &readFds, &writeFds, maxFd);
+	    maxFd = SelectSet(&cp->pmcd, &readFds, &writeFds, maxFd);
+	}
+	for (up = wp->upstreams; up; up = up->next)
+	    maxFd = SelectSet(&up->pmcd, &readFds, &writeFds, maxFd);
+	timeout.tv_sec = 1;
+	timeout.tv_usec = 0;
+	tp = wp->nconnecting ? &timeout : NULL;
+
+	sts = select(maxFd + 1, &readFds, &writeFds, NULL, tp);
+	if (sts < 0) {
+	    if (neterror() == EINTR)
+		continue;
+	    pmNotifyErr(LOG_ERR, "SelectLoop: worker %d select: %s\n",
+			wp->id, netstrerror());
+	    return;
+	}
+	for (up = wp->upstreams; sts > 0 && up; up = up->next)
+	    sts -= SelectEvent(&up->pmcd, &readFds, &writeFds);
+	for (cp = wp->clients; sts > 0 && cp; cp = cp->next) {
+	    sts -= SelectEvent(&cp->client, &readFds, &writeFds);
+	    sts -= SelectEvent(&cp->pmcd, &readFds, &writeFds);
+	}
+	if (__pmFD_ISSET(wp->wakefd[0], &readFds))
+	    WorkerAccept(wp);
+	EndOfRound(wp);
+    }
+}
+
+static void *
+WorkerLoop(void *arg)
+{
+    Worker	*wp = (Worker *)arg;
+
+#ifdef HAVE_SYS_EPOLL_H
+    if (wp->pollfd >= 0)
+	EpollLoop(wp);
+    else
+#endif
+	SelectLoop(wp);
+
+    /* only on fatal errors - stop the whole proxy */
+    pmNotifyErr(LOG_ERR, "pmproxy worker %d exiting\n", wp->id);
+    Shutdown();
+    exit(1);
+}
+
+/*
+ * Start the worker threads, or fewer of them if resources run out,
+ * returning the number started.
+ */
+int
+StartWorkers(int count)
+{
+    Worker	*wp;
+    sigset_t	sigs, oldsigs;
+    char	*env;
+    int		sts, flags;
+
+    if ((env = getenv("PMPROXY_USE_SELECT")) != NULL && strcmp(env, "0") != 0) {
+	fprintf(stderr, "Warning: using select from PMPROXY_USE_SELECT=%s in environment\n", env);
+	useSelect = 1;
+    }
+#ifndef HAVE_SYS_EPOLL_H
+    useSelect = 1;
+#endif
+
+    if ((workers = (Worker *)calloc(count, sizeof(Worker))) == NULL) {
+	pmNoMem("StartWorkers", count * sizeof(Worker), PM_RECOV_ERR);
+	return 0;
+    }
+    /* signals are for the main thread, workers never see them */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGHUP);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+
+    for (nworkers = 0; nworkers < count; nworkers++) {
+	wp = &workers[nworkers];
+	wp->id = nworkers;
+	wp->pollfd = -1;
+	wp->pipe[0] = wp->pipe[1] = -1;
+	if ((wp->scratch = (char *)malloc(WORKER_BUFSIZE)) == NULL)
+	    break;
+	if (pipe(wp->wakefd) < 0) {
+	    pmNotifyErr(LOG_ERR, "StartWorkers: pipe: %s\n", osstrerror());
+	    free(wp->scratch);
+	    break;
+	}
+	/* reads drain the pipe, the main thread writes are blocking */
+	flags = __pmGetFileStatusFlags(wp->wakefd[0]);
+	__pmSetFileStatusFlags(wp->wakefd[0], flags | FNDELAY);
+#ifdef SPLICE_F_MOVE
+	/* pmcd results are spliced through here, else copied via scratch */
+	if (pipe2(wp->pipe, O_CLOEXEC) < 0) {
+	    pmNotifyErr(LOG_WARNING, "StartWorkers: pipe2: %s, not splicing\n",
+			osstrerror());
+	    wp->pipe[0] = wp->pipe[1] = -1;
+	}
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+	if (!useSelect && (wp->pollfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+	    pmNotifyErr(LOG_WARNING, "StartWorkers: epoll_create1: %s, using select\n",
+			osstrerror());
+	    useSelect = 1;
+	}
+#endif
+	if ((sts = pthread_create(&wp->thread, NULL, WorkerLoop, wp)) != 0) {
+	    pmNotifyErr(LOG_ERR, "StartWorkers: pthread_create: %s\n",
+			pmErrStr(-sts));
+	    if (wp->pollfd >= 0)
+		close(wp->pollfd);
+	    if (wp->pipe[0] >= 0) {
+		close(wp->pipe[0]);
+		close(wp->pipe[1]);
+	    }
+	    close(wp->wakefd[0]);
+	    close(wp->wakefd[1]);
+	    free(wp->scratch);
+	    break;
+	}
+    }
+    pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+
+#ifdef HAVE_SYS_RESOURCE_H
+    if (!useSelect) {
+	struct rlimit	rlim;
+
+	/* no FD_SETSIZE ceiling now, allow as many clients as we may */
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < rlim.rlim_max) {
+	    rlim.rlim_cur = rlim.rlim_max;
+	    if (setrlimit(RLIMIT_NOFILE, &rlim) < 0 && pmDebugOptions.appl0)
+		fprintf(stderr, "StartWorkers: setrlimit: %s\n", osstrerror());
+	}
+    }
+#endif
+    pmNotifyErr(LOG_INFO, "pmproxy: %d worker threads, using %s\n",
+		nworkers, useSelect ? "select" : "epoll");
+    return nworkers;
+}
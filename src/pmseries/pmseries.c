@@ -180,7 +180,8 @@ on_series_value(pmSeriesID *sid, const char *stamp, const char *value, void *arg
 {
     series_data		*dp = (series_data *)arg;
 
-    if (dp->nvalues == 0 || memcmp(&dp->series, sid, PMSIDSZ) != 0) {
+    /* aggregates across series report labels first, with the header */
+    if (memcmp(&dp->series, sid, PMSIDSZ) != 0) {
 	printf("\n%s\n", sid->name);
 	dp->series = *sid;
 	dp->nvalues = 0;
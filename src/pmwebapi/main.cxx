@@ -22,6 +22,10 @@
 #include <fstream>
 #include <sstream>
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
 using namespace std;
 
 string uriprefix = "pmapi";
@@ -36,7 +40,7 @@ unsigned long perm_context = 1;	/* set by -c option, changed by -h/-a/-L */
 unsigned new_contexts_p = 1;	/* cleared by -N option */
 unsigned graphite_p;		/* set by -G option */
 unsigned graphite_encode = 1;	/* unset by -X option */
-unsigned exit_p;		/* counted by SIG* handler */
+volatile sig_atomic_t exit_p;	/* set by SIG* handler */
 static __pmServerPresence *presence;
 unsigned multithread = 0;       /* set by -M option */
 unsigned graphite_timestep = 60;  /* set by -i option */
@@ -44,6 +48,17 @@ unsigned graphite_hostcache = 0; /* set by -J option */
 string logfile = "";		/* set by -l option */
 string fatalfile = "/dev/tty";	/* fatal messages at startup go here */
 
+#ifdef HAVE_PTHREAD_H
+/* Under -M, requests are served by a pool of microhttpd threads; the
+   pmwebapi contexts do their own (sharded) locking, while the graphite
+   code and its archive cache are kept to one request at a time.
+   Lock order: a context shard's rwlock, then that context's own mutex.
+   graphite_lock is never held with those, only ahead of the graphite
+   fetch pool's locks; usage_lock is taken alone. */
+static pthread_mutex_t usage_lock = PTHREAD_MUTEX_INITIALIZER;	/* clients_usage */
+static pthread_mutex_t graphite_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 
 
 /* Print a best-effort message as a plain-text http response; anything
@@ -156,6 +171,29 @@ vector <string> http_params::find_all (const string & s) const
 }
 
 
+/* One graphite request at a time, however many threads are serving. */
+static int
+graphite_respond (struct MHD_Connection *connection, const http_params & params,
+                  const vector <string> &url, const string & url0)
+{
+    int rc;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock (&graphite_lock);
+    try {
+        rc = pmgraphite_respond (connection, params, url, url0);
+    } catch (...) {
+        pthread_mutex_unlock (&graphite_lock);
+        throw;
+    }
+    pthread_mutex_unlock (&graphite_lock);
+#else
+    rc = pmgraphite_respond (connection, params, url, url0);
+#endif
+    return rc;
+}
+
+
 /*
  * Respond to a new incoming HTTP request.  It may be
  * one of three general categories:
@@ -193,7 +231,14 @@ mhd_respond (void *cls, struct MHD_Connection *connection, const char *url0,
 
         // Collect simple utilization info if desired
         if (dumpstats > 0) {
-            clients_usage[conninfo (connection, false)] ++;
+            string who = conninfo (connection, false);
+#ifdef HAVE_PTHREAD_H
+            pthread_mutex_lock (&usage_lock);
+#endif
+            clients_usage[who] ++;
+#ifdef HAVE_PTHREAD_H
+            pthread_mutex_unlock (&usage_lock);
+#endif
         }
 
         // Get our context
@@ -247,7 +292,7 @@ mhd_respond (void *cls, struct MHD_Connection *connection, const char *url0,
         else if (graphite_p && (method == "GET" || method == "POST") && (url1 == "graphite")
                  && ((url2 == "render") || (url2 == "metrics") || (url2 == "rawdata")
                      || (url2 == "browser") || (url2 == "graphlot" && url3 == "findmetric"))) {
-            return pmgraphite_respond (connection, mhd_cc->params, url_tokens, url);
+            return graphite_respond (connection, mhd_cc->params, url_tokens, url);
         }
         // graphite dashboard idiosyncracy; note absence of /graphite top level
         else if (graphite_p && (method == "GET" || method == "POST") &&
@@ -255,7 +300,7 @@ mhd_respond (void *cls, struct MHD_Connection *connection, const char *url0,
                   (url1 == "render"))) {
             url_tokens.insert (url_tokens.begin() + 1 /* empty #0 */,
                                string("graphite"));
-            return pmgraphite_respond (connection, mhd_cc->params, url_tokens, url);
+            return graphite_respond (connection, mhd_cc->params, url_tokens, url);
         }
 
         /* pmresapi? */
@@ -276,7 +321,7 @@ static void
 handle_signals (int sig)
 {
     (void) sig;
-    exit_p++;
+    exit_p = 1;
     // NB: invoke no async-signal-unsafe functions!
 }
 
@@ -307,6 +352,38 @@ mhd_respond_completed (void *cls, struct MHD_Connection *connection, void **con_
 
 
 
+/*
+ * Start a microhttpd daemon.  By default, use the application-driven
+ * threading model - requests are served one at a time from our own
+ * select loop in main().  Under -M, microhttpd runs a pool of that many
+ * threads instead, each with its own listen socket event loop.
+ */
+#ifdef MHD_USE_EPOLL_TURBO
+#define MY_MHD_FLAGS MHD_USE_EPOLL_TURBO
+#else
+#define MY_MHD_FLAGS 0
+#endif
+
+static struct MHD_Daemon *
+pmweb_start_daemon (unsigned int flags, int port)
+{
+#ifdef HAVE_PTHREAD_H
+    if (multithread > 0)
+        return MHD_start_daemon (flags | MHD_USE_SELECT_INTERNALLY | MY_MHD_FLAGS,
+                                 port, NULL, NULL,	/* default accept policy */
+                                 &mhd_respond, NULL,	/* handler callback */
+                                 MHD_OPTION_CONNECTION_TIMEOUT, maxtimeout, MHD_OPTION_NOTIFY_COMPLETED,
+                                 &mhd_respond_completed, NULL,
+                                 MHD_OPTION_THREAD_POOL_SIZE, multithread, MHD_OPTION_END);
+#endif
+    return MHD_start_daemon (flags | MY_MHD_FLAGS,
+                             port, NULL, NULL,	/* default accept policy */
+                             &mhd_respond, NULL,	/* handler callback */
+                             MHD_OPTION_CONNECTION_TIMEOUT, maxtimeout, MHD_OPTION_NOTIFY_COMPLETED,
+                             &mhd_respond_completed, NULL, MHD_OPTION_END);
+}
+
+
 static void
 pmweb_dont_start (void)
 {
@@ -411,6 +488,8 @@ server_dump_configuration ()
     }
 #if HAVE_PTHREAD_H
     clog << "\tUsing up to " << multithread << " auxiliary threads" << endl;
+    if (multithread > 0)
+        clog << "\tServing requests from a pool of " << multithread << " threads" << endl;
 #endif
 }
 
@@ -720,30 +799,26 @@ main (int argc, char *argv[])
         exit (EXIT_FAILURE);
     }
 
+#if defined(HAVE_PTHREAD_H) && !defined(IS_MINGW)
     /*
-     * Start microhttp daemon.  Use the application-driven threading
-     * model, so we don't complicate things with threads.  In the
-     * future, if this daemon becomes safe to run multithreaded,
-     * we could make use of MHD_USE_THREAD_PER_CONNECTION; we'd need
-     * to add ample locking over pmwebd context structures etc.
+     * Termination signals are for the main thread, which sleeps between
+     * garbage collections while the pool threads serve requests - keep
+     * them blocked in every thread started from here on.
      */
-#ifdef MHD_USE_EPOLL_TURBO
-#define MY_MHD_FLAGS MHD_USE_EPOLL_TURBO
-#else
-#define MY_MHD_FLAGS 0
+    sigset_t sigs, oldsigs;
+    sigemptyset (&sigs);
+    sigaddset (&sigs, SIGINT);
+    sigaddset (&sigs, SIGTERM);
+    sigaddset (&sigs, SIGQUIT);
+    pthread_sigmask (SIG_BLOCK, &sigs, &oldsigs);
 #endif
     if (mhd_ipv4)
-        d4 = MHD_start_daemon (MY_MHD_FLAGS,
-                               port, NULL, NULL,	/* default accept policy */
-                               &mhd_respond, NULL,	/* handler callback */
-                               MHD_OPTION_CONNECTION_TIMEOUT, maxtimeout, MHD_OPTION_NOTIFY_COMPLETED,
-                               &mhd_respond_completed, NULL, MHD_OPTION_END);
+        d4 = pmweb_start_daemon (0, port);
     if (mhd_ipv6)
-        d6 = MHD_start_daemon (MHD_USE_IPv6 | MY_MHD_FLAGS,
-                               port, NULL, NULL,	/* default accept policy */
-                               &mhd_respond, NULL,	/* handler callback */
-                               MHD_OPTION_CONNECTION_TIMEOUT, maxtimeout, MHD_OPTION_NOTIFY_COMPLETED,
-                               &mhd_respond_completed, NULL, MHD_OPTION_END);
+        d6 = pmweb_start_daemon (MHD_USE_IPv6, port);
+#if defined(HAVE_PTHREAD_H) && !defined(IS_MINGW)
+    pthread_sigmask (SIG_SETMASK, &oldsigs, NULL);
+#endif
     if (d4 == NULL && d6 == NULL) {
         timestamp (cerr) << "Error starting microhttpd daemons on port " << port << endl;
         pmweb_dont_start ();
@@ -808,9 +883,17 @@ main (int argc, char *argv[])
     /* Setup randomness for calls to random() */
     pmweb_init_random_seed ();
 
-    /* Scan all of our graphite archives. */
-    if (graphite_p)
+    /* Scan all of our graphite archives.  The daemons are already
+       serving by now, so this must not overlap a graphite request. */
+    if (graphite_p) {
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_lock (&graphite_lock);
+#endif
         ac_refresh_all(0);
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_unlock (&graphite_lock);
+#endif
+    }
 
     // A place to track utilization
     /* Block indefinitely. */
@@ -825,12 +908,16 @@ main (int argc, char *argv[])
         FD_ZERO (&rs);
         FD_ZERO (&ws);
         FD_ZERO (&es);
-        if (d4 && MHD_YES != MHD_get_fdset (d4, &rs, &ws, &es, &maxsock)) {
-            break;		/* fatal internal error */
-        }
-        if (d6 && MHD_YES != MHD_get_fdset (d6, &rs, &ws, &es, &maxsock)) {
-            break;		/* fatal internal error */
+        if (multithread == 0) {
+            if (d4 && MHD_YES != MHD_get_fdset (d4, &rs, &ws, &es, &maxsock)) {
+                break;		/* fatal internal error */
+            }
+            if (d6 && MHD_YES != MHD_get_fdset (d6, &rs, &ws, &es, &maxsock)) {
+                break;		/* fatal internal error */
+            }
         }
+        /* else the pool threads watch the sockets; just sleep until
+           the next garbage collection (or signal). */
 
         /*
          * Find the next expiry.  We don't need to bound it by
@@ -849,16 +936,18 @@ main (int argc, char *argv[])
         // NB: we -could- estimate how long till the next dumpstats interval closes
         // (ie. now - (last_dumpstats + dumpstats)), but that could be negative if
         // we've fallen behind.  Let's not worry about reporting on an exact schedule.
-        if (dumpstats > 0 && tv.tv_sec > dumpstats && ! clients_usage.empty ()) {
+        // NB: with a thread pool, clients may arrive while we sleep; always clamp.
+        if (dumpstats > 0 && tv.tv_sec > dumpstats &&
+            (multithread > 0 || ! clients_usage.empty ())) {
             tv.tv_sec = dumpstats;
         }
 
         select (maxsock + 1, &rs, &ws, &es, &tv);
 
-        if (d4) {
+        if (d4 && multithread == 0) {
             MHD_run (d4);
         }
-        if (d6) {
+        if (d6 && multithread == 0) {
             MHD_run (d6);
         }
 
@@ -869,6 +958,9 @@ main (int argc, char *argv[])
                 last_dumpstats = now;
             } else if ((now - last_dumpstats) >= dumpstats) {
                 last_dumpstats = now;
+#ifdef HAVE_PTHREAD_H
+                pthread_mutex_lock (&usage_lock);
+#endif
                 if (! clients_usage.empty ()) {
                     timestamp (clog) << "Client request counts:" << endl;
                 }
@@ -879,14 +971,19 @@ main (int argc, char *argv[])
                 }
 
                 clients_usage.clear ();
+#ifdef HAVE_PTHREAD_H
+                pthread_mutex_unlock (&usage_lock);
+#endif
             }
         }
     }
 
     pmweb_shutdown (d4, d6);
-    // clean up graphite archive cache
-    if (graphite_p)
+    // clean up graphite fetch pool and archive cache
+    if (graphite_p) {
+        pmgraphite_shutdown ();
         ac_refresh_all (0);
+    }
     
     return 0;
 }
@@ -29,6 +29,7 @@
 #include <set>
 #include <stack>
 #include <map>
+#include <deque>
 
 using namespace std;
 
@@ -55,6 +56,7 @@ extern "C"
 #ifdef HAVE_CAIRO
 #include <cairo/cairo.h>
 #endif
+#include <pcp/mmv_stats.h>
 }
 
 
@@ -1211,103 +1213,329 @@ struct fetch_series_jobspec {
     string filename; // archive filename
     time_t t_start, t_end, t_step;
     string message; // may have error or verbose message
+    struct fetch_series_batch *batch; // the request waiting on this job
 };
 
 
-template <class Spec>
-struct fetch_series_jobqueue {
-#ifdef HAVE_PTHREAD_H
-    pthread_mutex_t lock; // protects following field
-#endif
-    unsigned next_job_nr;
-
-    vector<Spec> jobs; // vector itself read-only
-    typedef void (*runner_t) (Spec *);
-    runner_t runner;
+void pmgraphite_fetch_series (fetch_series_jobspec *spec, int pmc);
 
-    fetch_series_jobqueue (runner_t);
-    ~fetch_series_jobqueue ();
 
-    static void* thread_main (void *);
+/*
+ * A process-wide pool of -M threads runs the fetch jobs of all
+ * requests, one job per archive file (see pmgraphite_fetch_all_series).
+ * Each archive has a home worker, chosen by hashing its filename, which
+ * keeps that archive's PCP context open from one request to the next -
+ * dashboards ask for the same archives over and over, and this spares
+ * a pmNewContext (label, index and metadata reading) each time.  A
+ * worker that runs out of jobs of its own steals whole archive jobs
+ * from the back of the longest queue.  Without -M, jobs run in the
+ * requesting thread, with a context cache of its own.
+ *
+ * Queue depth, job counts and times, and context reuse are exported
+ * through MMV, as mmv.pmwebd.graphite.*.
+ */
+#define FETCH_CONTEXTS_MAX   32 // open archive contexts per worker
+#define FETCH_CONTEXT_MAXAGE 60 // seconds, so new volumes of live archives are seen
+#define FETCH_MMV_CLUSTER    323
+
+struct fetch_series_context {
+    int ctx;
+    time_t opened;
+    time_t used;
+};
 
-    void run ();
+struct fetch_series_worker {
+    unsigned id;
+    deque<fetch_series_jobspec*> jobs; // queued jobs homed here; fetch_lock
+    map<string,fetch_series_context> contexts; // open archives; this worker only
 };
 
+struct fetch_series_batch {
+    unsigned pending; // jobs not yet finished; fetch_lock
+#ifdef HAVE_PTHREAD_H
+    pthread_cond_t done;
+#endif
+};
 
-template <class Spec>
-fetch_series_jobqueue<Spec>::fetch_series_jobqueue (runner_t r)
-{
+static vector<fetch_series_worker*> fetch_workers;
+static fetch_series_worker fetch_local; // without -M, run by the requester
+static unsigned fetch_queued;           // jobs waiting, across all workers
+static bool fetch_started;
+static bool fetch_stopping;             // workers exit once idle
 #ifdef HAVE_PTHREAD_H
-    pthread_mutex_init (& this->lock, NULL);
+static vector<pthread_t> fetch_threads;
+static pthread_mutex_t fetch_lock = PTHREAD_MUTEX_INITIALIZER; // protects all the above
+static pthread_cond_t fetch_work = PTHREAD_COND_INITIALIZER;
 #endif
-    this->runner = r;
-    this->next_job_nr = 0;
-}
 
+static mmv_metric_t fetch_metrics[] = {
+    { "graphite.jobs.queued", 1, MMV_TYPE_U32, MMV_SEM_INSTANT,
+      MMV_UNITS(0,0,1,0,0,PM_COUNT_ONE), PM_INDOM_NULL,
+      (char *) "Archive fetch jobs waiting for a worker", NULL },
+    { "graphite.jobs.total", 2, MMV_TYPE_U64, MMV_SEM_COUNTER,
+      MMV_UNITS(0,0,1,0,0,PM_COUNT_ONE), PM_INDOM_NULL,
+      (char *) "Archive fetch jobs run", NULL },
+    { "graphite.jobs.stolen", 3, MMV_TYPE_U64, MMV_SEM_COUNTER,
+      MMV_UNITS(0,0,1,0,0,PM_COUNT_ONE), PM_INDOM_NULL,
+      (char *) "Archive fetch jobs run by a worker other than their home", NULL },
+    { "graphite.jobs.time", 4, MMV_TYPE_U64, MMV_SEM_COUNTER,
+      MMV_UNITS(0,1,0,0,PM_TIME_USEC,0), PM_INDOM_NULL,
+      (char *) "Time spent running archive fetch jobs", NULL },
+    { "graphite.contexts.opened", 5, MMV_TYPE_U64, MMV_SEM_COUNTER,
+      MMV_UNITS(0,0,1,0,0,PM_COUNT_ONE), PM_INDOM_NULL,
+      (char *) "Archive contexts opened by fetch workers", NULL },
+    { "graphite.contexts.reused", 6, MMV_TYPE_U64, MMV_SEM_COUNTER,
+      MMV_UNITS(0,0,1,0,0,PM_COUNT_ONE), PM_INDOM_NULL,
+      (char *) "Archive fetch jobs run on an already open context", NULL },
+    { "graphite.workers", 7, MMV_TYPE_U32, MMV_SEM_DISCRETE,
+      MMV_UNITS(0,0,0,0,0,0), PM_INDOM_NULL,
+      (char *) "Archive fetch worker threads", NULL },
+};
+
+static struct {
+    void *map;
+    pmAtomValue *queued, *total, *stolen, *time, *opened, *reused, *workers;
+} fetch_stats;
 
-template <class Spec>
-fetch_series_jobqueue<Spec>::~fetch_series_jobqueue ()
+
+// Return the (current) PMAPI context for the given archive, opening it
+// if this worker has none yet, or only an old one.
+static int
+fetch_series_context_get (fetch_series_worker *w, const string& filename, bool& reused)
 {
-#ifdef HAVE_PTHREAD_H
-    pthread_mutex_destroy (& this->lock);
-#endif
+    time_t now = time (NULL);
+    map<string,fetch_series_context>::iterator it = w->contexts.find (filename);
+
+    reused = false;
+    if (it != w->contexts.end ()) {
+        if (now - it->second.opened < FETCH_CONTEXT_MAXAGE &&
+            pmUseContext (it->second.ctx) >= 0) {
+            it->second.used = now;
+            reused = true;
+            return it->second.ctx;
+        }
+        pmDestroyContext (it->second.ctx);
+        w->contexts.erase (it);
+    }
+
+    if (w->contexts.size () >= FETCH_CONTEXTS_MAX) {
+        // close the least recently used
+        map<string,fetch_series_context>::iterator lru = w->contexts.begin ();
+        for (it = w->contexts.begin (); it != w->contexts.end (); it++)
+            if (it->second.used < lru->second.used)
+                lru = it;
+        pmDestroyContext (lru->second.ctx);
+        w->contexts.erase (lru);
+    }
+
+    int ctx = pmNewContext (PM_CONTEXT_ARCHIVE, filename.c_str ());
+    if (ctx < 0)
+        return ctx;
+    fetch_series_context c;
+    c.ctx = ctx;
+    c.opened = c.used = now;
+    w->contexts[filename] = c;
+    return ctx;
 }
 
 
-template <class Spec>
-void* fetch_series_jobqueue<Spec>::thread_main (void *cls)
+static void
+fetch_series_run (fetch_series_worker *w, fetch_series_jobspec *spec, bool stolen)
 {
-    fetch_series_jobqueue<Spec>* q = (fetch_series_jobqueue<Spec>*) cls;
-    assert (q != 0);
+    struct timeval start, finish;
+    bool reused;
+
+    (void) gettimeofday (&start, NULL);
+    int pmc = fetch_series_context_get (w, spec->filename, reused);
+    pmgraphite_fetch_series (spec, pmc);
+    (void) gettimeofday (&finish, NULL);
 
-    while (1) {
 #ifdef HAVE_PTHREAD_H
-        pthread_mutex_lock (& q->lock);
+    pthread_mutex_lock (&fetch_lock);
 #endif
-        unsigned my_jobid = q->next_job_nr++;
+    mmv_inc_value (fetch_stats.map, fetch_stats.total, 1);
+    mmv_inc_value (fetch_stats.map, fetch_stats.time, pmtimevalSub (&finish, &start) * 1000000);
+    if (stolen)
+        mmv_inc_value (fetch_stats.map, fetch_stats.stolen, 1);
+    if (reused)
+        mmv_inc_value (fetch_stats.map, fetch_stats.reused, 1);
+    else if (pmc >= 0)
+        mmv_inc_value (fetch_stats.map, fetch_stats.opened, 1);
+    if (--spec->batch->pending == 0) {
 #ifdef HAVE_PTHREAD_H
-        pthread_mutex_unlock (& q->lock);
+        pthread_cond_signal (&spec->batch->done);
 #endif
+    }
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock (&fetch_lock);
+#endif
+}
 
-        if ((my_jobid >= q->jobs.size ()) || exit_p) {
-            break;
+
+#ifdef HAVE_PTHREAD_H
+static void *
+fetch_series_worker_main (void *cls)
+{
+    fetch_series_worker *w = (fetch_series_worker *) cls;
+
+    pthread_mutex_lock (&fetch_lock);
+    while (1) {
+        fetch_series_jobspec *spec = NULL;
+        fetch_series_worker *victim = NULL;
+
+        if (! w->jobs.empty ()) {
+            spec = w->jobs.front ();
+            w->jobs.pop_front ();
+        } else {
+            for (unsigned i = 0; i < fetch_workers.size (); i++) {
+                fetch_series_worker *v = fetch_workers[i];
+                if (v->jobs.size () > (victim ? victim->jobs.size () : 0))
+                    victim = v;
+            }
+            if (victim) {
+                spec = victim->jobs.back ();
+                victim->jobs.pop_back ();
+            }
         }
+        if (spec == NULL) {
+            if (fetch_stopping)
+                break;
+            pthread_cond_wait (&fetch_work, &fetch_lock);
+            continue;
+        }
+        fetch_queued--;
+        mmv_set_value (fetch_stats.map, fetch_stats.queued, fetch_queued);
+        pthread_mutex_unlock (&fetch_lock);
+
+        fetch_series_run (w, spec, victim != NULL);
 
-        (*q->runner) (& q->jobs[my_jobid]);
+        pthread_mutex_lock (&fetch_lock);
     }
+    pthread_mutex_unlock (&fetch_lock);
     return 0;
 }
+#endif
+
+
+// Start the worker pool (and statistics) on first use; call with
+// fetch_lock held.  Returns false if jobs must run in the requester.
+static bool
+fetch_series_start ()
+{
+    if (! fetch_started) {
+        fetch_started = true;
+        fetch_stats.map = mmv_stats_init ("pmwebd", FETCH_MMV_CLUSTER, MMV_FLAG_PROCESS,
+                                          fetch_metrics,
+                                          sizeof (fetch_metrics) / sizeof (fetch_metrics[0]),
+                                          NULL, 0);
+        if (fetch_stats.map == NULL && verbosity)
+            timestamp (clog) << "graphite fetch statistics not exported" << endl;
+        fetch_stats.queued = mmv_lookup_value_desc (fetch_stats.map, "graphite.jobs.queued", NULL);
+        fetch_stats.total = mmv_lookup_value_desc (fetch_stats.map, "graphite.jobs.total", NULL);
+        fetch_stats.stolen = mmv_lookup_value_desc (fetch_stats.map, "graphite.jobs.stolen", NULL);
+        fetch_stats.time = mmv_lookup_value_desc (fetch_stats.map, "graphite.jobs.time", NULL);
+        fetch_stats.opened = mmv_lookup_value_desc (fetch_stats.map, "graphite.contexts.opened", NULL);
+        fetch_stats.reused = mmv_lookup_value_desc (fetch_stats.map, "graphite.contexts.reused", NULL);
+        fetch_stats.workers = mmv_lookup_value_desc (fetch_stats.map, "graphite.workers", NULL);
 
+#ifdef HAVE_PTHREAD_H
+        for (unsigned i = 0; i < multithread; i++) {
+            fetch_series_worker *w = new fetch_series_worker ();
+            pthread_t x;
+            w->id = fetch_workers.size ();
+            fetch_workers.push_back (w);
+            if (pthread_create (&x, NULL, fetch_series_worker_main, (void *) w) != 0) {
+                fetch_workers.pop_back ();
+                delete w;
+                break;
+            }
+            fetch_threads.push_back (x);
+        }
+#endif
+        mmv_set_value (fetch_stats.map, fetch_stats.workers, fetch_workers.size ());
+        if (verbosity)
+            timestamp (clog) << "graphite fetch pool of " << fetch_workers.size ()
+                             << " worker thread(s) started" << endl;
+    }
+    return ! fetch_workers.empty ();
+}
 
 
-// simple contention
-template <class Spec>
-void fetch_series_jobqueue<Spec>::run ()
+// Run all the given jobs to completion, in the pool when there is one.
+static void
+fetch_series_run_all (vector<fetch_series_jobspec>& jobs)
 {
-    // Permute the job queue randomly, to make it less likely that
-    // concurrent threads are processing the same archive.
-    // ... but some experimentaton shows harm rather than benefit.
-    // random_shuffle (this->jobs.begin(), this->jobs.end());
-    // ... plus we'd have to unshuffle before results are collected.
+    fetch_series_batch batch;
+
+    batch.pending = jobs.size ();
+    for (unsigned i = 0; i < jobs.size (); i++)
+        jobs[i].batch = & batch;
 
 #ifdef HAVE_PTHREAD_H
-    vector<pthread_t> threads;
-    for (unsigned i=0; i<multithread; i++) {
-        pthread_t x;
-        int rc = pthread_create (&x, NULL, & this->thread_main, (void*) this);
-        if (rc == 0) {
-            threads.push_back (x);
+    pthread_cond_init (&batch.done, NULL);
+    pthread_mutex_lock (&fetch_lock);
+    if (fetch_series_start ()) {
+        for (unsigned i = 0; i < jobs.size (); i++) {
+            // home worker for this archive
+            unsigned hash = 5381;
+            const string& f = jobs[i].filename;
+            for (unsigned j = 0; j < f.size (); j++)
+                hash = hash * 33 + (unsigned char) f[j];
+            fetch_workers[hash % fetch_workers.size ()]->jobs.push_back (& jobs[i]);
         }
+        fetch_queued += jobs.size ();
+        mmv_set_value (fetch_stats.map, fetch_stats.queued, fetch_queued);
+        pthread_cond_broadcast (&fetch_work);
+        while (batch.pending > 0)
+            pthread_cond_wait (&batch.done, &fetch_lock);
     }
+    pthread_mutex_unlock (&fetch_lock);
+#else
+    (void) fetch_series_start ();
 #endif
-    // have main thread also have a go
-    (void)this->thread_main (this);
+    // (only without a pool are any jobs left now)
+    for (unsigned i = 0; batch.pending > 0 && i < jobs.size (); i++)
+        fetch_series_run (& fetch_local, & jobs[i], false);
+#ifdef HAVE_PTHREAD_H
+    pthread_cond_destroy (&batch.done);
+#endif
+}
+
+
+static void
+fetch_series_worker_close (fetch_series_worker *w)
+{
+    for (map<string,fetch_series_context>::iterator it = w->contexts.begin ();
+         it != w->contexts.end (); it++)
+        pmDestroyContext (it->second.ctx);
+    w->contexts.clear ();
+}
+
 
+// Stop the worker pool and close its archives; the daemons must have
+// stopped already, so that no request is still waiting on a batch.
+void
+pmgraphite_shutdown ()
+{
 #ifdef HAVE_PTHREAD_H
-    for (unsigned i=0; i<threads.size (); i++) {
-        (void) pthread_join (threads[i], NULL);
-    }
+    pthread_mutex_lock (&fetch_lock);
+    fetch_stopping = true;
+    pthread_cond_broadcast (&fetch_work);
+    pthread_mutex_unlock (&fetch_lock);
+    for (unsigned i = 0; i < fetch_threads.size (); i++)
+        (void) pthread_join (fetch_threads[i], NULL);
+    fetch_threads.clear ();
 #endif
+    for (unsigned i = 0; i < fetch_workers.size (); i++) {
+        fetch_series_worker_close (fetch_workers[i]);
+        delete fetch_workers[i];
+    }
+    fetch_workers.clear ();
+    fetch_series_worker_close (& fetch_local);
+    if (fetch_stats.map) {
+        mmv_stats_stop ("pmwebd", fetch_stats.map);
+        fetch_stats.map = NULL;
+    }
 }
 
 
@@ -1322,7 +1550,7 @@ void fetch_series_jobqueue<Spec>::run ()
 // an empty vector.  (As a matter of security, we prefer not to give too
 // much information to a remote web user about the exact error.)  Occasional
 // missing metric values are represented as floating-point NaN values.
-void pmgraphite_fetch_series (fetch_series_jobspec *spec)
+void pmgraphite_fetch_series (fetch_series_jobspec *spec, int pmc)
 {
     assert (spec != NULL);
     assert (spec->outputs.size() > 0);
@@ -1334,7 +1562,6 @@ void pmgraphite_fetch_series (fetch_series_jobspec *spec)
     time_t t_step = spec->t_step;
     int sts;
     string last_component;
-    int pmc;
     string archive;
     unsigned entries_good = 0, entries;
     stringstream message;
@@ -1361,15 +1588,13 @@ void pmgraphite_fetch_series (fetch_series_jobspec *spec)
 
     archive = spec->filename;
 
-    // Open the bad boy.
-    pmc = pmNewContext (PM_CONTEXT_ARCHIVE, archive.c_str ());
+    // The bad boy is opened (and made current) by our worker.
     if (pmc < 0) {
-        // error already noted XXX where?
-        goto out0;
+        char pmmsg[PM_MAXERRMSGLEN];
+        message << "cannot open archive: " << pmErrStr_r (pmc, pmmsg, sizeof (pmmsg));
+        goto out;
     }
 
-    // NB: past this point, exit via 'goto out;' to release pmc
-
     // Fetch end of archive time boundaries, to avoid having libpcp
     // iterate across vast regions of void.  This would be especially
     // bad if libpcp worries the archive might have grown since last
@@ -1609,9 +1834,7 @@ void pmgraphite_fetch_series (fetch_series_jobspec *spec)
     }
 
  out:
-    pmDestroyContext (pmc);
- out0:
-    // vector output already returned via jobspec pointer
+    // vector output already returned via jobspec pointer; pmc stays open
 
     spec->message = message.str (); // pass back message
     // ... but prefix it with archive name
@@ -1710,17 +1933,17 @@ pmgraphite_fetch_all_series (struct MHD_Connection* connection,
         }
     }
 
-    // copy into a jobqueue vector (since the execution loop wants a vector)
-    fetch_series_jobqueue<fetch_series_jobspec> q (& pmgraphite_fetch_series);
+    // copy into a job vector (since the execution loop wants a vector)
+    vector<fetch_series_jobspec> jobs;
     for (map<string,fetch_series_jobspec>::iterator it = jobmap.begin(); it != jobmap.end(); it++)
-        q.jobs.push_back(it->second);
+        jobs.push_back(it->second);
 
-    unsigned number_of_jobs = q.jobs.size();
+    unsigned number_of_jobs = jobs.size();
 
     // it's ready to go
     struct timeval start;
     (void) gettimeofday (&start, NULL);
-    q.run ();
+    fetch_series_run_all (jobs);
     struct timeval finish;
     (void) gettimeofday (&finish, NULL);
     // ... aaaand it's gone
@@ -1731,8 +1954,8 @@ pmgraphite_fetch_all_series (struct MHD_Connection* connection,
 #endif
 
     // propagate any messages
-    for (unsigned i = 0; i < q.jobs.size (); i++) {
-        const string& message = q.jobs[i].message;
+    for (unsigned i = 0; i < jobs.size (); i++) {
+        const string& message = jobs[i].message;
         if (message != "") {
             connstamp (clog, connection) << message << endl;
         }
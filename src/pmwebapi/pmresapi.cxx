@@ -70,12 +70,14 @@ guess_content_type (const char *filename)
 
 
 static const char *
-create_rfc822_date (time_t t)
+create_rfc822_date (time_t t, char *datebuf, size_t datelen)
 {
-    static char datebuf[80];	/* if-threaded: unstaticify */
-    struct tm *now = gmtime (&t);
-    size_t rc = strftime (datebuf, sizeof (datebuf), "%a, %d %b %Y %T GMT", now);
-    if (rc <= 0 || rc >= sizeof (datebuf)) {
+    struct tm now;
+    if (gmtime_r (&t, &now) == NULL) {
+        return NULL;
+    }
+    size_t rc = strftime (datebuf, datelen, "%a, %d %b %Y %T GMT", &now);
+    if (rc <= 0 || rc >= datelen) {
         return NULL;
     }
     return datebuf;
@@ -95,6 +97,7 @@ pmwebres_respond (struct MHD_Connection *connection, const http_params& params,
     unsigned int resp_code = MHD_HTTP_OK;
     struct MHD_Response *resp;
     const char *ctype = NULL;
+    char datebuf[80];
 
     assert (resourcedir != "");	/* facility is enabled at all */
     /* NB: formerly, we asserted (url[0] == '/'), and this is proper for normal HTTP requests.
@@ -207,14 +210,14 @@ pmwebres_respond (struct MHD_Connection *connection, const http_params& params,
 
     /* And since we're generous to a fault, supply a timestamp field to
        assist caching. */
-    ctype = create_rfc822_date (fds.st_mtime);
+    ctype = create_rfc822_date (fds.st_mtime, datebuf, sizeof (datebuf));
     if (ctype) {
         (void) MHD_add_response_header (resp, "Last-Modified", ctype);
     }
 
 #if 0
     /* Add a 5-minute expiry. */
-    ctype = create_rfc822_date (time (0) + 300);	/* XXX: configure */
+    ctype = create_rfc822_date (time (0) + 300, datebuf, sizeof (datebuf));	/* XXX: configure */
     if (ctype) {
         (void) MHD_add_response_header (resp, "Expires", ctype);
     }
@@ -44,6 +44,10 @@
 #include <sstream>
 #include <algorithm>
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
 
 using namespace std;
 
@@ -64,12 +68,88 @@ struct webcontext {
     map <pmID, pmDesc> metric_desc_cache;
     map <pmID, string> metric_text_cache;
     map <pmID, map<int, string> > metric_inst_cache;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;	/* one request at a time on this context */
+#endif
+    webcontext ();
     ~webcontext ();
 };
 
 
+/* The webcontext# space is split into shards, each a map with its own
+   reader/writer lock.  A request holds the read lock of its context's
+   shard throughout, so requests on different contexts run in parallel
+   (under -M, in the microhttpd thread pool), while creation and garbage
+   collection take the write lock, and so never free a context that a
+   request is still using. */
+#define CONTEXT_SHARDS 16
+
 typedef map <unsigned long, webcontext *>context_map;
-static context_map contexts;	// map from webcontext#
+
+struct context_shard {
+    context_map contexts;	// map from webcontext#
+#ifdef HAVE_PTHREAD_H
+    pthread_rwlock_t lock;
+#endif
+    context_shard ();
+};
+
+static context_shard shards[CONTEXT_SHARDS];
+
+
+context_shard::context_shard ()
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_rwlock_init (& this->lock, NULL);
+#endif
+}
+
+static inline context_shard *
+context_shard_of (unsigned long webapi_ctx)
+{
+    return & shards[webapi_ctx % CONTEXT_SHARDS];
+}
+
+static inline void
+context_read_lock (context_shard *s)
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_rwlock_rdlock (& s->lock);
+#else
+    (void) s;
+#endif
+}
+
+static inline void
+context_write_lock (context_shard *s)
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_rwlock_wrlock (& s->lock);
+#else
+    (void) s;
+#endif
+}
+
+static inline bool
+context_try_write_lock (context_shard *s)
+{
+#ifdef HAVE_PTHREAD_H
+    return pthread_rwlock_trywrlock (& s->lock) == 0;
+#else
+    (void) s;
+    return true;
+#endif
+}
+
+static inline void
+context_unlock (context_shard *s)
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_rwlock_unlock (& s->lock);
+#else
+    (void) s;
+#endif
+}
 
 
 
@@ -77,7 +157,8 @@ static context_map contexts;	// map from webcontext#
 /* Check whether any contexts have been unpolled so long that they
    should be considered abandoned.  If so, close 'em, free 'em, yak
    'em, smack 'em.  Return the number of seconds to the next good time
-   to check for garbage. */
+   to check for garbage.  A shard busy with requests is skipped, and
+   looked at again a second later. */
 unsigned
 pmwebapi_gc ()
 {
@@ -85,39 +166,61 @@ pmwebapi_gc ()
     (void) time (&now);
     time_t soonest = 0;
 
-    for (context_map::iterator it = contexts.begin (); it != contexts.end (); /* null */) {
+    for (unsigned i = 0; i < CONTEXT_SHARDS; i++) {
+        context_shard *s = & shards[i];
 
-        if (it->second->expires == 0) {
-            // permanent
-            it++;
+        if (! context_try_write_lock (s)) {
+            if (soonest == 0 || soonest > now + 1) {
+                soonest = now + 1;
+            }
             continue;
         }
 
-        if (it->second->expires < now) {
-            if (verbosity) {
-                timestamp (clog) << "context (web" << it->first << "=pm" << it->second->context <<
-                                 ") expired." << endl;
+        for (context_map::iterator it = s->contexts.begin (); it != s->contexts.end (); /* null */) {
+
+            if (it->second->expires == 0) {
+                // permanent
+                it++;
+                continue;
             }
 
-            delete it->second;
-            context_map::iterator it2 = it++;
-            contexts.erase (it2);
-        } else {
-            if (soonest == 0) {
-                // first
-                soonest = it->second->expires;
-            } else if (soonest > it->second->expires) {
-                // not earliest
-                soonest = it->second->expires;
+            if (it->second->expires < now) {
+                if (verbosity) {
+                    timestamp (clog) << "context (web" << it->first << "=pm" << it->second->context <<
+                                     ") expired." << endl;
+                }
+
+                delete it->second;
+                context_map::iterator it2 = it++;
+                s->contexts.erase (it2);
+            } else {
+                if (soonest == 0) {
+                    // first
+                    soonest = it->second->expires;
+                } else if (soonest > it->second->expires) {
+                    // not earliest
+                    soonest = it->second->expires;
+                }
+                it++;
             }
-            it++;
         }
+
+        context_unlock (s);
     }
 
     return soonest ? (unsigned) (soonest - now) : maxtimeout;
 }
 
 
+webcontext::webcontext ():
+    mypolltimeout (0), expires (0), context (-1)
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_init (& this->lock, NULL);
+#endif
+}
+
+
 webcontext::~webcontext ()
 {
     if (this->context >= 0) {
@@ -127,51 +230,65 @@ webcontext::~webcontext ()
                              endl;
         }
     }
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_destroy (& this->lock);
+#endif
 }
 
 
 void
 pmwebapi_deallocate_all ()
 {
-    for (context_map::iterator it = contexts.begin (); it != contexts.end (); it++) {
-        if (verbosity) {
-            timestamp (clog) << "context pm" << it->second->context << "deleted." << endl;
+    for (unsigned i = 0; i < CONTEXT_SHARDS; i++) {
+        context_shard *s = & shards[i];
+
+        context_write_lock (s);
+        for (context_map::iterator it = s->contexts.begin (); it != s->contexts.end (); it++) {
+            if (verbosity) {
+                timestamp (clog) << "context pm" << it->second->context << "deleted." << endl;
+            }
+            delete it->second;
         }
-        delete it->second;
+        s->contexts.clear ();
+        context_unlock (s);
     }
-
 }
 
 
-/* Allocate an zeroed webcontext structure, and enroll it in the
-   hash table with the given context#. */
+/* Enroll a filled-in webcontext structure in the hash table with the
+   given context#; it becomes visible to requests only once complete. */
 static int
-webcontext_allocate (int webapi_ctx, struct webcontext **wc)
+webcontext_enroll (unsigned long webapi_ctx, struct webcontext *c)
 {
-    if (contexts.find (webapi_ctx) != contexts.end ()) {
-        return -EEXIST;
+    context_shard *s = context_shard_of (webapi_ctx);
+    int rc = 0;
+
+    assert (c);
+    context_write_lock (s);
+    if (s->contexts.find (webapi_ctx) != s->contexts.end ()) {
+        rc = -EEXIST;
+    } else {
+        s->contexts[webapi_ctx] = c;
     }
-    /* Allocate & clear our webapi context. */
-    assert (wc);
-    contexts[webapi_ctx] = *wc = new webcontext ();
-    return 0;
+    context_unlock (s);
+    return rc;
 }
 
 
 int
 pmwebapi_bind_permanent (int webapi_ctx, int pcp_context, string spec)
 {
-    struct webcontext *c;
-    int rc = webcontext_allocate (webapi_ctx, &c);
-    if (rc < 0) {
-        return rc;
-    }
-    assert (c);
+    struct webcontext *c = new webcontext ();
     c->context = pcp_context;
     c->mypolltimeout = ~0;
     c->expires = 0;
     c->spec = spec;
-    return 0;
+    int rc = webcontext_enroll (webapi_ctx, c);
+    if (rc < 0) {
+        c->context = -1;	/* caller's to clean up */
+        delete c;
+    }
+    return rc;
 }
 
 
@@ -311,7 +428,14 @@ pmwebapi_respond_new_context (struct MHD_Connection *connection,
 
 
     {
-        struct webcontext *c = NULL;
+        struct webcontext *c = new webcontext ();
+        c->context = context;
+        time (&c->expires);
+        c->mypolltimeout = polltimeout;
+        c->expires += c->mypolltimeout;
+        c->userid = userid;		/* may be empty */
+        c->password = password;	/* ditto */
+
         /* Create a new context key for the webapi.  We just use a random integer within
            a reasonable range: 1..INT_MAX */
         while (1) {
@@ -320,7 +444,7 @@ pmwebapi_respond_new_context (struct MHD_Connection *connection,
             iterations++;
             if (iterations > 100) {
                 connstamp (cerr, connection) << "webapi_ctx allocation failed" << endl;
-                pmDestroyContext (context);
+                delete c;	/* pmDestroyContext (context) */
                 rc = -EMFILE;
                 goto out;
             }
@@ -329,21 +453,13 @@ pmwebapi_respond_new_context (struct MHD_Connection *connection,
             if (webapi_ctx <= 0) {
                 continue;
             }
-            rc = webcontext_allocate (webapi_ctx, &c);
+            rc = webcontext_enroll (webapi_ctx, c);
             if (rc == 0) {
                 break;
             }
 
             /* This may already exist.  We loop in case the key id already exists. */
         }
-
-        assert (c);
-        c->context = context;
-        time (&c->expires);
-        c->mypolltimeout = polltimeout;
-        c->expires += c->mypolltimeout;
-        c->userid = userid;		/* may be empty */
-        c->password = password;	/* ditto */
         /* Errors beyond this point don't require instant cleanup; the
            periodic context GC will do it all. */
     }
@@ -1626,61 +1742,15 @@ out:
 /* ------------------------------------------------------------------------ */
 
 
-int
-pmwebapi_respond (struct MHD_Connection *connection, const http_params & params,
-                  const vector <string> &url)
+/* Serve one request on an existing context, with the context (and its
+   shard) locked by the caller. */
+static int
+pmwebapi_respond_context (struct MHD_Connection *connection, const http_params & params,
+                          struct webcontext *c, unsigned long webapi_ctx,
+                          const string & context_command)
 {
-    /* We emit CORS header for all successful json replies, namely:
-       Access-Control-Access-Origin: *
-       https://developer.mozilla.org/en-US/docs/HTTP/Access_control_CORS */
-
-    /* NB: url is already edited to remove the /pmapi/ prefix. */
-    unsigned long webapi_ctx;
-    struct webcontext *c;
-    char *context_end;
-    string context_command;
     int rc = 0;
-    context_map::iterator it;
 
-    /* Decode the calls to the web API. */
-    /* -------------------------------------------------------------------- */
-    /* context creation */
-    /* if-multithreaded: write-lock contexts */
-    if (new_contexts_p &&		/* permitted */
-            (url.size () == 3 && url[2] == "context")) {
-        return pmwebapi_respond_new_context (connection, params);
-    }
-
-    /* -------------------------------------------------------------------- */
-    /* All other calls use $CTX/command, so we parse $CTX
-       generally and map it to the webcontext* */
-    if (url.size () != 4) {
-	connstamp (cerr, connection) << "url.size() " << url.size() << " not 4, url[2]=" << url[2] << ", new_contexts_p=" << new_contexts_p << endl;
-        rc = -EINVAL;
-        goto out;
-    }
-
-    errno = 0;
-    webapi_ctx = strtoul (url[2].c_str (), &context_end, 10);	/* matches %d above */
-    if (errno != 0 || webapi_ctx <= 0	/* range check, plus string-nonemptyness check */
-            || webapi_ctx > INT_MAX	/* matches random() loop above */
-            || *context_end != '\0') {
-        /* fully parsed */
-        connstamp (cerr, connection) << "unrecognized web context #" << url[2] << endl;
-        rc = -EINVAL;
-        goto out;
-    }
-    context_command = url[3];
-
-    it = contexts.find (webapi_ctx);
-    if (it == contexts.end ()) {
-        connstamp (cerr, connection) << "unknown web context #" << webapi_ctx << endl;
-        rc = PM_ERR_NOCONTEXT;
-        goto out;
-    }
-
-    c = it->second;
-    assert (c != NULL);
     /* Process HTTP Basic userid/password, if supplied.  Both returned strings
        need to be free(3)'d later.  */
     if (c->userid != "" || __pmServerHasFeature(PM_SERVER_FEATURE_CREDS_REQD)) {
@@ -1746,8 +1816,8 @@ pmwebapi_respond (struct MHD_Connection *connection, const http_params & params,
         c->expires += c->mypolltimeout;
     }
 
-    /* Switch to this context for subsequent operations. */
-    /* if-multithreaded: watch out. */
+    /* Switch to this context for subsequent operations; the PMAPI
+       current context is per-thread. */
     if (c->context < 0)
 	c->context = pmNewContext(PM_CONTEXT_HOST, c->spec.c_str());
     else
@@ -1788,3 +1858,76 @@ pmwebapi_respond (struct MHD_Connection *connection, const http_params & params,
 out:
     return mhd_notify_error (connection, rc);
 }
+
+
+int
+pmwebapi_respond (struct MHD_Connection *connection, const http_params & params,
+                  const vector <string> &url)
+{
+    /* We emit CORS header for all successful json replies, namely:
+       Access-Control-Access-Origin: *
+       https://developer.mozilla.org/en-US/docs/HTTP/Access_control_CORS */
+
+    /* NB: url is already edited to remove the /pmapi/ prefix. */
+    unsigned long webapi_ctx;
+    struct webcontext *c;
+    char *context_end;
+    string context_command;
+    int rc = 0;
+    context_shard *shard;
+    context_map::iterator it;
+
+    /* Decode the calls to the web API. */
+    /* -------------------------------------------------------------------- */
+    /* context creation */
+    if (new_contexts_p &&		/* permitted */
+            (url.size () == 3 && url[2] == "context")) {
+        return pmwebapi_respond_new_context (connection, params);
+    }
+
+    /* -------------------------------------------------------------------- */
+    /* All other calls use $CTX/command, so we parse $CTX
+       generally and map it to the webcontext* */
+    if (url.size () != 4) {
+	connstamp (cerr, connection) << "url.size() " << url.size() << " not 4, url[2]=" << url[2] << ", new_contexts_p=" << new_contexts_p << endl;
+        rc = -EINVAL;
+        goto out;
+    }
+
+    errno = 0;
+    webapi_ctx = strtoul (url[2].c_str (), &context_end, 10);	/* matches %d above */
+    if (errno != 0 || webapi_ctx <= 0	/* range check, plus string-nonemptyness check */
+            || webapi_ctx > INT_MAX	/* matches random() loop above */
+            || *context_end != '\0') {
+        /* fully parsed */
+        connstamp (cerr, connection) << "unrecognized web context #" << url[2] << endl;
+        rc = -EINVAL;
+        goto out;
+    }
+    context_command = url[3];
+
+    shard = context_shard_of (webapi_ctx);
+    context_read_lock (shard);
+    it = shard->contexts.find (webapi_ctx);
+    if (it == shard->contexts.end ()) {
+        context_unlock (shard);
+        connstamp (cerr, connection) << "unknown web context #" << webapi_ctx << endl;
+        rc = PM_ERR_NOCONTEXT;
+        goto out;
+    }
+
+    c = it->second;
+    assert (c != NULL);
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock (& c->lock);
+#endif
+    rc = pmwebapi_respond_context (connection, params, c, webapi_ctx, context_command);
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock (& c->lock);
+#endif
+    context_unlock (shard);
+    return rc;
+
+out:
+    return mhd_notify_error (connection, rc);
+}
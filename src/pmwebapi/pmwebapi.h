@@ -66,7 +66,7 @@ extern int dumpstats;                           /* set by -d option */
 extern unsigned verbosity;			/* set by -v option */
 extern unsigned permissive;			/* set by -P option */
 extern unsigned new_contexts_p;		/* cleared by -N option */
-extern unsigned exit_p;			/* counted by SIG* handler */
+extern volatile sig_atomic_t exit_p;	/* set by SIG* handler, polled by all threads */
 extern unsigned maxtimeout;			/* set by -t option */
 extern unsigned multithread;			/* set by -M option */
 extern unsigned graphite_timestep;              /* set by -i option */
@@ -111,6 +111,7 @@ pmgraphite_respond (struct MHD_Connection *connection, const http_params &,
 #endif
 
 extern void ac_refresh_all(struct MHD_Connection *connection);
+extern void pmgraphite_shutdown(void);
 
 
 // util.cxx
@@ -38,14 +38,14 @@ using namespace std;
 ostream & timestamp (ostream & o)
 {
     time_t now;
+    char buf[32];
     time (&now);
-    char *now2 = ctime (&now);
+    char *now2 = ctime_r (&now, buf);
     if (now2) {
         now2[19] = '\0';		// overwrite \n
     }
 
     return o << "[" << (now2 ? now2 : "") << "] " << pmGetProgname() << "(" << getpid () << "): ";
-    // NB: we're single-threaded; no point printing out a thread-id too
 }
 
 